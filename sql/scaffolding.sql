@@ -60,6 +60,7 @@ grant usage on schema prism to prism;
 \i sprocs/stratcon.map_uuid_to_sid.sql
 \i sprocs/stratcon.update_config.sql
 \i sprocs/stratcon.rollup_metric_numeric.sql
+\i sprocs/stratcon.store_metric_numeric_rollup.sql
 \i sprocs/stratcon.metric_name_summary_compile_fts_data.sql
 \i sprocs/stratcon.rollup_metric_numeric.sql
 
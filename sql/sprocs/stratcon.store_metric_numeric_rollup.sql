@@ -0,0 +1,62 @@
+-- Stores finalized rollup rows computed by stratcon itself.  Each element
+-- of the arrays is one (sid, name, rollup_time) row of the given rollup and
+-- is written into its span segment exactly as stratcon.rollup_metric_numeric
+-- would write it.
+
+CREATE OR REPLACE FUNCTION stratcon.store_metric_numeric_rollup
+(in_roll text, in_sid integer[], in_name text[], in_rollup_time int8[],
+ in_count_rows integer[], in_avg_value numeric[], in_counter_dev numeric[])
+RETURNS int AS $$
+DECLARE
+    v_segment       stratcon.metric_numeric_rollup%rowtype;
+    v_conf          RECORD;
+    v_sql           TEXT;
+    v_stored_rollup INTEGER;
+    v_stored_rollup_tm TIMESTAMPTZ;
+    v_offset        INTEGER;
+    v_count         INTEGER;
+    v_i             INTEGER;
+BEGIN
+    SELECT * FROM metric_numeric_rollup_config WHERE rollup = in_roll INTO v_conf;
+    IF NOT FOUND THEN
+        RAISE EXCEPTION 'Given rollup name is invalid! [%]', in_roll;
+    END IF;
+    IF in_sid IS NULL THEN
+        RETURN 0;
+    END IF;
+
+    FOR v_i IN array_lower(in_sid, 1) .. array_upper(in_sid, 1) LOOP
+        v_stored_rollup    := floor( in_rollup_time[v_i] / v_conf.span ) * v_conf.span;
+        v_stored_rollup_tm := 'epoch'::timestamptz + v_stored_rollup * '1 second'::interval;
+        v_offset           := floor( ( in_rollup_time[v_i] - v_stored_rollup) / v_conf.seconds );
+
+        v_sql := 'SELECT * FROM metric_numeric_rollup_'||in_roll||' WHERE rollup_time = $1 and sid = $2 and name = $3';
+        EXECUTE v_sql INTO v_segment USING v_stored_rollup_tm, in_sid[v_i], in_name[v_i];
+        GET DIAGNOSTICS v_count = ROW_COUNT;
+        IF v_count = 0 THEN
+            v_segment := stratcon.init_metric_numeric_rollup( in_roll );
+        END IF;
+
+        v_segment.count_rows[v_offset]  := in_count_rows[v_i];
+        v_segment.avg_value[v_offset]   := in_avg_value[v_i];
+        v_segment.counter_dev[v_offset] := in_counter_dev[v_i];
+
+        IF v_count = 0 THEN
+            v_sql := 'INSERT INTO metric_numeric_rollup_'||in_roll||' (sid,name,rollup_time,count_rows,avg_value,counter_dev)
+                VALUES ($1,$2,$3,$4,$5,$6)';
+            EXECUTE v_sql USING in_sid[v_i], in_name[v_i], v_stored_rollup_tm, v_segment.count_rows, v_segment.avg_value, v_segment.counter_dev;
+        ELSE
+            v_sql := 'UPDATE metric_numeric_rollup_'||in_roll;
+            v_sql := v_sql || ' SET (count_rows,avg_value,counter_dev) = ($1,$2,$3)';
+            v_sql := v_sql || ' WHERE rollup_time = $4  AND sid = $5 AND name = $6';
+            EXECUTE v_sql USING v_segment.count_rows, v_segment.avg_value, v_segment.counter_dev, v_stored_rollup_tm, in_sid[v_i], in_name[v_i];
+        END IF;
+    END LOOP;
+
+    RETURN array_upper(in_sid, 1) - array_lower(in_sid, 1) + 1;
+END
+$$ LANGUAGE plpgsql
+SECURITY DEFINER
+;
+
+GRANT EXECUTE ON FUNCTION stratcon.store_metric_numeric_rollup(text, integer[], text[], int8[], integer[], numeric[], numeric[]) TO stratcon;
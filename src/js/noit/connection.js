@@ -82,7 +82,7 @@ nc.prototype.request = function(ext, payload, cb) {
     var data = '';
     var cert = req.connection.getPeerCertificate();
     res.on('data', function(d) { data = data + d; });
-    res.on('end', function() { cb(res.statusCode, data); });
+    res.on('end', function() { cb(res.statusCode, data, res.headers); });
   });
   req.on('error', function(err) { cb(500, err); });
   if(payload && payload.length) req.write(payload);
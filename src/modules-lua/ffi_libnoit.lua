@@ -93,6 +93,7 @@ typedef struct {
 } noit_numeric_rollup_accu;
 
 void noit_metric_rollup_accumulate_numeric(noit_numeric_rollup_accu* accumulator, noit_metric_value_t* value);
+void noit_metric_rollup_accumulate_numeric_batch(noit_numeric_rollup_accu* accumulator, noit_metric_type_t type, const uint64_t *whence_ms, const void *values, size_t nvalues);
 
 ]]
 return ffi.load("libnoit") 
@@ -301,6 +301,24 @@ function get_absolute_path(uri)
     return toReturn
 end
 
+function extract_metrics(check, extract, output, pcre_match_limit)
+    local exre = mtev.pcre(extract)
+    local rv = true
+    local m, key, value = nil, nil, nil
+    local extracted = {}
+    while rv and m ~= '' do
+      rv, m, key, value = exre(output or '', { limit = pcre_match_limit })
+      if rv and key ~= nil then
+        if value ~= nil then extracted[key] = value
+        else
+          extracted[key] = nil
+          check.metric(key, value)
+        end
+      end
+    end
+    check.metrics_bulk(extracted)
+end
+
 function initiate(module, check)
     local config = check.interpolate(check.config)
     local url = config.url or 'http:///'
@@ -542,15 +560,7 @@ function initiate(module, check)
     check.metric_int32("bytes", client.content_bytes)
 
     if config.extract ~= nil then
-      local exre = mtev.pcre(config.extract)
-      local rv = true
-      local m = nil
-      while rv and m ~= '' do
-        rv, m, key, value = exre(output or '', { limit = pcre_match_limit })
-        if rv and key ~= nil then
-          check.metric(key, value)
-        end
-      end
+      extract_metrics(check, config.extract, output, pcre_match_limit)
     end
 
     -- check body
@@ -48,6 +48,7 @@
 #include "noit_check.h"
 #include "noit_check_tools.h"
 #include "noit_mtev_bridge.h"
+#include "noit_udp.h"
 
 
 static mtev_log_stream_t nlerr = NULL;
@@ -59,15 +60,24 @@ typedef struct _mod_config {
   mtev_hash_table *options;
   mtev_boolean support_notifications;
   mtev_boolean asynch_metrics;
-  int ipv4_fd;
-  int ipv6_fd;
 } collectd_mod_config_t;
 
-typedef struct collectd_closure_s {
+/* A check's security settings.  Packets are decoded once per distinct
+ * set of these, so checks hold a reference rather than reading their
+ * config for every datagram; check_updated swaps in a fresh copy.
+ */
+typedef struct collectd_security_s {
+  uint32_t refcnt;
+  int security_level;
   char *username;
   char *secret;
-  int security_level;
-  EVP_CIPHER_CTX ctx; 
+  unsigned char aes_key[32];
+} collectd_security_t;
+
+static pthread_mutex_t collectd_security_lock = PTHREAD_MUTEX_INITIALIZER;
+
+typedef struct collectd_closure_s {
+  collectd_security_t *sec;
   int stats_count;
   int ntfy_count;
 } collectd_closure_t;
@@ -388,6 +398,43 @@ typedef struct receive_list_entry_s receive_list_entry_t;
  *
  */
 
+/* What a datagram decodes to, to be applied to each check from the source */
+typedef struct {
+  mtev_boolean is_notification;
+  union {
+    value_list_t vl;
+    notification_t n;
+  } u;
+} collectd_record_t;
+
+typedef struct {
+  collectd_security_t *sec;
+  EVP_CIPHER_CTX ctx;
+  collectd_record_t *records;
+  int nrecords;
+  int allocd;
+} collectd_decoded_t;
+
+static collectd_record_t *
+collectd_decoded_add(collectd_decoded_t *dec) {
+  if(dec->nrecords == dec->allocd) {
+    dec->allocd = dec->allocd ? dec->allocd * 2 : 8;
+    dec->records = realloc(dec->records, dec->allocd * sizeof(*dec->records));
+  }
+  return &dec->records[dec->nrecords++];
+}
+
+static void
+collectd_decoded_reset(collectd_decoded_t *dec) {
+  int i;
+  for(i=0; i<dec->nrecords; i++) {
+    if(dec->records[i].is_notification) continue;
+    free(dec->records[i].u.vl.values);
+    free(dec->records[i].u.vl.types);
+  }
+  dec->nrecords = 0;
+}
+
 static uint64_t collectd_ntohll (uint64_t n)
 {
 #if BYTE_ORDER == BIG_ENDIAN
@@ -427,30 +474,21 @@ static int queue_notifications(collectd_closure_t *ccl,
   noit_module_t *self, noit_check_t *check, notification_t *n);
 
 
-static EVP_CIPHER_CTX* network_get_aes256_cypher (collectd_closure_t *ccl, /* {{{ */
+static EVP_CIPHER_CTX* network_get_aes256_cypher (collectd_decoded_t *dec, /* {{{ */
     const void *iv, size_t iv_size, const char *username)
 {
 
-  if (ccl->secret == NULL)
+  if (dec->sec->secret == NULL)
     return (NULL);
   else
   {
     EVP_CIPHER_CTX *ctx_ptr;
-    EVP_MD_CTX ctx_md;
-    unsigned char password_hash[32];
-    unsigned int length = 0;
     int success;
 
-    ctx_ptr = &ccl->ctx;
-
-    EVP_DigestInit(&ctx_md, EVP_sha256());
-    EVP_DigestUpdate(&ctx_md, ccl->secret, strlen(ccl->secret));
-    EVP_DigestFinal(&ctx_md, password_hash, &length); 
-    EVP_MD_CTX_cleanup(&ctx_md);
-
-    mtevAssert(length <= 32);
+    ctx_ptr = &dec->ctx;
 
-    success = EVP_DecryptInit(ctx_ptr, EVP_aes_256_ofb(), password_hash, iv);
+    /* aes_key is the SHA-256 of the secret, see collectd_security_load */
+    success = EVP_DecryptInit(ctx_ptr, EVP_aes_256_ofb(), dec->sec->aes_key, iv);
     if (success != 1)
     {
       mtevL(nlerr, "collectd: EVP_DecryptInit returned: %d\n",
@@ -706,13 +744,12 @@ static int parse_part_string (void **ret_buffer, size_t *ret_buffer_len,
 
 
 // Forward declare
-static int parse_packet (
-    collectd_closure_t *ccl, noit_module_t *self, noit_check_t *check, 
+static int parse_packet (collectd_decoded_t *dec,
     void *buffer, size_t buffer_size, int flags);
 
 
-static int parse_part_sign_sha256 (collectd_closure_t *ccl, noit_module_t *self, 
-    noit_check_t *check, void **ret_buffer, size_t *ret_buffer_len, int flags)
+static int parse_part_sign_sha256 (collectd_decoded_t *dec,
+    void **ret_buffer, size_t *ret_buffer_len, int flags)
 {
   unsigned char *buffer;
   size_t buffer_len;
@@ -730,14 +767,14 @@ static int parse_part_sign_sha256 (collectd_closure_t *ccl, noit_module_t *self,
   buffer_len = *ret_buffer_len;
   buffer_offset = 0;
 
-  if (ccl->username == NULL)
+  if (dec->sec->username == NULL)
   {
     mtevL(nldeb, "collectd: Received signed network packet but can't verify "
         "it because no user has been configured. Will accept it.\n");
     return (0);
   }
 
-  if (ccl->secret == NULL)
+  if (dec->sec->secret == NULL)
   {
     mtevL(nldeb, "collectd: Received signed network packet but can't verify "
         "it because no secret has been configured. Will accept it.\n");
@@ -777,15 +814,15 @@ static int parse_part_sign_sha256 (collectd_closure_t *ccl, noit_module_t *self,
   mtevAssert (buffer_offset == pss_head_length);
 
   /* Match up the username with the expected username */
-  if (strcmp(ccl->username, pss.username) != 0)
+  if (strcmp(dec->sec->username, pss.username) != 0)
   {
-    mtevL(nlerr, "collectd: User: %s and Given User: %s don't match\n", ccl->username, pss.username);
+    mtevL(nlerr, "collectd: User: %s and Given User: %s don't match\n", dec->sec->username, pss.username);
     sfree (pss.username);
     return (-ENOENT);
   }
 
   /* Create a hash device and check the HMAC */
-  hash_ptr = HMAC(EVP_sha256(), ccl->secret, strlen(ccl->secret),
+  hash_ptr = HMAC(EVP_sha256(), dec->sec->secret, strlen(dec->sec->secret),
       buffer     + PART_SIGNATURE_SHA256_SIZE,
       buffer_len - PART_SIGNATURE_SHA256_SIZE,
       hash,         &length);
@@ -806,7 +843,7 @@ static int parse_part_sign_sha256 (collectd_closure_t *ccl, noit_module_t *self,
   }
   else
   {
-    parse_packet (ccl, self, check, buffer + buffer_offset, buffer_len - buffer_offset,
+    parse_packet (dec, buffer + buffer_offset, buffer_len - buffer_offset,
         flags | PP_SIGNED);
   }
 
@@ -817,9 +854,8 @@ static int parse_part_sign_sha256 (collectd_closure_t *ccl, noit_module_t *self,
 } /* }}} int parse_part_sign_sha256 */
 /* #endif HAVE_LIBGCRYPT */
 
-static int parse_part_encr_aes256 (collectd_closure_t *ccl, noit_module_t *self, 
-    noit_check_t *check, void **ret_buffer, size_t *ret_buffer_len,
-    int flags)
+static int parse_part_encr_aes256 (collectd_decoded_t *dec,
+    void **ret_buffer, size_t *ret_buffer_len, int flags)
 {
   unsigned char  *buffer = *ret_buffer;
   size_t buffer_len = *ret_buffer_len;
@@ -888,14 +924,15 @@ static int parse_part_encr_aes256 (collectd_closure_t *ccl, noit_module_t *self,
         PART_ENCRYPTION_AES256_SIZE - sizeof (pea.hash)));
 
   /* Match up the username with the expected username */
-  if (strcmp(ccl->username, pea.username) != 0)
+  if (dec->sec->username == NULL ||
+      strcmp(dec->sec->username, pea.username) != 0)
   {
     mtevL(nlerr, "collectd: Username received and server side username don't match\n");
     sfree (pea.username);
     return (-ENOENT);
   }
 
-  ctx = network_get_aes256_cypher (ccl, pea.iv, sizeof (pea.iv),
+  ctx = network_get_aes256_cypher (dec, pea.iv, sizeof (pea.iv),
       pea.username);
   if (ctx == NULL)
     return (-1);
@@ -938,7 +975,7 @@ static int parse_part_encr_aes256 (collectd_closure_t *ccl, noit_module_t *self,
     return (-1);
   }
 
-  parse_packet (ccl, self, check, buffer + buffer_offset, payload_len,
+  parse_packet (dec, buffer + buffer_offset, payload_len,
       flags | PP_ENCRYPTED);
 
   /* Update return values */
@@ -954,8 +991,7 @@ static int parse_part_encr_aes256 (collectd_closure_t *ccl, noit_module_t *self,
 
 
 static int parse_packet (/* {{{ */
-    collectd_closure_t *ccl, noit_module_t *self, noit_check_t *check,
-    void *buffer, size_t buffer_size, int flags)
+    collectd_decoded_t *dec, void *buffer, size_t buffer_size, int flags)
 {
   int status;
 
@@ -996,7 +1032,7 @@ static int parse_packet (/* {{{ */
 
     if (pkg_type == TYPE_ENCR_AES256)
     {
-      status = parse_part_encr_aes256 (ccl, self, check,
+      status = parse_part_encr_aes256 (dec,
           &buffer, &buffer_size, flags);
       if (status != 0)
       {
@@ -1006,7 +1042,7 @@ static int parse_packet (/* {{{ */
         break;
       }
     }
-    else if ((ccl->security_level == SECURITY_LEVEL_ENCRYPT)
+    else if ((dec->sec->security_level == SECURITY_LEVEL_ENCRYPT)
         && (packet_was_encrypted == 0))
     {
       if (printed_ignore_warning == 0)
@@ -1020,7 +1056,7 @@ static int parse_packet (/* {{{ */
     }
     else if (pkg_type == TYPE_SIGN_SHA256)
     {
-      status = parse_part_sign_sha256 (ccl, self, check,
+      status = parse_part_sign_sha256 (dec,
                                         &buffer, &buffer_size, flags);
       if (status != 0)
       {
@@ -1030,7 +1066,7 @@ static int parse_packet (/* {{{ */
         break;
       }
     }
-    else if ((ccl->security_level == SECURITY_LEVEL_SIGN)
+    else if ((dec->sec->security_level == SECURITY_LEVEL_SIGN)
         && (packet_was_encrypted == 0)
         && (packet_was_signed == 0))
     {
@@ -1055,7 +1091,12 @@ static int parse_packet (/* {{{ */
           (strlen (vl.plugin) > 0) &&
           (strlen (vl.type) > 0))
       {
-        queue_values(ccl, self, check, &vl);
+        /* the record takes ownership of values and types */
+        collectd_record_t *rec = collectd_decoded_add(dec);
+        rec->is_notification = mtev_false;
+        rec->u.vl = vl;
+        vl.values = NULL;
+        vl.types = NULL;
       }
       else
       {
@@ -1178,7 +1219,9 @@ static int parse_packet (/* {{{ */
       }
       else
       {
-        queue_notifications(ccl, self, check, &n);
+        collectd_record_t *rec = collectd_decoded_add(dec);
+        rec->is_notification = mtev_true;
+        rec->u.n = n;
         mtevL(nlerr, "collectd: "
             "DISPATCH NOTIFICATION\n");
       }
@@ -1394,130 +1437,294 @@ collectd_submit(noit_module_t *self, noit_check_t *check,
   return collectd_submit_internal(self, check, cause, mtev_false);
 }
 
+static const char *
+collectd_setting(collectd_mod_config_t *conf, noit_check_t *check,
+                 const char *key) {
+  const char *v = NULL;
+  if(!mtev_hash_retr_str(check->config, key, strlen(key), &v))
+    (void)mtev_hash_retr_str(conf->options, key, strlen(key), &v);
+  return v;
+}
+
+static collectd_security_t *
+collectd_security_load(collectd_mod_config_t *conf, noit_check_t *check) {
+  const char *v;
+  collectd_security_t *sec = calloc(1, sizeof(*sec));
+  sec->refcnt = 1;
+  // Default to NONE
+  sec->security_level = SECURITY_LEVEL_NONE;
+  if(NULL != (v = collectd_setting(conf, check, "security_level")))
+    sec->security_level = atoi(v);
+  if(NULL != (v = collectd_setting(conf, check, "username")))
+    sec->username = strdup(v);
+  if(NULL != (v = collectd_setting(conf, check, "secret"))) {
+    EVP_MD_CTX ctx_md;
+    unsigned int length = 0;
+    sec->secret = strdup(v);
+    EVP_DigestInit(&ctx_md, EVP_sha256());
+    EVP_DigestUpdate(&ctx_md, sec->secret, strlen(sec->secret));
+    EVP_DigestFinal(&ctx_md, sec->aes_key, &length);
+    EVP_MD_CTX_cleanup(&ctx_md);
+    mtevAssert(length <= sizeof(sec->aes_key));
+  }
+  return sec;
+}
+
+static void
+collectd_security_release(collectd_security_t *sec) {
+  uint32_t left;
+  if(!sec) return;
+  pthread_mutex_lock(&collectd_security_lock);
+  left = --sec->refcnt;
+  pthread_mutex_unlock(&collectd_security_lock);
+  if(left) return;
+  free(sec->username);
+  free(sec->secret);
+  free(sec);
+}
+
+static mtev_boolean
+collectd_security_same(const collectd_security_t *a,
+                       const collectd_security_t *b) {
+#define SAME_STR(x, y) (((x) == NULL && (y) == NULL) || \
+                        ((x) && (y) && !strcmp((x), (y))))
+  return a->security_level == b->security_level &&
+         SAME_STR(a->username, b->username) &&
+         SAME_STR(a->secret, b->secret);
+#undef SAME_STR
+}
+
+/* Returns a referenced copy of the check's security settings, loading
+ * them on first use; release it with collectd_security_release.
+ */
+static collectd_security_t *
+collectd_security_get(collectd_mod_config_t *conf, noit_check_t *check) {
+  collectd_closure_t *ccl;
+  collectd_security_t *sec, *fresh = NULL;
+
+  pthread_mutex_lock(&collectd_security_lock);
+  if(check->closure == NULL)
+    check->closure = calloc(1, sizeof(collectd_closure_t));
+  ccl = check->closure;
+  sec = ccl->sec;
+  if(sec) sec->refcnt++;
+  pthread_mutex_unlock(&collectd_security_lock);
+  if(sec) return sec;
+
+  fresh = collectd_security_load(conf, check);
+  pthread_mutex_lock(&collectd_security_lock);
+  if(ccl->sec == NULL) {
+    ccl->sec = fresh;
+    fresh = NULL;
+  }
+  sec = ccl->sec;
+  sec->refcnt++;
+  pthread_mutex_unlock(&collectd_security_lock);
+  collectd_security_release(fresh);
+  return sec;
+}
+
+static mtev_hook_return_t
+collectd_check_updated(void *closure, noit_check_t *check) {
+  noit_module_t *self = closure;
+  collectd_closure_t *ccl;
+  collectd_security_t *fresh, *old;
+
+  if(strcmp(check->module, "collectd") || check->closure == NULL)
+    return MTEV_HOOK_CONTINUE;
+  fresh = collectd_security_load(noit_module_get_userdata(self), check);
+  pthread_mutex_lock(&collectd_security_lock);
+  ccl = check->closure;
+  old = ccl->sec;
+  ccl->sec = fresh;
+  pthread_mutex_unlock(&collectd_security_lock);
+  collectd_security_release(old);
+  return MTEV_HOOK_CONTINUE;
+}
+
+static void
+noit_collectd_cleanup(noit_module_t *self, noit_check_t *check) {
+  collectd_closure_t *ccl = check->closure;
+  collectd_security_t *sec;
+  if(!ccl) return;
+  pthread_mutex_lock(&collectd_security_lock);
+  sec = ccl->sec;
+  ccl->sec = NULL;
+  pthread_mutex_unlock(&collectd_security_lock);
+  collectd_security_release(sec);
+}
+
+static mtev_boolean
+collectd_security_usable(const collectd_security_t *sec) {
+  if(!sec->username) {
+    if (sec->security_level == SECURITY_LEVEL_ENCRYPT) {
+      mtevL(nlerr, "collectd: no username defined for check.\n");
+      return mtev_false;
+    } else if (sec->security_level == SECURITY_LEVEL_SIGN) {
+      mtevL(nlerr, "collectd: no username defined for check, "
+          "will accept any signed packet.\n");
+    }
+  }
+  if(!sec->secret) {
+    if (sec->security_level == SECURITY_LEVEL_ENCRYPT) {
+      mtevL(nlerr, "collectd: no secret defined for check.\n");
+      return mtev_false;
+    }
+    else if (sec->security_level == SECURITY_LEVEL_SIGN) {
+      mtevL(nlerr, "collectd: no secret defined for check, "
+          "will accept any signed packet.\n");
+    }
+  }
+  return mtev_true;
+}
+
+/* A datagram is verified, decrypted and parsed once for each distinct set
+ * of security settings among the checks it is for (almost always once)
+ * and the resulting values are then applied to each of those checks.
+ */
+#define COLLECTD_MAX_DECODES 4
 struct collectd_pkt {
   noit_module_t *self;  /* which collect load context */
   char *payload;
   int len;
+  char *scratch;
+  collectd_decoded_t decodes[COLLECTD_MAX_DECODES];
+  int ndecodes;
+  noit_check_t **checks;
+  int nchecks, checks_allocd;
 };
 
+static collectd_decoded_t *
+collectd_pkt_decode(struct collectd_pkt *pkt, collectd_security_t *sec) {
+  collectd_decoded_t *dec = NULL;
+  int i;
+  for(i=0; i<pkt->ndecodes; i++)
+    if(collectd_security_same(pkt->decodes[i].sec, sec))
+      return &pkt->decodes[i];
+  if(pkt->ndecodes < COLLECTD_MAX_DECODES) dec = &pkt->decodes[pkt->ndecodes++];
+  else {
+    /* more distinct settings than we keep; recycle the last slot */
+    dec = &pkt->decodes[COLLECTD_MAX_DECODES-1];
+    collectd_decoded_reset(dec);
+    collectd_security_release(dec->sec);
+  }
+  pthread_mutex_lock(&collectd_security_lock);
+  sec->refcnt++;
+  pthread_mutex_unlock(&collectd_security_lock);
+  dec->sec = sec;
+  /* decryption happens in place, so each decode gets a fresh copy */
+  if(!pkt->scratch) pkt->scratch = malloc(pkt->len);
+  memcpy(pkt->scratch, pkt->payload, pkt->len);
+  parse_packet(dec, pkt->scratch, pkt->len, 0);
+  return dec;
+}
+
+static void
+collectd_pkt_done(struct collectd_pkt *pkt) {
+  int i;
+  for(i=0; i<pkt->ndecodes; i++) {
+    collectd_decoded_reset(&pkt->decodes[i]);
+    EVP_CIPHER_CTX_cleanup(&pkt->decodes[i].ctx);
+    collectd_security_release(pkt->decodes[i].sec);
+    pkt->decodes[i].sec = NULL;
+  }
+  pkt->ndecodes = 0;
+  pkt->nchecks = 0;
+}
+
 static int
 push_packet_at_check(noit_check_t *check, void *closure) {
   struct collectd_pkt *pkt = closure;
   collectd_closure_t *ccl;
-  char *security_buffer; 
+  collectd_security_t *sec;
+  collectd_decoded_t *dec;
   collectd_mod_config_t *conf;
+  int i;
   conf = noit_module_get_userdata(pkt->self);
 
   /* We need a check, and a collectd one at that */
   if (!check || strcmp(check->module, "collectd")) return 0;
 
-  // If its a new check retrieve some values
-  if (check->closure == NULL) {
-    // TODO: Verify if it could somehow retrieve data before the check closure exists 
-    ccl = check->closure = (void *)calloc(1, sizeof(collectd_closure_t)); 
-    memset(ccl, 0, sizeof(collectd_closure_t));
-  } else {
-    ccl = (collectd_closure_t*)check->closure;
-  }
-  // Default to NONE
-  ccl->security_level = SECURITY_LEVEL_NONE;
-  if (mtev_hash_retr_str(check->config, "security_level", strlen("security_level"),
-                         (const char**)&security_buffer) ||
-      mtev_hash_retr_str(conf->options, "security_level", strlen("security_level"),
-                         (const char**)&security_buffer))
-  {
-    ccl->security_level = atoi(security_buffer);
+  sec = collectd_security_get(conf, check);
+  if(!collectd_security_usable(sec)) {
+    collectd_security_release(sec);
+    return 0;
   }
+  dec = collectd_pkt_decode(pkt, sec);
+  collectd_security_release(sec);
 
-  // Is this outside to keep updates happening?
-  if (!mtev_hash_retr_str(check->config, "username", strlen("username"),
-                         (const char**)&ccl->username) &&
-      !mtev_hash_retr_str(conf->options, "username", strlen("username"),
-                         (const char**)&ccl->username)) 
-  {
-    if (ccl->security_level == SECURITY_LEVEL_ENCRYPT) {
-      mtevL(nlerr, "collectd: no username defined for check.\n");
-      return 0;
-    } else if (ccl->security_level == SECURITY_LEVEL_SIGN) {
-      mtevL(nlerr, "collectd: no username defined for check, "
-          "will accept any signed packet.\n");
-    }
+  ccl = check->closure;
+  for(i=0; i<dec->nrecords; i++) {
+    if(dec->records[i].is_notification)
+      queue_notifications(ccl, pkt->self, check, &dec->records[i].u.n);
+    else
+      queue_values(ccl, pkt->self, check, &dec->records[i].u.vl);
   }
+  return 1;
+}
 
-  if(!ccl->secret)
-    (void)mtev_hash_retr_str(check->config, "secret", strlen("secret"),
-                       (const char**)&ccl->secret);
-  if(!ccl->secret)
-    (void)mtev_hash_retr_str(conf->options, "secret", strlen("secret"),
-                       (const char**)&ccl->secret);
-  if(!ccl->secret) {
-    if (ccl->security_level == SECURITY_LEVEL_ENCRYPT) {
-      mtevL(nlerr, "collectd: no secret defined for check.\n");
-      return 0;
-    }
-    else if (ccl->security_level == SECURITY_LEVEL_SIGN) {
-      mtevL(nlerr, "collectd: no secret defined for check, "
-          "will accept any signed packet.\n");
-    }
+static int
+collect_target_check(noit_check_t *check, void *closure) {
+  struct collectd_pkt *pkt = closure;
+  if(pkt->nchecks == pkt->checks_allocd) {
+    pkt->checks_allocd = pkt->checks_allocd ? pkt->checks_allocd * 2 : 16;
+    pkt->checks = realloc(pkt->checks,
+                          pkt->checks_allocd * sizeof(*pkt->checks));
   }
-
-  parse_packet(ccl, pkt->self, check, pkt->payload, pkt->len, 0);
+  pkt->checks[pkt->nchecks++] = check;
   return 1;
 }
 
 static int noit_collectd_handler(eventer_t e, int mask, void *closure,
                              struct timeval *now) {
-  union {
-    struct sockaddr_in  skaddr;
-    struct sockaddr_in6 skaddr6;
-  } remote;
-  char packet[1500];
-  int packet_len = sizeof(packet);
-  unsigned int from_len;
-  char ip_p[INET6_ADDRSTRLEN];
-  noit_module_t *self = (noit_module_t *)closure;
-
-  // Get the username and password of the string
+  noit_udp_receiver_t *rx = (noit_udp_receiver_t *)closure;
+  noit_module_t *self = noit_udp_receiver_closure(rx);
+  struct collectd_pkt pkt;
+  int d;
 
+  memset(&pkt, 0, sizeof(pkt));
+  pkt.self = self;
   while(1) {
-    struct collectd_pkt pkt;
-    int inlen, check_cnt;
-
-    from_len = sizeof(remote);
+    noit_udp_packet_t *pkts;
+    int i, npkts;
 
-    inlen = recvfrom(eventer_get_fd(e), packet, packet_len, 0,
-                     (struct sockaddr *)&remote, &from_len);
+    npkts = noit_udp_receiver_recv(rx, eventer_get_fd(e), &pkts);
     mtev_gettimeofday(now, NULL); /* set it, as we care about accuracy */
 
-    if(inlen < 0) {
-      if(errno == EAGAIN || errno == EINTR) break;
-      mtevLT(nlerr, now, "collectd: recvfrom: %s\n", strerror(errno));
+    if(npkts <= 0) {
+      if(npkts < 0 && errno != EINTR)
+        mtevLT(nlerr, now, "collectd: recv: %s\n", strerror(errno));
       break;
     }
-    if (from_len == sizeof(remote.skaddr)) {
-      if (!inet_ntop(AF_INET, &(remote.skaddr.sin_addr), ip_p, INET_ADDRSTRLEN)) {
-        mtevLT(nlerr, now, "collectd: inet_ntop failed: %s\n", strerror(errno));
-        break;
+    for(i=0; i<npkts; i++) {
+      noit_check_t **checks;
+      int j, nchecks, check_cnt = 0;
+
+      if(!*pkts[i].ip) {
+        mtevLT(nlerr, now, "collectd: could not determine address family of remote\n");
+        continue;
       }
-    }
-    else if(from_len == sizeof(remote.skaddr6)) {
-      if (!inet_ntop(AF_INET6, &(remote.skaddr6.sin6_addr), ip_p, INET6_ADDRSTRLEN)) {
-        mtevLT(nlerr, now, "collectd: inet_ntop failed: %s\n", strerror(errno));
-        break;
+      pkt.payload = pkts[i].payload;
+      pkt.len = pkts[i].len;
+      free(pkt.scratch);
+      pkt.scratch = NULL;
+      checks = pkts[i].checks;
+      nchecks = pkts[i].nchecks;
+      if(pkts[i].checks_truncated) {
+        noit_poller_target_ip_do(pkts[i].ip, collect_target_check, &pkt);
+        checks = pkt.checks;
+        nchecks = pkt.nchecks;
       }
+      for(j=0; j<nchecks; j++)
+        check_cnt += push_packet_at_check(checks[j], &pkt);
+      collectd_pkt_done(&pkt);
+      if(check_cnt == 0)
+        mtevL(nlerr, "collectd: No defined check from ip [%s].\n", pkts[i].ip);
     }
-    else {
-      mtevLT(nlerr, now, "collectd: could not determine address family of remote\n");
-      break;
-    }
-
-    pkt.self = self;
-    pkt.payload = packet;
-    pkt.len = inlen;
-    check_cnt = noit_poller_target_ip_do(ip_p, push_packet_at_check ,&pkt);
-    if(check_cnt == 0)
-      mtevL(nlerr, "collectd: No defined check from ip [%s].\n", ip_p);
   }
+  free(pkt.scratch);
+  free(pkt.checks);
+  for(d=0; d<COLLECTD_MAX_DECODES; d++) free(pkt.decodes[d].records);
   return EVENTER_READ | EVENTER_EXCEPTION;
 }
 
@@ -2143,10 +2350,9 @@ rest_collectd_handler(mtev_http_rest_closure_t *restc,
 
 static int noit_collectd_init(noit_module_t *self) {
   const char *config_val;
-  int sockaddr_len;
   collectd_mod_config_t *conf;
   conf = noit_module_get_userdata(self);
-  int portint = 0;
+  int portint = 0, listeners = 1, batch_size = 32;
   struct sockaddr_in skaddr;
   struct sockaddr_in6 skaddr6;
   struct in6_addr in6addr_any;
@@ -2185,76 +2391,34 @@ static int noit_collectd_init(noit_module_t *self) {
 
   port = (unsigned short) portint;
 
-  conf->ipv4_fd = conf->ipv6_fd = -1;
+  if(mtev_hash_retr_str(conf->options,
+                         "listeners", strlen("listeners"),
+                         (const char**)&config_val))
+    listeners = atoi(config_val);
+  if(mtev_hash_retr_str(conf->options,
+                         "batch_size", strlen("batch_size"),
+                         (const char**)&config_val))
+    batch_size = atoi(config_val);
 
-  conf->ipv4_fd = socket(PF_INET, NE_SOCK_CLOEXEC|SOCK_DGRAM, IPPROTO_UDP);
-  if(conf->ipv4_fd < 0) {
-    mtevL(nlerr, "collectd: socket failed: %s\n",
-          strerror(errno));
-  }
-  else {
-    if(eventer_set_fd_nonblocking(conf->ipv4_fd)) {
-      close(conf->ipv4_fd);
-      conf->ipv4_fd = -1;
-      mtevL(nlerr,
-            "collectd: could not set socket non-blocking: %s\n",
-            strerror(errno));
-    }
-  }
   memset(&skaddr, 0, sizeof(skaddr));
   skaddr.sin_family = AF_INET;
   skaddr.sin_addr.s_addr = htonl(INADDR_ANY);
   skaddr.sin_port = htons(port);
+  if(noit_udp_listen("collectd/ipv4", self->hdr.name,
+                     (struct sockaddr *)&skaddr, sizeof(skaddr),
+                     listeners, batch_size, 1500,
+                     noit_collectd_handler, self) == 0)
+    mtevL(nlerr, "collectd: could not listen on %s:%d\n", host, port);
 
-  sockaddr_len = sizeof(skaddr);
-  if(conf->ipv4_fd >= 0) {
-    if(bind(conf->ipv4_fd, (struct sockaddr *)&skaddr, sockaddr_len) < 0) {
-      mtevL(nlerr, "collectd: bind failed[%s]: %s\n", host, strerror(errno));
-      close(conf->ipv4_fd);
-      conf->ipv4_fd = -1;
-    }
-  }
-
-  if(conf->ipv4_fd >= 0) {
-    eventer_t newe;
-    newe = eventer_alloc_fd(noit_collectd_handler, self, conf->ipv4_fd,
-                            EVENTER_READ | EVENTER_EXCEPTION);
-    eventer_add(newe);
-  }
-
-  conf->ipv6_fd = socket(AF_INET6, NE_SOCK_CLOEXEC|SOCK_DGRAM, IPPROTO_UDP);
-  if(conf->ipv6_fd < 0) {
-    mtevL(nlerr, "collectd: IPv6 socket failed: %s\n",
-          strerror(errno));
-  }
-  else {
-    if(eventer_set_fd_nonblocking(conf->ipv6_fd)) {
-      close(conf->ipv6_fd);
-      conf->ipv6_fd = -1;
-      mtevL(nlerr,
-            "collectd: could not set socket non-blocking: %s\n",
-               strerror(errno));
-    }
-  }
-  sockaddr_len = sizeof(skaddr6);
   memset(&skaddr6, 0, sizeof(skaddr6));
   skaddr6.sin6_family = AF_INET6;
   skaddr6.sin6_addr = in6addr_any;
   skaddr6.sin6_port = htons(port);
-
-  if(conf->ipv6_fd >= 0 &&
-     bind(conf->ipv6_fd, (struct sockaddr *)&skaddr6, sockaddr_len) < 0) {
-    mtevL(nlerr, "collectd: bind(IPv6) failed[%s]: %s\n", host, strerror(errno));
-    close(conf->ipv6_fd);
-    conf->ipv6_fd = -1;
-  }
-
-  if(conf->ipv6_fd >= 0) {
-    eventer_t newe;
-    newe = eventer_alloc_fd(noit_collectd_handler, self, conf->ipv6_fd,
-                            EVENTER_READ | EVENTER_EXCEPTION);
-    eventer_add(newe);
-  }
+  if(noit_udp_listen("collectd/ipv6", self->hdr.name,
+                     (struct sockaddr *)&skaddr6, sizeof(skaddr6),
+                     listeners, batch_size, 1500,
+                     noit_collectd_handler, self) == 0)
+    mtevL(nlerr, "collectd: could not listen on IPv6 %s:%d\n", host, port);
 
   noit_module_set_userdata(self, conf);
 
@@ -2263,6 +2427,7 @@ static int noit_collectd_init(noit_module_t *self) {
                           "^collectd/?(.*)$",
                           rest_collectd_handler);
   global_collectd = self;
+  check_updated_hook_register("collectd", collectd_check_updated, self);
   return 0;
 }
 
@@ -2279,6 +2444,6 @@ noit_module_t collectd = {
   noit_collectd_config,
   noit_collectd_init,
   noit_collectd_initiate_check,
-  NULL, /* noit_collectd_cleanup */
+  noit_collectd_cleanup,
   .thread_unsafe = 1
 };
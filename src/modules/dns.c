@@ -42,7 +42,6 @@
 #include <udns.h>
 
 #include <mtev_log.h>
-#include <mtev_atomic.h>
 
 #include "noit_mtev_bridge.h"
 #include "noit_module.h"
@@ -51,10 +50,13 @@
 
 #define MAX_RR 256
 #define DEFAULT_MAX_CONTEXTS 1024
+/* unreferenced contexts are kept this long for reuse before closing */
+#define DNS_CTX_IDLE_SECONDS 60
 
 typedef struct _mod_config {
   mtev_hash_table *options;
   int contexts;
+  mtev_boolean coalesce;
 } dns_mod_config_t;
 
 static void dns_module_eventer_dns_utm_fn(struct dns_ctx *, int, void *);
@@ -64,36 +66,93 @@ static void register_console_dns_commands();
 static mtev_log_stream_t nlerr = NULL;
 static mtev_log_stream_t nldeb = NULL;
 
-static mtev_hash_table active_events;
 static mtev_hash_table dns_rtypes;
 static mtev_hash_table dns_ctypes;
-static mtev_hash_table dns_ctx_store;
-static pthread_mutex_t dns_ctx_store_lock;
+
+/* udns contexts are not thread-safe, so each eventer thread that runs dns
+ * checks keeps its own shard of contexts and of in-flight queries.  All
+ * events for a shard's contexts and queries are owned by that thread; the
+ * shard lock only guards the context table against "show dns_module".
+ */
+typedef struct dns_shard {
+  pthread_t owner;
+  pthread_mutex_t lock;
+  mtev_hash_table ctx_store;  /* ns:port:slot -> dns_ctx_handle_t */
+  mtev_hash_table inflight;   /* question -> dns_inflight_t */
+  int contexts;               /* per nameserver, this shard's share */
+  unsigned int next_slot;
+  time_t last_reap;
+  uint64_t queries;           /* sent on the wire */
+  uint64_t coalesced;         /* answered by another check's query */
+  struct dns_shard *next;
+} dns_shard_t;
+
+static pthread_mutex_t dns_shards_lock = PTHREAD_MUTEX_INITIALIZER;
+static dns_shard_t *dns_shards = NULL;
+static __thread dns_shard_t *my_shard = NULL;
+
 typedef struct dns_ctx_handle {
   char *ns; /* name server */
   char *hkey; /* hash key - ns plus the port number */
   struct dns_ctx *ctx;  
-  mtev_atomic32_t refcnt;
+  int refcnt;
+  time_t idle_since;
+  dns_shard_t *shard;
   eventer_t e; /* evetner handling UDP traffic */
   eventer_t timeout; /* the timeout managed by libudns */
 } dns_ctx_handle_t;
 
+/* One outbound query and the checks waiting on its answer. */
+typedef struct dns_inflight {
+  char *key;
+  int klen;
+  dns_shard_t *shard;
+  dns_ctx_handle_t *h;
+  struct dns_query *q;
+  struct dns_check_info *waiters;
+  int submitting;
+  int done;
+} dns_inflight_t;
+
 static int cstring_cmp(const void *a, const void *b) {
   return strcmp(*((const char **)a), *((const char **)b));
 }
 
-static dns_ctx_handle_t *default_ctx_handle = NULL;
+static dns_shard_t *dns_module_my_shard(noit_module_t *self) {
+  dns_mod_config_t *conf;
+  dns_shard_t *s;
+  if(my_shard) return my_shard;
+  conf = noit_module_get_userdata(self);
+  s = calloc(1, sizeof(*s));
+  s->owner = pthread_self();
+  pthread_mutex_init(&s->lock, NULL);
+  mtev_hash_init(&s->ctx_store);
+  mtev_hash_init(&s->inflight);
+  s->contexts = conf->contexts / eventer_loop_concurrency();
+  if(s->contexts < 1) s->contexts = 1;
+  pthread_mutex_lock(&dns_shards_lock);
+  s->next = dns_shards;
+  dns_shards = s;
+  pthread_mutex_unlock(&dns_shards_lock);
+  my_shard = s;
+  return s;
+}
+
 static void dns_module_dns_ctx_handle_free(void *vh) {
   dns_ctx_handle_t *h = vh;
+  mtevAssert(h->timeout == NULL);
+  if(h->e) {
+    eventer_t e = eventer_remove_fde(h->e);
+    if(e) eventer_free(e);
+  }
   free(h->ns);
   free(h->hkey);
   dns_close(h->ctx);
   dns_free(h->ctx);
-  mtevAssert(h->timeout == NULL);
   free(h);
 }
 static void dns_module_dns_ctx_acquire(dns_ctx_handle_t *h) {
-  mtev_atomic_inc32(&h->refcnt);
+  h->refcnt++;
 }
 static void
 dns_debug_wrap(int code, const struct sockaddr *sa, unsigned salen,
@@ -101,103 +160,100 @@ dns_debug_wrap(int code, const struct sockaddr *sa, unsigned salen,
                const struct dns_query *q, void *data) {
   mtevL(nldeb, "dns code -> %d\n", code);
 }
+/* Close contexts that nobody has used for a while. */
+static void dns_module_shard_reap(dns_shard_t *s, time_t now) {
+  mtev_hash_iter iter = MTEV_HASH_ITER_ZERO;
+  dns_ctx_handle_t *idle[64];
+  const char *k;
+  int i, klen, nidle = 0;
+  void *vh;
+
+  if(now - s->last_reap < DNS_CTX_IDLE_SECONDS / 4) return;
+  s->last_reap = now;
+  pthread_mutex_lock(&s->lock);
+  while(nidle < (int)(sizeof(idle)/sizeof(*idle)) &&
+        mtev_hash_next(&s->ctx_store, &iter, &k, &klen, &vh)) {
+    dns_ctx_handle_t *h = vh;
+    if(h->refcnt == 0 && now - h->idle_since > DNS_CTX_IDLE_SECONDS)
+      idle[nidle++] = h;
+  }
+  for(i=0; i<nidle; i++)
+    mtev_hash_delete(&s->ctx_store, idle[i]->hkey, strlen(idle[i]->hkey),
+                     NULL, NULL);
+  pthread_mutex_unlock(&s->lock);
+  for(i=0; i<nidle; i++) dns_module_dns_ctx_handle_free(idle[i]);
+}
 static dns_ctx_handle_t *dns_module_dns_ctx_alloc(noit_module_t *self, const char *ns, int port) {
   void *vh;
-  char *hk = NULL;
-  dns_mod_config_t *conf = noit_module_get_userdata(self);
-  int randkey = random() % conf->contexts;
+  char hk[1100];
+  int hklen;
+  dns_shard_t *s = dns_module_my_shard(self);
   dns_ctx_handle_t *h = NULL;
+  int failed = 0;
   if(ns && *ns == '\0') ns = NULL;
-  pthread_mutex_lock(&dns_ctx_store_lock);
-  if(ns == NULL && default_ctx_handle != NULL) {
-    /* special case -- default context */
-    h = default_ctx_handle;
-    dns_module_dns_ctx_acquire(h);
-    goto bail;
-  }
 
-  if (ns != NULL) {
-    int len = snprintf(NULL, 0, "%s:%d:%d", ns, port, randkey); 
-    hk = (char *)malloc(len+1);
-    snprintf(hk, len+1, "%s:%d:%d", ns, port, randkey);
-  }
+  dns_module_shard_reap(s, time(NULL));
+  /* The default resolver gets a single context per shard */
+  if(ns == NULL) hklen = snprintf(hk, sizeof(hk), "::0");
+  else hklen = snprintf(hk, sizeof(hk), "%s:%d:%u", ns, port,
+                        s->next_slot++ % s->contexts);
+  if(hklen < 0 || hklen >= (int)sizeof(hk)) return NULL;
 
-  if(ns &&
-     mtev_hash_retrieve(&dns_ctx_store, hk, strlen(hk), &vh)) {
+  if(mtev_hash_retrieve(&s->ctx_store, hk, hklen, &vh)) {
     h = (dns_ctx_handle_t *)vh;
     dns_module_dns_ctx_acquire(h);
-    free(hk);
+    return h;
   }
-  else {
-    int failed = 0;
-    h = calloc(1, sizeof(*h));
-    h->ns = ns ? strdup(ns) : NULL;
-    h->ctx = dns_new(NULL);
-    if(dns_init(h->ctx, 0) != 0) {
-      mtevL(nlerr, "dns_init failed\n");
+
+  h = calloc(1, sizeof(*h));
+  h->ns = ns ? strdup(ns) : NULL;
+  h->shard = s;
+  h->ctx = dns_new(NULL);
+  if(dns_init(h->ctx, 0) != 0) {
+    mtevL(nlerr, "dns_init failed\n");
+    failed++;
+  }
+  dns_set_dbgfn(h->ctx, dns_debug_wrap);
+  if(ns) {
+    if(dns_add_serv(h->ctx, NULL) < 0) {
+      mtevL(nlerr, "dns_add_serv(NULL) failed\n");
       failed++;
     }
-    dns_set_dbgfn(h->ctx, dns_debug_wrap);
-    if(ns) {
-      if(dns_add_serv(h->ctx, NULL) < 0) {
-        mtevL(nlerr, "dns_add_serv(NULL) failed\n");
-        failed++;
-      }
-      if(dns_add_serv(h->ctx, ns) < 0) {
-        mtevL(nlerr, "dns_add_serv(%s) failed\n", ns);
-        failed++;
-      }
-    }
-    if(port && port != DNS_PORT) {
-      dns_set_opt(h->ctx, DNS_OPT_PORT, port);
-    }
-    if(dns_open(h->ctx) < 0) {
-      mtevL(nlerr, "dns_open failed\n");
+    if(dns_add_serv(h->ctx, ns) < 0) {
+      mtevL(nlerr, "dns_add_serv(%s) failed\n", ns);
       failed++;
     }
-    if(failed) {
-      free(h->ns);
-      dns_free(h->ctx);
-      free(h);
-      free(hk);
-      h = NULL;
-      goto bail;
-    }
-    h->hkey = hk;
-    dns_set_tmcbck(h->ctx, dns_module_eventer_dns_utm_fn, h);
-    h->e = eventer_alloc_fd(dns_module_eventer_callback, h, dns_sock(h->ctx),
-                            EVENTER_READ | EVENTER_EXCEPTION);
-    eventer_add(h->e);
-    h->refcnt = 1;
-    if(!ns)
-      default_ctx_handle = h;
-    else
-      mtev_hash_store(&dns_ctx_store, h->hkey, strlen(h->hkey), h);
-  }
- bail:
-  pthread_mutex_unlock(&dns_ctx_store_lock);
-  return h;
-}
-static int dns_module_dns_ctx_release(dns_ctx_handle_t *h) {
-  int rv = 0, last;
-  if(h->ns == NULL) {
-    /* Special case for the default */
-    mtev_atomic_dec32(&h->refcnt);
-    return rv;
   }
-  pthread_mutex_lock(&dns_ctx_store_lock);
-  last = mtev_atomic_dec32(&h->refcnt);
-  if(last == 0) {
-    /* I was the last one */
-    mtevAssert(mtev_hash_delete(&dns_ctx_store, h->hkey, strlen(h->hkey),
-                            NULL, dns_module_dns_ctx_handle_free));
-    rv = 1;
+  if(port && port != DNS_PORT) {
+    dns_set_opt(h->ctx, DNS_OPT_PORT, port);
+  }
+  if(dns_open(h->ctx) < 0) {
+    mtevL(nlerr, "dns_open failed\n");
+    failed++;
   }
-  pthread_mutex_unlock(&dns_ctx_store_lock);
-  return rv;
+  if(failed) {
+    free(h->ns);
+    dns_free(h->ctx);
+    free(h);
+    return NULL;
+  }
+  h->hkey = strdup(hk);
+  dns_set_tmcbck(h->ctx, dns_module_eventer_dns_utm_fn, h);
+  h->e = eventer_alloc_fd(dns_module_eventer_callback, h, dns_sock(h->ctx),
+                          EVENTER_READ | EVENTER_EXCEPTION);
+  eventer_set_owner(h->e, s->owner);
+  eventer_add(h->e);
+  h->refcnt = 1;
+  pthread_mutex_lock(&s->lock);
+  mtev_hash_store(&s->ctx_store, h->hkey, hklen, h);
+  pthread_mutex_unlock(&s->lock);
+  return h;
+}
+/* Contexts stay in their shard when released; idle ones are reaped. */
+static void dns_module_dns_ctx_release(dns_ctx_handle_t *h) {
+  mtevAssert(h->refcnt > 0);
+  if(--h->refcnt == 0) h->idle_since = time(NULL);
 }
-
-static pthread_mutex_t active_events_lock;
 
 typedef struct dns_check_info {
   int timed_out;
@@ -208,6 +264,9 @@ typedef struct dns_check_info {
   char *error;
   int nrr;
   int sort;
+  int active;
+  dns_inflight_t *inflight;
+  struct dns_check_info *next_waiter;
 
   /* These make up the query itself */
   unsigned char dn[DNS_MAXDN];
@@ -216,26 +275,13 @@ typedef struct dns_check_info {
 } dns_check_info_t;
 
 static int __isactive_ci(struct dns_check_info *ci) {
-  void *u;
-  int exists = 0;
-  pthread_mutex_lock(&active_events_lock);
-  if(mtev_hash_retrieve(&active_events, (void *)&ci, sizeof(ci), &u))
-    exists = 1;
-  pthread_mutex_unlock(&active_events_lock);
-  return exists;
+  return ci->active;
 }
 static void __activate_ci(struct dns_check_info *ci) {
-  struct dns_check_info **holder;
-  holder = calloc(1, sizeof(*holder));
-  *holder = ci;
-  pthread_mutex_lock(&active_events_lock);
-  mtevAssert(mtev_hash_store(&active_events, (void *)holder, sizeof(*holder), ci));
-  pthread_mutex_unlock(&active_events_lock);
+  ci->active = 1;
 }
 static void __deactivate_ci(struct dns_check_info *ci) {
-  pthread_mutex_lock(&active_events_lock);
-  mtevAssert(mtev_hash_delete(&active_events, (void *)&ci, sizeof(ci), free, NULL));
-  pthread_mutex_unlock(&active_events_lock);
+  ci->active = 0;
   ci->check->flags &= ~NP_RUNNING;
   if(ci->h != NULL) {
     dns_module_dns_ctx_release(ci->h);
@@ -243,6 +289,48 @@ static void __deactivate_ci(struct dns_check_info *ci) {
   }
 }
 
+/* The question is the server (ns and port), class, type and name. */
+static int dns_inflight_key(char *key, int len, const char *ns, int port,
+                            struct dns_check_info *ci) {
+  int nslen = ns ? strlen(ns) : 0;
+  int dnlen = dns_dnlen(ci->dn);
+  int need = 3 * sizeof(int) + nslen + 1 + dnlen;
+  int hdr[3];
+  if(need > len) return -1;
+  hdr[0] = port;
+  hdr[1] = ci->query_ctype;
+  hdr[2] = ci->query_rtype;
+  memcpy(key, hdr, sizeof(hdr));
+  if(nslen) memcpy(key + sizeof(hdr), ns, nslen);
+  key[sizeof(hdr) + nslen] = '\0';
+  memcpy(key + sizeof(hdr) + nslen + 1, ci->dn, dnlen);
+  return need;
+}
+static void dns_inflight_detach(dns_inflight_t *inf,
+                                struct dns_check_info *ci) {
+  struct dns_check_info **p;
+  for(p = &inf->waiters; *p; p = &(*p)->next_waiter) {
+    if(*p == ci) {
+      *p = ci->next_waiter;
+      break;
+    }
+  }
+  ci->next_waiter = NULL;
+  ci->inflight = NULL;
+}
+/* The query is answered or abandoned: forget it and drop its context. */
+static void dns_inflight_finish(dns_inflight_t *inf) {
+  if(inf->key)
+    mtev_hash_delete(&inf->shard->inflight, inf->key, inf->klen, NULL, NULL);
+  free(inf->key);
+  inf->key = NULL;
+  inf->q = NULL;
+  if(inf->h) dns_module_dns_ctx_release(inf->h);
+  inf->h = NULL;
+  inf->done = 1;
+  if(!inf->submitting) free(inf);
+}
+
 static void dns_check_log_results(struct dns_check_info *ci) {
   struct timeval duration, now;
   double rtt;
@@ -354,19 +442,34 @@ noit_console_show_dns(mtev_console_closure_t ncct,
                       int argc, char **argv,
                       mtev_console_state_t *dstate,
                       void *closure) {
-  mtev_hash_iter iter = MTEV_HASH_ITER_ZERO;
-  uuid_t key_id;
-  int klen;
-  void *vts;
-
-  pthread_mutex_lock(&dns_ctx_store_lock);
-  while(mtev_hash_next(&dns_ctx_store, &iter,
-                       (const char **)key_id, &klen,
-                       &vts)) {
-    dns_ctx_handle_t *h = vts;
-    nc_printf_dns_handle_brief(ncct, h);
+  dns_shard_t *s;
+  uint64_t queries = 0, coalesced = 0;
+
+  pthread_mutex_lock(&dns_shards_lock);
+  for(s = dns_shards; s; s = s->next) {
+    mtev_hash_iter iter = MTEV_HASH_ITER_ZERO;
+    const char *k;
+    int klen;
+    void *vts;
+    uint64_t q = s->queries, c = s->coalesced;
+
+    nc_printf(ncct, "==== shard %p ====\n", (void *)(uintptr_t)s->owner);
+    nc_printf(ncct, " queries: %llu\n coalesced: %llu (%.1f%%)\n",
+              (unsigned long long)q, (unsigned long long)c,
+              (q + c) ? 100.0 * c / (q + c) : 0.0);
+    queries += q;
+    coalesced += c;
+    pthread_mutex_lock(&s->lock);
+    while(mtev_hash_next(&s->ctx_store, &iter, &k, &klen, &vts)) {
+      dns_ctx_handle_t *h = vts;
+      nc_printf_dns_handle_brief(ncct, h);
+    }
+    pthread_mutex_unlock(&s->lock);
   }
-  pthread_mutex_unlock(&dns_ctx_store_lock);
+  pthread_mutex_unlock(&dns_shards_lock);
+  nc_printf(ncct, "== total ==\n queries: %llu\n coalesced: %llu (%.1f%%)\n",
+            (unsigned long long)queries, (unsigned long long)coalesced,
+            (queries + coalesced) ? 100.0 * coalesced / (queries + coalesced) : 0.0);
   return 0;
 }
 
@@ -391,12 +494,8 @@ static int dns_module_init(noit_module_t *self) {
 
   conf = noit_module_get_userdata(self);
 
-  mtev_hash_init(&active_events);
   mtev_hash_init(&dns_rtypes);
   mtev_hash_init(&dns_ctypes);
-  mtev_hash_init(&dns_ctx_store);
-  pthread_mutex_init(&dns_ctx_store_lock, NULL);
-  pthread_mutex_init(&active_events_lock, NULL);
 
   conf->contexts = DEFAULT_MAX_CONTEXTS;
   if(mtev_hash_retr_str(conf->options,
@@ -406,6 +505,13 @@ static int dns_module_init(noit_module_t *self) {
     if (conf->contexts <= 0)
       conf->contexts = DEFAULT_MAX_CONTEXTS;
   }
+  conf->coalesce = mtev_true;
+  if(mtev_hash_retr_str(conf->options,
+                         "coalesce", strlen("coalesce"),
+                         (const char**)&config_val)) {
+    if(!strcasecmp(config_val, "false") || !strcasecmp(config_val, "off"))
+      conf->coalesce = mtev_false;
+  }
   /* HASH the rr types */
   for(i=0, nv = &dns_typetab[i]; nv->name; nv = &dns_typetab[++i])
     mtev_hash_store(&dns_rtypes,
@@ -426,11 +532,13 @@ static int dns_module_init(noit_module_t *self) {
     mtevL(nlerr, "Unable to initialize dns subsystem\n");
     return -1;
   }
-  dns_free(pctx);
-  if(dns_module_dns_ctx_alloc(self, NULL, 0) == NULL) {
+  if(dns_init(pctx, 0) != 0 || dns_open(pctx) < 0) {
     mtevL(nlerr, "Error setting up default dns resolver context.\n");
+    dns_free(pctx);
     return -1;
   }
+  dns_close(pctx);
+  dns_free(pctx);
   register_console_dns_commands();
   return 0;
 }
@@ -443,18 +551,24 @@ static int dns_module_eventer_callback(eventer_t e, int mask, void *closure,
   dns_ctx_handle_t *h = closure;
   dns_module_dns_ctx_acquire(h);
   dns_ioevent(h->ctx, now->tv_sec);
-  if(dns_module_dns_ctx_release(h)) {
-    /* We've been closed */
-    return 0;
-  }
+  dns_module_dns_ctx_release(h);
   return EVENTER_READ | EVENTER_EXCEPTION;
 }
 
 static int dns_module_check_timeout(eventer_t e, int mask, void *closure,
                                     struct timeval *now) {
   struct dns_check_info *ci;
+  dns_inflight_t *inf;
   ci = closure;
   ci->timeout_event = NULL;
+  /* Stop waiting; if nobody else is, the query itself can go */
+  if((inf = ci->inflight) != NULL) {
+    dns_inflight_detach(inf, ci);
+    if(inf->waiters == NULL) {
+      if(inf->q) dns_cancel(inf->h->ctx, inf->q);
+      dns_inflight_finish(inf);
+    }
+  }
   dns_check_log_results(ci);
   __deactivate_ci(ci);
   return 0;
@@ -479,6 +593,7 @@ static void dns_module_eventer_dns_utm_fn(struct dns_ctx *ctx,
     if(h->timeout) e = eventer_remove(h->timeout);
     if(timeout > 0) {
       newe = eventer_in_s_us(dns_module_invoke_timeouts, h, timeout, 0);
+      eventer_set_owner(newe, h->shard->owner);
     }
   }
   if(e) {
@@ -630,10 +745,11 @@ static void decode_rr(struct dns_check_info *ci, struct dns_parse *p,
   return;
 }
 
-static void dns_cb(struct dns_ctx *ctx, void *result, void *data) {
-  int r = dns_status(ctx);
+/* Record the answer (or error r) to ci's question; result may be shared
+ * by several checks and is not modified. */
+static void dns_check_process_result(struct dns_check_info *ci,
+                                     const unsigned char *result, int r) {
   int len, i;
-  struct dns_check_info *ci = data;
   struct dns_parse p;
   struct dns_rr rr;
   unsigned nrr;
@@ -643,10 +759,7 @@ static void dns_cb(struct dns_ctx *ctx, void *result, void *data) {
   char *result_combined = NULL;
 
   /* If out ci isn't active, we must have timed out already */
-  if(!__isactive_ci(ci)) {
-    if(result) free(result);
-    return;
-  }
+  if(!__isactive_ci(ci)) return;
 
   ci->timed_out = 0;
   /* If we don't have a result, explode */
@@ -719,7 +832,6 @@ static void dns_cb(struct dns_ctx *ctx, void *result, void *data) {
   noit_stats_set_metric(ci->check, "answer", METRIC_STRING, result_combined);
 
  cleanup:
-  if(result) free(result);
   if(ci->timeout_event) {
     eventer_t e = eventer_remove(ci->timeout_event);
     ci->timeout_event = NULL;
@@ -729,6 +841,21 @@ static void dns_cb(struct dns_ctx *ctx, void *result, void *data) {
   __deactivate_ci(ci);
 }
 
+static void dns_cb(struct dns_ctx *ctx, void *result, void *data) {
+  int r = dns_status(ctx);
+  dns_inflight_t *inf = data;
+  struct dns_check_info *ci;
+
+  /* answer everyone who asked; the query is done either way */
+  inf->q = NULL;
+  while((ci = inf->waiters) != NULL) {
+    dns_inflight_detach(inf, ci);
+    dns_check_process_result(ci, result, r);
+  }
+  if(result) free(result);
+  dns_inflight_finish(inf);
+}
+
 static int dns_check_send(noit_module_t *self, noit_check_t *check,
                           noit_check_t *cause) {
   void *vnv_pair = NULL;
@@ -819,19 +946,7 @@ static int dns_check_send(noit_module_t *self, noit_check_t *check,
         query ? query : "null", ctype, rtype);
 
   __activate_ci(ci);
-  /* If this ci has a handle and it isn't the one we need,
-   * we should release it
-   */
-  if(ci->h &&
-     ((ci->h->ns == NULL && nameserver != NULL) ||
-      (ci->h->ns != NULL && nameserver == NULL) ||
-      (ci->h->ns && strcmp(ci->h->ns, nameserver)))) {
-    dns_module_dns_ctx_release(ci->h);
-    ci->h = NULL;
-  }
-  /* use the cached one, unless we don't have one */
-  if(!ci->h) ci->h = dns_module_dns_ctx_alloc(self, nameserver, port);
-  if(!ci->h) ci->error = strdup("bad nameserver");
+  if(nameserver && *nameserver == '\0') nameserver = NULL;
 
   /* Lookup out class */
   if(!mtev_hash_retrieve(&dns_ctypes, ctype, strlen(ctype),
@@ -855,15 +970,63 @@ static int dns_check_send(noit_module_t *self, noit_check_t *check,
   }
 
   if(!ci->error) {
-    /* Submit the query */
-    int abs;
-    if(!dns_ptodn(query, strlen(query), ci->dn, sizeof(ci->dn), &abs) ||
-       !dns_submit_dn(ci->h->ctx, ci->dn, ci->query_ctype, ci->query_rtype,
-                      abs | DNS_NOSRCH, NULL, dns_cb, ci)) {
+    dns_mod_config_t *conf = noit_module_get_userdata(self);
+    dns_shard_t *shard = dns_module_my_shard(self);
+    dns_inflight_t *inf = NULL;
+    char key[3 * sizeof(int) + sizeof(interpolated_nameserver) + DNS_MAXDN];
+    int abs, klen = -1;
+    void *vinf;
+
+    if(!dns_ptodn(query, strlen(query), ci->dn, sizeof(ci->dn), &abs))
       ci->error = strdup("submission error");
+    else if(conf->coalesce)
+      klen = dns_inflight_key(key, sizeof(key), nameserver, port, ci);
+
+    /* Someone is already asking this: wait for their answer */
+    if(klen > 0 &&
+       mtev_hash_retrieve(&shard->inflight, key, klen, &vinf)) {
+      inf = vinf;
+      ci->h = inf->h;
+      dns_module_dns_ctx_acquire(ci->h);
+      ci->inflight = inf;
+      ci->next_waiter = inf->waiters;
+      inf->waiters = ci;
+      shard->coalesced++;
     }
-    else {
-      dns_timeouts(ci->h->ctx, -1, now.tv_sec);
+    else if(!ci->error) {
+      ci->h = dns_module_dns_ctx_alloc(self, nameserver, port);
+      if(!ci->h) ci->error = strdup("bad nameserver");
+    }
+    if(!ci->error && !ci->inflight) {
+      struct dns_query *q;
+      inf = calloc(1, sizeof(*inf));
+      inf->shard = shard;
+      inf->h = ci->h;
+      dns_module_dns_ctx_acquire(inf->h);
+      inf->waiters = ci;
+      ci->inflight = inf;
+      if(klen > 0) {
+        inf->key = malloc(klen);
+        memcpy(inf->key, key, klen);
+        inf->klen = klen;
+        mtev_hash_store(&shard->inflight, inf->key, inf->klen, inf);
+      }
+      /* udns may answer (or fail) before dns_submit_dn returns */
+      inf->submitting = 1;
+      q = dns_submit_dn(ci->h->ctx, ci->dn, ci->query_ctype, ci->query_rtype,
+                        abs | DNS_NOSRCH, NULL, dns_cb, inf);
+      inf->submitting = 0;
+      if(inf->done) free(inf);
+      else if(!q) {
+        dns_inflight_detach(inf, ci);
+        dns_inflight_finish(inf);
+        ci->error = strdup("submission error");
+      }
+      else {
+        inf->q = q;
+        shard->queries++;
+        dns_timeouts(ci->h->ctx, -1, now.tv_sec);
+      }
     }
   }
 
@@ -881,6 +1044,7 @@ static int dns_check_send(noit_module_t *self, noit_check_t *check,
   p_int.tv_sec = check->timeout / 1000;
   p_int.tv_usec = (check->timeout % 1000) * 1000;
   newe = eventer_in(dns_module_check_timeout, ci, p_int);
+  eventer_set_owner(newe, pthread_self());
   ci->timeout_event = newe;
   eventer_add(newe);
 
@@ -38,6 +38,9 @@
 #include <netdb.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <signal.h>
+#include <spawn.h>
+#include <limits.h>
 #include <sys/uio.h>
 #ifdef HAVE_SYS_WAIT_H
 #include <sys/wait.h>
@@ -50,8 +53,9 @@
 #endif
 #include <pcre.h>
 
-#include <mtev_security.h>
+#include <mtev_conf.h>
 
+#include "noit_config.h"
 #include "noit_module.h"
 #include "noit_check.h"
 #include "noit_check_tools.h"
@@ -85,6 +89,8 @@ struct check_info {
   char *error;
   pcre *matcher;
   eventer_t timeout_event;
+  int helper;
+  struct timeval dispatched;
 };
 
 typedef struct external_closure {
@@ -144,8 +150,8 @@ static void external_log_results(noit_module_t *self, noit_check_t *check) {
   data = noit_module_get_userdata(self);
   ci = (struct check_info *)check->closure;
 
-  mtevL(data->nldeb, "external(%s) (error: %d, exit: %x)\n",
-        check->target, ci->errortype, ci->exit_code);
+  mtevL(data->nldeb, "external(%s) (error: %d, exit: %x, helper: %d)\n",
+        check->target, ci->errortype, ci->exit_code, ci->helper);
 
   mtev_gettimeofday(&now, NULL);
   sub_timeval(now, check->last_fire_time, &duration);
@@ -184,6 +190,20 @@ static void external_log_results(noit_module_t *self, noit_check_t *check) {
   }
 #endif
 
+  /* Time spent waiting for a helper vs. time spent running */
+  if(data->report_timing && ci->dispatched.tv_sec) {
+    struct timeval diff;
+    int32_t ms;
+    sub_timeval(ci->dispatched, check->last_fire_time, &diff);
+    ms = diff.tv_sec * 1000 + diff.tv_usec / 1000;
+    noit_stats_set_metric(check, "queue_wait", METRIC_INT32, &ms);
+    if(!ci->errortype) {
+      sub_timeval(now, ci->dispatched, &diff);
+      ms = diff.tv_sec * 1000 + diff.tv_usec / 1000;
+      noit_stats_set_metric(check, "run_time", METRIC_INT32, &ms);
+    }
+  }
+
   /* Hack the output into metrics */
   if(ci->output && ci->type == EXTERNAL_JSON_TYPE) {
     int len, cnt;
@@ -327,9 +347,74 @@ static void check_info_clean(struct check_info *ci) {
   if(ci->matcher) pcre_free(ci->matcher);
   memset(ci, 0, sizeof(*ci));
 }
+extern char **environ;
+
+static int external_helper_start(external_data_t *, external_helper_t *);
+static int external_helper_restart(eventer_t e, int mask,
+                                   void *closure, struct timeval *now) {
+  external_helper_t *h = (external_helper_t *)closure;
+  external_data_t *data = noit_module_get_userdata(h->self);
+  struct timeval when;
+
+  if(external_helper_start(data, h) != 0) {
+    mtev_gettimeofday(&when, NULL);
+    when.tv_sec += 1;
+    eventer_add(eventer_alloc_timer(external_helper_restart, h, &when));
+  }
+  return 0;
+}
+/* Reap a helper we have killed without waiting for it on the eventer */
+static int external_helper_reap(eventer_t e, int mask,
+                                void *closure, struct timeval *now) {
+  pid_t pid = (pid_t)(intptr_t)closure;
+  int status;
+  if(waitpid(pid, &status, WNOHANG) == 0)
+    eventer_add_in_s_us(external_helper_reap, closure, 0, 100000);
+  return 0;
+}
+static int external_helper_down(external_helper_t *h, eventer_t e) {
+  external_data_t *data = noit_module_get_userdata(h->self);
+  struct timeval when;
+  int mask;
+
+  mtevL(noit_error, "external helper %d (pid %d) terminated, restarting.\n",
+        h->idx, h->child);
+  pthread_mutex_lock(&data->pool_lock);
+  h->dead = mtev_true;
+  pthread_mutex_unlock(&data->pool_lock);
+
+  /* anything it was running will time out */
+  pthread_mutex_lock(&h->wlock);
+  close(h->pipe_n2e[1]);
+  h->pipe_n2e[1] = -1;
+  pthread_mutex_unlock(&h->wlock);
+  eventer_remove_fde(e);
+  eventer_close(e, &mask);
+  h->pipe_e2n[0] = -1;
+  /* We also get here on protocol errors, with the helper still running */
+  if(h->child > 0) {
+    (void)kill(h->child, SIGKILL);
+    external_helper_reap(NULL, 0, (void *)(intptr_t)h->child, NULL);
+  }
+  if(h->cr) {
+    free(h->cr->stdoutbuff);
+    free(h->cr->stderrbuff);
+    free(h->cr);
+    h->cr = NULL;
+  }
+
+  /* Don't spin on a helper that can't stay up */
+  if(time(NULL) - h->started < 1 || external_helper_start(data, h) != 0) {
+    mtev_gettimeofday(&when, NULL);
+    when.tv_sec += 1;
+    eventer_add(eventer_alloc_timer(external_helper_restart, h, &when));
+  }
+  return 0;
+}
 static int external_handler(eventer_t e, int mask,
                             void *closure, struct timeval *now) {
-  noit_module_t *self = (noit_module_t *)closure;
+  external_helper_t *helper = (external_helper_t *)closure;
+  noit_module_t *self = (noit_module_t *)helper->self;
   external_data_t *data;
 
   data = noit_module_get_userdata(self);
@@ -340,7 +425,7 @@ static int external_handler(eventer_t e, int mask,
     void *vci;
     int ret;
 
-    if(!data->cr) {
+    if(!helper->cr) {
       struct external_response r;
       external_header h;
 
@@ -384,68 +469,73 @@ static int external_handler(eventer_t e, int mask,
       r.stdout_truncated = h.stdout_truncated;
       r.stderr_truncated = h.stderr_truncated;
       r.stdoutlen = h.stdoutlen;
-      data->cr = calloc(sizeof(*data->cr), 1);
-      memset(data->cr, 0, sizeof(*data->cr));
-      memcpy(data->cr, &r, sizeof(r));
-      data->cr->stdoutbuff = malloc(data->cr->stdoutlen);
-      memset(data->cr->stdoutbuff, 0, data->cr->stdoutlen);
+      helper->cr = calloc(sizeof(*helper->cr), 1);
+      memset(helper->cr, 0, sizeof(*helper->cr));
+      memcpy(helper->cr, &r, sizeof(r));
+      helper->cr->stdoutbuff = malloc(helper->cr->stdoutlen);
+      memset(helper->cr->stdoutbuff, 0, helper->cr->stdoutlen);
     }
 
-    while(data->cr->stdoutlen_sofar < data->cr->stdoutlen) {
+    while(helper->cr->stdoutlen_sofar < helper->cr->stdoutlen) {
       while((inlen =
                read(eventer_get_fd(e),
-                    data->cr->stdoutbuff + data->cr->stdoutlen_sofar,
-                    data->cr->stdoutlen - data->cr->stdoutlen_sofar)) == -1 &&
+                    helper->cr->stdoutbuff + helper->cr->stdoutlen_sofar,
+                    helper->cr->stdoutlen - helper->cr->stdoutlen_sofar)) == -1 &&
              errno == EINTR);
       if(inlen == -1 && errno == EAGAIN)
         return EVENTER_READ | EVENTER_EXCEPTION;
       if(inlen == 0) goto widowed;
-      if((data->cr->stdoutlen_sofar + inlen) < data->cr->stdoutlen_sofar)
+      if((helper->cr->stdoutlen_sofar + inlen) < helper->cr->stdoutlen_sofar)
         goto widowed; /* overflow */
-      data->cr->stdoutlen_sofar += inlen;
+      helper->cr->stdoutlen_sofar += inlen;
     }
-    mtevAssert(data->cr->stdoutbuff[data->cr->stdoutlen-1] == '\0');
-    if(!data->cr->stderrbuff) {
-      while((inlen = read(eventer_get_fd(e), &data->cr->stderrlen,
-                          sizeof(data->cr->stderrlen))) == -1 &&
+    mtevAssert(helper->cr->stdoutbuff[helper->cr->stdoutlen-1] == '\0');
+    if(!helper->cr->stderrbuff) {
+      while((inlen = read(eventer_get_fd(e), &helper->cr->stderrlen,
+                          sizeof(helper->cr->stderrlen))) == -1 &&
             errno == EINTR);
       if(inlen == -1 && errno == EAGAIN)
         return EVENTER_READ | EVENTER_EXCEPTION;
       if(inlen == 0) goto widowed;
-      mtevAssert(inlen == sizeof(data->cr->stderrlen));
+      mtevAssert(inlen == sizeof(helper->cr->stderrlen));
       /* We know that the strderrlen we read is taintet, but it comes
        * from our parent process and is well controlled, so we can
        * forgive that transgression.
        */
       /* coverity[tainted_data] */
-      data->cr->stderrbuff = malloc(data->cr->stderrlen);
+      helper->cr->stderrbuff = malloc(helper->cr->stderrlen);
     }
-    while(data->cr->stderrlen_sofar < (int)data->cr->stderrlen) {
-      int stderrlen = (int)data->cr->stderrlen;
-      if((stderrlen - data->cr->stderrlen_sofar) < 0 ||
-         (size_t)(stderrlen - data->cr->stderrlen_sofar) > data->cr->stderrlen)
+    while(helper->cr->stderrlen_sofar < (int)helper->cr->stderrlen) {
+      int stderrlen = (int)helper->cr->stderrlen;
+      if((stderrlen - helper->cr->stderrlen_sofar) < 0 ||
+         (size_t)(stderrlen - helper->cr->stderrlen_sofar) > helper->cr->stderrlen)
         goto widowed; /* overflow */
       while((inlen =
                read(eventer_get_fd(e),
-                    data->cr->stderrbuff + data->cr->stderrlen_sofar,
-                    stderrlen - data->cr->stderrlen_sofar)) == -1 &&
+                    helper->cr->stderrbuff + helper->cr->stderrlen_sofar,
+                    stderrlen - helper->cr->stderrlen_sofar)) == -1 &&
              errno == EINTR);
       if(inlen == -1 && errno == EAGAIN)
         return EVENTER_READ | EVENTER_EXCEPTION;
       if(inlen == 0) goto widowed;
-      if(((int)data->cr->stdoutlen_sofar + inlen) < data->cr->stdoutlen_sofar)
+      if(((int)helper->cr->stdoutlen_sofar + inlen) < helper->cr->stdoutlen_sofar)
         goto widowed; /* overflow */
-      data->cr->stderrlen_sofar += inlen;
+      helper->cr->stderrlen_sofar += inlen;
     }
-    mtevAssert(data->cr && data->cr->stdoutbuff && data->cr->stderrbuff);
-    mtevAssert(data->cr->stderrbuff[data->cr->stderrlen-1] == '\0');
+    mtevAssert(helper->cr && helper->cr->stdoutbuff && helper->cr->stderrbuff);
+    mtevAssert(helper->cr->stderrbuff[helper->cr->stderrlen-1] == '\0');
 
     mtev_gettimeofday(now, NULL); /* set it, as we care about accuracy */
 
+    pthread_mutex_lock(&data->pool_lock);
+    if(helper->inflight) helper->inflight--;
+    pthread_cond_signal(&data->pool_cv);
+    pthread_mutex_unlock(&data->pool_lock);
+
     /* Lookup data in check_no hash */
     if(mtev_hash_retrieve(&data->external_checks,
-                          (const char *)&data->cr->check_no,
-                          sizeof(data->cr->check_no),
+                          (const char *)&helper->cr->check_no,
+                          sizeof(helper->cr->check_no),
                           &vci) == 0)
       vci = NULL;
     ci = (struct check_info *)vci;
@@ -453,16 +543,16 @@ static int external_handler(eventer_t e, int mask,
     /* We've seen it, it ain't coming again...
      * remove it, we'll free it ourselves */
     mtev_hash_delete(&data->external_checks,
-                     (const char *)&data->cr->check_no,
-                     sizeof(data->cr->check_no), NULL, NULL);
+                     (const char *)&helper->cr->check_no,
+                     sizeof(helper->cr->check_no), NULL, NULL);
 
     /* If there is no timeout_event, the check must have completed.
      * We have nothing to do. */
     if(!ci || !ci->timeout_event) {
-      free(data->cr->stdoutbuff);
-      free(data->cr->stderrbuff);
-      free(data->cr);
-      data->cr = NULL;
+      free(helper->cr->stdoutbuff);
+      free(helper->cr->stderrbuff);
+      free(helper->cr);
+      helper->cr = NULL;
       if (ci && ci->check) {
         ci->check->flags &= ~NP_RUNNING;
       }
@@ -472,13 +562,13 @@ static int external_handler(eventer_t e, int mask,
     free(eventer_get_closure(ci->timeout_event));
     eventer_free(ci->timeout_event);
     ci->timeout_event = NULL;
-    ci->exit_code = data->cr->exit_code;
-    ci->output = data->cr->stdoutbuff;
-    ci->error = data->cr->stderrbuff;
-    ci->stdout_truncated = data->cr->stdout_truncated;
-    ci->stderr_truncated = data->cr->stderr_truncated;
-    free(data->cr);
-    data->cr = NULL;
+    ci->exit_code = helper->cr->exit_code;
+    ci->output = helper->cr->stdoutbuff;
+    ci->error = helper->cr->stderrbuff;
+    ci->stdout_truncated = helper->cr->stdout_truncated;
+    ci->stderr_truncated = helper->cr->stderr_truncated;
+    free(helper->cr);
+    helper->cr = NULL;
     check = ci->check;
     if (!ci->errortype) {
       external_log_results(self, check);
@@ -487,13 +577,36 @@ static int external_handler(eventer_t e, int mask,
   }
 
  widowed:
-  mtevL(noit_error, "external module terminated, must restart.\n");
-  exit(1);
+  return external_helper_down(helper, e);
+}
+
+/* The helper program lives beside the modules; "helper" overrides. */
+static char *external_helper_path(external_data_t *data) {
+  const char *helper = NULL;
+  char *dirs = NULL, *dir, *brk, path[PATH_MAX];
+
+  if(data->options &&
+     mtev_hash_retr_str(data->options, "helper", strlen("helper"), &helper))
+    return strdup(helper);
+  (void)mtev_conf_get_string(NULL, "//modules/@directory", &dirs);
+  if(dirs) {
+    for(dir = strtok_r(dirs, ":;", &brk); dir;
+        dir = strtok_r(NULL, ":;", &brk)) {
+      snprintf(path, sizeof(path), "%s/external_helper", dir);
+      if(access(path, X_OK) == 0) {
+        free(dirs);
+        return strdup(path);
+      }
+    }
+    free(dirs);
+  }
+  return strdup(MODULES_DIR "/external_helper");
 }
 
 static int external_init(noit_module_t *self) {
   external_data_t *data;
   const char* path = NULL, *nagios_regex = NULL, *max_out_len = NULL;
+  int i;
 
   data = noit_module_get_userdata(self);
   if(!data) {
@@ -504,7 +617,6 @@ static int external_init(noit_module_t *self) {
   data->nldeb = mtev_log_stream_find("debug/external");
 
   data->jobq = eventer_jobq_create("external");
-  eventer_jobq_set_concurrency(data->jobq, 1);
 
   if (data->options) {
     (void)mtev_hash_retr_str(data->options, "path", strlen("path"), &path);
@@ -544,55 +656,117 @@ static int external_init(noit_module_t *self) {
     data->max_out_len = 256 * 1024; // default to 256K if they don't specify above
   }
 
-  if(socketpair(AF_UNIX, SOCK_STREAM, 0, data->pipe_n2e) != 0 ||
-     socketpair(AF_UNIX, SOCK_STREAM, 0, data->pipe_e2n) != 0) {
+  data->nhelpers = 1;
+  data->max_inflight = 0;
+  if(data->options) {
+    const char *value;
+    if(mtev_hash_retr_str(data->options, "helpers", strlen("helpers"), &value))
+      data->nhelpers = atoi(value);
+    if(mtev_hash_retr_str(data->options, "max_inflight", strlen("max_inflight"), &value))
+      data->max_inflight = atoi(value);
+    if(mtev_hash_retr_str(data->options, "report_timing", strlen("report_timing"), &value))
+      data->report_timing = !strcmp(value, "true") || !strcmp(value, "on");
+  }
+  if(data->nhelpers < 1) data->nhelpers = 1;
+  eventer_jobq_set_concurrency(data->jobq, data->nhelpers);
+  if(data->helper_path) free(data->helper_path);
+  data->helper_path = external_helper_path(data);
+
+  pthread_mutex_init(&data->pool_lock, NULL);
+  pthread_cond_init(&data->pool_cv, NULL);
+  data->helpers = calloc(data->nhelpers, sizeof(*data->helpers));
+  for(i=0; i<data->nhelpers; i++) {
+    external_helper_t *h = &data->helpers[i];
+    h->idx = i;
+    h->self = self;
+    h->dead = mtev_true;
+    h->pipe_n2e[0] = h->pipe_n2e[1] = -1;
+    h->pipe_e2n[0] = h->pipe_e2n[1] = -1;
+    pthread_mutex_init(&h->wlock, NULL);
+  }
+  noit_module_set_userdata(self, data);
+  for(i=0; i<data->nhelpers; i++) {
+    if(external_helper_start(data, &data->helpers[i]) != 0) return -1;
+  }
+  return 0;
+}
+
+static int external_helper_start(external_data_t *data, external_helper_t *h) {
+  eventer_t newe;
+  const char *user = NULL, *group = NULL;
+  char in_str[16], out_str[16], max_str[16];
+  char *argv[14];
+  pid_t pid;
+  int argc = 0, rv;
+
+  if(socketpair(AF_UNIX, SOCK_STREAM, 0, h->pipe_n2e) != 0) {
     mtevL(noit_error, "external: pipe() failed: %s\n", strerror(errno));
-    free(data->jobq);
-    free(data);
     return -1;
   }
-
-  data->child = fork();
-  if(data->child == -1) {
-    /* No child, bail. */
-    mtevL(noit_error, "external: fork() failed: %s\n", strerror(errno));
-    free(data->jobq);
-    free(data);
+  if(socketpair(AF_UNIX, SOCK_STREAM, 0, h->pipe_e2n) != 0) {
+    mtevL(noit_error, "external: pipe() failed: %s\n", strerror(errno));
+    close(h->pipe_n2e[0]);
+    close(h->pipe_n2e[1]);
     return -1;
   }
-
-  /* parent must close the read side of n2e and the write side of e2n */
-  /* The child must do the opposite */
-  close(data->pipe_n2e[(data->child == 0) ? 1 : 0]);
-  close(data->pipe_e2n[(data->child == 0) ? 0 : 1]);
+  /* our ends stay here; the helper closes anything else it inherits */
+  (void)fcntl(h->pipe_n2e[1], F_SETFD, FD_CLOEXEC);
+  (void)fcntl(h->pipe_e2n[0], F_SETFD, FD_CLOEXEC);
+
+  /* No fork of noitd: it is threaded and the child would run our
+   * allocator and locks.  Spawn the helper program instead. */
+  snprintf(in_str, sizeof(in_str), "%d", h->pipe_n2e[0]);
+  snprintf(out_str, sizeof(out_str), "%d", h->pipe_e2n[1]);
+  snprintf(max_str, sizeof(max_str), "%u", data->max_out_len);
+  argv[argc++] = "external_helper";
+  argv[argc++] = "-i"; argv[argc++] = in_str;
+  argv[argc++] = "-o"; argv[argc++] = out_str;
+  argv[argc++] = "-m"; argv[argc++] = max_str;
+  if(data->options) {
+    (void)mtev_hash_retr_str(data->options, "user", strlen("user"), &user);
+    (void)mtev_hash_retr_str(data->options, "group", strlen("group"), &group);
+  }
+  if(user) { argv[argc++] = "-u"; argv[argc++] = (char *)user; }
+  if(group) { argv[argc++] = "-g"; argv[argc++] = (char *)group; }
+  if(N_L_S_ON(data->nldeb)) argv[argc++] = "-d";
+  argv[argc] = NULL;
+
+  rv = posix_spawn(&pid, data->helper_path, NULL, NULL, argv, environ);
+  /* the helper's ends are its own now (or nobody's) */
+  close(h->pipe_n2e[0]);
+  close(h->pipe_e2n[1]);
+  if(rv != 0) {
+    mtevL(noit_error, "external: cannot spawn %s: %s\n",
+          data->helper_path, strerror(rv));
+    close(h->pipe_n2e[1]);
+    close(h->pipe_e2n[0]);
+    h->pipe_n2e[1] = h->pipe_e2n[0] = -1;
+    return -1;
+  }
+  h->child = pid;
 
   /* Now the parent must set its bits non-blocking, the child need not */
-  if(data->child != 0) {
-    /* in the parent */
-    if(eventer_set_fd_nonblocking(data->pipe_e2n[0]) == -1) {
-      close(data->pipe_n2e[1]);
-      close(data->pipe_e2n[0]);
-      mtevL(noit_error,
-            "external: could not set pipe non-blocking: %s\n",
-            strerror(errno));
-      free(data);
-      return -1;
-    }
-    eventer_t newe;
-    newe = eventer_alloc_fd(external_handler, self, data->pipe_e2n[0],
-                            EVENTER_READ | EVENTER_EXCEPTION);
-    eventer_add(newe);
-  }
-  else {
-    const char *user = NULL, *group = NULL;
-    if(data->options) {
-      (void)mtev_hash_retr_str(data->options, "user", strlen("user"), &user);
-      (void)mtev_hash_retr_str(data->options, "group", strlen("group"), &group);
-    }
-    mtev_security_usergroup(user, group, mtev_false);
-    exit(external_child(data));
+  if(eventer_set_fd_nonblocking(h->pipe_e2n[0]) == -1) {
+    close(h->pipe_n2e[1]);
+    close(h->pipe_e2n[0]);
+    h->pipe_n2e[1] = h->pipe_e2n[0] = -1;
+    (void)kill(pid, SIGKILL);
+    external_helper_reap(NULL, 0, (void *)(intptr_t)pid, NULL);
+    mtevL(noit_error,
+          "external: could not set pipe non-blocking: %s\n",
+          strerror(errno));
+    return -1;
   }
-  noit_module_set_userdata(self, data);
+  newe = eventer_alloc_fd(external_handler, h, h->pipe_e2n[0],
+                          EVENTER_READ | EVENTER_EXCEPTION);
+  eventer_add(newe);
+
+  h->started = time(NULL);
+  pthread_mutex_lock(&data->pool_lock);
+  h->inflight = 0;
+  h->dead = mtev_false;
+  pthread_cond_broadcast(&data->pool_cv);
+  pthread_mutex_unlock(&data->pool_lock);
   return 0;
 }
 
@@ -607,35 +781,54 @@ static void external_cleanup(noit_module_t *self, noit_check_t *check) {
     }
   }
 }
-#define assert_write(fd, s, l) do { \
-  int len; \
-  int written_bytes = 0; \
-  if (l == 0) break; \
-  while (1) { \
-    len = write(fd,(char*)s+written_bytes,l-written_bytes); \
-    if (len == -1) { \
-      if (errno != EINTR) { \
-        break; \
-      } \
-    } \
-    else if (len == 0) { \
-      break; \
-    } \
-    else { \
-      written_bytes += len; \
-      if (written_bytes >= l) break;\
-    } \
-  } \
-  if (written_bytes != l) { \
-    mtevFatal(noit_error, "written_bytes not equal to write length in external.c assert_write, aborting...\n"); \
-  } \
-} while (0)
+/* Least loaded live helper under max_inflight, waiting up to deadline */
+static external_helper_t *
+external_helper_acquire(external_data_t *data, struct timeval *deadline) {
+  external_helper_t *best;
+  struct timespec ts;
+
+  ts.tv_sec = deadline->tv_sec;
+  ts.tv_nsec = deadline->tv_usec * 1000;
+  pthread_mutex_lock(&data->pool_lock);
+  while(1) {
+    int i;
+    best = NULL;
+    for(i=0; i<data->nhelpers; i++) {
+      external_helper_t *h = &data->helpers[i];
+      if(h->dead) continue;
+      if(data->max_inflight && h->inflight >= data->max_inflight) continue;
+      if(!best || h->inflight < best->inflight) best = h;
+    }
+    if(best) {
+      best->inflight++;
+      break;
+    }
+    if(pthread_cond_timedwait(&data->pool_cv, &data->pool_lock, &ts) == ETIMEDOUT)
+      break;
+  }
+  pthread_mutex_unlock(&data->pool_lock);
+  return best;
+}
+static int write_all(int fd, const char *s, size_t l) {
+  size_t written_bytes = 0;
+  while(written_bytes < l) {
+    ssize_t len = write(fd, s + written_bytes, l - written_bytes);
+    if(len == -1 && errno == EINTR) continue;
+    if(len <= 0) return -1;
+    written_bytes += len;
+  }
+  return 0;
+}
 static int external_enqueue(eventer_t e, int mask, void *closure,
                             struct timeval *now) {
   external_closure_t *ecl = (external_closure_t *)closure;
   struct check_info *ci = (struct check_info *)ecl->check->closure;
   external_data_t *data;
-  int fd, i;
+  external_helper_t *h;
+  struct timeval deadline, timeout;
+  char *buf, *cp;
+  size_t len;
+  int i, rv;
 
   if(mask == EVENTER_ASYNCH_CLEANUP) {
     eventer_set_mask(e, 0);
@@ -655,16 +848,54 @@ static int external_enqueue(eventer_t e, int mask, void *closure,
     return 0;
   }
   data = noit_module_get_userdata(ecl->self);
-  fd = data->pipe_n2e[1];
-  assert_write(fd, &ci->check_no, sizeof(ci->check_no));
-  assert_write(fd, &ci->argcnt, sizeof(ci->argcnt));
-  assert_write(fd, ci->arglens, sizeof(*ci->arglens)*ci->argcnt);
+
+  timeout.tv_sec = ecl->check->timeout / 1000;
+  timeout.tv_usec = (ecl->check->timeout % 1000) * 1000;
+  add_timeval(ecl->check->last_fire_time, timeout, &deadline);
+  h = external_helper_acquire(data, &deadline);
+  if(!h) {
+    mtevL(data->nlerr, "external: no helper available for %lld\n",
+          (long long int)ci->check_no);
+    return 0;
+  }
+
+  /* Send it as one message */
+  len = sizeof(ci->check_no) + sizeof(ci->argcnt) +
+        sizeof(*ci->arglens)*ci->argcnt +
+        sizeof(ci->envcnt) + sizeof(*ci->envlens)*ci->envcnt;
+  for(i=0; i<ci->argcnt; i++) len += ci->arglens[i];
+  for(i=0; i<ci->envcnt; i++) len += ci->envlens[i];
+  cp = buf = malloc(len);
+#define APPEND(d, l) do { memcpy(cp, d, l); cp += l; } while(0)
+  APPEND(&ci->check_no, sizeof(ci->check_no));
+  APPEND(&ci->argcnt, sizeof(ci->argcnt));
+  APPEND(ci->arglens, sizeof(*ci->arglens)*ci->argcnt);
   for(i=0; i<ci->argcnt; i++)
-    assert_write(fd, ci->args[i], ci->arglens[i]);
-  assert_write(fd, &ci->envcnt, sizeof(ci->envcnt));
-  assert_write(fd, ci->envlens, sizeof(*ci->envlens)*ci->envcnt);
+    APPEND(ci->args[i], ci->arglens[i]);
+  APPEND(&ci->envcnt, sizeof(ci->envcnt));
+  APPEND(ci->envlens, sizeof(*ci->envlens)*ci->envcnt);
   for(i=0; i<ci->envcnt; i++)
-    assert_write(fd, ci->envs[i], ci->envlens[i]);
+    APPEND(ci->envs[i], ci->envlens[i]);
+#undef APPEND
+
+  ci->helper = h->idx;
+  mtev_gettimeofday(&ci->dispatched, NULL);
+  pthread_mutex_lock(&h->wlock);
+  rv = (h->pipe_n2e[1] >= 0) ? write_all(h->pipe_n2e[1], buf, len) : -1;
+  if(rv != 0) rv = errno;
+  pthread_mutex_unlock(&h->wlock);
+  free(buf);
+  if(rv != 0) {
+    /* The helper is going away, its handler will restart it. */
+    mtevL(data->nlerr, "external: write to helper %d failed: %s\n",
+          h->idx, strerror(rv));
+    memset(&ci->dispatched, 0, sizeof(ci->dispatched));
+    pthread_mutex_lock(&data->pool_lock);
+    if(h->inflight) h->inflight--;
+    pthread_cond_signal(&data->pool_cv);
+    pthread_mutex_unlock(&data->pool_lock);
+    return 0;
+  }
   ci->written = 1;
   return 0;
 }
@@ -847,6 +1078,8 @@ static int external_initiate_check(noit_module_t *self, noit_check_t *check,
 static int external_onload(mtev_image_t *self) {
   eventer_name_callback("external/timeout", external_timeout);
   eventer_name_callback("external/handler", external_handler);
+  eventer_name_callback("external/helper_restart", external_helper_restart);
+  eventer_name_callback("external/helper_reap", external_helper_reap);
   return 0;
 }
 
@@ -0,0 +1,86 @@
+/*
+ * Copyright (c) 2017, Circonus, Inc. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above
+ *       copyright notice, this list of conditions and the following
+ *       disclaimer in the documentation and/or other materials provided
+ *       with the distribution.
+ *     * Neither the name Circonus, Inc. nor the names
+ *       of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written
+ *       permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* external_helper: the process the external module hands commands to.
+ * noitd spawns it (never a fork of itself) with the module's ends of a
+ * pair of sockets, and it runs external_child() until noitd goes away.
+ *
+ *   external_helper -i <in fd> -o <out fd> [-m max_output_len]
+ *                   [-u user] [-g group] [-d]
+ */
+
+#include <mtev_defines.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <mtev_log.h>
+#include <mtev_security.h>
+
+#include "external_proc.h"
+
+static void
+usage(const char *prog) {
+  fprintf(stderr, "%s -i <in fd> -o <out fd> [-m max_output_len]\n"
+                  "\t[-u user] [-g group] [-d]\n", prog);
+}
+
+int main(int argc, char **argv) {
+  int ch, in_fd = -1, out_fd = -1, debug = 0;
+  uint32_t max_out_len = 256 * 1024;
+  const char *user = NULL, *group = NULL;
+
+  while((ch = getopt(argc, argv, "i:o:m:u:g:d")) != -1) {
+    switch(ch) {
+      case 'i': in_fd = atoi(optarg); break;
+      case 'o': out_fd = atoi(optarg); break;
+      case 'm': max_out_len = strtoul(optarg, NULL, 10); break;
+      case 'u': user = optarg; break;
+      case 'g': group = optarg; break;
+      case 'd': debug = 1; break;
+      default: usage(argv[0]); exit(2);
+    }
+  }
+  if(in_fd < 0 || out_fd < 0 || max_out_len == 0) {
+    usage(argv[0]);
+    exit(2);
+  }
+
+  /* errors go to stderr, which is noitd's */
+  mtev_log_init(debug);
+  if((user || group) && mtev_security_usergroup(user, group, mtev_false) != 0) {
+    mtevL(mtev_error, "external_helper: cannot become %s:%s\n",
+          user ? user : "-", group ? group : "-");
+    exit(2);
+  }
+  return external_child(in_fd, out_fd, max_out_len, mtev_error, mtev_debug);
+}
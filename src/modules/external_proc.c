@@ -36,9 +36,12 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <signal.h>
-#include <sys/mman.h>
+#include <spawn.h>
 #include <poll.h>
 #include <errno.h>
+#include <dirent.h>
+#include <limits.h>
+#include <sys/resource.h>
 #ifdef HAVE_SYS_WAIT_H
 #include <sys/wait.h>
 #endif
@@ -52,6 +55,28 @@ static void finish_procs();
 static mtev_log_stream_t nlerr = NULL;
 static mtev_log_stream_t nldeb = NULL;
 int in_fd, out_fd;
+static int devnull_fd = -1;
+
+/* Child output is read from pipes as it is produced into these.  Only the
+ * first max_out_len - 1 bytes are kept, the rest is counted and dropped.
+ * The buffers are recycled across runs.
+ */
+struct output_capture {
+  int fd;
+  char *buf;
+  uint32_t len;
+  uint32_t allocd;
+  uint64_t total;
+};
+
+#define OUTBUF_POOL_MAX 64
+static char *outbuf_pool[OUTBUF_POOL_MAX];
+static uint32_t outbuf_pool_allocd[OUTBUF_POOL_MAX];
+static int outbuf_pool_cnt = 0;
+
+/* Completed results are framed into this and written to noitd in one go */
+static char *results_buf = NULL;
+static size_t results_len = 0, results_allocd = 0;
 
 struct proc_state {
   int64_t check_no;
@@ -61,12 +86,73 @@ struct proc_state {
   char *path;
   char **argv;
   char **envp;
-  int stdout_fd;
-  int stderr_fd;
+  struct output_capture out;
+  struct output_capture err;
   uint32_t max_out_len;
   struct proc_state *next;
 };
 
+static void output_capture_init(struct output_capture *oc) {
+  memset(oc, 0, sizeof(*oc));
+  oc->fd = -1;
+}
+
+static void output_capture_release(struct output_capture *oc) {
+  if(oc->fd >= 0) close(oc->fd);
+  oc->fd = -1;
+  if(oc->buf) {
+    if(outbuf_pool_cnt < OUTBUF_POOL_MAX) {
+      outbuf_pool_allocd[outbuf_pool_cnt] = oc->allocd;
+      outbuf_pool[outbuf_pool_cnt++] = oc->buf;
+    }
+    else free(oc->buf);
+  }
+  oc->buf = NULL;
+  oc->allocd = 0;
+}
+
+static void output_capture_grow(struct output_capture *oc, uint32_t limit) {
+  uint32_t want;
+  if(!oc->buf && outbuf_pool_cnt > 0) {
+    outbuf_pool_cnt--;
+    oc->buf = outbuf_pool[outbuf_pool_cnt];
+    oc->allocd = outbuf_pool_allocd[outbuf_pool_cnt];
+    if(oc->allocd > oc->len) return;
+  }
+  want = oc->allocd ? oc->allocd * 2 : 4096;
+  if(want > limit) want = limit;
+  oc->buf = realloc(oc->buf, want);
+  oc->allocd = want;
+}
+
+/* Read what's available; returns 0 on EOF or error, 1 if the fd is open. */
+static int output_capture_drain(struct output_capture *oc, uint32_t max_out_len) {
+  uint32_t keep = max_out_len - 1;
+  char discard[4096];
+  ssize_t rv;
+
+  while(oc->fd >= 0) {
+    char *dst = discard;
+    size_t room = sizeof(discard);
+    if(oc->len < keep) {
+      if(oc->len >= oc->allocd) output_capture_grow(oc, keep);
+      dst = oc->buf + oc->len;
+      room = MIN(oc->allocd, keep) - oc->len;
+    }
+    rv = read(oc->fd, dst, room);
+    if(rv > 0) {
+      if(dst != discard) oc->len += rv;
+      oc->total += rv;
+      continue;
+    }
+    if(rv < 0 && errno == EINTR) continue;
+    if(rv < 0 && errno == EAGAIN) return 1;
+    close(oc->fd);
+    oc->fd = -1;
+  }
+  return 0;
+}
+
 void proc_state_free(struct proc_state *ps) {
   int i;
   free(ps->path);
@@ -76,8 +162,9 @@ void proc_state_free(struct proc_state *ps) {
   for(i=0; ps->envp[i]; i++)
     free(ps->envp[i]);
   free(ps->envp);
-  if(ps->stdout_fd >= 0) close(ps->stdout_fd);
-  if(ps->stderr_fd >= 0) close(ps->stderr_fd);
+  output_capture_release(&ps->out);
+  output_capture_release(&ps->err);
+  free(ps);
 }
 
 mtev_skiplist active_procs;
@@ -125,6 +212,7 @@ static void process_siglist() {
     mtevL((ps?nldeb:nlerr), "reaped pid %d (check: %lld) -> %x\n",
           pid, (long long int)(ps?ps->check_no:-1), status);
     if(ps) {
+      ps->status = status;
       int rv = mtev_skiplist_remove_compare(&active_procs, &ps->pid, NULL,  __proc_state_pid);
       if (!rv) {
         mtevL(noit_error, "error: couldn't remove PID %d from active_procs in external\n", ps->pid);
@@ -166,89 +254,33 @@ static void fetch_and_kill_by_check(int64_t check_no) {
   mtevAssert(read_bytes == l); \
 } while (0)
 
-#define assert_write(fd, s, l) do { \
-  int len; \
-  int written_bytes = 0; \
-  if (l == 0) break; \
-  while (1) { \
-    len = write(fd,(char*)s+written_bytes,l); \
-    if (len == -1) { \
-      if (errno == EINTR) { \
-        finish_procs(); \
-      } \
-      else break; \
-    } \
-    else if (len == 0) { \
-      break; \
-    } \
-    else { \
-      written_bytes += len; \
-      if (written_bytes >= l) break; \
-    } \
-  } \
-  mtevAssert(written_bytes == l); \
-} while (0)
-
-static int16_t get_truncated(int bfd, uint32_t max_out_len) {
-  struct stat buf;
-
-  if(fstat(bfd, &buf) == -1) {
-    mtevL(nldeb, "external: fstat error: %s\n", strerror(errno));
-    return -1;
+static void results_append(const void *d, size_t l) {
+  if(results_len + l > results_allocd) {
+    results_allocd = MAX(results_len + l, results_allocd * 2);
+    results_buf = realloc(results_buf, results_allocd);
   }
-  if(buf.st_size > max_out_len - 1) {
-    return 1;
-  }
-  return 0;
+  memcpy(results_buf + results_len, d, l);
+  results_len += l;
 }
-/* 
- * return 1 if the output had to be truncated, 0 on normal output, -1 on mmap or fstat failure or nothing to do
- */
-static int write_out_backing_fd(int ofd, int bfd, uint32_t max_out_len) {
-  char *mmap_buf;
-  uint32_t outlen;
-  mtev_boolean truncated = mtev_false;
-  struct stat buf;
-
-  if(fstat(bfd, &buf) == -1) {
-    mtevL(nldeb, "external: fstat error: %s\n", strerror(errno));
-    goto bail;
-  }
-
-  /* 
-   * Our output length is defaulted to 256k (including a \0) 
-   * But the user can override by providing an option
-   * for external checks
-   */
-  if(buf.st_size > max_out_len - 1) {
-    truncated = mtev_true;
-    outlen = max_out_len - 1;
-  }
-  else outlen = buf.st_size;
 
-  mtevL(nldeb, "external_proc outlen=%d\n", outlen);
-
-  /* If we have no length, we can skip all this nonsense */
-  if(outlen == 0) goto bail;
+/* Frame one stream as the NUL terminated length/bytes pair noitd expects */
+static void results_append_output(struct output_capture *oc) {
+  uint32_t outlen = oc->len + 1; /* no null on the end, but we're reporting one */
+  mtevL(nldeb, "external_proc outlen=%d\n", oc->len);
+  results_append(&outlen, sizeof(outlen));
+  if(oc->len) results_append(oc->buf, oc->len);
+  results_append("", 1);
+}
 
-  mmap_buf = mmap(NULL, outlen, PROT_READ, MAP_SHARED, bfd, 0);
-  if(mmap_buf == (char *)-1) {
-    mtevL(nldeb, "external: mmap error: %s\n", strerror(errno));
-    goto bail;
+static void results_flush() {
+  size_t written = 0;
+  while(written < results_len) {
+    ssize_t len = write(out_fd, results_buf + written, results_len - written);
+    if(len == -1 && errno == EINTR) continue;
+    mtevAssert(len > 0);
+    written += len;
   }
-  outlen++; /* no null on the end, but we're reporting one */
-  assert_write(ofd, &outlen, sizeof(outlen));
-  outlen--; /* set it back to write and munmap */
-  assert_write(ofd, mmap_buf, outlen);
-  assert_write(ofd, "", 1);
-  munmap(mmap_buf, outlen);
-  return truncated == mtev_true;
-
- bail:
-  outlen = 1;
-  assert_write(ofd, &outlen, sizeof(outlen));
-  assert_write(ofd, "", 1);
-  return -1;
+  results_len = 0;
 }
 
 static void finish_procs() {
@@ -258,71 +290,177 @@ static void finish_procs() {
   while((ps = mtev_skiplist_pop(&done_procs, NULL)) != NULL) {
     mtevL(nldeb, "finished %lld/%d\n", (long long int)ps->check_no, ps->pid);
     if(ps->cancelled == 0) {
-      assert_write(out_fd, &ps->check_no,
-                   sizeof(ps->check_no));
-      assert_write(out_fd, &ps->status,
-                   sizeof(ps->status));
+      int16_t stdout_trunc, stderr_trunc;
+      /* pick up whatever was written after our last poll */
+      output_capture_drain(&ps->out, ps->max_out_len);
+      output_capture_drain(&ps->err, ps->max_out_len);
+      results_append(&ps->check_no, sizeof(ps->check_no));
+      results_append(&ps->status, sizeof(ps->status));
 
       /* Write if we're truncating stdout or stderr */
-      int16_t stdout_trunc = get_truncated(ps->stdout_fd, ps->max_out_len);
-      int16_t stderr_trunc = get_truncated(ps->stderr_fd, ps->max_out_len);
-      assert_write(out_fd, &stdout_trunc, sizeof(stdout_trunc));
-      assert_write(out_fd, &stderr_trunc, sizeof(stderr_trunc));
+      stdout_trunc = (ps->out.total > ps->max_out_len - 1);
+      stderr_trunc = (ps->err.total > ps->max_out_len - 1);
+      results_append(&stdout_trunc, sizeof(stdout_trunc));
+      results_append(&stderr_trunc, sizeof(stderr_trunc));
 
-      write_out_backing_fd(out_fd, ps->stdout_fd, ps->max_out_len);
-      write_out_backing_fd(out_fd, ps->stderr_fd, ps->max_out_len);
+      results_append_output(&ps->out);
+      results_append_output(&ps->err);
     }
     proc_state_free(ps);
   }
+  if(results_len) results_flush();
+}
+
+static int capture_pipe(int fds[2]) {
+  if(pipe(fds) != 0) return -1;
+  /* Only our end is non-blocking; neither end survives an exec. */
+  if(fcntl(fds[0], F_SETFD, FD_CLOEXEC) == -1 ||
+     fcntl(fds[1], F_SETFD, FD_CLOEXEC) == -1 ||
+     fcntl(fds[0], F_SETFL, fcntl(fds[0], F_GETFL) | O_NONBLOCK) == -1) {
+    close(fds[0]);
+    close(fds[1]);
+    return -1;
+  }
+  return 0;
 }
 
 int external_proc_spawn(struct proc_state *ps) {
-  int i, stdin_fd;
-  char stdoutfile[PATH_MAX];
-  char stderrfile[PATH_MAX];
+  int rv, stdout_pipe[2], stderr_pipe[2];
+  posix_spawn_file_actions_t actions;
 
   mtevL(nldeb, "About to spawn: (%s)\n", ps->path);
-  strlcpy(stdoutfile, "/tmp/noitext.XXXXXX", PATH_MAX);
-  ps->stdout_fd = mkstemp(stdoutfile);
-  if(ps->stdout_fd < 0) goto prefork_fail;
-  unlink(stdoutfile);
-  strlcpy(stderrfile, "/tmp/noitext.XXXXXX", PATH_MAX);
-  ps->stderr_fd = mkstemp(stderrfile);
-  if(ps->stderr_fd < 0) goto prefork_fail;
-  unlink(stderrfile);
-  ps->pid = fork();
-  if(ps->pid == -1) goto prefork_fail;
-
-  /* Here.. fork has succeeded */
-  if(ps->pid) {
-    mtev_skiplist_insert(&active_procs, ps);
-    return 0;
+  if(capture_pipe(stdout_pipe)) goto prefork_fail;
+  if(capture_pipe(stderr_pipe)) {
+    close(stdout_pipe[0]);
+    close(stdout_pipe[1]);
+    goto prefork_fail;
+  }
+  ps->out.fd = stdout_pipe[0];
+  ps->err.fd = stderr_pipe[0];
+
+  /* Everything but std{in,out,err} is close-on-exec */
+  posix_spawn_file_actions_init(&actions);
+  if(devnull_fd >= 0)
+    posix_spawn_file_actions_adddup2(&actions, devnull_fd, 0);
+  else
+    posix_spawn_file_actions_addclose(&actions, 0);
+  posix_spawn_file_actions_adddup2(&actions, stdout_pipe[1], 1);
+  posix_spawn_file_actions_adddup2(&actions, stderr_pipe[1], 2);
+  rv = posix_spawn(&ps->pid, ps->path, &actions, NULL, ps->argv, ps->envp);
+  posix_spawn_file_actions_destroy(&actions);
+  close(stdout_pipe[1]);
+  close(stderr_pipe[1]);
+
+  if(rv != 0) {
+    /* Report it as the forked child's exit(-1) after a failed execve */
+    mtevL(nldeb, "posix_spawn(%s): %s\n", ps->path, strerror(rv));
+    ps->status = 0xff00;
+    mtev_skiplist_insert(&done_procs, ps);
+    return -1;
   }
-  /* Run the process */
-  stdin_fd = open("/dev/null", O_RDONLY);
-  if(stdin_fd < 0) close(0);
-  else dup2(stdin_fd, 0);
-  dup2(ps->stdout_fd, 1);
-  dup2(ps->stderr_fd, 2);
-  /* Shut off everything but std{in,out,err} */
-  for(i=3;i<256;i++) close(i);
-  execve(ps->path, ps->argv, ps->envp);
-  exit(-1);
+  mtev_skiplist_insert(&active_procs, ps);
+  return 0;
+
  prefork_fail:
   ps->status = -1;
   mtev_skiplist_insert(&done_procs, ps);
   return -1;
 }
 
+/* Collect running children's output until noitd has something for us.
+ * Returns true if in_fd is readable. */
+static mtev_boolean wait_for_input() {
+  static struct pollfd *pfds = NULL;
+  static struct proc_state **owners = NULL;
+  static uint32_t pfds_allocd = 0;
+  mtev_skiplist_node *iter;
+  struct proc_state *ps;
+  uint32_t npfds = 1, i;
+  int rv;
+
+  if(pfds_allocd < 1 + 2 * active_procs.size) {
+    pfds_allocd = 1 + 2 * active_procs.size;
+    pfds = realloc(pfds, pfds_allocd * sizeof(*pfds));
+    owners = realloc(owners, pfds_allocd * sizeof(*owners));
+  }
+  pfds[0].fd = in_fd;
+  pfds[0].events = POLLIN;
+  pfds[0].revents = 0;
+  for(iter = mtev_skiplist_getlist(&active_procs); iter;
+      mtev_skiplist_next(&active_procs, &iter)) {
+    ps = iter->data;
+    if(ps->out.fd >= 0) {
+      pfds[npfds].fd = ps->out.fd;
+      pfds[npfds].events = POLLIN;
+      owners[npfds++] = ps;
+    }
+    if(ps->err.fd >= 0) {
+      pfds[npfds].fd = ps->err.fd;
+      pfds[npfds].events = POLLIN;
+      owners[npfds++] = ps;
+    }
+  }
+
+  /* A child closing its output usually means it exited, but it might not
+   * be reapable yet; wake up now and then while children are running. */
+  rv = poll(pfds, npfds, active_procs.size ? 1000 : -1);
+  for(i = 1; rv > 0 && i < npfds; i++) {
+    if(pfds[i].revents == 0) continue;
+    ps = owners[i];
+    output_capture_drain(pfds[i].fd == ps->out.fd ? &ps->out : &ps->err,
+                         ps->max_out_len);
+  }
+  finish_procs();
+  return rv > 0 && pfds[0].revents != 0;
+}
+
+/* We are exec'd by noitd and inherit whatever it had open without
+ * close-on-exec: listeners, client connections, other helpers' pipes.
+ * Close all of it but our own pipes.  Walk the open descriptors where
+ * the system lists them, else every possible one up to the limit. */
+static void
+close_inherited(void) {
+  struct rlimit rl;
+  int fd, maxfd = 1024;
+#ifdef __linux__
+  DIR *dir = opendir("/proc/self/fd");
+  if(dir) {
+    struct dirent *de;
+    while((de = readdir(dir)) != NULL) {
+      char *endptr;
+      fd = strtol(de->d_name, &endptr, 10);
+      if(*endptr != '\0' || fd < 3 || fd == dirfd(dir) ||
+         fd == in_fd || fd == out_fd) continue;
+      close(fd);
+    }
+    closedir(dir);
+    return;
+  }
+#endif
+  if(getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur != RLIM_INFINITY)
+    maxfd = (int)MIN(rl.rlim_cur, (rlim_t)INT_MAX);
+  for(fd = 3; fd < maxfd; fd++)
+    if(fd != in_fd && fd != out_fd) close(fd);
+}
+
 static void sig_noop(int signum) {
   signal(signum, sig_noop);
 }
 
-int external_child(external_data_t *data) {
-  in_fd = data->pipe_n2e[0];
-  out_fd = data->pipe_e2n[1];
-  nlerr = data->nlerr;
-  nldeb = data->nldeb;
+int external_child(int in, int out, uint32_t max_out_len,
+                   mtev_log_stream_t err, mtev_log_stream_t deb) {
+  in_fd = in;
+  out_fd = out;
+  nlerr = err;
+  nldeb = deb;
+
+  /* Children are spawned without a chance to close anything, so what
+   * they may see is only our pipes, and those not past exec */
+  close_inherited();
+  (void)fcntl(in_fd, F_SETFD, FD_CLOEXEC);
+  (void)fcntl(out_fd, F_SETFD, FD_CLOEXEC);
+  devnull_fd = open("/dev/null", O_RDONLY);
+  if(devnull_fd >= 0) (void)fcntl(devnull_fd, F_SETFD, FD_CLOEXEC);
 
   /* switch to / */
   if(chdir("/") != 0) {
@@ -340,7 +478,6 @@ int external_child(external_data_t *data) {
                             __proc_state_check_no_key);
 
   while(1) {
-    struct pollfd pfd;
     struct proc_state *proc_state;
     int64_t check_no;
     int16_t argcnt, *arglens, envcnt, *envlens;
@@ -349,9 +486,7 @@ int external_child(external_data_t *data) {
     sig_noop(SIGCHLD);
 
     /* We poll here so that we can be interrupted by the SIGCHLD */
-    pfd.fd = in_fd;
-    pfd.events = POLLIN;
-    while(poll(&pfd, 1, -1) == -1 && errno == EINTR) finish_procs();
+    if(!wait_for_input()) continue;
 
     assert_read(in_fd, &check_no, sizeof(check_no));
     assert_read(in_fd, &argcnt, sizeof(argcnt));
@@ -362,10 +497,10 @@ int external_child(external_data_t *data) {
     }
     mtevAssert(argcnt > 1);
     proc_state = calloc(1, sizeof(*proc_state));
-    proc_state->stdout_fd = -1;
-    proc_state->stderr_fd = -1;
+    output_capture_init(&proc_state->out);
+    output_capture_init(&proc_state->err);
     proc_state->check_no = check_no;
-    proc_state->max_out_len = data->max_out_len;
+    proc_state->max_out_len = max_out_len;
 
     /* read in the argument lengths */
     arglens = calloc(argcnt, sizeof(*arglens));
@@ -35,6 +35,7 @@
 #define MODULES_EXTERNAL_PROC_H
 
 #include <mtev_defines.h>
+#include <pthread.h>
 #include <eventer/eventer.h>
 #include <mtev_atomic.h>
 #include <mtev_hash.h>
@@ -57,20 +58,38 @@ struct external_response {
   uint32_t stderrlen;
   char *stderrbuff;
 };
+/* One helper process (external_helper, spawned from the module
+ * directory); checks are spread over a pool of these. */
 typedef struct {
-  mtev_log_stream_t nlerr;
-  mtev_log_stream_t nldeb;
+  int idx;
+  void *self;
   int child;
   int pipe_n2e[2];
   int pipe_e2n[2];
+  mtev_boolean dead;
+  time_t started;
+  uint32_t inflight;
+  pthread_mutex_t wlock;
+  struct external_response *cr;
+} external_helper_t;
+
+typedef struct {
+  mtev_log_stream_t nlerr;
+  mtev_log_stream_t nldeb;
   char* path;
   char* nagios_regex;
   eventer_jobq_t *jobq;
   mtev_atomic64_t check_no_seq;
   mtev_hash_table external_checks;
   mtev_hash_table *options;
+  char *helper_path;
   uint32_t max_out_len;
-  struct external_response *cr;
+  int nhelpers;
+  external_helper_t *helpers;
+  uint32_t max_inflight;
+  pthread_mutex_t pool_lock;
+  pthread_cond_t pool_cv;
+  mtev_boolean report_timing;
 } external_data_t;
 
 typedef struct {
@@ -81,6 +100,9 @@ typedef struct {
   uint32_t stdoutlen;
 } __attribute__((packed)) external_header;
 
-int external_child(external_data_t *);
+/* The helper's loop, run by the external_helper program: commands are
+ * read from in_fd, run, and their results written to out_fd. */
+int external_child(int in_fd, int out_fd, uint32_t max_out_len,
+                   mtev_log_stream_t nlerr, mtev_log_stream_t nldeb);
 
 #endif
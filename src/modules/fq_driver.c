@@ -40,6 +40,7 @@
 #include <eventer/eventer.h>
 #include <mtev_log.h>
 #include <mtev_conf.h>
+#include <mtev_hash.h>
 
 #include "stratcon_iep.h"
 #include "fq_driver.xmlh"
@@ -58,9 +59,33 @@ typedef struct {
   mtev_atomic64_t dropped;
   mtev_atomic64_t msgs_in;
   mtev_atomic64_t msgs_out;
+  mtev_atomic64_t publish_bytes;
+  mtev_atomic64_t shard_primary;
+  /* per-second rates over the last status interval */
+  uint64_t last_publications;
+  uint64_t last_publish_bytes;
+  double publication_rate;
+  double byte_rate;
 } fq_stats_t;
 
 #define MAX_HOSTS 10
+#define SHARD_VNODES_DEFAULT 64
+#define ROUTE_CACHE_MAX (1 << 20)
+#define HOST_RETRY_SECONDS 10
+
+/* A point on the consistent-hash ring used by sharded publishing. */
+typedef struct {
+  uint32_t hash;
+  int host;
+} fq_ring_point_t;
+
+/* Per-check routing information, computed once from the first message
+ * seen for a check and cached by the uuid field of the jlog line. */
+typedef struct {
+  uint32_t ring_hash;
+  char uuid_formatted[UUID_STR_LEN+1];
+  char routingkey[1];
+} fq_route_t;
 struct fq_driver {
   fq_client client[MAX_HOSTS];
   fq_stats_t stats[MAX_HOSTS];
@@ -79,6 +104,10 @@ struct fq_driver {
   int port;
   int round_robin;
   int round_robin_target;
+  int shard_replicas;
+  int shard_vnodes;
+  fq_ring_point_t *ring;
+  int nring;
   int down_host[MAX_HOSTS];
   time_t last_error[MAX_HOSTS];
 };
@@ -87,6 +116,8 @@ static struct fq_driver global_fq_ctx;
 
 #define BUMPSTAT(i,a) mtev_atomic_inc64(&global_fq_ctx.stats[i].a)
 
+static mtev_hash_table route_cache;
+
 /* This is very specific to an internal implementation somewhere...
  * and thus unlikely to be useful unless people name their checks:
  * c_<accountid>_<checknumber>::<rest of name>
@@ -179,8 +210,8 @@ static void fq_logger(fq_client c, const char *err) {
     if(c == global_fq_ctx.client[i]) {
       mtevL(nlerr, "fq[%d]: %s%s", i, err, need_lf ? "\n" : "");
       BUMPSTAT(i, error_messages);
-      /* We only care about this if we're using round robin processing */
-      if (global_fq_ctx.round_robin) {
+      /* We only care about this if we're using round robin or sharded processing */
+      if (global_fq_ctx.round_robin || global_fq_ctx.shard_replicas) {
         if (!strncmp(err, "socket: Connection refused", strlen("socket: Connection refused"))) {
           global_fq_ctx.down_host[i] = true;
           global_fq_ctx.last_error[i] = time(NULL);
@@ -195,6 +226,118 @@ static void fq_logger(fq_client c, const char *err) {
   }
 }
 
+static int
+ring_point_compare(const void *a, const void *b) {
+  uint32_t ha = ((const fq_ring_point_t *)a)->hash;
+  uint32_t hb = ((const fq_ring_point_t *)b)->hash;
+  return (ha < hb) ? -1 : (ha > hb) ? 1 : 0;
+}
+
+/* Each host contributes shard_vnodes points so load stays even and a
+ * host leaving only moves the checks it owned to their next host. */
+static void
+noit_fq_build_ring(struct fq_driver *driver) {
+  int i, v, n = 0;
+  char key[160];
+
+  free(driver->ring);
+  driver->ring = calloc(driver->nhosts * driver->shard_vnodes,
+                        sizeof(*driver->ring));
+  for(i=0; i<driver->nhosts; i++) {
+    for(v=0; v<driver->shard_vnodes; v++) {
+      int len = snprintf(key, sizeof(key), "%s:%d#%d",
+                         driver->hostname[i], driver->ports[i], v);
+      driver->ring[n].hash = mtev_hash__hash(key, len, 0);
+      driver->ring[n].host = i;
+      n++;
+    }
+  }
+  qsort(driver->ring, n, sizeof(*driver->ring), ring_point_compare);
+  driver->nring = n;
+}
+
+static bool
+noit_fq_host_available(struct fq_driver *driver, int host, time_t now) {
+  if(!driver->down_host[host]) return true;
+  if(now - driver->last_error[host] >= HOST_RETRY_SECONDS) {
+    driver->down_host[host] = false;
+    return true;
+  }
+  return false;
+}
+
+/* Walk the ring clockwise from hash collecting up to shard_replicas
+ * distinct hosts that are not marked down.  If every host is down we
+ * still return the owner so the message lands in its backlog. */
+static int
+noit_fq_shard_targets(struct fq_driver *driver, uint32_t hash, int *targets) {
+  int lo = 0, hi = driver->nring, i, n = 0;
+  bool seen[MAX_HOSTS] = { false };
+  time_t now = time(NULL);
+
+  while(lo < hi) {
+    int mid = (lo + hi) / 2;
+    if(driver->ring[mid].hash < hash) lo = mid + 1;
+    else hi = mid;
+  }
+  for(i=0; i<driver->nring && n < driver->shard_replicas; i++) {
+    int host = driver->ring[(lo + i) % driver->nring].host;
+    if(seen[host]) continue;
+    seen[host] = true;
+    if(noit_fq_host_available(driver, host, now)) targets[n++] = host;
+  }
+  if(n == 0) targets[n++] = driver->ring[lo % driver->nring].host;
+  return n;
+}
+
+/* Locate the uuid field (the fourth) of a jlog line. */
+static const char *
+jlog_uuid_field(const char *payload, size_t payloadlen, int *fieldlen) {
+  const char *atab = payload, *end;
+  int i;
+  for(i=0; i<3; i++) {
+    atab = memchr(atab, '\t', payloadlen - (atab - payload));
+    if(!atab) return NULL;
+    atab++;
+  }
+  end = memchr(atab, '\t', payloadlen - (atab - payload));
+  if(!end) return NULL;
+  *fieldlen = end - atab;
+  return atab;
+}
+
+static void
+noit_fq_route_free(void *vr) {
+  free(vr);
+}
+
+static fq_route_t *
+noit_fq_route_cache(const char *field, int fieldlen, const char *routingkey,
+                    const char *uuid_formatted) {
+  fq_route_t *route;
+  int rklen = strlen(routingkey);
+  if(mtev_hash_size(&route_cache) >= ROUTE_CACHE_MAX)
+    mtev_hash_delete_all(&route_cache, free, noit_fq_route_free);
+  route = malloc(sizeof(*route) + rklen);
+  memcpy(route->routingkey, routingkey, rklen + 1);
+  strlcpy(route->uuid_formatted, uuid_formatted, sizeof(route->uuid_formatted));
+  route->ring_hash = mtev_hash__hash(uuid_formatted, strlen(uuid_formatted), 0);
+  mtev_hash_replace(&route_cache, strndup(field, fieldlen), fieldlen, route,
+                    free, noit_fq_route_free);
+  return route;
+}
+
+static void
+noit_fq_publish(struct fq_driver *driver, int host, fq_msg *msg, size_t len) {
+  if(fq_client_publish(driver->client[host], msg) == 1) {
+    BUMPSTAT(host, publications);
+    mtev_atomic_add64(&driver->stats[host].publish_bytes, len);
+  }
+  else {
+    BUMPSTAT(host, client_tx_drop);
+  }
+}
+
 static iep_thread_driver_t *noit_fq_allocate(mtev_conf_section_t conf) {
   char *hostname, *cp, *brk, *round_robin;
   int i;
@@ -232,6 +375,11 @@ static iep_thread_driver_t *noit_fq_allocate(mtev_conf_section_t conf) {
       global_fq_ctx.round_robin = 0;
     }
   }
+  if(!mtev_conf_get_int(conf, "shard_replicas", &global_fq_ctx.shard_replicas))
+    global_fq_ctx.shard_replicas = 0;
+  if(!mtev_conf_get_int(conf, "shard_vnodes", &global_fq_ctx.shard_vnodes) ||
+     global_fq_ctx.shard_vnodes < 1)
+    global_fq_ctx.shard_vnodes = SHARD_VNODES_DEFAULT;
   (void)mtev_conf_get_string(conf, "hostname", &hostname);
   if(!hostname) hostname = strdup("127.0.0.1");
   for(cp = hostname; cp; cp = strchr(cp+1, ',')) global_fq_ctx.nhosts++;
@@ -258,6 +406,16 @@ static iep_thread_driver_t *noit_fq_allocate(mtev_conf_section_t conf) {
   }
   free(hostname);
 
+  if(global_fq_ctx.shard_replicas > 0) {
+    if(global_fq_ctx.round_robin) {
+      mtevL(nlerr, "fq: shard_replicas overrides round_robin\n");
+      global_fq_ctx.round_robin = 0;
+    }
+    if(global_fq_ctx.shard_replicas > global_fq_ctx.nhosts)
+      global_fq_ctx.shard_replicas = global_fq_ctx.nhosts;
+    noit_fq_build_ring(&global_fq_ctx);
+  }
+
   return (iep_thread_driver_t *)&global_fq_ctx;
 }
 
@@ -270,15 +428,41 @@ static int noit_fq_disconnect(iep_thread_driver_t *d) {
   return 0;
 }
 
+/* Choose the round robin host for the next message (or batch) and
+ * advance past it.  Returns -1 if every host is down. */
 static int
-noit_fq_submit(iep_thread_driver_t *dr,
-               const char *payload, size_t payloadlen) {
+noit_fq_round_robin_pick(struct fq_driver *driver) {
+  int checked = 0, host = -1;
+  time_t cur_time = time(NULL);
+  while (1) {
+    if (noit_fq_host_available(driver, global_fq_ctx.round_robin_target, cur_time)) {
+      host = global_fq_ctx.round_robin_target;
+      break;
+    }
+    global_fq_ctx.round_robin_target = (global_fq_ctx.round_robin_target+1) % driver->nhosts;
+    checked++;
+    if (checked == driver->nhosts) {
+      /* This means everybody is down.... just try to send to whatever fq
+         we're pointing at */
+      break;
+    }
+  }
+  global_fq_ctx.round_robin_target = (global_fq_ctx.round_robin_target+1) % driver->nhosts;
+  return host;
+}
+
+/* rr_host is the round robin pick when round robin is enabled */
+static int
+noit_fq_submit_one(struct fq_driver *driver,
+                   const char *payload, size_t payloadlen, int rr_host) {
   int i;
-  struct fq_driver *driver = (struct fq_driver *)dr;
   const char *routingkey = driver->routingkey;
+  const char *uuid_formatted = NULL;
   mtev_hash_table *filtered_metrics;
   char uuid_formatted_str[UUID_STR_LEN+1];
   bool is_bundle = false, is_metric = false, send = false;
+  int targets[MAX_HOSTS], ntargets = 0;
+  fq_route_t *route = NULL;
   fq_msg *msg;
   char *metric = NULL;
 
@@ -289,26 +473,45 @@ noit_fq_submit(iep_thread_driver_t *dr,
      (*payload == 'F' && payload[1] == '1') ||
      (*payload == 'B' && (payload[1] == '1' || payload[1] == '2'))) {
     char uuid_str[32 * 2 + 1];
-    int account_id, check_id;
+    int account_id, check_id, fieldlen = 0;
+    const char *field;
+    bool need_metric;
 
     if (*payload == 'B') is_bundle = true;
     else if ((*payload == 'H') || (*payload == 'M')) {
       is_metric = true;
     }
-
-    if(extract_uuid_from_jlog(payload, payloadlen,
-                              &account_id, &check_id, uuid_str,
-                              uuid_formatted_str, &metric)) {
-      if(*routingkey) {
-        char *replace;
-        int newlen = strlen(driver->routingkey) + 1 + sizeof(uuid_str) + 2 * 32;
-        replace = alloca(newlen);
-        snprintf(replace, newlen, "%s.%x.%x.%d.%d%s", driver->routingkey,
-                 account_id%16, (account_id/16)%16, account_id,
-                 check_id, uuid_str);
-        routingkey = replace;
+    need_metric = is_metric && global_fq_ctx.filtered_exchange[0] &&
+                  filtered_metrics_exist;
+
+    field = jlog_uuid_field(payload, payloadlen, &fieldlen);
+    if(field) {
+      void *vroute;
+      if(mtev_hash_retrieve(&route_cache, field, fieldlen, &vroute))
+        route = vroute;
+    }
+    if(!route || need_metric) {
+      if(extract_uuid_from_jlog(payload, payloadlen,
+                                &account_id, &check_id, uuid_str,
+                                uuid_formatted_str, &metric)) {
+        uuid_formatted = uuid_formatted_str;
+        if(!route && field) {
+          char *replace = (char *)"";
+          if(*routingkey) {
+            int newlen = strlen(driver->routingkey) + 1 + sizeof(uuid_str) + 2 * 32;
+            replace = alloca(newlen);
+            snprintf(replace, newlen, "%s.%x.%x.%d.%d%s", driver->routingkey,
+                     account_id%16, (account_id/16)%16, account_id,
+                     check_id, uuid_str);
+          }
+          route = noit_fq_route_cache(field, fieldlen, replace, uuid_formatted_str);
+        }
       }
     }
+    if(route) {
+      if(*routingkey) routingkey = route->routingkey;
+      uuid_formatted = route->uuid_formatted;
+    }
   }
 
   /* Let through any messages that aren't metrics or bundles */
@@ -329,68 +532,43 @@ noit_fq_submit(iep_thread_driver_t *dr,
   fq_msg_route(msg, routingkey, strlen(routingkey));
   fq_msg_id(msg, NULL);
 
-  if (global_fq_ctx.round_robin) {
-    int checked = 0, good = 0;
-    time_t cur_time;
-    while (1) {
-      if (!global_fq_ctx.down_host[global_fq_ctx.round_robin_target]) {
-        good = 1;
-        break;
-      }
-      cur_time = time(NULL);
-      if (cur_time - global_fq_ctx.last_error[global_fq_ctx.round_robin_target] >= 10) {
-        global_fq_ctx.down_host[global_fq_ctx.round_robin_target] = false;
-        good = 1;
-        break;
-      } 
-      global_fq_ctx.round_robin_target = (global_fq_ctx.round_robin_target+1) % driver->nhosts;
-      checked++;
-      if (checked == driver->nhosts) {
-        /* This means everybody is down.... just try to send to whatever fq
-           we're pointing at */
-        break;
-      }
+  if (global_fq_ctx.shard_replicas > 0) {
+    /* Messages that don't belong to a check go to every host */
+    if(route) {
+      ntargets = noit_fq_shard_targets(driver, route->ring_hash, targets);
+      BUMPSTAT(targets[0], shard_primary);
     }
-    if (good) {
-      if(fq_client_publish(driver->client[global_fq_ctx.round_robin_target], msg) == 1) {
-        BUMPSTAT(global_fq_ctx.round_robin_target, publications);
-      }
-      else {
-        BUMPSTAT(global_fq_ctx.round_robin_target, client_tx_drop);
-      }
+    else {
+      for(i=0; i<driver->nhosts; i++) targets[ntargets++] = i;
+    }
+    for(i=0; i<ntargets; i++)
+      noit_fq_publish(driver, targets[i], msg, payloadlen);
+  }
+  else if (global_fq_ctx.round_robin) {
+    if (rr_host >= 0) {
+      noit_fq_publish(driver, rr_host, msg, payloadlen);
     }
     /* Go ahead and try to publish to the hosts that are down, just in
        case they've come back up. This should help minimize lost messages */
     for (i=0; i<driver->nhosts; i++) {
       if (global_fq_ctx.down_host[i]) {
-        if(fq_client_publish(driver->client[i], msg) == 1) {
-          BUMPSTAT(i, publications);
-        }
-        else {
-          BUMPSTAT(i, client_tx_drop);
-        }
+        noit_fq_publish(driver, i, msg, payloadlen);
       }
     }
-    global_fq_ctx.round_robin_target = (global_fq_ctx.round_robin_target+1) % driver->nhosts;
   }
   else {
     for(i=0; i<driver->nhosts; i++) {
-      if(fq_client_publish(driver->client[i], msg) == 1) {
-        BUMPSTAT(i, publications);
-      }
-      else {
-        BUMPSTAT(i, client_tx_drop);
-      }
+      noit_fq_publish(driver, i, msg, payloadlen);
     }
   }
 
   fq_msg_deref(msg);
-  if (!send) {
-    if(mtev_hash_retrieve(&filtered_checks_hash, uuid_formatted_str, strlen(uuid_formatted_str), (void**)&filtered_metrics)) {
+  if (!send && uuid_formatted) {
+    if(mtev_hash_retrieve(&filtered_checks_hash, uuid_formatted, strlen(uuid_formatted), (void**)&filtered_metrics)) {
       if (is_bundle || (is_metric && mtev_hash_size(filtered_metrics) == 0)) {
         send = true;
       }
-      else if (is_metric) {
+      else if (is_metric && metric) {
         void *tmp;
         if (mtev_hash_retrieve(filtered_metrics, metric, strlen(metric), &tmp)) {
           send = true;
@@ -406,13 +584,13 @@ noit_fq_submit(iep_thread_driver_t *dr,
     mtevL(mtev_debug, "route[%s] -> %s\n", driver->filtered_exchange, routingkey);
     fq_msg_route(msg2, routingkey, strlen(routingkey));
     fq_msg_id(msg2, NULL);
-    for(i=0; i<driver->nhosts; i++) {
-      if(fq_client_publish(driver->client[i], msg2) == 1) {
-        BUMPSTAT(i, publications);
-      }
-      else {
-        BUMPSTAT(i, client_tx_drop);
-      }
+    if(ntargets > 0) {
+      for(i=0; i<ntargets; i++)
+        noit_fq_publish(driver, targets[i], msg2, payloadlen);
+    }
+    else {
+      for(i=0; i<driver->nhosts; i++)
+        noit_fq_publish(driver, i, msg2, payloadlen);
     }
     fq_msg_deref(msg2);
   }
@@ -420,6 +598,29 @@ noit_fq_submit(iep_thread_driver_t *dr,
   return 0;
 }
 
+static int
+noit_fq_submit(iep_thread_driver_t *dr,
+               const char *payload, size_t payloadlen) {
+  struct fq_driver *driver = (struct fq_driver *)dr;
+  int rr_host = global_fq_ctx.round_robin ? noit_fq_round_robin_pick(driver) : -1;
+  return noit_fq_submit_one(driver, payload, payloadlen, rr_host);
+}
+
+/* A batch is published as a unit: in round robin mode the whole batch
+ * goes to one host, so host availability is checked once per batch
+ * rather than once per message, and the batch's messages are queued
+ * to that host's client back to back. */
+static int
+noit_fq_submit_batch(iep_thread_driver_t *dr, const char **payloads,
+                     size_t *payloadlens, int count) {
+  struct fq_driver *driver = (struct fq_driver *)dr;
+  int i, sent = 0;
+  int rr_host = global_fq_ctx.round_robin ? noit_fq_round_robin_pick(driver) : -1;
+  for(i=0; i<count; i++)
+    if(noit_fq_submit_one(driver, payloads[i], payloadlens[i], rr_host) == 0) sent++;
+  return sent;
+}
+
 static void noit_fq_deallocate(iep_thread_driver_t *d) {
   /* No allocations are actually done in allocate...
    * We just use on single global context, so nothing to free here.
@@ -491,7 +692,8 @@ mq_driver_t mq_driver_fq = {
   noit_fq_submit,
   noit_fq_disconnect,
   noit_fq_deallocate,
-  noit_fq_set_filters
+  noit_fq_set_filters,
+  noit_fq_submit_batch
 };
 
 static int noit_fq_driver_config(mtev_dso_generic_t *self, mtev_hash_table *o) {
@@ -511,11 +713,24 @@ noit_console_show_fq(mtev_console_closure_t ncct,
   nc_printf(ncct, " == FQ ==\n");
   nc_printf(ncct, " Allocation Failures:   %llu\n", global_fq_ctx.allocation_failures);
   nc_printf(ncct, " Messages:              %llu\n", global_fq_ctx.msg_cnt);
+  if(global_fq_ctx.shard_replicas > 0)
+    nc_printf(ncct, " Sharding:              %d replicas, %d vnodes/host\n",
+              global_fq_ctx.shard_replicas, global_fq_ctx.shard_vnodes);
+  else if(global_fq_ctx.round_robin)
+    nc_printf(ncct, " Sharding:              round robin\n");
   for(i=0; i<global_fq_ctx.nhosts; i++) {
     fq_stats_t *s = &global_fq_ctx.stats[i];
     nc_printf(ncct, " === %s:%d ===\n", global_fq_ctx.hostname[i],
               global_fq_ctx.ports[i]);
     nc_printf(ncct, "  publications:         %llu\n", s->publications);
+    nc_printf(ncct, "  publish_bytes:        %llu\n", s->publish_bytes);
+    nc_printf(ncct, "  publications/s:       %0.1f\n", s->publication_rate);
+    nc_printf(ncct, "  bytes/s:              %0.1f\n", s->byte_rate);
+    if(global_fq_ctx.shard_replicas > 0)
+      nc_printf(ncct, "  shard_primary:        %llu\n", s->shard_primary);
+    if(global_fq_ctx.down_host[i])
+      nc_printf(ncct, "  marked down:          %ds ago\n",
+                (int)(time(NULL) - global_fq_ctx.last_error[i]));
     nc_printf(ncct, "  client_tx_drop:       %llu\n", s->client_tx_drop);
     nc_printf(ncct, "  error_messages:       %llu\n", s->error_messages);
     nc_printf(ncct, "  no_exchange:          %llu\n", s->no_exchange);
@@ -563,14 +778,21 @@ static void process_fq_status(char *key, uint32_t value, void *cl) {
       break;
   }
 }
+#define FQ_STATUS_INTERVAL 5
 static int
 fq_status_checker(eventer_t e, int mask, void *closure, struct timeval *now) {
   int i;
   for(i=0; i<global_fq_ctx.nhosts; i++) {
+    fq_stats_t *s = &global_fq_ctx.stats[i];
+    uint64_t pubs = s->publications, bytes = s->publish_bytes;
     fq_client_status(global_fq_ctx.client[i], process_fq_status,
-                     (void *)&global_fq_ctx.stats[i]);
+                     (void *)s);
+    s->publication_rate = (double)(pubs - s->last_publications) / FQ_STATUS_INTERVAL;
+    s->byte_rate = (double)(bytes - s->last_publish_bytes) / FQ_STATUS_INTERVAL;
+    s->last_publications = pubs;
+    s->last_publish_bytes = bytes;
   }
-  eventer_add_in_s_us(fq_status_checker, NULL, 5, 0);
+  eventer_add_in_s_us(fq_status_checker, NULL, FQ_STATUS_INTERVAL, 0);
   return 0;
 }
 
@@ -578,6 +800,7 @@ static int noit_fq_driver_init(mtev_dso_generic_t *self) {
   if(!nlerr) nlerr = mtev_log_stream_find("error/fq_driver");
   if(!nlerr) nlerr = mtev_error;
   mtev_hash_init(&filtered_checks_hash);
+  mtev_hash_init_locks(&route_cache, MTEV_HASH_DEFAULT_SIZE, MTEV_HASH_LOCK_MODE_MUTEX);
   stratcon_iep_mq_driver_register("fq", &mq_driver_fq);
   register_console_fq_commands();
   eventer_add_in_s_us(fq_status_checker, NULL, 0, 0);
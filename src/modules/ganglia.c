@@ -49,9 +49,11 @@
 #include "noit_check.h"
 #include "noit_check_tools.h"
 #include "noit_mtev_bridge.h"
+#include "noit_udp.h"
 
 #define GANGLIA_DEFAULT_MCAST_ADDR "239.2.11.71"
 #define GANGLIA_DEFAULT_MCAST_PORT 8649
+#define GANGLIA_MTU 1500 /* 1500 is correct; see __GANGLIA_MTU */
 
 typedef struct _mod_config {
   mtev_hash_table *options;
@@ -192,70 +194,72 @@ ganglia_process_dgram(noit_check_t *check, void *closure) {
 
 static int noit_ganglia_handler(eventer_t e, int mask, void *closure,
                              struct timeval *now) {
-  char packet[1500]; /* 1500 is correct; see __GANGLIA_MTU */
-  int packet_len = sizeof(packet);
-  noit_module_t *self = (noit_module_t *)closure;
+  noit_udp_receiver_t *rx = (noit_udp_receiver_t *)closure;
+  noit_module_t *self = noit_udp_receiver_closure(rx);
 
   while(1) {
-    struct ganglia_dgram pkt;
-    int inlen;
-    void *payload = &packet;
-    char *host, *name;
-    int *len;
-    uint32_t *type;
-
-    inlen = recvfrom(eventer_get_fd(e), packet, packet_len, 0, NULL, 0);
-
-    if(inlen < 0) {
-      if(errno == EAGAIN) break; /* out of data to read, hand it back to eventer
-                                    and wait to be scheduled again */
-      mtevLT(noit_error, now, "ganglia: recvfrom: %s\n", strerror(errno));
+    noit_udp_packet_t *pkts;
+    int i, npkts;
+
+    npkts = noit_udp_receiver_recv(rx, eventer_get_fd(e), &pkts);
+    if(npkts <= 0) {
+      if(npkts < 0) /* out of data to read, hand it back to eventer
+                       and wait to be scheduled again */
+        mtevLT(noit_error, now, "ganglia: recv: %s\n", strerror(errno));
       break;
     }
 
-    type = payload;
-    *type = ntohl(*type);
-    payload += 4;
+    for(i=0; i<npkts; i++) {
+      struct ganglia_dgram pkt;
+      void *payload = pkts[i].payload;
+      char *host, *name;
+      int *len;
+      uint32_t *type;
 
-    len = payload;
-    *len = ntohl(*len);
-    if(!*len) {
-      mtevL(noit_error, "ganglia: empty host\n");
-      return -1;
-    }
-    payload += 4;
-    host = payload;
-    payload += (*len + 3) & ~0x03;
-
-    len = payload;
-    *len = ntohl(*len);
-    if(!*len) {
-      mtevL(noit_error, "ganglia: empty name\n");
-      return -1;
+      type = payload;
+      *type = ntohl(*type);
+      payload += 4;
+
+      len = payload;
+      *len = ntohl(*len);
+      if(!*len) {
+        mtevL(noit_error, "ganglia: empty host\n");
+        continue;
+      }
+      payload += 4;
+      host = payload;
+      payload += (*len + 3) & ~0x03;
+
+      len = payload;
+      *len = ntohl(*len);
+      if(!*len) {
+        mtevL(noit_error, "ganglia: empty name\n");
+        continue;
+      }
+      payload += 4;
+      name = payload;
+      payload += (*len + 3) & ~0x03;
+      *len = 0; /* add null char to end of host string */
+
+      /* skip the spoof boolean */
+      payload += 4;
+
+      /* skip the format string */
+      len = payload;
+      *len = ntohl(*len);
+      payload += 4;
+      payload += (*len + 3) & ~0x03;
+      *len = 0; /* add null char to end of name string */
+
+      pkt.self = self;
+      pkt.payload = payload;
+      pkt.len = pkts[i].len;
+      pkt.type = *type;
+      pkt.name = name;
+
+      if(!noit_poller_target_do(host, ganglia_process_dgram, &pkt))
+        mtevL(noit_error, "ganglia: no checks from host: %s\n", host);
     }
-    payload += 4;
-    name = payload;
-    payload += (*len + 3) & ~0x03;
-    *len = 0; /* add null char to end of host string */
-
-    /* skip the spoof boolean */
-    payload += 4;
-
-    /* skip the format string */
-    len = payload;
-    *len = ntohl(*len);
-    payload += 4;
-    payload += (*len + 3) & ~0x03;
-    *len = 0; /* add null char to end of name string */
-
-    pkt.self = self;
-    pkt.payload = payload;
-    pkt.len = inlen;
-    pkt.type = *type;
-    pkt.name = name;
-
-    if(!noit_poller_target_do(host, ganglia_process_dgram, &pkt))
-      mtevL(noit_error, "ganglia: no checks from host: %s\n", host);
   }
   return EVENTER_READ | EVENTER_EXCEPTION;
 }
@@ -349,8 +353,9 @@ static int noit_ganglia_init(noit_module_t *self) {
   struct sockaddr_in skaddr;
   struct sockaddr_in6 skaddr6;
   const char *multiaddr, *multiaddr6;
-  int portint=0;
+  int portint=0, batch_size = 32;
   unsigned short port;
+  noit_udp_receiver_t *rx;
 
   conf->asynch_metrics = mtev_true;
   if(mtev_hash_retr_str(conf->options,
@@ -376,28 +381,20 @@ static int noit_ganglia_init(noit_module_t *self) {
 
   conf->ipv4_fd = conf->ipv6_fd = -1;
 
-  /* ipv4 socket and binding */
-  conf->ipv4_fd = socket(PF_INET, NE_SOCK_CLOEXEC|SOCK_DGRAM, IPPROTO_UDP);
-  if(conf->ipv4_fd < 0) {
-    close(conf->ipv4_fd);
-    mtevL(noit_error, "ganglia: ipv4 socket failed: %s\n", strerror(errno));
-    return -1;
-  }
-
-  if(eventer_set_fd_nonblocking(conf->ipv4_fd)) {
-    close(conf->ipv4_fd);
-    mtevL(noit_error, "ganglia: could not set ipv4 socket non-blocking: %s\n", strerror(errno));
-    return -1;
-  }
+  if(mtev_hash_retr_str(conf->options,
+                         "batch_size", strlen("batch_size"),
+                         (const char**)&config_val))
+    batch_size = atoi(config_val);
 
-  /* ipv4 binding */
+  /* ipv4 socket and binding */
   memset(&skaddr, 0, sizeof(skaddr));
   skaddr.sin_family = AF_INET;
   skaddr.sin_addr.s_addr = htonl(INADDR_ANY);
   skaddr.sin_port = htons(port);
 
-  if(bind(conf->ipv4_fd, (struct sockaddr *)&skaddr, sizeof(skaddr))) {
-    close(conf->ipv4_fd);
+  conf->ipv4_fd = noit_udp_bind((struct sockaddr *)&skaddr, sizeof(skaddr),
+                                mtev_false);
+  if(conf->ipv4_fd < 0) {
     mtevL(noit_error, "ganglia: ipv4 binding failed: %s\n", strerror(errno));
     return -1;
   }
@@ -415,8 +412,11 @@ static int noit_ganglia_init(noit_module_t *self) {
     return -1;
   }
 
+  /* ganglia routes on the host in the payload, not the source address */
   eventer_t newe;
-  newe = eventer_alloc_fd(noit_ganglia_handler, self, conf->ipv4_fd,
+  rx = noit_udp_receiver_alloc("ganglia/ipv4", NULL, batch_size,
+                               GANGLIA_MTU, self);
+  newe = eventer_alloc_fd(noit_ganglia_handler, rx, conf->ipv4_fd,
                           EVENTER_READ | EVENTER_EXCEPTION);
   eventer_add(newe);
   mtevL(noit_debug, "ganglia: Added ipv4 handler!\n");
@@ -434,30 +434,16 @@ static int noit_ganglia_init(noit_module_t *self) {
     /* ganglia doesn't have a default ipv6 multicast */
     multiaddr6 = NULL;
 
-  /* ipv6 socket, nonblocking */
-  if(multiaddr6) { 
-    conf->ipv6_fd = socket(AF_INET6, NE_SOCK_CLOEXEC|SOCK_DGRAM, IPPROTO_UDP);
-    if(conf->ipv6_fd < 0) {
-      mtevL(noit_error, "ganglia: IPv6 socket creation failed: %s\n", strerror(errno));
-    }
-    else if(eventer_set_fd_nonblocking(conf->ipv6_fd)) {
-      mtevL(noit_error, "ganglia: could not set socket non-blocking: %s\n", strerror(errno));
-      close(conf->ipv6_fd);
-      conf->ipv6_fd =  -1;
-    }
-  }
-
-  /* ipv6 binding */
-  if(conf->ipv6_fd > 0) {
+  /* ipv6 socket and binding */
+  if(multiaddr6) {
     memset(&skaddr6, 0, sizeof(skaddr6));
     skaddr6.sin6_family = AF_INET6;
     skaddr6.sin6_addr = in6addr_any;
     skaddr6.sin6_port = htons(port);
-    if(bind(conf->ipv6_fd, (struct sockaddr *)&skaddr6, sizeof(skaddr6))) {
+    conf->ipv6_fd = noit_udp_bind((struct sockaddr *)&skaddr6,
+                                  sizeof(skaddr6), mtev_false);
+    if(conf->ipv6_fd < 0)
       mtevL(noit_error, "ganglia: ipv6 binding failed: %s\n", strerror(errno));
-      close(conf->ipv6_fd);
-      conf->ipv6_fd = -1;
-    }
   }
 
   /* join ipv6 multicast */
@@ -477,7 +463,9 @@ static int noit_ganglia_init(noit_module_t *self) {
 
   if(conf->ipv6_fd > 0) {
     eventer_t newe;
-    newe = eventer_alloc_fd(noit_ganglia_handler, self, conf->ipv6_fd,
+    rx = noit_udp_receiver_alloc("ganglia/ipv6", NULL, batch_size,
+                                 GANGLIA_MTU, self);
+    newe = eventer_alloc_fd(noit_ganglia_handler, rx, conf->ipv6_fd,
                             EVENTER_READ | EVENTER_EXCEPTION);
     eventer_add(newe);
     mtevL(noit_debug, "ganglia: Added ipv6 handler!\n");
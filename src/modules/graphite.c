@@ -0,0 +1,990 @@
+/*
+ * Copyright (c) 2017, Circonus, Inc. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above
+ *       copyright notice, this list of conditions and the following
+ *       disclaimer in the documentation and/or other materials provided
+ *       with the distribution.
+ *     * Neither the name Circonus, Inc. nor the names
+ *       of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written
+ *       permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <mtev_defines.h>
+
+#include <stdio.h>
+#include <unistd.h>
+#include <errno.h>
+#include <ctype.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <mtev_hash.h>
+#include <mtev_atomic.h>
+
+#include "noit_module.h"
+#include "noit_check.h"
+#include "noit_check_tools.h"
+#include "noit_mtev_bridge.h"
+
+/* A native receiver for the carbon (graphite) plaintext and pickle
+ * protocols.  Metrics are routed to the graphite checks whose target is
+ * the sender's address.  Each connection is serviced by the eventer thread
+ * that accepted it; every read is parsed in place and applied to each
+ * check with a single noit_stats_set_metric_batch().
+ */
+
+#define GRAPHITE_MAX_CHECKS 8
+#define GRAPHITE_READ_SIZE 65536
+#define DEFAULT_MAX_BUFFER (1024 * 1024)
+/* refuse pickle memo indexes beyond this rather than allocate for them */
+#define GRAPHITE_MAX_MEMO (1024 * 1024)
+
+static mtev_log_stream_t nlerr = NULL;
+static mtev_log_stream_t nldeb = NULL;
+
+typedef struct _mod_config {
+  mtev_hash_table *options;
+  mtev_boolean asynch_metrics;
+  size_t max_buffer;
+} graphite_mod_config_t;
+
+typedef struct {
+  noit_module_t *self;
+  mtev_atomic32_t stats_count;  /* added to by the listener threads */
+} graphite_closure_t;
+
+typedef struct {
+  noit_module_t *self;
+  mtev_boolean pickle;
+} graphite_listener_t;
+
+typedef struct {
+  const char *name;      /* NULL: at name_off in the connection's arena */
+  size_t name_off;
+  double value;
+  int64_t whence;        /* -1 if the sender didn't say */
+} graphite_metric_t;
+
+typedef enum {
+  PK_NONE, PK_NUM, PK_STR, PK_TUPLE, PK_LIST
+} pk_kind_t;
+
+/* A decoded pickle value.  Tuples list their members in the kids array;
+ * lists are never materialized, their items are taken as metrics as
+ * they are appended. */
+typedef struct {
+  pk_kind_t kind;
+  int n;
+  union {
+    double num;
+    struct { const char *s; int len; } str;
+    int first;
+  } u;
+} pk_val_t;
+
+typedef struct {
+  pk_val_t *vals;
+  int nvals, vals_allocd;
+  int *stack;
+  int nstack, stack_allocd;
+  int *kids;
+  int nkids, kids_allocd;
+  int *marks;
+  int nmarks, marks_allocd;
+  int *memo;
+  int nmemo, memo_allocd, memo_count;
+} pk_state_t;
+
+typedef struct {
+  noit_module_t *self;
+  mtev_boolean pickle;
+  char ip[INET6_ADDRSTRLEN];
+
+  /* checks for (ip, module); refreshed when the poller's index changes */
+  uint32_t generation;
+  noit_check_t *checks[GRAPHITE_MAX_CHECKS];
+  int nchecks;
+  mtev_boolean checks_truncated;
+
+  char *buf;
+  size_t len, allocd;
+  char *arena;
+  size_t arena_len, arena_allocd;
+  graphite_metric_t *metrics;
+  int nmetrics, metrics_allocd;
+  noit_stats_batch_metric_t *batch;
+  int batch_allocd;
+  pk_state_t pk;
+} graphite_conn_t;
+
+#define GROW(ptr, cnt, allocd, need) do { \
+  if((need) > (allocd)) { \
+    int __n = (allocd) ? (allocd) : 16; \
+    while(__n < (need)) __n *= 2; \
+    (ptr) = realloc((ptr), __n * sizeof(*(ptr))); \
+    (allocd) = __n; \
+  } \
+} while(0)
+
+static mtev_boolean
+graphite_check_asynch(noit_module_t *self, noit_check_t *check) {
+  const char *config_val;
+  graphite_mod_config_t *conf = noit_module_get_userdata(self);
+  mtev_boolean is_asynch = conf->asynch_metrics;
+  if(mtev_hash_retr_str(check->config,
+                        "asynch_metrics", strlen("asynch_metrics"),
+                        (const char **)&config_val)) {
+    if(!strcasecmp(config_val, "false") || !strcasecmp(config_val, "off"))
+      is_asynch = mtev_false;
+  }
+
+  if(is_asynch) check->flags |= NP_SUPPRESS_METRICS;
+  else check->flags &= ~NP_SUPPRESS_METRICS;
+  return is_asynch;
+}
+
+static graphite_metric_t *
+graphite_metric_add(graphite_conn_t *c) {
+  GROW(c->metrics, c->nmetrics, c->metrics_allocd, c->nmetrics + 1);
+  return &c->metrics[c->nmetrics++];
+}
+
+static int
+graphite_apply_check(noit_check_t *check, void *closure) {
+  graphite_conn_t *c = closure;
+  graphite_closure_t *ccl;
+  const char *config_val;
+  int i, n = 0, set, max_age = 0;
+  int64_t cutoff = 0;
+
+  if(!check || strcmp(check->module, c->self->hdr.name)) return 0;
+  /* We are passive, so we don't do anything for transient checks */
+  if(check->flags & NP_TRANSIENT) return 0;
+
+  if(mtev_hash_retr_str(check->config, "max_age", strlen("max_age"),
+                        &config_val))
+    max_age = atoi(config_val);
+  if(max_age > 0) cutoff = (int64_t)time(NULL) - max_age;
+
+  GROW(c->batch, 0, c->batch_allocd, c->nmetrics);
+  for(i=0; i<c->nmetrics; i++) {
+    graphite_metric_t *m = &c->metrics[i];
+    if(max_age > 0 && m->whence >= 0 && m->whence < cutoff) continue;
+    c->batch[n].name = m->name;
+    c->batch[n].type = METRIC_DOUBLE;
+    c->batch[n].value = &m->value;
+    n++;
+  }
+  set = noit_stats_set_metric_batch(check, c->batch, n,
+                                    graphite_check_asynch(c->self, check));
+  ccl = check->closure;
+  if(ccl && set) mtev_atomic_add32(&ccl->stats_count, set);
+  return 1;
+}
+
+static void
+graphite_apply(graphite_conn_t *c) {
+  uint32_t generation;
+  int i;
+
+  if(c->nmetrics == 0) return;
+  for(i=0; i<c->nmetrics; i++)
+    if(c->metrics[i].name == NULL)
+      c->metrics[i].name = c->arena + c->metrics[i].name_off;
+
+  /* read the generation first so a concurrent change leaves us stale
+   * for one more round rather than wrong */
+  generation = noit_poller_target_ip_generation();
+  if(generation != c->generation) {
+    c->generation = generation;
+    c->nchecks = noit_poller_lookup_by_ip_module(c->ip, c->self->hdr.name,
+                                                 c->checks, GRAPHITE_MAX_CHECKS);
+    c->checks_truncated = (c->nchecks == GRAPHITE_MAX_CHECKS);
+  }
+  if(c->checks_truncated)
+    noit_poller_target_ip_do(c->ip, graphite_apply_check, c);
+  else
+    for(i=0; i<c->nchecks; i++) graphite_apply_check(c->checks[i], c);
+  mtevL(nldeb, "graphite: %d metrics from %s -> %d checks\n",
+        c->nmetrics, c->ip, c->nchecks);
+  c->nmetrics = 0;
+  c->arena_len = 0;
+}
+
+/* name value [timestamp]; the line is NUL terminated and the name is
+ * terminated in place. */
+static void
+graphite_parse_line(graphite_conn_t *c, char *line) {
+  graphite_metric_t *m;
+  char *name, *ep;
+  double value;
+  int64_t whence = -1;
+
+  while(isspace((unsigned char)*line)) line++;
+  if(!*line) return;
+  name = line;
+  while(*line && !isspace((unsigned char)*line)) line++;
+  if(!*line) goto bad;
+  *line++ = '\0';
+  value = strtod(line, &ep);
+  if(ep == line || (*ep && !isspace((unsigned char)*ep))) goto bad;
+  line = ep;
+  while(isspace((unsigned char)*line)) line++;
+  if(*line) {
+    whence = strtoll(line, &ep, 10);
+    if(ep == line) goto bad;
+  }
+  m = graphite_metric_add(c);
+  m->name = name;
+  m->value = value;
+  m->whence = whence;
+  return;
+
+ bad:
+  mtevL(nldeb, "graphite: bad line from %s\n", c->ip);
+}
+
+static size_t
+graphite_process_plaintext(graphite_conn_t *c, mtev_boolean eof) {
+  char *cp = c->buf, *end = c->buf + c->len, *nl;
+
+  while(cp < end && (nl = memchr(cp, '\n', end - cp)) != NULL) {
+    *nl = '\0';
+    if(nl > cp && nl[-1] == '\r') nl[-1] = '\0';
+    graphite_parse_line(c, cp);
+    cp = nl + 1;
+  }
+  if(eof && cp < end) {
+    *end = '\0'; /* the buffer always has room for this */
+    graphite_parse_line(c, cp);
+    cp = end;
+  }
+  return cp - c->buf;
+}
+
+/* Pickle */
+
+static int
+pk_push_val(pk_state_t *pk, pk_kind_t kind) {
+  pk_val_t *v;
+  GROW(pk->vals, pk->nvals, pk->vals_allocd, pk->nvals + 1);
+  GROW(pk->stack, pk->nstack, pk->stack_allocd, pk->nstack + 1);
+  v = &pk->vals[pk->nvals];
+  memset(v, 0, sizeof(*v));
+  v->kind = kind;
+  pk->stack[pk->nstack++] = pk->nvals;
+  return pk->nvals++;
+}
+
+static void
+pk_push_num(pk_state_t *pk, double num) {
+  int idx = pk_push_val(pk, PK_NUM);
+  pk->vals[idx].u.num = num;
+}
+
+static void
+pk_push_str(pk_state_t *pk, const char *s, int len) {
+  int idx = pk_push_val(pk, PK_STR);
+  pk->vals[idx].u.str.s = s;
+  pk->vals[idx].u.str.len = len;
+}
+
+/* make a tuple of the top n stack entries */
+static void
+pk_tuple(pk_state_t *pk, int n) {
+  int i, idx, first;
+  GROW(pk->kids, pk->nkids, pk->kids_allocd, pk->nkids + n);
+  first = pk->nkids;
+  for(i=0; i<n; i++) pk->kids[pk->nkids++] = pk->stack[pk->nstack - n + i];
+  pk->nstack -= n;
+  idx = pk_push_val(pk, PK_TUPLE);
+  pk->vals[idx].n = n;
+  pk->vals[idx].u.first = first;
+}
+
+static mtev_boolean
+pk_number(pk_state_t *pk, int idx, double *out) {
+  pk_val_t *v = &pk->vals[idx];
+  char buf[64], *ep;
+  if(v->kind == PK_NUM) {
+    *out = v->u.num;
+    return mtev_true;
+  }
+  if(v->kind != PK_STR || v->u.str.len == 0 ||
+     v->u.str.len >= (int)sizeof(buf)) return mtev_false;
+  memcpy(buf, v->u.str.s, v->u.str.len);
+  buf[v->u.str.len] = '\0';
+  *out = strtod(buf, &ep);
+  return (ep != buf);
+}
+
+/* A metric is (path, (timestamp, value)) */
+static void
+pk_emit(graphite_conn_t *c, int idx) {
+  pk_state_t *pk = &c->pk;
+  pk_val_t *t = &pk->vals[idx], *name, *pt;
+  graphite_metric_t *m;
+  double whence, value;
+
+  if(t->kind != PK_TUPLE || t->n != 2) goto bad;
+  name = &pk->vals[pk->kids[t->u.first]];
+  pt = &pk->vals[pk->kids[t->u.first + 1]];
+  if(name->kind != PK_STR || name->u.str.len == 0 ||
+     pt->kind != PK_TUPLE || pt->n != 2) goto bad;
+  if(!pk_number(pk, pk->kids[pt->u.first], &whence) ||
+     !pk_number(pk, pk->kids[pt->u.first + 1], &value)) goto bad;
+
+  GROW(c->arena, c->arena_len, c->arena_allocd,
+       c->arena_len + name->u.str.len + 1);
+  m = graphite_metric_add(c);
+  m->name = NULL;
+  m->name_off = c->arena_len;
+  memcpy(c->arena + c->arena_len, name->u.str.s, name->u.str.len);
+  c->arena_len += name->u.str.len;
+  c->arena[c->arena_len++] = '\0';
+  m->value = value;
+  m->whence = (int64_t)whence;
+  return;
+
+ bad:
+  mtevL(nldeb, "graphite: bad pickled metric from %s\n", c->ip);
+}
+
+static int
+pk_memo_set(pk_state_t *pk, int64_t id) {
+  if(pk->nstack == 0 || id < 0 || id >= GRAPHITE_MAX_MEMO) return -1;
+  GROW(pk->memo, pk->nmemo, pk->memo_allocd, id + 1);
+  while(pk->nmemo <= id) pk->memo[pk->nmemo++] = -1;
+  pk->memo[id] = pk->stack[pk->nstack - 1];
+  pk->memo_count++;
+  return 0;
+}
+
+static int
+pk_memo_get(pk_state_t *pk, int64_t id) {
+  if(id < 0 || id >= pk->nmemo || pk->memo[id] < 0) return -1;
+  GROW(pk->stack, pk->nstack, pk->stack_allocd, pk->nstack + 1);
+  pk->stack[pk->nstack++] = pk->memo[id];
+  return 0;
+}
+
+static uint32_t
+pk_le32(const unsigned char *p) {
+  return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+/* little-endian two's complement, as LONG1/LONG4 */
+static double
+pk_long(const unsigned char *p, uint32_t n) {
+  double v = 0, range = 1;
+  uint32_t i;
+  if(n == 0) return 0;
+  for(i=n; i>0; i--) {
+    v = v * 256.0 + p[i-1];
+    range *= 256.0;
+  }
+  if(p[n-1] & 0x80) v -= range;
+  return v;
+}
+
+/* Decode one pickled frame of carbon metrics.  The opcodes that carbon
+ * senders produce (protocols 0 through 5; 5 adds only BYTEARRAY8 and the
+ * out-of-band buffer opcodes, which a frame on the wire cannot use) are
+ * understood; anything else, including a later protocol, rejects the
+ * frame.  Returns 0 or -1 if the frame is malformed. */
+static int
+graphite_unpickle(graphite_conn_t *c, const char *frame, size_t len) {
+  pk_state_t *pk = &c->pk;
+  const unsigned char *p = (const unsigned char *)frame;
+  const unsigned char *end = p + len, *nl;
+  uint32_t slen;
+  int i, mark;
+
+#define PK_NEED(n) do { if((size_t)(end - p) < (size_t)(n)) return -1; } while(0)
+#define PK_LINE() do { \
+  nl = memchr(p, '\n', end - p); \
+  if(!nl) return -1; \
+} while(0)
+#define PK_POP_MARK() do { \
+  if(pk->nmarks == 0) return -1; \
+  mark = pk->marks[--pk->nmarks]; \
+} while(0)
+
+  pk->nvals = pk->nstack = pk->nkids = pk->nmarks = 0;
+  pk->nmemo = pk->memo_count = 0;
+  while(p < end) {
+    unsigned char op = *p++;
+    switch(op) {
+      case 0x80: /* PROTO */
+        PK_NEED(1);
+        if(p[0] > 5) return -1;
+        p++;
+        break;
+      case 0x95: /* FRAME */
+        PK_NEED(8); p += 8; break;
+      case '(': /* MARK */
+        GROW(pk->marks, pk->nmarks, pk->marks_allocd, pk->nmarks + 1);
+        pk->marks[pk->nmarks++] = pk->nstack;
+        break;
+      case ']': /* EMPTY_LIST */
+        pk_push_val(pk, PK_LIST); break;
+      case ')': /* EMPTY_TUPLE */
+        pk_tuple(pk, 0); break;
+      case 'N': /* NONE */
+        pk_push_val(pk, PK_NONE); break;
+      case 0x88: /* NEWTRUE */
+        pk_push_num(pk, 1); break;
+      case 0x89: /* NEWFALSE */
+        pk_push_num(pk, 0); break;
+      case 'K': /* BININT1 */
+        PK_NEED(1); pk_push_num(pk, p[0]); p += 1; break;
+      case 'M': /* BININT2 */
+        PK_NEED(2); pk_push_num(pk, p[0] | (p[1] << 8)); p += 2; break;
+      case 'J': /* BININT */
+        PK_NEED(4); pk_push_num(pk, (int32_t)pk_le32(p)); p += 4; break;
+      case 0x8a: /* LONG1 */
+        PK_NEED(1); slen = p[0]; p++;
+        PK_NEED(slen); pk_push_num(pk, pk_long(p, slen)); p += slen; break;
+      case 0x8b: /* LONG4 */
+        PK_NEED(4); slen = pk_le32(p); p += 4;
+        PK_NEED(slen); pk_push_num(pk, pk_long(p, slen)); p += slen; break;
+      case 'G': /* BINFLOAT */
+      {
+        union { uint64_t i; double d; } u;
+        PK_NEED(8);
+        u.i = 0;
+        for(i=0; i<8; i++) u.i = (u.i << 8) | p[i];
+        pk_push_num(pk, u.d);
+        p += 8;
+        break;
+      }
+      case 'I': /* INT */
+      case 'L': /* LONG */
+      case 'F': /* FLOAT */
+      {
+        char buf[64];
+        PK_LINE();
+        if(nl - p >= (int)sizeof(buf)) return -1;
+        memcpy(buf, p, nl - p);
+        buf[nl - p] = '\0';
+        pk_push_num(pk, strtod(buf, NULL));
+        p = nl + 1;
+        break;
+      }
+      case 'S': /* STRING, a quoted repr */
+        PK_LINE();
+        if(nl - p < 2 || (*p != '\'' && *p != '"') || nl[-1] != *p)
+          return -1;
+        pk_push_str(pk, (const char *)p + 1, nl - p - 2);
+        p = nl + 1;
+        break;
+      case 'V': /* UNICODE */
+        PK_LINE();
+        pk_push_str(pk, (const char *)p, nl - p);
+        p = nl + 1;
+        break;
+      case 'X': /* BINUNICODE */
+      case 'T': /* BINSTRING */
+      case 'B': /* BINBYTES */
+        PK_NEED(4); slen = pk_le32(p); p += 4;
+        PK_NEED(slen); pk_push_str(pk, (const char *)p, slen); p += slen;
+        break;
+      case 0x8d: /* BINUNICODE8 */
+      case 0x8e: /* BINBYTES8 */
+      case 0x96: /* BYTEARRAY8 */
+        PK_NEED(8);
+        /* a frame is far smaller than 4GB */
+        if(p[4] || p[5] || p[6] || p[7]) return -1;
+        slen = pk_le32(p); p += 8;
+        PK_NEED(slen); pk_push_str(pk, (const char *)p, slen); p += slen;
+        break;
+      case 0x8c: /* SHORT_BINUNICODE */
+      case 'U': /* SHORT_BINSTRING */
+      case 'C': /* SHORT_BINBYTES */
+        PK_NEED(1); slen = p[0]; p++;
+        PK_NEED(slen); pk_push_str(pk, (const char *)p, slen); p += slen;
+        break;
+      case 't': /* TUPLE */
+        PK_POP_MARK();
+        pk_tuple(pk, pk->nstack - mark);
+        break;
+      case 0x85: /* TUPLE1 */
+      case 0x86: /* TUPLE2 */
+      case 0x87: /* TUPLE3 */
+        if(pk->nstack < op - 0x84) return -1;
+        pk_tuple(pk, op - 0x84);
+        break;
+      case 'l': /* LIST */
+        PK_POP_MARK();
+        for(i=mark; i<pk->nstack; i++) pk_emit(c, pk->stack[i]);
+        pk->nstack = mark;
+        pk_push_val(pk, PK_LIST);
+        break;
+      case 'a': /* APPEND */
+        if(pk->nstack < 2 ||
+           pk->vals[pk->stack[pk->nstack - 2]].kind != PK_LIST) return -1;
+        pk_emit(c, pk->stack[--pk->nstack]);
+        break;
+      case 'e': /* APPENDS */
+        PK_POP_MARK();
+        if(mark < 1 || pk->vals[pk->stack[mark - 1]].kind != PK_LIST)
+          return -1;
+        for(i=mark; i<pk->nstack; i++) pk_emit(c, pk->stack[i]);
+        pk->nstack = mark;
+        break;
+      case 'p': /* PUT */
+        PK_LINE();
+        if(pk_memo_set(pk, strtoll((const char *)p, NULL, 10))) return -1;
+        p = nl + 1;
+        break;
+      case 'q': /* BINPUT */
+        PK_NEED(1);
+        if(pk_memo_set(pk, p[0])) return -1;
+        p += 1;
+        break;
+      case 'r': /* LONG_BINPUT */
+        PK_NEED(4);
+        if(pk_memo_set(pk, pk_le32(p))) return -1;
+        p += 4;
+        break;
+      case 0x94: /* MEMOIZE */
+        if(pk_memo_set(pk, pk->memo_count)) return -1;
+        break;
+      case 'g': /* GET */
+        PK_LINE();
+        if(pk_memo_get(pk, strtoll((const char *)p, NULL, 10))) return -1;
+        p = nl + 1;
+        break;
+      case 'h': /* BINGET */
+        PK_NEED(1);
+        if(pk_memo_get(pk, p[0])) return -1;
+        p += 1;
+        break;
+      case 'j': /* LONG_BINGET */
+        PK_NEED(4);
+        if(pk_memo_get(pk, pk_le32(p))) return -1;
+        p += 4;
+        break;
+      case '0': /* POP */
+        if(pk->nstack == 0) return -1;
+        pk->nstack--;
+        break;
+      case '1': /* POP_MARK */
+        PK_POP_MARK();
+        pk->nstack = mark;
+        break;
+      case '2': /* DUP */
+        if(pk->nstack == 0) return -1;
+        GROW(pk->stack, pk->nstack, pk->stack_allocd, pk->nstack + 1);
+        pk->stack[pk->nstack] = pk->stack[pk->nstack - 1];
+        pk->nstack++;
+        break;
+      case '.': /* STOP */
+        return 0;
+      default:
+        mtevL(nldeb, "graphite: unsupported pickle opcode 0x%02x from %s\n",
+              op, c->ip);
+        return -1;
+    }
+  }
+  return -1;
+#undef PK_NEED
+#undef PK_LINE
+#undef PK_POP_MARK
+}
+
+/* Each pickled message is a 4 byte big-endian length and the frame. */
+static ssize_t
+graphite_process_pickle(graphite_conn_t *c, size_t max_frame) {
+  size_t off = 0;
+  while(c->len - off >= 4) {
+    const unsigned char *hdr = (const unsigned char *)c->buf + off;
+    uint32_t flen = ((uint32_t)hdr[0] << 24) | (hdr[1] << 16) |
+                    (hdr[2] << 8) | hdr[3];
+    if(flen > max_frame) {
+      mtevL(nlerr, "graphite: %u byte pickle from %s is too large\n",
+            flen, c->ip);
+      return -1;
+    }
+    if(c->len - off - 4 < flen) break;
+    if(graphite_unpickle(c, c->buf + off + 4, flen))
+      mtevL(nlerr, "graphite: malformed pickle from %s\n", c->ip);
+    off += 4 + flen;
+  }
+  return off;
+}
+
+static void
+graphite_conn_free(graphite_conn_t *c) {
+  free(c->buf);
+  free(c->arena);
+  free(c->metrics);
+  free(c->batch);
+  free(c->pk.vals);
+  free(c->pk.stack);
+  free(c->pk.kids);
+  free(c->pk.marks);
+  free(c->pk.memo);
+  free(c);
+}
+
+static int
+graphite_conn_handler(eventer_t e, int mask, void *closure,
+                      struct timeval *now) {
+  graphite_conn_t *c = closure;
+  graphite_mod_config_t *conf = noit_module_get_userdata(c->self);
+  mtev_boolean eof = mtev_false;
+
+  if(mask & EVENTER_EXCEPTION) goto done;
+
+  while(!eof) {
+    ssize_t len, used;
+    if(c->len == c->allocd) {
+      size_t want = c->allocd ? c->allocd * 2 : GRAPHITE_READ_SIZE;
+      if(c->allocd >= conf->max_buffer) {
+        mtevL(nlerr, "graphite: %s sent more than %zu bytes without a %s\n",
+              c->ip, conf->max_buffer,
+              c->pickle ? "complete pickle" : "newline");
+        goto done;
+      }
+      if(want > conf->max_buffer) want = conf->max_buffer;
+      /* one spare byte to terminate a final unterminated line */
+      c->buf = realloc(c->buf, want + 1);
+      c->allocd = want;
+    }
+    len = read(eventer_get_fd(e), c->buf + c->len, c->allocd - c->len);
+    if(len < 0) {
+      if(errno == EINTR) continue;
+      if(errno == EAGAIN || errno == EWOULDBLOCK) break;
+      mtevL(nldeb, "graphite: read from %s: %s\n", c->ip, strerror(errno));
+      goto done;
+    }
+    if(len == 0) eof = mtev_true;
+    c->len += len;
+
+    used = c->pickle ? graphite_process_pickle(c, conf->max_buffer - 4)
+                     : (ssize_t)graphite_process_plaintext(c, eof);
+    graphite_apply(c);
+    if(used < 0) goto done;
+    if(used > 0) {
+      memmove(c->buf, c->buf + used, c->len - used);
+      c->len -= used;
+    }
+  }
+  if(!eof) return EVENTER_READ | EVENTER_EXCEPTION;
+
+ done:
+  eventer_remove_fde(e);
+  eventer_close(e, &mask);
+  graphite_conn_free(c);
+  return 0;
+}
+
+static int
+graphite_accept(eventer_t e, int mask, void *closure,
+                struct timeval *now) {
+  graphite_listener_t *l = closure;
+
+  while(1) {
+    union {
+      struct sockaddr sa;
+      struct sockaddr_in in;
+      struct sockaddr_in6 in6;
+    } addr;
+    socklen_t addrlen = sizeof(addr);
+    graphite_conn_t *c;
+    eventer_t newe;
+    const void *ip;
+    int fd;
+
+    fd = accept(eventer_get_fd(e), &addr.sa, &addrlen);
+    if(fd < 0) {
+      if(errno == EINTR) continue;
+      if(errno != EAGAIN && errno != EWOULDBLOCK)
+        mtevL(nlerr, "graphite: accept: %s\n", strerror(errno));
+      break;
+    }
+    if(eventer_set_fd_nonblocking(fd) ||
+       fcntl(fd, F_SETFD, FD_CLOEXEC) < 0) {
+      close(fd);
+      continue;
+    }
+
+    c = calloc(1, sizeof(*c));
+    c->self = l->self;
+    c->pickle = l->pickle;
+    /* zero is never a valid generation, so the first batch looks up */
+    c->generation = 0;
+    ip = (addr.sa.sa_family == AF_INET6) ? (const void *)&addr.in6.sin6_addr
+                                          : (const void *)&addr.in.sin_addr;
+    if(inet_ntop(addr.sa.sa_family, ip, c->ip, sizeof(c->ip)) == NULL) {
+      close(fd);
+      free(c);
+      continue;
+    }
+    mtevL(nldeb, "graphite: %s connection from %s\n",
+          c->pickle ? "pickle" : "plaintext", c->ip);
+
+    /* the connection lives on the thread that accepted it */
+    newe = eventer_alloc_fd(graphite_conn_handler, c, fd,
+                            EVENTER_READ | EVENTER_EXCEPTION);
+    eventer_set_owner(newe, eventer_get_owner(e));
+    eventer_add(newe);
+  }
+  return EVENTER_READ | EVENTER_EXCEPTION;
+}
+
+static int
+graphite_bind(const struct sockaddr *addr, socklen_t addrlen,
+              mtev_boolean reuseport) {
+  int fd, on = 1, save_errno;
+
+  fd = socket(addr->sa_family, NE_SOCK_CLOEXEC|SOCK_STREAM, IPPROTO_TCP);
+  if(fd < 0) return -1;
+  if(eventer_set_fd_nonblocking(fd)) goto bail;
+  if(setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) < 0)
+    goto bail;
+  if(reuseport) {
+#if defined(SO_REUSEPORT)
+    if(setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) < 0)
+      goto bail;
+#else
+    errno = ENOTSUP;
+    goto bail;
+#endif
+  }
+#if defined(IPV6_V6ONLY)
+  if(addr->sa_family == AF_INET6 &&
+     setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &on, sizeof(on)) < 0)
+    goto bail;
+#endif
+  if(bind(fd, addr, addrlen) < 0) goto bail;
+  if(listen(fd, SOMAXCONN) < 0) goto bail;
+  return fd;
+
+ bail:
+  save_errno = errno;
+  close(fd);
+  errno = save_errno;
+  return -1;
+}
+
+/* Start `listeners` accepting sockets on addr, sharing the port with
+ * SO_REUSEPORT, each on its own eventer thread.  Returns the number
+ * started. */
+static int
+graphite_listen(noit_module_t *self, mtev_boolean pickle,
+                const struct sockaddr *addr, socklen_t addrlen,
+                int listeners) {
+  graphite_listener_t *l;
+  int i, started = 0;
+
+  if(listeners < 1) listeners = 1;
+#if !defined(SO_REUSEPORT)
+  if(listeners > 1) {
+    mtevL(nlerr, "graphite: SO_REUSEPORT unsupported, using one listener\n");
+    listeners = 1;
+  }
+#endif
+  l = calloc(1, sizeof(*l));
+  l->self = self;
+  l->pickle = pickle;
+  for(i=0; i<listeners; i++) {
+    eventer_t newe;
+    int fd = graphite_bind(addr, addrlen, listeners > 1);
+    if(fd < 0) {
+      mtevL(nlerr, "graphite: bind failed: %s\n", strerror(errno));
+      break;
+    }
+    newe = eventer_alloc_fd(graphite_accept, l, fd,
+                            EVENTER_READ | EVENTER_EXCEPTION);
+    if(listeners > 1) eventer_set_owner(newe, eventer_choose_owner(i));
+    eventer_add(newe);
+    started++;
+  }
+  if(started == 0) free(l);
+  return started;
+}
+
+static int
+graphite_submit(noit_module_t *self, noit_check_t *check,
+                noit_check_t *cause) {
+  graphite_closure_t *ccl;
+  struct timeval now, duration;
+
+  /* We are passive, so we don't do anything for transient checks */
+  if(check->flags & NP_TRANSIENT) return 0;
+
+  if(!check->closure) {
+    ccl = check->closure = calloc(1, sizeof(graphite_closure_t));
+    ccl->self = self;
+  } else {
+    // Don't count the first run
+    char human_buffer[256];
+    int32_t cnt;
+    ccl = (graphite_closure_t*)check->closure;
+    cnt = ccl->stats_count;
+    mtev_atomic_add32(&ccl->stats_count, -cnt);
+    mtev_gettimeofday(&now, NULL);
+    sub_timeval(now, check->last_fire_time, &duration);
+    noit_stats_set_whence(check, &now);
+    noit_stats_set_duration(check, duration.tv_sec * 1000 + duration.tv_usec / 1000);
+
+    snprintf(human_buffer, sizeof(human_buffer),
+             "dur=%ld,run=%d,stats=%d", duration.tv_sec * 1000 + duration.tv_usec / 1000,
+             check->generation, cnt);
+    mtevL(nldeb, "graphite(%s) [%s]\n", check->target, human_buffer);
+
+    noit_stats_set_available(check, (cnt > 0) ? NP_AVAILABLE : NP_UNAVAILABLE);
+    noit_stats_set_state(check, (cnt > 0) ? NP_GOOD : NP_BAD);
+    noit_stats_set_status(check, human_buffer);
+    if(check->last_fire_time.tv_sec)
+      noit_check_passive_set_stats(check);
+
+    memcpy(&check->last_fire_time, &now, sizeof(duration));
+  }
+  return 0;
+}
+
+static int noit_graphite_initiate_check(noit_module_t *self,
+                                        noit_check_t *check,
+                                        int once, noit_check_t *cause) {
+  check->flags |= NP_PASSIVE_COLLECTION;
+  if (check->closure == NULL) {
+    graphite_closure_t *ccl = check->closure = calloc(1, sizeof(*ccl));
+    ccl->self = self;
+  }
+  INITIATE_CHECK(graphite_submit, self, check, cause);
+  return 0;
+}
+
+static int noit_graphite_config(noit_module_t *self, mtev_hash_table *options) {
+  graphite_mod_config_t *conf;
+  conf = noit_module_get_userdata(self);
+  if(conf) {
+    if(conf->options) {
+      mtev_hash_destroy(conf->options, free, free);
+      free(conf->options);
+    }
+  }
+  else
+    conf = calloc(1, sizeof(*conf));
+  conf->options = options;
+  noit_module_set_userdata(self, conf);
+  return 1;
+}
+
+static int noit_graphite_onload(mtev_image_t *self) {
+  if(!nlerr) nlerr = mtev_log_stream_find("error/graphite");
+  if(!nldeb) nldeb = mtev_log_stream_find("debug/graphite");
+  if(!nlerr) nlerr = noit_error;
+  if(!nldeb) nldeb = noit_debug;
+  eventer_name_callback("graphite/accept", graphite_accept);
+  eventer_name_callback("graphite/connection", graphite_conn_handler);
+  return 0;
+}
+
+static int
+graphite_listen_port(noit_module_t *self, mtev_boolean pickle,
+                     unsigned short port, int listeners) {
+  struct sockaddr_in skaddr;
+  struct sockaddr_in6 skaddr6;
+  int started;
+
+  memset(&skaddr, 0, sizeof(skaddr));
+  skaddr.sin_family = AF_INET;
+  skaddr.sin_addr.s_addr = htonl(INADDR_ANY);
+  skaddr.sin_port = htons(port);
+  started = graphite_listen(self, pickle, (struct sockaddr *)&skaddr,
+                            sizeof(skaddr), listeners);
+  if(started == 0)
+    mtevL(nlerr, "graphite: could not listen on port %d\n", port);
+
+  memset(&skaddr6, 0, sizeof(skaddr6));
+  skaddr6.sin6_family = AF_INET6;
+  skaddr6.sin6_addr = in6addr_any;
+  skaddr6.sin6_port = htons(port);
+  if(graphite_listen(self, pickle, (struct sockaddr *)&skaddr6,
+                     sizeof(skaddr6), listeners) == 0)
+    mtevL(nlerr, "graphite: could not listen on IPv6 port %d\n", port);
+  return started;
+}
+
+static int noit_graphite_init(noit_module_t *self) {
+  unsigned short port = 2003, pickle_port = 2004;
+  int listeners = 1;
+  const char *config_val;
+  graphite_mod_config_t *conf;
+  conf = noit_module_get_userdata(self);
+
+  conf->asynch_metrics = mtev_true;
+  if(mtev_hash_retr_str(conf->options,
+                        "asynch_metrics", strlen("asynch_metrics"),
+                        (const char **)&config_val)) {
+    if(!strcasecmp(config_val, "false") || !strcasecmp(config_val, "off"))
+      conf->asynch_metrics = mtev_false;
+  }
+  conf->max_buffer = DEFAULT_MAX_BUFFER;
+  if(mtev_hash_retr_str(conf->options, "max_buffer", strlen("max_buffer"),
+                        (const char **)&config_val)) {
+    long v = atol(config_val);
+    if(v >= 1024) conf->max_buffer = v;
+  }
+  if(mtev_hash_retr_str(conf->options, "port", strlen("port"),
+                        (const char **)&config_val)) {
+    port = atoi(config_val);
+  }
+  if(mtev_hash_retr_str(conf->options, "pickle_port", strlen("pickle_port"),
+                        (const char **)&config_val)) {
+    pickle_port = atoi(config_val);
+  }
+  if(mtev_hash_retr_str(conf->options, "listeners", strlen("listeners"),
+                        (const char **)&config_val)) {
+    listeners = atoi(config_val);
+  }
+
+  if(port && graphite_listen_port(self, mtev_false, port, listeners) == 0)
+    return -1;
+  if(pickle_port) (void)graphite_listen_port(self, mtev_true, pickle_port, listeners);
+
+  noit_module_set_userdata(self, conf);
+  return 0;
+}
+
+#include "graphite.xmlh"
+noit_module_t graphite = {
+  {
+    .magic = NOIT_MODULE_MAGIC,
+    .version = NOIT_MODULE_ABI_VERSION,
+    .name = "graphite",
+    .description = "carbon (graphite) plaintext and pickle receiver",
+    .xml_description = graphite_xml_description,
+    .onload = noit_graphite_onload
+  },
+  noit_graphite_config,
+  noit_graphite_init,
+  noit_graphite_initiate_check,
+  NULL
+};
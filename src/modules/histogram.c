@@ -29,9 +29,11 @@
  */
 
 #include <inttypes.h>
+#include <pthread.h>
 
 #include <mtev_log.h>
 #include <mtev_b64.h>
+#include <mtev_console.h>
 
 #include <circllhist.h>
 
@@ -39,10 +41,14 @@
 #include "noit_module.h"
 #include "noit_check.h"
 #include "noit_check_tools.h"
+#include "noit_check_wheel.h"
 #include "histogram.h"
+#include "histogram_store.h"
+#include "histogram.xmlh"
 
 static mtev_log_stream_t metrics_log = NULL;
 static int histogram_module_id = -1;
+static histogram_store_t *hstore = NULL;
 
 static int
 histogram_onload(mtev_image_t *self) {
@@ -57,6 +63,9 @@ struct histogram_config {
   mtev_boolean sum;
   double *quantiles;
   int n_quantiles;
+  const char *store_path;
+  size_t store_size;
+  int store_reclaim;
 };
 
 static int double_sort(const void *av, const void *bv) {
@@ -69,7 +78,7 @@ static int double_sort(const void *av, const void *bv) {
 static int
 histogram_config(mtev_dso_generic_t *self, mtev_hash_table *o) {
   struct histogram_config *conf = mtev_image_get_userdata(&self->hdr);
-  const char *duty;
+  const char *duty, *opt;
   char *duty_copy, *cp, *brk;
   int i;
 
@@ -99,17 +108,74 @@ histogram_config(mtev_dso_generic_t *self, mtev_hash_table *o) {
   }
   qsort(conf->quantiles, conf->n_quantiles, sizeof(double), double_sort);
   free(duty_copy);
+
+  conf->store_path = NULL;
+  if(mtev_hash_retr_str(o, "store", strlen("store"), &opt) && *opt)
+    conf->store_path = strdup(opt);
+  conf->store_size = HSTORE_DEFAULT_SIZE;
+  if(mtev_hash_retr_str(o, "store_size", strlen("store_size"), &opt))
+    conf->store_size = strtoull(opt, NULL, 10);
+  conf->store_reclaim = 300;
+  if(mtev_hash_retr_str(o, "store_reclaim", strlen("store_reclaim"), &opt))
+    conf->store_reclaim = atoi(opt);
   return 0;
 }
 
+/* The tiers themselves live in the histogram store.  Samples only ever
+ * land in the current second's slot; the ten second and minute rollups
+ * (and the logging of minute histograms) are done by a per-thread sweeper
+ * that runs on the check timing wheel at each second boundary and only
+ * visits the tiers that have been touched or still hold data.
+ */
 typedef struct histotier {
-  histogram_t *tensecs[6];
-  histogram_t *secs[10];
-  histogram_t *last_aggr;
-  uint8_t last_second;
-  uint64_t last_minute;
+  hstore_ref_t ref;
+  const char *name;
+  uint64_t touched;
+  mtev_boolean pending;
+  struct histotier *next_touched;
+  struct histotier *next_pending;
+  /* the last complete second, kept only while a live feed is watching */
+  histogram_t *live;
+  uint64_t live_second;
 } histotier;
 
+struct histogram_sweeper;
+
+typedef struct histogram_check {
+  mtev_hash_table metrics;
+  mtev_atomic32_t chunks;
+  noit_check_t *check;
+  struct histogram_sweeper *sweeper;
+  histotier *touched;
+  histotier *pending;
+  mtev_boolean listed;
+  mtev_boolean dead;
+  struct histogram_check *next;
+  uint64_t live_until;
+  uint64_t live_sent;
+} histogram_check_t;
+
+/* One per eventer thread.  The lock is recursive as logging and stats
+ * updates under it can re-enter the metric hooks. */
+typedef struct histogram_sweeper {
+  pthread_mutex_t lock;
+  pthread_t owner;
+  volatile uint64_t second;
+  histogram_check_t *checks;
+  eventer_t e;
+  noit_check_wheel_entry_t ent;
+  mtev_boolean on_wheel;
+  uint64_t sweeps;
+  uint64_t tiers_rolled;
+  uint64_t histograms_logged;
+  uint64_t last_sweep_us;
+  uint64_t max_sweep_us;
+} histogram_sweeper_t;
+
+static struct histogram_config *global_conf = NULL;
+static int nsweepers = 0;
+static histogram_sweeper_t *sweepers = NULL;
+
 static void
 debug_print_hist(histogram_t *ht) {
   if(ht != NULL) {
@@ -124,12 +190,9 @@ debug_print_hist(histogram_t *ht) {
   }
 }
 
-void
-noit_log_histo_encoded_function(noit_check_t *check, struct timeval *whence,
-          const char *metric_name, const char *hist_encode, ssize_t hist_encode_len,
-          mtev_boolean live_feed) {
+static void
+histo_uuid_str(noit_check_t *check, char *uuid_str, size_t len) {
   mtev_boolean extended_id = mtev_false;
-  char uuid_str[256*3+37];
   const char *v;
 
   SETUP_LOG(metrics, );
@@ -139,18 +202,27 @@ noit_log_histo_encoded_function(noit_check_t *check, struct timeval *whence,
   }
   uuid_str[0] = '\0';
   if(extended_id) {
-    strlcat(uuid_str, check->target, sizeof(uuid_str)-37);
-    strlcat(uuid_str, "`", sizeof(uuid_str)-37);
-    strlcat(uuid_str, check->module, sizeof(uuid_str)-37);
-    strlcat(uuid_str, "`", sizeof(uuid_str)-37);
-    strlcat(uuid_str, check->name, sizeof(uuid_str)-37);
-    strlcat(uuid_str, "`", sizeof(uuid_str)-37);
+    strlcat(uuid_str, check->target, len-37);
+    strlcat(uuid_str, "`", len-37);
+    strlcat(uuid_str, check->module, len-37);
+    strlcat(uuid_str, "`", len-37);
+    strlcat(uuid_str, check->name, len-37);
+    strlcat(uuid_str, "`", len-37);
   }
   uuid_unparse_lower(check->checkid, uuid_str + strlen(uuid_str));
+}
 
 #define SECPART(a) ((unsigned long)(a)->tv_sec)
 #define MSECPART(a) ((unsigned long)((a)->tv_usec / 1000))
 
+void
+noit_log_histo_encoded_function(noit_check_t *check, struct timeval *whence,
+          const char *metric_name, const char *hist_encode, ssize_t hist_encode_len,
+          mtev_boolean live_feed) {
+  char uuid_str[256*3+37];
+
+  histo_uuid_str(check, uuid_str, sizeof(uuid_str));
+
   if(live_feed && check->feeds) {
     mtev_skiplist_node *curr, *next;
     curr = next = mtev_skiplist_getlist(check->feeds);
@@ -177,184 +249,453 @@ noit_log_histo_encoded_function(noit_check_t *check, struct timeval *whence,
   }
 }
 
+/* A batch writes all of one check's histograms for one sweep: the check
+ * id, the target log streams and the encoding buffers are set up once and
+ * shared by every H1 record in it.
+ */
+typedef struct histo_batch {
+  noit_check_t *check;
+  mtev_boolean live_feed;
+  int nstreams;
+  mtev_log_stream_t *streams;
+  const char **feed_names;
+  mtev_boolean *failed;
+  mtev_log_stream_t metrics_stream;
+  mtev_boolean metrics_failed;
+  char uuid_str[256*3+37];
+  int count;
+} histo_batch_t;
+
+static __thread char *batch_serial = NULL;
+static __thread ssize_t batch_serial_len = 0;
+static __thread char *batch_encode = NULL;
+static __thread ssize_t batch_encode_len = 0;
+
 static void
-log_histo(noit_check_t *check, uint64_t whence_s,
-          const char *metric_name, histogram_t *h,
-          mtev_boolean live_feed) {
-  char *hist_serial = NULL;
-  char *hist_encode = NULL;
+histo_batch_init(histo_batch_t *b, noit_check_t *check,
+                 mtev_boolean live_feed) {
+  memset(b, 0, sizeof(*b));
+  b->check = check;
+  b->live_feed = live_feed;
+  histo_uuid_str(check, b->uuid_str, sizeof(b->uuid_str));
+  if(live_feed) {
+    mtev_skiplist_node *curr;
+    if(!check->feeds || check->feeds->size == 0) return;
+    b->streams = calloc(check->feeds->size, sizeof(*b->streams));
+    b->feed_names = calloc(check->feeds->size, sizeof(*b->feed_names));
+    b->failed = calloc(check->feeds->size, sizeof(*b->failed));
+    for(curr = mtev_skiplist_getlist(check->feeds);
+        curr && b->nstreams < check->feeds->size;
+        mtev_skiplist_next(check->feeds, &curr)) {
+      b->feed_names[b->nstreams] = (const char *)curr->data;
+      b->streams[b->nstreams] = mtev_log_stream_find(curr->data);
+      if(!b->streams[b->nstreams]) b->failed[b->nstreams] = mtev_true;
+      b->nstreams++;
+    }
+  }
+  else {
+    SETUP_LOG(metrics, return);
+    b->metrics_stream = metrics_log;
+    b->streams = &b->metrics_stream;
+    b->failed = &b->metrics_failed;
+    b->nstreams = 1;
+  }
+}
+
+static mtev_boolean
+histo_batch_reserve(char **buf, ssize_t *len, ssize_t need) {
+  char *newbuf;
+  if(need <= *len) return mtev_true;
+  newbuf = realloc(*buf, need);
+  if(!newbuf) {
+    mtevL(noit_error, "realloc(%d) failed\n", (int)need);
+    return mtev_false;
+  }
+  *buf = newbuf;
+  *len = need;
+  return mtev_true;
+}
+
+static void
+histo_batch_add(histo_batch_t *b, uint64_t whence_s,
+                const char *metric_name, histogram_t *h) {
   ssize_t est, enc_est;
   struct timeval whence;
+  int i;
+
+  if(b->nstreams == 0) return;
   whence.tv_sec = whence_s;
   whence.tv_usec = 0;
 
   est = hist_serialize_estimate(h);
-  hist_serial = malloc(est);
-  if(!hist_serial) {
-    mtevL(noit_error, "malloc(%d) failed\n", (int)est);
-    goto cleanup;
-  }
   enc_est = ((est + 2)/3)*4;
-  hist_encode = malloc(enc_est);
-  if(!hist_encode) {
-    mtevL(noit_error, "malloc(%d) failed\n", (int)enc_est);
-    goto cleanup;
-  }
-  if(hist_serialize(h, hist_serial, est) != est) {
+  if(!histo_batch_reserve(&batch_serial, &batch_serial_len, est) ||
+     !histo_batch_reserve(&batch_encode, &batch_encode_len, enc_est))
+    return;
+  if(hist_serialize(h, batch_serial, est) != est) {
     mtevL(noit_error, "histogram serialization failure\n");
-    goto cleanup;
+    return;
   }
-  enc_est = mtev_b64_encode((unsigned char *)hist_serial, est,
-                            hist_encode, enc_est);
+  enc_est = mtev_b64_encode((unsigned char *)batch_serial, est,
+                            batch_encode, enc_est);
   if(enc_est < 0) {
     mtevL(noit_error, "base64 histogram encoding failure\n");
-    goto cleanup;
+    return;
   }
+  for(i=0; i<b->nstreams; i++) {
+    if(b->failed[i]) continue;
+    if(mtev_log(b->streams[i], &whence, __FILE__, __LINE__,
+                "H1\t%lu.%03lu\t%s\t%s\t%.*s\n",
+                SECPART(&whence), MSECPART(&whence),
+                b->uuid_str, metric_name, (int)enc_est, batch_encode) &&
+       b->live_feed)
+      b->failed[i] = mtev_true;
+  }
+  b->count++;
+}
 
+static void
+histo_batch_finish(histo_batch_t *b) {
+  int i;
+  if(!b->live_feed) return;
+  /* feeds we couldn't write to are dropped, as they would be per record */
+  for(i=0; i<b->nstreams; i++)
+    if(b->failed[i]) noit_check_transient_remove_feed(b->check, b->feed_names[i]);
+  free(b->streams);
+  free(b->feed_names);
+  free(b->failed);
+}
 
-
-  noit_log_histo_encoded_function(check, &whence, metric_name, hist_encode, enc_est, live_feed);
-
- cleanup:
-  if(hist_serial) free(hist_serial);
-  if(hist_encode) free(hist_encode);
+static histogram_sweeper_t *
+histogram_sweeper_for(noit_check_t *check) {
+  pthread_t owner = CHOOSE_EVENTER_THREAD_FOR_CHECK(check);
+  int i;
+  for(i=0; i<nsweepers; i++)
+    if(pthread_equal(sweepers[i].owner, owner)) return &sweepers[i];
+  return &sweepers[0];
 }
 
+/* Caller holds the sweeper lock */
 static void
-sweep_roll_n_log(struct histogram_config *conf, noit_check_t *check, histotier *ht, const char *name) {
+histogram_check_list(histogram_check_t *hc) {
+  histogram_sweeper_t *sw = hc->sweeper;
+  if(hc->listed) return;
+  hc->listed = mtev_true;
+  hc->next = sw->checks;
+  sw->checks = hc;
+}
+
+/* Bring a tier's rollups up to second s.  Returns mtev_true if the tier
+ * still holds data that a later sweep has to roll (or expire).
+ */
+static mtev_boolean
+histotier_roll(struct histogram_config *conf, histogram_check_t *hc,
+               histotier *ht, uint64_t s, histo_batch_t *batch) {
+  hstore_ref_t ref = ht->ref;
+  uint64_t last_minute;
+  uint8_t last_second;
   histogram_t *tgt;
-  uint64_t aligned_seconds = ht->last_minute * 60;
-  int cidx = 0, sidx = 0;
-  /* find the first histogram to use as an aggregation target */
-  for(cidx=0; cidx<6; cidx++) {
-    if(NULL != (tgt = ht->tensecs[cidx])) {
-      ht->tensecs[cidx] = NULL;
-      break;
+  int slot, nbins = 0;
+
+  histogram_store_get_clock(hstore, ref, &last_minute, &last_second);
+  if(s/60 > last_minute) {
+    mtev_boolean empty = mtev_true;
+    for(slot=0; slot<HSTORE_SLOTS && empty; slot++)
+      empty = histogram_store_empty(hstore, ref, slot);
+    histogram_store_set_clock(hstore, ref, s/60, s%60);
+    if(empty) return mtev_false;
+
+    /* aggregate all the seconds and tensecs into one and drop them */
+    tgt = hist_alloc();
+    for(slot=0; slot<HSTORE_SLOT_AGGR; slot++) {
+      if(histogram_store_empty(hstore, ref, slot)) continue;
+      nbins += histogram_store_accumulate(hstore, ref, slot, tgt);
+      histogram_store_clear(hstore, ref, slot, &hc->chunks);
     }
+    /* push this out to the log streams */
+    if(conf->histogram) histo_batch_add(batch, last_minute * 60, ht->name, tgt);
+    debug_print_hist(tgt);
+    /* this becomes the last aggregate, an empty minute expires it */
+    histogram_store_replace(hstore, ref, HSTORE_SLOT_AGGR, nbins ? tgt : NULL,
+                            &hc->chunks);
+    hist_free(tgt);
+    hc->sweeper->tiers_rolled++;
+    return nbins > 0;
   }
-  if(tgt == NULL) {
-    for(sidx=0; sidx<10; sidx++) {
-      if(NULL != (tgt = ht->secs[sidx])) {
-        ht->secs[sidx] = NULL;
-        break;
-      }
+  if((s%60)/10 > last_second/10) {
+    int tgt_bucket = last_second / 10;
+    tgt = hist_alloc();
+    for(slot=0; slot<HSTORE_SECS; slot++) {
+      if(histogram_store_empty(hstore, ref, HSTORE_SLOT_SEC(slot))) continue;
+      nbins += histogram_store_accumulate(hstore, ref, HSTORE_SLOT_SEC(slot), tgt);
+      histogram_store_clear(hstore, ref, HSTORE_SLOT_SEC(slot), &hc->chunks);
+    }
+    if(nbins) {
+      /* The target should be empty as we never rollup the same bucket
+       * twice, but a store recovered from a crash may disagree; merge
+       * rather than lose data. */
+      histogram_store_accumulate(hstore, ref, HSTORE_SLOT_TENSEC(tgt_bucket), tgt);
+      histogram_store_replace(hstore, ref, HSTORE_SLOT_TENSEC(tgt_bucket), tgt,
+                              &hc->chunks);
+      hc->sweeper->tiers_rolled++;
     }
+    hist_free(tgt);
+    histogram_store_set_clock(hstore, ref, last_minute, s%60);
   }
-  if(tgt != NULL) {
-    /* aggregate all remaining tensecs */
-    /* we can do all of them b/c we've removed the tgt */
-    if(cidx < 5) hist_accumulate(tgt, (const histogram_t * const *)ht->tensecs, 6);
-    if(sidx < 9) hist_accumulate(tgt, (const histogram_t * const *)ht->secs, 10);
-    for(cidx=0;cidx<6;cidx++) {
-      hist_free(ht->tensecs[cidx]);
-      ht->tensecs[cidx] = NULL;
+  return mtev_true;
+}
+
+/* Caller holds the sweeper lock */
+static void
+histogram_sweep_check(struct histogram_config *conf, histogram_check_t *hc,
+                      uint64_t s) {
+  histotier *ht, **pht;
+  histo_batch_t batch;
+  mtev_boolean live = hc->live_until >= s;
+
+  /* The seconds touched since the last sweep are complete now */
+  while(NULL != (ht = hc->touched)) {
+    hc->touched = ht->next_touched;
+    ht->next_touched = NULL;
+    if(live) {
+      if(!ht->live) ht->live = hist_alloc();
+      else hist_clear(ht->live);
+      histogram_store_accumulate(hstore, ht->ref,
+                                 HSTORE_SLOT_SEC(ht->touched % 10), ht->live);
+      ht->live_second = ht->touched;
     }
-    for(sidx=0;sidx<10;sidx++) {
-      hist_free(ht->secs[sidx]);
-      ht->secs[sidx] = NULL;
+    if(!ht->pending) {
+      ht->pending = mtev_true;
+      ht->next_pending = hc->pending;
+      hc->pending = ht;
     }
   }
 
-  /* push this out to the log streams */
-  if(conf->histogram)
-    log_histo(check, aligned_seconds, name, tgt, mtev_false);
-  debug_print_hist(tgt);
+  histo_batch_init(&batch, hc->check, mtev_false);
+  for(pht = &hc->pending; NULL != (ht = *pht); ) {
+    if(histotier_roll(conf, hc, ht, s, &batch)) {
+      pht = &ht->next_pending;
+      continue;
+    }
+    *pht = ht->next_pending;
+    ht->next_pending = NULL;
+    ht->pending = mtev_false;
+  }
+  hc->sweeper->histograms_logged += batch.count;
+  histo_batch_finish(&batch);
+}
 
-  /* drop the tgt, it's ours */
-  if(ht->last_aggr) hist_free(ht->last_aggr);
-  ht->last_aggr = tgt;
+static void
+histotier_free(histogram_check_t *hc, histotier *ht) {
+  histogram_store_tier_free(hstore, ht->ref, &hc->chunks);
+  if(ht->live) hist_free(ht->live);
+  free(ht);
 }
 
 static void
-sweep_roll_tensec(histotier *ht) {
-  histogram_t *tgt;
-  int tgt_bucket = ht->last_second / 10;
-  int sidx;
-  /* We can't very well rollup the same bucket twice */
-  mtevAssert(tgt_bucket >= 0 && tgt_bucket < 6 && ht->tensecs[tgt_bucket] == NULL);
-  for(sidx=0;sidx<10;sidx++) {
-    if(NULL != (tgt = ht->secs[sidx])) {
-      ht->secs[sidx] = NULL;
-      break;
+histogram_sweep(histogram_sweeper_t *sw, uint64_t s) {
+  histogram_check_t *hc, **phc;
+  struct timeval start, end, diff;
+  uint64_t us;
+
+  mtev_gettimeofday(&start, NULL);
+  pthread_mutex_lock(&sw->lock);
+  sw->second = s;
+  for(phc = &sw->checks; NULL != (hc = *phc); ) {
+    if(!hc->dead) histogram_sweep_check(global_conf, hc, s);
+    if(hc->dead || (!hc->touched && !hc->pending)) {
+      *phc = hc->next;
+      hc->listed = mtev_false;
+      if(hc->dead) free(hc);
+      continue;
     }
+    phc = &hc->next;
   }
-  if(tgt == NULL) return; /* nothing to do */
-  ht->tensecs[tgt_bucket] = tgt;
-  hist_accumulate(tgt, (const histogram_t * const *)ht->secs, 10);
-  for(sidx=0;sidx<10;sidx++) {
-    hist_free(ht->secs[sidx]);
-    ht->secs[sidx] = NULL;
+  sw->sweeps++;
+  pthread_mutex_unlock(&sw->lock);
+  mtev_gettimeofday(&end, NULL);
+  sub_timeval(end, start, &diff);
+  us = diff.tv_sec * 1000000 + diff.tv_usec;
+  sw->last_sweep_us = us;
+  if(us > sw->max_sweep_us) sw->max_sweep_us = us;
+}
+
+static int
+histogram_sweeper_tick(eventer_t e, int mask, void *closure,
+                       struct timeval *now) {
+  histogram_sweeper_t *sw = closure;
+  histogram_sweep(sw, now->tv_sec);
+  e->whence.tv_sec = now->tv_sec + 1;
+  e->whence.tv_usec = 0;
+  if(sw->on_wheel) {
+    /* the wheel only fires an entry once */
+    if(!noit_check_wheel_add(&sw->ent, e, mtev_false)) {
+      sw->on_wheel = mtev_false;
+      eventer_add(e);
+    }
   }
+  return EVENTER_TIMER;
 }
+
+static int
+histogram_sweepers_start(eventer_t e, int mask, void *closure,
+                         struct timeval *now) {
+  int i;
+  for(i=0; i<nsweepers; i++) {
+    histogram_sweeper_t *sw = &sweepers[i];
+    sw->e = eventer_alloc();
+    sw->e->mask = EVENTER_TIMER;
+    sw->e->callback = histogram_sweeper_tick;
+    sw->e->closure = sw;
+    sw->e->whence.tv_sec = now->tv_sec + 1;
+    sw->e->whence.tv_usec = 0;
+    eventer_set_owner(sw->e, sw->owner);
+    sw->on_wheel = noit_check_wheel_add(&sw->ent, sw->e, mtev_false);
+    if(!sw->on_wheel) eventer_add(sw->e);
+  }
+  return 0;
+}
+
+static void free_histogram_check(void *vhc) {
+  mtev_hash_iter iter = MTEV_HASH_ITER_ZERO;
+  histogram_check_t *hc = vhc;
+  histogram_sweeper_t *sw = hc->sweeper;
+  const char *k;
+  int klen;
+  void *data;
+
+  pthread_mutex_lock(&sw->lock);
+  while(mtev_hash_next(&hc->metrics, &iter, &k, &klen, &data))
+    histotier_free(hc, data);
+  mtev_hash_destroy(&hc->metrics, free, NULL);
+  hc->touched = hc->pending = NULL;
+  hc->check = NULL;
+  /* a listed check is unlinked (and freed) by its sweeper */
+  if(hc->listed) hc->dead = mtev_true;
+  pthread_mutex_unlock(&sw->lock);
+  if(!hc->dead) free(hc);
+}
+
+static histotier *
+histogram_check_tier(noit_check_t *check, histogram_check_t **hcp,
+                     const char *name) {
+  histogram_check_t *hc;
+  histotier *ht;
+  hstore_ref_t ref;
+  void *vht;
+
+  hc = noit_check_get_module_metadata(check, histogram_module_id);
+  if(!hc) {
+    hc = calloc(1, sizeof(*hc));
+    mtev_hash_init(&hc->metrics);
+    hc->check = check;
+    hc->sweeper = histogram_sweeper_for(check);
+    noit_check_set_module_metadata(check, histogram_module_id,
+                                   hc, free_histogram_check);
+  }
+  *hcp = hc;
+  if(mtev_hash_retrieve(&hc->metrics, name, strlen(name), &vht))
+    return vht;
+  ref = histogram_store_tier(hstore, check->checkid, name, &hc->chunks);
+  if(!ref) return NULL;
+  ht = calloc(1, sizeof(*ht));
+  ht->ref = ref;
+  ht->name = strdup(name);
+  pthread_mutex_lock(&hc->sweeper->lock);
+  if(mtev_hash_retrieve(&hc->metrics, name, strlen(name), &vht)) {
+    /* another thread created it since we looked; use theirs */
+    pthread_mutex_unlock(&hc->sweeper->lock);
+    free((void *)ht->name);
+    histotier_free(hc, ht);
+    return vht;
+  }
+  mtev_hash_store(&hc->metrics, ht->name, strlen(ht->name), ht);
+  pthread_mutex_unlock(&hc->sweeper->lock);
+  return ht;
+}
+
+/* Write the last complete second of each tier to check's live feeds, at
+ * most once a second.  Snapshots are kept by the sweeper for as long as
+ * someone keeps asking for them.
+ */
+static void
+histogram_live_feed(struct histogram_config *conf, histogram_check_t *hc,
+                    noit_check_t *check) {
+  histogram_sweeper_t *sw = hc->sweeper;
+  mtev_hash_iter iter = MTEV_HASH_ITER_ZERO;
+  histo_batch_t batch;
+  const char *k;
+  int klen;
+  void *data;
+  uint64_t sent;
+
+  if(!conf->histogram) return;
+  pthread_mutex_lock(&sw->lock);
+  hc->live_until = sw->second + 2;
+  sent = hc->live_sent;
+  if(sent >= sw->second - 1) {
+    pthread_mutex_unlock(&sw->lock);
+    return;
+  }
+  histo_batch_init(&batch, check, mtev_true);
+  while(mtev_hash_next(&hc->metrics, &iter, &k, &klen, &data)) {
+    histotier *ht = data;
+    if(!ht->live || ht->live_second <= sent) continue;
+    if(hist_num_buckets(ht->live))
+      histo_batch_add(&batch, ht->live_second, ht->name, ht->live);
+    if(ht->live_second > hc->live_sent) hc->live_sent = ht->live_second;
+  }
+  if(hc->live_sent == sent) hc->live_sent = sw->second - 1;
+  pthread_mutex_unlock(&sw->lock);
+  histo_batch_finish(&batch);
+}
+
 static void
-update_histotier(histotier *ht, uint64_t s,
+update_histotier(histogram_check_t *hc, histotier *ht,
                  struct histogram_config *conf, noit_check_t *check,
-                 const char *name, double val, uint64_t cnt) {
-  uint64_t minute = s/60;
-  uint8_t second = s%60;
-  uint8_t sec_bucket = s%10;
+                 double val, uint64_t cnt) {
+  histogram_sweeper_t *sw = hc->sweeper;
+  uint64_t s;
+
   noit_check_metric_count_add(cnt);
-  if((second != ht->last_second || check->flags & NP_TRANSIENT) &&
-     check->feeds) {
-    int last_second = ht->last_second;
-    int last_minute = ht->last_minute;
-    uint8_t last_bucket;
-
-    /* If we are transient we're coming to this sloppy.
-     * Someone else owns this ht. So, if we're high-traffic
-     * then last_second has already been bumped, so we need to
-     * rewind it.
-     */
-    if(check->flags & NP_TRANSIENT && second == last_second) {
-      last_second--;
-      if(last_second < 0) {
-        last_second = 59;
-        last_minute--;
+  pthread_mutex_lock(&sw->lock);
+  s = sw->second;
+  if(ht->touched != s) {
+    /* first sample this second: a tier the sweeper isn't tracking may
+     * still hold (recovered) data from before, roll it up first */
+    if(!ht->pending) {
+      histo_batch_t batch;
+      histo_batch_init(&batch, hc->check, mtev_false);
+      if(histotier_roll(conf, hc, ht, s, &batch)) {
+        ht->pending = mtev_true;
+        ht->next_pending = hc->pending;
+        hc->pending = ht;
       }
+      sw->histograms_logged += batch.count;
+      histo_batch_finish(&batch);
     }
-    last_bucket = last_second % 10;
-    if(ht->secs[last_bucket] && hist_num_buckets(ht->secs[last_bucket])
-        && conf->histogram)
-      log_histo(check, last_minute * 60 + last_second, name,
-          ht->secs[last_bucket], mtev_true);
-  }
-  if(minute > ht->last_minute) {
-    sweep_roll_n_log(conf, check, ht, name);
-  }
-  else if(second/10 > ht->last_second/10) {
-    sweep_roll_tensec(ht);
+    histogram_store_set_clock(hstore, ht->ref, s/60, s%60);
+    if(ht->touched < s) {
+      ht->next_touched = hc->touched;
+      hc->touched = ht;
+    }
+    ht->touched = s;
+    histogram_check_list(hc);
   }
   if(cnt > 0) {
-    if(ht->secs[sec_bucket] == NULL)
-      ht->secs[sec_bucket] = hist_alloc();
-    hist_insert(ht->secs[sec_bucket], val, cnt);
+    /* If the store is full the sample is dropped (and counted there) */
+    histogram_store_insert(hstore, ht->ref, HSTORE_SLOT_SEC(s % 10),
+                           val, cnt, &hc->chunks);
   }
-  ht->last_minute = minute;
-  ht->last_second = second;
-}
-
-static void free_histotier(void *vht) {
-  int i;
-  histotier *ht = vht;
-  if(vht == NULL) return;
-  for(i=0;i<10;i++)
-    if(ht->secs[i]) hist_free(ht->secs[i]);
-  for(i=0;i<6;i++)
-    if(ht->tensecs[i]) hist_free(ht->tensecs[i]);
-  if(ht->last_aggr) hist_free(ht->last_aggr);
-  free(ht);
-}
-static void free_hash_o_histotier(void *vh) {
-  mtev_hash_table *h = vh;
-  mtev_hash_destroy(h, free, free_histotier);
-  free(h);
+  pthread_mutex_unlock(&sw->lock);
+  if(check->feeds) histogram_live_feed(conf, hc, check);
 }
 static mtev_hook_return_t
 histogram_hook_impl(void *closure, noit_check_t *check, stats_t *stats,
                     metric_t *m) {
-  void *vht;
+  histogram_check_t *hc;
   histotier *ht;
-  mtev_hash_table *config, *metrics;
+  mtev_hash_table *config;
   const char *track = "";
   mtev_dso_generic_t *self = closure;
   struct histogram_config *conf = mtev_image_get_userdata(&self->hdr);
@@ -365,23 +706,10 @@ histogram_hook_impl(void *closure, noit_check_t *check, stats_t *stats,
   if(!track || strcmp(track, "add"))
     return MTEV_HOOK_CONTINUE;
 
-  metrics = noit_check_get_module_metadata(check, histogram_module_id);
-  if(!metrics) {
-    metrics = calloc(1, sizeof(*metrics));
-    mtev_hash_init(metrics);
-    noit_check_set_module_metadata(check, histogram_module_id,
-                                   metrics, free_hash_o_histotier);
-  }
-  if(!mtev_hash_retrieve(metrics, m->metric_name, strlen(m->metric_name),
-                         &vht)) {
-    ht = calloc(1, sizeof(*ht));
-    vht = ht;
-    mtev_hash_store(metrics, strdup(m->metric_name), strlen(m->metric_name),
-                    vht);
-  }
-  else ht = vht;
+  ht = histogram_check_tier(check, &hc, m->metric_name);
+  if(!ht) return MTEV_HOOK_CONTINUE;
   if(m->metric_value.vp != NULL) {
-#define UPDATE_HISTOTIER(a) update_histotier(ht, time(NULL), conf, check, m->metric_name, *m->metric_value.a, 1)
+#define UPDATE_HISTOTIER(a) update_histotier(hc, ht, conf, check, *m->metric_value.a, 1)
     switch(m->metric_type) {
       case METRIC_UINT64:
         UPDATE_HISTOTIER(L); break;
@@ -404,9 +732,9 @@ static mtev_hook_return_t
 histogram_hook_special_impl(void *closure, noit_check_t *check, stats_t *stats,
                             const char *metric_name, metric_type_t type, const char *v,
                             mtev_boolean success) {
-  void *vht;
+  histogram_check_t *hc;
   histotier *ht;
-  mtev_hash_table *config, *metrics;
+  mtev_hash_table *config;
   const char *track = "";
   mtev_dso_generic_t *self = closure;
   struct histogram_config *conf = mtev_image_get_userdata(&self->hdr);
@@ -419,21 +747,8 @@ histogram_hook_special_impl(void *closure, noit_check_t *check, stats_t *stats,
   if(!track || strcmp(track, "add"))
     return MTEV_HOOK_CONTINUE;
 
-  metrics = noit_check_get_module_metadata(check, histogram_module_id);
-  if(!metrics) {
-    metrics = calloc(1, sizeof(*metrics));
-    mtev_hash_init(metrics);
-    noit_check_set_module_metadata(check, histogram_module_id,
-                                   metrics, free_hash_o_histotier);
-  }
-  if(!mtev_hash_retrieve(metrics, metric_name, strlen(metric_name),
-                         &vht)) {
-    ht = calloc(1, sizeof(*ht));
-    vht = ht;
-    mtev_hash_store(metrics, strdup(metric_name), strlen(metric_name),
-                    vht);
-  }
-  else ht = vht;
+  ht = histogram_check_tier(check, &hc, metric_name);
+  if(!ht) return MTEV_HOOK_CONTINUE;
   if(v != NULL) {
     /* We expect: H[<float>]=%d */
     const char *lhs;
@@ -448,7 +763,7 @@ histogram_hook_special_impl(void *closure, noit_check_t *check, stats_t *stats,
     if(endptr == v+2) return MTEV_HOOK_CONTINUE;
     cnt = strtoull(lhs, &endptr, 10);
     if(endptr == lhs) return MTEV_HOOK_CONTINUE;
-    update_histotier(ht, time(NULL), conf, check, metric_name, bucket, cnt);
+    update_histotier(hc, ht, conf, check, bucket, cnt);
   }
   return MTEV_HOOK_CONTINUE;
 }
@@ -459,24 +774,29 @@ histogram_sweep_calculations(struct histogram_config *conf, noit_check_t *check)
   const char *metric_name;
   int klen;
   void *data;
-  mtev_hash_table *metrics;
+  histogram_check_t *hc;
+  histogram_t *last_aggr;
   double *out_q;
 
   noit_check_get_stats_current(check);
   /* Only need to do work if it's asked for */
   if(!conf->mean && !conf->sum && conf->n_quantiles < 1) return;
-  metrics = noit_check_get_module_metadata(check, histogram_module_id);
-  if(!metrics) return;
+  hc = noit_check_get_module_metadata(check, histogram_module_id);
+  if(!hc) return;
   out_q = alloca(sizeof(double *) * conf->n_quantiles);
 
-  while(mtev_hash_next(metrics, &iter, &metric_name, &klen, &data)) {
+  last_aggr = hist_alloc();
+  pthread_mutex_lock(&hc->sweeper->lock);
+  while(mtev_hash_next(&hc->metrics, &iter, &metric_name, &klen, &data)) {
     char mname[1024];
     histotier *ht = data;
-    if(ht->last_aggr == NULL) continue;
+    if(histogram_store_empty(hstore, ht->ref, HSTORE_SLOT_AGGR)) continue;
+    hist_clear(last_aggr);
+    histogram_store_accumulate(hstore, ht->ref, HSTORE_SLOT_AGGR, last_aggr);
     if(conf->mean) {
       double mean_value;
       snprintf(mname, sizeof(mname), "%s:mean", metric_name);
-      mean_value = hist_approx_mean(ht->last_aggr);
+      mean_value = hist_approx_mean(last_aggr);
       noit_stats_set_metric(check, mname, METRIC_DOUBLE, &mean_value);
       if (check->flags & NP_SUPPRESS_METRICS) {
         noit_stats_log_immediate_metric(check, mname, METRIC_DOUBLE, &mean_value);
@@ -485,14 +805,14 @@ histogram_sweep_calculations(struct histogram_config *conf, noit_check_t *check)
     if(conf->sum) {
       double sum;
       snprintf(mname, sizeof(mname), "%s:sum", metric_name);
-      sum = hist_approx_sum(ht->last_aggr);
+      sum = hist_approx_sum(last_aggr);
       noit_stats_set_metric(check, mname, METRIC_DOUBLE, &sum);
       if (check->flags & NP_SUPPRESS_METRICS) {
         noit_stats_log_immediate_metric(check, mname, METRIC_DOUBLE, &sum);
       }
     }
     if(conf->n_quantiles) {
-      if(hist_approx_quantile(ht->last_aggr,
+      if(hist_approx_quantile(last_aggr,
            conf->quantiles, conf->n_quantiles, out_q) == 0) {
         int i;
         for(i=0;i<conf->n_quantiles;i++) {
@@ -505,6 +825,8 @@ histogram_sweep_calculations(struct histogram_config *conf, noit_check_t *check)
       }
     }
   }
+  pthread_mutex_unlock(&hc->sweeper->lock);
+  hist_free(last_aggr);
 }
 
 static mtev_hook_return_t
@@ -539,28 +861,15 @@ static mtev_hook_return_t
 histogram_logger_passive(void *closure, noit_check_t *check) {
   return _histogram_logger_impl(closure, check, mtev_true);
 }
-static void
-heartbeat_all_metrics(struct histogram_config *conf,
-                      noit_check_t *check, mtev_hash_table *metrics) {
-  mtev_hash_iter iter = MTEV_HASH_ITER_ZERO;
-  const char *k;
-  int klen;
-  void *data;
-  uint64_t s = time(NULL);
-  while(mtev_hash_next(metrics, &iter, &k, &klen, &data)) {
-    histotier *ht = data;
-    update_histotier(ht, s, conf, check, k, 0, 0);
-  }
-}
 static mtev_hook_return_t
 histogram_hb_hook_impl(void *closure, noit_module_t *self,
                        noit_check_t *check, noit_check_t *cause) {
-  /* We'll use this as an artificial heartbeat to induce a histo sweep-n-roll
-   * if no new data has come in yet.
+  /* Rollups happen in the sweepers, but a watched check that isn't
+   * getting samples pushed into it still needs its live feed.
    */
   struct histogram_config *conf = mtev_image_get_userdata(&self->hdr);
   noit_check_t *metrics_source = check;
-  mtev_hash_table *metrics;
+  histogram_check_t *hc;
 #define NEED_PARENT (NP_TRANSIENT | NP_PASSIVE_COLLECTION)
 
   /* If this is a passive check, we should be looking at the source
@@ -572,13 +881,103 @@ histogram_hb_hook_impl(void *closure, noit_module_t *self,
     if(metrics_source == NULL) return MTEV_HOOK_CONTINUE;
   }
   /* quick disqualifictaion */
-  metrics = noit_check_get_module_metadata(metrics_source, histogram_module_id);
-  if(!metrics || mtev_hash_size(metrics) == 0) return MTEV_HOOK_CONTINUE;
-  heartbeat_all_metrics(conf, check, metrics);
+  if(!check->feeds) return MTEV_HOOK_CONTINUE;
+  hc = noit_check_get_module_metadata(metrics_source, histogram_module_id);
+  if(!hc || mtev_hash_size(&hc->metrics) == 0) return MTEV_HOOK_CONTINUE;
+  histogram_live_feed(conf, hc, check);
   return MTEV_HOOK_CONTINUE;
 }
+static int
+histogram_store_reclaimer(eventer_t e, int mask, void *closure,
+                          struct timeval *now) {
+  int n = histogram_store_reclaim(hstore);
+  if(n) mtevL(noit_error, "histogram store: reclaimed %d unclaimed tiers\n", n);
+  return 0;
+}
+
+static int
+histogram_show_check(noit_check_t *check, void *closure) {
+  mtev_console_closure_t ncct = closure;
+  histogram_check_t *hc;
+  char uuid_str[UUID_STR_LEN+1];
+
+  hc = noit_check_get_module_metadata(check, histogram_module_id);
+  if(!hc || (check->flags & NP_TRANSIENT)) return 0;
+  uuid_unparse_lower(check->checkid, uuid_str);
+  nc_printf(ncct, "%s %s`%s: %d metrics, %d chunks, %zu bytes\n",
+            uuid_str, check->target, check->name, mtev_hash_size(&hc->metrics),
+            (int)hc->chunks, (size_t)hc->chunks * HSTORE_CHUNK_SIZE);
+  return 1;
+}
+
+static int
+histogram_console_show(mtev_console_closure_t ncct,
+                       int argc, char **argv,
+                       mtev_console_state_t *dstate,
+                       void *closure) {
+  uint32_t total, used, unclaimed;
+  uint64_t dropped;
+  int i;
+
+  histogram_store_stats(hstore, &total, &used, &unclaimed, &dropped);
+  nc_printf(ncct, "store: %u/%u chunks used (%zu/%zu bytes)\n", used, total,
+            (size_t)used * HSTORE_CHUNK_SIZE, (size_t)total * HSTORE_CHUNK_SIZE);
+  nc_printf(ncct, "unclaimed recovered tiers: %u\n", unclaimed);
+  nc_printf(ncct, "allocations failed: %" PRIu64 "\n", dropped);
+  for(i=0; i<nsweepers; i++) {
+    histogram_sweeper_t *sw = &sweepers[i];
+    nc_printf(ncct, "sweeper[%d]%s: %" PRIu64 " sweeps, %" PRIu64 " rollups, "
+              "%" PRIu64 " histograms logged, last %" PRIu64 "us, max %" PRIu64 "us\n",
+              i, sw->on_wheel ? "" : " (timer)", sw->sweeps, sw->tiers_rolled,
+              sw->histograms_logged, sw->last_sweep_us, sw->max_sweep_us);
+  }
+  noit_poller_do(histogram_show_check, ncct);
+  return 0;
+}
+
+static void
+register_console_histogram_commands() {
+  mtev_console_state_t *tl;
+  cmd_info_t *showcmd;
+
+  tl = mtev_console_state_initial();
+  showcmd = mtev_console_state_get_cmd(tl, "show");
+  mtevAssert(showcmd && showcmd->dstate);
+  mtev_console_state_add_cmd(showcmd->dstate,
+    NCSCMD("histogram", histogram_console_show, NULL, NULL, NULL));
+}
+
 static int
 histogram_init(mtev_dso_generic_t *self) {
+  struct histogram_config *conf = mtev_image_get_userdata(&self->hdr);
+  pthread_mutexattr_t attr;
+  int i;
+
+  hstore = histogram_store_open(conf->store_path, conf->store_size);
+  if(!hstore && conf->store_path) {
+    mtevL(noit_error, "histogram store %s unavailable, not persisting\n",
+          conf->store_path);
+    hstore = histogram_store_open(NULL, conf->store_size);
+  }
+  if(!hstore) return -1;
+
+  global_conf = conf;
+  nsweepers = eventer_loop_concurrency();
+  if(nsweepers < 1) nsweepers = 1;
+  sweepers = calloc(nsweepers, sizeof(*sweepers));
+  pthread_mutexattr_init(&attr);
+  pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+  for(i=0; i<nsweepers; i++) {
+    pthread_mutex_init(&sweepers[i].lock, &attr);
+    sweepers[i].owner = eventer_choose_owner(i);
+    sweepers[i].second = time(NULL);
+  }
+  pthread_mutexattr_destroy(&attr);
+  /* the check wheel comes up with the poller, after us */
+  eventer_add_in_s_us(histogram_sweepers_start, NULL, 0, 0);
+  if(conf->store_reclaim > 0)
+    eventer_add_in_s_us(histogram_store_reclaimer, NULL, conf->store_reclaim, 0);
+  register_console_histogram_commands();
   check_stats_set_metric_hook_register("histogram", histogram_hook_impl, self);
   check_stats_set_metric_coerce_hook_register("histogram", histogram_hook_special_impl, self);
   check_set_stats_hook_register("histogram", histogram_stats_fixup, self);
@@ -594,7 +993,7 @@ mtev_dso_generic_t histogram = {
     MTEV_GENERIC_ABI_VERSION,
     "histogram",
     "Passive histogram support for metrics collection",
-    "",
+    histogram_xml_description,
     histogram_onload
   },
   histogram_config,
@@ -0,0 +1,509 @@
+/*
+ * Copyright (c) 2017, Circonus, Inc. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above
+ *       copyright notice, this list of conditions and the following
+ *       disclaimer in the documentation and/or other materials provided
+ *       with the distribution.
+ *     * Neither the name Circonus, Inc. nor the names
+ *       of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written
+ *       permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <mtev_defines.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <mtev_log.h>
+#include <mtev_hash.h>
+
+#include "noit_mtev_bridge.h"
+#include "histogram_store.h"
+
+#define HSTORE_MAGIC 0x48535431 /* HST1 */
+#define HSTORE_VERSION 1
+#define HSTORE_BINS_PER_CHUNK 12
+
+enum {
+  HSTORE_FREE = 0,
+  HSTORE_TIER,
+  HSTORE_BINS
+};
+
+struct hstore_chunk_hdr {
+  uint8_t kind;
+  uint8_t slot;
+  uint16_t nbins;
+  uint32_t next;
+};
+
+struct hstore_tier {
+  struct hstore_chunk_hdr hdr;
+  uuid_t checkid;
+  uint64_t name_hash;
+  uint64_t last_minute;
+  uint8_t last_second;
+  uint8_t unused[3];
+  uint32_t slots[HSTORE_SLOTS];
+};
+
+struct hstore_bins {
+  struct hstore_chunk_hdr hdr;
+  uint64_t count[HSTORE_BINS_PER_CHUNK];
+  hist_bucket_t bucket[HSTORE_BINS_PER_CHUNK];
+};
+
+/* chunk 0 of the arena */
+struct hstore_header {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t chunk_size;
+  uint32_t nchunks;
+};
+
+typedef union {
+  struct hstore_chunk_hdr hdr;
+  struct hstore_tier tier;
+  struct hstore_bins bins;
+  struct hstore_header header;
+  char pad[HSTORE_CHUNK_SIZE];
+} hstore_chunk_t;
+typedef char hstore_chunk_size_check[sizeof(hstore_chunk_t) == HSTORE_CHUNK_SIZE ? 1 : -1];
+
+struct hstore_key {
+  uuid_t checkid;
+  uint64_t name_hash;
+};
+
+struct histogram_store {
+  hstore_chunk_t *chunks;
+  size_t mapsize;
+  uint32_t nchunks;
+  pthread_mutex_t lock;
+  /* The free list is threaded through the free chunks' next and rebuilt
+   * from the chunk kinds on open, so it needn't survive a crash. */
+  uint32_t free_head;
+  uint32_t nfree;
+  uint64_t dropped;
+  /* tiers found on open that no metric has claimed yet */
+  mtev_hash_table recovered;
+};
+
+#define CHUNK(s,i) (&(s)->chunks[i])
+#define TIER(s,r) (&CHUNK(s,r)->tier)
+#define BINS(s,i) (&CHUNK(s,i)->bins)
+
+static uint64_t
+hstore_name_hash(const char *name) {
+  size_t len = strlen(name);
+  return ((uint64_t)mtev_hash__hash(name, len, 0) << 32) |
+         mtev_hash__hash(name, len, 0x9e3779b9);
+}
+
+static void
+hstore_key(struct hstore_key *key, uuid_t checkid, uint64_t name_hash) {
+  memset(key, 0, sizeof(*key));
+  mtev_uuid_copy(key->checkid, checkid);
+  key->name_hash = name_hash;
+}
+
+static uint32_t
+hstore_chunk_alloc(histogram_store_t *s) {
+  uint32_t idx;
+  pthread_mutex_lock(&s->lock);
+  idx = s->free_head;
+  if(idx) {
+    s->free_head = CHUNK(s,idx)->hdr.next;
+    s->nfree--;
+  }
+  else s->dropped++;
+  pthread_mutex_unlock(&s->lock);
+  return idx;
+}
+
+/* Caller holds the lock */
+static void
+hstore_chunk_release(histogram_store_t *s, uint32_t idx) {
+  hstore_chunk_t *c = CHUNK(s,idx);
+  c->hdr.kind = HSTORE_FREE;
+  c->hdr.next = s->free_head;
+  s->free_head = idx;
+  s->nfree++;
+}
+
+/* Unlink first, then free: a crash in between leaves unreachable chunks
+ * that the next open reclaims. */
+static int
+hstore_chain_free(histogram_store_t *s, uint32_t *head) {
+  uint32_t idx = *head, next;
+  int n = 0;
+  if(!idx) return 0;
+  *head = 0;
+  pthread_mutex_lock(&s->lock);
+  for(; idx; idx = next) {
+    next = CHUNK(s,idx)->hdr.next;
+    hstore_chunk_release(s, idx);
+    n++;
+  }
+  pthread_mutex_unlock(&s->lock);
+  return n;
+}
+
+static int
+hstore_tier_chunks(histogram_store_t *s, hstore_ref_t ref) {
+  struct hstore_tier *t = TIER(s,ref);
+  int slot, n = 1;
+  uint32_t idx;
+  for(slot=0; slot<HSTORE_SLOTS; slot++)
+    for(idx = t->slots[slot]; idx; idx = CHUNK(s,idx)->hdr.next) n++;
+  return n;
+}
+
+static void
+hstore_tier_release(histogram_store_t *s, hstore_ref_t ref) {
+  struct hstore_tier *t = TIER(s,ref);
+  int slot;
+  uint32_t idx, next;
+  hstore_chunk_release(s, ref);
+  for(slot=0; slot<HSTORE_SLOTS; slot++) {
+    for(idx = t->slots[slot]; idx; idx = next) {
+      next = CHUNK(s,idx)->hdr.next;
+      hstore_chunk_release(s, idx);
+    }
+    t->slots[slot] = 0;
+  }
+}
+
+/* Walk every tier, cut any chain at the first chunk that doesn't belong
+ * to it, then put everything unreachable on the free list. */
+static void
+hstore_recover(histogram_store_t *s) {
+  uint8_t *seen;
+  uint32_t i, ntiers = 0;
+
+  seen = calloc(s->nchunks, 1);
+  for(i=1; i<s->nchunks; i++) {
+    struct hstore_tier *t = TIER(s,i);
+    struct hstore_key *key;
+    void *vref;
+    int slot;
+
+    if(t->hdr.kind != HSTORE_TIER) continue;
+    key = malloc(sizeof(*key));
+    hstore_key(key, t->checkid, t->name_hash);
+    if(mtev_hash_retrieve(&s->recovered, (const char *)key, sizeof(*key),
+                          &vref)) {
+      free(key);
+      continue;
+    }
+    for(slot=0; slot<HSTORE_SLOTS; slot++) {
+      uint32_t *link = &t->slots[slot];
+      while(*link) {
+        uint32_t idx = *link;
+        struct hstore_bins *b;
+        if(idx >= s->nchunks || seen[idx]) break;
+        b = BINS(s,idx);
+        if(b->hdr.kind != HSTORE_BINS || b->hdr.slot != slot ||
+           b->hdr.nbins > HSTORE_BINS_PER_CHUNK) break;
+        seen[idx] = 1;
+        link = &b->hdr.next;
+      }
+      *link = 0;
+    }
+    t->hdr.next = 0;
+    if(t->last_second >= 60) t->last_second = 0;
+    seen[i] = 1;
+    mtev_hash_store(&s->recovered, (const char *)key, sizeof(*key),
+                    (void *)(uintptr_t)i);
+    ntiers++;
+  }
+  for(i=s->nchunks-1; i>0; i--)
+    if(!seen[i]) hstore_chunk_release(s, i);
+  free(seen);
+  if(ntiers)
+    mtevL(noit_error, "histogram store: recovered %u tiers (%u/%u chunks free)\n",
+          ntiers, s->nfree, s->nchunks - 1);
+}
+
+histogram_store_t *
+histogram_store_open(const char *path, size_t size) {
+  histogram_store_t *s;
+  struct hstore_header *hdr;
+  uint32_t nchunks;
+  mtev_boolean fresh = mtev_true;
+  void *map;
+
+  if(size / HSTORE_CHUNK_SIZE > UINT32_MAX) size = (size_t)UINT32_MAX * HSTORE_CHUNK_SIZE;
+  nchunks = size / HSTORE_CHUNK_SIZE;
+  if(nchunks < 2) {
+    mtevL(noit_error, "histogram store: size %zu too small\n", size);
+    return NULL;
+  }
+  size = (size_t)nchunks * HSTORE_CHUNK_SIZE;
+
+  if(path) {
+    struct stat sb;
+    int fd = open(path, O_RDWR|O_CREAT, 0640);
+    if(fd < 0) {
+      mtevL(noit_error, "histogram store: open(%s): %s\n", path, strerror(errno));
+      return NULL;
+    }
+    if(fstat(fd, &sb) == 0 && sb.st_size == (off_t)size) fresh = mtev_false;
+    else if(ftruncate(fd, 0) != 0 || ftruncate(fd, size) != 0) {
+      mtevL(noit_error, "histogram store: ftruncate(%s): %s\n", path, strerror(errno));
+      close(fd);
+      return NULL;
+    }
+    map = mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+  }
+  else {
+    map = mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANON, -1, 0);
+  }
+  if(map == MAP_FAILED) {
+    mtevL(noit_error, "histogram store: mmap(%zu): %s\n", size, strerror(errno));
+    return NULL;
+  }
+
+  s = calloc(1, sizeof(*s));
+  s->chunks = map;
+  s->mapsize = size;
+  s->nchunks = nchunks;
+  pthread_mutex_init(&s->lock, NULL);
+  mtev_hash_init(&s->recovered);
+
+  hdr = &CHUNK(s,0)->header;
+  if(!fresh &&
+     (hdr->magic != HSTORE_MAGIC || hdr->version != HSTORE_VERSION ||
+      hdr->chunk_size != HSTORE_CHUNK_SIZE || hdr->nchunks != nchunks)) {
+    mtevL(noit_error, "histogram store: %s has an incompatible layout, resetting\n", path);
+    fresh = mtev_true;
+  }
+  if(fresh) {
+    if(path) memset(map, 0, size);
+    hdr->magic = HSTORE_MAGIC;
+    hdr->version = HSTORE_VERSION;
+    hdr->chunk_size = HSTORE_CHUNK_SIZE;
+    hdr->nchunks = nchunks;
+  }
+  hstore_recover(s);
+  return s;
+}
+
+hstore_ref_t
+histogram_store_tier(histogram_store_t *s, uuid_t checkid,
+                     const char *name, mtev_atomic32_t *usage) {
+  struct hstore_key key;
+  struct hstore_tier *t;
+  uint64_t name_hash = hstore_name_hash(name);
+  hstore_ref_t ref = 0;
+  void *vref;
+
+  hstore_key(&key, checkid, name_hash);
+  pthread_mutex_lock(&s->lock);
+  if(mtev_hash_size(&s->recovered) &&
+     mtev_hash_retrieve(&s->recovered, (const char *)&key, sizeof(key), &vref)) {
+    ref = (hstore_ref_t)(uintptr_t)vref;
+    mtev_hash_delete(&s->recovered, (const char *)&key, sizeof(key), free, NULL);
+  }
+  pthread_mutex_unlock(&s->lock);
+  if(ref) {
+    mtev_atomic_add32(usage, hstore_tier_chunks(s, ref));
+    return ref;
+  }
+
+  if(0 == (ref = hstore_chunk_alloc(s))) return 0;
+  t = TIER(s,ref);
+  memset(t, 0, sizeof(*t));
+  mtev_uuid_copy(t->checkid, checkid);
+  t->name_hash = name_hash;
+  t->hdr.kind = HSTORE_TIER;
+  mtev_atomic_inc32(usage);
+  return ref;
+}
+
+void
+histogram_store_tier_free(histogram_store_t *s, hstore_ref_t ref,
+                          mtev_atomic32_t *usage) {
+  int n;
+  if(!ref) return;
+  n = hstore_tier_chunks(s, ref);
+  pthread_mutex_lock(&s->lock);
+  hstore_tier_release(s, ref);
+  pthread_mutex_unlock(&s->lock);
+  mtev_atomic_add32(usage, -n);
+}
+
+void
+histogram_store_get_clock(histogram_store_t *s, hstore_ref_t ref,
+                          uint64_t *minute, uint8_t *second) {
+  *minute = TIER(s,ref)->last_minute;
+  *second = TIER(s,ref)->last_second;
+}
+
+void
+histogram_store_set_clock(histogram_store_t *s, hstore_ref_t ref,
+                          uint64_t minute, uint8_t second) {
+  TIER(s,ref)->last_minute = minute;
+  TIER(s,ref)->last_second = second;
+}
+
+mtev_boolean
+histogram_store_empty(histogram_store_t *s, hstore_ref_t ref, int slot) {
+  return TIER(s,ref)->slots[slot] == 0;
+}
+
+/* Initialize a bin chunk before it is published on a chain. */
+static struct hstore_bins *
+hstore_bins_new(histogram_store_t *s, int slot, uint32_t next,
+                uint32_t *idxp) {
+  struct hstore_bins *b;
+  uint32_t idx = hstore_chunk_alloc(s);
+  if(!idx) return NULL;
+  b = BINS(s,idx);
+  b->hdr.kind = HSTORE_BINS;
+  b->hdr.slot = slot;
+  b->hdr.nbins = 0;
+  b->hdr.next = next;
+  *idxp = idx;
+  return b;
+}
+
+int
+histogram_store_insert(histogram_store_t *s, hstore_ref_t ref, int slot,
+                       double val, uint64_t cnt, mtev_atomic32_t *usage) {
+  struct hstore_tier *t = TIER(s,ref);
+  struct hstore_bins *b, *space = NULL;
+  hist_bucket_t hb = double_to_hist_bucket(val);
+  uint32_t idx;
+  int i;
+
+  for(idx = t->slots[slot]; idx; idx = b->hdr.next) {
+    b = BINS(s,idx);
+    for(i=0; i<b->hdr.nbins; i++) {
+      if(b->bucket[i].val == hb.val && b->bucket[i].exp == hb.exp) {
+        b->count[i] += cnt;
+        return 0;
+      }
+    }
+    if(!space && b->hdr.nbins < HSTORE_BINS_PER_CHUNK) space = b;
+  }
+  if(!space) {
+    if(NULL == (space = hstore_bins_new(s, slot, t->slots[slot], &idx)))
+      return -1;
+    t->slots[slot] = idx;
+    mtev_atomic_inc32(usage);
+  }
+  /* the bin is only visible once nbins covers it */
+  i = space->hdr.nbins;
+  space->bucket[i] = hb;
+  space->count[i] = cnt;
+  space->hdr.nbins = i + 1;
+  return 0;
+}
+
+int
+histogram_store_accumulate(histogram_store_t *s, hstore_ref_t ref, int slot,
+                           histogram_t *h) {
+  struct hstore_bins *b;
+  uint32_t idx;
+  int i, n = 0;
+  for(idx = TIER(s,ref)->slots[slot]; idx; idx = b->hdr.next) {
+    b = BINS(s,idx);
+    for(i=0; i<b->hdr.nbins; i++) hist_insert_raw(h, b->bucket[i], b->count[i]);
+    n += b->hdr.nbins;
+  }
+  return n;
+}
+
+void
+histogram_store_clear(histogram_store_t *s, hstore_ref_t ref, int slot,
+                      mtev_atomic32_t *usage) {
+  int n = hstore_chain_free(s, &TIER(s,ref)->slots[slot]);
+  if(n) mtev_atomic_add32(usage, -n);
+}
+
+int
+histogram_store_replace(histogram_store_t *s, hstore_ref_t ref, int slot,
+                        const histogram_t *h, mtev_atomic32_t *usage) {
+  struct hstore_bins *b = NULL;
+  uint32_t head = 0;
+  int i, nbins, rv = 0;
+
+  histogram_store_clear(s, ref, slot, usage);
+  nbins = h ? hist_bucket_count(h) : 0;
+  /* build the chain privately, publish it once it is complete */
+  for(i=0; i<nbins; i++) {
+    hist_bucket_t hb;
+    uint64_t cnt;
+    if(!hist_bucket_idx_bucket(h, i, &hb, &cnt) || cnt == 0) continue;
+    if(!b || b->hdr.nbins == HSTORE_BINS_PER_CHUNK) {
+      if(NULL == (b = hstore_bins_new(s, slot, head, &head))) {
+        rv = -1;
+        break;
+      }
+      mtev_atomic_inc32(usage);
+    }
+    b->bucket[b->hdr.nbins] = hb;
+    b->count[b->hdr.nbins] = cnt;
+    b->hdr.nbins++;
+  }
+  TIER(s,ref)->slots[slot] = head;
+  return rv;
+}
+
+int
+histogram_store_reclaim(histogram_store_t *s) {
+  mtev_hash_iter iter = MTEV_HASH_ITER_ZERO;
+  const char *k;
+  int klen, n = 0;
+  void *vref;
+
+  pthread_mutex_lock(&s->lock);
+  while(mtev_hash_next(&s->recovered, &iter, &k, &klen, &vref)) {
+    hstore_tier_release(s, (hstore_ref_t)(uintptr_t)vref);
+    n++;
+  }
+  mtev_hash_delete_all(&s->recovered, free, NULL);
+  pthread_mutex_unlock(&s->lock);
+  return n;
+}
+
+void
+histogram_store_stats(histogram_store_t *s, uint32_t *total,
+                      uint32_t *used, uint32_t *unclaimed,
+                      uint64_t *dropped) {
+  pthread_mutex_lock(&s->lock);
+  *total = s->nchunks - 1;
+  *used = *total - s->nfree;
+  *unclaimed = mtev_hash_size(&s->recovered);
+  *dropped = s->dropped;
+  pthread_mutex_unlock(&s->lock);
+}
@@ -0,0 +1,105 @@
+/*
+ * Copyright (c) 2017, Circonus, Inc. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above
+ *       copyright notice, this list of conditions and the following
+ *       disclaimer in the documentation and/or other materials provided
+ *       with the distribution.
+ *     * Neither the name Circonus, Inc. nor the names
+ *       of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written
+ *       permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef MODULES_HISTOGRAM_STORE_H
+#define MODULES_HISTOGRAM_STORE_H
+
+#include <mtev_defines.h>
+#include <mtev_uuid.h>
+
+#include <circllhist.h>
+
+/* The histogram store keeps every tracked metric's tiers in one
+ * memory-mapped arena of fixed size chunks.  A metric is a tier chunk
+ * (check uuid, name hash, clock and the head of each slot's chain) and
+ * each non-empty slot is a chain of bin chunks.  When the arena is backed
+ * by a file, the tiers survive a restart (or a crash) of the process and
+ * are reattached the first time their metric is seen again.
+ */
+
+#define HSTORE_SECS 10
+#define HSTORE_TENSECS 6
+#define HSTORE_SLOT_SEC(i) (i)
+#define HSTORE_SLOT_TENSEC(i) (HSTORE_SECS + (i))
+#define HSTORE_SLOT_AGGR (HSTORE_SECS + HSTORE_TENSECS)
+#define HSTORE_SLOTS (HSTORE_SLOT_AGGR + 1)
+
+#define HSTORE_CHUNK_SIZE 128
+#define HSTORE_DEFAULT_SIZE (64 * 1024 * 1024)
+
+typedef struct histogram_store histogram_store_t;
+/* A tier is referenced by its chunk index, 0 means none. */
+typedef uint32_t hstore_ref_t;
+
+/* path may be NULL for an anonymous (non-persistent) arena. */
+histogram_store_t *
+  histogram_store_open(const char *path, size_t size);
+
+/* Find (or create) the tier for a check's metric; *usage is the number of
+ * chunks accounted to the check.  Returns 0 when the arena is full. */
+hstore_ref_t
+  histogram_store_tier(histogram_store_t *, uuid_t checkid,
+                       const char *name, mtev_atomic32_t *usage);
+void
+  histogram_store_tier_free(histogram_store_t *, hstore_ref_t,
+                            mtev_atomic32_t *usage);
+void
+  histogram_store_get_clock(histogram_store_t *, hstore_ref_t,
+                            uint64_t *minute, uint8_t *second);
+void
+  histogram_store_set_clock(histogram_store_t *, hstore_ref_t,
+                            uint64_t minute, uint8_t second);
+
+mtev_boolean
+  histogram_store_empty(histogram_store_t *, hstore_ref_t, int slot);
+int
+  histogram_store_insert(histogram_store_t *, hstore_ref_t, int slot,
+                         double val, uint64_t cnt, mtev_atomic32_t *usage);
+/* Add the slot's bins into h, returns the number of bins added. */
+int
+  histogram_store_accumulate(histogram_store_t *, hstore_ref_t, int slot,
+                             histogram_t *h);
+int
+  histogram_store_replace(histogram_store_t *, hstore_ref_t, int slot,
+                          const histogram_t *h, mtev_atomic32_t *usage);
+void
+  histogram_store_clear(histogram_store_t *, hstore_ref_t, int slot,
+                        mtev_atomic32_t *usage);
+
+/* Free recovered tiers no metric has claimed, returns how many. */
+int
+  histogram_store_reclaim(histogram_store_t *);
+void
+  histogram_store_stats(histogram_store_t *, uint32_t *total,
+                        uint32_t *used, uint32_t *unclaimed,
+                        uint64_t *dropped);
+
+#endif
@@ -42,6 +42,7 @@
 #include <mtev_rest.h>
 #include <mtev_hash.h>
 #include <mtev_json.h>
+#include <mtev_memory.h>
 #include <mtev_uuid.h>
 
 #include "noit_metric.h"
@@ -72,6 +73,8 @@ static const char *TRUNCATE_ERROR = "at least one metric truncated to 255 charac
 typedef struct _mod_config {
   mtev_hash_table *options;
   mtev_boolean asynch_metrics;
+  int offload_threshold;
+  eventer_jobq_t *jobq;
 } httptrap_mod_config_t;
 
 typedef struct httptrap_closure_s {
@@ -85,10 +88,47 @@ typedef enum {
   HTTPTRAP_VOP_ACCUMULATE
 } httptrap_vop_t;
 
-struct value_list {
-  char *v;
-  struct value_list *next;
+/* The parser never touches the check; it records what it finds as a list
+ * of operations (with names and strings in a reusable arena) that is
+ * applied to the check in bulk on the check's own thread.  A HT_OP_COMPLEX
+ * (a _type/_value map) is followed by its c.nvals HT_OP_VALUE entries.
+ */
+typedef enum {
+  HT_OP_SET,
+  HT_OP_COMPLEX,
+  HT_OP_VALUE
+} httptrap_op_type_t;
+
+struct httptrap_op {
+  httptrap_op_type_t op;
+  metric_type_t type;
+  mtev_boolean is_null;
+  size_t name;
+  union {
+    int32_t i;
+    int64_t l;
+    uint64_t L;
+    double n;
+    size_t s;
+    struct {
+      int nvals;
+      httptrap_vop_t vop;
+    } c;
+  } v;
 };
+
+struct httptrap_buf {
+  char *buf;
+  size_t len;
+  size_t allocd;
+};
+
+#define HTTPTRAP_MAX_KEYLEN (255 + MAX_DEPTH + 1)
+/* Larger bodies are parsed off the event loop, but never buffer more
+ * than this for one request. */
+#define HTTPTRAP_OFFLOAD_MAX (64 * 1024 * 1024)
+#define DEFAULT_OFFLOAD_THRESHOLD (1024 * 1024)
+
 struct rest_json_payload {
   noit_check_t *check;
   uuid_t check_id;
@@ -99,25 +139,32 @@ struct rest_json_payload {
   char *error;
   char *supp_err;
   int depth;
-  char *keys[MAX_DEPTH];
+  char keybuf[HTTPTRAP_MAX_KEYLEN];
+  int keylen[MAX_DEPTH];
   int array_depth[MAX_DEPTH];
   unsigned char last_special_key;
   unsigned char saw_complex_type;
   httptrap_vop_t vop_flag;
-  
+
   metric_type_t last_type;
-  struct value_list *last_value;
+  struct httptrap_buf lvbuf;
+  ssize_t *lv;
+  int nlv, lv_allocd;
+
+  struct httptrap_buf arena;
+  struct httptrap_op *ops;
+  int nops, ops_allocd;
+  noit_stats_batch_metric_t *batch;
+  int batch_allocd;
+
+  mtev_boolean offload;
+  struct httptrap_buf body;
+  mtev_http_rest_closure_t *restc;
+
   int cnt;
   mtev_boolean immediate;
 };
 
-#define NEW_LV(json,a) do { \
-  struct value_list *nlv = malloc(sizeof(*nlv)); \
-  nlv->v = a; \
-  nlv->next = json->last_value; \
-  json->last_value = nlv; \
-} while(0)
-
 static mtev_boolean
 noit_httptrap_check_asynch(noit_module_t *self,
                            noit_check_t *check) {
@@ -141,36 +188,94 @@ noit_httptrap_check_asynch(noit_module_t *self,
   return is_asynch;
 }
 
+static size_t
+httptrap_buf_put(struct httptrap_buf *b, const void *s, size_t len,
+                 mtev_boolean terminate) {
+  size_t off = b->len, need = b->len + len + (terminate ? 1 : 0);
+  if(need > b->allocd) {
+    size_t newsize = b->allocd ? b->allocd : 4096;
+    while(newsize < need) newsize <<= 1;
+    b->buf = realloc(b->buf, newsize);
+    b->allocd = newsize;
+  }
+  memcpy(b->buf + b->len, s, len);
+  if(terminate) b->buf[b->len + len] = '\0';
+  b->len = need;
+  return off;
+}
+static struct httptrap_op *
+httptrap_op_new(struct rest_json_payload *json, httptrap_op_type_t type) {
+  struct httptrap_op *op;
+  if(json->nops == json->ops_allocd) {
+    json->ops_allocd = json->ops_allocd ? json->ops_allocd * 2 : 256;
+    json->ops = realloc(json->ops, json->ops_allocd * sizeof(*json->ops));
+  }
+  op = &json->ops[json->nops++];
+  memset(op, 0, sizeof(*op));
+  op->op = type;
+  return op;
+}
+/* Only valid for keys that exist, the caller must check keylen >= 0 */
+static size_t
+httptrap_name_put(struct rest_json_payload *json, int depth) {
+  return httptrap_buf_put(&json->arena, json->keybuf,
+                          json->keylen[depth], mtev_true);
+}
+static struct httptrap_op *
+httptrap_set_new(struct rest_json_payload *json, metric_type_t type) {
+  struct httptrap_op *op;
+  size_t name = httptrap_name_put(json, json->depth);
+  op = httptrap_op_new(json, HT_OP_SET);
+  op->type = type;
+  op->name = name;
+  return op;
+}
+static void
+httptrap_lv_push(struct rest_json_payload *json, const char *s, size_t len) {
+  if(json->nlv == json->lv_allocd) {
+    json->lv_allocd = json->lv_allocd ? json->lv_allocd * 2 : 16;
+    json->lv = realloc(json->lv, json->lv_allocd * sizeof(*json->lv));
+  }
+  json->lv[json->nlv++] = s ? (ssize_t)httptrap_buf_put(&json->lvbuf, s, len, mtev_true) : -1;
+}
+
+/* Name the current depth "parent<delimiter>key", bounded as it always was
+ * to 255 characters (plus the delimiter).  A key below an unnamed parent
+ * (e.g. inside _ts) has no name and so produces no metrics.
+ */
+static void
+httptrap_set_key(struct rest_json_payload *json, const char *key, size_t len) {
+  int depth = json->depth, uplen;
+  if(depth == 0) {
+    memcpy(json->keybuf, key, len);
+    json->keylen[0] = len;
+    return;
+  }
+  uplen = json->keylen[depth-1];
+  if(uplen < 0) {
+    json->keylen[depth] = -1;
+    return;
+  }
+  if(uplen + 1 + len > 255) {
+    if(255 - uplen - 1 < 0) len = 0;
+    else len = 255 - uplen - 1;
+    if(!json->supp_err)
+      json->supp_err = strdup(TRUNCATE_ERROR);
+  }
+  json->keybuf[uplen] = json->delimiter;
+  memcpy(json->keybuf + uplen + 1, key, len);
+  json->keylen[depth] = uplen + 1 + len;
+}
+
 static int
 set_array_key(struct rest_json_payload *json) {
+  if(json->depth < 0) return 0;
   if(json->array_depth[json->depth] > 0) {
-    char str[256];
+    char str[32];
     int strLen;
-    snprintf(str, sizeof(str), "%d", json->array_depth[json->depth] - 1);
+    strLen = snprintf(str, sizeof(str), "%d", json->array_depth[json->depth] - 1);
     json->array_depth[json->depth]++;
-    strLen = strlen(str);
-    if(json->keys[json->depth]) free(json->keys[json->depth]);
-    json->keys[json->depth] = NULL;
-    if(json->depth == 0) {
-      json->keys[json->depth] = malloc(strLen+1);
-      memcpy(json->keys[json->depth], str, strLen);
-      json->keys[json->depth][strLen] = '\0';
-    }
-    else {
-      int uplen = strlen(json->keys[json->depth-1]);
-      /* This is too large.... return an error */
-      if(uplen + 1 + strLen > 255) {
-	   strLen = 255 - uplen - 1;
-	   if(strLen < 0) strLen = 0;
-        if(!json->supp_err)
-	     json->supp_err = strdup(TRUNCATE_ERROR);
-      }
-      json->keys[json->depth] = malloc(uplen + 1 + strLen + 1);
-      memcpy(json->keys[json->depth], json->keys[json->depth-1], uplen);
-      json->keys[json->depth][uplen] = json->delimiter;
-      memcpy(json->keys[json->depth] + uplen + 1, str, strLen);
-      json->keys[json->depth][uplen + 1 + strLen] = '\0';
-    }
+    httptrap_set_key(json, str, strLen);
   }
   return 0;
 }
@@ -185,25 +290,23 @@ httptrap_yajl_cb_null(void *ctx) {
   rv = set_array_key(json);
   if(json->last_special_key == HT_EX_VALUE) {
     _YD("[%3d]*cb_null\n", json->depth);
-    NEW_LV(json, NULL);
+    httptrap_lv_push(json, NULL, 0);
     return 1;
   }
   if(json->last_special_key) return 0;
   if(rv) return 1;
-  if(json->keys[json->depth]) {
+  if(json->keylen[json->depth] >= 0) {
+    struct httptrap_op *op;
     _YD("[%3d] cb_null\n", json->depth);
-    noit_stats_set_metric(json->check,
-        json->keys[json->depth], METRIC_INT32, NULL);
-    if(json->immediate)
-      noit_stats_log_immediate_metric(json->check,
-          json->keys[json->depth], METRIC_INT32, NULL);
+    op = httptrap_set_new(json, METRIC_INT32);
+    op->is_null = mtev_true;
     json->cnt++;
   }
   return 1;
 }
 static int
 httptrap_yajl_cb_boolean(void *ctx, int boolVal) {
-  int ival, rv;
+  int rv;
   struct rest_json_payload *json = ctx;
   if(json->depth<0) {
     _YD("[%3d] cb_boolean [BAD]\n", json->depth);
@@ -211,28 +314,46 @@ httptrap_yajl_cb_boolean(void *ctx, int boolVal) {
   }
   rv = set_array_key(json);
   if(json->last_special_key == HT_EX_VALUE) {
-    NEW_LV(json, strdup(boolVal ? "1" : "0"));
+    httptrap_lv_push(json, boolVal ? "1" : "0", 1);
     _YD("[%3d]*cb_boolean -> %s\n", json->depth, boolVal ? "true" : "false");
     return 1;
   }
   if(json->last_special_key) return 0;
   if(rv) return 1;
-  if(json->keys[json->depth]) {
-    ival = boolVal ? 1 : 0;
+  if(json->keylen[json->depth] >= 0) {
+    struct httptrap_op *op;
     _YD("[%3d] cb_boolean -> %s\n", json->depth, boolVal ? "true" : "false");
-    noit_stats_set_metric(json->check,
-        json->keys[json->depth], METRIC_INT32, &ival);
-    if(json->immediate)
-      noit_stats_log_immediate_metric(json->check,
-          json->keys[json->depth], METRIC_INT32, &ival);
+    op = httptrap_set_new(json, METRIC_INT32);
+    op->v.i = boolVal ? 1 : 0;
     json->cnt++;
   }
   return 1;
 }
+/* Numbers are classified straight out of the parser's buffer and stored
+ * typed; only values that turn out to be strings are copied (and, as
+ * always, truncated to limit-1 characters). */
+static void
+httptrap_set_guess(struct rest_json_payload *json, const char *str,
+                   size_t len, size_t limit) {
+  noit_metric_value_t v;
+  metric_type_t type;
+  struct httptrap_op *op;
+
+  if(len > limit-1) len = limit-1;
+  type = noit_metric_guess_value(str, len, &v);
+  op = httptrap_set_new(json, type);
+  switch(type) {
+    case METRIC_INT64: op->v.l = v.value.v_int64; break;
+    case METRIC_UINT64: op->v.L = v.value.v_uint64; break;
+    case METRIC_DOUBLE: op->v.n = v.value.v_double; break;
+    default:
+      op->v.s = httptrap_buf_put(&json->arena, str, len, mtev_true);
+      break;
+  }
+}
 static int
 httptrap_yajl_cb_number(void *ctx, const char * numberVal,
                         size_t numberLen) {
-  char val[128];
   struct rest_json_payload *json = ctx;
   int rv;
   if(json->depth<0) {
@@ -241,12 +362,8 @@ httptrap_yajl_cb_number(void *ctx, const char * numberVal,
   }
   rv = set_array_key(json);
   if(json->last_special_key == HT_EX_VALUE) {
-    char *str;
-    str = malloc(numberLen+1);
-    memcpy(str, numberVal, numberLen);
-    str[numberLen] = '\0';
-    NEW_LV(json, str);
-    _YD("[%3d] cb_number %s\n", json->depth, str);
+    httptrap_lv_push(json, numberVal, numberLen);
+    _YD("[%3d] cb_number %.*s\n", json->depth, (int)numberLen, numberVal);
     return 1;
   }
   if(rv) return 1;
@@ -259,16 +376,9 @@ httptrap_yajl_cb_number(void *ctx, const char * numberVal,
     _YD("[%3d] cb_number [BAD]\n", json->depth);
     return 0;
   }
-  if(json->keys[json->depth]) {
-    if(numberLen > sizeof(val)-1) numberLen = sizeof(val)-1;
-    memcpy(val, numberVal, numberLen);
-    val[numberLen] = '\0';
-    _YD("[%3d] cb_number %s\n", json->depth, val);
-    noit_stats_set_metric(json->check,
-        json->keys[json->depth], METRIC_GUESS, val);
-    if(json->immediate)
-      noit_stats_log_immediate_metric(json->check,
-          json->keys[json->depth], METRIC_GUESS, val);
+  if(json->keylen[json->depth] >= 0) {
+    _YD("[%3d] cb_number %.*s\n", json->depth, (int)numberLen, numberVal);
+    httptrap_set_guess(json, numberVal, numberLen, 128);
     json->cnt++;
   }
   return 1;
@@ -277,7 +387,6 @@ static int
 httptrap_yajl_cb_string(void *ctx, const unsigned char * stringVal,
                         size_t stringLen) {
   struct rest_json_payload *json = ctx;
-  char val[4096];
   int rv;
   if(json->depth<0) {
     _YD("[%3d] cb_string [BAD]\n", json->depth);
@@ -303,12 +412,9 @@ httptrap_yajl_cb_string(void *ctx, const unsigned char * stringVal,
     return 0;
   }
   else if(json->last_special_key == HT_EX_VALUE) {
-    char *str;
-    str = malloc(stringLen+1);
-    memcpy(str, stringVal, stringLen);
-    str[stringLen] = '\0';
-    NEW_LV(json, str);
-    _YD("[%3d] cb_string { _value: %s }\n", json->depth, str);
+    httptrap_lv_push(json, (const char *)stringVal, stringLen);
+    _YD("[%3d] cb_string { _value: %.*s }\n", json->depth,
+        (int)stringLen, stringVal);
     json->saw_complex_type |= HT_EX_VALUE;
     return 1;
   }
@@ -329,16 +435,9 @@ httptrap_yajl_cb_string(void *ctx, const unsigned char * stringVal,
   else if(json->last_special_key == HT_EX_TS) return 1;
   else if(json->last_special_key == HT_EX_TAGS) return 1;
   if(rv) return 1;
-  if(json->keys[json->depth]) {
-    if(stringLen > sizeof(val)-1) stringLen = sizeof(val)-1;
-    memcpy(val, stringVal, stringLen);
-    val[stringLen] = '\0';
-    _YD("[%3d] cb_string %s\n", json->depth, val);
-    noit_stats_set_metric(json->check,
-        json->keys[json->depth], METRIC_GUESS, val);
-    if(json->immediate)
-      noit_stats_log_immediate_metric(json->check,
-          json->keys[json->depth], METRIC_GUESS, val);
+  if(json->keylen[json->depth] >= 0) {
+    _YD("[%3d] cb_string %.*s\n", json->depth, (int)stringLen, stringVal);
+    httptrap_set_guess(json, (const char *)stringVal, stringLen, 4096);
     json->cnt++;
   }
   return 1;
@@ -350,117 +449,38 @@ httptrap_yajl_cb_start_map(void *ctx) {
   if(set_array_key(json)) return 1;
   json->depth++;
   if(json->depth >= MAX_DEPTH) return 0;
+  json->keylen[json->depth] = -1;
   return 1;
 }
 static int
 httptrap_yajl_cb_end_map(void *ctx) {
-  struct value_list *p, *last_p = NULL;
   struct rest_json_payload *json = ctx;
-  const char *metric_name;
 
   _YD("[%3d]%-.*s cb_end_map\n", json->depth, json->depth, "");
   json->depth--;
-  metric_name = json->keys[json->depth];
-  if(json->saw_complex_type == 0x3) {
-    long double total = 0, cnt = 0, accum = 1;
-    double newval;
-    mtev_boolean use_computed_value = mtev_false;
-    metric_t *m;
-
-    /* Purpose statement...
-     * for extended types, users can request that values be accumulated
-     * or averaged.. or replaced..
-     * note that replacement will still average a single submission.
-     *
-     * Here we make an attempt to find the last known metric value
-     * and if we're in avging mode, the last inprogress metric value,
-     * but we also need a cnt to make the weight right for the avg.
-     *
-     * If we are immediate mode, averaging over the "period" makes
-     * no sense whatsoever... so if the user has requested averaging
-     * and we're in immediate mode, we revert to replacement.
-     */
-    if(json->immediate && json->vop_flag == HTTPTRAP_VOP_AVERAGE)
-      json->vop_flag = HTTPTRAP_VOP_REPLACE;
-
-    switch(json->vop_flag) {
-    case HTTPTRAP_VOP_REPLACE: break;
-    case HTTPTRAP_VOP_AVERAGE:
-      /* We are asked to compute an average, presumably only within
-       * out time window (check period) so we restrict our pull to
-       * in progress metrics only (get_metric) not (get_last_metric)
-       * and we also much fetch a count...
-       */
-      m = noit_stats_get_metric(json->check, NULL, metric_name);
-      double old_value;
-      if(noit_metric_as_double(m, &old_value)) {
-        cnt = m->accumulator;
-        total = (long double)old_value * (long double)cnt;
-      }
-      break;
-    case HTTPTRAP_VOP_ACCUMULATE:
-      /* We have one value, if not found that value is zero.
-       * we also want the count to remain zero as we add, so
-       * we ultimately divide by one and not the set size, so
-       * set accum = 0 so we will not accumulate a divisor.
-       */
-      cnt = 1;
-      accum = 0;
-      m = noit_stats_get_last_metric(json->check, metric_name);
-      double old_total = 0.0;
-      noit_metric_as_double(m, &old_total);
-      total = old_total;
-      break;
-    }
-          
-    for(p=json->last_value;p;p=p->next) {
-      noit_stats_set_metric_coerce(json->check, metric_name,
-                                   json->last_type, p->v);
-      last_p = p;
-      if(p->v != NULL && IS_METRIC_TYPE_NUMERIC(json->last_type)) {
-        total += strtold(p->v, NULL);
-        cnt = cnt + accum;
-        use_computed_value = mtev_true;
-      }
+  if(json->saw_complex_type == 0x3 &&
+     json->depth >= 0 && json->keylen[json->depth] >= 0) {
+    struct httptrap_op *op;
+    size_t name = httptrap_name_put(json, json->depth);
+    int i;
+    op = httptrap_op_new(json, HT_OP_COMPLEX);
+    op->name = name;
+    op->type = json->last_type;
+    op->v.c.nvals = json->nlv;
+    op->v.c.vop = json->vop_flag;
+    for(i=0; i<json->nlv; i++) {
+      op = httptrap_op_new(json, HT_OP_VALUE);
+      if(json->lv[i] < 0) op->is_null = mtev_true;
+      else op->v.s = httptrap_buf_put(&json->arena, json->lvbuf.buf + json->lv[i],
+                                      strlen(json->lvbuf.buf + json->lv[i]),
+                                      mtev_true);
       json->cnt++;
     }
-    if(use_computed_value) {
-      newval = (double)(total / (long double)cnt);
-      /* Perform and in-place update of the metric value correcting it */
-      m = noit_stats_get_metric(json->check, NULL, metric_name);
-      if(m && IS_METRIC_TYPE_NUMERIC(m->metric_type)) {
-        if(m->metric_value.vp == NULL) {
-          double *dp = malloc(sizeof(double));
-          *dp = newval;
-          m->metric_value.vp = (void *)dp;
-        }
-        else {
-          *(m->metric_value.n) = newval;
-        }
-        m->metric_type = METRIC_DOUBLE;
-        m->accumulator = cnt;
-      }
-    }
-    if(json->immediate && last_p != NULL) {
-      if(use_computed_value) {
-        noit_stats_log_immediate_metric(json->check, metric_name, 'n', &newval);
-      }
-      else {
-        noit_stats_log_immediate_metric(json->check, metric_name, json->last_type, last_p->v);
-      }
-    }
   }
   json->saw_complex_type = 0;
   json->vop_flag = HTTPTRAP_VOP_REPLACE;
-  for(p=json->last_value;p;) {
-    struct value_list *savenext;
-    savenext = p->next;
-    if(p->v) free(p->v);
-    savenext = p->next;
-    free(p);
-    p = savenext;
-  }
-  json->last_value = NULL;
+  json->nlv = 0;
+  json->lvbuf.len = 0;
   return 1;
 }
 static int
@@ -468,6 +488,8 @@ httptrap_yajl_cb_start_array(void *ctx) {
   struct rest_json_payload *json = ctx;
   set_array_key(json);
   json->depth++;
+  if(json->depth >= MAX_DEPTH) return 0;
+  json->keylen[json->depth] = -1;
   json->array_depth[json->depth]++;
   return 1;
 }
@@ -487,15 +509,14 @@ httptrap_yajl_cb_map_key(void *ctx, const unsigned char * key,
       json->supp_err = strdup(TRUNCATE_ERROR);
     stringLen = 255;
   }
-  if(json->keys[json->depth]) free(json->keys[json->depth]);
-  json->keys[json->depth] = NULL;
+  json->keylen[json->depth] = -1;
   if(stringLen == 5 && memcmp(key, "_type", 5) == 0) {
     json->last_special_key = HT_EX_TYPE;
-    if(json->depth > 0) json->keys[json->depth] = strdup(json->keys[json->depth-1]);
+    if(json->depth > 0) json->keylen[json->depth] = json->keylen[json->depth-1];
     return 1;
   }
   if(stringLen == 6 && memcmp(key, "_value", 6) == 0) {
-    if(json->depth > 0) json->keys[json->depth] = strdup(json->keys[json->depth-1]);
+    if(json->depth > 0) json->keylen[json->depth] = json->keylen[json->depth-1];
     json->last_special_key = HT_EX_VALUE;
     json->saw_complex_type |= HT_EX_VALUE;
     return 1;
@@ -513,25 +534,7 @@ httptrap_yajl_cb_map_key(void *ctx, const unsigned char * key,
     return 1;
   }
   json->last_special_key = 0;
-  if(json->depth == 0) {
-    json->keys[json->depth] = malloc(stringLen+1);
-    memcpy(json->keys[json->depth], key, stringLen);
-    json->keys[json->depth][stringLen] = '\0';
-  }
-  else {
-    int uplen = strlen(json->keys[json->depth-1]);
-    if(uplen + 1 + stringLen > 255) {
-      if(255 - uplen - 1 < 0) stringLen = 0;
-      else stringLen = 255 - uplen - 1;
-      if(!json->supp_err)
-	   json->supp_err = strdup(TRUNCATE_ERROR);
-    }
-    json->keys[json->depth] = malloc(uplen + 1 + stringLen + 1);
-    memcpy(json->keys[json->depth], json->keys[json->depth-1], uplen);
-    json->keys[json->depth][uplen] = json->delimiter;
-    memcpy(json->keys[json->depth] + uplen + 1, key, stringLen);
-    json->keys[json->depth][uplen + 1 + stringLen] = '\0';
-  }
+  httptrap_set_key(json, (const char *)key, stringLen);
   return 1;
 }
 static yajl_callbacks httptrap_yajl_callbacks = {
@@ -546,19 +549,183 @@ static yajl_callbacks httptrap_yajl_callbacks = {
   .yajl_end_array = httptrap_yajl_cb_end_array
 };
 
+/* The per-map weighting of _value lists; see httptrap_apply_ops. */
 static void
-rest_json_payload_free(void *f) {
+httptrap_apply_complex(struct rest_json_payload *json, noit_check_t *check,
+                       struct httptrap_op *op, struct httptrap_op *vals) {
+  const char *metric_name = json->arena.buf + op->name;
+  metric_type_t last_type = op->type;
+  httptrap_vop_t vop_flag = op->v.c.vop;
+  const char *last_v = NULL;
+  mtev_boolean have_last = mtev_false;
+  long double total = 0, cnt = 0, accum = 1;
+  double newval;
+  mtev_boolean use_computed_value = mtev_false;
+  metric_t *m;
   int i;
+
+  /* Purpose statement...
+   * for extended types, users can request that values be accumulated
+   * or averaged.. or replaced..
+   * note that replacement will still average a single submission.
+   *
+   * Here we make an attempt to find the last known metric value
+   * and if we're in avging mode, the last inprogress metric value,
+   * but we also need a cnt to make the weight right for the avg.
+   *
+   * If we are immediate mode, averaging over the "period" makes
+   * no sense whatsoever... so if the user has requested averaging
+   * and we're in immediate mode, we revert to replacement.
+   */
+  if(json->immediate && vop_flag == HTTPTRAP_VOP_AVERAGE)
+    vop_flag = HTTPTRAP_VOP_REPLACE;
+
+  /* The metrics we read (and correct in place) stay valid until we
+   * leave this epoch. */
+  mtev_memory_begin();
+  switch(vop_flag) {
+  case HTTPTRAP_VOP_REPLACE: break;
+  case HTTPTRAP_VOP_AVERAGE:
+    /* We are asked to compute an average, presumably only within
+     * out time window (check period) so we restrict our pull to
+     * in progress metrics only (get_metric) not (get_last_metric)
+     * and we also much fetch a count...
+     */
+    m = noit_stats_get_metric(check, NULL, metric_name);
+    double old_value;
+    if(noit_metric_as_double(m, &old_value)) {
+      cnt = m->accumulator;
+      total = (long double)old_value * (long double)cnt;
+    }
+    break;
+  case HTTPTRAP_VOP_ACCUMULATE:
+    /* We have one value, if not found that value is zero.
+     * we also want the count to remain zero as we add, so
+     * we ultimately divide by one and not the set size, so
+     * set accum = 0 so we will not accumulate a divisor.
+     */
+    cnt = 1;
+    accum = 0;
+    m = noit_stats_get_last_metric(check, metric_name);
+    double old_total = 0.0;
+    noit_metric_as_double(m, &old_total);
+    total = old_total;
+    break;
+  }
+
+  /* Values are applied most recent first, so the first one submitted
+   * is the one that sticks (and is logged). */
+  for(i=op->v.c.nvals-1; i>=0; i--) {
+    const char *v = vals[i].is_null ? NULL : json->arena.buf + vals[i].v.s;
+    noit_stats_set_metric_coerce(check, metric_name, last_type, v);
+    last_v = v;
+    have_last = mtev_true;
+    if(v != NULL && IS_METRIC_TYPE_NUMERIC(last_type)) {
+      total += strtold(v, NULL);
+      cnt = cnt + accum;
+      use_computed_value = mtev_true;
+    }
+  }
+  if(use_computed_value) {
+    newval = (double)(total / (long double)cnt);
+    /* Perform and in-place update of the metric value correcting it */
+    m = noit_stats_get_metric(check, NULL, metric_name);
+    if(m && IS_METRIC_TYPE_NUMERIC(m->metric_type)) {
+      if(m->metric_value.vp == NULL) {
+        double *dp = malloc(sizeof(double));
+        *dp = newval;
+        m->metric_value.vp = (void *)dp;
+      }
+      else {
+        *(m->metric_value.n) = newval;
+      }
+      m->metric_type = METRIC_DOUBLE;
+      m->accumulator = cnt;
+    }
+  }
+  mtev_memory_end();
+  if(json->immediate && have_last) {
+    if(use_computed_value) {
+      noit_stats_log_immediate_metric(check, metric_name, 'n', &newval);
+    }
+    else {
+      noit_stats_log_immediate_metric(check, metric_name, last_type, last_v);
+    }
+  }
+}
+
+/* Apply everything parsed so far to the check.  Inline requests call
+ * this on the check's eventer thread after each chunk read; offloaded
+ * ones call it once, from the parse job's completion (see
+ * httptrap_offload_job).  Plain metrics are handed to the stats layer
+ * in bulk; a complex map reads back in-progress values, so whatever
+ * precedes it is applied first to keep submission order.
+ */
+static void
+httptrap_apply_ops(struct rest_json_payload *json, noit_check_t *check) {
+  int i = 0, nb = 0;
+  if(check && json->nops > 0) {
+    if(json->batch_allocd < json->nops) {
+      json->batch_allocd = json->ops_allocd;
+      free(json->batch);
+      json->batch = malloc(json->batch_allocd * sizeof(*json->batch));
+    }
+    while(i < json->nops) {
+      struct httptrap_op *op = &json->ops[i];
+      if(op->op == HT_OP_SET) {
+        noit_stats_batch_metric_t *b = &json->batch[nb++];
+        b->name = json->arena.buf + op->name;
+        b->type = op->type;
+        if(op->is_null) b->value = NULL;
+        else if(op->type == METRIC_STRING) b->value = json->arena.buf + op->v.s;
+        else b->value = &op->v;
+        i++;
+        continue;
+      }
+      if(nb) {
+        noit_stats_set_metric_batch(check, json->batch, nb, json->immediate);
+        nb = 0;
+      }
+      if(op->op == HT_OP_COMPLEX) {
+        httptrap_apply_complex(json, check, op, op + 1);
+        i += op->v.c.nvals;
+      }
+      i++;
+    }
+    if(nb) noit_stats_set_metric_batch(check, json->batch, nb, json->immediate);
+  }
+  json->nops = 0;
+  json->arena.len = 0;
+}
+
+static void
+rest_json_payload_free(void *f) {
   struct rest_json_payload *json = f;
   if(json->parser) yajl_free(json->parser);
   if(json->error) free(json->error);
   if(json->supp_err) free(json->supp_err);
-  for(i=0;i<MAX_DEPTH;i++)
-    if(json->keys[i]) free(json->keys[i]);
-  if(json->last_value) free(json->last_value);
+  free(json->lvbuf.buf);
+  free(json->lv);
+  free(json->arena.buf);
+  free(json->ops);
+  free(json->batch);
+  free(json->body.buf);
   free(json);
 }
 
+static void
+httptrap_parse_chunk(struct rest_json_payload *rxc,
+                     const unsigned char *buffer, int len) {
+  yajl_status status;
+  status = yajl_parse(rxc->parser, buffer, len);
+  if(status != yajl_status_ok) {
+    unsigned char *err;
+    err = yajl_get_error(rxc->parser, 1, buffer, len);
+    rxc->error = strdup((char *)err);
+    yajl_free_error(rxc->parser, err);
+  }
+}
+
 static struct rest_json_payload *
 rest_get_json_upload(mtev_http_rest_closure_t *restc,
                     int *mask, int *complete) {
@@ -586,16 +753,18 @@ rest_get_json_upload(mtev_http_rest_closure_t *restc,
             sizeof(buffer),
             mask);
     if(len > 0) {
-      yajl_status status;
-      _YD("inbound payload chunk (%d bytes) continuing YAJL parse\n", len);
-      status = yajl_parse(rxc->parser, (unsigned char *)buffer, len);
-      if(status != yajl_status_ok) {
-        unsigned char *err;
-        *complete = 1;
-        err = yajl_get_error(rxc->parser, 1, (unsigned char *)buffer, len);
-        rxc->error = strdup((char *)err);
-        yajl_free_error(rxc->parser, err);
-        return rxc;
+      if(rxc->offload) {
+        /* parsed all at once, off the event loop, when complete */
+        httptrap_buf_put(&rxc->body, buffer, len, mtev_false);
+      }
+      else {
+        _YD("inbound payload chunk (%d bytes) continuing YAJL parse\n", len);
+        httptrap_parse_chunk(rxc, (unsigned char *)buffer, len);
+        httptrap_apply_ops(rxc, rxc->check);
+        if(rxc->error) {
+          *complete = 1;
+          return rxc;
+        }
       }
       rxc->len += len;
     }
@@ -608,8 +777,11 @@ rest_get_json_upload(mtev_http_rest_closure_t *restc,
     if((mtev_http_request_payload_chunked(req) && len == 0) ||
        (rxc->len == content_length)) {
       rxc->complete = 1;
-      _YD("no more data, finishing YAJL parse\n");
-      yajl_complete_parse(rxc->parser);
+      if(!rxc->offload) {
+        _YD("no more data, finishing YAJL parse\n");
+        yajl_complete_parse(rxc->parser);
+        httptrap_apply_ops(rxc, rxc->check);
+      }
     }
   }
 
@@ -677,21 +849,147 @@ cross_module_reverse_allowed(noit_check_t *check, const char *secret) {
 }
 
 static int
-rest_httptrap_handler(mtev_http_rest_closure_t *restc,
-                      int npats, char **pats) {
-  int mask, complete = 0, cnt;
-  struct rest_json_payload *rxc = NULL;
-  const char *error = "internal error", *secret = NULL;
-  mtev_http_session_ctx *ctx = restc->http_ctx;
+httptrap_respond(mtev_http_session_ctx *ctx, struct rest_json_payload *rxc,
+                 const char *error) {
   const unsigned int DEBUGDATA_OUT_SIZE=4096;
-  const unsigned int JSON_OUT_SIZE=DEBUGDATA_OUT_SIZE+128;
   char debugdata_out[DEBUGDATA_OUT_SIZE];
   int debugflag=0;
   const char *debugchkflag;
   noit_check_t *check;
-  uuid_t check_id;
   mtev_http_request *req;
   mtev_hash_table *hdrs;
+  int cnt;
+
+  if(!rxc) goto error;
+  if(rxc->error) goto error;
+
+  cnt = rxc->cnt;
+
+  mtev_http_response_status_set(ctx, 200, "OK");
+  mtev_http_response_header_set(ctx, "Content-Type", "application/json");
+  mtev_http_response_option_set(ctx, MTEV_HTTP_CLOSE);
+
+  /*Examine headers for x-circonus-httptrap-debug flag*/
+  req = mtev_http_session_request(ctx);
+  hdrs = mtev_http_request_headers_table(req);
+
+  /*Check if debug header passed in. If present and set to true, set debugflag value to one.*/
+  if(mtev_hash_retr_str(hdrs, "x-circonus-httptrap-debug", strlen("x-circonus-httptrap-debug"), &debugchkflag))
+  {
+    if (strcmp(debugchkflag,"true")==0)
+    {
+      debugflag=1;
+    }
+  }
+
+  json_object *obj =  NULL;
+  obj = json_object_new_object();
+  /*If debugflag remains zero, simply output the number of metrics.*/
+  if (debugflag==0)
+  {
+    json_object_object_add(obj, "stats", json_object_new_int(cnt));
+    if (rxc->supp_err)
+      json_object_object_add(obj, "error", json_object_new_string(rxc->supp_err));
+  }
+
+  /*Otherwise, if set to one, output current metrics in addition to number of current metrics.*/
+  else if (debugflag==1)
+  {
+      stats_t *c;
+      json_object *metrics_obj;
+      metrics_obj = json_object_new_object();
+
+      /*Retrieve check information.*/
+      check = noit_poller_lookup(rxc->check_id);
+      mtev_memory_begin();
+      c = noit_check_get_stats_inprogress(check);
+      uint32_t iter = 0;
+      metric_t *tmp;
+      memset(debugdata_out,'\0',sizeof(debugdata_out));
+
+      /*Extract metrics*/
+      while(noit_check_stats_metric_next(c, &iter, &tmp))
+      {
+        char buff[256], type_str[2];
+        char *metric_name=tmp->metric_name;
+        metric_type_t metric_type=tmp->metric_type;
+        noit_stats_snprint_metric_value(buff, sizeof(buff), tmp);
+        json_object *value_obj = json_object_new_object();
+	   snprintf(type_str, sizeof(type_str), "%c", metric_type);
+	   json_object_object_add(value_obj, "_type", json_object_new_string(type_str));
+	   json_object_object_add(value_obj, "_value", json_object_new_string(buff));
+	   json_object_object_add(metrics_obj, metric_name, value_obj);
+      }
+      mtev_memory_end();
+
+      /*Output stats and metrics.*/
+      json_object_object_add(obj, "stats", json_object_new_int(cnt));
+      json_object_object_add(obj, "metrics", metrics_obj);
+  }
+
+  const char *json_out = json_object_to_json_string(obj);
+  mtev_http_response_append(ctx, json_out, strlen(json_out));
+  json_object_put(obj);
+  mtev_http_response_end(ctx);
+  return 0;
+
+ error:
+  mtev_http_response_server_error(ctx, "application/json");
+  mtev_http_response_append(ctx, "{ \"error\": \"", 12);
+  if(rxc && rxc->error) error = rxc->error;
+  mtev_http_response_append(ctx, error, strlen(error));
+  mtev_http_response_append(ctx, "\" }", 3);
+  mtev_http_response_end(ctx);
+  return 0;
+}
+
+/* Large bodies are not parsed on an event loop at all: the connection
+ * is floated off the loop (mtev_http_connection_event_float and
+ * eventer_remove_fde), the buffered body is parsed by a httptrap_parse
+ * jobq thread, and the completion callback -- run by the job's owner,
+ * the check's eventer thread -- applies the whole op list at once,
+ * answers and hands the connection back.
+ */
+static int
+httptrap_offload_job(eventer_t e, int mask, void *closure,
+                     struct timeval *now) {
+  struct rest_json_payload *rxc = closure;
+  mtev_http_rest_closure_t *restc = rxc->restc;
+  mtev_http_session_ctx *ctx = restc->http_ctx;
+  eventer_t conne;
+
+  if(mask == EVENTER_ASYNCH_WORK) {
+    _YD("parsing %d byte payload in jobq\n", (int)rxc->body.len);
+    httptrap_parse_chunk(rxc, (unsigned char *)rxc->body.buf, rxc->body.len);
+    if(!rxc->error) yajl_complete_parse(rxc->parser);
+    return 0;
+  }
+  if(mask != EVENTER_ASYNCH) return 0;
+
+  /* The check may have gone away while we parsed */
+  rxc->check = noit_poller_lookup(rxc->check_id);
+  httptrap_apply_ops(rxc, rxc->check);
+
+  restc->call_closure = NULL;
+  restc->call_closure_free = NULL;
+  restc->fastpath = NULL;
+  httptrap_respond(ctx, rxc->check ? rxc : NULL, "no such check");
+  rest_json_payload_free(rxc);
+
+  conne = mtev_http_connection_event(mtev_http_session_connection(ctx));
+  if(conne) eventer_trigger(conne, EVENTER_READ | EVENTER_WRITE);
+  return 0;
+}
+
+static int
+rest_httptrap_handler(mtev_http_rest_closure_t *restc,
+                      int npats, char **pats) {
+  int mask, complete = 0;
+  struct rest_json_payload *rxc = NULL;
+  const char *error = "internal error", *secret = NULL;
+  mtev_http_session_ctx *ctx = restc->http_ctx;
+  noit_check_t *check;
+  uuid_t check_id;
 
   if(npats != 2) {
     error = "bad uri";
@@ -704,9 +1002,11 @@ rest_httptrap_handler(mtev_http_rest_closure_t *restc,
 
   if(restc->call_closure == NULL) {
     mtev_boolean allowed = mtev_false;
-    httptrap_closure_t *ccl = NULL;
     const char *delimiter = NULL;
+    httptrap_mod_config_t *conf = NULL;
+    int content_length;
     rxc = restc->call_closure = calloc(1, sizeof(*rxc));
+    restc->call_closure_free = rest_json_payload_free;
     rxc->delimiter = DEFAULT_HTTPTRAP_DELIMITER;
     check = noit_poller_lookup(check_id);
     if(!check) {
@@ -717,7 +1017,7 @@ rest_httptrap_handler(mtev_http_rest_closure_t *restc,
       error = "no such httptrap check";
       goto error;
     }
- 
+
     /* check "secret" then "httptrap_secret" as a fallback */
     (void)mtev_hash_retr_str(check->config, "secret", strlen("secret"), &secret);
     if(!secret) (void)mtev_hash_retr_str(check->config, "httptrap_secret", strlen("httptrap_secret"), &secret);
@@ -741,7 +1041,16 @@ rest_httptrap_handler(mtev_http_rest_closure_t *restc,
     yajl_config(rxc->parser, yajl_dont_validate_strings, 1);
     yajl_config(rxc->parser, yajl_allow_trailing_garbage, 1);
     yajl_config(rxc->parser, yajl_allow_partial_values, 1);
-    restc->call_closure_free = rest_json_payload_free;
+
+    if(global_self) conf = noit_module_get_userdata(global_self);
+    content_length =
+      mtev_http_request_content_length(mtev_http_session_request(ctx));
+    if(conf && conf->jobq && conf->offload_threshold > 0 &&
+       content_length > conf->offload_threshold &&
+       content_length <= HTTPTRAP_OFFLOAD_MAX) {
+      rxc->offload = mtev_true;
+      rxc->restc = restc;
+    }
   }
   else rxc = restc->call_closure;
 
@@ -761,90 +1070,20 @@ rest_httptrap_handler(mtev_http_rest_closure_t *restc,
   rxc = rest_get_json_upload(restc, &mask, &complete);
   if(rxc == NULL && !complete) return mask;
 
-  if(!rxc) goto error;
-  if(rxc->error) goto error;
-
-  cnt = rxc->cnt;
-
-  mtev_http_response_status_set(ctx, 200, "OK"); 
-  mtev_http_response_header_set(ctx, "Content-Type", "application/json");
-  mtev_http_response_option_set(ctx, MTEV_HTTP_CLOSE); 
-  
-  /*Examine headers for x-circonus-httptrap-debug flag*/
-  req = mtev_http_session_request(ctx);
-  hdrs = mtev_http_request_headers_table(req); 
-    
-  /*Check if debug header passed in. If present and set to true, set debugflag value to one.*/
-  if(mtev_hash_retr_str(hdrs, "x-circonus-httptrap-debug", strlen("x-circonus-httptrap-debug"), &debugchkflag))
-  {
-    if (strcmp(debugchkflag,"true")==0)
-    {
-      debugflag=1;
-    }
-  }
-   
-  json_object *obj =  NULL;
-  obj = json_object_new_object();
-  /*If debugflag remains zero, simply output the number of metrics.*/
-  if (debugflag==0)
-  {
-    json_object_object_add(obj, "stats", json_object_new_int(cnt));
-    if (rxc->supp_err)
-      json_object_object_add(obj, "error", json_object_new_string(rxc->supp_err));
-  }
-  
-  /*Otherwise, if set to one, output current metrics in addition to number of current metrics.*/
-  else if (debugflag==1)
-  {        
-      stats_t *c;
-      mtev_hash_table *metrics;
-      json_object *metrics_obj;
-      metrics_obj = json_object_new_object();
-        
-      /*Retrieve check information.*/        
-      check = noit_poller_lookup(check_id);
-      c = noit_check_get_stats_inprogress(check);
-      metrics = noit_check_stats_metrics(c);
-      mtev_hash_iter iter = MTEV_HASH_ITER_ZERO;
-      const char *k;
-      int klen;
-      void *data;
-      memset(debugdata_out,'\0',sizeof(debugdata_out));
-      
-      /*Extract metrics*/
-      while(mtev_hash_next(metrics, &iter, &k, &klen, &data))
-      {
-        char buff[256], type_str[2];
-        metric_t *tmp=(metric_t *)data;
-        char *metric_name=tmp->metric_name;
-        metric_type_t metric_type=tmp->metric_type;
-        noit_stats_snprint_metric_value(buff, sizeof(buff), tmp);
-        json_object *value_obj = json_object_new_object();
-	   snprintf(type_str, sizeof(type_str), "%c", metric_type);
-	   json_object_object_add(value_obj, "_type", json_object_new_string(type_str));
-	   json_object_object_add(value_obj, "_value", json_object_new_string(buff));
-	   json_object_object_add(metrics_obj, metric_name, value_obj);
-      }
-        
-      /*Output stats and metrics.*/
-      json_object_object_add(obj, "stats", json_object_new_int(cnt));
-      json_object_object_add(obj, "metrics", metrics_obj);
+  if(rxc && !rxc->error && rxc->offload) {
+    httptrap_mod_config_t *conf = noit_module_get_userdata(global_self);
+    eventer_t conne, job;
+    conne = mtev_http_connection_event_float(mtev_http_session_connection(ctx));
+    if(conne) eventer_remove_fde(conne);
+    job = eventer_alloc_asynch(httptrap_offload_job, rxc);
+    eventer_set_owner(job, CHOOSE_EVENTER_THREAD_FOR_CHECK(rxc->check));
+    eventer_add_asynch(conf->jobq, job);
+    return 0;
   }
-
-  const char *json_out = json_object_to_json_string(obj);
-  mtev_http_response_append(ctx, json_out, strlen(json_out));
-  json_object_put(obj);
-  mtev_http_response_end(ctx);
-  return 0;
+  return httptrap_respond(ctx, rxc, error);
 
  error:
-  mtev_http_response_server_error(ctx, "application/json");
-  mtev_http_response_append(ctx, "{ \"error\": \"", 12);
-  if(rxc && rxc->error) error = rxc->error;
-  mtev_http_response_append(ctx, error, strlen(error));
-  mtev_http_response_append(ctx, "\" }", 3);
-  mtev_http_response_end(ctx);
-  return 0;
+  return httptrap_respond(ctx, NULL, error);
 }
 
 static int noit_httptrap_initiate_check(noit_module_t *self,
@@ -907,6 +1146,24 @@ static int noit_httptrap_init(noit_module_t *self) {
       httptrap_surrogate = mtev_true;
   }
 
+  conf->offload_threshold = DEFAULT_OFFLOAD_THRESHOLD;
+  if(mtev_hash_retr_str(conf->options,
+                        "offload_threshold", strlen("offload_threshold"),
+                        (const char **)&config_val)) {
+    conf->offload_threshold = atoi(config_val);
+  }
+  if(conf->offload_threshold > 0 && !conf->jobq) {
+    int concurrency = 2;
+    if(mtev_hash_retr_str(conf->options,
+                          "offload_concurrency", strlen("offload_concurrency"),
+                          (const char **)&config_val)) {
+      concurrency = atoi(config_val);
+      if(concurrency < 1) concurrency = 1;
+    }
+    conf->jobq = eventer_jobq_create("httptrap_parse");
+    eventer_jobq_set_concurrency(conf->jobq, concurrency);
+  }
+
   noit_module_set_userdata(self, conf);
 
   /* register rest handler */
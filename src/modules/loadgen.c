@@ -0,0 +1,515 @@
+/*
+ * Copyright (c) 2017, Circonus, Inc. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above
+ *       copyright notice, this list of conditions and the following
+ *       disclaimer in the documentation and/or other materials provided
+ *       with the distribution.
+ *     * Neither the name Circonus, Inc. nor the names
+ *       of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written
+ *       permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* loadgen: a synthetic load source.  A loadgen check ("the driver")
+ * owns N disabled checks and, once per period, gives each of them a
+ * result of M metrics and hands it to noit_check_set_stats(), so the
+ * load runs through the real filterset, director and bundle code and
+ * lands in the feeds as whatever the feed is configured to write.
+ *
+ * The simulated checks get uuids derived from the driver's, so they
+ * keep their identity (and stratcon's view of them) across restarts.
+ * Results are emitted in "slices" spread over the period to give the
+ * feed a steady rate rather than one burst per period.
+ */
+
+#include <mtev_defines.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+
+#include <mtev_hash.h>
+#include <mtev_uuid.h>
+
+#include "noit_mtev_bridge.h"
+#include "noit_module.h"
+#include "noit_jlog_listener.h"
+#include "noit_check.h"
+#include "noit_check_tools.h"
+
+#define LOADGEN_DRIVER_KEY "loadgen_driver"
+
+typedef union {
+  double n;
+  uint64_t L;
+  int32_t i;
+  int64_t l;
+  const char *s;
+} loadgen_value_t;
+
+typedef struct {
+  noit_module_t *self;
+  noit_check_t *check;
+
+  /* configuration as of the current run */
+  int nchecks;
+  int nmetrics;
+  int ntext;
+  int bad_percent;
+  int nslices;
+
+  /* simulated checks that may exist, so we know what to remove */
+  int created;
+  mtev_hash_table child_config;
+
+  char **names;
+  loadgen_value_t *values;
+  noit_stats_batch_metric_t *batch;
+  int names_allocd;
+  int names_text;     /* how many of the names are text_ ones */
+
+  /* the run in progress */
+  eventer_t slice_e;
+  int slice;
+  struct timeval start;
+  struct timeval last_start;
+  uint64_t seed;
+  uint64_t run;
+
+  /* reported on the driver */
+  uint64_t checks_emitted;
+  uint64_t metrics_emitted;
+  uint64_t checks_recreated;
+  uint64_t overruns;
+  uint64_t run_checks;
+  double emit_ms;
+  double max_lateness_ms;
+} loadgen_info_t;
+
+typedef struct {
+  uuid_t driver;
+  int created;
+} loadgen_reap_t;
+
+static mtev_log_stream_t nlerr = NULL;
+static mtev_log_stream_t nldeb = NULL;
+
+static const char *loadgen_texts[] = {
+  "ok", "degraded", "recovering", "maintenance", "unknown"
+};
+
+static uint64_t
+loadgen_rand(loadgen_info_t *ci) {
+  /* xorshift64*, plenty for synthetic data */
+  ci->seed ^= ci->seed >> 12;
+  ci->seed ^= ci->seed << 25;
+  ci->seed ^= ci->seed >> 27;
+  return ci->seed * 2685821657736338717ULL;
+}
+
+static void
+loadgen_child_id(uuid_t out, uuid_t driver, int idx) {
+  uint32_t n = (uint32_t)idx + 1;
+  mtev_uuid_copy(out, driver);
+  out[12] ^= (n >> 24) & 0xff;
+  out[13] ^= (n >> 16) & 0xff;
+  out[14] ^= (n >> 8) & 0xff;
+  out[15] ^= n & 0xff;
+}
+
+static int
+loadgen_config_int(noit_check_t *check, const char *key, int def) {
+  const char *v;
+  if(!check->config ||
+     !mtev_hash_retr_str(check->config, key, strlen(key), &v)) return def;
+  return atoi(v);
+}
+
+static void
+loadgen_free_names(loadgen_info_t *ci) {
+  int i;
+  if(ci->names) {
+    for(i=0; i<ci->names_allocd; i++) free(ci->names[i]);
+    free(ci->names);
+  }
+  free(ci->values);
+  free(ci->batch);
+  ci->names = NULL;
+  ci->values = NULL;
+  ci->batch = NULL;
+  ci->names_allocd = 0;
+  ci->names_text = 0;
+}
+
+static void
+loadgen_configure(loadgen_info_t *ci, noit_check_t *check) {
+  int i;
+
+  ci->nchecks = loadgen_config_int(check, "checks", 100);
+  ci->nmetrics = loadgen_config_int(check, "metrics", 50);
+  ci->ntext = loadgen_config_int(check, "text_metrics", 1);
+  ci->bad_percent = loadgen_config_int(check, "bad_percent", 0);
+  ci->nslices = loadgen_config_int(check, "slices", 10);
+  if(ci->nchecks < 0) ci->nchecks = 0;
+  if(ci->nmetrics < 0) ci->nmetrics = 0;
+  if(ci->ntext < 0) ci->ntext = 0;
+  if(ci->ntext > ci->nmetrics) ci->ntext = ci->nmetrics;
+  if(ci->nslices < 1) ci->nslices = 1;
+  if(ci->nchecks > 0 && ci->nslices > ci->nchecks) ci->nslices = ci->nchecks;
+
+  if(ci->names_allocd == ci->nmetrics && ci->names_text == ci->ntext) return;
+  loadgen_free_names(ci);
+  if(ci->nmetrics == 0) return;
+  ci->names = calloc(ci->nmetrics, sizeof(*ci->names));
+  ci->values = calloc(ci->nmetrics, sizeof(*ci->values));
+  ci->batch = calloc(ci->nmetrics, sizeof(*ci->batch));
+  for(i=0; i<ci->nmetrics; i++) {
+    char buff[32];
+    if(i < ci->nmetrics - ci->ntext) snprintf(buff, sizeof(buff), "metric_%04d", i);
+    else snprintf(buff, sizeof(buff), "text_%04d", i - (ci->nmetrics - ci->ntext));
+    ci->names[i] = strdup(buff);
+  }
+  ci->names_allocd = ci->nmetrics;
+  ci->names_text = ci->ntext;
+}
+
+/* Delete simulated checks [from, to) of the given driver. */
+static void
+loadgen_remove_children(uuid_t driver, int from, int to) {
+  int i;
+  for(i=from; i<to; i++) {
+    uuid_t id;
+    loadgen_child_id(id, driver, i);
+    noit_poller_deschedule(id, mtev_true);
+  }
+}
+
+/* Run after a driver is freed: its simulated checks go with it, unless
+ * the driver has been recreated (a reconfiguration) in the meantime.
+ */
+static int
+loadgen_reap(eventer_t e, int mask, void *closure, struct timeval *now) {
+  loadgen_reap_t *r = closure;
+  noit_check_t *driver = noit_poller_lookup(r->driver);
+  if(!driver || strcmp(driver->module, "loadgen")) {
+    mtevL(nldeb, "loadgen removing %d simulated checks\n", r->created);
+    loadgen_remove_children(r->driver, 0, r->created);
+  }
+  free(r);
+  return 0;
+}
+
+static noit_check_t *
+loadgen_child(loadgen_info_t *ci, int idx) {
+  noit_check_t *check = ci->check, *child;
+  uuid_t id, out;
+  char name[256];
+
+  loadgen_child_id(id, check->checkid, idx);
+  if((child = noit_poller_lookup(id)) != NULL) return child;
+
+  snprintf(name, sizeof(name), "%s.%d", check->name, idx);
+  noit_poller_schedule(check->target, check->module, name, check->filterset,
+                       &ci->child_config, NULL, check->period, check->timeout,
+                       NULL, 0, NP_DISABLED, id, out);
+  ci->checks_recreated++;
+  return noit_poller_lookup(id);
+}
+
+static void
+loadgen_emit(loadgen_info_t *ci, noit_check_t *child, int idx,
+             struct timeval *now) {
+  int i, nnumeric = ci->nmetrics - ci->ntext;
+  int bad = ci->bad_percent > 0 &&
+            (int)(loadgen_rand(ci) % 100) < ci->bad_percent;
+
+  noit_stats_set_whence(child, now);
+  noit_stats_set_duration(child, loadgen_rand(ci) % 250);
+  noit_stats_set_available(child, bad ? NP_UNAVAILABLE : NP_AVAILABLE);
+  noit_stats_set_state(child, bad ? NP_BAD : NP_GOOD);
+  noit_stats_set_status(child, bad ? "synthetic failure" : "ok");
+
+  for(i=0; i<ci->nmetrics; i++) {
+    noit_stats_batch_metric_t *m = &ci->batch[i];
+    loadgen_value_t *v = &ci->values[i];
+    m->name = ci->names[i];
+    m->value = v;
+    if(i >= nnumeric) {
+      m->type = METRIC_STRING;
+      v->s = loadgen_texts[loadgen_rand(ci) % (sizeof(loadgen_texts)/sizeof(*loadgen_texts))];
+      m->value = v->s;
+      continue;
+    }
+    switch(i % 4) {
+      case 0: /* a wavy gauge */
+        m->type = METRIC_DOUBLE;
+        v->n = 100.0 + 50.0 * sin((double)(ci->run + idx + i) / 10.0) +
+               (double)(loadgen_rand(ci) % 1000) / 100.0;
+        break;
+      case 1: /* a steadily increasing counter */
+        m->type = METRIC_UINT64;
+        v->L = ci->run * (uint64_t)(i + 1) * 1000 + (uint64_t)idx;
+        break;
+      case 2:
+        m->type = METRIC_INT32;
+        v->i = (int32_t)(loadgen_rand(ci) % 10000);
+        break;
+      default:
+        m->type = METRIC_INT64;
+        v->l = (int64_t)(loadgen_rand(ci) >> 1) - (INT64_MAX / 2);
+        break;
+    }
+  }
+  if(ci->nmetrics) noit_stats_set_metric_batch(child, ci->batch, ci->nmetrics, mtev_false);
+  noit_check_set_stats(child);
+  ci->checks_emitted++;
+  ci->metrics_emitted += ci->nmetrics;
+}
+
+static int loadgen_feed_details(jlog_feed_stats_t *s, void *closure) {
+  char buff[256];
+  uint64_t ms;
+  int32_t s32;
+  struct timeval now, diff;
+  noit_check_t *check = closure;
+
+  mtev_gettimeofday(&now, NULL);
+  if(s->last_checkpoint.tv_sec > 0) {
+    sub_timeval(now, s->last_checkpoint, &diff);
+    ms = diff.tv_sec * 1000 + diff.tv_usec / 1000;
+    snprintf(buff, sizeof(buff), "feed`%s`last_checkpoint_ms", s->feed_name);
+    noit_stats_set_metric(check, buff, METRIC_UINT64, &ms);
+  }
+  s32 = s->connections;
+  snprintf(buff, sizeof(buff), "feed`%s`connections", s->feed_name);
+  noit_stats_set_metric(check, buff, METRIC_INT32, &s32);
+  return 1;
+}
+
+static void
+loadgen_log_results(loadgen_info_t *ci, struct timeval *now) {
+  noit_check_t *check = ci->check;
+  struct timeval duration, interval;
+  double secs, d;
+  int32_t s32;
+
+  sub_timeval(*now, ci->start, &duration);
+  if(ci->last_start.tv_sec) sub_timeval(ci->start, ci->last_start, &interval);
+  else {
+    interval.tv_sec = check->period / 1000;
+    interval.tv_usec = (check->period % 1000) * 1000;
+  }
+  secs = interval.tv_sec + (double)interval.tv_usec / 1000000.0;
+  if(secs <= 0) secs = 1;
+
+  noit_stats_set_whence(check, now);
+  noit_stats_set_duration(check, duration.tv_sec * 1000 + duration.tv_usec / 1000);
+  noit_stats_set_available(check, NP_AVAILABLE);
+  noit_stats_set_state(check, NP_GOOD);
+  noit_stats_set_status(check, "ok");
+
+  s32 = ci->nchecks;
+  noit_stats_set_metric(check, "checks", METRIC_INT32, &s32);
+  s32 = ci->nmetrics;
+  noit_stats_set_metric(check, "metrics_per_check", METRIC_INT32, &s32);
+  noit_stats_set_metric(check, "checks_emitted", METRIC_UINT64, &ci->checks_emitted);
+  noit_stats_set_metric(check, "metrics_emitted", METRIC_UINT64, &ci->metrics_emitted);
+  noit_stats_set_metric(check, "checks_created", METRIC_UINT64, &ci->checks_recreated);
+  noit_stats_set_metric(check, "overruns", METRIC_UINT64, &ci->overruns);
+  d = (double)ci->run_checks / secs;
+  noit_stats_set_metric(check, "checks_per_second", METRIC_DOUBLE, &d);
+  d = (double)ci->run_checks * ci->nmetrics / secs;
+  noit_stats_set_metric(check, "metrics_per_second", METRIC_DOUBLE, &d);
+  noit_stats_set_metric(check, "emit_ms", METRIC_DOUBLE, &ci->emit_ms);
+  noit_stats_set_metric(check, "slice_lateness_ms", METRIC_DOUBLE, &ci->max_lateness_ms);
+  noit_jlog_foreach_feed_stats(loadgen_feed_details, check);
+
+  noit_check_set_stats(check);
+  mtevL(nldeb, "loadgen %s: %d checks in %0.3fms, %0.3fms late\n",
+        check->name, (int)ci->run_checks, ci->emit_ms, ci->max_lateness_ms);
+}
+
+static int
+loadgen_slice(eventer_t e, int mask, void *closure, struct timeval *now) {
+  loadgen_info_t *ci = closure;
+  noit_check_t *check = ci->check;
+  struct timeval due, offset, lateness, done;
+  uint64_t offset_ms;
+  int i, from, to;
+  double ms;
+
+  if(e) ci->slice_e = NULL;
+  if(check->flags & NP_KILLED) {
+    /* deleted mid-run; cleanup will take the simulated checks with it */
+    check->flags &= ~NP_RUNNING;
+    return 0;
+  }
+
+  offset_ms = (uint64_t)check->period * ci->slice / ci->nslices;
+  offset.tv_sec = offset_ms / 1000;
+  offset.tv_usec = (offset_ms % 1000) * 1000;
+  add_timeval(ci->start, offset, &due);
+  if(compare_timeval(*now, due) > 0) {
+    sub_timeval(*now, due, &lateness);
+    ms = lateness.tv_sec * 1000.0 + lateness.tv_usec / 1000.0;
+    if(ms > ci->max_lateness_ms) ci->max_lateness_ms = ms;
+  }
+
+  from = (int)((int64_t)ci->nchecks * ci->slice / ci->nslices);
+  to = (int)((int64_t)ci->nchecks * (ci->slice + 1) / ci->nslices);
+  for(i=from; i<to; i++) {
+    noit_check_t *child = loadgen_child(ci, i);
+    if(!child) continue;
+    loadgen_emit(ci, child, i, now);
+    ci->run_checks++;
+  }
+  if(to > ci->created) ci->created = to;
+
+  mtev_gettimeofday(&done, NULL);
+  sub_timeval(done, *now, &lateness);
+  ci->emit_ms += lateness.tv_sec * 1000.0 + lateness.tv_usec / 1000.0;
+
+  if(++ci->slice < ci->nslices) {
+    offset_ms = (uint64_t)check->period * ci->slice / ci->nslices;
+    offset.tv_sec = offset_ms / 1000;
+    offset.tv_usec = (offset_ms % 1000) * 1000;
+    add_timeval(ci->start, offset, &due);
+    ci->slice_e = eventer_alloc_timer(loadgen_slice, ci, &due);
+    eventer_add(ci->slice_e);
+    return 0;
+  }
+
+  loadgen_log_results(ci, &done);
+  check->flags &= ~NP_RUNNING;
+  return 0;
+}
+
+static void loadgen_cleanup(noit_module_t *self, noit_check_t *check) {
+  loadgen_info_t *ci = check->closure;
+  if(!ci) return;
+  if(ci->slice_e) {
+    eventer_remove(ci->slice_e);
+    eventer_free(ci->slice_e);
+    ci->slice_e = NULL;
+  }
+  if(ci->created > 0) {
+    loadgen_reap_t *r = calloc(1, sizeof(*r));
+    mtev_uuid_copy(r->driver, check->checkid);
+    r->created = ci->created;
+    eventer_add_in_s_us(loadgen_reap, r, 0, 0);
+  }
+  loadgen_free_names(ci);
+  mtev_hash_destroy(&ci->child_config, free, free);
+  memset(ci, 0, sizeof(*ci));
+}
+
+static int loadgen_initiate(noit_module_t *self, noit_check_t *check,
+                            noit_check_t *cause) {
+  loadgen_info_t *ci = check->closure;
+  struct timeval __now;
+  int was;
+
+  /* A run that hasn't finished by the next period means the feed can't
+   * keep up; count it rather than complain every period. */
+  if(check->flags & NP_RUNNING) {
+    ci->overruns++;
+    return 0;
+  }
+  check->flags |= NP_RUNNING;
+
+  ci->self = self;
+  ci->check = check;
+  was = ci->nchecks;
+  loadgen_configure(ci, check);
+  if(ci->created > ci->nchecks) {
+    mtevL(nldeb, "loadgen %s shrinking %d -> %d checks\n",
+          check->name, was, ci->nchecks);
+    loadgen_remove_children(check->checkid, ci->nchecks, ci->created);
+    ci->created = ci->nchecks;
+  }
+
+  mtev_gettimeofday(&__now, NULL);
+  memcpy(&check->last_fire_time, &__now, sizeof(__now));
+  ci->last_start = ci->start;
+  ci->start = __now;
+  ci->slice = 0;
+  ci->run++;
+  ci->run_checks = 0;
+  ci->emit_ms = 0;
+  ci->max_lateness_ms = 0;
+
+  loadgen_slice(NULL, EVENTER_TIMER, ci, &__now);
+  return 0;
+}
+
+static int loadgen_initiate_check(noit_module_t *self, noit_check_t *check,
+                                  int once, noit_check_t *cause) {
+  loadgen_info_t *ci;
+  char uuid_str[UUID_STR_LEN+1];
+  void *vdriver;
+
+  /* Simulated checks are disabled, but never let one become a driver. */
+  if(check->config &&
+     mtev_hash_retrieve(check->config, LOADGEN_DRIVER_KEY,
+                        strlen(LOADGEN_DRIVER_KEY), &vdriver))
+    return 0;
+
+  if(!check->closure) {
+    ci = calloc(1, sizeof(loadgen_info_t));
+    mtev_hash_init(&ci->child_config);
+    mtev_uuid_unparse_lower(check->checkid, uuid_str);
+    mtev_hash_store(&ci->child_config, strdup(LOADGEN_DRIVER_KEY),
+                    strlen(LOADGEN_DRIVER_KEY), strdup(uuid_str));
+    ci->seed = 0x9e3779b97f4a7c15ULL ^ ((uint64_t)check->checkid[0] << 56 |
+                                        (uint64_t)check->checkid[15]);
+    check->closure = (void*)ci;
+  }
+  INITIATE_CHECK(loadgen_initiate, self, check, cause);
+  return 0;
+}
+
+static int loadgen_onload(mtev_image_t *self) {
+  nlerr = mtev_log_stream_find("error/loadgen");
+  nldeb = mtev_log_stream_find("debug/loadgen");
+  if(!nlerr) nlerr = noit_stderr;
+  if(!nldeb) nldeb = noit_debug;
+
+  eventer_name_callback("loadgen/slice", loadgen_slice);
+  eventer_name_callback("loadgen/reap", loadgen_reap);
+  return 0;
+}
+
+#include "loadgen.xmlh"
+noit_module_t loadgen = {
+  {
+    .magic = NOIT_MODULE_MAGIC,
+    .version = NOIT_MODULE_ABI_VERSION,
+    .name = "loadgen",
+    .description = "synthetic check load generator",
+    .xml_description = loadgen_xml_description,
+    .onload = loadgen_onload
+  },
+  NULL,
+  NULL,
+  loadgen_initiate_check,
+  loadgen_cleanup
+};
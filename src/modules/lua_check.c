@@ -40,6 +40,7 @@
 #include <mtev_log.h>
 
 #include <circllhist.h>
+#include <ck_pr.h>
 
 #include "noit_config.h"
 #include "noit_module.h"
@@ -540,6 +541,167 @@ noit_lua_log_immediate_metric(lua_State *L) {
   return noit_lua_set_metric_f(L, mtev_true, noit_stats_log_immediate_metric_timed);
 }
 
+/* check.metrics_bulk{ name = value, name = { type, value }, ... }
+ *
+ * Sets every metric in the table with one call into C and one pass over
+ * the stats lock.  A plain value is typed like check.metric() would type
+ * it; a { type, value } pair takes a metric type character ("i", "I",
+ * "l", "L", "n" or "s").  Returns the number of metrics set.
+ */
+#define LUA_BULK_CHUNK 256
+static int
+noit_lua_set_metrics_bulk_f(lua_State *L, mtev_boolean immediate) {
+  noit_check_t *check;
+  noit_stats_batch_metric_t batch[LUA_BULK_CHUNK];
+  union {
+    int32_t i;
+    uint32_t I;
+    int64_t l;
+    uint64_t L;
+    double n;
+  } vals[LUA_BULK_CHUNK];
+  /* Numbers typed by guessing are guessed from their string form, which
+   * (unlike string values) the table does not keep alive for us. */
+  char numbufs[LUA_BULK_CHUNK][64];
+  int n = 0, total = 0;
+
+  if(lua_gettop(L) != 1 || !lua_istable(L, 1))
+    luaL_error(L, "need 1 argument: { <metric_name> = <value>, ... }");
+  check = lua_touserdata(L, lua_upvalueindex(1));
+
+  lua_pushnil(L);
+  while(lua_next(L, 1)) {
+    noit_stats_batch_metric_t *m = &batch[n];
+    metric_type_t type = METRIC_GUESS;
+    const char *str;
+    int vidx = -1, pair = 0;
+
+    if(lua_type(L, -2) != LUA_TSTRING)
+      luaL_error(L, "metrics_bulk: metric names must be strings");
+    m->name = lua_tostring(L, -2);
+    if(lua_istable(L, -1)) {
+      lua_rawgeti(L, -1, 1);
+      str = lua_tostring(L, -1);
+      if(!str || strlen(str) != 1 || (*str != METRIC_STRING &&
+                                      *str != METRIC_INT32 &&
+                                      *str != METRIC_UINT32 &&
+                                      *str != METRIC_INT64 &&
+                                      *str != METRIC_UINT64 &&
+                                      *str != METRIC_DOUBLE))
+        luaL_error(L, "metrics_bulk: bad metric type for %s", m->name);
+      type = *str;
+      lua_pop(L, 1);
+      lua_rawgeti(L, -1, 2);
+      pair = 1;
+    }
+    m->type = type;
+    m->value = NULL;
+    switch(type) {
+      case METRIC_GUESS:
+      case METRIC_STRING:
+        if(lua_type(L, vidx) == LUA_TSTRING) {
+          /* the table (or the pair in it) holds on to the string */
+          m->value = lua_tostring(L, vidx);
+        }
+        else if(lua_type(L, vidx) == LUA_TNUMBER) {
+          lua_pushvalue(L, vidx);
+          strlcpy(numbufs[n], lua_tostring(L, -1), sizeof(numbufs[n]));
+          lua_pop(L, 1);
+          m->value = numbufs[n];
+        }
+        else if(!lua_isnil(L, vidx))
+          luaL_error(L, "metrics_bulk: bad value for %s", m->name);
+        break;
+      case METRIC_INT32:
+      case METRIC_UINT32:
+      case METRIC_INT64:
+      case METRIC_UINT64:
+      case METRIC_DOUBLE:
+        if(!lua_isnumber(L, vidx)) break;
+        /* same conversions as noit_lua_set_metric_f */
+        lua_pushvalue(L, vidx);
+        str = lua_tostring(L, -1);
+        switch(type) {
+          case METRIC_INT32: vals[n].i = strtol(str, NULL, 10); break;
+          case METRIC_UINT32: vals[n].I = strtoul(str, NULL, 10); break;
+          case METRIC_INT64: vals[n].l = strtoll(str, NULL, 10); break;
+          case METRIC_UINT64: vals[n].L = strtoull(str, NULL, 10); break;
+          default: vals[n].n = lua_tonumber(L, -1); break;
+        }
+        lua_pop(L, 1);
+        m->value = &vals[n];
+        break;
+      default:
+        break;
+    }
+    lua_pop(L, 1 + pair);
+    if(++n == LUA_BULK_CHUNK) {
+      total += noit_stats_set_metric_batch(check, batch, n, immediate);
+      n = 0;
+    }
+  }
+  if(n) total += noit_stats_set_metric_batch(check, batch, n, immediate);
+  lua_pushinteger(L, total);
+  return 1;
+}
+
+static int
+noit_lua_set_metrics_bulk(lua_State *L) {
+  return noit_lua_set_metrics_bulk_f(L, mtev_false);
+}
+
+static int
+noit_lua_log_immediate_metrics_bulk(lua_State *L) {
+  return noit_lua_set_metrics_bulk_f(L, mtev_true);
+}
+
+/* check.config hands out a table per check that is cached in each Lua
+ * state and rebuilt only after some check has been updated or deleted;
+ * scripts must treat it as read-only.
+ */
+#define LUA_CHECK_CONFIG_CACHE "noit_check_config_cache"
+static uint32_t lua_check_config_epoch = 1;
+
+static mtev_hook_return_t
+noit_lua_check_config_changed(void *closure, noit_check_t *check) {
+  ck_pr_inc_32(&lua_check_config_epoch);
+  return MTEV_HOOK_CONTINUE;
+}
+
+static void
+noit_lua_push_check_config(lua_State *L, noit_check_t *check) {
+  uint32_t epoch = ck_pr_load_32(&lua_check_config_epoch);
+
+  lua_getfield(L, LUA_REGISTRYINDEX, LUA_CHECK_CONFIG_CACHE);
+  if(lua_istable(L, -1)) {
+    lua_getfield(L, -1, "epoch");
+    if((uint32_t)lua_tonumber(L, -1) != epoch) {
+      lua_pop(L, 2);
+      lua_pushnil(L);
+    }
+    else lua_pop(L, 1);
+  }
+  if(!lua_istable(L, -1)) {
+    lua_pop(L, 1);
+    lua_createtable(L, 0, 8);
+    lua_pushnumber(L, epoch);
+    lua_setfield(L, -2, "epoch");
+    lua_pushvalue(L, -1);
+    lua_setfield(L, LUA_REGISTRYINDEX, LUA_CHECK_CONFIG_CACHE);
+  }
+
+  lua_pushlightuserdata(L, check);
+  lua_rawget(L, -2);
+  if(!lua_istable(L, -1)) {
+    lua_pop(L, 1);
+    mtev_lua_hash_to_table(L, check->config);
+    lua_pushlightuserdata(L, check);
+    lua_pushvalue(L, -2);
+    lua_rawset(L, -4);
+  }
+  lua_remove(L, -2);
+}
+
 static int
 noit_lua_interpolate(lua_State *L) {
   noit_check_t *check;
@@ -620,7 +782,7 @@ noit_check_index_func(lua_State *L) {
       else break;
       return 1;
     case 'c':
-      if(!strcmp(k, "config")) mtev_lua_hash_to_table(L, check->config);
+      if(!strcmp(k, "config")) noit_lua_push_check_config(L, check);
       else if(!strcmp(k, "checkid")) {
         char uuid_str[UUID_STR_LEN + 1];
         uuid_unparse_lower(check->checkid, uuid_str);
@@ -676,6 +838,10 @@ noit_check_index_func(lua_State *L) {
         lua_pushlightuserdata(L, check);
         lua_pushcclosure(L, noit_lua_set_histo_metric, 1);
       }
+      else if(!strcmp(k, "immediate_metrics_bulk")) {
+        lua_pushlightuserdata(L, check);
+        lua_pushcclosure(L, noit_lua_log_immediate_metrics_bulk, 1);
+      }
       else break;
 
       return 1;
@@ -700,6 +866,10 @@ noit_check_index_func(lua_State *L) {
         lua_pushlightuserdata(L, check);
         lua_pushcclosure(L, noit_lua_set_metric_json, 1);
       }
+      else if(!strcmp(k, "metrics_bulk")) {
+        lua_pushlightuserdata(L, check);
+        lua_pushcclosure(L, noit_lua_set_metrics_bulk, 1);
+      }
 
       else break;
       return 1;
@@ -1260,6 +1430,8 @@ noit_lua_loader_onload(mtev_image_t *self) {
   eventer_name_callback("lua/check_timeout", noit_lua_check_timeout);
   mtev_lua_context_describe(LUA_CHECK_INFO_MAGIC, describe_lua_check_context);
   register_console_lua_commands();
+  check_updated_hook_register("lua_check_config", noit_lua_check_config_changed, NULL);
+  check_deleted_hook_register("lua_check_config", noit_lua_check_config_changed, NULL);
   return 0;
 }
 
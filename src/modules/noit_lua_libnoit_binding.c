@@ -231,6 +231,25 @@ lua_noit_metric_next(lua_State *L) {
   return 0;
 }
 
+/* metric_director_next_batch([n]) returns an array of up to n (default
+ * 100) messages, empty if none are waiting. */
+#define METRIC_NEXT_BATCH_MAX 1024
+static int
+lua_noit_metric_next_batch(lua_State *L) {
+  noit_metric_message_t *msgs[METRIC_NEXT_BATCH_MAX];
+  int i, n, max = 100;
+  if(lua_gettop(L) > 0 && !lua_isnil(L, 1)) max = luaL_checkinteger(L, 1);
+  if(max < 1) max = 1;
+  if(max > METRIC_NEXT_BATCH_MAX) max = METRIC_NEXT_BATCH_MAX;
+  n = noit_metric_director_lane_next_batch(msgs, max);
+  lua_createtable(L, n, 0);
+  for(i=0; i<n; i++) {
+    noit_lua_setup_message(L, msgs[i]);
+    lua_rawseti(L, -2, i+1);
+  }
+  return 1;
+}
+
 static int
 lua_noit_metric_messages_received(lua_State *L) {
   lua_pushinteger(L, noit_metric_director_get_messages_received());
@@ -250,6 +269,7 @@ static const luaL_Reg libnoit_binding[] = {
   { "metric_director_subscribe", lua_noit_metric_subscribe },
   { "metric_director_unsubscribe", lua_noit_metric_unsubscribe },
   { "metric_director_next", lua_noit_metric_next },
+  { "metric_director_next_batch", lua_noit_metric_next_batch },
   { "metric_director_get_messages_received", lua_noit_metric_messages_received },
   { "metric_director_get_messages_distributed", lua_noit_metric_messages_distributed},
   { NULL, NULL }
@@ -66,6 +66,13 @@
 
 #define PING_INTERVAL 2000 /* 2000ms = 2s */
 #define PING_COUNT    5
+/* probes per sendmmsg/recvmmsg */
+#define PING_BATCH    64
+/* probe slots are allocated this many at a time and never moved */
+#define PING_SLOT_CHUNK_SHIFT 12
+#define PING_SLOT_CHUNK (1 << PING_SLOT_CHUNK_SHIFT)
+#define PING_SLOT_NONE 0xffffffff
+#define PING_RECV_LEN 512
 
 struct check_info {
   uint16_t check_no;
@@ -73,17 +80,17 @@ struct check_info {
   uint8_t seq;
   int8_t expected_count;
   float *turnaround;
+  uint32_t *slots;
+  eventer_t send_event;
   eventer_t timeout_event;
 };
-struct ping_session_key {
-  uintptr_t addr_of_check; /* ticket #288 */
-  uuid_t checkid;
-};
 struct ping_payload {
   uintptr_t addr_of_check; /* ticket #288 */
   uuid_t checkid;
   uint64_t tv_sec;
-  uint32_t tv_usec;
+  uint32_t tv_nsec;
+  uint32_t slot;
+  uint32_t slot_gen;
   uint16_t generation;    
   uint16_t check_no;
   uint8_t  check_pack_no;
@@ -91,25 +98,117 @@ struct ping_payload {
   uint8_t  size_bookend;
 };
 #define PING_PAYLOAD_LEN offsetof(struct ping_payload, size_bookend)
+/* the send time is the only part of a probe not known when it is built */
+#define PING_TS_OFF offsetof(struct ping_payload, tv_sec)
+#define PING_TS_LEN (offsetof(struct ping_payload, slot) - PING_TS_OFF)
+#define PING_PACKET_MAX (sizeof(struct icmp) + PING_PAYLOAD_LEN)
+
 struct ping_closure {
   noit_module_t *self;
   noit_check_t *check;
-  void *payload;
-  int payload_len;
-  int icp_len;
 };
+
+/* A probe, built when the check is run and sent when it falls due.  The
+ * reply names its slot, so no lookup is needed to find the check; the
+ * slot generation changes whenever the slot is released so that late or
+ * forged replies are ignored. */
+typedef struct {
+  noit_check_t *check;    /* NULL when free */
+  uint32_t gen;
+  uint32_t next_free;
+  uint32_t csum;          /* unfolded sum of the packet, timestamp zeroed */
+  int len;
+  int icp_len;
+  int family;
+  union {
+    struct sockaddr_in in4;
+    struct sockaddr_in6 in6;
+  } to;
+  socklen_t tolen;
+  unsigned char pkt[PING_PACKET_MAX];
+} ping_probe_t;
+
+typedef struct {
+  uint32_t slot;
+  uint32_t gen;
+} ping_pending_t;
+
 static mtev_log_stream_t nlerr = NULL;
 static mtev_log_stream_t nldeb = NULL;
-static int in_cksum(u_short *addr, int len);
+static uint32_t ping_cksum_add(uint32_t sum, const void *addr, int len);
+static uint16_t ping_cksum_fold(uint32_t sum);
 static uintptr_t random_num;
 
 
 typedef struct  {
   int ipv4_fd;
   int ipv6_fd;
-  mtev_hash_table *in_flight;
+  mtev_boolean kernel_timestamps;
+
+  /* checks run on many eventer threads and replies arrive on the fd's
+   * thread; the slots, the free list and the pending queue are only
+   * touched with this held */
+  pthread_mutex_t lock;
+  ping_probe_t **slot_chunks;
+  int nchunks;
+  uint32_t free_slot;
+
+  ping_pending_t *pending;
+  int npending, pending_allocd;
+  eventer_t flush_event;
 } ping_icmp_data_t;
 
+#if defined(SO_TIMESTAMPNS)
+#define PING_CMSG_SPACE CMSG_SPACE(sizeof(struct timespec))
+#else
+#define PING_CMSG_SPACE CMSG_SPACE(sizeof(int))
+#endif
+
+/* ping_slot, ping_slot_alloc and ping_icmp_flush require data->lock */
+static ping_probe_t *ping_slot(ping_icmp_data_t *data, uint32_t slot) {
+  if(slot == PING_SLOT_NONE ||
+     (slot >> PING_SLOT_CHUNK_SHIFT) >= (uint32_t)data->nchunks) return NULL;
+  return &data->slot_chunks[slot >> PING_SLOT_CHUNK_SHIFT]
+                           [slot & (PING_SLOT_CHUNK - 1)];
+}
+static uint32_t ping_slot_alloc(ping_icmp_data_t *data, noit_check_t *check) {
+  uint32_t slot;
+  ping_probe_t *probe;
+  if(data->free_slot == PING_SLOT_NONE) {
+    int i;
+    ping_probe_t *chunk = calloc(PING_SLOT_CHUNK, sizeof(*chunk));
+    data->slot_chunks = realloc(data->slot_chunks,
+                                (data->nchunks + 1) * sizeof(*data->slot_chunks));
+    data->slot_chunks[data->nchunks] = chunk;
+    for(i=PING_SLOT_CHUNK-1; i>=0; i--) {
+      chunk[i].next_free = data->free_slot;
+      data->free_slot = (data->nchunks << PING_SLOT_CHUNK_SHIFT) | i;
+    }
+    data->nchunks++;
+  }
+  slot = data->free_slot;
+  probe = ping_slot(data, slot);
+  data->free_slot = probe->next_free;
+  probe->next_free = PING_SLOT_NONE;
+  probe->check = check;
+  return slot;
+}
+static void ping_release_slots(ping_icmp_data_t *data, struct check_info *ci) {
+  int i;
+  if(!ci->slots) return;
+  pthread_mutex_lock(&data->lock);
+  for(i=0; i<ci->expected_count; i++) {
+    ping_probe_t *probe = ping_slot(data, ci->slots[i]);
+    if(!probe) continue;
+    probe->check = NULL;
+    probe->gen++;
+    probe->next_free = data->free_slot;
+    data->free_slot = ci->slots[i];
+    ci->slots[i] = PING_SLOT_NONE;
+  }
+  pthread_mutex_unlock(&data->lock);
+}
+
 static int ping_icmp_config(noit_module_t *self, mtev_hash_table *options) {
   return 0;
 }
@@ -182,10 +281,14 @@ static void ping_icmp_log_results(noit_module_t *self, noit_check_t *check) {
                         METRIC_DOUBLE, avail > 0.0 ? &avg : NULL);
   noit_check_set_stats(check);
 }
+static void ping_icmp_finish(ping_icmp_data_t *data, noit_check_t *check) {
+  struct check_info *ci = (struct check_info *)check->closure;
+  check->flags &= ~NP_RUNNING;
+  ping_release_slots(data, ci);
+}
 static int ping_icmp_timeout(eventer_t e, int mask,
                              void *closure, struct timeval *now) {
   struct ping_closure *pcl = (struct ping_closure *)closure;
-  struct ping_session_key k;
   struct check_info *data;
   ping_icmp_data_t *ping_data;
 
@@ -194,149 +297,201 @@ static int ping_icmp_timeout(eventer_t e, int mask,
   }
   data = (struct check_info *)pcl->check->closure;
   data->timeout_event = NULL;
-  pcl->check->flags &= ~NP_RUNNING;
   ping_data = noit_module_get_userdata(pcl->self);
-  k.addr_of_check = (uintptr_t)pcl->check ^ random_num;
-  mtev_uuid_copy(k.checkid, pcl->check->checkid);
-  mtev_hash_delete(ping_data->in_flight, (const char *)&k, sizeof(k),
-                   free, NULL);
+  ping_icmp_finish(ping_data, pcl->check);
   free(pcl);
   return 0;
 }
 
+static void ping_icmp_reply(noit_module_t *self, ping_icmp_data_t *ping_data,
+                            struct ping_payload *payload,
+                            const struct timespec *rx, struct timeval *now) {
+  ping_probe_t *probe;
+  noit_check_t *check;
+  struct check_info *data;
+  int64_t rtt_ns;
+
+  pthread_mutex_lock(&ping_data->lock);
+  probe = ping_slot(ping_data, payload->slot);
+  check = NULL;
+  if(probe && probe->check && probe->gen == payload->slot_gen &&
+     ((uintptr_t)probe->check ^ random_num) == payload->addr_of_check &&
+     !uuid_compare(probe->check->checkid, payload->checkid))
+    check = probe->check;
+  pthread_mutex_unlock(&ping_data->lock);
+  if(!check) {
+    char uuid_str[37];
+    uuid_unparse_lower(payload->checkid, uuid_str);
+    mtevLT(nldeb, now,
+           "ping_icmp response for unknown check '%s'\n", uuid_str);
+    return;
+  }
+  /* make sure this check is from this generation! */
+  if((check->generation & 0xffff) != payload->generation) {
+    mtevLT(nldeb, now,
+           "ping_icmp response in generation gap\n");
+    return;
+  }
+  data = (struct check_info *)check->closure;
+
+  /* If there is no timeout_event, the check must have completed.
+   * We have nothing to do. */
+  if(!data->timeout_event) return;
+
+  /* Sanity check the payload */
+  if(payload->check_no != data->check_no) return;
+  if(payload->check_pack_cnt != data->expected_count) return;
+  if(payload->check_pack_no >= data->expected_count) return;
+
+  rtt_ns = ((int64_t)rx->tv_sec - (int64_t)payload->tv_sec) * 1000000000LL +
+           ((int64_t)rx->tv_nsec - (int64_t)payload->tv_nsec);
+  if(rtt_ns < 0) rtt_ns = 0;
+  data->turnaround[payload->check_pack_no] = (float)(rtt_ns / 1000000000.0);
+  if(ping_icmp_is_complete(self, check)) {
+    ping_icmp_log_results(self, check);
+    eventer_remove(data->timeout_event);
+    free(eventer_get_closure(data->timeout_event));
+    eventer_free(data->timeout_event);
+    data->timeout_event = NULL;
+    ping_icmp_finish(ping_data, check);
+  }
+}
+
 static int ping_icmp_handler(eventer_t e, int mask,
                              void *closure, struct timeval *now,
                              uint8_t family) {
   noit_module_t *self = (noit_module_t *)closure;
   ping_icmp_data_t *ping_data;
-  struct check_info *data;
-  char packet[1500];
-  int packet_len = sizeof(packet);
   union {
    struct sockaddr_in  in4;
    struct sockaddr_in6 in6;
-  } from;
-  unsigned int from_len;
+  } from[PING_BATCH];
+  struct iovec iov[PING_BATCH];
+#ifdef HAVE_RECVMMSG
+  struct mmsghdr msgs[PING_BATCH];
+#else
+  struct msghdr msgs[PING_BATCH];
+#endif
+  /* on the stack: the v4 and v6 handlers may run on different threads */
+  unsigned char rxbufs[PING_BATCH][PING_RECV_LEN];
+  union {
+    char buf[PING_BATCH * PING_CMSG_SPACE];
+    struct cmsghdr align;
+  } rxcmsgs;
   struct ping_payload *payload;
 
   if(family != AF_INET && family != AF_INET6) return EVENTER_READ;
 
   ping_data = noit_module_get_userdata(self);
   while(1) {
-    struct ping_session_key k;
-    int inlen;
-    uint8_t iphlen = 0;
-    void *vcheck;
-    noit_check_t *check;
-    struct timeval tt, whence;
-
-    from_len = sizeof(from);
-
-    inlen = recvfrom(eventer_get_fd(e), packet, packet_len, 0,
-                     (struct sockaddr *)&from, &from_len);
-    mtev_gettimeofday(now, NULL); /* set it, as we care about accuracy */
+    int i, cnt;
+    struct timespec user_ts;
+
+    memset(msgs, 0, sizeof(msgs));
+    for(i=0; i<PING_BATCH; i++) {
+#ifdef HAVE_RECVMMSG
+      struct msghdr *hdr = &msgs[i].msg_hdr;
+#else
+      struct msghdr *hdr = &msgs[i];
+#endif
+      iov[i].iov_base = rxbufs[i];
+      iov[i].iov_len = PING_RECV_LEN;
+      hdr->msg_name = &from[i];
+      hdr->msg_namelen = sizeof(from[i]);
+      hdr->msg_iov = &iov[i];
+      hdr->msg_iovlen = 1;
+      hdr->msg_control = rxcmsgs.buf + i * PING_CMSG_SPACE;
+      hdr->msg_controllen = PING_CMSG_SPACE;
+    }
+#ifdef HAVE_RECVMMSG
+    cnt = recvmmsg(eventer_get_fd(e), msgs, PING_BATCH, MSG_DONTWAIT, NULL);
+#else
+    for(cnt=0; cnt<PING_BATCH; cnt++) {
+      ssize_t len = recvmsg(eventer_get_fd(e), &msgs[cnt], MSG_DONTWAIT);
+      if(len < 0) break;
+      iov[cnt].iov_len = len;
+    }
+    if(cnt == 0) cnt = -1;
+#endif
+    /* for any reply that lacks a kernel timestamp */
+    clock_gettime(CLOCK_REALTIME, &user_ts);
+    now->tv_sec = user_ts.tv_sec;
+    now->tv_usec = user_ts.tv_nsec / 1000;
 
-    if(inlen < 0) {
+    if(cnt < 0) {
       if(errno == EAGAIN || errno == EINTR) break;
-      mtevLT(nldeb, now, "ping_icmp recvfrom: %s\n", strerror(errno));
+      mtevLT(nldeb, now, "ping_icmp recvmmsg: %s\n", strerror(errno));
       break;
     }
 
-    if(family == AF_INET) {
-      struct icmp *icp4;
-      iphlen = ((struct ip *)packet)->ip_hl << 2;
-      if((inlen-iphlen) != sizeof(struct icmp)+PING_PAYLOAD_LEN) {
-        mtevLT(nldeb, now,
-               "ping_icmp bad size: %d+%d\n", iphlen, inlen-iphlen); 
-        continue;
-      }
-      icp4 = (struct icmp *)(packet + iphlen);
-      payload = (struct ping_payload *)(icp4 + 1);
-      if(icp4->icmp_type != ICMP_ECHOREPLY) {
-        mtevLT(nldeb, now, "ping_icmp bad type: %d\n", icp4->icmp_type);
-        continue;
-      }
-      if(icp4->icmp_id != (((uintptr_t)self) & 0xffff)) {
-        mtevLT(nldeb, now,
-                 "ping_icmp not sent from this instance (%d:%d) vs. %lu\n",
-                 icp4->icmp_id, ntohs(icp4->icmp_seq),
-                 (unsigned long)(((uintptr_t)self) & 0xffff));
-        continue;
-      }
-    }
-    else if(family == AF_INET6) {
-      struct icmp6_hdr *icp6 = (struct icmp6_hdr *)packet;
-      if((inlen) != sizeof(struct icmp6_hdr)+PING_PAYLOAD_LEN) {
-        mtevLT(nldeb, now,
-               "ping_icmp bad size: %d+%d\n", iphlen, inlen-iphlen); 
-        continue;
+    for(i=0; i<cnt; i++) {
+#ifdef HAVE_RECVMMSG
+      struct msghdr *hdr = &msgs[i].msg_hdr;
+      int inlen = msgs[i].msg_len;
+#else
+      struct msghdr *hdr = &msgs[i];
+      int inlen = iov[i].iov_len;
+#endif
+      char *packet = (char *)rxbufs[i];
+      struct timespec rx_ts = user_ts;
+      uint8_t iphlen = 0;
+#if defined(SO_TIMESTAMPNS)
+      struct cmsghdr *cmsg;
+      if(ping_data->kernel_timestamps) {
+        for(cmsg = CMSG_FIRSTHDR(hdr); cmsg; cmsg = CMSG_NXTHDR(hdr, cmsg)) {
+          if(cmsg->cmsg_level == SOL_SOCKET &&
+             cmsg->cmsg_type == SCM_TIMESTAMPNS)
+            memcpy(&rx_ts, CMSG_DATA(cmsg), sizeof(rx_ts));
+        }
       }
-      payload = (struct ping_payload *)(icp6+1);
-      if(icp6->icmp6_type != ICMP6_ECHO_REPLY) {
-        mtevLT(nldeb, now, "ping_icmp bad type: %d\n", icp6->icmp6_type);
-        continue;
+#endif
+      if(hdr->msg_flags & MSG_TRUNC) continue;
+
+      if(family == AF_INET) {
+        struct icmp *icp4;
+        iphlen = ((struct ip *)packet)->ip_hl << 2;
+        if((inlen-iphlen) != sizeof(struct icmp)+PING_PAYLOAD_LEN) {
+          mtevLT(nldeb, now,
+                 "ping_icmp bad size: %d+%d\n", iphlen, inlen-iphlen); 
+          continue;
+        }
+        icp4 = (struct icmp *)(packet + iphlen);
+        payload = (struct ping_payload *)(icp4 + 1);
+        if(icp4->icmp_type != ICMP_ECHOREPLY) {
+          mtevLT(nldeb, now, "ping_icmp bad type: %d\n", icp4->icmp_type);
+          continue;
+        }
+        if(icp4->icmp_id != (((uintptr_t)self) & 0xffff)) {
+          mtevLT(nldeb, now,
+                   "ping_icmp not sent from this instance (%d:%d) vs. %lu\n",
+                   icp4->icmp_id, ntohs(icp4->icmp_seq),
+                   (unsigned long)(((uintptr_t)self) & 0xffff));
+          continue;
+        }
       }
-      if(icp6->icmp6_id != (((uintptr_t)self) & 0xffff)) {
-        mtevLT(nldeb, now,
-                 "ping_icmp not sent from this instance (%d:%d) vs. %lu\n",
-                 icp6->icmp6_id, ntohs(icp6->icmp6_seq),
-                 (unsigned long)(((uintptr_t)self) & 0xffff));
-        continue;
+      else {
+        struct icmp6_hdr *icp6 = (struct icmp6_hdr *)packet;
+        if((inlen) != sizeof(struct icmp6_hdr)+PING_PAYLOAD_LEN) {
+          mtevLT(nldeb, now,
+                 "ping_icmp bad size: %d+%d\n", iphlen, inlen-iphlen); 
+          continue;
+        }
+        payload = (struct ping_payload *)(icp6+1);
+        if(icp6->icmp6_type != ICMP6_ECHO_REPLY) {
+          mtevLT(nldeb, now, "ping_icmp bad type: %d\n", icp6->icmp6_type);
+          continue;
+        }
+        if(icp6->icmp6_id != (((uintptr_t)self) & 0xffff)) {
+          mtevLT(nldeb, now,
+                   "ping_icmp not sent from this instance (%d:%d) vs. %lu\n",
+                   icp6->icmp6_id, ntohs(icp6->icmp6_seq),
+                   (unsigned long)(((uintptr_t)self) & 0xffff));
+          continue;
+        }
       }
+      ping_icmp_reply(self, ping_data, payload, &rx_ts, now);
     }
-    else {
-      /* This should be unreachable */
-      continue;
-    }
-    check = NULL;
-    k.addr_of_check = payload->addr_of_check;
-    mtev_uuid_copy(k.checkid, payload->checkid);
-    if(mtev_hash_retrieve(ping_data->in_flight,
-                          (const char *)&k, sizeof(k),
-                          &vcheck))
-      check = vcheck;
-
-    /* make sure this check is from this generation! */
-    if(!check) {
-      char uuid_str[37];
-      uuid_unparse_lower(payload->checkid, uuid_str);
-      mtevLT(nldeb, now,
-             "ping_icmp response for unknown check '%s'\n", uuid_str);
-      continue;
-    }
-    if((check->generation & 0xffff) != payload->generation) {
-      mtevLT(nldeb, now,
-             "ping_icmp response in generation gap\n");
-      continue;
-    }
-    data = (struct check_info *)check->closure;
-
-    /* If there is no timeout_event, the check must have completed.
-     * We have nothing to do. */
-    if(!data->timeout_event) continue;
-
-    /* Sanity check the payload */
-    if(payload->check_no != data->check_no) continue;
-    if(payload->check_pack_cnt != data->expected_count) continue;
-    if(payload->check_pack_no >= data->expected_count) continue;
-
-    whence.tv_sec = payload->tv_sec;
-    whence.tv_usec = payload->tv_usec;
-    sub_timeval(*now, whence, &tt);
-    data->turnaround[payload->check_pack_no] =
-      (float)tt.tv_sec + (float)tt.tv_usec / 1000000.0;
-    if(ping_icmp_is_complete(self, check)) {
-      ping_icmp_log_results(self, check);
-      eventer_remove(data->timeout_event);
-      free(eventer_get_closure(data->timeout_event));
-      eventer_free(data->timeout_event);
-      data->timeout_event = NULL;
-      check->flags &= ~NP_RUNNING;
-      k.addr_of_check = (uintptr_t)check ^ random_num;
-      mtev_uuid_copy(k.checkid, check->checkid);
-      mtev_hash_delete(ping_data->in_flight, (const char *)&k,
-                       sizeof(k), free, NULL);
-    }
+    if(cnt < PING_BATCH) break;
   }
   return EVENTER_READ;
 }
@@ -349,6 +504,20 @@ static int ping_icmp6_handler(eventer_t e, int mask,
   return ping_icmp_handler(e, mask, closure, now, AF_INET6);
 }
 
+/* Have the kernel stamp each reply as it arrives, so RTTs don't include
+ * the time replies spend queued behind other work on the event loop. */
+static void ping_icmp_kernel_timestamps(ping_icmp_data_t *data, int fd) {
+#if defined(SO_TIMESTAMPNS)
+  int on = 1;
+  if(setsockopt(fd, SOL_SOCKET, SO_TIMESTAMPNS, &on, sizeof(on)) == 0) {
+    data->kernel_timestamps = mtev_true;
+    return;
+  }
+  mtevL(noit_debug, "ping_icmp: SO_TIMESTAMPNS unavailable: %s\n",
+        strerror(errno));
+#endif
+}
+
 static int ping_icmp_init(noit_module_t *self) {
   socklen_t on;
   struct protoent *proto;
@@ -356,10 +525,10 @@ static int ping_icmp_init(noit_module_t *self) {
 
   RAND_pseudo_bytes((unsigned char *)&random_num, sizeof(uintptr_t));
 
-  data = malloc(sizeof(*data));
-  data->in_flight = calloc(1, sizeof(*data->in_flight));
-  mtev_hash_init(data->in_flight);
+  data = calloc(1, sizeof(*data));
   data->ipv4_fd = data->ipv6_fd = -1;
+  pthread_mutex_init(&data->lock, NULL);
+  data->free_slot = PING_SLOT_NONE;
 
   if ((proto = getprotobyname("icmp")) == NULL) {
     mtevL(noit_error, "Couldn't find 'icmp' protocol\n");
@@ -399,6 +568,7 @@ static int ping_icmp_init(noit_module_t *self) {
   }
   if(data->ipv4_fd >= 0) {
     eventer_t newe;
+    ping_icmp_kernel_timestamps(data, data->ipv4_fd);
     newe = eventer_alloc_fd(ping_icmp4_handler, self, data->ipv4_fd, EVENTER_READ);
     eventer_add(newe);
   }
@@ -420,6 +590,7 @@ static int ping_icmp_init(noit_module_t *self) {
     }
     if(data->ipv6_fd >= 0) {
       eventer_t newe;
+      ping_icmp_kernel_timestamps(data, data->ipv6_fd);
       newe = eventer_alloc_fd(ping_icmp6_handler, self, data->ipv6_fd, EVENTER_READ);
       eventer_add(newe);
     }
@@ -431,76 +602,189 @@ static int ping_icmp_init(noit_module_t *self) {
   return 0;
 }
 
+static void ping_icmp_sendmsgs(int fd,
+#ifdef HAVE_SENDMMSG
+                               struct mmsghdr *msgs,
+#else
+                               struct msghdr *msgs,
+#endif
+                               ping_probe_t **probes, int cnt) {
+  int off = 0;
+  while(off < cnt) {
+    int sent;
+#ifdef HAVE_SENDMMSG
+    sent = sendmmsg(fd, msgs + off, cnt - off, 0);
+#else
+    sent = (sendmsg(fd, msgs + off, 0) == probes[off]->len) ? 1 : -1;
+#endif
+    if(sent <= 0) {
+      /* skip the probe that failed; its check will see it as lost */
+      ping_probe_t *probe = probes[off];
+      if(errno == EINTR) continue;
+      mtevL(nlerr, "Error sending ICMP packet to %s(%s): %s\n",
+            probe->check ? probe->check->target : "?",
+            probe->check ? probe->check->target_ip : "?", strerror(errno));
+      sent = 1;
+    }
+    off += sent;
+  }
+}
+
+/* Stamp and send every pending probe, PING_BATCH at a time per family. */
+static void ping_icmp_flush(ping_icmp_data_t *data) {
+  ping_probe_t *probes4[PING_BATCH], *probes6[PING_BATCH];
+  struct iovec iov4[PING_BATCH], iov6[PING_BATCH];
+#ifdef HAVE_SENDMMSG
+  struct mmsghdr msgs4[PING_BATCH], msgs6[PING_BATCH];
+#else
+  struct msghdr msgs4[PING_BATCH], msgs6[PING_BATCH];
+#endif
+  int i, n4 = 0, n6 = 0;
+  struct timespec ts;
+  unsigned char tsbuf[PING_TS_LEN];
+  uint32_t ts_sum = 0;
+
+  for(i=0; i<data->npending; i++) {
+    ping_pending_t *pp = &data->pending[i];
+    ping_probe_t *probe = ping_slot(data, pp->slot);
+    struct ping_payload *payload;
+    struct iovec *iov;
+    struct msghdr *hdr;
+    uint16_t cksum;
+    uint64_t sec;
+    uint32_t nsec;
+
+    /* the check may have finished or gone away since this was queued */
+    if(!probe || !probe->check || probe->gen != pp->gen) continue;
+
+    /* one clock read per batch; the payload words are patched into the
+     * checksum rather than summing the whole packet again */
+    if(n4 == 0 && n6 == 0) {
+      clock_gettime(CLOCK_REALTIME, &ts);
+      sec = ts.tv_sec;
+      nsec = ts.tv_nsec;
+      memcpy(tsbuf, &sec, sizeof(sec));
+      memcpy(tsbuf + sizeof(sec), &nsec, sizeof(nsec));
+      ts_sum = ping_cksum_add(0, tsbuf, PING_TS_LEN);
+    }
+    payload = (struct ping_payload *)(probe->pkt + probe->icp_len);
+    memcpy((unsigned char *)payload + PING_TS_OFF, tsbuf, PING_TS_LEN);
+    cksum = ping_cksum_fold(probe->csum + ts_sum);
+
+    if(probe->family == AF_INET) {
+      ((struct icmp *)probe->pkt)->icmp_cksum = cksum;
+      probes4[n4] = probe;
+      iov = &iov4[n4];
+#ifdef HAVE_SENDMMSG
+      hdr = &msgs4[n4].msg_hdr;
+#else
+      hdr = &msgs4[n4];
+#endif
+      n4++;
+    }
+    else {
+      ((struct icmp6_hdr *)probe->pkt)->icmp6_cksum = cksum;
+      probes6[n6] = probe;
+      iov = &iov6[n6];
+#ifdef HAVE_SENDMMSG
+      hdr = &msgs6[n6].msg_hdr;
+#else
+      hdr = &msgs6[n6];
+#endif
+      n6++;
+    }
+    iov->iov_base = probe->pkt;
+    iov->iov_len = probe->len;
+    memset(hdr, 0, sizeof(*hdr));
+    hdr->msg_name = &probe->to;
+    hdr->msg_namelen = probe->tolen;
+    hdr->msg_iov = iov;
+    hdr->msg_iovlen = 1;
+
+    if(n4 == PING_BATCH) {
+      ping_icmp_sendmsgs(data->ipv4_fd, msgs4, probes4, n4);
+      n4 = 0;
+    }
+    if(n6 == PING_BATCH) {
+      ping_icmp_sendmsgs(data->ipv6_fd, msgs6, probes6, n6);
+      n6 = 0;
+    }
+  }
+  if(n4) ping_icmp_sendmsgs(data->ipv4_fd, msgs4, probes4, n4);
+  if(n6) ping_icmp_sendmsgs(data->ipv6_fd, msgs6, probes6, n6);
+  data->npending = 0;
+}
+static int ping_icmp_flush_event(eventer_t e, int mask,
+                                 void *closure, struct timeval *now) {
+  noit_module_t *self = (noit_module_t *)closure;
+  ping_icmp_data_t *data = noit_module_get_userdata(self);
+  pthread_mutex_lock(&data->lock);
+  data->flush_event = NULL;
+  ping_icmp_flush(data);
+  pthread_mutex_unlock(&data->lock);
+  return 0;
+}
+
+/* A check's probes are due: queue them.  Probes from all the checks that
+ * fall due together are sent by one flush. */
 static int ping_icmp_real_send(eventer_t e, int mask,
                                void *closure, struct timeval *now) {
   struct ping_closure *pcl = (struct ping_closure *)closure;
-  struct ping_session_key k;
-  struct ping_payload *payload;
-  struct timeval whence;
+  struct check_info *ci = (struct check_info *)pcl->check->closure;
   ping_icmp_data_t *data;
-  void *vcheck;
-  int i = 0;
+  int i;
 
   data = noit_module_get_userdata(pcl->self);
-  payload = (struct ping_payload *)((char *)pcl->payload + pcl->icp_len);
-  k.addr_of_check = payload->addr_of_check;
-  mtev_uuid_copy(k.checkid, payload->checkid);
-
+  ci->send_event = NULL;
   if(pcl->check->target_ip[0] == '\0') goto cleanup;
 
-  if(!mtev_hash_retrieve(data->in_flight, (const char *)&k, sizeof(k),
-                         &vcheck)) {
-    mtevLT(nldeb, now, "ping check no longer active, bailing\n");
-    goto cleanup;
-  }
-
   mtevLT(nldeb, now, "ping_icmp_real_send(%s)\n", pcl->check->target_ip);
-  mtev_gettimeofday(&whence, NULL); /* now isn't accurate enough */
-  payload->tv_sec = whence.tv_sec;
-  payload->tv_usec = whence.tv_usec;
-  if(pcl->check->target_family == AF_INET) {
-    struct sockaddr_in sin;
-    struct icmp *icp4 = (struct icmp *)pcl->payload;
-    icp4->icmp_cksum = in_cksum(pcl->payload, pcl->payload_len);
-    memset(&sin, 0, sizeof(sin));
-    sin.sin_family = AF_INET;
-    memcpy(&sin.sin_addr,
-           &pcl->check->target_addr.addr, sizeof(sin.sin_addr));
-    i = sendto(data->ipv4_fd,
-               pcl->payload, pcl->payload_len, 0,
-               (struct sockaddr *)&sin, sizeof(sin));
+  pthread_mutex_lock(&data->lock);
+  if(data->npending + ci->expected_count > data->pending_allocd) {
+    while(data->npending + ci->expected_count > data->pending_allocd)
+      data->pending_allocd = data->pending_allocd ? data->pending_allocd * 2
+                                                  : PING_BATCH * 4;
+    data->pending = realloc(data->pending,
+                            data->pending_allocd * sizeof(*data->pending));
+  }
+  for(i=0; i<ci->expected_count; i++) {
+    ping_probe_t *probe = ping_slot(data, ci->slots[i]);
+    if(!probe) continue;
+    data->pending[data->npending].slot = ci->slots[i];
+    data->pending[data->npending].gen = probe->gen;
+    data->npending++;
   }
-  else if(pcl->check->target_family == AF_INET6) {
-    struct sockaddr_in6 sin;
-    struct icmp6_hdr *icp6 = (struct icmp6_hdr *)pcl->payload;
-    icp6->icmp6_cksum = in_cksum(pcl->payload, pcl->payload_len);
-    memset(&sin, 0, sizeof(sin));
-    sin.sin6_family = AF_INET6;
-    memcpy(&sin.sin6_addr,
-           &pcl->check->target_addr.addr6, sizeof(sin.sin6_addr));
-    i = sendto(data->ipv6_fd,
-               pcl->payload, pcl->payload_len, 0,
-               (struct sockaddr *)&sin, sizeof(sin));
+  if(data->npending >= PING_BATCH) {
+    ping_icmp_flush(data);
   }
-  if(i != pcl->payload_len) {
-    mtevLT(nlerr, now, "Error sending ICMP packet to %s(%s): %s\n",
-             pcl->check->target, pcl->check->target_ip, strerror(errno));
+  else if(data->npending && !data->flush_event) {
+    data->flush_event = eventer_in_s_us(ping_icmp_flush_event, pcl->self, 0, 0);
+    eventer_add(data->flush_event);
   }
+  pthread_mutex_unlock(&data->lock);
  cleanup:
-  free(pcl->payload);
   free(pcl);
   return 0;
 }
 static void ping_check_cleanup(noit_module_t *self, noit_check_t *check) {
   struct check_info *ci = (struct check_info *)check->closure;
+  ping_icmp_data_t *data = noit_module_get_userdata(self);
   if(ci) {
+    if(ci->send_event) {
+      eventer_remove(ci->send_event);
+      free(eventer_get_closure(ci->send_event));
+      eventer_free(ci->send_event);
+      ci->send_event = NULL;
+    }
     if(ci->timeout_event) {
       eventer_remove(ci->timeout_event);
       free(eventer_get_closure(ci->timeout_event));
       eventer_free(ci->timeout_event);
       ci->timeout_event = NULL;
     }
+    if(data) ping_release_slots(data, ci);
     if(ci->turnaround) free(ci->turnaround);
+    if(ci->slots) free(ci->slots);
   }
 }
 static int ping_icmp_send(noit_module_t *self, noit_check_t *check,
@@ -513,7 +797,6 @@ static int ping_icmp_send(noit_module_t *self, noit_check_t *check,
   eventer_t newe;
   const char *config_val;
   ping_icmp_data_t *ping_data;
-  struct ping_session_key *k;
   void *icp;
 
   int interval = PING_INTERVAL;
@@ -530,13 +813,6 @@ static int ping_icmp_send(noit_module_t *self, noit_check_t *check,
 
   check->flags |= NP_RUNNING;
   ping_data = noit_module_get_userdata(self);
-  k = calloc(1, sizeof(*k));
-  k->addr_of_check = (uintptr_t)check ^ random_num;
-  mtev_uuid_copy(k->checkid, check->checkid);
-  if(!mtev_hash_store(ping_data->in_flight, (const char *)k, sizeof(*k),
-                      check)) {
-    free(k);
-  }
   mtevL(nldeb, "ping_icmp_send(%p,%s,%d,%d)\n",
         self, check->target_ip, interval, count);
 
@@ -549,6 +825,13 @@ static int ping_icmp_send(noit_module_t *self, noit_check_t *check,
     eventer_free(ci->timeout_event);
     ci->timeout_event = NULL;
   }
+  if(ci->send_event) {
+    eventer_remove(ci->send_event);
+    free(eventer_get_closure(ci->send_event));
+    eventer_free(ci->send_event);
+    ci->send_event = NULL;
+  }
+  ping_release_slots(ping_data, ci);
 
   mtev_gettimeofday(&when, NULL);
   memcpy(&check->last_fire_time, &when, sizeof(when));
@@ -564,13 +847,23 @@ static int ping_icmp_send(noit_module_t *self, noit_check_t *check,
   ci->expected_count = count;
   if(ci->turnaround) free(ci->turnaround);
   ci->turnaround = malloc(count * sizeof(*ci->turnaround));
+  if(ci->slots) free(ci->slots);
+  ci->slots = malloc(count * sizeof(*ci->slots));
 
   ++ci->check_no;
+  pthread_mutex_lock(&ping_data->lock);
   for(i=0; i<count; i++) {
+    ping_probe_t *probe;
     /* Negative means we've not received a response */
     ci->turnaround[i] = -1.0;
 
-    icp = calloc(1,packet_len);
+    ci->slots[i] = ping_slot_alloc(ping_data, check);
+    probe = ping_slot(ping_data, ci->slots[i]);
+    probe->family = check->target_family;
+    probe->len = packet_len;
+    probe->icp_len = icp_len;
+    icp = probe->pkt;
+    memset(icp, 0, packet_len);
     payload = (struct ping_payload *)((char *)icp + icp_len);
 
     if(check->target_family == AF_INET) {
@@ -580,6 +873,11 @@ static int ping_icmp_send(noit_module_t *self, noit_check_t *check,
       icp4->icmp_cksum = 0;
       icp4->icmp_seq = htons(ci->seq++);
       icp4->icmp_id = (((uintptr_t)self) & 0xffff);
+      memset(&probe->to.in4, 0, sizeof(probe->to.in4));
+      probe->to.in4.sin_family = AF_INET;
+      memcpy(&probe->to.in4.sin_addr,
+             &check->target_addr.addr, sizeof(probe->to.in4.sin_addr));
+      probe->tolen = sizeof(probe->to.in4);
     }
     else if(check->target_family == AF_INET6) {
       struct icmp6_hdr *icp6 = icp;
@@ -588,25 +886,33 @@ static int ping_icmp_send(noit_module_t *self, noit_check_t *check,
       icp6->icmp6_cksum = 0;
       icp6->icmp6_seq = htons(ci->seq++);
       icp6->icmp6_id = (((uintptr_t)self) & 0xffff);
+      memset(&probe->to.in6, 0, sizeof(probe->to.in6));
+      probe->to.in6.sin6_family = AF_INET6;
+      memcpy(&probe->to.in6.sin6_addr,
+             &check->target_addr.addr6, sizeof(probe->to.in6.sin6_addr));
+      probe->tolen = sizeof(probe->to.in6);
     }
 
     payload->addr_of_check = (uintptr_t)check ^ random_num;
     mtev_uuid_copy(payload->checkid, check->checkid);
+    payload->slot = ci->slots[i];
+    payload->slot_gen = probe->gen;
     payload->generation = check->generation & 0xffff;
     payload->check_no = ci->check_no;
     payload->check_pack_no = i;
     payload->check_pack_cnt = count;
+    /* the timestamp is still zero, so it contributes nothing here */
+    probe->csum = ping_cksum_add(0, icp, packet_len);
+  }
+  pthread_mutex_unlock(&ping_data->lock);
 
-    pcl = calloc(1, sizeof(*pcl));
-    pcl->self = self;
-    pcl->check = check;
-    pcl->payload = icp;
-    pcl->payload_len = packet_len;
-    pcl->icp_len = icp_len;
+  pcl = calloc(1, sizeof(*pcl));
+  pcl->self = self;
+  pcl->check = check;
+  newe = eventer_in(ping_icmp_real_send, pcl, p_int);
+  eventer_add(newe);
+  ci->send_event = newe;
 
-    newe = eventer_in(ping_icmp_real_send, pcl, p_int);
-    eventer_add(newe);
-  }
   p_int.tv_sec = check->timeout / 1000;
   p_int.tv_usec = (check->timeout % 1000) * 1000;
   pcl = calloc(1, sizeof(*pcl));
@@ -630,13 +936,14 @@ static int ping_icmp_initiate_check(noit_module_t *self, noit_check_t *check,
  *          This is from Mike Muuss's Public Domain code.
  * Checksum routine for Internet Protocol family headers (C Version)
  *
+ * Split in two so that a sum can be extended as fields are filled in:
+ * ping_cksum_add() accumulates and ping_cksum_fold() produces the
+ * checksum.  Additions must start on even offsets of the packet.
  */
-static int in_cksum(u_short *addr, int len)
+static uint32_t ping_cksum_add(uint32_t sum, const void *addr, int len)
 {
   register int nleft = len;
-  register u_short *w = addr;
-  register u_short answer;
-  register int sum = 0;
+  register const u_short *w = addr;
 
   /*
    *  Our algorithm is simple, using a 32 bit accumulator (sum),
@@ -653,17 +960,20 @@ static int in_cksum(u_short *addr, int len)
   if( nleft == 1 ) {
     u_short  u = 0;
 
-    *(u_char *)(&u) = *(u_char *)w ;
+    *(u_char *)(&u) = *(const u_char *)w ;
     sum += u;
   }
+  return sum;
+}
 
+static uint16_t ping_cksum_fold(uint32_t sum)
+{
   /*
    * add back carry outs from top 16 bits to low 16 bits
    */
   sum = (sum >> 16) + (sum & 0xffff);  /* add hi 16 to low 16 */
   sum += (sum >> 16);      /* add carry */
-  answer = ~sum;        /* truncate to 16 bits */
-  return (answer);
+  return (uint16_t)~sum;   /* truncate to 16 bits */
 }
 
 static int ping_icmp_onload(mtev_image_t *self) {
@@ -675,6 +985,7 @@ static int ping_icmp_onload(mtev_image_t *self) {
   eventer_name_callback("ping_icmp/handler", ping_icmp4_handler);
   eventer_name_callback("ping_icmp6/handler", ping_icmp6_handler);
   eventer_name_callback("ping_icmp/send", ping_icmp_real_send);
+  eventer_name_callback("ping_icmp/flush", ping_icmp_flush_event);
   return 0;
 }
 #include "ping_icmp.xmlh"
@@ -43,6 +43,7 @@
 #include <libpq-fe.h>
 #include <zlib.h>
 #include <errno.h>
+#include <math.h>
 
 #include <eventer/eventer.h>
 #include <mtev_log.h>
@@ -58,6 +59,7 @@
 #include "noit_module.h"
 #include "stratcon_datastore.h"
 #include "stratcon_ingest.h"
+#include "stratcon_rollup.h"
 #include "stratcon_realtime_http.h"
 #include "stratcon_iep.h"
 #include "noit_check.h"
@@ -84,6 +86,7 @@ DECL_STMT(metric_insert_numeric, metric_numeric);
 DECL_STMT(metric_insert_text, metric_text);
 DECL_STMT(config_insert, config);
 DECL_STMT(config_get, findconfig);
+DECL_STMT(rollup_store, rollup_numeric);
 
 static mtev_log_stream_t ds_err = NULL;
 static mtev_log_stream_t ds_deb = NULL;
@@ -187,6 +190,12 @@ static mtev_hash_table uuid_to_info_cache;
 static pthread_mutex_t storagenode_to_info_cache_lock;
 static mtev_hash_table storagenode_to_info_cache;
 
+/* in-process numeric rollups, NULL when the database computes them */
+static stratcon_rollup_t *rollups = NULL;
+static int rollup_checkpoint_interval = 60;
+static time_t rollup_last_checkpoint = 0;
+static pthread_mutex_t rollup_checkpoint_lock = PTHREAD_MUTEX_INITIALIZER;
+
 /* the fqdn cache needs to be thread safe */
 typedef struct {
   char *uuid_str;
@@ -1128,12 +1137,185 @@ pg_interim_journal_remove(pg_interim_journal_t *ij) {
   if(ij->fqdn) free(ij->fqdn);
   free(ij);
 }
+/* Feed one M line to the rollups:
+ * M\t<whence>\t<uuid>\t<name>\t<type>\t<value> */
+static void
+stratcon_ingest_rollup_line(int storagenode_id, const char *remote_cn,
+                            const char *line) {
+  const char *field[6], *cp = line;
+  char namebuf[256], *name = namebuf;
+  int i, sid, namelen, uuidlen;
+  noit_metric_value_t v;
+  char *endptr;
+
+  for(i = 0; i < 6; i++) {
+    field[i] = cp;
+    if(i == 5) break;
+    if((cp = strchr(cp, '\t')) == NULL) return;
+    cp++;
+  }
+  memset(&v, 0, sizeof(v));
+  v.type = *field[4];
+  if(!IS_METRIC_TYPE_NUMERIC(v.type) || field[4][1] != '\t') return;
+  if(!strncmp(field[5], "[[null]]", 8)) return;
+  switch(v.type) {
+    case METRIC_INT32:
+    case METRIC_INT64:
+      v.type = METRIC_INT64;
+      v.value.v_int64 = strtoll(field[5], &endptr, 10);
+      break;
+    case METRIC_UINT32:
+    case METRIC_UINT64:
+      v.type = METRIC_UINT64;
+      v.value.v_uint64 = strtoull(field[5], &endptr, 10);
+      break;
+    default:
+      v.value.v_double = strtod(field[5], &endptr);
+      if(!isfinite(v.value.v_double)) return;
+      break;
+  }
+  if(endptr == field[5]) return;
+
+  v.whence_ms = strtoull(field[1], &endptr, 10) * 1000;
+  if(*endptr == '.') {
+    int scale = 100;
+    for(cp = endptr + 1; *cp >= '0' && *cp <= '9' && scale; cp++, scale /= 10)
+      v.whence_ms += (*cp - '0') * scale;
+  }
+
+  /* uuid is last 36 bytes */
+  uuidlen = field[3] - field[2] - 1;
+  if(uuidlen < UUID_STR_LEN) return;
+  sid = uuid_to_sid(field[2] + uuidlen - UUID_STR_LEN, remote_cn);
+  if(sid == 0) return;
+
+  namelen = field[4] - field[3] - 1;
+  if(namelen >= (int)sizeof(namebuf)) name = malloc(namelen + 1);
+  memcpy(name, field[3], namelen);
+  name[namelen] = '\0';
+  stratcon_rollup_add(rollups, storagenode_id, sid, name, &v);
+  if(name != namebuf) free(name);
+}
+
+static void
+stratcon_ingest_rollup_batch(pg_interim_journal_t *ij, ds_line_detail *head) {
+  ds_line_detail *l;
+  for(l = head; l; l = l->next)
+    if(l->data && l->data[0] == 'M' && l->data[1] == '\t')
+      stratcon_ingest_rollup_line(ij->storagenode_id, ij->remote_cn, l->data);
+}
+
+typedef struct {
+  char *buf;
+  size_t len, allocd;
+} pg_array_t;
+
+static void
+pg_array_add(pg_array_t *a, const char *str, mtev_boolean quote) {
+  size_t need = a->len + 2 * strlen(str) + 6;
+  if(need > a->allocd) {
+    a->allocd = MAX(need, a->allocd * 2);
+    a->buf = realloc(a->buf, a->allocd);
+  }
+  a->buf[a->len] = a->len ? ',' : '{';
+  a->len++;
+  if(quote) a->buf[a->len++] = '"';
+  for(; *str; str++) {
+    if(quote && (*str == '"' || *str == '\\')) a->buf[a->len++] = '\\';
+    a->buf[a->len++] = *str;
+  }
+  if(quote) a->buf[a->len++] = '"';
+  a->buf[a->len] = '\0';
+}
+
+static void
+pg_array_finish(pg_array_t *a) {
+  /* pg_array_add always leaves room for this */
+  a->buf[a->len++] = '}';
+  a->buf[a->len] = '\0';
+}
+
+/* Write finalized rollup rows, one bulk call per rollup. */
+static execute_outcome_t
+stratcon_ingest_store_rollups(conn_q *cq, stratcon_rollup_row_t *rows,
+                              int nrows) {
+  int i, j;
+  char *done = calloc(nrows, 1);
+  ds_single_detail *d = NULL;
+  execute_outcome_t rv = DS_EXEC_SUCCESS;
+
+  GET_QUERY(rollup_store);
+  for(i = 0; i < nrows; i++) {
+    pg_array_t arr[6];
+    char buff[64];
+    const char *rollup = rows[i].rollup;
+    if(done[i]) continue;
+    memset(arr, 0, sizeof(arr));
+    for(j = i; j < nrows; j++) {
+      stratcon_rollup_row_t *row = &rows[j];
+      if(done[j] || row->rollup != rollup) continue;
+      done[j] = 1;
+      snprintf(buff, sizeof(buff), "%d", row->sid);
+      pg_array_add(&arr[0], buff, mtev_false);
+      pg_array_add(&arr[1], row->name, mtev_true);
+      snprintf(buff, sizeof(buff), "%llu", (unsigned long long)row->rollup_time);
+      pg_array_add(&arr[2], buff, mtev_false);
+      snprintf(buff, sizeof(buff), "%d", row->count_rows);
+      pg_array_add(&arr[3], buff, mtev_false);
+      snprintf(buff, sizeof(buff), "%.17g", row->avg_value);
+      pg_array_add(&arr[4], buff, mtev_false);
+      if(row->has_counter_dev)
+        snprintf(buff, sizeof(buff), "%.9g", row->counter_dev);
+      else
+        strlcpy(buff, "NULL", sizeof(buff));
+      pg_array_add(&arr[5], buff, mtev_false);
+    }
+    d = calloc(1, sizeof(*d));
+    DECLARE_PARAM_STR(rollup, strlen(rollup));
+    for(j = 0; j < 6; j++) {
+      pg_array_finish(&arr[j]);
+      DECLARE_PARAM_STR(arr[j].buf, arr[j].len);
+      free(arr[j].buf);
+    }
+    PG_EXEC(rollup_store);
+    PQclear(d->res);
+    free_params(d);
+    free(d);
+    d = NULL;
+  }
+  free(done);
+  return rv;
+
+ bad_row:
+  if(d) {
+    free_params(d);
+    free(d);
+  }
+  free(done);
+  return (PQstatus(cq->dbh) == CONNECTION_OK) ?
+    DS_EXEC_ROW_FAILED : DS_EXEC_TXN_FAILED;
+}
+
+static void
+stratcon_ingest_rollup_checkpoint() {
+  time_t now = time(NULL);
+  if(now - rollup_last_checkpoint < rollup_checkpoint_interval) return;
+  if(pthread_mutex_trylock(&rollup_checkpoint_lock)) return;
+  if(now - rollup_last_checkpoint >= rollup_checkpoint_interval) {
+    stratcon_rollup_checkpoint(rollups);
+    rollup_last_checkpoint = now;
+  }
+  pthread_mutex_unlock(&rollup_checkpoint_lock);
+}
+
 static int
 stratcon_ingest_asynch_execute(eventer_t e, int mask, void *closure,
                                struct timeval *now) {
-  int i, total, success, sp_total, sp_success;
+  int i, total, success, sp_total, sp_success, nrollup_rows = 0;
   pg_interim_journal_t *ij;
   ds_line_detail *head = NULL, *current, *last_sp;
+  stratcon_rollup_row_t *rollup_rows = NULL;
+  mtev_boolean rolled = mtev_false;
   const char *dsn;
   conn_q *cq;
   if(!(mask & EVENTER_ASYNCH_WORK)) return 0;
@@ -1163,6 +1345,17 @@ stratcon_ingest_asynch_execute(eventer_t e, int mask, void *closure,
   }
 
   if(head == NULL) head = build_insert_batch(ij);
+  if(rollups && !rolled) {
+    /* Only once per journal, retries below must not count it again. */
+    struct timeval tv;
+    rolled = mtev_true;
+    stratcon_ingest_rollup_batch(ij, head);
+    gettimeofday(&tv, NULL);
+    stratcon_rollup_advance(rollups,
+                            (uint64_t)tv.tv_sec * 1000 + tv.tv_usec / 1000);
+    nrollup_rows = stratcon_rollup_take(rollups, ij->storagenode_id,
+                                        &rollup_rows);
+  }
   mtevL(ds_deb, "Starting batch from %s/%s to %s\n",
         ij->remote_str ? ij->remote_str : "(null)",
         ij->remote_cn ? ij->remote_cn : "(null)",
@@ -1211,6 +1404,23 @@ stratcon_ingest_asynch_execute(eventer_t e, int mask, void *closure,
     }
   }
   if(last_sp) RELEASE_SAVEPOINT("batch");
+  if(nrollup_rows) {
+    SAVEPOINT("rollup");
+    switch(stratcon_ingest_store_rollups(cq, rollup_rows, nrollup_rows)) {
+      case DS_EXEC_SUCCESS:
+        RELEASE_SAVEPOINT("rollup");
+        break;
+      case DS_EXEC_ROW_FAILED:
+        /* don't hold the journal hostage to the rollups */
+        mtevL(noit_error, "dropping %d rollup rows for storage node %d\n",
+              nrollup_rows, ij->storagenode_id);
+        ROLLBACK_TO_SAVEPOINT("rollup");
+        break;
+      case DS_EXEC_TXN_FAILED:
+        mtevL(noit_error, "rollup txn failed '%s', retrying\n", ij->filename);
+        BUSTED(cq);
+    }
+  }
   if(stratcon_ingest_do(cq, "COMMIT")) {
     mtevL(noit_error, "txn commit failed '%s', retrying\n", ij->filename);
     BUSTED(cq);
@@ -1230,6 +1440,8 @@ stratcon_ingest_asynch_execute(eventer_t e, int mask, void *closure,
         ij->fqdn ? ij->fqdn : "(null)", success, total);
   pg_interim_journal_remove(ij);
   release_conn_q(cq);
+  if(rollup_rows) stratcon_rollup_rows_free(rollup_rows, nrollup_rows);
+  if(rollups) stratcon_ingest_rollup_checkpoint();
   return 0;
 }
 static int
@@ -1617,6 +1829,7 @@ static int is_postgres_ingestor_file(const char *file) {
   return (strlen(file) == 19 && !strcmp(file + 16, ".pg"));
 }
 static int postgres_ingestor_init(mtev_dso_generic_t *self) {
+  char *rollup_checkpoint = NULL;
   stratcon_datastore_core_init();
   mtev_hash_init(&ds_conns);
   mtev_hash_init(&uuid_to_info_cache);
@@ -1634,6 +1847,24 @@ static int postgres_ingestor_init(mtev_dso_generic_t *self) {
     mtevL(noit_error, "/stratcon/database/journal/path is unspecified\n");
     exit(-1);
   }
+  if(mtev_conf_get_string(NULL, "/stratcon/database/rollup/checkpoint",
+                          &rollup_checkpoint)) {
+    int grace = 60;
+    if(!mtev_conf_get_string(NULL, rollup_store_conf, &rollup_store)) {
+      mtevL(noit_error, "%s is unspecified, rollups stay in the database\n",
+            rollup_store_conf);
+    }
+    else {
+      (void)mtev_conf_get_int(NULL, "/stratcon/database/rollup/grace",
+                              &grace);
+      (void)mtev_conf_get_int(NULL,
+                              "/stratcon/database/rollup/checkpoint_interval",
+                              &rollup_checkpoint_interval);
+      rollups = stratcon_rollup_alloc(rollup_checkpoint, grace);
+      rollup_last_checkpoint = time(NULL);
+    }
+    free(rollup_checkpoint);
+  }
   stratcon_ingest_all_check_info();
   stratcon_ingest_all_storagenode_info();
   stratcon_ingest_sweep_journals(basejpath, is_postgres_ingestor_file,
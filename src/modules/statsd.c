@@ -40,11 +40,15 @@
 #include <arpa/inet.h>
 
 #include <mtev_hash.h>
+#include <mtev_b64.h>
+#include <mtev_memory.h>
+#include <circllhist.h>
 
 #include "noit_module.h"
 #include "noit_check.h"
 #include "noit_check_tools.h"
 #include "noit_mtev_bridge.h"
+#include "noit_udp.h"
 
 #define MAX_CHECKS 3
 
@@ -59,17 +63,192 @@ typedef struct _mod_config {
   uuid_t primary;
   int primary_active;
   noit_check_t *check;
-  char *payload;
-  int payload_len;
-  int ipv4_fd;
-  int ipv6_fd;
 } statsd_mod_config_t;
 
+/* HyperLogLog for |s sets: 2^11 registers, ~2.3% standard error */
+#define STATSD_HLL_BITS 11
+#define STATSD_HLL_REGISTERS (1 << STATSD_HLL_BITS)
+/* drop cached keys that have been silent for this many periods */
+#define STATSD_KEY_IDLE_PERIODS 10
+
+typedef struct {
+  uint8_t reg[STATSD_HLL_REGISTERS];
+} statsd_hll_t;
+
+/* Everything the hot path needs for one statsd key on one check.  The
+ * metric pointers refer to the in-progress stats and are only trusted
+ * while generation matches the closure's. */
+typedef struct {
+  uint32_t generation;
+  metric_t *count;
+  metric_t *rate;
+  metric_t *counter;
+  metric_t *gauge;
+  histogram_t *timing;
+  statsd_hll_t *set;
+  char key[1];
+} statsd_key_t;
+
 typedef struct {
   noit_module_t *self;
   int stats_count;
+  uint32_t generation;
+  pthread_mutex_t lock;
+  mtev_hash_table keys;
 } statsd_closure_t;
 
+static statsd_closure_t *
+statsd_closure_alloc(noit_module_t *self) {
+  statsd_closure_t *ccl = calloc(1, sizeof(*ccl));
+  ccl->self = self;
+  ccl->generation = 1;
+  pthread_mutex_init(&ccl->lock, NULL);
+  mtev_hash_init(&ccl->keys);
+  return ccl;
+}
+
+static void
+statsd_key_free(void *vk) {
+  statsd_key_t *k = vk;
+  if(k->timing) hist_free(k->timing);
+  free(k->set);
+  free(k);
+}
+
+static uint64_t
+statsd_hash64(const char *v, size_t len) {
+  uint64_t h = 0xcbf29ce484222325ULL;
+  size_t i;
+  for(i=0; i<len; i++) {
+    h ^= (unsigned char)v[i];
+    h *= 0x100000001b3ULL;
+  }
+  /* FNV alone mixes the high bits poorly; finish with murmur's fmix64 */
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdULL;
+  h ^= h >> 33;
+  h *= 0xc4ceb9fe1a85ec53ULL;
+  h ^= h >> 33;
+  return h;
+}
+
+static void
+statsd_hll_add(statsd_hll_t *hll, const char *v) {
+  uint64_t h = statsd_hash64(v, strlen(v));
+  uint32_t idx = h >> (64 - STATSD_HLL_BITS);
+  uint64_t w = (h << STATSD_HLL_BITS) | (1ULL << (STATSD_HLL_BITS - 1));
+  uint8_t rank = __builtin_clzll(w) + 1;
+  if(rank > hll->reg[idx]) hll->reg[idx] = rank;
+}
+
+static uint64_t
+statsd_hll_estimate(const statsd_hll_t *hll) {
+  double m = STATSD_HLL_REGISTERS, sum = 0.0, est;
+  int i, zeros = 0;
+  for(i=0; i<STATSD_HLL_REGISTERS; i++) {
+    sum += ldexp(1.0, -hll->reg[i]);
+    if(hll->reg[i] == 0) zeros++;
+  }
+  est = (0.7213 / (1.0 + 1.079 / m)) * m * m / sum;
+  /* linear counting is far more accurate for small cardinalities */
+  if(est <= 2.5 * m && zeros) est = m * log(m / (double)zeros);
+  return (uint64_t)(est + 0.5);
+}
+
+static metric_t *
+statsd_cache_metric(noit_check_t *check, stats_t *inprogress,
+                    const char *name, metric_type_t type) {
+  metric_t *m = noit_stats_get_metric(check, inprogress, name);
+  if(m && m->metric_type == type && m->metric_value.vp != NULL) return m;
+  return NULL;
+}
+
+/* Emit a timer histogram; returns mtev_false if no histogram log is
+ * available so the caller can fall back to a plain metric. */
+static mtev_boolean
+statsd_log_histo(noit_check_t *check, const char *name, histogram_t *h,
+                 uint64_t whence_s) {
+  char *serial = NULL, *encoded = NULL;
+  ssize_t est, enc_est;
+  mtev_boolean rv = mtev_false;
+
+  est = hist_serialize_estimate(h);
+  serial = malloc(est);
+  enc_est = ((est + 2)/3)*4;
+  encoded = malloc(enc_est);
+  if(!serial || !encoded) goto cleanup;
+  if(hist_serialize(h, serial, est) != est) {
+    mtevL(nlerr, "statsd: histogram serialization failure\n");
+    goto cleanup;
+  }
+  enc_est = mtev_b64_encode((unsigned char *)serial, est, encoded, enc_est);
+  if(enc_est < 0) {
+    mtevL(nlerr, "statsd: base64 histogram encoding failure\n");
+    goto cleanup;
+  }
+  rv = noit_stats_log_immediate_histo(check, name, encoded, enc_est, whence_s);
+ cleanup:
+  free(serial);
+  free(encoded);
+  return rv;
+}
+
+/* Turn this period's timer histograms and sets into metrics, and forget
+ * keys that have gone quiet. */
+static void
+statsd_flush_keys(noit_check_t *check, statsd_closure_t *ccl,
+                  struct timeval *now) {
+  mtev_hash_iter iter = MTEV_HASH_ITER_ZERO;
+  const char *k;
+  int klen, i, nidle = 0, nready = 0, alloc;
+  void *vk;
+  statsd_key_t **ready, **idle;
+  char buff[256];
+
+  pthread_mutex_lock(&ccl->lock);
+  alloc = mtev_hash_size(&ccl->keys);
+  ready = alloc ? calloc(alloc, sizeof(*ready)) : NULL;
+  idle = alloc ? calloc(alloc, sizeof(*idle)) : NULL;
+  while(mtev_hash_next(&ccl->keys, &iter, &k, &klen, &vk)) {
+    statsd_key_t *key = vk;
+    if(key->timing || key->set) {
+      statsd_key_t *out = calloc(1, sizeof(*out) + strlen(key->key));
+      strcpy(out->key, key->key);
+      out->timing = key->timing;
+      out->set = key->set;
+      key->timing = NULL;
+      key->set = NULL;
+      ready[nready++] = out;
+    }
+    else if(ccl->generation - key->generation > STATSD_KEY_IDLE_PERIODS) {
+      idle[nidle++] = key;
+    }
+  }
+  for(i=0; i<nidle; i++)
+    mtev_hash_delete(&ccl->keys, idle[i]->key, strlen(idle[i]->key),
+                     NULL, statsd_key_free);
+  pthread_mutex_unlock(&ccl->lock);
+
+  for(i=0; i<nready; i++) {
+    statsd_key_t *key = ready[i];
+    if(key->timing) {
+      snprintf(buff, sizeof(buff), "%s`timing", key->key);
+      if(!statsd_log_histo(check, buff, key->timing, now->tv_sec)) {
+        double mean = hist_approx_mean(key->timing);
+        noit_stats_set_metric(check, buff, METRIC_DOUBLE, &mean);
+      }
+    }
+    if(key->set) {
+      uint64_t card = statsd_hll_estimate(key->set);
+      snprintf(buff, sizeof(buff), "%s`set", key->key);
+      noit_stats_set_metric(check, buff, METRIC_UINT64, &card);
+    }
+    statsd_key_free(key);
+  }
+  free(ready);
+  free(idle);
+}
+
 static int
 statsd_submit(noit_module_t *self, noit_check_t *check,
               noit_check_t *cause) {
@@ -91,13 +270,13 @@ statsd_submit(noit_module_t *self, noit_check_t *check,
   if(check->flags & NP_TRANSIENT) return 0;
 
   if(!check->closure) {
-    ccl = check->closure = calloc(1, sizeof(*ccl));
-    ccl->self = self;
+    ccl = check->closure = statsd_closure_alloc(self);
   } else {
     // Don't count the first run
     char human_buffer[256];
     ccl = (statsd_closure_t*)check->closure;
     mtev_gettimeofday(&now, NULL);
+    statsd_flush_keys(check, ccl, &now);
     sub_timeval(now, check->last_fire_time, &duration);
     noit_stats_set_whence(check, &now);
     noit_stats_set_duration(check, duration.tv_sec * 1000 + duration.tv_usec / 1000);
@@ -113,8 +292,15 @@ statsd_submit(noit_module_t *self, noit_check_t *check,
     noit_stats_set_state(check, (ccl->stats_count > 0) ?
         NP_GOOD : NP_BAD);
     noit_stats_set_status(check, human_buffer);
-    if(check->last_fire_time.tv_sec)
+    if(check->last_fire_time.tv_sec) {
+      /* The cached metric pointers die with the in-progress stats, so
+       * invalidate them in the same critical section as the rotation;
+       * a sample can't land between the two and cache a stale one. */
+      pthread_mutex_lock(&ccl->lock);
       noit_check_passive_set_stats(check);
+      ccl->generation++;
+      pthread_mutex_unlock(&ccl->lock);
+    }
 
     memcpy(&check->last_fire_time, &now, sizeof(duration));
   }
@@ -124,56 +310,93 @@ statsd_submit(noit_module_t *self, noit_check_t *check,
 
 static void
 update_check(noit_check_t *check, const char *key, char type,
-             double diff, double sample) {
+             double diff, double sample, const char *value) {
   uint32_t one = 1, cnt = 1;
   char buff[256];
   statsd_closure_t *ccl;
+  statsd_key_t *k;
   stats_t *inprogress;
-  metric_t *m;
+  void *vk;
 
   if (sample == 0.0) return; /* would be a div-by-zero */
   if (check->closure == NULL) return;
   ccl = check->closure;
 
+  pthread_mutex_lock(&ccl->lock);
+  if(!mtev_hash_retrieve(&ccl->keys, key, strlen(key), &vk)) {
+    k = calloc(1, sizeof(*k) + strlen(key));
+    strcpy(k->key, key);
+    mtev_hash_store(&ccl->keys, k->key, strlen(k->key), k);
+  }
+  else k = vk;
+
+  mtev_memory_begin();
   inprogress = noit_check_get_stats_inprogress(check);
+  if(k->generation != ccl->generation) {
+    /* first sample for this key since the stats were last rotated */
+    k->generation = ccl->generation;
+    k->count = k->rate = k->counter = k->gauge = NULL;
+    ccl->stats_count++;
+  }
+
   /* First key counts */
-  snprintf(buff, sizeof(buff), "%s`count", key);
-  m = noit_stats_get_metric(check, inprogress, buff);
-  if(!m) ccl->stats_count++;
-  if(m && m->metric_type == METRIC_UINT32 && m->metric_value.I != NULL) {
-    (*m->metric_value.I)++;
-    cnt = *m->metric_value.I;
-    check_stats_set_metric_hook_invoke(check, inprogress, m);
+  if(k->count) {
+    cnt = ++(*k->count->metric_value.I);
+    check_stats_set_metric_hook_invoke(check, inprogress, k->count);
   }
-  else
+  else {
+    snprintf(buff, sizeof(buff), "%s`count", key);
     noit_stats_set_metric(check, buff, METRIC_UINT32, &one);
-
-  /* Next the actual data */
-  if(type == 'c') {
-    double v = diff * (1.0 / sample) / (check->period / 1000.0);
-    snprintf(buff, sizeof(buff), "%s`rate", key);
-    m = noit_stats_get_metric(check, inprogress, buff);
-    if(m && m->metric_type == METRIC_DOUBLE && m->metric_value.n != NULL) {
-      (*m->metric_value.n) += v;
-      check_stats_set_metric_hook_invoke(check, inprogress, m);
-    }
-    else
-      noit_stats_set_metric(check, buff, METRIC_DOUBLE, &v);
+    k->count = statsd_cache_metric(check, inprogress, buff, METRIC_UINT32);
   }
 
-  snprintf(buff, sizeof(buff), "%s`%s", key,
-           (type == 'c') ? "counter" : (type == 'g') ? "gauge" : "timing");
-  m = noit_stats_get_metric(check, inprogress, buff);
-  if(m && m->metric_type == METRIC_DOUBLE && m->metric_value.n != NULL) {
-    if(type == 'c') (*m->metric_value.n) += (diff * (1.0/sample));
-    else {
-      double new_avg = ((double)(cnt - 1) * (*m->metric_value.n) + diff) / (double)cnt;
-      (*m->metric_value.n) = new_avg;
+  switch(type) {
+    case 'm':
+      if(!k->timing) k->timing = hist_alloc();
+      hist_insert(k->timing, diff, (uint64_t)(1.0 / sample + 0.5));
+      break;
+    case 's':
+      if(!k->set) k->set = calloc(1, sizeof(*k->set));
+      statsd_hll_add(k->set, value);
+      break;
+    case 'c':
+    {
+      double v = diff * (1.0 / sample) / (check->period / 1000.0);
+      if(k->rate) {
+        (*k->rate->metric_value.n) += v;
+        check_stats_set_metric_hook_invoke(check, inprogress, k->rate);
+      }
+      else {
+        snprintf(buff, sizeof(buff), "%s`rate", key);
+        noit_stats_set_metric(check, buff, METRIC_DOUBLE, &v);
+        k->rate = statsd_cache_metric(check, inprogress, buff, METRIC_DOUBLE);
+      }
+      if(k->counter) {
+        (*k->counter->metric_value.n) += (diff * (1.0/sample));
+        check_stats_set_metric_hook_invoke(check, inprogress, k->counter);
+      }
+      else {
+        snprintf(buff, sizeof(buff), "%s`counter", key);
+        noit_stats_set_metric(check, buff, METRIC_DOUBLE, &diff);
+        k->counter = statsd_cache_metric(check, inprogress, buff, METRIC_DOUBLE);
+      }
+      break;
     }
-    check_stats_set_metric_hook_invoke(check, inprogress, m);
+    case 'g':
+      if(k->gauge) {
+        double *n = k->gauge->metric_value.n;
+        *n = ((double)(cnt - 1) * (*n) + diff) / (double)cnt;
+        check_stats_set_metric_hook_invoke(check, inprogress, k->gauge);
+      }
+      else {
+        snprintf(buff, sizeof(buff), "%s`gauge", key);
+        noit_stats_set_metric(check, buff, METRIC_DOUBLE, &diff);
+        k->gauge = statsd_cache_metric(check, inprogress, buff, METRIC_DOUBLE);
+      }
+      break;
   }
-  else
-    noit_stats_set_metric(check, buff, METRIC_DOUBLE, &diff);
+  mtev_memory_end();
+  pthread_mutex_unlock(&ccl->lock);
 }
 
 static void
@@ -229,6 +452,9 @@ statsd_handle_payload(noit_check_t **checks, int nchecks,
           else if(0 == strcmp(type, "ms")) {
             diff = 0.0;
           }
+          else if(*type == 's' && type[1] == '\0') {
+            diff = 0.0;
+          }
           else {
             type = NULL;
           }
@@ -241,8 +467,9 @@ statsd_handle_payload(noit_check_t **checks, int nchecks,
         case 'g':
         case 'c':
         case 'm':
+        case 's':
           for(i=0;i<nchecks;i++)
-            update_check(checks[i], key, *type, diff, sampleRate);
+            update_check(checks[i], key, *type, diff, sampleRate, value);
           break;
         default:
           break;
@@ -257,7 +484,8 @@ statsd_handle_payload(noit_check_t **checks, int nchecks,
 static int
 statsd_handler(eventer_t e, int mask, void *closure,
                struct timeval *now) {
-  noit_module_t *self = (noit_module_t *)closure;
+  noit_udp_receiver_t *rx = (noit_udp_receiver_t *)closure;
+  noit_module_t *self = noit_udp_receiver_closure(rx);
   int packets_per_cycle;
   statsd_mod_config_t *conf;
   noit_check_t *parent = NULL;
@@ -266,45 +494,26 @@ statsd_handler(eventer_t e, int mask, void *closure,
   if(conf->primary_active) parent = noit_poller_lookup(conf->primary);
 
   packets_per_cycle = MAX(conf->packets_per_cycle, 1);
-  for( ; packets_per_cycle > 0; packets_per_cycle--) {
-    noit_check_t *checks[MAX_CHECKS];
-    int nchecks = 0;
-    char ip[INET6_ADDRSTRLEN];
-    union {
-      struct sockaddr_in in;
-      struct sockaddr_in6 in6;
-    } addr;
-    socklen_t addrlen = sizeof(addr);
-    ssize_t len;
-    len = recvfrom(eventer_get_fd(e), conf->payload, conf->payload_len-1, 0,
-                   (struct sockaddr *)&addr, &addrlen);
-    if(len < 0) {
-      if(errno != EAGAIN)
-        mtevL(nlerr, "statsd: recvfrom() -> %s\n", strerror(errno));
+  while(packets_per_cycle > 0) {
+    noit_udp_packet_t *pkts;
+    int i, npkts;
+    npkts = noit_udp_receiver_recv(rx, eventer_get_fd(e), &pkts);
+    if(npkts <= 0) {
+      if(npkts < 0)
+        mtevL(nlerr, "statsd: recv -> %s\n", strerror(errno));
       break;
     }
-    switch(addr.in.sin_family) {
-      case AF_INET:
-        addrlen = sizeof(struct sockaddr_in);
-        inet_ntop(AF_INET, &((struct sockaddr_in *)&addr)->sin_addr, ip, addrlen);
-        break;
-      case AF_INET6:
-        addrlen = sizeof(struct sockaddr_in6);
-        inet_ntop(AF_INET6, &((struct sockaddr_in6 *)&addr)->sin6_addr, ip, addrlen);
-        break;
-      default:
-        ip[0] = '\0';
+    for(i=0; i<npkts; i++) {
+      noit_check_t *checks[MAX_CHECKS];
+      int nchecks = MIN(pkts[i].nchecks, MAX_CHECKS-1);
+      if(nchecks) memcpy(checks, pkts[i].checks, nchecks * sizeof(*checks));
+      mtevL(nldeb, "statsd(%d bytes) from '%s' -> %d checks%s\n",
+            pkts[i].len, pkts[i].ip, nchecks, parent ? " + a parent" : "");
+      if(parent) checks[nchecks++] = parent;
+      if(nchecks)
+        statsd_handle_payload(checks, nchecks, pkts[i].payload, pkts[i].len);
     }
-    conf->payload[len] = '\0';
-    nchecks = 0;
-    if(*ip)
-      nchecks = noit_poller_lookup_by_ip_module(ip, self->hdr.name,
-                                                checks, MAX_CHECKS-1);
-    mtevL(nldeb, "statsd(%d bytes) from '%s' -> %d checks%s\n", (int)len,
-          ip, (int)nchecks, parent ? " + a parent" : "");
-    if(parent) checks[nchecks++] = parent;
-    if(nchecks)
-      statsd_handle_payload(checks, nchecks, conf->payload, len);
+    packets_per_cycle -= npkts;
   }
   return EVENTER_READ | EVENTER_EXCEPTION;
 }
@@ -314,14 +523,20 @@ static int noit_statsd_initiate_check(noit_module_t *self,
                                         int once, noit_check_t *cause) {
   check->flags |= NP_PASSIVE_COLLECTION;
   if (check->closure == NULL) {
-    statsd_closure_t *ccl;
-    ccl = check->closure = (void *)calloc(1, sizeof(statsd_closure_t));
-    ccl->self = self;
+    check->closure = statsd_closure_alloc(self);
   }
   INITIATE_CHECK(statsd_submit, self, check, cause);
   return 0;
 }
 
+static void noit_statsd_cleanup(noit_module_t *self, noit_check_t *check) {
+  statsd_closure_t *ccl = check->closure;
+  if(!ccl) return;
+  /* the closure itself is freed by the check */
+  mtev_hash_destroy(&ccl->keys, NULL, statsd_key_free);
+  pthread_mutex_destroy(&ccl->lock);
+}
+
 static int noit_statsd_config(noit_module_t *self, mtev_hash_table *options) {
   statsd_mod_config_t *conf;
   conf = noit_module_get_userdata(self);
@@ -349,9 +564,10 @@ static int noit_statsd_onload(mtev_image_t *self) {
 static int noit_statsd_init(noit_module_t *self) {
   unsigned short port = 8125;
   int packets_per_cycle = 100;
-  int payload_len = 256*1024;
+  int payload_len = 65536; /* the largest possible UDP datagram */
+  int listeners = 1, batch_size = 32;
   struct sockaddr_in skaddr;
-  int sockaddr_len;
+  struct sockaddr_in6 skaddr6;
   const char *config_val;
   statsd_mod_config_t *conf;
   conf = noit_module_get_userdata(self);
@@ -378,83 +594,37 @@ static int noit_statsd_init(noit_module_t *self) {
   }
   conf->packets_per_cycle = packets_per_cycle;
 
-  conf->payload_len = payload_len;
-  conf->payload = malloc(conf->payload_len);
-  if(!conf->payload) {
-    mtevL(noit_error, "statsd malloc() failed\n");
-    return -1;
-  }
-
-  conf->ipv4_fd = socket(PF_INET, NE_SOCK_CLOEXEC|SOCK_DGRAM, IPPROTO_UDP);
-  if(conf->ipv4_fd < 0) {
-    mtevL(noit_error, "statsd: socket failed: %s\n", strerror(errno));
-    return -1;
+  if(mtev_hash_retr_str(conf->options, "listeners", strlen("listeners"),
+                        (const char **)&config_val)) {
+    listeners = atoi(config_val);
   }
-  else {
-    if(eventer_set_fd_nonblocking(conf->ipv4_fd)) {
-      close(conf->ipv4_fd);
-      conf->ipv4_fd = -1;
-      mtevL(noit_error,
-            "collectd: could not set socket non-blocking: %s\n",
-            strerror(errno));
-      return -1;
-    }
+  if(mtev_hash_retr_str(conf->options, "batch_size", strlen("batch_size"),
+                        (const char **)&config_val)) {
+    batch_size = atoi(config_val);
   }
+
   memset(&skaddr, 0, sizeof(skaddr));
   skaddr.sin_family = AF_INET;
   skaddr.sin_addr.s_addr = htonl(INADDR_ANY);
   skaddr.sin_port = htons(conf->port);
-  sockaddr_len = sizeof(skaddr);
-  if(bind(conf->ipv4_fd, (struct sockaddr *)&skaddr, sockaddr_len) < 0) {
-    mtevL(noit_error, "bind failed[%d]: %s\n", conf->port, strerror(errno));
-    close(conf->ipv4_fd);
+  if(noit_udp_listen("statsd/ipv4", self->hdr.name,
+                     (struct sockaddr *)&skaddr, sizeof(skaddr),
+                     listeners, batch_size, payload_len,
+                     statsd_handler, self) == 0) {
+    mtevL(noit_error, "statsd: could not listen on port %d\n", conf->port);
     return -1;
   }
 
-  if(conf->ipv4_fd >= 0) {
-    eventer_t newe;
-    newe = eventer_alloc_fd(statsd_handler, self, conf->ipv4_fd,
-                            EVENTER_READ | EVENTER_EXCEPTION);
-    eventer_add(newe);
-  }
-
-  conf->ipv6_fd = socket(AF_INET6, NE_SOCK_CLOEXEC|SOCK_DGRAM, IPPROTO_UDP);
-  if(conf->ipv6_fd < 0) {
-    mtevL(noit_error, "statsd: IPv6 socket failed: %s\n",
-          strerror(errno));
-  }
-  else {
-    if(eventer_set_fd_nonblocking(conf->ipv6_fd)) {
-      close(conf->ipv6_fd);
-      conf->ipv6_fd = -1;
-      mtevL(noit_error,
-            "statsd: could not set socket non-blocking: %s\n",
-            strerror(errno));
-    }
-    else {
-      struct sockaddr_in6 skaddr6;
-      struct in6_addr in6addr_any;
-      sockaddr_len = sizeof(skaddr6);
-      memset(&skaddr6, 0, sizeof(skaddr6));
-      skaddr6.sin6_family = AF_INET6;
-      memset(&in6addr_any, 0, sizeof(in6addr_any));
-      skaddr6.sin6_addr = in6addr_any;
-      skaddr6.sin6_port = htons(conf->port);
-
-      if(bind(conf->ipv6_fd, (struct sockaddr *)&skaddr6, sockaddr_len) < 0) {
-        mtevL(noit_error, "bind(IPv6) failed[%d]: %s\n",
-              conf->port, strerror(errno));
-        close(conf->ipv6_fd);
-        conf->ipv6_fd = -1;
-      }
-    }
-  }
-
-  if(conf->ipv6_fd >= 0) {
-    eventer_t newe;
-    newe = eventer_alloc_fd(statsd_handler, self, conf->ipv6_fd,
-                            EVENTER_READ | EVENTER_EXCEPTION);
-    eventer_add(newe);
+  memset(&skaddr6, 0, sizeof(skaddr6));
+  skaddr6.sin6_family = AF_INET6;
+  skaddr6.sin6_addr = in6addr_any;
+  skaddr6.sin6_port = htons(conf->port);
+  if(noit_udp_listen("statsd/ipv6", self->hdr.name,
+                     (struct sockaddr *)&skaddr6, sizeof(skaddr6),
+                     listeners, batch_size, payload_len,
+                     statsd_handler, self) == 0) {
+    mtevL(noit_error, "statsd: could not listen on IPv6 port %d\n",
+          conf->port);
   }
 
   noit_module_set_userdata(self, conf);
@@ -474,5 +644,5 @@ noit_module_t statsd = {
   noit_statsd_config,
   noit_statsd_init,
   noit_statsd_initiate_check,
-  NULL
+  noit_statsd_cleanup
 };
@@ -32,43 +32,714 @@
  * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 
+/* noit_b2sm: convert bundled records (B1, B2 and BF) into S/M lines,
+ * JSON or flatbuffer bundles.  Input is mmap'd files, jlog directories or
+ * stdin; lines are decoded in parallel in chunks and written out in input
+ * order to stdout, a jlog or fq, optionally at a fixed rate for replay.
+ */
+
+#include "noit_config.h"
+
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <strings.h>
 #include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <jlog.h>
+#ifdef HAVE_LIBFQ
+#include <fq.h>
+#endif
+
+#include "noit_metric.h"
+#include "noit_message_decoder.h"
 #include "noit_check_log_helpers.h"
+#include "noit_fb.h"
+
+#define CHUNK_SIZE (1024*1024)
+#define MAX_LINE (1024*1024*16)
+
+typedef enum {
+  OUT_SM,
+  OUT_JSON,
+  OUT_BF,
+  OUT_BF_BATCH
+} out_format_t;
+
+struct outbuf {
+  char *buf;
+  size_t len, allocd;
+  uint64_t records;
+};
+
+typedef enum {
+  CHUNK_EMPTY,
+  CHUNK_READY,
+  CHUNK_DONE
+} chunk_state_t;
+
+/* A run of whole input lines.  The data either points into an mmap'd
+ * file or is owned by the chunk (stdin and jlog input). */
+struct chunk {
+  chunk_state_t state;
+  const char *data;
+  size_t len;
+  char *owned;
+  struct outbuf out;
+};
+
+static out_format_t format = OUT_SM;
+static int nthreads = 0;
+static int verbose = 0;
+static double rate = 0;          /* output records per second */
+static const char *jlog_out = NULL;
+static const char *subscriber = NULL;
+#ifdef HAVE_LIBFQ
+static const char *fq_host = NULL;
+static const char *fq_exchange = "noit.firehose";
+static const char *fq_route = "check";
+static fq_client fq;
+#endif
+
+static struct chunk *ring;
+static int ring_size;
+static uint64_t next_fill, next_work, next_write;
+static int input_done;
+static pthread_mutex_t ring_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t ring_space = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t ring_work = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t ring_done = PTHREAD_COND_INITIALIZER;
+
+static uint64_t lines_in, records_out;
 
 static void usage(const char *prog) {
-  fprintf(stderr, "%s\n", prog);
-  fprintf(stderr, "This tool takes B{1,2} records from stdin and emits S/M records to stdout\n");
+  fprintf(stderr, "%s [-v] [-t threads] [-f sm|json|bf|bfbatch] [-r rate] [-o jlog]"
+#ifdef HAVE_LIBFQ
+                  " [-q host[:port]] [-x exchange] [-k route]"
+#endif
+                  "\n\t[-s subscriber] [file|jlog|- ...]\n", prog);
+  fprintf(stderr, "This tool takes B{1,2,F} records and emits S/M records, JSON or BF records\n");
+  fprintf(stderr, "\t-v        print a throughput summary to stderr when done\n");
+  fprintf(stderr, "\t-t count  decoding threads (default: one per CPU)\n");
+  fprintf(stderr, "\t-f fmt    sm (default), json, bf (MetricColumns) or bfbatch (MetricBatch)\n");
+  fprintf(stderr, "\t-r rate   output records per second (default: unlimited)\n");
+  fprintf(stderr, "\t-o jlog   write records to this jlog instead of stdout\n");
+#ifdef HAVE_LIBFQ
+  fprintf(stderr, "\t-q host   publish records to fq (port 8765 unless given)\n");
+  fprintf(stderr, "\t-x name   fq exchange (default: noit.firehose)\n");
+  fprintf(stderr, "\t-k route  fq routing key (default: check)\n");
+#endif
+  fprintf(stderr, "\t-s name   read jlogs as this subscriber and advance it (default: read\n"
+                  "\t          everything through a temporary subscriber)\n");
+  fprintf(stderr, "Inputs are files, jlog directories or - for stdin (the default).\n");
 }
-char buff[1024*1024*16];
-int main(int argc, char **argv) {
-  if(argc > 1) {
-    usage(argv[0]);
-    return 2;
-  }
-  while(fgets(buff, sizeof(buff), stdin) != NULL) {
-    char **lines = NULL;
-    int i;
-    char *dp = buff, *sp = buff;
-    while(*sp) {
-      if(*sp == ' ' || *sp == '\t') {
-        if(dp > buff && dp[-1] == '\t') {
-          sp++; continue;
-        }
-        *dp = '\t';
+
+static double now_sec() {
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+static void outbuf_append(struct outbuf *o, const char *str, size_t len) {
+  if(o->len + len + 1 > o->allocd) {
+    while(o->len + len + 1 > o->allocd)
+      o->allocd = o->allocd ? o->allocd * 2 : 65536;
+    o->buf = realloc(o->buf, o->allocd);
+  }
+  memcpy(o->buf + o->len, str, len);
+  o->len += len;
+  o->buf[o->len++] = '\n';
+  o->records++;
+}
+
+/* Chunks are handed out in order and retired in order, so the ring
+ * slot for a sequence number is always seq % ring_size. */
+static void submit_chunk(const char *data, size_t len, char *owned) {
+  struct chunk *c;
+  pthread_mutex_lock(&ring_lock);
+  while(next_fill - next_write >= ring_size)
+    pthread_cond_wait(&ring_space, &ring_lock);
+  c = &ring[next_fill % ring_size];
+  c->data = data;
+  c->len = len;
+  c->owned = owned;
+  c->out.len = 0;
+  c->out.records = 0;
+  c->state = CHUNK_READY;
+  next_fill++;
+  pthread_cond_signal(&ring_work);
+  pthread_mutex_unlock(&ring_lock);
+}
+
+static void finish_input() {
+  pthread_mutex_lock(&ring_lock);
+  input_done = 1;
+  pthread_cond_broadcast(&ring_work);
+  pthread_cond_broadcast(&ring_done);
+  pthread_mutex_unlock(&ring_lock);
+}
+
+struct worker {
+  pthread_t tid;
+  char *line;
+  size_t line_allocd;
+  uint64_t lines;
+};
+
+static void emit_json(struct outbuf *out, const char *line) {
+  noit_metric_message_t msg;
+  char *json = NULL;
+  size_t jlen;
+
+  memset(&msg, 0, sizeof(msg));
+  msg.type = line[0];
+  if(noit_message_decoder_parse_line(line, strlen(line), &msg.id.id,
+                                     &msg.id.name, &msg.id.name_len,
+                                     &msg.noit.name, &msg.noit.name_len,
+                                     &msg.value, -1) != 1) return;
+  noit_metric_to_json(&msg, &json, &jlen, mtev_false);
+  if(json) outbuf_append(out, json, jlen);
+  free(json);
+  if(msg.type == MESSAGE_TYPE_M && msg.value.type == METRIC_STRING)
+    free(msg.value.value.v_string);
+}
+
+static void emit_bf_finish(struct outbuf *out, void *B) {
+  size_t size;
+  void *buffer;
+  char *b64, head[32];
+  unsigned int b64len;
+  int hlen;
+
+  if(format == OUT_BF) buffer = noit_fb_finalize_metriccolumns(B, &size);
+  else buffer = noit_fb_finalize_metricbatch(B, &size);
+  if(noit_check_log_bundle_compress_b64(NOIT_COMPRESS_LZ4, buffer, size,
+                                        &b64, &b64len) == 0) {
+    hlen = snprintf(head, sizeof(head), "BF\t%d\t", (int)size);
+    /* append the header and payload as one record */
+    outbuf_append(out, head, hlen);
+    out->len--;
+    out->records--;
+    outbuf_append(out, b64, b64len);
+    free(b64);
+  }
+  free(buffer);
+}
+
+/* Re-encode the M lines of one decoded bundle as a BF record; S lines
+ * are passed through as flatbuffers carry no status. */
+static void emit_bf(struct worker *w, struct outbuf *out, char **lines, int nm) {
+  void *B = NULL;
+  const char *cur_id = NULL;
+  size_t cur_id_len = 0;
+  uint64_t cur_whence = 0;
+  int i;
+
+  for(i=0; i<nm; i++) {
+    const char *line = lines[i], *name, *noit_name, *id, *cp;
+    int name_len, noit_name_len;
+    size_t id_len;
+    uuid_t uuid;
+    noit_metric_value_t v;
+    metric_t m;
+    char *mname;
+
+    if(line[0] != 'M') {
+      outbuf_append(out, line, strlen(line));
+      continue;
+    }
+    memset(&v, 0, sizeof(v));
+    if(noit_message_decoder_parse_line(line, strlen(line), &uuid, &name,
+                                       &name_len, &noit_name, &noit_name_len,
+                                       &v, -1) != 1) continue;
+    /* the field before the name is [target`module`name`]uuid */
+    for(id = name - 1; id > line && id[-1] != '\t'; id--);
+    id_len = (name - 1) - id;
+    if(id_len < UUID_STR_LEN) continue;
+    if(!B || id_len != cur_id_len || memcmp(id, cur_id, id_len) ||
+       v.whence_ms != cur_whence) {
+      char check_name[256*3], uuid_str[UUID_STR_LEN + 1];
+      size_t cn_len = id_len - UUID_STR_LEN;
+      int account_id = 0;
+
+      if(B) emit_bf_finish(out, B);
+      if(cn_len >= sizeof(check_name)) cn_len = sizeof(check_name) - 1;
+      memcpy(check_name, id, cn_len);
+      check_name[cn_len] = '\0';
+      memcpy(uuid_str, id + id_len - UUID_STR_LEN, UUID_STR_LEN);
+      uuid_str[UUID_STR_LEN] = '\0';
+      /* as in noit_check_log: a `c_<id> module prefix names the account */
+      if((cp = strstr(check_name, "`c_")) != NULL) account_id = atoi(cp + 3);
+      if(format == OUT_BF)
+        B = noit_fb_start_metriccolumns(v.whence_ms, uuid_str, check_name, account_id);
+      else
+        B = noit_fb_start_metricbatch(v.whence_ms, uuid_str, check_name, account_id);
+      cur_id = id;
+      cur_id_len = id_len;
+      cur_whence = v.whence_ms;
+    }
+
+    if(name_len + 1 > w->line_allocd) {
+      w->line_allocd = name_len + 1;
+      w->line = realloc(w->line, w->line_allocd);
+    }
+    mname = w->line;
+    memcpy(mname, name, name_len);
+    mname[name_len] = '\0';
+    memset(&m, 0, sizeof(m));
+    m.metric_name = mname;
+    m.metric_type = v.type;
+    if(!v.is_null) {
+      switch(v.type) {
+        case METRIC_INT32: m.metric_value.i = &v.value.v_int32; break;
+        case METRIC_UINT32: m.metric_value.I = &v.value.v_uint32; break;
+        case METRIC_INT64: m.metric_value.l = &v.value.v_int64; break;
+        case METRIC_UINT64: m.metric_value.L = &v.value.v_uint64; break;
+        case METRIC_DOUBLE: m.metric_value.n = &v.value.v_double; break;
+        case METRIC_STRING: m.metric_value.s = v.value.v_string; break;
+        default: break;
       }
-      else *dp = *sp;
-      sp++; dp++;
     }
-    *dp = '\0';
-    int nm = noit_check_log_b_to_sm(buff, strlen(buff), &lines, -1);
-    for(i=0; i<nm; i++) {
-      /* zip through the line and change spaces to tabs. */
-      printf("%s\n", lines[i]);
-      free(lines[i]);
+    if(format == OUT_BF) noit_fb_add_metric_to_metriccolumns(B, &m);
+    else noit_fb_add_metric_to_metricbatch(B, &m);
+    if(v.type == METRIC_STRING && !v.is_null) free(v.value.v_string);
+  }
+  if(B) emit_bf_finish(out, B);
+}
+
+static void convert_line(struct worker *w, const char *line, size_t len,
+                         struct outbuf *out) {
+  char **lines = NULL, *dp;
+  const char *sp, *end = line + len;
+  int i, nm;
+
+  /* zip through the line and collapse runs of spaces and tabs to a tab */
+  if(len + 1 > w->line_allocd) {
+    w->line_allocd = len + 1;
+    w->line = realloc(w->line, w->line_allocd);
+  }
+  dp = w->line;
+  for(sp = line; sp < end; sp++) {
+    if(*sp == ' ' || *sp == '\t') {
+      if(dp > w->line && dp[-1] == '\t') continue;
+      *dp++ = '\t';
     }
+    else *dp++ = *sp;
+  }
+  *dp = '\0';
+  w->lines++;
+
+  /* S and M lines are already in the output form */
+  if((w->line[0] == 'S' || w->line[0] == 'M') && w->line[1] == '\t') {
+    lines = &w->line;
+    nm = 1;
+  }
+  else {
+    nm = noit_check_log_b_to_sm(w->line, dp - w->line, &lines, -1);
+  }
+  if(nm <= 0) return;
+
+  switch(format) {
+    case OUT_SM:
+      for(i=0; i<nm; i++) outbuf_append(out, lines[i], strlen(lines[i]));
+      break;
+    case OUT_JSON:
+      for(i=0; i<nm; i++) emit_json(out, lines[i]);
+      break;
+    case OUT_BF:
+    case OUT_BF_BATCH:
+      if(lines == &w->line) {
+        /* emit_bf reuses the line buffer for names */
+        char *copy = strdup(w->line);
+        emit_bf(w, out, &copy, 1);
+        free(copy);
+      }
+      else emit_bf(w, out, lines, nm);
+      break;
+  }
+  if(lines != &w->line) {
+    for(i=0; i<nm; i++) free(lines[i]);
     free(lines);
   }
 }
+
+static void *worker_main(void *vw) {
+  struct worker *w = vw;
+  while(1) {
+    struct chunk *c;
+    const char *sp, *end, *nl;
+
+    pthread_mutex_lock(&ring_lock);
+    while(next_work == next_fill && !input_done)
+      pthread_cond_wait(&ring_work, &ring_lock);
+    if(next_work == next_fill) {
+      pthread_mutex_unlock(&ring_lock);
+      break;
+    }
+    c = &ring[next_work % ring_size];
+    next_work++;
+    pthread_mutex_unlock(&ring_lock);
+
+    end = c->data + c->len;
+    for(sp = c->data; sp < end; sp = nl + 1) {
+      size_t len;
+      nl = memchr(sp, '\n', end - sp);
+      if(!nl) nl = end;
+      len = nl - sp;
+      while(len > 0 && sp[len-1] == '\r') len--;
+      if(len > 0) convert_line(w, sp, len, &c->out);
+    }
+
+    pthread_mutex_lock(&ring_lock);
+    c->state = CHUNK_DONE;
+    pthread_cond_broadcast(&ring_done);
+    pthread_mutex_unlock(&ring_lock);
+  }
+  return NULL;
+}
+
+static jlog_ctx *out_jlog;
+
+#ifdef HAVE_LIBFQ
+static void fq_logger(fq_client c, const char *s) {
+  fprintf(stderr, "fq: %s\n", s);
+}
+#endif
+
+static void write_record(const char *rec, size_t len) {
+  if(out_jlog) {
+    if(jlog_ctx_write(out_jlog, rec, len) != 0)
+      fprintf(stderr, "jlog write: %s\n", jlog_ctx_err_string(out_jlog));
+  }
+#ifdef HAVE_LIBFQ
+  else if(fq_host) {
+    fq_msg *msg = fq_msg_alloc(rec, len);
+    fq_msg_exchange(msg, fq_exchange, strlen(fq_exchange));
+    fq_msg_route(msg, fq_route, strlen(fq_route));
+    fq_msg_id(msg, NULL);
+    fq_client_publish(fq, msg);
+    fq_msg_deref(msg);
+  }
+#endif
+  else {
+    fwrite(rec, 1, len, stdout);
+    fputc('\n', stdout);
+  }
+}
+
+static void *writer_main(void *unused) {
+  double start = now_sec();
+  while(1) {
+    struct chunk *c;
+    const char *sp, *end, *nl;
+
+    pthread_mutex_lock(&ring_lock);
+    while(next_write == next_fill ||
+          ring[next_write % ring_size].state != CHUNK_DONE) {
+      if(next_write == next_fill && input_done) break;
+      pthread_cond_wait(&ring_done, &ring_lock);
+    }
+    if(next_write == next_fill) {
+      pthread_mutex_unlock(&ring_lock);
+      break;
+    }
+    c = &ring[next_write % ring_size];
+    pthread_mutex_unlock(&ring_lock);
+
+    if(rate <= 0 && !out_jlog
+#ifdef HAVE_LIBFQ
+       && !fq_host
+#endif
+      ) {
+      fwrite(c->out.buf, 1, c->out.len, stdout);
+      records_out += c->out.records;
+    }
+    else {
+      end = c->out.buf + c->out.len;
+      for(sp = c->out.buf; sp < end; sp = nl + 1) {
+        nl = memchr(sp, '\n', end - sp);
+        if(rate > 0) {
+          double due = records_out / rate, elapsed = now_sec() - start;
+          if(due > elapsed) usleep((useconds_t)((due - elapsed) * 1000000));
+        }
+        write_record(sp, nl - sp);
+        records_out++;
+      }
+    }
+
+    free(c->owned);
+    c->owned = NULL;
+    pthread_mutex_lock(&ring_lock);
+    c->state = CHUNK_EMPTY;
+    next_write++;
+    pthread_cond_signal(&ring_space);
+    pthread_mutex_unlock(&ring_lock);
+  }
+  return NULL;
+}
+
+/* Cut a mapped file into chunks of whole lines. */
+static void read_mapped(const char *data, size_t len) {
+  const char *sp = data, *end = data + len;
+  while(sp < end) {
+    const char *cut = sp + CHUNK_SIZE, *nl;
+    if(cut >= end) cut = end;
+    else if((nl = memchr(cut, '\n', end - cut)) != NULL) cut = nl + 1;
+    else cut = end;
+    submit_chunk(sp, cut - sp, NULL);
+    sp = cut;
+  }
+}
+
+static int read_stream(int fd) {
+  char *buf = NULL;
+  size_t len = 0, allocd = 0;
+  ssize_t rv;
+
+  while(1) {
+    char *nl;
+    if(allocd - len < CHUNK_SIZE / 4) {
+      if(allocd >= MAX_LINE + CHUNK_SIZE) {
+        fprintf(stderr, "line exceeds %d bytes\n", MAX_LINE);
+        free(buf);
+        return -1;
+      }
+      allocd = allocd ? allocd * 2 : CHUNK_SIZE;
+      buf = realloc(buf, allocd);
+    }
+    rv = read(fd, buf + len, allocd - len);
+    if(rv < 0 && errno == EINTR) continue;
+    if(rv < 0) {
+      perror("read");
+      free(buf);
+      return -1;
+    }
+    if(rv == 0) break;
+    len += rv;
+    if(len < CHUNK_SIZE) continue;
+    nl = memrchr(buf, '\n', len);
+    if(nl) {
+      /* hand off whole lines, keep the tail for the next chunk */
+      size_t used = nl + 1 - buf, rest = len - used;
+      char *next = malloc(allocd);
+      memcpy(next, nl + 1, rest);
+      submit_chunk(buf, used, buf);
+      buf = next;
+      len = rest;
+    }
+  }
+  if(len) submit_chunk(buf, len, buf);
+  else free(buf);
+  return 0;
+}
+
+static int read_jlog(const char *path) {
+  jlog_ctx *ctx;
+  jlog_id start, finish;
+  char tmpsub[64];
+  const char *sub = subscriber;
+  char *buf = NULL;
+  size_t len = 0, allocd = 0;
+  int cnt, rv = 0;
+
+  if(!sub) {
+    snprintf(tmpsub, sizeof(tmpsub), "noit_b2sm.%d", (int)getpid());
+    sub = tmpsub;
+    ctx = jlog_new(path);
+    if(jlog_ctx_add_subscriber(ctx, sub, JLOG_BEGIN) != 0 &&
+       jlog_ctx_err(ctx) != JLOG_ERR_SUBSCRIBER_EXISTS) {
+      fprintf(stderr, "%s: %s\n", path, jlog_ctx_err_string(ctx));
+      jlog_ctx_close(ctx);
+      return -1;
+    }
+    jlog_ctx_close(ctx);
+  }
+  ctx = jlog_new(path);
+  if(jlog_ctx_open_reader(ctx, sub) != 0) {
+    fprintf(stderr, "%s: %s\n", path, jlog_ctx_err_string(ctx));
+    jlog_ctx_close(ctx);
+    return -1;
+  }
+  while((cnt = jlog_ctx_read_interval(ctx, &start, &finish)) > 0) {
+    while(cnt-- > 0) {
+      jlog_message msg;
+      size_t mlen;
+      if(jlog_ctx_read_message(ctx, &start, &msg) != 0) {
+        fprintf(stderr, "%s: %s\n", path, jlog_ctx_err_string(ctx));
+        rv = -1;
+        break;
+      }
+      mlen = msg.mess_len;
+      while(mlen > 0 && ((char *)msg.mess)[mlen-1] == '\n') mlen--;
+      if(len + mlen + 1 > allocd) {
+        while(len + mlen + 1 > allocd) allocd = allocd ? allocd * 2 : CHUNK_SIZE;
+        buf = realloc(buf, allocd);
+      }
+      memcpy(buf + len, msg.mess, mlen);
+      len += mlen;
+      buf[len++] = '\n';
+      if(len >= CHUNK_SIZE) {
+        submit_chunk(buf, len, buf);
+        buf = NULL;
+        len = allocd = 0;
+      }
+      JLOG_ID_ADVANCE(&start);
+    }
+    if(rv) break;
+    /* with -s the subscriber keeps its place */
+    jlog_ctx_read_checkpoint(ctx, &finish);
+  }
+  if(cnt < 0) {
+    fprintf(stderr, "%s: %s\n", path, jlog_ctx_err_string(ctx));
+    rv = -1;
+  }
+  if(len) submit_chunk(buf, len, buf);
+  else free(buf);
+  if(sub == tmpsub) jlog_ctx_remove_subscriber(ctx, sub);
+  jlog_ctx_close(ctx);
+  return rv;
+}
+
+static int read_input(const char *path) {
+  struct stat sb;
+  int fd;
+  void *map;
+
+  if(!strcmp(path, "-")) return read_stream(0);
+  if(stat(path, &sb) != 0) {
+    perror(path);
+    return -1;
+  }
+  if(S_ISDIR(sb.st_mode)) return read_jlog(path);
+  if((fd = open(path, O_RDONLY)) < 0) {
+    perror(path);
+    return -1;
+  }
+  if(!S_ISREG(sb.st_mode) || sb.st_size == 0) {
+    int rv = read_stream(fd);
+    close(fd);
+    return rv;
+  }
+  map = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if(map == MAP_FAILED) {
+    perror(path);
+    return -1;
+  }
+  madvise(map, sb.st_size, MADV_SEQUENTIAL);
+  /* the mapping stays until exit; chunks point into it */
+  read_mapped(map, sb.st_size);
+  return 0;
+}
+
+int main(int argc, char **argv) {
+  int ch, i, rv = 0;
+  struct worker *workers;
+  pthread_t writer;
+  double start, elapsed;
+
+  while((ch = getopt(argc, argv, "vt:f:r:o:s:q:x:k:h")) != -1) {
+    switch(ch) {
+      case 'v': verbose = 1; break;
+      case 't': nthreads = atoi(optarg); break;
+      case 'f':
+        if(!strcmp(optarg, "sm")) format = OUT_SM;
+        else if(!strcmp(optarg, "json")) format = OUT_JSON;
+        else if(!strcmp(optarg, "bf")) format = OUT_BF;
+        else if(!strcmp(optarg, "bfbatch")) format = OUT_BF_BATCH;
+        else {
+          usage(argv[0]);
+          return 2;
+        }
+        break;
+      case 'r': rate = atof(optarg); break;
+      case 'o': jlog_out = optarg; break;
+      case 's': subscriber = optarg; break;
+#ifdef HAVE_LIBFQ
+      case 'q': fq_host = optarg; break;
+      case 'x': fq_exchange = optarg; break;
+      case 'k': fq_route = optarg; break;
+#endif
+      default: usage(argv[0]); return 2;
+    }
+  }
+  if(nthreads <= 0) nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+  if(nthreads <= 0) nthreads = 1;
+
+  if(jlog_out) {
+    out_jlog = jlog_new(jlog_out);
+    jlog_ctx_init(out_jlog);
+    jlog_ctx_close(out_jlog);
+    out_jlog = jlog_new(jlog_out);
+    if(jlog_ctx_open_writer(out_jlog) != 0) {
+      fprintf(stderr, "%s: %s\n", jlog_out, jlog_ctx_err_string(out_jlog));
+      return 1;
+    }
+  }
+#ifdef HAVE_LIBFQ
+  if(fq_host) {
+    char host[256], *cp;
+    int port = 8765;
+    snprintf(host, sizeof(host), "%s", fq_host);
+    if((cp = strchr(host, ':')) != NULL) {
+      *cp++ = '\0';
+      port = atoi(cp);
+    }
+    fq_client_init(&fq, 0, fq_logger);
+    fq_client_creds(fq, host, port, "guest", "guest");
+    fq_client_heartbeat(fq, 2000);
+    fq_client_set_backlog(fq, 10000, 100);
+    fq_client_connect(fq);
+  }
+#endif
+
+  ring_size = nthreads * 4;
+  ring = calloc(ring_size, sizeof(*ring));
+  workers = calloc(nthreads, sizeof(*workers));
+  start = now_sec();
+  for(i=0; i<nthreads; i++)
+    pthread_create(&workers[i].tid, NULL, worker_main, &workers[i]);
+  pthread_create(&writer, NULL, writer_main, NULL);
+
+  if(optind == argc) rv = read_input("-");
+  for(i=optind; i<argc; i++)
+    if(read_input(argv[i]) != 0) rv = 1;
+  finish_input();
+
+  for(i=0; i<nthreads; i++) {
+    pthread_join(workers[i].tid, NULL);
+    lines_in += workers[i].lines;
+    free(workers[i].line);
+  }
+  pthread_join(writer, NULL);
+  fflush(stdout);
+  if(out_jlog) jlog_ctx_close(out_jlog);
+#ifdef HAVE_LIBFQ
+  if(fq_host) {
+    while(fq_client_data_backlog(fq) > 0) usleep(1000);
+  }
+#endif
+  for(i=0; i<ring_size; i++) free(ring[i].out.buf);
+  free(ring);
+  free(workers);
+
+  elapsed = now_sec() - start;
+  /* stdout carries the records, so only say how it went when asked or
+   * when they went elsewhere */
+  if(verbose || jlog_out || rate > 0
+#ifdef HAVE_LIBFQ
+     || fq_host
+#endif
+    )
+    fprintf(stderr, "%llu lines in, %llu records out in %.3fs with %d threads: "
+            "%.0f records/s\n",
+            (unsigned long long)lines_in, (unsigned long long)records_out,
+            elapsed, nthreads, elapsed > 0 ? records_out / elapsed : 0);
+  return rv;
+}
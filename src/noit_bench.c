@@ -0,0 +1,703 @@
+/*
+ * Copyright (c) 2017, Circonus, Inc. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above
+ *       copyright notice, this list of conditions and the following
+ *       disclaimer in the documentation and/or other materials provided
+ *       with the distribution.
+ *     * Neither the name Circonus, Inc. nor the names
+ *       of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written
+ *       permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* noit_bench: microbenchmarks of the noit and stratcon hot paths, linked
+ * against the same objects as noitd.  It boots as a (foreground) noit
+ * from test/bench/noit_bench.conf, runs the selected cases over recorded
+ * traffic from test/bench/feed.txt and reports ns/op, allocations/op and
+ * ops/s.  Results can be written as a baseline (-w) and later runs
+ * compared against it (-b), failing on regressions.
+ *
+ * With -M it instead boots from a config that loads modules and starts
+ * listeners (noit_bench_modules.conf, made from the .in by "make bench"),
+ * runs the eventer and runs only the module cases, which drive those
+ * modules over loopback sockets.
+ */
+
+#define _GNU_SOURCE
+#include <dlfcn.h>
+#undef _GNU_SOURCE
+
+#include "noit_config.h"
+#include <mtev_defines.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fnmatch.h>
+#include <math.h>
+#include <limits.h>
+#include <pthread.h>
+
+#include <mtev_main.h>
+#include <mtev_memory.h>
+#include <mtev_atomic.h>
+#include <mtev_hash.h>
+#include <mtev_log.h>
+#include <mtev_uuid.h>
+#include <mtev_conf.h>
+#include <mtev_console.h>
+#include <mtev_dso.h>
+#include <mtev_rest.h>
+#include <mtev_listener.h>
+#include <eventer/eventer.h>
+
+#include "noit_mtev_bridge.h"
+#include "noit_check.h"
+#include "noit_check_tools_shared.h"
+#include "noit_conf_checks.h"
+#include "noit_filters.h"
+#include "noit_jlog_listener.h"
+#include "noit_metric_director.h"
+#include "noit_module.h"
+#include "noit_bench.h"
+
+#define APPNAME "noit"
+#define MAX_REPS 32
+#define MAX_PATTERNS 64
+
+static const char *fixture_dir = NULL;
+static char *config_file = NULL;
+static const char *baseline_in = NULL;
+static const char *baseline_out = NULL;
+static const char *patterns[MAX_PATTERNS];
+static int npatterns = 0;
+static double rep_seconds = 0.25;
+static int reps = 5;
+static double tolerance = 25.0;  /* percent slower than baseline allowed */
+static int list_only = 0;
+static int debug = 0;
+static int module_cases = 0;
+
+static const noit_bench_case_t *case_tables[5];
+static int ncase_tables = 0;
+
+/* Allocation counting: interpose the allocator and count calls.  dlsym
+ * may allocate while we resolve the real functions, so those early
+ * requests are served from a small static arena that is never freed.
+ */
+#ifdef RTLD_NEXT
+static void *(*real_malloc)(size_t);
+static void *(*real_calloc)(size_t, size_t);
+static void *(*real_realloc)(void *, size_t);
+static int (*real_posix_memalign)(void **, size_t, size_t);
+static void (*real_free)(void *);
+static mtev_atomic64_t alloc_count = 0;
+static char bootstrap[8192] __attribute__((aligned(16)));
+static size_t bootstrap_used = 0;
+static int resolving = 0;
+
+#define IN_BOOTSTRAP(p) ((char *)(p) >= bootstrap && \
+                         (char *)(p) < bootstrap + sizeof(bootstrap))
+
+static void *
+bootstrap_alloc(size_t size) {
+  void *p;
+  size = (size + 15) & ~(size_t)15;
+  if(bootstrap_used + size > sizeof(bootstrap)) return NULL;
+  p = bootstrap + bootstrap_used;
+  bootstrap_used += size;
+  return p;
+}
+
+static void
+resolve_allocator(void) {
+  resolving = 1;
+  real_malloc = dlsym(RTLD_NEXT, "malloc");
+  real_calloc = dlsym(RTLD_NEXT, "calloc");
+  real_realloc = dlsym(RTLD_NEXT, "realloc");
+  real_posix_memalign = dlsym(RTLD_NEXT, "posix_memalign");
+  real_free = dlsym(RTLD_NEXT, "free");
+  resolving = 0;
+}
+
+void *
+malloc(size_t size) {
+  if(!real_malloc) {
+    if(resolving) return bootstrap_alloc(size);
+    resolve_allocator();
+  }
+  mtev_atomic_inc64(&alloc_count);
+  return real_malloc(size);
+}
+
+void *
+calloc(size_t nmemb, size_t size) {
+  if(!real_calloc) {
+    if(resolving) return bootstrap_alloc(nmemb * size);
+    resolve_allocator();
+  }
+  mtev_atomic_inc64(&alloc_count);
+  return real_calloc(nmemb, size);
+}
+
+void *
+realloc(void *ptr, size_t size) {
+  if(IN_BOOTSTRAP(ptr)) {
+    void *n = malloc(size);
+    size_t avail = bootstrap + sizeof(bootstrap) - (char *)ptr;
+    if(n) memcpy(n, ptr, size < avail ? size : avail);
+    return n;
+  }
+  if(!real_realloc) resolve_allocator();
+  mtev_atomic_inc64(&alloc_count);
+  return real_realloc(ptr, size);
+}
+
+int
+posix_memalign(void **memptr, size_t alignment, size_t size) {
+  if(!real_posix_memalign) resolve_allocator();
+  mtev_atomic_inc64(&alloc_count);
+  return real_posix_memalign(memptr, alignment, size);
+}
+
+void
+free(void *ptr) {
+  if(!ptr || IN_BOOTSTRAP(ptr)) return;
+  if(!real_free) resolve_allocator();
+  real_free(ptr);
+}
+
+uint64_t
+noit_bench_allocs(void) {
+  return alloc_count;
+}
+#else
+uint64_t
+noit_bench_allocs(void) {
+  return 0;
+}
+#endif
+
+void
+noit_bench_fail(noit_bench_t *b, const char *fmt, ...) {
+  va_list arg;
+  va_start(arg, fmt);
+  vsnprintf(b->error, sizeof(b->error), fmt, arg);
+  va_end(arg);
+}
+
+const char *
+noit_bench_fixture_path(const char *file) {
+  static char path[PATH_MAX];
+  snprintf(path, sizeof(path), "%s/%s", fixture_dir, file);
+  return path;
+}
+
+/* Fixture parsing */
+
+static noit_bench_feed_t *feed = NULL;
+
+static int
+split_tabs(char *line, char **fields, int max) {
+  int n = 0;
+  fields[n++] = line;
+  while(n < max && (line = strchr(line, '\t')) != NULL) {
+    *line++ = '\0';
+    fields[n++] = line;
+  }
+  return n;
+}
+
+static noit_bench_check_t *
+feed_check(mtev_hash_table *index, char *extended_id) {
+  noit_bench_check_t *c;
+  char *parts[4], *cp = extended_id;
+  void *vidx;
+  int i;
+
+  for(i=0; i<4; i++) {
+    parts[i] = cp;
+    if(i < 3) {
+      if((cp = strchr(cp, '`')) == NULL) return NULL;
+      *cp++ = '\0';
+    }
+  }
+  if(mtev_hash_retrieve(index, parts[3], strlen(parts[3]), &vidx))
+    return &feed->checks[(intptr_t)vidx];
+
+  feed->checks = realloc(feed->checks,
+                         (feed->nchecks + 1) * sizeof(*feed->checks));
+  c = &feed->checks[feed->nchecks];
+  memset(c, 0, sizeof(*c));
+  if(uuid_parse(parts[3], c->id)) return NULL;
+  c->target = strdup(parts[0]);
+  c->module = strdup(parts[1]);
+  c->name = strdup(parts[2]);
+  mtev_hash_store(index, strdup(parts[3]), strlen(parts[3]),
+                  (void *)(intptr_t)feed->nchecks);
+  feed->nchecks++;
+  return c;
+}
+
+static noit_bench_sample_t *
+feed_sample(noit_bench_check_t *c, const char *when, mtev_boolean fresh) {
+  noit_bench_sample_t *s;
+  struct timeval tv;
+  char *dp;
+
+  tv.tv_sec = strtoul(when, &dp, 10);
+  tv.tv_usec = (*dp == '.') ? atoi(dp + 1) * 1000 : 0;
+  if(!fresh && c->nsamples > 0) {
+    s = &c->samples[c->nsamples - 1];
+    if(s->whence.tv_sec == tv.tv_sec && s->whence.tv_usec == tv.tv_usec)
+      return s;
+  }
+  c->samples = realloc(c->samples, (c->nsamples + 1) * sizeof(*c->samples));
+  s = &c->samples[c->nsamples++];
+  memset(s, 0, sizeof(*s));
+  s->whence = tv;
+  s->state = NP_UNKNOWN;
+  s->available = NP_UNKNOWN;
+  return s;
+}
+
+static int
+feed_load(const char *path) {
+  FILE *fp;
+  char *line = NULL;
+  size_t allocd = 0;
+  ssize_t len;
+  mtev_hash_table index;
+  int rv = 0;
+
+  if((fp = fopen(path, "r")) == NULL) {
+    fprintf(stderr, "%s: %s\n", path, strerror(errno));
+    return -1;
+  }
+  feed = calloc(1, sizeof(*feed));
+  mtev_hash_init(&index);
+  while((len = getline(&line, &allocd, fp)) > 0) {
+    char *copy, *f[7];
+    int nf;
+    noit_bench_check_t *c;
+    noit_bench_sample_t *s;
+
+    while(len > 0 && (line[len-1] == '\n' || line[len-1] == '\r'))
+      line[--len] = '\0';
+    if(len == 0) continue;
+    feed->lines = realloc(feed->lines, (feed->nlines + 1) * sizeof(char *));
+    feed->lens = realloc(feed->lens, (feed->nlines + 1) * sizeof(int));
+    feed->lines[feed->nlines] = strdup(line);
+    feed->lens[feed->nlines] = len;
+    feed->nlines++;
+
+    copy = strdup(line);
+    nf = split_tabs(copy, f, 7);
+    if(nf >= 7 && line[0] == 'S' && (c = feed_check(&index, f[2])) != NULL) {
+      s = feed_sample(c, f[1], mtev_true);
+      s->state = (f[3][0] == 'G') ? NP_GOOD : NP_BAD;
+      s->available = (f[4][0] == 'A') ? NP_AVAILABLE : NP_UNAVAILABLE;
+      s->duration = strtoul(f[5], NULL, 10);
+      s->status = strdup(f[6]);
+    }
+    else if(nf >= 6 && line[0] == 'M' && (c = feed_check(&index, f[2])) != NULL) {
+      noit_bench_metric_t *m;
+      s = feed_sample(c, f[1], mtev_false);
+      s->metrics = realloc(s->metrics, (s->nmetrics + 1) * sizeof(*s->metrics));
+      m = &s->metrics[s->nmetrics++];
+      m->name = strdup(f[3]);
+      m->type = (metric_type_t)f[4][0];
+      m->value = strcmp(f[5], "[[null]]") ? strdup(f[5]) : NULL;
+      feed->nmetrics++;
+    }
+    else {
+      fprintf(stderr, "%s: bad fixture line %d\n", path, feed->nlines);
+      rv = -1;
+    }
+    free(copy);
+  }
+  free(line);
+  fclose(fp);
+  mtev_hash_destroy(&index, free, NULL);
+  return rv;
+}
+
+const noit_bench_feed_t *
+noit_bench_feed(void) {
+  return feed;
+}
+
+noit_check_t *
+noit_bench_check(const noit_bench_check_t *c) {
+  noit_check_t *check;
+  uuid_t out;
+  uuid_t id;
+
+  mtev_uuid_copy(id, c->id);
+  if((check = noit_poller_lookup(id)) != NULL) return check;
+  noit_poller_schedule(c->target, c->module, c->name, NULL, NULL, NULL,
+                       60000, 5000, NULL, 0, 0, id, out);
+  return noit_poller_lookup(id);
+}
+
+noit_check_t *
+noit_bench_schedule(const char *target, const char *module, const char *name) {
+  uuid_t in, out;
+  uuid_clear(in);
+  noit_poller_schedule(target, module, name, NULL, NULL, NULL,
+                       60000, 5000, NULL, 0, 0, in, out);
+  return noit_poller_lookup(out);
+}
+
+void
+noit_bench_check_load(noit_check_t *check, const noit_bench_sample_t *s,
+                      mtev_boolean rotate) {
+  struct timeval whence = s->whence;
+  int i;
+
+  noit_stats_set_whence(check, &whence);
+  noit_stats_set_state(check, s->state);
+  noit_stats_set_available(check, s->available);
+  noit_stats_set_duration(check, s->duration);
+  noit_stats_set_status(check, s->status);
+  for(i=0; i<s->nmetrics; i++) {
+    const noit_bench_metric_t *m = &s->metrics[i];
+    if(m->value) noit_stats_set_metric_coerce(check, m->name, m->type, m->value);
+    else noit_stats_set_metric(check, m->name, m->type, NULL);
+  }
+  if(rotate) noit_check_set_stats(check);
+}
+
+/* Running and reporting */
+
+typedef struct {
+  char *name;
+  double ns_per_op;
+  double allocs_per_op;
+} bench_result_t;
+
+static bench_result_t *baseline = NULL;
+static int nbaseline = 0;
+
+static int
+load_baseline(const char *path) {
+  FILE *fp;
+  char line[512];
+
+  if((fp = fopen(path, "r")) == NULL) {
+    fprintf(stderr, "baseline %s: %s\n", path, strerror(errno));
+    return -1;
+  }
+  while(fgets(line, sizeof(line), fp)) {
+    char name[256];
+    double ns, allocs;
+    if(line[0] == '#') continue;
+    if(sscanf(line, "%255s %lf %lf", name, &ns, &allocs) != 3) continue;
+    baseline = realloc(baseline, (nbaseline + 1) * sizeof(*baseline));
+    baseline[nbaseline].name = strdup(name);
+    baseline[nbaseline].ns_per_op = ns;
+    baseline[nbaseline].allocs_per_op = allocs;
+    nbaseline++;
+  }
+  fclose(fp);
+  return 0;
+}
+
+static const bench_result_t *
+find_baseline(const char *name) {
+  int i;
+  for(i=0; i<nbaseline; i++)
+    if(!strcmp(baseline[i].name, name)) return &baseline[i];
+  return NULL;
+}
+
+static int
+dblcmp(const void *a, const void *b) {
+  double x = *(const double *)a, y = *(const double *)b;
+  return (x < y) ? -1 : (x > y) ? 1 : 0;
+}
+
+static mtev_boolean
+case_selected(const char *name) {
+  int i;
+  if(npatterns == 0) return mtev_true;
+  for(i=0; i<npatterns; i++) {
+    if(!strncmp(name, patterns[i], strlen(patterns[i]))) return mtev_true;
+    if(fnmatch(patterns[i], name, 0) == 0) return mtev_true;
+  }
+  return mtev_false;
+}
+
+/* Find an n that takes about rep_seconds, then time reps repetitions
+ * of it.  Returns 0 and fills in the median figures, or -1 on failure.
+ */
+static int
+run_case(const noit_bench_case_t *bc, bench_result_t *r, double *bytes,
+         char *note) {
+  noit_bench_t b;
+  double ns[MAX_REPS], allocs[MAX_REPS];
+  uint64_t n = 1, ops;
+  uint64_t start, elapsed;
+  int i;
+
+  memset(&b, 0, sizeof(b));
+  b.bcase = bc;
+  if(bc->setup && bc->setup(&b) != 0) {
+    printf("%-36s FAILED: %s\n", bc->name, b.error[0] ? b.error : "setup");
+    return -1;
+  }
+
+  while(1) {
+    start = mtev_gethrtime();
+    ops = bc->run(&b, n);
+    elapsed = mtev_gethrtime() - start;
+    if(ops == 0) {
+      noit_bench_fail(&b, "%s", b.error[0] ? b.error : "no operations");
+      goto failed;
+    }
+    if(elapsed >= rep_seconds * 1e9 / 4 || n >= (1ULL << 40)) break;
+    /* aim a little past the target so the next try usually lands */
+    if(elapsed < 1000) n *= 100;
+    else {
+      uint64_t want = (uint64_t)(ops * (rep_seconds * 1e9 / elapsed) * 1.1);
+      n = (want > n * 100) ? n * 100 : (want > n) ? want : n * 2;
+    }
+  }
+  n = (uint64_t)(ops * (rep_seconds * 1e9 / elapsed));
+  if(n == 0) n = 1;
+
+  for(i=0; i<reps; i++) {
+    uint64_t a0 = noit_bench_allocs();
+    start = mtev_gethrtime();
+    ops = bc->run(&b, n);
+    elapsed = mtev_gethrtime() - start;
+    if(ops == 0 || b.error[0]) goto failed;
+    ns[i] = (double)elapsed / ops;
+    allocs[i] = (double)(noit_bench_allocs() - a0) / ops;
+  }
+  qsort(ns, reps, sizeof(*ns), dblcmp);
+  qsort(allocs, reps, sizeof(*allocs), dblcmp);
+  r->name = (char *)bc->name;
+  r->ns_per_op = ns[reps / 2];
+  r->allocs_per_op = allocs[reps / 2];
+  *bytes = b.bytes_per_op;
+  memcpy(note, b.note, sizeof(b.note));
+  if(bc->teardown) bc->teardown(&b);
+  return 0;
+
+ failed:
+  printf("%-36s FAILED: %s\n", bc->name, b.error[0] ? b.error : "run");
+  if(bc->teardown) bc->teardown(&b);
+  return -1;
+}
+
+static int
+run_all(void) {
+  FILE *out = NULL;
+  int t, i, failures = 0, regressions = 0;
+
+  if(baseline_out && (out = fopen(baseline_out, "w")) == NULL) {
+    fprintf(stderr, "baseline %s: %s\n", baseline_out, strerror(errno));
+    return 2;
+  }
+  if(out) fprintf(out, "# noit_bench baseline: name ns/op allocs/op\n");
+
+  printf("%-36s %12s %10s %14s %10s%s\n", "case", "ns/op", "allocs/op",
+         "ops/s", "bytes/op", baseline_in ? "  vs baseline" : "");
+  for(t=0; t<ncase_tables; t++) {
+    for(i=0; case_tables[t][i].name; i++) {
+      const noit_bench_case_t *bc = &case_tables[t][i];
+      bench_result_t r;
+      double bytes = 0;
+      char bytes_str[32] = "-", cmp[64] = "", note[NOIT_BENCH_NOTE_LEN] = "";
+
+      if(!case_selected(bc->name)) continue;
+      if(run_case(bc, &r, &bytes, note) != 0) {
+        failures++;
+        continue;
+      }
+      if(bytes > 0) snprintf(bytes_str, sizeof(bytes_str), "%.1f", bytes);
+      if(baseline_in) {
+        const bench_result_t *base = find_baseline(bc->name);
+        if(!base) snprintf(cmp, sizeof(cmp), "  (new)");
+        else {
+          double pct = (r.ns_per_op / base->ns_per_op - 1.0) * 100.0;
+          mtev_boolean slow = pct > tolerance;
+          mtev_boolean leaky = r.allocs_per_op > base->allocs_per_op + 0.5;
+          snprintf(cmp, sizeof(cmp), "  %+.1f%%%s%s", pct,
+                   slow ? " REGRESSION" : "",
+                   leaky ? " ALLOCS" : "");
+          if(slow || leaky) regressions++;
+        }
+      }
+      printf("%-36s %12.1f %10.2f %14.0f %10s%s%s%s\n", bc->name, r.ns_per_op,
+             r.allocs_per_op, 1e9 / r.ns_per_op, bytes_str, cmp,
+             note[0] ? "  " : "", note);
+      fflush(stdout);
+      if(out) fprintf(out, "%s\t%.1f\t%.2f\n", bc->name, r.ns_per_op,
+                      r.allocs_per_op);
+    }
+  }
+  if(out) fclose(out);
+  if(failures) printf("%d case(s) failed\n", failures);
+  if(regressions) printf("%d case(s) regressed beyond %.0f%% (or allocate more)\n",
+                         regressions, tolerance);
+  return (failures || regressions) ? 1 : 0;
+}
+
+static void
+list_cases(void) {
+  int t, i;
+  for(t=0; t<ncase_tables; t++)
+    for(i=0; case_tables[t][i].name; i++)
+      if(case_selected(case_tables[t][i].name))
+        printf("%-36s %s\n", case_tables[t][i].name, case_tables[t][i].desc);
+}
+
+static void *
+module_cases_main(void *unused) {
+  int rv = run_all();
+  fflush(stdout);
+  exit(rv);
+  return NULL;
+}
+
+static int
+child_main() {
+  int rv;
+
+  noit_mtev_bridge_init();
+  if(mtev_conf_load(config_file) == -1) {
+    fprintf(stderr, "Cannot load config: '%s'\n", config_file);
+    exit(2);
+  }
+  mtev_log_reopen_all();
+  if(eventer_init() == -1) {
+    fprintf(stderr, "Cannot initialize eventer\n");
+    exit(2);
+  }
+  noit_check_tools_shared_init();
+  mtev_console_init(APPNAME);
+  if(module_cases) {
+    mtev_http_rest_init();
+    mtev_dso_init();
+    noit_module_init();
+    mtev_dso_post_init();
+    mtev_listener_init(APPNAME);
+  }
+  noit_filters_init();
+  noit_poller_init();
+
+  if(feed_load(noit_bench_fixture_path("feed.txt")) != 0) exit(2);
+  if(baseline_in && load_baseline(baseline_in) != 0) exit(2);
+
+  if(module_cases) {
+    /* The modules' listeners need a running eventer; the cases run
+     * from their own thread and exit the process when done. */
+    pthread_t tid;
+    pthread_create(&tid, NULL, module_cases_main, NULL);
+    eventer_loop();
+    return 0;
+  }
+  rv = run_all();
+  fflush(stdout);
+  exit(rv);
+  return rv;
+}
+
+static void
+usage(const char *prog) {
+  fprintf(stderr, "%s [-F fixturedir] [-c config] [-M] [-t secs] [-r reps] [-l]\n"
+                  "\t[-w baseline] [-b baseline [-x pct]] [-d] [case ...]\n", prog);
+  fprintf(stderr, "\t-F dir   fixtures (default: $NOIT_BENCH_FIXTURES or ../test/bench)\n");
+  fprintf(stderr, "\t-c file  config (default: <fixturedir>/noit_bench.conf, or\n"
+                  "\t         ./noit_bench_modules.conf with -M)\n");
+  fprintf(stderr, "\t-M       load modules, start listeners and run the module cases\n");
+  fprintf(stderr, "\t-t secs  time per repetition (default: 0.25)\n");
+  fprintf(stderr, "\t-r count repetitions, the median is reported (default: 5)\n");
+  fprintf(stderr, "\t-l       list cases\n");
+  fprintf(stderr, "\t-w file  write results as a baseline\n");
+  fprintf(stderr, "\t-b file  compare against a baseline, exit 1 on regressions\n");
+  fprintf(stderr, "\t-x pct   slowdown tolerated against the baseline (default: 25)\n");
+  fprintf(stderr, "Cases are selected by name prefix or glob.\n");
+}
+
+int main(int argc, char **argv) {
+  int ch;
+
+  mtev_memory_init();
+  while((ch = getopt(argc, argv, "F:c:Mt:r:lw:b:x:dh")) != -1) {
+    switch(ch) {
+      case 'F': fixture_dir = optarg; break;
+      case 'c': config_file = strdup(optarg); break;
+      case 'M': module_cases = 1; break;
+      case 't': rep_seconds = atof(optarg); break;
+      case 'r': reps = atoi(optarg); break;
+      case 'l': list_only = 1; break;
+      case 'w': baseline_out = optarg; break;
+      case 'b': baseline_in = optarg; break;
+      case 'x': tolerance = atof(optarg); break;
+      case 'd': debug++; break;
+      default: usage(argv[0]); return 2;
+    }
+  }
+  for(; optind < argc && npatterns < MAX_PATTERNS; optind++)
+    patterns[npatterns++] = argv[optind];
+  if(reps < 1) reps = 1;
+  if(reps > MAX_REPS) reps = MAX_REPS;
+  if(rep_seconds <= 0) rep_seconds = 0.25;
+
+  if(module_cases) {
+    case_tables[ncase_tables++] = noit_bench_module_cases;
+  }
+  else {
+    case_tables[ncase_tables++] = noit_bench_decode_cases;
+    case_tables[ncase_tables++] = noit_bench_fb_cases;
+    case_tables[ncase_tables++] = noit_bench_stats_cases;
+    case_tables[ncase_tables++] = noit_bench_check_cases;
+    /* last: its director case leaves the metric director hooked into logging */
+    case_tables[ncase_tables++] = noit_bench_pipeline_cases;
+  }
+  if(list_only) {
+    list_cases();
+    return 0;
+  }
+
+  if(!fixture_dir) fixture_dir = getenv("NOIT_BENCH_FIXTURES");
+  if(!fixture_dir) fixture_dir = "../test/bench";
+  if(!config_file)
+    config_file = strdup(module_cases ? "noit_bench_modules.conf" :
+                         noit_bench_fixture_path("noit_bench.conf"));
+
+  noit_check_init_globals();
+  noit_check_tools_shared_init_globals();
+  noit_conf_checks_init_globals();
+  noit_filters_init_globals();
+  noit_jlog_listener_init_globals();
+  noit_metric_director_init_globals();
+  noit_module_init_globals();
+  return mtev_main(APPNAME, config_file, debug, 1, MTEV_LOCK_OP_NONE,
+                   NULL, NULL, NULL, child_main);
+}
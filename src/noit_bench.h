@@ -0,0 +1,170 @@
+/*
+ * Copyright (c) 2017, Circonus, Inc. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above
+ *       copyright notice, this list of conditions and the following
+ *       disclaimer in the documentation and/or other materials provided
+ *       with the distribution.
+ *     * Neither the name Circonus, Inc. nor the names
+ *       of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written
+ *       permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _NOIT_BENCH_H
+#define _NOIT_BENCH_H
+
+#include <mtev_defines.h>
+#include <sys/time.h>
+#include <uuid/uuid.h>
+#include "noit_metric.h"
+#include "noit_check.h"
+
+/* noit_bench runs microbenchmarks against the real noit and stratcon
+ * objects.  A case describes one operation; run() performs (at least) n
+ * of them and returns how many it did.  The harness sizes n so that a
+ * repetition lasts long enough to time and reports the median ns/op,
+ * heap allocations/op and ops/s over several repetitions.
+ */
+
+typedef struct noit_bench noit_bench_t;
+
+#define NOIT_BENCH_NOTE_LEN 64
+
+typedef struct {
+  const char *name;
+  const char *desc;
+  /* 0 to run, -1 to fail the case (reason via noit_bench_fail) */
+  int (*setup)(noit_bench_t *b);
+  uint64_t (*run)(noit_bench_t *b, uint64_t n);
+  void (*teardown)(noit_bench_t *b);
+} noit_bench_case_t;
+
+struct noit_bench {
+  const noit_bench_case_t *bcase;
+  void *closure;
+  /* If set, reported as output bytes per op (e.g. encoded size) */
+  double bytes_per_op;
+  /* If set, printed after the result (e.g. p99 or loss) */
+  char note[NOIT_BENCH_NOTE_LEN];
+  char error[256];
+};
+
+API_EXPORT(void)
+  noit_bench_fail(noit_bench_t *b, const char *fmt, ...);
+
+/* Heap allocations (malloc, calloc, realloc, posix_memalign) made by
+ * any thread since start; 0 if they cannot be counted on this platform.
+ */
+API_EXPORT(uint64_t)
+  noit_bench_allocs(void);
+
+/* Fixture access.  feed.txt is a recorded noit feed of S and M lines
+ * (extended ids) from a mix of check types; it is parsed once and
+ * shared read-only by all cases.
+ */
+typedef struct {
+  char *name;
+  metric_type_t type;
+  char *value;           /* NULL for [[null]] */
+} noit_bench_metric_t;
+
+typedef struct {
+  struct timeval whence;
+  int8_t state;
+  int8_t available;
+  uint32_t duration;
+  char *status;
+  int nmetrics;
+  noit_bench_metric_t *metrics;
+} noit_bench_sample_t;
+
+typedef struct {
+  uuid_t id;
+  char *target;
+  char *module;
+  char *name;
+  int nsamples;
+  noit_bench_sample_t *samples;
+} noit_bench_check_t;
+
+typedef struct {
+  int nlines;
+  char **lines;
+  int *lens;
+  int nmetrics;          /* M lines */
+  int nchecks;
+  noit_bench_check_t *checks;
+} noit_bench_feed_t;
+
+API_EXPORT(const noit_bench_feed_t *)
+  noit_bench_feed(void);
+
+/* Full path of a file in the fixture directory (static buffer). */
+API_EXPORT(const char *)
+  noit_bench_fixture_path(const char *file);
+
+/* The noit check for a fixture check, scheduled (disabled, it has no
+ * module here) on first use.  noit_bench_check_load() sets a sample's
+ * status and metrics as the in-progress stats and, if rotate is set,
+ * makes them current as a check completion would.
+ */
+API_EXPORT(noit_check_t *)
+  noit_bench_check(const noit_bench_check_t *c);
+
+API_EXPORT(void)
+  noit_bench_check_load(noit_check_t *check, const noit_bench_sample_t *s,
+                        mtev_boolean rotate);
+
+/* A check of the case's own, for shapes the fixture lacks. */
+API_EXPORT(noit_check_t *)
+  noit_bench_schedule(const char *target, const char *module, const char *name);
+
+/* Bundle cases (noit_bench_decode.c): setup schedules the fixture
+ * checks and logs each once with the bundle log's "compression" and
+ * "flatbuffer" properties set as given; encode logs them again, decode
+ * converts the captured lines back with noit_check_log_b_to_sm.  Ops are
+ * metrics.
+ */
+API_EXPORT(int)
+  noit_bench_bundle_setup(noit_bench_t *b, const char *compression,
+                          const char *flatbuffer);
+
+API_EXPORT(uint64_t)
+  noit_bench_bundle_encode_run(noit_bench_t *b, uint64_t n);
+
+API_EXPORT(uint64_t)
+  noit_bench_bundle_decode_run(noit_bench_t *b, uint64_t n);
+
+API_EXPORT(void)
+  noit_bench_bundle_teardown(noit_bench_t *b);
+
+/* Case tables, each terminated by an entry with a NULL name */
+extern const noit_bench_case_t noit_bench_decode_cases[];
+extern const noit_bench_case_t noit_bench_fb_cases[];
+extern const noit_bench_case_t noit_bench_pipeline_cases[];
+extern const noit_bench_case_t noit_bench_stats_cases[];
+extern const noit_bench_case_t noit_bench_check_cases[];
+/* Run (alone) with -M: modules loaded, listeners up and the eventer
+ * running in other threads. */
+extern const noit_bench_case_t noit_bench_module_cases[];
+
+#endif
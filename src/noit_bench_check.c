@@ -0,0 +1,506 @@
+/*
+ * Copyright (c) 2017, Circonus, Inc. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above
+ *       copyright notice, this list of conditions and the following
+ *       disclaimer in the documentation and/or other materials provided
+ *       with the distribution.
+ *     * Neither the name Circonus, Inc. nor the names
+ *       of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written
+ *       permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* Check-path cases: the (ip, module) index the passive modules route
+ * packets by, rescheduling on the check timing wheel against plain
+ * eventer timers, batched UDP receive and histogram tiers in the store
+ * against per-slot heap histograms.
+ */
+
+#include "noit_config.h"
+#include <mtev_defines.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
+
+#include <circllhist.h>
+#include <mtev_log.h>
+#include <eventer/eventer.h>
+
+#include "noit_check.h"
+#include "noit_check_wheel.h"
+#include "noit_udp.h"
+#include "noit_bench.h"
+#include "modules/histogram_store.h"
+
+/* (ip, module) lookups as statsd, collectd and ganglia do per packet:
+ * LOOKUP_IPS targets, each with checks for a few modules, looked up
+ * from one thread and from LOOKUP_THREADS at once.
+ */
+
+#define LOOKUP_IPS 256
+#define LOOKUP_THREADS 4
+
+static const char *lookup_modules[] = { "statsd", "collectd", "ganglia", "httptrap" };
+#define LOOKUP_NMODULES (sizeof(lookup_modules)/sizeof(*lookup_modules))
+
+struct lookup_bench {
+  char ips[LOOKUP_IPS][INET_ADDRSTRLEN];
+  noit_check_t *checks[LOOKUP_IPS * LOOKUP_NMODULES];
+  int nchecks;
+  int threads;
+};
+
+struct lookup_thread {
+  struct lookup_bench *lb;
+  uint64_t n;
+  uint64_t found;
+  int seed;
+};
+
+static void *
+lookup_thread_main(void *vlt) {
+  struct lookup_thread *lt = vlt;
+  noit_check_t *found[NOIT_UDP_MAX_CHECKS];
+  uint64_t i;
+  for(i=0; i<lt->n; i++) {
+    int idx = (lt->seed + i) % (LOOKUP_IPS * LOOKUP_NMODULES);
+    lt->found += noit_poller_lookup_by_ip_module(lt->lb->ips[idx / LOOKUP_NMODULES],
+                                                 lookup_modules[idx % LOOKUP_NMODULES],
+                                                 found, NOIT_UDP_MAX_CHECKS);
+  }
+  return NULL;
+}
+
+static int
+lookup_setup(noit_bench_t *b, int threads) {
+  struct lookup_bench *lb = calloc(1, sizeof(*lb));
+  int i, m;
+
+  b->closure = lb;
+  lb->threads = threads;
+  for(i=0; i<LOOKUP_IPS; i++) {
+    snprintf(lb->ips[i], sizeof(lb->ips[i]), "10.200.%d.%d", i / 200, 1 + i % 200);
+    for(m=0; m<LOOKUP_NMODULES; m++) {
+      /* every other module per ip, so half the lookups miss */
+      if((i + m) % 2) continue;
+      lb->checks[lb->nchecks] =
+        noit_bench_schedule(lb->ips[i], lookup_modules[m], lookup_modules[m]);
+      if(lb->checks[lb->nchecks]) lb->nchecks++;
+    }
+  }
+  if(lb->nchecks == 0) {
+    noit_bench_fail(b, "no checks could be scheduled");
+    return -1;
+  }
+  return 0;
+}
+static int lookup_setup_1(noit_bench_t *b) { return lookup_setup(b, 1); }
+static int lookup_setup_mt(noit_bench_t *b) { return lookup_setup(b, LOOKUP_THREADS); }
+
+static uint64_t
+lookup_run(noit_bench_t *b, uint64_t n) {
+  struct lookup_bench *lb = b->closure;
+  struct lookup_thread lt[LOOKUP_THREADS];
+  pthread_t tids[LOOKUP_THREADS];
+  uint64_t done = 0, found = 0;
+  int i;
+
+  for(i=0; i<lb->threads; i++) {
+    lt[i].lb = lb;
+    lt[i].n = (n + lb->threads - 1) / lb->threads;
+    lt[i].found = 0;
+    lt[i].seed = i * 97;
+  }
+  if(lb->threads == 1) lookup_thread_main(&lt[0]);
+  else {
+    for(i=0; i<lb->threads; i++)
+      pthread_create(&tids[i], NULL, lookup_thread_main, &lt[i]);
+    for(i=0; i<lb->threads; i++) pthread_join(tids[i], NULL);
+  }
+  for(i=0; i<lb->threads; i++) {
+    done += lt[i].n;
+    found += lt[i].found;
+  }
+  if(found == 0) {
+    noit_bench_fail(b, "lookups found no checks");
+    return 0;
+  }
+  return done;
+}
+
+static void
+lookup_teardown(noit_bench_t *b) {
+  struct lookup_bench *lb = b->closure;
+  int i;
+  for(i=0; i<lb->nchecks; i++)
+    noit_poller_deschedule(lb->checks[i]->checkid, mtev_true);
+  free(lb);
+}
+
+/* Rescheduling: TIMER_EVENTS timers spread over a minute on one eventer
+ * thread; an op moves one of them to a new time, as each check fire
+ * does.  The eventer loop is not running, so nothing fires.
+ */
+
+#define TIMER_EVENTS 4096
+
+struct timer_bench {
+  eventer_t events[TIMER_EVENTS];
+  noit_check_wheel_entry_t entries[TIMER_EVENTS];
+  mtev_boolean wheel;
+  int pos;
+};
+
+static int
+timer_noop(eventer_t e, int mask, void *closure, struct timeval *now) {
+  return 0;
+}
+
+static void
+timer_place(struct timer_bench *tb, int i, const struct timeval *now) {
+  eventer_t e = tb->events[i];
+  int offset_ms = (i * 7919 + tb->pos * 31) % 60000;
+  e->whence.tv_sec = now->tv_sec + 1 + offset_ms / 1000;
+  e->whence.tv_usec = (offset_ms % 1000) * 1000;
+  if(tb->wheel) noit_check_wheel_add(&tb->entries[i], e, mtev_false);
+  else eventer_add(e);
+}
+
+static int
+timer_setup(noit_bench_t *b, mtev_boolean wheel) {
+  struct timer_bench *tb = calloc(1, sizeof(*tb));
+  struct timeval now;
+  int i;
+
+  b->closure = tb;
+  if(wheel && !noit_check_wheel_enabled()) {
+    noit_bench_fail(b, "timing wheel disabled (//checks/@timing_wheel)");
+    return -1;
+  }
+  tb->wheel = wheel;
+  gettimeofday(&now, NULL);
+  for(i=0; i<TIMER_EVENTS; i++) {
+    eventer_t e = eventer_alloc();
+    e->mask = EVENTER_TIMER;
+    e->callback = timer_noop;
+    eventer_set_owner(e, eventer_choose_owner(0));
+    tb->events[i] = e;
+    timer_place(tb, i, &now);
+  }
+  return 0;
+}
+static int wheel_setup(noit_bench_t *b) { return timer_setup(b, mtev_true); }
+static int eventer_timer_setup(noit_bench_t *b) { return timer_setup(b, mtev_false); }
+
+static uint64_t
+timer_run(noit_bench_t *b, uint64_t n) {
+  struct timer_bench *tb = b->closure;
+  struct timeval now;
+  uint64_t i;
+
+  gettimeofday(&now, NULL);
+  for(i=0; i<n; i++) {
+    int idx = tb->pos++ % TIMER_EVENTS;
+    if(tb->wheel) noit_check_wheel_remove(&tb->entries[idx]);
+    else eventer_remove(tb->events[idx]);
+    timer_place(tb, idx, &now);
+  }
+  return n;
+}
+
+static void
+timer_teardown(noit_bench_t *b) {
+  struct timer_bench *tb = b->closure;
+  int i;
+  for(i=0; i<TIMER_EVENTS; i++) {
+    if(!tb->events[i]) continue;
+    if(tb->wheel) noit_check_wheel_remove(&tb->entries[i]);
+    else eventer_remove(tb->events[i]);
+    eventer_free(tb->events[i]);
+  }
+  free(tb);
+}
+
+/* UDP receive: statsd-style datagrams sent over loopback in bursts and
+ * drained through a noit_udp receiver with a batch of 1 (one recvfrom
+ * per packet, as before) or UDP_BATCH.  The send side is identical in
+ * both, so the difference is the receive path.
+ */
+
+#define UDP_BURST 64
+#define UDP_BATCH 32
+#define UDP_PAYLOADS 256
+
+struct udp_bench {
+  int rxfd;
+  int txfd;
+  noit_udp_receiver_t *rx;
+  noit_check_t *check;
+  char *payloads[UDP_PAYLOADS];
+  int lens[UDP_PAYLOADS];
+  int npayloads;
+  int pos;
+};
+
+static int
+udp_setup(noit_bench_t *b, int batch) {
+  const noit_bench_feed_t *feed = noit_bench_feed();
+  struct udp_bench *ub = calloc(1, sizeof(*ub));
+  struct sockaddr_in addr;
+  socklen_t addrlen = sizeof(addr);
+  int i;
+
+  b->closure = ub;
+  ub->rxfd = ub->txfd = -1;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  if((ub->rxfd = noit_udp_bind((struct sockaddr *)&addr, sizeof(addr), mtev_false)) < 0 ||
+     getsockname(ub->rxfd, (struct sockaddr *)&addr, &addrlen) != 0) {
+    noit_bench_fail(b, "cannot bind loopback: %s", strerror(errno));
+    return -1;
+  }
+  if((ub->txfd = socket(AF_INET, SOCK_DGRAM, 0)) < 0 ||
+     connect(ub->txfd, (struct sockaddr *)&addr, addrlen) != 0) {
+    noit_bench_fail(b, "cannot connect to loopback: %s", strerror(errno));
+    return -1;
+  }
+
+  /* name:value|g from the fixture's metrics */
+  for(i=0; i<feed->nchecks && ub->npayloads < UDP_PAYLOADS; i++) {
+    const noit_bench_check_t *c = &feed->checks[i];
+    int m;
+    if(c->nsamples == 0) continue;
+    for(m=0; m<c->samples[0].nmetrics && ub->npayloads < UDP_PAYLOADS; m++) {
+      const noit_bench_metric_t *bm = &c->samples[0].metrics[m];
+      char buf[512];
+      if(!bm->value || bm->type == METRIC_STRING) continue;
+      ub->lens[ub->npayloads] =
+        snprintf(buf, sizeof(buf), "%s:%s|g", bm->name, bm->value);
+      ub->payloads[ub->npayloads++] = strdup(buf);
+    }
+  }
+  if(ub->npayloads == 0) {
+    noit_bench_fail(b, "no numeric metrics in the fixture");
+    return -1;
+  }
+
+  ub->check = noit_bench_schedule("127.0.0.1", "statsd", "udp");
+  ub->rx = noit_udp_receiver_alloc(batch == 1 ? "bench-1" : "bench-batch",
+                                   "statsd", batch, 1500, NULL);
+  return 0;
+}
+static int udp_setup_1(noit_bench_t *b) { return udp_setup(b, 1); }
+static int udp_setup_batch(noit_bench_t *b) { return udp_setup(b, UDP_BATCH); }
+
+static uint64_t
+udp_run(noit_bench_t *b, uint64_t n) {
+  struct udp_bench *ub = b->closure;
+  uint64_t done = 0;
+
+  while(done < n) {
+    noit_udp_packet_t *packets;
+    int i, got = 0, cnt;
+    for(i=0; i<UDP_BURST; i++) {
+      int idx = ub->pos++ % ub->npayloads;
+      if(send(ub->txfd, ub->payloads[idx], ub->lens[idx], 0) < 0) break;
+    }
+    while(got < i && (cnt = noit_udp_receiver_recv(ub->rx, ub->rxfd, &packets)) > 0)
+      got += cnt;
+    if(got == 0) {
+      noit_bench_fail(b, "no datagrams received");
+      return 0;
+    }
+    done += got;
+  }
+  return done;
+}
+
+static void
+udp_teardown(noit_bench_t *b) {
+  struct udp_bench *ub = b->closure;
+  int i;
+  if(ub->rxfd >= 0) close(ub->rxfd);
+  if(ub->txfd >= 0) close(ub->txfd);
+  if(ub->check) noit_poller_deschedule(ub->check->checkid, mtev_true);
+  for(i=0; i<ub->npayloads; i++) free(ub->payloads[i]);
+  /* receivers live as long as their listener; this one is simply leaked */
+  free(ub);
+}
+
+/* Histogram tiers: HIST_METRICS metrics, each with its ten second slots
+ * holding HIST_VALUES distinct bins, in the histogram store's arena and
+ * as the heap layout it replaced (a histogram_t per slot: ten seconds,
+ * six ten seconds and the aggregate).  An op inserts a sample into one
+ * metric's current second, as the histogram hook does per metric set.
+ * The note is the memory each layout holds per metric once filled.
+ */
+
+#define HIST_METRICS 10000
+#define HIST_VALUES 8
+#define HIST_HEAP_SLOTS (HSTORE_SECS + HSTORE_TENSECS + 1)
+
+struct hist_bench {
+  histogram_store_t *store;
+  hstore_ref_t refs[HIST_METRICS];
+  histogram_t *(*heap)[HIST_HEAP_SLOTS];
+  mtev_atomic32_t usage;
+  uint64_t pos;
+};
+
+/* Bytes the allocator has handed out and not had back, where known. */
+static int64_t
+heap_in_use(void) {
+#if defined(__GLIBC__) && __GLIBC_PREREQ(2,33)
+  return (int64_t)mallinfo2().uordblks;
+#elif defined(__GLIBC__)
+  return (int64_t)mallinfo().uordblks;
+#else
+  return -1;
+#endif
+}
+
+static double
+hist_value(int metric, uint64_t k) {
+  return 1.0 + ((metric * 7 + k % HIST_VALUES) % 64) * 0.25;
+}
+
+static void
+hist_insert_one(struct hist_bench *hb) {
+  int metric = hb->pos % HIST_METRICS;
+  int slot = (hb->pos / HIST_METRICS) % HSTORE_SECS;
+  double v = hist_value(metric, hb->pos / (HIST_METRICS * HSTORE_SECS));
+  if(hb->store)
+    histogram_store_insert(hb->store, hb->refs[metric], HSTORE_SLOT_SEC(slot),
+                           v, 1, &hb->usage);
+  else
+    hist_insert(hb->heap[metric][HSTORE_SLOT_SEC(slot)], v, 1);
+  hb->pos++;
+}
+
+static int
+hist_setup(noit_bench_t *b, mtev_boolean store) {
+  struct hist_bench *hb = calloc(1, sizeof(*hb));
+  int64_t before = heap_in_use();
+  uint64_t i;
+  int m, s;
+
+  b->closure = hb;
+  if(store) {
+    uuid_t checkid;
+    uint32_t total, used, unclaimed;
+    uint64_t dropped;
+    if((hb->store = histogram_store_open(NULL, HSTORE_DEFAULT_SIZE)) == NULL) {
+      noit_bench_fail(b, "cannot open an anonymous histogram store");
+      return -1;
+    }
+    uuid_generate(checkid);
+    for(m=0; m<HIST_METRICS; m++) {
+      char name[64];
+      snprintf(name, sizeof(name), "group%02d`metric%05d", m % 16, m);
+      if((hb->refs[m] = histogram_store_tier(hb->store, checkid, name, &hb->usage)) == 0) {
+        noit_bench_fail(b, "histogram store full at %d metrics", m);
+        return -1;
+      }
+    }
+    for(i=0; i<(uint64_t)HIST_METRICS * HSTORE_SECS * HIST_VALUES; i++)
+      hist_insert_one(hb);
+    histogram_store_stats(hb->store, &total, &used, &unclaimed, &dropped);
+    if(dropped) {
+      noit_bench_fail(b, "histogram store dropped %llu samples",
+                      (unsigned long long)dropped);
+      return -1;
+    }
+    snprintf(b->note, sizeof(b->note), "%.0f B/metric",
+             (double)used * HSTORE_CHUNK_SIZE / HIST_METRICS);
+  }
+  else {
+    int64_t after;
+    hb->heap = calloc(HIST_METRICS, sizeof(*hb->heap));
+    for(m=0; m<HIST_METRICS; m++)
+      for(s=0; s<HIST_HEAP_SLOTS; s++) hb->heap[m][s] = hist_alloc();
+    for(i=0; i<(uint64_t)HIST_METRICS * HSTORE_SECS * HIST_VALUES; i++)
+      hist_insert_one(hb);
+    after = heap_in_use();
+    if(before >= 0 && after >= before)
+      snprintf(b->note, sizeof(b->note), "%.0f B/metric",
+               (double)(after - before) / HIST_METRICS);
+  }
+  return 0;
+}
+static int hist_store_setup(noit_bench_t *b) { return hist_setup(b, mtev_true); }
+static int hist_heap_setup(noit_bench_t *b) { return hist_setup(b, mtev_false); }
+
+static uint64_t
+hist_run(noit_bench_t *b, uint64_t n) {
+  struct hist_bench *hb = b->closure;
+  uint64_t i;
+  for(i=0; i<n; i++) hist_insert_one(hb);
+  return n;
+}
+
+static void
+hist_teardown(noit_bench_t *b) {
+  struct hist_bench *hb = b->closure;
+  int m, s;
+  /* the arena is not unmapped; an anonymous one is simply leaked */
+  if(hb->store) {
+    for(m=0; m<HIST_METRICS; m++)
+      histogram_store_tier_free(hb->store, hb->refs[m], &hb->usage);
+  }
+  if(hb->heap) {
+    for(m=0; m<HIST_METRICS; m++)
+      for(s=0; s<HIST_HEAP_SLOTS; s++) hist_free(hb->heap[m][s]);
+    free(hb->heap);
+  }
+  free(hb);
+}
+
+const noit_bench_case_t noit_bench_check_cases[] = {
+  { "poller.ip_module_lookup", "noit_poller_lookup_by_ip_module (op: lookup)",
+    lookup_setup_1, lookup_run, lookup_teardown },
+  { "poller.ip_module_lookup.mt4", "as above from 4 threads at once (op: lookup)",
+    lookup_setup_mt, lookup_run, lookup_teardown },
+  { "wheel.reschedule", "noit_check_wheel remove and add, 4096 timers (op: move)",
+    wheel_setup, timer_run, timer_teardown },
+  { "eventer.timer.reschedule", "eventer_remove and eventer_add, 4096 timers (op: move)",
+    eventer_timer_setup, timer_run, timer_teardown },
+  { "udp.recv.single", "noit_udp receiver, batch of 1, loopback (op: datagram)",
+    udp_setup_1, udp_run, udp_teardown },
+  { "udp.recv.batch", "noit_udp receiver, batch of 32, loopback (op: datagram)",
+    udp_setup_batch, udp_run, udp_teardown },
+  { "histogram.store.insert", "sample into a histogram store tier, 10k metrics (op: sample)",
+    hist_store_setup, hist_run, hist_teardown },
+  { "histogram.heap.insert", "sample into per-slot heap histograms, 10k metrics (op: sample)",
+    hist_heap_setup, hist_run, hist_teardown },
+  { NULL }
+};
@@ -0,0 +1,411 @@
+/*
+ * Copyright (c) 2017, Circonus, Inc. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above
+ *       copyright notice, this list of conditions and the following
+ *       disclaimer in the documentation and/or other materials provided
+ *       with the distribution.
+ *     * Neither the name Circonus, Inc. nor the names
+ *       of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written
+ *       permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* Decoding and encoding cases: M/S line parsing, METRIC_GUESS inference
+ * (against the legacy guesser it replaced) and bundle encode/decode of
+ * the protobuf B1 and B2 formats.  The BF cases (noit_bench_fb.c) share
+ * the bundle machinery here.
+ */
+
+#include "noit_config.h"
+#include <mtev_defines.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <mtev_log.h>
+#include <mtev_hooks.h>
+
+#include "noit_metric.h"
+#include "noit_message_decoder.h"
+#include "noit_check.h"
+#include "noit_check_log_helpers.h"
+#include "noit_metric_guess_legacy.h"
+#include "noit_bench.h"
+
+/* M/S line parsing */
+
+struct lines_bench {
+  int nlines;
+  char **lines;
+  int *lens;
+  int pos;
+};
+
+static int
+lines_setup(noit_bench_t *b, char type) {
+  const noit_bench_feed_t *feed = noit_bench_feed();
+  struct lines_bench *lb = calloc(1, sizeof(*lb));
+  int i;
+
+  lb->lines = calloc(feed->nlines, sizeof(*lb->lines));
+  lb->lens = calloc(feed->nlines, sizeof(*lb->lens));
+  for(i=0; i<feed->nlines; i++) {
+    if(feed->lines[i][0] != type) continue;
+    lb->lines[lb->nlines] = feed->lines[i];
+    lb->lens[lb->nlines] = feed->lens[i];
+    lb->nlines++;
+  }
+  b->closure = lb;
+  if(lb->nlines == 0) {
+    noit_bench_fail(b, "no %c lines in the fixture", type);
+    return -1;
+  }
+  return 0;
+}
+static int parse_m_setup(noit_bench_t *b) { return lines_setup(b, 'M'); }
+static int parse_s_setup(noit_bench_t *b) { return lines_setup(b, 'S'); }
+
+static uint64_t
+parse_run(noit_bench_t *b, uint64_t n) {
+  struct lines_bench *lb = b->closure;
+  uint64_t i;
+
+  for(i=0; i<n; i++) {
+    noit_metric_value_t value;
+    const char *name;
+    int name_len;
+    uuid_t id;
+    int idx = lb->pos++ % lb->nlines;
+
+    memset(&value, 0, sizeof(value));
+    if(noit_message_decoder_parse_line(lb->lines[idx], lb->lens[idx], &id,
+                                       &name, &name_len, NULL, NULL,
+                                       &value, 0) != 1) {
+      noit_bench_fail(b, "cannot parse: %s", lb->lines[idx]);
+      return 0;
+    }
+    if(value.type == METRIC_STRING && !value.is_null)
+      free(value.value.v_string);
+  }
+  return n;
+}
+
+static void
+lines_teardown(noit_bench_t *b) {
+  struct lines_bench *lb = b->closure;
+  free(lb->lines);
+  free(lb->lens);
+  free(lb);
+}
+
+/* METRIC_GUESS inference, against the legacy guesser it replaced
+ * (noit_metric_guess_legacy.c), over every value in the fixture and
+ * these, which exercise the edges of the grammar. */
+static const char *guess_extra[] = {
+  "0", "-0", "+0", "00", "0.", ".5", "-.5", "0.0", "1e10", "1.0e10",
+  "1.5e+10", "1.5E-10", "1.5e10", "-1.5e-308", "4.9e-324", "1.7976931348623157e+308",
+  "1e+400", "18446744073709551615", "18446744073709551616",
+  "-9223372036854775808", "-9223372036854775809", "9007199254740993",
+  "0.1", "0.30000000000000004", "123456789012345678901234567890.5",
+  "  42  ", "42%", " 87.5% used ", "12 apples", "12 apples 3", "1 2",
+  "%", "-", "+", ".", "e5", "1.e5", "1..2", "0x10", "inf", "nan", "",
+  "   ", "3.14159", "2.718281828459045235360287", "-17", "+17", "17 ",
+  NULL
+};
+
+struct guess_bench {
+  int nvalues;
+  const char **values;
+  size_t *lens;
+  int pos;
+};
+
+static int
+guess_setup(noit_bench_t *b) {
+  const noit_bench_feed_t *feed = noit_bench_feed();
+  struct guess_bench *gb = calloc(1, sizeof(*gb));
+  int c, s, m, i, allocd;
+
+  allocd = feed->nmetrics + sizeof(guess_extra) / sizeof(*guess_extra);
+  gb->values = calloc(allocd, sizeof(*gb->values));
+  gb->lens = calloc(allocd, sizeof(*gb->lens));
+  for(c=0; c<feed->nchecks; c++)
+    for(s=0; s<feed->checks[c].nsamples; s++)
+      for(m=0; m<feed->checks[c].samples[s].nmetrics; m++) {
+        const char *v = feed->checks[c].samples[s].metrics[m].value;
+        if(v) gb->values[gb->nvalues++] = v;
+      }
+  for(i=0; guess_extra[i]; i++) gb->values[gb->nvalues++] = guess_extra[i];
+  for(i=0; i<gb->nvalues; i++) gb->lens[i] = strlen(gb->values[i]);
+  b->closure = gb;
+  return 0;
+}
+
+/* The replacement must agree with the legacy guesser on type and value
+ * (bit for bit for doubles) before its speed means anything. */
+static int
+guess_value_setup(noit_bench_t *b) {
+  struct guess_bench *gb;
+  int i;
+
+  guess_setup(b);
+  gb = b->closure;
+  for(i=0; i<gb->nvalues; i++) {
+    void *replacement = NULL;
+    noit_metric_value_t v;
+    metric_type_t lt, nt;
+    mtev_boolean same;
+
+    lt = noit_metric_guess_type_legacy(gb->values[i], &replacement);
+    nt = noit_metric_guess_value(gb->values[i], gb->lens[i], &v);
+    same = (lt == nt);
+    if(same) {
+      switch(lt) {
+        case METRIC_INT64:
+          same = (v.value.v_int64 == *(int64_t *)replacement); break;
+        case METRIC_UINT64:
+          same = (v.value.v_uint64 == *(uint64_t *)replacement); break;
+        case METRIC_DOUBLE:
+          same = !memcmp(&v.value.v_double, replacement, sizeof(double)); break;
+        default: break;
+      }
+    }
+    free(replacement);
+    if(!same) {
+      noit_bench_fail(b, "guess mismatch on \"%s\" (%c vs legacy %c)",
+                      gb->values[i], nt, lt);
+      return -1;
+    }
+  }
+  return 0;
+}
+
+static uint64_t
+guess_legacy_run(noit_bench_t *b, uint64_t n) {
+  struct guess_bench *gb = b->closure;
+  uint64_t i;
+  for(i=0; i<n; i++) {
+    void *replacement = NULL;
+    noit_metric_guess_type_legacy(gb->values[gb->pos++ % gb->nvalues], &replacement);
+    free(replacement);
+  }
+  return n;
+}
+
+static uint64_t
+guess_value_run(noit_bench_t *b, uint64_t n) {
+  struct guess_bench *gb = b->closure;
+  uint64_t i;
+  for(i=0; i<n; i++) {
+    noit_metric_value_t v;
+    int idx = gb->pos++ % gb->nvalues;
+    noit_metric_guess_value(gb->values[idx], gb->lens[idx], &v);
+  }
+  return n;
+}
+
+static void
+guess_teardown(noit_bench_t *b) {
+  struct guess_bench *gb = b->closure;
+  free(gb->values);
+  free(gb->lens);
+  free(gb);
+}
+
+/* Bundles.  Every fixture check is scheduled with its first sample as
+ * the current stats; encoding is noit_check_log_bundle() into the
+ * "bundle" log (a memory outlet), with the stream properties selecting
+ * the format.  The lines it writes are captured once to size the
+ * encoding and to serve as the input of the matching decode case.
+ */
+
+struct bundle_bench {
+  const char *compression;
+  const char *flatbuffer;
+  int nchecks;
+  noit_check_t **checks;
+  int *nmetrics;
+  int nlines;
+  char **lines;
+  int *lens;
+  int lines_allocd;
+  uint64_t metrics;
+  uint64_t bytes;
+  int pos;
+};
+
+static struct bundle_bench *capturing = NULL;
+static mtev_boolean capture_hooked = mtev_false;
+
+static mtev_hook_return_t
+bundle_capture(void *closure, mtev_log_stream_t ls, const struct timeval *whence,
+               const char *timebuf, int timebuflen,
+               const char *debugbuf, int debugbuflen,
+               const char *line, size_t len) {
+  struct bundle_bench *bb = capturing;
+  const char *name;
+
+  if(!bb || !ls) return MTEV_HOOK_CONTINUE;
+  name = mtev_log_stream_get_name(ls);
+  if(!name || strcmp(name, "bundle")) return MTEV_HOOK_CONTINUE;
+  while(len > 0 && line[len-1] == '\n') len--;
+  bb->bytes += len + 1;
+  if(len < 2 || line[0] != 'B') return MTEV_HOOK_CONTINUE;
+  if(bb->nlines == bb->lines_allocd) {
+    bb->lines_allocd = bb->lines_allocd ? bb->lines_allocd * 2 : 64;
+    bb->lines = realloc(bb->lines, bb->lines_allocd * sizeof(*bb->lines));
+    bb->lens = realloc(bb->lens, bb->lines_allocd * sizeof(*bb->lens));
+  }
+  bb->lines[bb->nlines] = malloc(len + 1);
+  memcpy(bb->lines[bb->nlines], line, len);
+  bb->lines[bb->nlines][len] = '\0';
+  bb->lens[bb->nlines] = len;
+  bb->nlines++;
+  return MTEV_HOOK_CONTINUE;
+}
+
+int
+noit_bench_bundle_setup(noit_bench_t *b, const char *compression,
+                        const char *flatbuffer) {
+  const noit_bench_feed_t *feed = noit_bench_feed();
+  struct bundle_bench *bb = calloc(1, sizeof(*bb));
+  mtev_log_stream_t ls;
+  int i;
+
+  b->closure = bb;
+  if((ls = mtev_log_stream_find("bundle")) == NULL) {
+    noit_bench_fail(b, "no bundle log configured");
+    return -1;
+  }
+  /* the stream takes ownership of both the property and its value */
+  mtev_log_stream_set_property(ls, strdup("compression"), strdup(compression));
+  mtev_log_stream_set_property(ls, strdup("flatbuffer"), strdup(flatbuffer));
+  if(!capture_hooked) {
+    mtev_log_line_hook_register("noit_bench", bundle_capture, NULL);
+    capture_hooked = mtev_true;
+  }
+
+  bb->compression = compression;
+  bb->flatbuffer = flatbuffer;
+  bb->checks = calloc(feed->nchecks, sizeof(*bb->checks));
+  bb->nmetrics = calloc(feed->nchecks, sizeof(*bb->nmetrics));
+  for(i=0; i<feed->nchecks; i++) {
+    const noit_bench_check_t *c = &feed->checks[i];
+    noit_check_t *check;
+    if(c->nsamples == 0) continue;
+    if((check = noit_bench_check(c)) == NULL) continue;
+    noit_bench_check_load(check, &c->samples[0], mtev_true);
+    bb->checks[bb->nchecks] = check;
+    bb->nmetrics[bb->nchecks] = c->samples[0].nmetrics;
+    bb->nchecks++;
+  }
+  if(bb->nchecks == 0) {
+    noit_bench_fail(b, "no checks could be scheduled");
+    return -1;
+  }
+
+  capturing = bb;
+  for(i=0; i<bb->nchecks; i++) {
+    noit_check_log_bundle(bb->checks[i]);
+    bb->metrics += bb->nmetrics[i];
+  }
+  capturing = NULL;
+  if(bb->nlines == 0) {
+    noit_bench_fail(b, "nothing logged to the bundle log");
+    return -1;
+  }
+  b->bytes_per_op = (double)bb->bytes / bb->metrics;
+  return 0;
+}
+
+static int bundle_b1_setup(noit_bench_t *b) { return noit_bench_bundle_setup(b, "on", "off"); }
+static int bundle_b2_setup(noit_bench_t *b) { return noit_bench_bundle_setup(b, "off", "off"); }
+
+uint64_t
+noit_bench_bundle_encode_run(noit_bench_t *b, uint64_t n) {
+  struct bundle_bench *bb = b->closure;
+  uint64_t done = 0;
+  while(done < n) {
+    int idx = bb->pos++ % bb->nchecks;
+    noit_check_log_bundle(bb->checks[idx]);
+    done += bb->nmetrics[idx] ? bb->nmetrics[idx] : 1;
+  }
+  return done;
+}
+
+uint64_t
+noit_bench_bundle_decode_run(noit_bench_t *b, uint64_t n) {
+  struct bundle_bench *bb = b->closure;
+  uint64_t done = 0;
+  while(done < n) {
+    int i, cnt, idx = bb->pos++ % bb->nlines;
+    char **out = NULL;
+    cnt = noit_check_log_b_to_sm(bb->lines[idx], bb->lens[idx], &out, -1);
+    if(cnt <= 0) {
+      noit_bench_fail(b, "cannot decode %.20s...", bb->lines[idx]);
+      return 0;
+    }
+    for(i=0; i<cnt; i++) free(out[i]);
+    free(out);
+    done += cnt;
+  }
+  return done;
+}
+
+void
+noit_bench_bundle_teardown(noit_bench_t *b) {
+  struct bundle_bench *bb = b->closure;
+  mtev_log_stream_t ls;
+  int i;
+
+  if((ls = mtev_log_stream_find("bundle")) != NULL) {
+    mtev_log_stream_set_property(ls, strdup("compression"), strdup("on"));
+    mtev_log_stream_set_property(ls, strdup("flatbuffer"), strdup("off"));
+  }
+  for(i=0; i<bb->nlines; i++) free(bb->lines[i]);
+  free(bb->lines);
+  free(bb->lens);
+  free(bb->checks);
+  free(bb->nmetrics);
+  free(bb);
+}
+
+const noit_bench_case_t noit_bench_decode_cases[] = {
+  { "decode.parse_line.M", "noit_message_decoder_parse_line on M lines (op: line)",
+    parse_m_setup, parse_run, lines_teardown },
+  { "decode.parse_line.S", "noit_message_decoder_parse_line on S lines (op: line)",
+    parse_s_setup, parse_run, lines_teardown },
+  { "guess.legacy", "the pre-guess_value METRIC_GUESS guesser (op: value)",
+    guess_setup, guess_legacy_run, guess_teardown },
+  { "guess.value", "noit_metric_guess_value, checked against legacy (op: value)",
+    guess_value_setup, guess_value_run, guess_teardown },
+  { "bundle.encode.B1", "noit_check_log_bundle, protobuf+zlib (op: metric)",
+    bundle_b1_setup, noit_bench_bundle_encode_run, noit_bench_bundle_teardown },
+  { "bundle.encode.B2", "noit_check_log_bundle, protobuf (op: metric)",
+    bundle_b2_setup, noit_bench_bundle_encode_run, noit_bench_bundle_teardown },
+  { "bundle.decode.B1", "noit_check_log_b_to_sm on B1 (op: metric)",
+    bundle_b1_setup, noit_bench_bundle_decode_run, noit_bench_bundle_teardown },
+  { "bundle.decode.B2", "noit_check_log_b_to_sm on B2 (op: metric)",
+    bundle_b2_setup, noit_bench_bundle_decode_run, noit_bench_bundle_teardown },
+  { NULL }
+};
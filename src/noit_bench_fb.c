@@ -0,0 +1,56 @@
+/*
+ * Copyright (c) 2017, Circonus, Inc. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above
+ *       copyright notice, this list of conditions and the following
+ *       disclaimer in the documentation and/or other materials provided
+ *       with the distribution.
+ *     * Neither the name Circonus, Inc. nor the names
+ *       of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written
+ *       permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* BF bundle cases: the same fixture checks as the B1/B2 bundle cases
+ * (noit_bench_decode.c), logged and decoded as a MetricBatch and as
+ * MetricColumns.  Both are lz4 compressed; bytes/op is the size of the
+ * line per metric.
+ */
+
+#include "noit_config.h"
+#include <mtev_defines.h>
+
+#include "noit_bench.h"
+
+static int bf_batch_setup(noit_bench_t *b) { return noit_bench_bundle_setup(b, "on", "batch"); }
+static int bf_columns_setup(noit_bench_t *b) { return noit_bench_bundle_setup(b, "on", "columnar"); }
+
+const noit_bench_case_t noit_bench_fb_cases[] = {
+  { "bundle.encode.BF.batch", "noit_check_log_bundle, MetricBatch+lz4 (op: metric)",
+    bf_batch_setup, noit_bench_bundle_encode_run, noit_bench_bundle_teardown },
+  { "bundle.encode.BF.columnar", "noit_check_log_bundle, MetricColumns+lz4 (op: metric)",
+    bf_columns_setup, noit_bench_bundle_encode_run, noit_bench_bundle_teardown },
+  { "bundle.decode.BF.batch", "noit_check_log_b_to_sm on BF MetricBatch (op: metric)",
+    bf_batch_setup, noit_bench_bundle_decode_run, noit_bench_bundle_teardown },
+  { "bundle.decode.BF.columnar", "noit_check_log_b_to_sm on BF MetricColumns (op: metric)",
+    bf_columns_setup, noit_bench_bundle_decode_run, noit_bench_bundle_teardown },
+  { NULL }
+};
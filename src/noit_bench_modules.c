@@ -0,0 +1,1058 @@
+/*
+ * Copyright (c) 2017, Circonus, Inc. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above
+ *       copyright notice, this list of conditions and the following
+ *       disclaimer in the documentation and/or other materials provided
+ *       with the distribution.
+ *     * Neither the name Circonus, Inc. nor the names
+ *       of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written
+ *       permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* Module cases, run with -M: noit_bench has loaded the modules in
+ * noit_bench_modules.conf and their listeners are served by a running
+ * eventer, so these cases drive the modules as clients would, over
+ * loopback sockets, and count what arrives through the metric hook.
+ */
+
+#include "noit_config.h"
+#include <mtev_defines.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <time.h>
+
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+
+#include <mtev_log.h>
+#include <mtev_conf.h>
+#include <mtev_atomic.h>
+#include <mtev_hooks.h>
+#include <mtev_hash.h>
+#include <mtev_uuid.h>
+
+#include <circllhist.h>
+
+#include "noit_check.h"
+#include "noit_check_tools.h"
+#include "noit_module.h"
+#include "noit_bench.h"
+
+/* Checks the cases schedule are named "bench.<something>"; only their
+ * metrics are counted, optionally only those whose name ends in
+ * count_suffix (e.g. statsd's "`count", one per line received).
+ */
+#define BENCH_CHECK_PREFIX "bench."
+
+static mtev_atomic64_t bench_events;
+static const char *count_suffix;
+
+static mtev_hook_return_t
+count_metric(void *closure, noit_check_t *check, stats_t *stats, metric_t *m) {
+  size_t len, slen;
+  if(!check->name || strncmp(check->name, BENCH_CHECK_PREFIX,
+                             strlen(BENCH_CHECK_PREFIX)))
+    return MTEV_HOOK_CONTINUE;
+  if(count_suffix) {
+    len = strlen(m->metric_name);
+    slen = strlen(count_suffix);
+    if(len < slen || strcmp(m->metric_name + len - slen, count_suffix))
+      return MTEV_HOOK_CONTINUE;
+  }
+  mtev_atomic_inc64(&bench_events);
+  return MTEV_HOOK_CONTINUE;
+}
+
+static void
+count_events(const char *suffix) {
+  static mtev_boolean hooked = mtev_false;
+  if(!hooked) {
+    check_stats_set_metric_hook_register("noit_bench_modules", count_metric, NULL);
+    hooked = mtev_true;
+  }
+  count_suffix = suffix;
+}
+
+static uint64_t
+events_now(void) {
+  return (uint64_t)bench_events;
+}
+
+/* Wait for the event count to reach target; give up once it has not
+ * moved for settle_ms (the rest is counted as lost).
+ */
+static uint64_t
+events_wait(uint64_t target, int settle_ms) {
+  uint64_t last = events_now(), now;
+  struct timeval start, tv;
+  gettimeofday(&start, NULL);
+  while((now = events_now()) < target) {
+    gettimeofday(&tv, NULL);
+    if(now != last) {
+      last = now;
+      start = tv;
+    }
+    else if((tv.tv_sec - start.tv_sec) * 1000 +
+            (tv.tv_usec - start.tv_usec) / 1000 >= settle_ms)
+      break;
+    usleep(100);
+  }
+  return now;
+}
+
+static int
+module_option_int(const char *module, const char *option, int def) {
+  char xpath[256];
+  int val = def;
+  snprintf(xpath, sizeof(xpath),
+           "//modules//module[@name=\"%s\"]/config/%s", module, option);
+  mtev_conf_get_int(NULL, xpath, &val);
+  return val;
+}
+
+static int
+listener_port(const char *type, int def) {
+  char xpath[256];
+  int val = def;
+  snprintf(xpath, sizeof(xpath),
+           "//listeners//listener[@type=\"%s\"]/@port", type);
+  mtev_conf_get_int(NULL, xpath, &val);
+  return val;
+}
+
+static noit_check_t *
+bench_schedule(const char *target, const char *module, const char *name,
+               mtev_hash_table *config) {
+  uuid_t in, out;
+  uuid_clear(in);
+  noit_poller_schedule(target, module, name, NULL, config, NULL,
+                       60000, 5000, NULL, 0, 0, in, out);
+  return noit_poller_lookup(out);
+}
+
+static int
+bench_fire_cb(eventer_t e, int mask, void *closure, struct timeval *now) {
+  noit_check_t *check = closure;
+  noit_module_t *mod = noit_module_lookup(check->module);
+  if(mod && mod->initiate_check) mod->initiate_check(mod, check, 1, NULL);
+  return 0;
+}
+
+/* Run the check now, on its own eventer thread, as its schedule would. */
+static void
+bench_fire(noit_check_t *check) {
+  eventer_t e = eventer_alloc();
+  e->mask = EVENTER_TIMER;
+  e->callback = bench_fire_cb;
+  e->closure = check;
+  mtev_gettimeofday(&e->whence, NULL);
+  eventer_set_owner(e, CHOOSE_EVENTER_THREAD_FOR_CHECK(check));
+  eventer_add(e);
+}
+
+/* UDP drive: UDP_SOURCES sockets, each bound to its own loopback
+ * address (127.0.0.2 and up) so the module sees that many sources and
+ * routes each by (ip, module) to the checks targeting it, sending the
+ * same datagram from sender threads at once.  Senders stay at most
+ * UDP_WINDOW ops ahead of what has arrived, so the rate is what the
+ * module sustains rather than what the socket buffers drop.  Where
+ * 127.0.0.2 cannot be bound (not every platform routes all of
+ * 127/8), a single 127.0.0.1 source is used.
+ */
+
+#define UDP_SOURCES 64
+#define UDP_MAX_THREADS 4
+#define UDP_MAX_CHECKS_PER_SOURCE 3
+#define UDP_WINDOW 4096
+#define UDP_SETTLE_MS 50
+
+struct udp_drive {
+  const char *module;
+  int port;
+  int threads;
+  int nsources;
+  int fds[UDP_SOURCES];
+  char ips[UDP_SOURCES][INET_ADDRSTRLEN];
+  noit_check_t *checks[UDP_SOURCES * UDP_MAX_CHECKS_PER_SOURCE];
+  int nchecks;
+  mtev_hash_table *config;    /* of the checks, if any */
+  char *payload;
+  int len;
+  int ops_per_datagram;
+  int events_per_op;
+  mtev_atomic64_t sent;       /* ops */
+  uint64_t base;              /* events before this run */
+  uint64_t total_sent;
+  uint64_t total_received;
+};
+
+struct udp_sender {
+  struct udp_drive *ud;
+  int id;
+  uint64_t datagrams;
+};
+
+static uint64_t
+udp_received(struct udp_drive *ud) {
+  return (events_now() - ud->base) / ud->events_per_op;
+}
+
+static void *
+udp_sender_main(void *vs) {
+  struct udp_sender *us = vs;
+  struct udp_drive *ud = us->ud;
+  uint64_t i;
+  int s = us->id % ud->nsources;
+
+  for(i=0; i<us->datagrams; i++) {
+    while((uint64_t)ud->sent > udp_received(ud) + UDP_WINDOW) usleep(20);
+    if(send(ud->fds[s], ud->payload, ud->len, 0) == ud->len)
+      mtev_atomic_add64(&ud->sent, ud->ops_per_datagram);
+    s += ud->threads;
+    if(s >= ud->nsources) s = us->id % ud->nsources;
+  }
+  return NULL;
+}
+
+static int
+udp_bind_source(struct udp_drive *ud, const char *ip) {
+  struct sockaddr_in addr;
+  int fd;
+
+  if((fd = socket(AF_INET, SOCK_DGRAM, 0)) < 0) return -1;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  inet_pton(AF_INET, ip, &addr.sin_addr);
+  if(bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) goto bad;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  addr.sin_port = htons(ud->port);
+  if(connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) goto bad;
+  ud->fds[ud->nsources] = fd;
+  strlcpy(ud->ips[ud->nsources], ip, sizeof(ud->ips[0]));
+  ud->nsources++;
+  return 0;
+ bad:
+  close(fd);
+  return -1;
+}
+
+/* Binds the sources and schedules checks_per_source checks on each; the
+ * caller has set module, port, threads, the payload, the op counts and
+ * optionally the checks' config.
+ */
+static int
+udp_drive_setup(noit_bench_t *b, struct udp_drive *ud, int checks_per_source) {
+  int s, c;
+
+  for(s=0; s<UDP_SOURCES; s++) {
+    char ip[INET_ADDRSTRLEN];
+    snprintf(ip, sizeof(ip), "127.0.0.%d", 2 + s);
+    if(udp_bind_source(ud, ip) != 0) break;
+  }
+  if(ud->nsources == 0 && udp_bind_source(ud, "127.0.0.1") != 0) {
+    noit_bench_fail(b, "cannot send to %s on 127.0.0.1:%d: %s",
+                    ud->module, ud->port, strerror(errno));
+    return -1;
+  }
+  for(s=0; s<ud->nsources; s++) {
+    for(c=0; c<checks_per_source; c++) {
+      char name[64];
+      snprintf(name, sizeof(name), BENCH_CHECK_PREFIX "%s.%d", ud->module, c);
+      if((ud->checks[ud->nchecks] = bench_schedule(ud->ips[s], ud->module, name, ud->config)) == NULL) {
+        noit_bench_fail(b, "cannot schedule a %s check", ud->module);
+        return -1;
+      }
+      ud->nchecks++;
+    }
+  }
+  ud->events_per_op *= checks_per_source;
+
+  /* one datagram from each source proves the path before timing it */
+  ud->base = events_now();
+  ud->sent = 0;
+  for(s=0; s<ud->nsources; s++) {
+    if(send(ud->fds[s], ud->payload, ud->len, 0) == ud->len)
+      mtev_atomic_add64(&ud->sent, ud->ops_per_datagram);
+  }
+  events_wait(ud->base + ud->sent * ud->events_per_op, 2000);
+  if(udp_received(ud) == 0) {
+    noit_bench_fail(b, "nothing arrived from %s on port %d (not loaded?)",
+                    ud->module, ud->port);
+    return -1;
+  }
+  return 0;
+}
+
+static uint64_t
+udp_run(noit_bench_t *b, uint64_t n) {
+  struct udp_drive *ud = b->closure;
+  struct udp_sender senders[UDP_MAX_THREADS];
+  pthread_t tids[UDP_MAX_THREADS];
+  uint64_t datagrams, received;
+  int i;
+
+  datagrams = (n + ud->ops_per_datagram - 1) / ud->ops_per_datagram;
+  ud->base = events_now();
+  ud->sent = 0;
+  for(i=0; i<ud->threads; i++) {
+    senders[i].ud = ud;
+    senders[i].id = i;
+    senders[i].datagrams = (datagrams + ud->threads - 1) / ud->threads;
+    pthread_create(&tids[i], NULL, udp_sender_main, &senders[i]);
+  }
+  for(i=0; i<ud->threads; i++) pthread_join(tids[i], NULL);
+  events_wait(ud->base + ud->sent * ud->events_per_op, UDP_SETTLE_MS);
+  received = udp_received(ud);
+
+  ud->total_sent += ud->sent;
+  ud->total_received += received;
+  snprintf(b->note, sizeof(b->note), "%d sources, loss %.2f%%", ud->nsources,
+           100.0 * (ud->total_sent - ud->total_received) / ud->total_sent);
+  if(received == 0) noit_bench_fail(b, "no %s metrics arrived", ud->module);
+  return received;
+}
+
+static void
+udp_teardown(noit_bench_t *b) {
+  struct udp_drive *ud = b->closure;
+  int i;
+  if(!ud) return;
+  for(i=0; i<ud->nsources; i++) close(ud->fds[i]);
+  for(i=0; i<ud->nchecks; i++)
+    noit_poller_deschedule(ud->checks[i]->checkid, mtev_true);
+  if(ud->config) {
+    mtev_hash_destroy(ud->config, NULL, NULL);
+    free(ud->config);
+  }
+  free(ud->payload);
+  free(ud);
+}
+
+/* statsd: datagrams of STATSD_LINES counters, one check per source; an
+ * op is a line, counted by the "`count" metric it updates.
+ */
+
+#define STATSD_LINES 16
+
+static int
+statsd_setup(noit_bench_t *b, int threads) {
+  struct udp_drive *ud = calloc(1, sizeof(*ud));
+  char buf[1024];
+  int i, len = 0;
+
+  b->closure = ud;
+  ud->module = "statsd";
+  ud->port = module_option_int("statsd", "port", 8125);
+  ud->threads = threads;
+  for(i=0; i<STATSD_LINES; i++)
+    len += snprintf(buf + len, sizeof(buf) - len, "bench.k%02d:1|c\n", i);
+  ud->payload = strdup(buf);
+  ud->len = len;
+  ud->ops_per_datagram = STATSD_LINES;
+  ud->events_per_op = 1;
+  count_events("`count");
+  return udp_drive_setup(b, ud, 1);
+}
+static int statsd_setup_1(noit_bench_t *b) { return statsd_setup(b, 1); }
+static int statsd_setup_4(noit_bench_t *b) { return statsd_setup(b, 4); }
+
+/* collectd: binary protocol packets of COLLECTD_VALUES derive values,
+ * one op per packet, sent plain or signed (security_level 1, the
+ * HMAC-SHA-256 part wrapping the rest) to 1, 2 or 3 checks on each
+ * source.  Every check a packet reaches sets each of its values.
+ */
+
+#define COLLECTD_VALUES 16
+#define COLLECTD_USER "bench"
+#define COLLECTD_SECRET "bench-secret"
+
+static size_t
+collectd_part_string(unsigned char *p, uint16_t type, const char *str) {
+  uint16_t len = 4 + strlen(str) + 1;
+  p[0] = type >> 8; p[1] = type & 0xff;
+  p[2] = len >> 8; p[3] = len & 0xff;
+  memcpy(p + 4, str, len - 4);
+  return len;
+}
+
+static size_t
+collectd_part_number(unsigned char *p, uint16_t type, uint64_t v) {
+  int i;
+  p[0] = type >> 8; p[1] = type & 0xff;
+  p[2] = 0; p[3] = 12;
+  for(i=0; i<8; i++) p[4+i] = (v >> (56 - 8*i)) & 0xff;
+  return 12;
+}
+
+static size_t
+collectd_part_derive(unsigned char *p, int64_t v) {
+  int i;
+  p[0] = 0x00; p[1] = 0x06;  /* values */
+  p[2] = 0; p[3] = 15;
+  p[4] = 0; p[5] = 1;        /* one value */
+  p[6] = 2;                  /* derive */
+  for(i=0; i<8; i++) p[7+i] = ((uint64_t)v >> (56 - 8*i)) & 0xff;
+  return 15;
+}
+
+static int
+collectd_setup(noit_bench_t *b, int checks_per_source, mtev_boolean sign) {
+  struct udp_drive *ud = calloc(1, sizeof(*ud));
+  unsigned char body[1024], *pkt;
+  size_t len = 0, ulen = strlen(COLLECTD_USER), slen;
+  char instance[16];
+  int i;
+
+  b->closure = ud;
+  ud->module = "collectd";
+  ud->port = module_option_int("collectd", "collectd_port", 25826);
+  ud->threads = UDP_MAX_THREADS;
+
+  len += collectd_part_string(body + len, 0x0000, "bench");      /* host */
+  len += collectd_part_number(body + len, 0x0008, (uint64_t)time(NULL) << 30);
+  len += collectd_part_number(body + len, 0x0009, (uint64_t)10 << 30);
+  len += collectd_part_string(body + len, 0x0002, "bench");      /* plugin */
+  len += collectd_part_string(body + len, 0x0004, "derive");     /* type */
+  for(i=0; i<COLLECTD_VALUES; i++) {
+    snprintf(instance, sizeof(instance), "k%02d", i);
+    len += collectd_part_string(body + len, 0x0005, instance);   /* type instance */
+    len += collectd_part_derive(body + len, i * 1000);
+  }
+
+  if(sign) {
+    unsigned int hlen = 0;
+    slen = 4 + 32 + ulen;
+    pkt = malloc(slen + len);
+    pkt[0] = 0x02; pkt[1] = 0x00;
+    pkt[2] = slen >> 8; pkt[3] = slen & 0xff;
+    memcpy(pkt + 36, COLLECTD_USER, ulen);
+    memcpy(pkt + slen, body, len);
+    /* the signature covers the username and everything after it */
+    HMAC(EVP_sha256(), COLLECTD_SECRET, strlen(COLLECTD_SECRET),
+         pkt + 36, ulen + len, pkt + 4, &hlen);
+    len += slen;
+
+    ud->config = calloc(1, sizeof(*ud->config));
+    mtev_hash_init(ud->config);
+    mtev_hash_store(ud->config, "security_level", strlen("security_level"), (void *)"1");
+    mtev_hash_store(ud->config, "username", strlen("username"), (void *)COLLECTD_USER);
+    mtev_hash_store(ud->config, "secret", strlen("secret"), (void *)COLLECTD_SECRET);
+  }
+  else {
+    pkt = malloc(len);
+    memcpy(pkt, body, len);
+  }
+  ud->payload = (char *)pkt;
+  ud->len = len;
+  ud->ops_per_datagram = 1;
+  ud->events_per_op = COLLECTD_VALUES;
+  count_events(NULL);
+  return udp_drive_setup(b, ud, checks_per_source);
+}
+static int collectd_setup_c1(noit_bench_t *b) { return collectd_setup(b, 1, mtev_false); }
+static int collectd_setup_c2(noit_bench_t *b) { return collectd_setup(b, 2, mtev_false); }
+static int collectd_setup_c3(noit_bench_t *b) { return collectd_setup(b, 3, mtev_false); }
+static int collectd_setup_signed_c1(noit_bench_t *b) { return collectd_setup(b, 1, mtev_true); }
+static int collectd_setup_signed_c2(noit_bench_t *b) { return collectd_setup(b, 2, mtev_true); }
+static int collectd_setup_signed_c3(noit_bench_t *b) { return collectd_setup(b, 3, mtev_true); }
+
+/* httptrap: a JSON document of N numeric metrics PUT to the REST
+ * listener, one connection per push, as a client batching its metrics
+ * would.  50k metrics make a body over the default offload_threshold, so
+ * it takes the jobq path; 1k stays inline.  An op is a metric.
+ */
+
+#define HTTPTRAP_SECRET "bench"
+
+struct httptrap_bench {
+  int port;
+  noit_check_t *check;
+  char uuid_str[UUID_STR_LEN + 1];
+  int nmetrics;
+  char *request;
+  size_t request_len;
+};
+
+static int
+httptrap_push(noit_bench_t *b, struct httptrap_bench *hb) {
+  struct sockaddr_in addr;
+  char buf[4096];
+  size_t off = 0, got = 0;
+  ssize_t len;
+  int fd;
+
+  if((fd = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
+    noit_bench_fail(b, "socket: %s", strerror(errno));
+    return -1;
+  }
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  addr.sin_port = htons(hb->port);
+  if(connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+    noit_bench_fail(b, "connect to 127.0.0.1:%d: %s", hb->port, strerror(errno));
+    goto bad;
+  }
+  while(off < hb->request_len) {
+    if((len = write(fd, hb->request + off, hb->request_len - off)) <= 0) {
+      if(len < 0 && errno == EINTR) continue;
+      noit_bench_fail(b, "write: %s", strerror(errno));
+      goto bad;
+    }
+    off += len;
+  }
+  /* Connection: close, so the reply ends at EOF; only its status matters */
+  while((len = read(fd, buf + got, sizeof(buf) - 1 - got)) != 0) {
+    if(len < 0) {
+      if(errno == EINTR) continue;
+      noit_bench_fail(b, "read: %s", strerror(errno));
+      goto bad;
+    }
+    if(got + len < sizeof(buf) - 1) got += len;
+  }
+  buf[got] = '\0';
+  close(fd);
+  if(strncmp(buf, "HTTP/1.1 200", 12) && strncmp(buf, "HTTP/1.0 200", 12)) {
+    char *eol = strchr(buf, '\r');
+    if(eol) *eol = '\0';
+    noit_bench_fail(b, "httptrap answered '%s'", buf);
+    return -1;
+  }
+  return 0;
+ bad:
+  close(fd);
+  return -1;
+}
+
+static int
+httptrap_setup(noit_bench_t *b, int nmetrics) {
+  struct httptrap_bench *hb = calloc(1, sizeof(*hb));
+  mtev_hash_table config;
+  size_t body_len, allocd;
+  char *body;
+  int i, threshold;
+  uint64_t before;
+
+  b->closure = hb;
+  hb->nmetrics = nmetrics;
+  hb->port = listener_port("http_rest_api", 8888);
+
+  mtev_hash_init(&config);
+  mtev_hash_store(&config, "secret", strlen("secret"), (void *)HTTPTRAP_SECRET);
+  hb->check = bench_schedule("127.0.0.1", "httptrap", BENCH_CHECK_PREFIX "httptrap", &config);
+  mtev_hash_destroy(&config, NULL, NULL);
+  if(!hb->check) {
+    noit_bench_fail(b, "cannot schedule an httptrap check");
+    return -1;
+  }
+  mtev_uuid_unparse_lower(hb->check->checkid, hb->uuid_str);
+
+  allocd = 64 + (size_t)nmetrics * 48;
+  body = malloc(allocd);
+  body_len = snprintf(body, allocd, "{");
+  for(i=0; i<nmetrics; i++)
+    body_len += snprintf(body + body_len, allocd - body_len,
+                         "%s\"group%02d`metric%05d\":%d.%d", i ? "," : "",
+                         i % 64, i, i, i % 10);
+  body_len += snprintf(body + body_len, allocd - body_len, "}");
+
+  allocd = body_len + 512;
+  hb->request = malloc(allocd);
+  hb->request_len =
+    snprintf(hb->request, allocd,
+             "PUT /module/httptrap/%s/" HTTPTRAP_SECRET " HTTP/1.1\r\n"
+             "Host: 127.0.0.1:%d\r\n"
+             "Content-Type: application/json\r\n"
+             "Content-Length: %zu\r\n"
+             "Connection: close\r\n\r\n", hb->uuid_str, hb->port, body_len);
+  memcpy(hb->request + hb->request_len, body, body_len);
+  hb->request_len += body_len;
+  free(body);
+
+  threshold = module_option_int("httptrap", "offload_threshold", 1024*1024);
+  snprintf(b->note, sizeof(b->note), "%zu KB body, %s", body_len / 1024,
+           (threshold > 0 && body_len > threshold) ? "offloaded" : "inline");
+
+  /* one push proves the path (and that every metric lands) */
+  count_events(NULL);
+  before = events_now();
+  if(httptrap_push(b, hb) != 0) return -1;
+  if(events_wait(before + nmetrics, 2000) < before + nmetrics) {
+    noit_bench_fail(b, "httptrap applied %d of %d metrics",
+                    (int)(events_now() - before), nmetrics);
+    return -1;
+  }
+  return 0;
+}
+static int httptrap_setup_1k(noit_bench_t *b) { return httptrap_setup(b, 1000); }
+static int httptrap_setup_50k(noit_bench_t *b) { return httptrap_setup(b, 50000); }
+
+static uint64_t
+httptrap_run(noit_bench_t *b, uint64_t n) {
+  struct httptrap_bench *hb = b->closure;
+  uint64_t done = 0;
+  while(done < n) {
+    if(httptrap_push(b, hb) != 0) return 0;
+    done += hb->nmetrics;
+  }
+  return done;
+}
+
+static void
+httptrap_teardown(noit_bench_t *b) {
+  struct httptrap_bench *hb = b->closure;
+  if(!hb) return;
+  if(hb->check) noit_poller_deschedule(hb->check->checkid, mtev_true);
+  free(hb->request);
+  free(hb);
+}
+
+/* graphite vs carbon.lua: carbon plaintext lines written over
+ * persistent loopback TCP connections, one sender thread each, in
+ * blocks of LINE_BLOCK lines and at most LINE_WINDOW lines ahead of
+ * what has been applied.  The same stream goes to the native graphite
+ * module and to the Lua carbon module it replaces.  An op is a line.
+ */
+
+#define LINE_BLOCK 1000
+#define LINE_MAX_CONNS 4
+#define LINE_WINDOW 50000
+#define LINE_SETTLE_MS 1000
+
+struct line_drive {
+  const char *module;
+  noit_check_t *check;
+  int port;
+  int nconns;
+  int fds[LINE_MAX_CONNS];
+  char *block;
+  size_t block_len;
+  mtev_atomic64_t sent;       /* lines */
+  uint64_t base;
+};
+
+struct line_sender {
+  struct line_drive *ld;
+  int fd;
+  uint64_t blocks;
+};
+
+static int
+line_write_block(struct line_drive *ld, int fd) {
+  size_t off = 0;
+  while(off < ld->block_len) {
+    ssize_t rv = write(fd, ld->block + off, ld->block_len - off);
+    if(rv < 0 && errno == EINTR) continue;
+    if(rv <= 0) return -1;
+    off += rv;
+  }
+  mtev_atomic_add64(&ld->sent, LINE_BLOCK);
+  return 0;
+}
+
+static void *
+line_sender_main(void *vs) {
+  struct line_sender *ls = vs;
+  struct line_drive *ld = ls->ld;
+  uint64_t i;
+  for(i=0; i<ls->blocks; i++) {
+    while((uint64_t)ld->sent > events_now() - ld->base + LINE_WINDOW) usleep(20);
+    if(line_write_block(ld, ls->fd) != 0) break;
+  }
+  return NULL;
+}
+
+static int
+line_connect(int port) {
+  struct sockaddr_in addr;
+  int fd;
+  if((fd = socket(AF_INET, SOCK_STREAM, 0)) < 0) return -1;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  addr.sin_port = htons(port);
+  if(connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+/* The caller has scheduled ld->check and set module, port and nconns;
+ * a listener that is still starting gets two seconds.
+ */
+static int
+line_drive_setup(noit_bench_t *b, struct line_drive *ld) {
+  size_t allocd = LINE_BLOCK * 64;
+  long now = (long)time(NULL);
+  int i, tries;
+
+  ld->block = malloc(allocd);
+  for(i=0; i<LINE_BLOCK; i++)
+    ld->block_len += snprintf(ld->block + ld->block_len, allocd - ld->block_len,
+                              "bench.group%02d.k%03d %d.%d %ld\n",
+                              i % 16, i, i, i % 10, now);
+  for(i=0; i<ld->nconns; i++) ld->fds[i] = -1;
+  for(i=0; i<ld->nconns; i++) {
+    for(tries=0; tries<200 && ld->fds[i] < 0; tries++) {
+      if((ld->fds[i] = line_connect(ld->port)) < 0) usleep(10000);
+    }
+    if(ld->fds[i] < 0) {
+      noit_bench_fail(b, "cannot connect to %s on 127.0.0.1:%d: %s",
+                      ld->module, ld->port, strerror(errno));
+      return -1;
+    }
+  }
+
+  /* one block proves the path (and that every line lands) */
+  count_events(NULL);
+  ld->base = events_now();
+  ld->sent = 0;
+  if(line_write_block(ld, ld->fds[0]) != 0 ||
+     events_wait(ld->base + LINE_BLOCK, 2000) < ld->base + LINE_BLOCK) {
+    noit_bench_fail(b, "%s applied %d of %d lines", ld->module,
+                    (int)(events_now() - ld->base), LINE_BLOCK);
+    return -1;
+  }
+  return 0;
+}
+
+static int
+graphite_setup(noit_bench_t *b, int nconns) {
+  struct line_drive *ld = calloc(1, sizeof(*ld));
+
+  b->closure = ld;
+  ld->module = "graphite";
+  ld->port = module_option_int("graphite", "port", 2003);
+  ld->nconns = nconns;
+  if((ld->check = bench_schedule("127.0.0.1", "graphite",
+                                 BENCH_CHECK_PREFIX "graphite", NULL)) == NULL) {
+    noit_bench_fail(b, "cannot schedule a graphite check");
+    return -1;
+  }
+  return line_drive_setup(b, ld);
+}
+static int graphite_setup_1(noit_bench_t *b) { return graphite_setup(b, 1); }
+static int graphite_setup_4(noit_bench_t *b) { return graphite_setup(b, LINE_MAX_CONNS); }
+
+/* carbon.lua takes its port from the check and starts listening on the
+ * check's first run, so that run is fired here rather than waited for.
+ */
+#define CARBON_PORT 18213
+
+static int
+carbon_setup(noit_bench_t *b, int nconns) {
+  struct line_drive *ld = calloc(1, sizeof(*ld));
+  mtev_hash_table config;
+  char port_str[16];
+
+  b->closure = ld;
+  ld->module = "carbon";
+  ld->port = CARBON_PORT;
+  ld->nconns = nconns;
+  if(noit_module_lookup("carbon") == NULL) {
+    noit_bench_fail(b, "the carbon module is not loaded");
+    return -1;
+  }
+  snprintf(port_str, sizeof(port_str), "%d", CARBON_PORT);
+  mtev_hash_init(&config);
+  mtev_hash_store(&config, "port", strlen("port"), (void *)port_str);
+  ld->check = bench_schedule("127.0.0.1", "carbon",
+                             BENCH_CHECK_PREFIX "carbon", &config);
+  mtev_hash_destroy(&config, NULL, NULL);
+  if(!ld->check) {
+    noit_bench_fail(b, "cannot schedule a carbon check");
+    return -1;
+  }
+  bench_fire(ld->check);
+  return line_drive_setup(b, ld);
+}
+static int carbon_setup_1(noit_bench_t *b) { return carbon_setup(b, 1); }
+static int carbon_setup_4(noit_bench_t *b) { return carbon_setup(b, LINE_MAX_CONNS); }
+
+static uint64_t
+line_run(noit_bench_t *b, uint64_t n) {
+  struct line_drive *ld = b->closure;
+  struct line_sender senders[LINE_MAX_CONNS];
+  pthread_t tids[LINE_MAX_CONNS];
+  uint64_t blocks, received;
+  int i;
+
+  blocks = (n + LINE_BLOCK - 1) / LINE_BLOCK;
+  ld->base = events_now();
+  ld->sent = 0;
+  for(i=0; i<ld->nconns; i++) {
+    senders[i].ld = ld;
+    senders[i].fd = ld->fds[i];
+    senders[i].blocks = (blocks + ld->nconns - 1) / ld->nconns;
+    pthread_create(&tids[i], NULL, line_sender_main, &senders[i]);
+  }
+  for(i=0; i<ld->nconns; i++) pthread_join(tids[i], NULL);
+  events_wait(ld->base + ld->sent, LINE_SETTLE_MS);
+  received = events_now() - ld->base;
+  if(received < (uint64_t)ld->sent)
+    noit_bench_fail(b, "%s applied %llu of %llu lines", ld->module,
+                    (unsigned long long)received,
+                    (unsigned long long)ld->sent);
+  return received;
+}
+
+static void
+line_teardown(noit_bench_t *b) {
+  struct line_drive *ld = b->closure;
+  int i;
+  if(!ld) return;
+  for(i=0; i<ld->nconns; i++) if(ld->fds[i] >= 0) close(ld->fds[i]);
+  if(ld->check) noit_poller_deschedule(ld->check->checkid, mtev_true);
+  free(ld->block);
+  free(ld);
+}
+
+/* Lua: the bench_lua module (test/bench/lua) runs config.iterations ops
+ * of one case per run of its check, through the functions http.lua and
+ * resmon.lua use on a response, and sets "bench_ops" when done.  Runs
+ * are fired on the check's own eventer thread, one at a time, in place
+ * of its periodic schedule.  An op is
+ * one body handled (50 metrics) or one check.config read.
+ */
+
+struct lua_bench {
+  noit_check_t *check;
+  int iterations;
+};
+
+static int
+lua_bench_once(noit_bench_t *b, struct lua_bench *lb) {
+  uint64_t before;
+
+  while(lb->check->flags & NP_RUNNING) usleep(10);
+  before = events_now();
+  bench_fire(lb->check);
+  if(events_wait(before + 1, 5000) < before + 1) {
+    noit_bench_fail(b, "bench_lua did not finish a run of %s",
+                    lb->check->name);
+    return -1;
+  }
+  return 0;
+}
+
+static int
+lua_bench_setup(noit_bench_t *b, const char *name, int iterations) {
+  struct lua_bench *lb = calloc(1, sizeof(*lb));
+  mtev_hash_table config;
+  char check_name[64], iter_str[16];
+
+  b->closure = lb;
+  lb->iterations = iterations;
+  if(noit_module_lookup("bench_lua") == NULL) {
+    noit_bench_fail(b, "the bench_lua module is not loaded");
+    return -1;
+  }
+  snprintf(iter_str, sizeof(iter_str), "%d", iterations);
+  snprintf(check_name, sizeof(check_name), BENCH_CHECK_PREFIX "lua.%s", name);
+  mtev_hash_init(&config);
+  mtev_hash_store(&config, "case", strlen("case"), (void *)name);
+  mtev_hash_store(&config, "iterations", strlen("iterations"), (void *)iter_str);
+  count_events("bench_ops");
+  lb->check = bench_schedule("127.0.0.1", "bench_lua", check_name, &config);
+  mtev_hash_destroy(&config, NULL, NULL);
+  if(!lb->check) {
+    noit_bench_fail(b, "cannot schedule %s", check_name);
+    return -1;
+  }
+  /* only the runs fired here count; drop the periodic one */
+  noit_check_fire_event_cancel(lb->check);
+  /* one run loads the Lua side and proves the case exists */
+  return lua_bench_once(b, lb);
+}
+static int lua_bench_extract_setup(noit_bench_t *b) { return lua_bench_setup(b, "http.extract", 200); }
+static int lua_bench_extract_single_setup(noit_bench_t *b) { return lua_bench_setup(b, "http.extract.single", 200); }
+static int lua_bench_resmon_json_setup(noit_bench_t *b) { return lua_bench_setup(b, "resmon.json", 200); }
+static int lua_bench_resmon_xml_setup(noit_bench_t *b) { return lua_bench_setup(b, "resmon.xml", 200); }
+static int lua_bench_config_setup(noit_bench_t *b) { return lua_bench_setup(b, "check.config", 10000); }
+
+static uint64_t
+lua_bench_run(noit_bench_t *b, uint64_t n) {
+  struct lua_bench *lb = b->closure;
+  uint64_t done = 0;
+  while(done < n) {
+    if(lua_bench_once(b, lb) != 0) return 0;
+    done += lb->iterations;
+  }
+  return done;
+}
+
+static void
+lua_bench_teardown(noit_bench_t *b) {
+  struct lua_bench *lb = b->closure;
+  if(!lb) return;
+  if(lb->check) {
+    while(lb->check->flags & NP_RUNNING) usleep(10);
+    noit_poller_deschedule(lb->check->checkid, mtev_true);
+  }
+  free(lb);
+}
+
+/* Per-sample cost with the histogram module tracking every metric of a
+ * check (histogram:<metric>=add), timed one noit_stats_set_metric at a
+ * time so the tail shows: a sample must never pay for a rollover, which
+ * the sweeper on the check's eventer thread does meanwhile.  The same
+ * check untracked gives the floor.  The note is the p99 and p99.9.
+ */
+
+#define SAMPLE_METRICS 1000
+
+struct sample_bench {
+  noit_check_t *check;
+  char *names[SAMPLE_METRICS];
+  histogram_t *latency;
+  uint64_t pos;
+};
+
+static int
+sample_setup(noit_bench_t *b, mtev_boolean tracked) {
+  struct sample_bench *sb = calloc(1, sizeof(*sb));
+  int nmodules = noit_check_registered_module_cnt();
+  int hid = noit_check_registered_module_by_name("histogram");
+  mtev_hash_table **mconfigs = NULL, hconfig;
+  char name[64];
+  uuid_t in, out;
+  int i;
+
+  b->closure = sb;
+  if(hid < 0) {
+    noit_bench_fail(b, "the histogram module is not loaded");
+    return -1;
+  }
+  mtev_hash_init(&hconfig);
+  for(i=0; i<SAMPLE_METRICS; i++) {
+    snprintf(name, sizeof(name), "group%02d`latency%04d", i % 16, i);
+    sb->names[i] = strdup(name);
+    mtev_hash_store(&hconfig, sb->names[i], strlen(sb->names[i]), (void *)"add");
+  }
+  if(tracked) {
+    mconfigs = calloc(nmodules, sizeof(*mconfigs));
+    mconfigs[hid] = &hconfig;
+  }
+  uuid_clear(in);
+  snprintf(name, sizeof(name), BENCH_CHECK_PREFIX "histogram.%s",
+           tracked ? "tracked" : "untracked");
+  noit_poller_schedule("127.0.0.1", "noit_bench", name, NULL, NULL, mconfigs,
+                       60000, 5000, NULL, 0, 0, in, out);
+  mtev_hash_destroy(&hconfig, NULL, NULL);
+  free(mconfigs);
+  if((sb->check = noit_poller_lookup(out)) == NULL) {
+    noit_bench_fail(b, "cannot schedule %s", name);
+    return -1;
+  }
+  sb->latency = hist_alloc();
+  return 0;
+}
+static int sample_tracked_setup(noit_bench_t *b) { return sample_setup(b, mtev_true); }
+static int sample_untracked_setup(noit_bench_t *b) { return sample_setup(b, mtev_false); }
+
+static uint64_t
+sample_run(noit_bench_t *b, uint64_t n) {
+  struct sample_bench *sb = b->closure;
+  double q[2] = { 0.99, 0.999 }, qv[2];
+  uint64_t i;
+
+  for(i=0; i<n; i++) {
+    int idx = sb->pos % SAMPLE_METRICS;
+    double v = ((sb->pos * 13) % 1000) * 0.5;
+    uint64_t start = mtev_gethrtime();
+    noit_stats_set_metric(sb->check, sb->names[idx], METRIC_DOUBLE, &v);
+    hist_insert(sb->latency, (double)(mtev_gethrtime() - start), 1);
+    sb->pos++;
+  }
+  if(hist_approx_quantile(sb->latency, q, 2, qv) == 0)
+    snprintf(b->note, sizeof(b->note), "p99 %.0f ns, p99.9 %.0f ns",
+             qv[0], qv[1]);
+  return n;
+}
+
+static void
+sample_teardown(noit_bench_t *b) {
+  struct sample_bench *sb = b->closure;
+  int i;
+  if(!sb) return;
+  if(sb->check) noit_poller_deschedule(sb->check->checkid, mtev_true);
+  for(i=0; i<SAMPLE_METRICS; i++) free(sb->names[i]);
+  if(sb->latency) hist_free(sb->latency);
+  free(sb);
+}
+
+const noit_bench_case_t noit_bench_module_cases[] = {
+  { "statsd.udp.t1", "statsd over loopback, 64 sources, 1 sender (op: line)",
+    statsd_setup_1, udp_run, udp_teardown },
+  { "statsd.udp.t4", "statsd over loopback, 64 sources, 4 senders (op: line)",
+    statsd_setup_4, udp_run, udp_teardown },
+  { "collectd.udp.c1", "collectd packets, 1 check per source (op: packet)",
+    collectd_setup_c1, udp_run, udp_teardown },
+  { "collectd.udp.c2", "collectd packets, 2 checks per source (op: packet)",
+    collectd_setup_c2, udp_run, udp_teardown },
+  { "collectd.udp.c3", "collectd packets, 3 checks per source (op: packet)",
+    collectd_setup_c3, udp_run, udp_teardown },
+  { "collectd.signed.c1", "signed collectd packets, 1 check per source (op: packet)",
+    collectd_setup_signed_c1, udp_run, udp_teardown },
+  { "collectd.signed.c2", "signed collectd packets, 2 checks per source (op: packet)",
+    collectd_setup_signed_c2, udp_run, udp_teardown },
+  { "collectd.signed.c3", "signed collectd packets, 3 checks per source (op: packet)",
+    collectd_setup_signed_c3, udp_run, udp_teardown },
+  { "httptrap.push.1k", "PUT 1000 metrics to httptrap over loopback (op: metric)",
+    httptrap_setup_1k, httptrap_run, httptrap_teardown },
+  { "httptrap.push.50k", "PUT 50000 metrics to httptrap over loopback (op: metric)",
+    httptrap_setup_50k, httptrap_run, httptrap_teardown },
+  { "graphite.tcp.c1", "carbon plaintext to the graphite module, 1 connection (op: line)",
+    graphite_setup_1, line_run, line_teardown },
+  { "graphite.tcp.c4", "carbon plaintext to the graphite module, 4 connections (op: line)",
+    graphite_setup_4, line_run, line_teardown },
+  { "carbon.lua.c1", "the same lines to carbon.lua, 1 connection (op: line)",
+    carbon_setup_1, line_run, line_teardown },
+  { "carbon.lua.c4", "the same lines to carbon.lua, 4 connections (op: line)",
+    carbon_setup_4, line_run, line_teardown },
+  { "lua.http.extract", "http.lua extract of a 50 metric body, bulk set (op: body)",
+    lua_bench_extract_setup, lua_bench_run, lua_bench_teardown },
+  { "lua.http.extract.single", "the same extract, one check.metric per match (op: body)",
+    lua_bench_extract_single_setup, lua_bench_run, lua_bench_teardown },
+  { "lua.resmon.json", "resmon.lua on a 50 metric JSON document (op: document)",
+    lua_bench_resmon_json_setup, lua_bench_run, lua_bench_teardown },
+  { "lua.resmon.xml", "resmon.lua on a 50 metric XML document (op: document)",
+    lua_bench_resmon_xml_setup, lua_bench_run, lua_bench_teardown },
+  { "lua.check.config", "read check.config from Lua (op: read)",
+    lua_bench_config_setup, lua_bench_run, lua_bench_teardown },
+  { "histogram.sample.tracked", "set a metric the histogram module tracks (op: sample)",
+    sample_tracked_setup, sample_run, sample_teardown },
+  { "histogram.sample.untracked", "set a metric on the same check untracked (op: sample)",
+    sample_untracked_setup, sample_run, sample_teardown },
+  { NULL }
+};
@@ -0,0 +1,522 @@
+/*
+ * Copyright (c) 2017, Circonus, Inc. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above
+ *       copyright notice, this list of conditions and the following
+ *       disclaimer in the documentation and/or other materials provided
+ *       with the distribution.
+ *     * Neither the name Circonus, Inc. nor the names
+ *       of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written
+ *       permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* Pipeline cases: what happens to a metric after a check produces it --
+ * filterset evaluation, numeric rollup accumulation, stratcon's journal
+ * ingestion into in-process rollups and distribution by the metric
+ * director.
+ */
+
+#include "noit_config.h"
+#include <mtev_defines.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <limits.h>
+#include <math.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+
+#include <mtev_log.h>
+#include <mtev_memory.h>
+#include <mtev_hash.h>
+#include <mtev_uuid.h>
+#include <eventer/eventer.h>
+
+#include "noit_metric.h"
+#include "noit_metric_rollup.h"
+#include "noit_metric_director.h"
+#include "noit_message_decoder.h"
+#include "noit_filters.h"
+#include "noit_check.h"
+#include "stratcon_ingest.h"
+#include "stratcon_rollup.h"
+#include "noit_bench.h"
+
+/* Filtersets: each fixture metric against the filtersets of the bench
+ * config, one written with regex rules and one with hash rules.
+ */
+
+struct filter_bench {
+  const char *filterset;
+  int nmetrics;
+  noit_check_t **checks;
+  metric_t **metrics;
+  int pos;
+};
+
+static int
+filter_setup(noit_bench_t *b, const char *filterset) {
+  const noit_bench_feed_t *feed = noit_bench_feed();
+  struct filter_bench *fb = calloc(1, sizeof(*fb));
+  int i, allocd = 0;
+
+  b->closure = fb;
+  fb->filterset = filterset;
+  if(!noit_filter_exists(filterset)) {
+    noit_bench_fail(b, "no filterset %s in the bench config", filterset);
+    return -1;
+  }
+  for(i=0; i<feed->nchecks; i++) {
+    const noit_bench_check_t *c = &feed->checks[i];
+    noit_check_t *check;
+    stats_t *stats;
+    metric_t *m;
+    uint32_t iter = 0;
+
+    if(c->nsamples == 0) continue;
+    if((check = noit_bench_check(c)) == NULL) continue;
+    noit_bench_check_load(check, &c->samples[0], mtev_true);
+    /* Nothing rotates the bench checks again before teardown, so the
+     * metrics stay owned by current after the epoch closes. */
+    mtev_memory_begin();
+    stats = noit_check_get_stats_current(check);
+    while(noit_check_stats_metric_next(stats, &iter, &m)) {
+      if(fb->nmetrics == allocd) {
+        allocd = allocd ? allocd * 2 : 256;
+        fb->checks = realloc(fb->checks, allocd * sizeof(*fb->checks));
+        fb->metrics = realloc(fb->metrics, allocd * sizeof(*fb->metrics));
+      }
+      fb->checks[fb->nmetrics] = check;
+      fb->metrics[fb->nmetrics] = m;
+      fb->nmetrics++;
+    }
+    mtev_memory_end();
+  }
+  if(fb->nmetrics == 0) {
+    noit_bench_fail(b, "no metrics to filter");
+    return -1;
+  }
+  return 0;
+}
+static int filter_regex_setup(noit_bench_t *b) { return filter_setup(b, "bench-regex"); }
+static int filter_hash_setup(noit_bench_t *b) { return filter_setup(b, "bench-hash"); }
+
+static uint64_t
+filter_run(noit_bench_t *b, uint64_t n) {
+  struct filter_bench *fb = b->closure;
+  uint64_t i;
+  for(i=0; i<n; i++) {
+    int idx = fb->pos++ % fb->nmetrics;
+    noit_apply_filterset(fb->filterset, fb->checks[idx], fb->metrics[idx]);
+  }
+  return n;
+}
+
+static void
+filter_teardown(noit_bench_t *b) {
+  struct filter_bench *fb = b->closure;
+  free(fb->checks);
+  free(fb->metrics);
+  free(fb);
+}
+
+/* Numeric rollups: a 1s-resolution series folded into 5 minute windows,
+ * sample by sample and a window at a time.  The values cycle through the
+ * fixture's numeric values with a slow drift so that the derivative and
+ * counter figures are not degenerate.
+ */
+
+#define ROLLUP_SAMPLES 65536
+#define ROLLUP_WINDOW 300
+
+struct rollup_bench {
+  uint64_t *whence_ms;
+  double *values;
+  noit_numeric_rollup_accu accu;
+  int pos;
+};
+
+static void
+rollup_value(noit_metric_value_t *v, uint64_t whence_ms, double value) {
+  memset(v, 0, sizeof(*v));
+  v->whence_ms = whence_ms;
+  v->type = METRIC_DOUBLE;
+  v->value.v_double = value;
+}
+
+static mtev_boolean
+rollup_close(double a, double b, double scale) {
+  return fabs(a - b) <= 1e-4 * (fabs(scale) + fabs(a) + 1e-3);
+}
+
+static int
+rollup_setup(noit_bench_t *b) {
+  const noit_bench_feed_t *feed = noit_bench_feed();
+  struct rollup_bench *rb = calloc(1, sizeof(*rb));
+  double *seeds = NULL;
+  int nseeds = 0, allocd = 0, c, s, m, i;
+
+  b->closure = rb;
+  for(c=0; c<feed->nchecks; c++)
+    for(s=0; s<feed->checks[c].nsamples; s++)
+      for(m=0; m<feed->checks[c].samples[s].nmetrics; m++) {
+        const noit_bench_metric_t *bm = &feed->checks[c].samples[s].metrics[m];
+        char *endptr;
+        double d;
+        if(!bm->value || bm->type == METRIC_STRING) continue;
+        d = strtod(bm->value, &endptr);
+        if(endptr == bm->value || !isfinite(d)) continue;
+        if(nseeds == allocd) {
+          allocd = allocd ? allocd * 2 : 256;
+          seeds = realloc(seeds, allocd * sizeof(*seeds));
+        }
+        seeds[nseeds++] = d;
+      }
+  if(nseeds == 0) {
+    free(seeds);
+    noit_bench_fail(b, "no numeric values in the fixture");
+    return -1;
+  }
+
+  rb->whence_ms = malloc(ROLLUP_SAMPLES * sizeof(*rb->whence_ms));
+  rb->values = malloc(ROLLUP_SAMPLES * sizeof(*rb->values));
+  for(i=0; i<ROLLUP_SAMPLES; i++) {
+    rb->whence_ms[i] = 1500000000000ULL + (uint64_t)i * 1000;
+    rb->values[i] = seeds[i % nseeds] + i * 0.5;
+  }
+  free(seeds);
+
+  /* The batch must produce what the scalar path does, window by window */
+  for(i=0; i<ROLLUP_SAMPLES; i+=ROLLUP_WINDOW) {
+    noit_numeric_rollup_accu sa, ba;
+    int j, cnt = MIN(ROLLUP_WINDOW, ROLLUP_SAMPLES - i);
+    memset(&sa, 0, sizeof(sa));
+    memset(&ba, 0, sizeof(ba));
+    for(j=0; j<cnt; j++) {
+      noit_metric_value_t v;
+      rollup_value(&v, rb->whence_ms[i+j], rb->values[i+j]);
+      noit_metric_rollup_accumulate_numeric(&sa, &v);
+    }
+    noit_metric_rollup_accumulate_numeric_batch(&ba, METRIC_DOUBLE,
+                                                &rb->whence_ms[i],
+                                                &rb->values[i], cnt);
+    if(sa.accumulated.count != ba.accumulated.count ||
+       !rollup_close(sa.accumulated.value.v_double,
+                     ba.accumulated.value.v_double,
+                     sa.accumulated.value.v_double) ||
+       !rollup_close(sa.accumulated.derivative, ba.accumulated.derivative,
+                     sa.accumulated.derivative) ||
+       !rollup_close(sa.accumulated.counter, ba.accumulated.counter,
+                     sa.accumulated.counter)) {
+      noit_bench_fail(b, "batch rollup differs from scalar in window %d",
+                      i / ROLLUP_WINDOW);
+      return -1;
+    }
+  }
+  return 0;
+}
+
+static uint64_t
+rollup_scalar_run(noit_bench_t *b, uint64_t n) {
+  struct rollup_bench *rb = b->closure;
+  uint64_t i;
+  for(i=0; i<n; i++) {
+    noit_metric_value_t v;
+    int idx = rb->pos++ % ROLLUP_SAMPLES;
+    if(idx % ROLLUP_WINDOW == 0) memset(&rb->accu, 0, sizeof(rb->accu));
+    rollup_value(&v, rb->whence_ms[idx], rb->values[idx]);
+    noit_metric_rollup_accumulate_numeric(&rb->accu, &v);
+  }
+  return n;
+}
+
+static uint64_t
+rollup_batch_run(noit_bench_t *b, uint64_t n) {
+  struct rollup_bench *rb = b->closure;
+  uint64_t done = 0;
+  while(done < n) {
+    int idx = rb->pos % ROLLUP_SAMPLES;
+    int cnt = MIN(ROLLUP_WINDOW, ROLLUP_SAMPLES - idx);
+    memset(&rb->accu, 0, sizeof(rb->accu));
+    noit_metric_rollup_accumulate_numeric_batch(&rb->accu, METRIC_DOUBLE,
+                                                &rb->whence_ms[idx],
+                                                &rb->values[idx], cnt);
+    rb->pos += cnt;
+    done += cnt;
+  }
+  return done;
+}
+
+static void
+rollup_teardown(noit_bench_t *b) {
+  struct rollup_bench *rb = b->closure;
+  free(rb->whence_ms);
+  free(rb->values);
+  free(rb);
+}
+
+/* Journal ingestion: the fixture written as stratcon journal files under
+ * <tmp>/<remote>/<cn>/<id>/, swept by stratcon_ingest_sweep_journals and
+ * decoded into in-process rollups as the postgres ingestor does.  The
+ * files are left in place so every sweep sees the same work.
+ */
+
+#define JOURNAL_FILES 4
+
+struct ingest_bench {
+  char base[PATH_MAX];
+  char dir[PATH_MAX];
+  char *files[JOURNAL_FILES];
+  uint64_t lines;
+};
+
+static stratcon_rollup_t *ingest_rollup = NULL;
+static struct ingest_bench *ingesting = NULL;
+
+static int
+ingest_test(const char *file) {
+  return strlen(file) == 16;
+}
+
+static int
+ingest_file(const char *fullpath, const char *remote_str,
+            const char *remote_cn, const char *id_str,
+            const mtev_boolean sweeping) {
+  FILE *fp;
+  char *line = NULL;
+  size_t cap = 0;
+  ssize_t len;
+
+  if((fp = fopen(fullpath, "r")) == NULL) return -1;
+  while((len = getline(&line, &cap, fp)) > 0) {
+    noit_metric_value_t value;
+    const char *name;
+    int name_len;
+    uuid_t id;
+    char namebuf[256];
+
+    if(line[len-1] == '\n') line[--len] = '\0';
+    ingesting->lines++;
+    if(line[0] != 'M') continue;
+    memset(&value, 0, sizeof(value));
+    if(noit_message_decoder_parse_line(line, len, &id, &name, &name_len,
+                                       NULL, NULL, &value, 0) != 1)
+      continue;
+    if(value.type == METRIC_STRING) {
+      if(!value.is_null) free(value.value.v_string);
+      continue;
+    }
+    if(value.is_null || name_len >= (int)sizeof(namebuf)) continue;
+    memcpy(namebuf, name, name_len);
+    namebuf[name_len] = '\0';
+    stratcon_rollup_add(ingest_rollup, 1, (int32_t)(id[0] << 16 | id[1] << 8 | id[2]) + 1,
+                        namebuf, &value);
+  }
+  free(line);
+  fclose(fp);
+  return 0;
+}
+
+static int
+ingest_setup(noit_bench_t *b) {
+  const noit_bench_feed_t *feed = noit_bench_feed();
+  struct ingest_bench *ib = calloc(1, sizeof(*ib));
+  FILE *fp[JOURNAL_FILES];
+  int i;
+
+  b->closure = ib;
+  snprintf(ib->base, sizeof(ib->base), "%s/noit_bench.XXXXXX",
+           getenv("TMPDIR") ? getenv("TMPDIR") : "/tmp");
+  if(mkdtemp(ib->base) == NULL) {
+    noit_bench_fail(b, "mkdtemp(%s) failed", ib->base);
+    ib->base[0] = '\0';
+    return -1;
+  }
+  snprintf(ib->dir, sizeof(ib->dir), "%s/127.0.0.1", ib->base);
+  mkdir(ib->dir, 0700);
+  snprintf(ib->dir, sizeof(ib->dir), "%s/127.0.0.1/noit-bench", ib->base);
+  mkdir(ib->dir, 0700);
+  snprintf(ib->dir, sizeof(ib->dir), "%s/127.0.0.1/noit-bench/00000001", ib->base);
+  mkdir(ib->dir, 0700);
+
+  for(i=0; i<JOURNAL_FILES; i++) {
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/%08x%08x", ib->dir, 1, i + 1);
+    ib->files[i] = strdup(path);
+    if((fp[i] = fopen(path, "w")) == NULL) {
+      noit_bench_fail(b, "cannot write %s", path);
+      while(--i >= 0) fclose(fp[i]);
+      return -1;
+    }
+  }
+  for(i=0; i<feed->nlines; i++)
+    fprintf(fp[i * JOURNAL_FILES / feed->nlines], "%s\n", feed->lines[i]);
+  for(i=0; i<JOURNAL_FILES; i++) fclose(fp[i]);
+
+  if(!ingest_rollup) ingest_rollup = stratcon_rollup_alloc(NULL, 60);
+  return 0;
+}
+
+static uint64_t
+ingest_run(noit_bench_t *b, uint64_t n) {
+  struct ingest_bench *ib = b->closure;
+  ingesting = ib;
+  ib->lines = 0;
+  while(ib->lines < n)
+    stratcon_ingest_sweep_journals(ib->base, ingest_test, ingest_file);
+  ingesting = NULL;
+  return ib->lines;
+}
+
+static void
+ingest_teardown(noit_bench_t *b) {
+  struct ingest_bench *ib = b->closure;
+  stratcon_rollup_row_t *rows;
+  char path[PATH_MAX];
+  int i, nrows;
+
+  if(ingest_rollup) {
+    stratcon_rollup_advance(ingest_rollup, UINT64_MAX / 2);
+    nrows = stratcon_rollup_take(ingest_rollup, 1, &rows);
+    stratcon_rollup_rows_free(rows, nrows);
+  }
+  for(i=0; i<JOURNAL_FILES; i++) {
+    if(!ib->files[i]) continue;
+    unlink(ib->files[i]);
+    free(ib->files[i]);
+  }
+  if(ib->base[0]) {
+    rmdir(ib->dir);
+    snprintf(path, sizeof(path), "%s/127.0.0.1/noit-bench", ib->base);
+    rmdir(path);
+    snprintf(path, sizeof(path), "%s/127.0.0.1", ib->base);
+    rmdir(path);
+    rmdir(ib->base);
+  }
+  free(ib);
+}
+
+/* Metric director: fixture lines handed to the director as logged lines
+ * and drained in batches from this thread's lane, with interest in about
+ * a quarter of the metrics.  Initializing the director hooks it into all
+ * logging, so this runs last.
+ */
+
+#define DIRECTOR_BATCH 256
+
+struct director_bench {
+  mtev_log_stream_t ls;
+  int pos;
+};
+
+static int
+director_interest(short cnt) {
+  const noit_bench_feed_t *feed = noit_bench_feed();
+  int c, m, registered = 0;
+
+  for(c=0; c<feed->nchecks; c++) {
+    const noit_bench_check_t *bc = &feed->checks[c];
+    uuid_t id;
+    if(bc->nsamples == 0) continue;
+    mtev_uuid_copy(id, bc->id);
+    for(m=0; m<bc->samples[0].nmetrics; m+=4) {
+      noit_adjust_metric_interest(id, bc->samples[0].metrics[m].name, cnt);
+      registered++;
+    }
+  }
+  return registered;
+}
+
+static void
+director_drain(void) {
+  noit_metric_message_t *msgs[DIRECTOR_BATCH];
+  int i, cnt;
+  while((cnt = noit_metric_director_lane_next_batch(msgs, DIRECTOR_BATCH)) > 0)
+    for(i=0; i<cnt; i++) noit_metric_director_message_deref(msgs[i]);
+}
+
+static int
+director_setup(noit_bench_t *b) {
+  static mtev_boolean initialized = mtev_false;
+  struct director_bench *db = calloc(1, sizeof(*db));
+
+  b->closure = db;
+  if((db->ls = mtev_log_stream_find("metrics")) == NULL) {
+    noit_bench_fail(b, "no metrics log configured");
+    return -1;
+  }
+  if(!initialized) {
+    noit_metric_director_init();
+    /* the fixture is replayed over and over */
+    noit_metric_director_dedupe(mtev_false);
+    initialized = mtev_true;
+  }
+  noit_metric_director_my_lane();
+  if(director_interest(1) == 0) {
+    noit_bench_fail(b, "no metrics to register interest in");
+    return -1;
+  }
+  return 0;
+}
+
+static uint64_t
+director_run(noit_bench_t *b, uint64_t n) {
+  const noit_bench_feed_t *feed = noit_bench_feed();
+  struct director_bench *db = b->closure;
+  struct timeval now;
+  uint64_t i;
+
+  gettimeofday(&now, NULL);
+  for(i=0; i<n; i++) {
+    int idx = db->pos++ % feed->nlines;
+    mtev_log_line_hook_invoke(db->ls, &now, "", 0, "", 0,
+                              feed->lines[idx], feed->lens[idx]);
+    if(i % DIRECTOR_BATCH == DIRECTOR_BATCH - 1) director_drain();
+  }
+  director_drain();
+  return n;
+}
+
+static void
+director_teardown(noit_bench_t *b) {
+  director_interest(-1);
+  director_drain();
+  free(b->closure);
+}
+
+const noit_bench_case_t noit_bench_pipeline_cases[] = {
+  { "filters.regex", "noit_apply_filterset, regex rules (op: metric)",
+    filter_regex_setup, filter_run, filter_teardown },
+  { "filters.hash", "noit_apply_filterset, hash rules (op: metric)",
+    filter_hash_setup, filter_run, filter_teardown },
+  { "rollup.numeric.scalar", "noit_metric_rollup_accumulate_numeric (op: sample)",
+    rollup_setup, rollup_scalar_run, rollup_teardown },
+  { "rollup.numeric.batch", "noit_metric_rollup_accumulate_numeric_batch (op: sample)",
+    rollup_setup, rollup_batch_run, rollup_teardown },
+  { "ingest.journal", "journal sweep, decode and stratcon_rollup_add (op: line)",
+    ingest_setup, ingest_run, ingest_teardown },
+  { "director.distribute", "metric director, log line to lane (op: line)",
+    director_setup, director_run, director_teardown },
+  { NULL }
+};
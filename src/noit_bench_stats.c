@@ -0,0 +1,231 @@
+/*
+ * Copyright (c) 2017, Circonus, Inc. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above
+ *       copyright notice, this list of conditions and the following
+ *       disclaimer in the documentation and/or other materials provided
+ *       with the distribution.
+ *     * Neither the name Circonus, Inc. nor the names
+ *       of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written
+ *       permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* Stats cases: rotating a check's generations as it completes, and
+ * looking metrics up in them the way httptrap and statsd do, alone and
+ * while the check is being rotated under the lookups.
+ */
+
+#include "noit_config.h"
+#include <mtev_defines.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/time.h>
+
+#include <mtev_log.h>
+#include <mtev_memory.h>
+#include <mtev_hooks.h>
+
+#include "noit_check.h"
+#include "noit_bench.h"
+
+#define BENCH_MODULE "noit_bench"
+
+/* BENCH_MODULE checks never write bundles, so only the stats handling
+ * is measured. */
+static mtev_hook_return_t
+quiet_log_stats(void *closure, noit_check_t *check) {
+  if(check->module && !strcmp(check->module, BENCH_MODULE))
+    return MTEV_HOOK_DONE;
+  return MTEV_HOOK_CONTINUE;
+}
+
+struct stats_bench {
+  int nmetrics;
+  char **names;
+  double *values;
+  noit_check_t *check;
+  uint64_t rotations;
+  /* lookups while rotating */
+  pthread_t rotator;
+  volatile int stop;
+  uint64_t found;
+};
+
+static int
+stats_setup(noit_bench_t *b, int nmetrics) {
+  static mtev_boolean hooked = mtev_false;
+  struct stats_bench *sb = calloc(1, sizeof(*sb));
+  char name[64];
+  int i;
+
+  b->closure = sb;
+  if(!hooked) {
+    check_log_stats_hook_register("noit_bench", quiet_log_stats, NULL);
+    hooked = mtev_true;
+  }
+  snprintf(name, sizeof(name), "stats.%d", nmetrics);
+  if((sb->check = noit_bench_schedule("127.0.0.1", BENCH_MODULE, name)) == NULL) {
+    noit_bench_fail(b, "cannot schedule %s", name);
+    return -1;
+  }
+  sb->nmetrics = nmetrics;
+  sb->names = calloc(nmetrics, sizeof(*sb->names));
+  sb->values = calloc(nmetrics, sizeof(*sb->values));
+  for(i=0; i<nmetrics; i++) {
+    snprintf(name, sizeof(name), "group%d`metric%05d", i % 16, i);
+    sb->names[i] = strdup(name);
+    sb->values[i] = i * 1.5;
+  }
+  return 0;
+}
+
+/* One completion of the check: status, every metric, rotate. */
+static void
+stats_complete(struct stats_bench *sb) {
+  struct timeval now;
+  int i;
+
+  gettimeofday(&now, NULL);
+  noit_stats_set_whence(sb->check, &now);
+  noit_stats_set_state(sb->check, NP_GOOD);
+  noit_stats_set_available(sb->check, NP_AVAILABLE);
+  noit_stats_set_status(sb->check, "ok");
+  for(i=0; i<sb->nmetrics; i++) {
+    sb->values[i] += 1.0;
+    noit_stats_set_metric(sb->check, sb->names[i], METRIC_DOUBLE,
+                          &sb->values[i]);
+  }
+  noit_check_set_stats(sb->check);
+  /* rotated stats are freed safely, reclaim them as the eventer would */
+  if((++sb->rotations & 63) == 0) mtev_memory_maintenance();
+}
+
+static void
+stats_teardown(noit_bench_t *b) {
+  struct stats_bench *sb = b->closure;
+  int i;
+  if(sb->rotator) {
+    sb->stop = 1;
+    pthread_join(sb->rotator, NULL);
+  }
+  if(sb->check) noit_poller_deschedule(sb->check->checkid, mtev_true);
+  mtev_memory_maintenance();
+  for(i=0; i<sb->nmetrics; i++) free(sb->names[i]);
+  free(sb->names);
+  free(sb->values);
+  free(sb);
+}
+
+/* Rotation: set every metric of a check with N metrics then rotate, as
+ * a completing check does. */
+
+static int rotate_10_setup(noit_bench_t *b) { return stats_setup(b, 10); }
+static int rotate_1k_setup(noit_bench_t *b) { return stats_setup(b, 1000); }
+static int rotate_50k_setup(noit_bench_t *b) { return stats_setup(b, 50000); }
+
+static uint64_t
+rotate_run(noit_bench_t *b, uint64_t n) {
+  struct stats_bench *sb = b->closure;
+  uint64_t done = 0;
+
+  while(done < n) {
+    stats_complete(sb);
+    done += sb->nmetrics;
+  }
+  mtev_memory_maintenance();
+  return done;
+}
+
+/* Lookups: noit_stats_get_metric() by name in the current generation of
+ * a check with 1000 metrics, each in its own epoch as httptrap does.
+ * The .rotating case completes the check over and over in another
+ * thread meanwhile, so the generations are swapped under the lookups.
+ */
+
+#define LOOKUP_METRICS 1000
+
+static void *
+rotator_main(void *vsb) {
+  struct stats_bench *sb = vsb;
+  mtev_memory_init_thread();
+  while(!sb->stop) stats_complete(sb);
+  return NULL;
+}
+
+static int
+lookup_setup(noit_bench_t *b, mtev_boolean rotating) {
+  struct stats_bench *sb;
+
+  if(stats_setup(b, LOOKUP_METRICS)) return -1;
+  sb = b->closure;
+  /* two completions so current and previous are both populated */
+  stats_complete(sb);
+  stats_complete(sb);
+  if(rotating &&
+     pthread_create(&sb->rotator, NULL, rotator_main, sb) != 0) {
+    sb->rotator = 0;
+    noit_bench_fail(b, "cannot start the rotating thread");
+    return -1;
+  }
+  return 0;
+}
+static int lookup_setup_still(noit_bench_t *b) { return lookup_setup(b, mtev_false); }
+static int lookup_setup_rotating(noit_bench_t *b) { return lookup_setup(b, mtev_true); }
+
+static uint64_t
+lookup_run(noit_bench_t *b, uint64_t n) {
+  struct stats_bench *sb = b->closure;
+  uint64_t i;
+
+  for(i=0; i<n; i++) {
+    metric_t *m;
+    mtev_memory_begin();
+    m = noit_stats_get_metric(sb->check, noit_check_get_stats_current(sb->check),
+                              sb->names[(i * 7919) % sb->nmetrics]);
+    if(m) sb->found++;
+    mtev_memory_end();
+  }
+  if(sb->found == 0) {
+    noit_bench_fail(b, "lookups found no metrics");
+    return 0;
+  }
+  snprintf(b->note, sizeof(b->note), "%llu rotations",
+           (unsigned long long)sb->rotations);
+  return n;
+}
+
+const noit_bench_case_t noit_bench_stats_cases[] = {
+  { "stats.rotate.10", "set 10 metrics and rotate stats (op: metric)",
+    rotate_10_setup, rotate_run, stats_teardown },
+  { "stats.rotate.1k", "set 1000 metrics and rotate stats (op: metric)",
+    rotate_1k_setup, rotate_run, stats_teardown },
+  { "stats.rotate.50k", "set 50000 metrics and rotate stats (op: metric)",
+    rotate_50k_setup, rotate_run, stats_teardown },
+  { "stats.get_metric", "noit_stats_get_metric, 1000 metrics (op: lookup)",
+    lookup_setup_still, lookup_run, stats_teardown },
+  { "stats.get_metric.rotating", "as above while another thread rotates the check (op: lookup)",
+    lookup_setup_rotating, lookup_run, stats_teardown },
+  { NULL }
+};
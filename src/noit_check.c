@@ -37,12 +37,14 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdarg.h>
 #include <unistd.h>
 #include <ctype.h>
 #include <errno.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <time.h>
+#include <ck_pr.h>
 
 #include <eventer/eventer.h>
 #include <mtev_memory.h>
@@ -130,9 +132,54 @@ free_metric(metric_t *m) {
   if(m->metric_value.i) free(m->metric_value.i);
 }
 
-#define stats_inprogress(c) ((stats_t **)(c->statistics))[STATS_INPROGRESS]
-#define stats_current(c) ((stats_t **)(c->statistics))[STATS_CURRENT]
-#define stats_previous(c) ((stats_t **)(c->statistics))[STATS_PREVIOUS]
+/* Metrics live in a per-check generational store.  Every metric name the
+ * check has ever reported is assigned a stable slot in a name index shared
+ * by all three generations.  A generation is a table of fixed-size pages of
+ * metric_t pointers indexed by slot; a page no metric landed on stays NULL,
+ * so a generation costs only the pages it touches.
+ *
+ * Readers take no lock.  The index is a lock-free hash, and tables, pages
+ * and metrics are published with release stores and retired through safe
+ * memory, so whatever a reader loads stays valid until its mtev_memory
+ * epoch ends.  Writers to the in-progress generation serialize on the
+ * set's lock, and only in-progress pages are ever written in place.
+ *
+ * Rotation takes no lock either.  Previous gets a new table that shares
+ * every page the outgoing current generation left alone, adopts current's
+ * page wherever it covers everything previous held there, and copies only
+ * the pages where the two mix.  No metric name is hashed.
+ */
+#define STATS_PAGE_SHIFT 6
+#define STATS_PAGE_SIZE (1 << STATS_PAGE_SHIFT)
+#define STATS_PAGE_MASK (STATS_PAGE_SIZE - 1)
+
+typedef struct {
+  uint32_t count; /* non-NULL entries in m */
+  metric_t *m[STATS_PAGE_SIZE];
+} stats_page_t;
+
+typedef struct {
+  uint32_t npages;
+  stats_page_t *page[1];
+} stats_pages_t;
+
+typedef struct {
+  stats_t *gen[3];
+  pthread_mutex_t lock;  /* in-progress writers and index inserts */
+  mtev_hash_table index; /* metric name -> slot + 1 */
+  uint32_t nslots;
+  struct check_state_fragment *state; /* see noit_check_state_fragment() */
+} stats_set_t;
+
+#define stats_set(c) ((stats_set_t *)((c)->statistics))
+
+static void noit_check_state_refresh(noit_check_t *check);
+static void noit_check_state_deleted(noit_check_t *check);
+#define stats_gen(c, g) ((stats_t *)ck_pr_load_ptr(&stats_set(c)->gen[g]))
+#define stats_gen_publish(c, g, s) ck_pr_store_ptr(&stats_set(c)->gen[g], (s))
+#define stats_inprogress(c) stats_gen(c, STATS_INPROGRESS)
+#define stats_current(c) stats_gen(c, STATS_CURRENT)
+#define stats_previous(c) stats_gen(c, STATS_PREVIOUS)
 
 stats_t *
 noit_check_get_stats_inprogress(noit_check_t *c) {
@@ -152,7 +199,10 @@ struct stats_t {
   int8_t available;
   int8_t state;
   uint32_t duration;
-  mtev_hash_table metrics;
+  stats_set_t *set;
+  stats_pages_t *pages;
+  uint32_t nmetrics;
+  mtev_boolean merged; /* pages and metrics were handed to previous */
   char status[256];
 };
 
@@ -181,9 +231,41 @@ noit_check_stats_status(stats_t *s, const char *n) {
   if(n) strlcpy(s->status, n, sizeof(s->status));
   return s->status;
 }
-mtev_hash_table *
-noit_check_stats_metrics(stats_t *s) {
-  return &s->metrics;
+uint32_t
+noit_check_stats_metric_count(stats_t *s) {
+  return s->nmetrics;
+}
+static metric_t *
+stats_slot_get(stats_t *s, int64_t slot) {
+  stats_pages_t *pages = ck_pr_load_ptr(&s->pages);
+  stats_page_t *page;
+  if(slot < 0 || !pages || (slot >> STATS_PAGE_SHIFT) >= pages->npages)
+    return NULL;
+  page = ck_pr_load_ptr(&pages->page[slot >> STATS_PAGE_SHIFT]);
+  if(!page) return NULL;
+  return ck_pr_load_ptr(&page->m[slot & STATS_PAGE_MASK]);
+}
+mtev_boolean
+noit_check_stats_metric_next(stats_t *s, uint32_t *iter, metric_t **m) {
+  stats_pages_t *pages = ck_pr_load_ptr(&s->pages);
+  uint32_t i;
+  if(!pages) return mtev_false;
+  for(i = *iter; (i >> STATS_PAGE_SHIFT) < pages->npages; i++) {
+    stats_page_t *page = ck_pr_load_ptr(&pages->page[i >> STATS_PAGE_SHIFT]);
+    metric_t *v;
+    if(!page) {
+      i |= STATS_PAGE_MASK;
+      continue;
+    }
+    v = ck_pr_load_ptr(&page->m[i & STATS_PAGE_MASK]);
+    if(v) {
+      *m = v;
+      *iter = i + 1;
+      return mtev_true;
+    }
+  }
+  *iter = i;
+  return mtev_false;
 }
 void
 noit_stats_set_whence(noit_check_t *c, struct timeval *t) {
@@ -212,26 +294,115 @@ noit_check_safe_free_metric(void *vs) {
     free_metric(m);
   }
 }
+static stats_page_t *
+stats_page_alloc(const stats_page_t *copy) {
+  stats_page_t *page = mtev_memory_safe_malloc(sizeof(*page));
+  if(copy) memcpy(page, copy, sizeof(*page));
+  else memset(page, 0, sizeof(*page));
+  return page;
+}
+static stats_pages_t *
+stats_pages_alloc(uint32_t npages, const stats_pages_t *copy) {
+  size_t len = sizeof(stats_pages_t) + (npages - 1) * sizeof(stats_page_t *);
+  stats_pages_t *pages = mtev_memory_safe_malloc(len);
+  memset(pages, 0, len);
+  pages->npages = npages;
+  if(copy) memcpy(pages->page, copy->page, copy->npages * sizeof(stats_page_t *));
+  return pages;
+}
 static void
 noit_check_safe_free_stats(void *vs) {
   stats_t *s = vs;
-  mtev_hash_destroy(&s->metrics, NULL, (void (*)(void *))mtev_memory_safe_free);
+  uint32_t i, j;
+  if(!s->pages || s->merged) return;
+  for(i=0; i<s->pages->npages; i++) {
+    stats_page_t *page = s->pages->page[i];
+    if(!page) continue;
+    for(j=0; j<STATS_PAGE_SIZE; j++)
+      if(page->m[j]) mtev_memory_safe_free(page->m[j]);
+    mtev_memory_safe_free(page);
+  }
+  mtev_memory_safe_free(s->pages);
 }
 static stats_t *
-noit_check_stats_alloc() {
+noit_check_stats_alloc(stats_set_t *set) {
   stats_t *n;
   n = mtev_memory_safe_malloc_cleanup(sizeof(*n), noit_check_safe_free_stats);
   memset(n, 0, sizeof(*n));
-  mtev_hash_init_locks(&n->metrics, MTEV_HASH_DEFAULT_SIZE, MTEV_HASH_LOCK_MODE_MUTEX);
+  n->set = set;
   return n;
 }
+/* Find (or add) the page of s holding slot; the caller holds the set lock.
+ * A table too small for the slot is replaced and retired, not realloc'd,
+ * as readers may be walking it.
+ */
+static stats_page_t *
+stats_page_reserve(stats_t *s, uint32_t slot) {
+  stats_pages_t *old = s->pages, *n;
+  stats_page_t *page;
+  uint32_t idx = slot >> STATS_PAGE_SHIFT, npages;
+  if(!old || idx >= old->npages) {
+    npages = old ? old->npages * 2 : 1;
+    if(npages < (s->set->nslots + STATS_PAGE_MASK) >> STATS_PAGE_SHIFT)
+      npages = (s->set->nslots + STATS_PAGE_MASK) >> STATS_PAGE_SHIFT;
+    if(npages <= idx) npages = idx + 1;
+    n = stats_pages_alloc(npages, old);
+    ck_pr_store_ptr(&s->pages, n);
+    if(old) mtev_memory_safe_free(old);
+  }
+  page = s->pages->page[idx];
+  if(!page) {
+    page = stats_page_alloc(NULL);
+    ck_pr_store_ptr(&s->pages->page[idx], page);
+  }
+  return page;
+}
+/* Put m in slot of s, returning what it replaced; the caller holds the set
+ * lock and retires the replaced metric. */
+static metric_t *
+stats_slot_put(stats_t *s, uint32_t slot, metric_t *m) {
+  stats_page_t *page = stats_page_reserve(s, slot);
+  metric_t *old = page->m[slot & STATS_PAGE_MASK];
+  ck_pr_store_ptr(&page->m[slot & STATS_PAGE_MASK], m);
+  if(!old) {
+    page->count++;
+    s->nmetrics++;
+  }
+  return old;
+}
+/* Look up the slot for a metric name, or -1 when the name is unknown.  The
+ * lookup takes no lock; with create, a new name is assigned the next slot
+ * and the caller must hold the set lock.
+ */
+static int64_t
+stats_set_slot(stats_set_t *set, const char *name, mtev_boolean create) {
+  void *vslot;
+  int len = strlen(name);
+  if(mtev_hash_retrieve(&set->index, name, len, &vslot))
+    return (int64_t)(uintptr_t)vslot - 1;
+  if(!create) return -1;
+  mtev_hash_store(&set->index, strdup(name), len,
+                  (void *)(uintptr_t)(set->nslots + 1));
+  return set->nslots++;
+}
+static void
+noit_check_safe_free_stats_set(void *vs) {
+  stats_set_t *set = vs;
+  mtev_hash_destroy(&set->index, free, NULL);
+  pthread_mutex_destroy(&set->lock);
+}
 static void *
 noit_check_stats_set_calloc() {
   int i;
-  stats_t **s;
-  s = calloc(sizeof(stats_t *), 3);
-  for(i=0;i<3;i++) s[i] = noit_check_stats_alloc();
-  return s;
+  stats_set_t *set;
+  set = mtev_memory_safe_malloc_cleanup(sizeof(*set),
+                                        noit_check_safe_free_stats_set);
+  memset(set, 0, sizeof(*set));
+  pthread_mutex_init(&set->lock, NULL);
+  mtev_hash_init_locks(&set->index, MTEV_HASH_DEFAULT_SIZE,
+                       MTEV_HASH_LOCK_MODE_MUTEX);
+  for(i=0;i<3;i++) set->gen[i] = noit_check_stats_alloc(set);
+  return set;
 }
 
 /* 20 ms slots over 60 second for distribution */
@@ -280,6 +451,101 @@ noit_poller_lookup_by_name__nolock(char *target, char *name) {
   return mtev_skiplist_find(&polls_by_name, &tmp_check, NULL);
 }
 
+/* Passive receivers (statsd, collectd, ganglia, ...) map the source
+ * address of every packet to checks.  Rather than walking polls_by_name
+ * under polls_lock for each one, we keep an index from "ip\0module" (and
+ * "ip\0" for all modules) to an immutable, sorted array of checks.
+ * Writers (holding polls_lock) build a new array and replace the old one;
+ * readers do a single lock-free probe inside a memory epoch, so both the
+ * replaced array and the replaced key are retired through safe memory.
+ */
+typedef struct {
+  int count;
+  noit_check_t *checks[1];
+} check_ip_set_t;
+static mtev_hash_table ip_module_index;
+static mtev_hash_table ip_module_index_keys; /* checkid -> indexed target_ip */
+static mtev_atomic32_t ip_module_index_generation = 0;
+
+static int
+ip_module_index_key(char *buf, size_t len, const char *ip, const char *module) {
+  size_t iplen = strlen(ip), modlen = module ? strlen(module) : 0;
+  if(iplen + 1 + modlen > len) return -1;
+  memcpy(buf, ip, iplen);
+  buf[iplen] = '\0';
+  if(modlen) memcpy(buf + iplen + 1, module, modlen);
+  return iplen + 1 + modlen;
+}
+static void
+ip_module_index_safe_free(void *vs) {
+  mtev_memory_safe_free(vs);
+}
+static void
+ip_module_index_update__nolock(const char *ip, const char *module,
+                               noit_check_t *check, mtev_boolean add) {
+  char key[INET6_ADDRSTRLEN + 1 + 256], *keycopy;
+  int i, j, klen;
+  void *vs;
+  check_ip_set_t *old = NULL, *new;
+
+  klen = ip_module_index_key(key, sizeof(key), ip, module);
+  if(klen < 0) return;
+  if(mtev_hash_retrieve(&ip_module_index, key, klen, &vs)) old = vs;
+  if(!add) {
+    if(!old) return;
+    for(i=0; i<old->count; i++) if(old->checks[i] == check) break;
+    if(i == old->count) return;
+    if(old->count == 1) {
+      mtev_hash_delete(&ip_module_index, key, klen,
+                       ip_module_index_safe_free, ip_module_index_safe_free);
+      mtev_atomic_inc32(&ip_module_index_generation);
+      return;
+    }
+  }
+  new = mtev_memory_safe_malloc(sizeof(*new) +
+          ((old ? old->count : 0) + 1) * sizeof(noit_check_t *));
+  new->count = 0;
+  /* same order the target_ip skiplist index would yield: by name */
+  for(i=0, j=0; old && i<old->count; i++) {
+    if(old->checks[i] == check) continue;
+    if(add && j == 0 && check->name &&
+       old->checks[i]->name && strcmp(check->name, old->checks[i]->name) < 0) {
+      new->checks[new->count++] = check;
+      j = 1;
+    }
+    new->checks[new->count++] = old->checks[i];
+  }
+  if(add && j == 0) new->checks[new->count++] = check;
+  keycopy = mtev_memory_safe_malloc(klen);
+  memcpy(keycopy, key, klen);
+  mtev_hash_replace(&ip_module_index, keycopy, klen, new,
+                    ip_module_index_safe_free, ip_module_index_safe_free);
+  mtev_atomic_inc32(&ip_module_index_generation);
+}
+static void
+ip_module_index_remove__nolock(noit_check_t *check) {
+  void *vip;
+  if(!mtev_hash_retrieve(&ip_module_index_keys,
+                         (char *)check->checkid, UUID_SIZE, &vip))
+    return;
+  ip_module_index_update__nolock(vip, check->module, check, mtev_false);
+  ip_module_index_update__nolock(vip, NULL, check, mtev_false);
+  mtev_hash_delete(&ip_module_index_keys, (char *)check->checkid, UUID_SIZE,
+                   free, free);
+}
+static void
+ip_module_index_add__nolock(noit_check_t *check) {
+  char *key;
+  ip_module_index_remove__nolock(check);
+  ip_module_index_update__nolock(check->target_ip, check->module,
+                                 check, mtev_true);
+  ip_module_index_update__nolock(check->target_ip, NULL, check, mtev_true);
+  key = malloc(UUID_SIZE);
+  memcpy(key, check->checkid, UUID_SIZE);
+  mtev_hash_store(&ip_module_index_keys, key, UUID_SIZE,
+                  strdup(check->target_ip));
+}
+
 static int
 noit_console_show_timing_slots(mtev_console_closure_t ncct,
                                int argc, char **argv,
@@ -323,7 +589,9 @@ noit_check_add_to_list(noit_check_t *new_check, const char *newname) {
       mtevL(noit_error, "Check %s`%s disabled due to naming conflict\n",
             new_check->target, new_check->name);
       new_check->flags |= NP_DISABLED;
+      ip_module_index_remove__nolock(new_check);
     }
+    else ip_module_index_add__nolock(new_check);
     if(oldname) free(oldname);
   }
   pthread_mutex_unlock(&polls_lock);
@@ -404,6 +672,10 @@ check_slots_adjust_tv(struct timeval *tv, short adj) {
   check_slots_count[idx] += adj;
   check_slots_seconds_count[offset_ms / 1000] += adj;
 }
+mtev_boolean
+noit_check_is_priority_scheduled(noit_check_t *check) {
+  return priority_scheduling && check->period && (check->period % 60000) == 0;
+}
 void check_slots_inc_tv(struct timeval *tv) {
   check_slots_adjust_tv(tv, 1);
 }
@@ -895,6 +1167,9 @@ noit_poller_init() {
                             __check_target_ip_compare);
   mtev_skiplist_add_index(&polls_by_name, __check_target_compare,
                             __check_target_compare);
+  mtev_hash_init_locks(&ip_module_index, MTEV_HASH_DEFAULT_SIZE,
+                       MTEV_HASH_LOCK_MODE_MUTEX);
+  mtev_hash_init(&ip_module_index_keys);
   mtev_skiplist_init(&watchlist);
   mtev_skiplist_set_compare(&watchlist, __watchlist_compare,
                             __watchlist_compare);
@@ -1313,6 +1588,7 @@ noit_check_update(noit_check_t *new_check,
     noit_check_activate(new_check);
 
   noit_check_add_to_list(new_check, NULL);
+  noit_check_state_refresh(new_check);
   check_updated_hook_invoke(new_check);
   return 0;
 }
@@ -1396,12 +1672,7 @@ noit_poller_free_check_internal(noit_check_t *checker, mtev_boolean has_lock) {
 
   mod = noit_module_lookup(checker->module);
   if(mod && mod->cleanup) mod->cleanup(mod, checker);
-  if(checker->fire_event) {
-     eventer_remove(checker->fire_event);
-     free(eventer_get_closure(checker->fire_event));
-     eventer_free(checker->fire_event);
-     checker->fire_event = NULL;
-  }
+  noit_check_fire_event_cancel(checker);
   if(checker->closure) free(checker->closure);
   if(checker->target) free(checker->target);
   if(checker->module) free(checker->module);
@@ -1438,8 +1709,10 @@ noit_poller_free_check_internal(noit_check_t *checker, mtev_boolean has_lock) {
   mtev_memory_safe_free(stats_inprogress(checker));
   mtev_memory_safe_free(stats_current(checker));
   mtev_memory_safe_free(stats_previous(checker));
+  if(stats_set(checker)->state)
+    mtev_memory_safe_free(stats_set(checker)->state);
 
-  free(checker->statistics);
+  mtev_memory_safe_free(checker->statistics);
 
   mtev_memory_safe_free(checker);
 }
@@ -1500,8 +1773,12 @@ noit_poller_deschedule(uuid_t in, mtev_boolean log) {
   checker->flags |= (NP_DISABLED|NP_KILLED);
 
   if(log) noit_check_log_delete(checker);
+  noit_check_state_deleted(checker);
 
+  pthread_mutex_lock(&polls_lock);
   mtevAssert(mtev_skiplist_remove(&polls_by_name, checker, NULL));
+  ip_module_index_remove__nolock(checker);
+  pthread_mutex_unlock(&polls_lock);
   mtevAssert(mtev_hash_delete(&polls, (char *)in, UUID_SIZE, NULL, NULL));
 
   check_deleted_hook_invoke(checker);
@@ -1526,55 +1803,32 @@ noit_poller_lookup_by_name(char *target, char *name) {
   pthread_mutex_unlock(&polls_lock);
   return check;
 }
+static check_ip_set_t *
+ip_module_index_lookup(const char *ip, const char *module) {
+  char key[INET6_ADDRSTRLEN + 1 + 256];
+  int klen;
+  void *vs;
+  klen = ip_module_index_key(key, sizeof(key), ip, module);
+  if(klen < 0) return NULL;
+  if(mtev_hash_retrieve(&ip_module_index, key, klen, &vs)) return vs;
+  return NULL;
+}
+uint32_t
+noit_poller_target_ip_generation() {
+  return (uint32_t)ip_module_index_generation;
+}
 int
 noit_poller_target_ip_do(const char *target_ip,
                          int (*f)(noit_check_t *, void *),
                          void *closure) {
-  int i, count = 0, todo_count = 0;
-  noit_check_t pivot;
-  mtev_skiplist *tlist;
-  mtev_skiplist_node *next;
-  noit_check_t *todo_onstack[8192];
-  noit_check_t **todo = todo_onstack;
-
-  tlist = mtev_skiplist_find(polls_by_name.index,
-                             __check_target_ip_compare, NULL);
-
-  pthread_mutex_lock(&polls_lock);
-  /* First pass to count */
-  memset(&pivot, 0, sizeof(pivot));
-  strlcpy(pivot.target_ip, (char*)target_ip, sizeof(pivot.target_ip));
-  pivot.name = "";
-  pivot.target = "";
-  mtev_skiplist_find_neighbors(tlist, &pivot, NULL, NULL, &next);
-  while(next && next->data) {
-    noit_check_t *check = next->data;
-    if(strcmp(check->target_ip, target_ip)) break;
-    todo_count++;
-    mtev_skiplist_next(tlist, &next);
-  }
-
-  if(todo_count > 8192) todo = malloc(todo_count * sizeof(*todo));
-
-  memset(&pivot, 0, sizeof(pivot));
-  strlcpy(pivot.target_ip, (char*)target_ip, sizeof(pivot.target_ip));
-  pivot.name = "";
-  pivot.target = "";
-  mtev_skiplist_find_neighbors(tlist, &pivot, NULL, NULL, &next);
-  while(next && next->data) {
-    noit_check_t *check = next->data;
-    if(strcmp(check->target_ip, target_ip)) break;
-    if(count < todo_count) todo[count++] = check;
-    mtev_skiplist_next(tlist, &next);
-  }
-  pthread_mutex_unlock(&polls_lock);
-
-  todo_count = count;
-  count = 0;
-  for(i=0;i<todo_count;i++)
-    count += f(todo[i],closure);
-
-  if(todo != todo_onstack) free(todo);
+  int i, count = 0;
+  check_ip_set_t *set;
+
+  mtev_memory_begin();
+  set = ip_module_index_lookup(target_ip, NULL);
+  for(i=0; set && i<set->count; i++)
+    count += f(set->checks[i],closure);
+  mtev_memory_end();
   return count;
 }
 int
@@ -1668,12 +1922,15 @@ static int ip_module_collector(noit_check_t *check, void *cl) {
 int
 noit_poller_lookup_by_ip_module(const char *ip, const char *mod,
                                 noit_check_t **checks, int nchecks) {
-  struct ip_module_collector_crutch crutch;
-  crutch.array = checks;
-  crutch.allocd = nchecks;
-  crutch.idx = 0;
-  crutch.module = mod;
-  return noit_poller_target_ip_do(ip, ip_module_collector, &crutch);
+  int i;
+  check_ip_set_t *set;
+
+  mtev_memory_begin();
+  set = ip_module_index_lookup(ip, mod);
+  for(i=0; set && i<set->count && i<nchecks; i++)
+    checks[i] = set->checks[i];
+  mtev_memory_end();
+  return i;
 }
 int
 noit_poller_lookup_by_module(const char *ip, const char *mod,
@@ -1793,32 +2050,52 @@ bad_check_initiate(noit_module_t *self, noit_check_t *check,
   check->flags &= ~NP_RUNNING;
   return 0;
 }
-void
-noit_check_stats_clear(noit_check_t *check, stats_t *s) {
-  memset(s, 0, sizeof(*s));
-  s->state = NP_UNKNOWN;
-  s->available = NP_UNKNOWN;
+static void
+__stats_add_metric(stats_t *newstate, metric_t *m) {
+  stats_set_t *set = newstate->set;
+  metric_t *old;
+  pthread_mutex_lock(&set->lock);
+  old = stats_slot_put(newstate,
+                       stats_set_slot(set, m->metric_name, mtev_true), m);
+  pthread_mutex_unlock(&set->lock);
+  if(old) mtev_memory_safe_free(old);
 }
 
 static void
-__stats_add_metric(stats_t *newstate, metric_t *m) {
-  mtev_hash_replace(&newstate->metrics, m->metric_name, strlen(m->metric_name),
-                    m, NULL, (void (*)(void *))mtev_memory_safe_free);
+__stats_add_metrics(stats_t *newstate, metric_t **ms, int cnt,
+                    mtev_boolean logged) {
+  stats_set_t *set = newstate->set;
+  metric_t *old;
+  int i;
+  pthread_mutex_lock(&set->lock);
+  for(i=0; i<cnt; i++) {
+    ms[i]->logged = logged;
+    old = stats_slot_put(newstate,
+                         stats_set_slot(set, ms[i]->metric_name, mtev_true),
+                         ms[i]);
+    if(old) mtev_memory_safe_free(old);
+  }
+  pthread_mutex_unlock(&set->lock);
 }
 
 static mtev_boolean
 __mark_metric_logged(stats_t *newstate, metric_t *m) {
-  void *vm;
-  if(mtev_hash_retrieve(&newstate->metrics,
-      m->metric_name, strlen(m->metric_name), &vm)) {
-    ((metric_t *)vm)->logged = mtev_true;
-    return mtev_false;
+  stats_set_t *set = newstate->set;
+  mtev_boolean added = mtev_false;
+  metric_t *existing;
+  int64_t slot;
+  pthread_mutex_lock(&set->lock);
+  slot = stats_set_slot(set, m->metric_name, mtev_true);
+  existing = stats_slot_get(newstate, slot);
+  if(existing) {
+    existing->logged = mtev_true;
   } else {
     m->logged = mtev_true;
-    mtev_hash_replace(&newstate->metrics, m->metric_name, strlen(m->metric_name),
-                        m, NULL, (void (*)(void *))mtev_memory_safe_free);
-    return mtev_true;
+    stats_slot_put(newstate, slot, m);
+    added = mtev_true;
   }
+  pthread_mutex_unlock(&set->lock);
+  return added;
 }
 
 static size_t
@@ -1851,118 +2128,27 @@ noit_metric_sizes(metric_type_t type, const void *value) {
 }
 static metric_type_t
 noit_metric_guess_type(const char *s, void **replacement) {
-  char *copy, *cp, *trailer, *rpl;
-  int negative = 0;
-  metric_type_t type = METRIC_STRING;
+  noit_metric_value_t v;
+  metric_type_t type;
 
   if(!s) return METRIC_GUESS;
-  copy = cp = strdup(s);
-
-  /* TRIM the string */
-  while(*cp && isspace(*cp)) cp++; /* ltrim */
-  s = cp; /* found a good starting point */
-  while(*cp) cp++; /* advance to \0 */
-  cp--; /* back up one */
-  while(cp > s && isspace(*cp)) *cp-- = '\0'; /* rtrim */
-
-  /* Find the first space */
-  cp = (char *)s;
-  while(*cp && !isspace(*cp)) cp++;
-  trailer = cp;
-  cp--; /* backup one */
-  if(cp > s && *cp == '%') *cp-- = '\0'; /* chop a last % is there is one */
-
-  while(*trailer && isspace(*trailer)) *trailer++ = '\0'; /* rtrim */
-
-  /* string was       '  -1.23e-01%  inodes used  ' */
-  /* copy is (~ = \0) '  -1.23e-01~  inodes used~~' */
-  /*                     ^           ^              */
-  /*                     s           trailer        */
-
-  /* So, the trailer must not contain numbers */
-  while(*trailer) { if(isdigit(*trailer)) goto notanumber; trailer++; }
-
-  /* And the 's' must be of the form:
-   *  0) may start with a sign [-+]?
-   *  1) [1-9][0-9]*
-   *  2) [0]?.[0-9]+
-   *  3) 0
-   *  4) [1-9][0-9]*.[0-9]+
-   *  5) all of the above ending with e[+-][0-9]+
-   */
-   rpl = (char *)s;
-   /* CASE 0 */
-   if(s[0] == '-' || s[0] == '+') {
-     if(s[0] == '-') negative = 1;
-     s++;
-   }
-
-   if(s[0] == '.') goto decimal; /* CASE 2 */
-   if(s[0] == '0') { /* CASE 2 & 3 */
-     s++;
-     if(!s[0]) goto scanint; /* CASE 3 */
-     if(s[0] == '.') goto decimal; /* CASE 2 */
-     goto notanumber;
-   }
-   if(s[0] >= '1' && s[0] <= '9') { /* CASE 1 & 4 */
-     s++;
-     while(isdigit(s[0])) s++; /* CASE 1 & 4 */
-     if(!s[0]) goto scanint; /* CASE 1 */
-     if(s[0] == '.') goto decimal; /* CASE 4 */
-     goto notanumber;
-   }
-   /* Not case 1,2,3,4 */
-   goto notanumber;
-
-  decimal:
-   s++;
-   if(!isdigit(s[0])) goto notanumber;
-   s++;
-   while(isdigit(s[0])) s++;
-   if(!s[0]) goto scandouble;
-   if(s[0] == 'e' || s[0] == 'E') goto exponent; /* CASE 5 */
-   goto notanumber;
-
-  exponent:
-   s++;
-   if(s[0] != '-' && s[0] != '+') goto notanumber;
-   s++;
-   if(!isdigit(s[0])) goto notanumber;
-   s++;
-   while(isdigit(s[0])) s++;
-   if(!s[0]) goto scandouble;
-   goto notanumber;
-
- scanint:
-   if(negative) {
-     int64_t *v;
-     v = malloc(sizeof(*v));
-     *v = strtoll(rpl, NULL, 10);
-     *replacement = v;
-     type = METRIC_INT64;
-     goto alldone;
-   }
-   else {
-     uint64_t *v;
-     v = malloc(sizeof(*v));
-     *v = strtoull(rpl, NULL, 10);
-     *replacement = v;
-     type = METRIC_UINT64;
-     goto alldone;
-   }
- scandouble:
-   {
-     double *v;
-     v = malloc(sizeof(*v));
-     *v = strtod(rpl, NULL);
-     *replacement = v;
-     type = METRIC_DOUBLE;
-     goto alldone;
-   }
-
- alldone:
- notanumber:
-  free(copy);
+  type = noit_metric_guess_value(s, strlen(s), &v);
+  switch(type) {
+    case METRIC_INT64:
+      *replacement = malloc(sizeof(int64_t));
+      *(int64_t *)*replacement = v.value.v_int64;
+      break;
+    case METRIC_UINT64:
+      *replacement = malloc(sizeof(uint64_t));
+      *(uint64_t *)*replacement = v.value.v_uint64;
+      break;
+    case METRIC_DOUBLE:
+      *replacement = malloc(sizeof(double));
+      *(double *)*replacement = v.value.v_double;
+      break;
+    default:
+      break;
+  }
   return type;
 }
 
@@ -2013,12 +2199,9 @@ noit_stats_populate_metric(metric_t *m, const char *name, metric_type_t type,
 metric_t *
 noit_stats_get_metric(noit_check_t *check,
                       stats_t *newstate, const char *name) {
-  void *v;
   if(newstate == NULL)
     newstate = stats_inprogress(check);
-  if(mtev_hash_retrieve(&newstate->metrics, name, strlen(name), &v))
-    return (metric_t *)v;
-  return NULL;
+  return stats_slot_get(newstate, stats_set_slot(newstate->set, name, mtev_false));
 }
 
 metric_t *
@@ -2049,6 +2232,40 @@ noit_stats_set_metric(noit_check_t *check,
   __stats_add_metric(c, m);
 }
 
+int
+noit_stats_set_metric_batch(noit_check_t *check,
+                            const noit_stats_batch_metric_t *batch,
+                            int cnt, mtev_boolean log_immediate) {
+  metric_t *stack_ms[256], **ms = stack_ms;
+  struct timeval now;
+  stats_t *c;
+  int i, n = 0;
+
+  if(cnt <= 0) return 0;
+  if(cnt > sizeof(stack_ms)/sizeof(*stack_ms))
+    ms = malloc(cnt * sizeof(*ms));
+  c = noit_check_get_stats_inprogress(check);
+  for(i=0; i<cnt; i++) {
+    metric_t *m = mtev_memory_safe_malloc_cleanup(sizeof(*m), noit_check_safe_free_metric);
+    memset(m, 0, sizeof(*m));
+    if(noit_stats_populate_metric(m, batch[i].name, batch[i].type, batch[i].value)) {
+      mtev_memory_safe_free(m);
+      continue;
+    }
+    check_stats_set_metric_hook_invoke(check, c, m);
+    ms[n++] = m;
+  }
+  noit_check_metric_count_add(n);
+  /* Log before they are marked, logging skips logged metrics */
+  if(log_immediate && n > 0) {
+    gettimeofday(&now, NULL);
+    noit_check_log_metric_batch(check, &now, ms, n);
+  }
+  __stats_add_metrics(c, ms, n, log_immediate);
+  if(ms != stack_ms) free(ms);
+  return n;
+}
+
 void
 noit_stats_set_metric_coerce(noit_check_t *check,
                              const char *name, metric_type_t t,
@@ -2209,12 +2426,17 @@ noit_check_passive_set_stats(noit_check_t *check) {
     wcheck->statistics = backup;
   }
 }
+/* Fold src (the outgoing current generation) into tgt (previous).  tgt
+ * gets a new table that shares the pages src left empty, adopts src's page
+ * wherever it covers all tgt held there and copies only the pages where
+ * they mix; it is published whole, so readers see the fold all at once.
+ * Metrics src supersedes are retired, as are src's leftover pages and its
+ * table, and src is marked merged so freeing it leaves the rest alone.
+ */
 static void
 stats_merge(stats_t *tgt, stats_t *src) {
-  mtev_hash_iter iter = MTEV_HASH_ITER_ZERO;
-  const char *name;
-  int namelen;
-  void *vm;
+  stats_pages_t *from, *to, *n;
+  uint32_t i, k, npages, nmetrics;
 
   if(!src) return;
 
@@ -2224,11 +2446,225 @@ stats_merge(stats_t *tgt, stats_t *src) {
   tgt->state = src->state;
   tgt->duration = src->duration;
 
-  while(mtev_hash_next(&src->metrics, &iter, &name, &namelen, &vm)) {
-    __stats_add_metric(tgt, (metric_t *)vm);
+  from = src->pages;
+  if(!from) return;
+  to = tgt->pages;
+  npages = from->npages;
+  if(to && to->npages > npages) npages = to->npages;
+  n = stats_pages_alloc(npages, to);
+  nmetrics = tgt->nmetrics;
+  for(k=0; k<from->npages; k++) {
+    stats_page_t *fp = from->page[k], *tp = n->page[k], *np;
+    if(!fp) continue;
+    if(fp->count == 0) {
+      mtev_memory_safe_free(fp);
+      continue;
+    }
+    if(!tp) {
+      n->page[k] = fp;
+      nmetrics += fp->count;
+      continue;
+    }
+    for(i=0; i<STATS_PAGE_SIZE; i++)
+      if(tp->m[i] && !fp->m[i]) break;
+    if(i == STATS_PAGE_SIZE) {
+      for(i=0; i<STATS_PAGE_SIZE; i++)
+        if(tp->m[i]) mtev_memory_safe_free(tp->m[i]);
+      nmetrics += fp->count - tp->count;
+      n->page[k] = fp;
+    }
+    else {
+      np = stats_page_alloc(tp);
+      for(i=0; i<STATS_PAGE_SIZE; i++) {
+        if(!fp->m[i]) continue;
+        if(np->m[i]) mtev_memory_safe_free(np->m[i]);
+        else {
+          np->count++;
+          nmetrics++;
+        }
+        np->m[i] = fp->m[i];
+      }
+      n->page[k] = np;
+      mtev_memory_safe_free(fp);
+    }
+    mtev_memory_safe_free(tp);
+  }
+  tgt->nmetrics = nmetrics;
+  ck_pr_store_ptr(&tgt->pages, n);
+  if(to) mtev_memory_safe_free(to);
+  mtev_memory_safe_free(from);
+  src->merged = mtev_true;
+}
+/* Pre-serialized check state.  Listing every check through json-c is
+ * far too slow with many checks, so each check carries the stable part of
+ * its summary as a JSON fragment, rebuilt when it is reconfigured or
+ * reports.  Every rebuild (and every deletion) takes the next value of a
+ * global state generation so REST clients can ask what changed since a
+ * generation they have seen.  Readers rely on mtev_memory epochs, as they
+ * do for the stats themselves.
+ */
+struct check_state_fragment {
+  uint64_t gen;
+  size_t len;
+  char json[1];
+};
+
+static mtev_atomic64_t check_state_gen = 0;
+
+#define STATE_DELETED_HISTORY 4096
+static struct {
+  uuid_t id;
+  uint64_t gen;
+} state_deleted[STATE_DELETED_HISTORY];
+static uint64_t state_deleted_cnt = 0;
+static uint64_t state_deleted_floor = 0; /* deletions <= this may be lost */
+static pthread_mutex_t state_deleted_lock = PTHREAD_MUTEX_INITIALIZER;
+
+typedef struct {
+  char *buf;
+  size_t len;
+  size_t alloc;
+} state_buf_t;
+
+static void
+state_buf_append(state_buf_t *b, const char *s, size_t len) {
+  if(b->len + len + 1 > b->alloc) {
+    while(b->len + len + 1 > b->alloc) b->alloc = b->alloc ? b->alloc * 2 : 512;
+    b->buf = realloc(b->buf, b->alloc);
+  }
+  memcpy(b->buf + b->len, s, len);
+  b->len += len;
+}
+static void
+state_buf_printf(state_buf_t *b, const char *fmt, ...) {
+  char scratch[256];
+  va_list ap;
+  int len;
+  va_start(ap, fmt);
+  len = vsnprintf(scratch, sizeof(scratch), fmt, ap);
+  va_end(ap);
+  if(len < 0) return;
+  if(len >= (int)sizeof(scratch)) len = sizeof(scratch) - 1;
+  state_buf_append(b, scratch, len);
+}
+static void
+state_buf_json_str(state_buf_t *b, const char *s) {
+  const char *cp, *start;
+  if(!s) {
+    state_buf_append(b, "null", 4);
+    return;
+  }
+  state_buf_append(b, "\"", 1);
+  for(start = cp = s; *cp; cp++) {
+    unsigned char c = *cp;
+    if(c != '"' && c != '\\' && c >= 0x20) continue;
+    state_buf_append(b, start, cp - start);
+    if(c == '"') state_buf_append(b, "\\\"", 2);
+    else if(c == '\\') state_buf_append(b, "\\\\", 2);
+    else state_buf_printf(b, "\\u%04x", c);
+    start = cp + 1;
   }
-  mtev_hash_delete_all(&src->metrics, NULL, NULL);
+  state_buf_append(b, start, cp - start);
+  state_buf_append(b, "\"", 1);
 }
+
+/* Must match the keys and value types noit_check_state_as_json() uses. */
+static void
+noit_check_state_refresh(noit_check_t *check) {
+  stats_set_t *set = stats_set(check);
+  struct check_state_fragment *frag, *old;
+  state_buf_t b = { NULL, 0, 0 };
+  struct timeval *t = NULL;
+  uint64_t ms = 0;
+
+  if(!set || (check->flags & NP_TRANSIENT)) return;
+
+  state_buf_append(&b, "\"name\":", 7);
+  state_buf_json_str(&b, check->name);
+  state_buf_append(&b, ",\"module\":", 10);
+  state_buf_json_str(&b, check->module);
+  state_buf_append(&b, ",\"target\":", 10);
+  state_buf_json_str(&b, check->target);
+  state_buf_append(&b, ",\"target_ip\":", 13);
+  state_buf_json_str(&b, check->target_ip);
+  state_buf_append(&b, ",\"filterset\":", 13);
+  state_buf_json_str(&b, check->filterset);
+  if(stats_current(check)) t = noit_check_stats_whence(stats_current(check), NULL);
+  if(t) ms = (uint64_t)t->tv_sec * 1000ULL + t->tv_usec / 1000;
+  state_buf_printf(&b, ",\"seq\":\"%lld\",\"period\":%u,\"timeout\":%u,"
+                   "\"last_run\":%llu",
+                   (long long)check->config_seq, check->period,
+                   check->timeout, (unsigned long long)ms);
+
+  frag = mtev_memory_safe_malloc(sizeof(*frag) + b.len);
+  memcpy(frag->json, b.buf, b.len);
+  frag->json[b.len] = '\0';
+  frag->len = b.len;
+  free(b.buf);
+
+  pthread_mutex_lock(&set->lock);
+  frag->gen = mtev_atomic_inc64(&check_state_gen);
+  old = set->state;
+  /* readers load this without the lock */
+  ck_pr_store_ptr(&set->state, frag);
+  pthread_mutex_unlock(&set->lock);
+  if(old) mtev_memory_safe_free(old);
+}
+
+static void
+noit_check_state_deleted(noit_check_t *check) {
+  uint64_t idx;
+  if(check->flags & NP_TRANSIENT) return;
+  pthread_mutex_lock(&state_deleted_lock);
+  idx = state_deleted_cnt++ % STATE_DELETED_HISTORY;
+  if(state_deleted_cnt > STATE_DELETED_HISTORY)
+    state_deleted_floor = state_deleted[idx].gen;
+  mtev_uuid_copy(state_deleted[idx].id, check->checkid);
+  state_deleted[idx].gen = mtev_atomic_inc64(&check_state_gen);
+  pthread_mutex_unlock(&state_deleted_lock);
+}
+
+const char *
+noit_check_state_fragment(noit_check_t *check, size_t *len, uint64_t *gen) {
+  struct check_state_fragment *frag;
+  if(!check->statistics) return NULL;
+  frag = ck_pr_load_ptr(&stats_set(check)->state);
+  if(!frag) {
+    noit_check_state_refresh(check);
+    frag = ck_pr_load_ptr(&stats_set(check)->state);
+    if(!frag) return NULL;
+  }
+  if(len) *len = frag->len;
+  if(gen) *gen = frag->gen;
+  return frag->json;
+}
+
+uint64_t
+noit_check_state_generation() {
+  return (uint64_t)mtev_atomic_add64(&check_state_gen, 0);
+}
+
+int
+noit_check_state_deleted_since(uint64_t since,
+                               void (*f)(uuid_t, uint64_t, void *),
+                               void *closure) {
+  uint64_t i, first;
+  pthread_mutex_lock(&state_deleted_lock);
+  if(since < state_deleted_floor) {
+    pthread_mutex_unlock(&state_deleted_lock);
+    return -1;
+  }
+  first = state_deleted_cnt > STATE_DELETED_HISTORY ?
+            state_deleted_cnt - STATE_DELETED_HISTORY : 0;
+  for(i=first; f && i<state_deleted_cnt; i++) {
+    int idx = i % STATE_DELETED_HISTORY;
+    if(state_deleted[idx].gen > since)
+      f(state_deleted[idx].id, state_deleted[idx].gen, closure);
+  }
+  pthread_mutex_unlock(&state_deleted_lock);
+  return 0;
+}
+
 void
 noit_check_set_stats(noit_check_t *check) {
   int report_change = 0;
@@ -2239,21 +2675,27 @@ noit_check_set_stats(noit_check_t *check) {
   if(check_set_stats_hook_invoke(check) == MTEV_HOOK_ABORT) return;
 
   if(!stats_previous(check)) {
-    stats_previous(check) = noit_check_stats_alloc();
+    stats_gen_publish(check, STATS_PREVIOUS,
+                      noit_check_stats_alloc(stats_set(check)));
   }
+  /* Writers move on to a fresh in-progress generation and readers to the
+   * new current before the old current is folded into previous. */
   all = stats_previous(check);
   prev = stats_current(check);
+  current = stats_inprogress(check);
+  stats_gen_publish(check, STATS_INPROGRESS,
+                    noit_check_stats_alloc(stats_set(check)));
+  stats_gen_publish(check, STATS_CURRENT, current);
   if(prev) {
     stats_merge(all,prev);
     mtev_memory_safe_free(prev);
   }
-  current = stats_current(check) = stats_inprogress(check);
-  stats_inprogress(check) = noit_check_stats_alloc();
   
   if(current) {
     for(cp = current->status; cp && *cp; cp++)
       if(*cp == '\r' || *cp == '\n') *cp = ' ';
   }
+  noit_check_state_refresh(check);
 
   /* check for state changes */
   if((!current || (current->available != NP_UNKNOWN)) &&
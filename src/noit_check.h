@@ -221,6 +221,11 @@ API_EXPORT(int)
   noit_poller_lookup_by_ip_module(const char *ip, const char *mod,
                                   noit_check_t **checks, int nchecks);
 
+/* Bumped whenever the (ip, module) index changes; callers caching the
+ * results of noit_poller_lookup_by_ip_module can compare against it. */
+API_EXPORT(uint32_t)
+  noit_poller_target_ip_generation();
+
 API_EXPORT(int)
    noit_poller_target_ip_do(const char *target,
                             int (*f)(noit_check_t *, void *),
@@ -276,6 +281,12 @@ API_EXPORT(void)
 API_EXPORT(void)
   noit_stats_set_status(noit_check_t *check, const char *t);
 
+/* Metric lookups take no lock.  The metric returned is only good until
+ * the caller's mtev_memory_end(), so call these inside
+ * mtev_memory_begin()/mtev_memory_end().  A NULL stats_t means the
+ * in-progress generation.  Code running on the thread that rotates the
+ * check (its module's own callbacks) can't see a generation retired
+ * under it and may skip the epoch. */
 API_EXPORT(metric_t *)
   noit_stats_get_metric(noit_check_t *check, stats_t *, const char *);
 
@@ -286,6 +297,23 @@ API_EXPORT(void)
   noit_stats_set_metric(noit_check_t *check,
                         const char *, metric_type_t, const void *);
 
+/* One element of a noit_stats_set_metric_batch() call; the fields have
+ * the same meaning as the arguments to noit_stats_set_metric(). */
+typedef struct {
+  const char *name;
+  metric_type_t type;
+  const void *value;
+} noit_stats_batch_metric_t;
+
+/* Set cnt metrics on the in-progress stats taking the stats lock once.
+ * If log_immediate is set they are also logged (as few bundles as the
+ * log allows) and marked logged, exactly as if each had been followed
+ * by noit_stats_log_immediate_metric().  Returns the number set. */
+API_EXPORT(int)
+  noit_stats_set_metric_batch(noit_check_t *check,
+                              const noit_stats_batch_metric_t *batch,
+                              int cnt, mtev_boolean log_immediate);
+
 API_EXPORT(void)
   noit_stats_set_metric_coerce(noit_check_t *check,
                                const char *, metric_type_t,
@@ -329,6 +357,26 @@ API_EXPORT(void)
 API_EXPORT(void)
   noit_check_transient_remove_feed(noit_check_t *check, const char *feed);
 
+/* Pre-serialized state for the REST check listings.  The fragment is
+ * the JSON members of noit_check_state_as_json(check, 0) that only change
+ * when the check is reconfigured or reports (everything but "id", "flags"
+ * and "next_run"), without enclosing braces.  It stays valid until the
+ * caller's mtev_memory epoch ends.  *gen receives the state generation at
+ * which it was made; generations increase across all checks.
+ */
+API_EXPORT(const char *)
+  noit_check_state_fragment(noit_check_t *check, size_t *len, uint64_t *gen);
+/* The latest state generation handed out. */
+API_EXPORT(uint64_t)
+  noit_check_state_generation();
+/* Call f (if not NULL) for each check deleted after generation since.
+ * Returns -1, calling nothing, if deletions that long ago are no longer
+ * remembered. */
+API_EXPORT(int)
+  noit_check_state_deleted_since(uint64_t since,
+                                 void (*f)(uuid_t, uint64_t, void *),
+                                 void *closure);
+
 /* Register your module */
 API_EXPORT(int)
   noit_check_register_module(const char *);
@@ -366,6 +414,9 @@ API_EXPORT(void) noit_check_log_bundle(noit_check_t *check);
 API_EXPORT(void) noit_check_log_metrics(noit_check_t *check);
 API_EXPORT(void) noit_check_log_metric(noit_check_t *check,
                                        const struct timeval *whence, metric_t *m);
+API_EXPORT(void) noit_check_log_metric_batch(noit_check_t *check,
+                                             const struct timeval *whence,
+                                             metric_t **ms, int cnt);
 API_EXPORT(void) noit_check_log_histo(noit_check_t *check, uint64_t whence_s,
           const char *metric_name, const char *b64_histo, ssize_t b64_histo_len);
 API_EXPORT(void) noit_check_extended_id_split(const char *in, int len,
@@ -385,6 +436,8 @@ API_EXPORT(char *)
                                mtev_console_state_t *dstate,
                                int argc, char **argv, int idx);
 
+API_EXPORT(mtev_boolean)
+  noit_check_is_priority_scheduled(noit_check_t *check);
 API_EXPORT(void) check_slots_inc_tv(struct timeval *tv);
 API_EXPORT(void) check_slots_dec_tv(struct timeval *tv);
 
@@ -398,8 +451,13 @@ API_EXPORT(uint32_t)
   noit_check_stats_duration(stats_t *s, uint32_t *n);
 API_EXPORT(const char *)
   noit_check_stats_status(stats_t *s, const char *n);
-API_EXPORT(mtev_hash_table *)
-  noit_check_stats_metrics(stats_t *s);
+API_EXPORT(uint32_t)
+  noit_check_stats_metric_count(stats_t *s);
+/* Walk the metrics of a stats generation; *iter must start at 0.  Like
+ * noit_stats_get_metric() this takes no lock, so walk inside
+ * mtev_memory_begin()/mtev_memory_end() and drop the metrics by its end. */
+API_EXPORT(mtev_boolean)
+  noit_check_stats_metric_next(stats_t *s, uint32_t *iter, metric_t **m);
 API_EXPORT(void) 
   noit_check_init_globals(void);
 
@@ -32,6 +32,7 @@
  */
 
 #include <mtev_defines.h>
+#include <mtev_memory.h>
 
 #include <uuid/uuid.h>
 #include <netinet/in.h>
@@ -77,6 +78,9 @@
  * BINARY
  *  'BF' strlen(base64(flatbuffer payload)) base64(flatbuffer payload)
  *
+ *  The payload is a MetricBatch or a MetricColumns, see the "flatbuffer"
+ *  feed property below.
+ *
  */
 
 static mtev_log_stream_t check_log = NULL;
@@ -158,9 +162,12 @@ _noit_check_log_delete(mtev_log_stream_t ls,
 void
 noit_check_log_delete(noit_check_t *check) {
   if(!(check->flags & NP_TRANSIENT)) {
+    /* stats generations are retired through safe memory */
+    mtev_memory_begin();
     handle_extra_feeds(check, _noit_check_log_delete);
-    SETUP_LOG(delete, return);
+    SETUP_LOG(delete, mtev_memory_end(); return);
     _noit_check_log_delete(delete_log, check);
+    mtev_memory_end();
   }
 }
 
@@ -230,11 +237,14 @@ _noit_check_log_status(mtev_log_stream_t ls,
 }
 void
 noit_check_log_status(noit_check_t *check) {
+  /* stats generations are retired through safe memory */
+  mtev_memory_begin();
   handle_extra_feeds(check, _noit_check_log_status);
   if(!(check->flags & (NP_TRANSIENT | NP_SUPPRESS_STATUS))) {
-    SETUP_LOG(status, return);
+    SETUP_LOG(status, mtev_memory_end(); return);
     _noit_check_log_status(status_log, check);
   }
+  mtev_memory_end();
 }
 
 static int
@@ -249,24 +259,51 @@ account_id_from_name(const char *check_name)
   return account_id;
 }
 
+/* The "flatbuffer" property of a feed selects "BF" lines carrying either
+ * a MetricBatch ("batch") or MetricColumns ("columnar") in place of the
+ * protobuf bundles.  Readers tell the two apart by file identifier.
+ */
+typedef enum {
+  NOIT_BUNDLE_PROTOBUF,
+  NOIT_BUNDLE_FB_BATCH,
+  NOIT_BUNDLE_FB_COLUMNS
+} noit_bundle_format_t;
+
+static noit_bundle_format_t
+noit_check_log_bundle_format(mtev_log_stream_t ls) {
+  const char *v = mtev_log_stream_get_property(ls, "flatbuffer");
+  if(v && !strcmp(v, "batch")) return NOIT_BUNDLE_FB_BATCH;
+  if(v && !strcmp(v, "columnar")) return NOIT_BUNDLE_FB_COLUMNS;
+  return NOIT_BUNDLE_PROTOBUF;
+}
+
+/* Log the metrics that pass the filterset and are not yet logged as one
+ * BF line; if none do, nothing is logged.
+ */
 static int
-noit_check_log_bundle_metric_flatbuffer_serialize_log(mtev_log_stream_t ls,
-                                                      noit_check_t *check,
-                                                      struct timeval *whence,
-                                                      metric_t *m)
+noit_check_log_bundle_fb_emit(mtev_log_stream_t ls, noit_check_t *check,
+                              const struct timeval *whence,
+                              noit_bundle_format_t format,
+                              metric_t **ms, int cnt)
 {
-  int rv = 0;
+  int i, first, rv = 0;
   char check_name[256 * 3] = {0};
   char uuid_str[UUID_STR_LEN + 1];
   int len = sizeof(check_name);
-
-  static char *ip_str = "ip";
-
-  if(!noit_apply_filterset(check->filterset, check, m)) return 0;
-  if(m->logged) return 0;
+  void *B, *buffer;
+  size_t fb_size;
+  char *outbuf;
+  unsigned int outsize;
 
   const char *v;
   mtev_boolean extended_id = mtev_false;
+
+  /* If we apply the filter set and it returns false, we don't log */
+  for(first=0; first<cnt; first++)
+    if(noit_apply_filterset(check->filterset, check, ms[first]) &&
+       !ms[first]->logged) break;
+  if(first == cnt) return 0;
+
   v = mtev_log_stream_get_property(ls, "extended_id");
   if(v && !strcmp(v, "on")) extended_id = mtev_true;
   check_name[0] = '\0';
@@ -282,78 +319,61 @@ noit_check_log_bundle_metric_flatbuffer_serialize_log(mtev_log_stream_t ls,
   uuid_str[0] = '\0';
   uuid_unparse_lower(check->checkid, uuid_str);
 
-  size_t size = 0;
   /* TODO: this is a circonus specific line based on how we name checks
    *
    * Could be a hook?
    */
   int account_id = account_id_from_name(check_name);
-  void *buffer = noit_fb_serialize_metricbatch((SECPART(whence) * 1000) + MSECPART(whence), uuid_str, check_name, account_id,
-                                               m, &size);
+  uint64_t whence_ms = (SECPART(whence) * 1000) + MSECPART(whence);
+  if(format == NOIT_BUNDLE_FB_COLUMNS)
+    B = noit_fb_start_metriccolumns(whence_ms, uuid_str, check_name, account_id);
+  else
+    B = noit_fb_start_metricbatch(whence_ms, uuid_str, check_name, account_id);
+
+  for(i=first; i<cnt; i++) {
+    metric_t *m = ms[i];
+    if(i > first) {
+      if(!noit_apply_filterset(check->filterset, check, m)) continue;
+      if(m->logged) continue;
+    }
+    if(format == NOIT_BUNDLE_FB_COLUMNS) noit_fb_add_metric_to_metriccolumns(B, m);
+    else noit_fb_add_metric_to_metricbatch(B, m);
+    if(NOIT_CHECK_METRIC_ENABLED()) {
+      char buff[256];
+      noit_stats_snprint_metric(buff, sizeof(buff), m);
+      NOIT_CHECK_METRIC(uuid_str, check->module, check->name, check->target,
+                        m->metric_name, m->metric_type, buff);
+    }
+  }
 
-  unsigned int outsize;
-  char *outbuf = NULL;
-  noit_check_log_bundle_compress_b64(NOIT_COMPRESS_LZ4, buffer, size, &outbuf, &outsize);
+  if(format == NOIT_BUNDLE_FB_COLUMNS)
+    buffer = noit_fb_finalize_metriccolumns(B, &fb_size);
+  else
+    buffer = noit_fb_finalize_metricbatch(B, &fb_size);
+  noit_check_log_bundle_compress_b64(NOIT_COMPRESS_LZ4, buffer, fb_size, &outbuf, &outsize);
 
   rv = mtev_log(ls, whence, __FILE__, __LINE__,
-                "BF\t%d\t%.*s\n", (int)size,
+                "BF\t%d\t%.*s\n", (int)fb_size,
                 (unsigned int)outsize, outbuf);
   free(outbuf);
   free(buffer);
   return rv;
-
 }
 
 static int
-noit_check_log_bundle_metric_serialize(mtev_log_stream_t ls,
-                                       noit_check_t *check,
-                                       const struct timeval *whence,
-                                       metric_t *m) {
-  int size, rv = 0;
+noit_check_log_bundle_metrics_emit(mtev_log_stream_t ls, noit_check_t *check,
+                                   const struct timeval *whence,
+                                   const char *uuid_str,
+                                   mtev_boolean use_compression,
+                                   Bundle *bundle) {
+  int size, rv;
   unsigned int out_size;
-  static char *ip_str = "ip";
   noit_compression_type_t comp;
-  Bundle bundle = BUNDLE__INIT;
-  char uuid_str[256*3+37];
   char *buf, *out_buf;
-  mtev_boolean use_compression = mtev_true;
-  const char *v_comp;
-
-  if(!noit_apply_filterset(check->filterset, check, m)) return 0;
-  if(m->logged) return 0;
 
-  MAKE_CHECK_UUID_STR(uuid_str, sizeof(uuid_str), ls, check);
-  v_comp = mtev_log_stream_get_property(ls, "compression");
-  if(v_comp && !strcmp(v_comp, "off")) use_compression = mtev_false;
-
-  bundle.status = NULL;
-  bundle.has_period = mtev_false;
-  bundle.has_timeout = mtev_false;
-
-  bundle.n_metadata = 1;
-  bundle.metadata = malloc(sizeof(Metadata*));
-  bundle.metadata[0] = malloc(sizeof(Metadata));
-  metadata__init(bundle.metadata[0]);
-  bundle.metadata[0]->key = ip_str;
-  bundle.metadata[0]->value = check->target_ip;
-
-  bundle.n_metrics = 1;
-  bundle.metrics = malloc(bundle.n_metrics * sizeof(Metric*));
-
-  bundle.metrics[0] = malloc(sizeof(Metric));
-  metric__init(bundle.metrics[0]);
-  _noit_check_log_bundle_metric(ls, bundle.metrics[0], m);
-
-  if(NOIT_CHECK_METRIC_ENABLED()) {
-    char buff[256];
-    noit_stats_snprint_metric(buff, sizeof(buff), m);
-    NOIT_CHECK_METRIC(uuid_str, check->module, check->name, check->target,
-                      m->metric_name, m->metric_type, buff);
-  }
-
-  size = bundle__get_packed_size(&bundle);
+  size = bundle__get_packed_size(bundle);
   buf = malloc(size);
-  bundle__pack(&bundle, (uint8_t*)buf);
+  bundle__pack(bundle, (uint8_t*)buf);
 
   // Compress + B64
   comp = use_compression ? NOIT_COMPRESS_ZLIB : NOIT_COMPRESS_NONE;
@@ -367,13 +387,96 @@ noit_check_log_bundle_metric_serialize(mtev_log_stream_t ls,
 
   free(buf);
   free(out_buf);
-  free(bundle.metrics[0]);
-  free(bundle.metrics);
-  free(bundle.metadata[0]);
-  free(bundle.metadata);
   return rv;
 }
 
+/* Log a set of metrics (that share a timestamp) as status-less bundles
+ * of at most metrics_per_bundle metrics each.  Metrics that are filtered
+ * out or already logged are skipped; if none remain nothing is logged.
+ */
+static int
+noit_check_log_bundle_metrics_serialize(mtev_log_stream_t ls,
+                                        noit_check_t *check,
+                                        const struct timeval *whence,
+                                        metric_t **ms, int cnt) {
+  int i, n = 0, rv, rv_sum = 0, metrics_per_bundle = 0;
+  static char *ip_str = "ip";
+  Bundle bundle = BUNDLE__INIT;
+  Metadata metadata, *metadatap = &metadata;
+  Metric *mstore, **mptrs;
+  char uuid_str[256*3+37];
+  mtev_boolean use_compression = mtev_true;
+  const char *v_comp, *v_mpb;
+  noit_bundle_format_t format = noit_check_log_bundle_format(ls);
+
+  if(format != NOIT_BUNDLE_PROTOBUF)
+    return noit_check_log_bundle_fb_emit(ls, check, whence, format, ms, cnt);
+
+  MAKE_CHECK_UUID_STR(uuid_str, sizeof(uuid_str), ls, check);
+  v_comp = mtev_log_stream_get_property(ls, "compression");
+  if(v_comp && !strcmp(v_comp, "off")) use_compression = mtev_false;
+  v_mpb = mtev_log_stream_get_property(ls, "metrics_per_bundle");
+  if(v_mpb) metrics_per_bundle = atoi(v_mpb);
+  if(metrics_per_bundle <= 0) metrics_per_bundle = METRICS_PER_BUNDLE;
+  if(metrics_per_bundle > cnt) metrics_per_bundle = cnt;
+  if(metrics_per_bundle <= 0) return 0;
+
+  bundle.status = NULL;
+  bundle.has_period = mtev_false;
+  bundle.has_timeout = mtev_false;
+
+  metadata__init(&metadata);
+  metadata.key = ip_str;
+  metadata.value = check->target_ip;
+  bundle.n_metadata = 1;
+  bundle.metadata = &metadatap;
+
+  mstore = malloc(metrics_per_bundle * sizeof(*mstore));
+  mptrs = malloc(metrics_per_bundle * sizeof(*mptrs));
+  bundle.metrics = mptrs;
+
+  for(i=0; i<cnt; i++) {
+    metric_t *m = ms[i];
+    if(!noit_apply_filterset(check->filterset, check, m)) continue;
+    if(m->logged) continue;
+    metric__init(&mstore[n]);
+    _noit_check_log_bundle_metric(ls, &mstore[n], m);
+    mptrs[n] = &mstore[n];
+    if(NOIT_CHECK_METRIC_ENABLED()) {
+      char buff[256];
+      noit_stats_snprint_metric(buff, sizeof(buff), m);
+      NOIT_CHECK_METRIC(uuid_str, check->module, check->name, check->target,
+                        m->metric_name, m->metric_type, buff);
+    }
+    if(++n == metrics_per_bundle) {
+      bundle.n_metrics = n;
+      rv = noit_check_log_bundle_metrics_emit(ls, check, whence, uuid_str,
+                                              use_compression, &bundle);
+      if(rv < 0) rv_sum = rv;
+      else if(rv_sum >= 0) rv_sum += rv;
+      n = 0;
+    }
+  }
+  if(n > 0) {
+    bundle.n_metrics = n;
+    rv = noit_check_log_bundle_metrics_emit(ls, check, whence, uuid_str,
+                                            use_compression, &bundle);
+    if(rv < 0) rv_sum = rv;
+    else if(rv_sum >= 0) rv_sum += rv;
+  }
+  free(mptrs);
+  free(mstore);
+  return rv_sum;
+}
+
+static int
+noit_check_log_bundle_metric_serialize(mtev_log_stream_t ls,
+                                       noit_check_t *check,
+                                       const struct timeval *whence,
+                                       metric_t *m) {
+  return noit_check_log_bundle_metrics_serialize(ls, check, whence, &m, 1);
+}
+
 #if !defined(NOIT_CHECK_LOG_M)
 static int
 _noit_check_log_metric(mtev_log_stream_t ls, noit_check_t *check,
@@ -382,16 +485,26 @@ _noit_check_log_metric(mtev_log_stream_t ls, noit_check_t *check,
   return noit_check_log_bundle_metric_serialize(ls, check, whence, m);
 }
 static int
+_noit_check_log_metric_batch(mtev_log_stream_t ls, noit_check_t *check,
+                             const char *uuid_str,
+                             const struct timeval *whence,
+                             metric_t **ms, int cnt) {
+  return noit_check_log_bundle_metrics_serialize(ls, check, whence, ms, cnt);
+}
+static int
 _noit_check_log_metrics(mtev_log_stream_t ls, noit_check_t *check) {
   return noit_check_log_bundle_serialize(ls, check);
 }
 void
 noit_check_log_metrics(noit_check_t *check) {
+  /* stats generations and their metrics are retired through safe memory */
+  mtev_memory_begin();
   handle_extra_feeds(check, _noit_check_log_metrics);
   if(!(check->flags & (NP_TRANSIENT | NP_SUPPRESS_METRICS))) {
-    SETUP_LOG(bundle, return);
+    SETUP_LOG(bundle, mtev_memory_end(); return);
     _noit_check_log_metrics(bundle_log, check);
   }
+  mtev_memory_end();
 }
 #else
 static int
@@ -463,36 +576,49 @@ _noit_check_log_metric(mtev_log_stream_t ls, noit_check_t *check,
   return srv;
 }
 static int
+_noit_check_log_metric_batch(mtev_log_stream_t ls, noit_check_t *check,
+                             const char *uuid_str,
+                             const struct timeval *whence,
+                             metric_t **ms, int cnt) {
+  int i, srv, rv = 0;
+  for(i=0; i<cnt; i++) {
+    srv = _noit_check_log_metric(ls, check, uuid_str,
+                                 (struct timeval *)whence, ms[i]);
+    if(srv) rv = srv;
+  }
+  return rv;
+}
+static int
 _noit_check_log_metrics(mtev_log_stream_t ls, noit_check_t *check) {
   int rv = 0;
   int srv;
   struct timeval *whence;
   char uuid_str[256*3+37];
-  mtev_hash_iter iter = MTEV_HASH_ITER_ZERO;
-  const char *key;
-  int klen;
+  uint32_t iter = 0;
   stats_t *c;
-  void *vm;
+  metric_t *m;
   SETUP_LOG(metrics, );
   MAKE_CHECK_UUID_STR(uuid_str, sizeof(uuid_str), metrics_log, check);
 
   c = noit_check_get_stats_current(check);
   whence = noit_check_stats_whence(c, NULL);
-  while(mtev_hash_next(&c->metrics, &iter, &key, &klen, &vm)) {
+  while(noit_check_stats_metric_next(c, &iter, &m)) {
     /* If we apply the filter set and it returns false, we don't log */
-    metric_t *m = (metric_t *)vm;
-    srv = _noit_check_log_metric(ls, check, uuid_str, &c->whence, m);
+    srv = _noit_check_log_metric(ls, check, uuid_str, whence, m);
     if(srv) rv = srv;
   }
   return rv;
 }
 void
 noit_check_log_metrics(noit_check_t *check) {
+  /* stats generations and their metrics are retired through safe memory */
+  mtev_memory_begin();
   handle_extra_feeds(check, _noit_check_log_metrics);
   if(!(check->flags & (NP_TRANSIENT | NP_SUPPRESS_METRICS))) {
-    SETUP_LOG(metrics, return);
+    SETUP_LOG(metrics, mtev_memory_end(); return);
     _noit_check_log_metrics(metrics_log, check);
   }
+  mtev_memory_end();
 }
 #endif
 
@@ -528,68 +654,25 @@ _noit_check_log_bundle_metric(mtev_log_stream_t ls, Metric *metric, metric_t *m)
 }
 
 static int
-noit_check_log_bundle_fb_serialize(mtev_log_stream_t ls, noit_check_t *check) {
-  int rv = 0;
-  static char *ip_str = "ip";
-  char check_name[256 * 3] = {0};
-  char uuid_str[UUID_PRINTABLE_STRING_LENGTH];
-  int len = sizeof(check_name);
-  mtev_hash_iter iter = MTEV_HASH_ITER_ZERO;
-  mtev_hash_iter iter2 = MTEV_HASH_ITER_ZERO;
-  const char *key;
-  int klen, i=0, j;
-  unsigned int out_size;
+noit_check_log_bundle_fb_serialize(mtev_log_stream_t ls, noit_check_t *check,
+                                   noit_bundle_format_t format) {
+  int rv, srv, n = 0;
+  uint32_t iter = 0;
   stats_t *c;
-  void *vm;
+  metric_t *m, **ms;
   struct timeval *whence;
-  char *buf, *out_buf;
-  mtev_hash_table *metrics;
+
+  /* flatbuffers carry no status, so that goes out as its own line */
+  srv = _noit_check_log_status(ls, check);
 
   c = noit_check_get_stats_current(check);
   whence = noit_check_stats_whence(c, NULL);
-
-  const char *v;
-  mtev_boolean extended_id = mtev_false;
-  v = mtev_log_stream_get_property(ls, "extended_id");
-  if(v && !strcmp(v, "on")) extended_id = mtev_true;
-  check_name[0] = '\0';
-  if(extended_id) {
-    strlcat(check_name, check->target, len);
-    strlcat(check_name, "`", len);
-    strlcat(check_name, check->module, len);
-    strlcat(check_name, "`", len);
-    strlcat(check_name, check->name, len);
-    strlcat(check_name, "`", len);
-  }
-
-  uuid_str[0] = '\0';
-  uuid_unparse_lower(check->checkid, uuid_str);
-
-  metrics = noit_check_stats_metrics(c);
-
-  int account_id = account_id_from_name(check_name);
-  void *B = noit_fb_start_metricbatch((SECPART(whence) * 1000) + MSECPART(whence), uuid_str, check_name, account_id);
-
-  while(mtev_hash_next(metrics, &iter, &key, &klen, &vm)) {
-    /* If we apply the filter set and it returns false, we don't log */
-    metric_t *m = (metric_t *)vm;
-    if(!noit_apply_filterset(check->filterset, check, m)) continue;
-    if(m->logged) continue;
-    noit_fb_add_metric_to_metricbatch(B, m);
-  }
-
-  size_t fb_size;
-  void *buffer = noit_fb_finalize_metricbatch(B, &fb_size);
-  char *outbuf;
-  unsigned int outsize;
-  noit_check_log_bundle_compress_b64(NOIT_COMPRESS_LZ4, buffer, fb_size, &outbuf, &outsize);
-
-  rv = mtev_log(ls, whence, __FILE__, __LINE__,
-                "BF\t%d\t%.*s\n", (int)fb_size,
-                (unsigned int)outsize, outbuf);
-  free(outbuf);
-  free(buffer);
-  return rv;
+  ms = malloc(MAX(noit_check_stats_metric_count(c), 1) * sizeof(*ms));
+  while(noit_check_stats_metric_next(c, &iter, &m)) ms[n++] = m;
+  rv = noit_check_log_bundle_fb_emit(ls, check, whence, format, ms, n);
+  free(ms);
+  if(srv < 0) return srv;
+  return (rv < 0) ? rv : rv + srv;
 }
 
 static int
@@ -597,17 +680,17 @@ noit_check_log_bundle_serialize(mtev_log_stream_t ls, noit_check_t *check) {
   int rv = 0;
   static char *ip_str = "ip";
   char uuid_str[256*3+37];
-  mtev_hash_iter iter = MTEV_HASH_ITER_ZERO;
-  mtev_hash_iter iter2 = MTEV_HASH_ITER_ZERO;
-  const char *key;
-  int klen, i=0, size, j, n_metrics = 0;
+  uint32_t iter = 0;
+  int i=0, size, j, n_metrics = 0;
   unsigned int out_size;
   stats_t *c;
-  void *vm;
+  metric_t *m;
   struct timeval *whence;
   char *buf, *out_buf;
-  mtev_hash_table *metrics;
   noit_compression_type_t comp;
+  noit_bundle_format_t format = noit_check_log_bundle_format(ls);
+  if(format != NOIT_BUNDLE_PROTOBUF)
+    return noit_check_log_bundle_fb_serialize(ls, check, format);
   SETUP_LOG(bundle, );
   MAKE_CHECK_UUID_STR(uuid_str, sizeof(uuid_str), bundle_log, check);
   mtev_boolean use_compression = mtev_true;
@@ -624,10 +707,7 @@ noit_check_log_bundle_serialize(mtev_log_stream_t ls, noit_check_t *check) {
   whence = noit_check_stats_whence(c, NULL);
 
   // Just count
-  metrics = noit_check_stats_metrics(c);
-  while(mtev_hash_next(metrics, &iter, &key, &klen, &vm)) {
-    n_metrics++;
-  }
+  n_metrics = noit_check_stats_metric_count(c);
 
   int n_bundles = ((MAX(n_metrics,1) - 1) / metrics_per_bundle) + 1;
   Bundle *bundles = malloc(n_bundles * sizeof(*bundles));
@@ -667,14 +747,13 @@ noit_check_log_bundle_serialize(mtev_log_stream_t ls, noit_check_t *check) {
   i = 0;
   if(n_metrics > 0) {
     // Now convert
-    while(mtev_hash_next(metrics, &iter2, &key, &klen, &vm)) {
+    while(noit_check_stats_metric_next(c, &iter, &m)) {
       /* make sure we don't go past our allocation for some reason*/
       if((i / metrics_per_bundle) >= n_bundles) break;
 
       Bundle *bundle = &bundles[i / metrics_per_bundle];
       int b_i = i % metrics_per_bundle;
       /* If we apply the filter set and it returns false, we don't log */
-      metric_t *m = (metric_t *)vm;
       if(!noit_apply_filterset(check->filterset, check, m)) continue;
       if(m->logged) continue;
       bundle->metrics[b_i] = malloc(sizeof(Metric));
@@ -727,12 +806,14 @@ noit_check_log_bundle_serialize(mtev_log_stream_t ls, noit_check_t *check) {
 
 void
 noit_check_log_bundle(noit_check_t *check) {
+  /* stats generations and their metrics are retired through safe memory */
+  mtev_memory_begin();
   handle_extra_feeds(check, noit_check_log_bundle_serialize);
   if(!(check->flags & (NP_TRANSIENT | NP_SUPPRESS_STATUS | NP_SUPPRESS_METRICS))) {
-    SETUP_LOG(bundle, return);
+    SETUP_LOG(bundle, mtev_memory_end(); return);
     noit_check_log_bundle_serialize(bundle_log, check);
-    //noit_check_log_bundle_fb_serialize(bundle_log, check);
   }
+  mtev_memory_end();
 }
 
 void
@@ -777,6 +858,49 @@ noit_check_log_metric(noit_check_t *check, const struct timeval *whence,
   }
 }
 
+void
+noit_check_log_metric_batch(noit_check_t *check, const struct timeval *whence,
+                            metric_t **ms, int cnt) {
+  char uuid_str[256*3+37];
+  int i;
+  if(cnt <= 0) return;
+#if defined(NOIT_CHECK_LOG_M)
+  MAKE_CHECK_UUID_STR(uuid_str, sizeof(uuid_str), metrics_log, check);
+#else
+  MAKE_CHECK_UUID_STR(uuid_str, sizeof(uuid_str), bundle_log, check);
+#endif
+
+  if(check->feeds) {
+    mtev_skiplist_node *curr, *next;
+    curr = next = mtev_skiplist_getlist(check->feeds);
+    while(curr) {
+      const char *feed_name = (char *)curr->data;
+      mtev_log_stream_t ls = mtev_log_stream_find(feed_name);
+      mtev_skiplist_next(check->feeds, &next);
+      if(!ls || _noit_check_log_metric_batch(ls, check, uuid_str, whence, ms, cnt))
+        noit_check_transient_remove_feed(check, feed_name);
+      curr = next;
+    }
+  }
+  if(!(check->flags & NP_TRANSIENT)) {
+#if defined(NOIT_CHECK_LOG_M)
+    SETUP_LOG(metrics, return);
+    _noit_check_log_metric_batch(metrics_log, check, uuid_str, whence, ms, cnt);
+#else
+    SETUP_LOG(bundle, return);
+    _noit_check_log_metric_batch(bundle_log, check, uuid_str, whence, ms, cnt);
+#endif
+    if(NOIT_CHECK_METRIC_ENABLED()) {
+      for(i=0; i<cnt; i++) {
+        char buff[256];
+        noit_stats_snprint_metric(buff, sizeof(buff), ms[i]);
+        NOIT_CHECK_METRIC(uuid_str, check->module, check->name, check->target,
+                          ms[i]->metric_name, ms[i]->metric_type, buff);
+      }
+    }
+  }
+}
+
 int
 noit_stats_snprint_metric(char *b, int l, metric_t *m) {
   int rv, nl;
@@ -47,6 +47,8 @@
 #include "noit_check_log_helpers.h"
 #include "flatbuffers/metric_reader.h"
 #include "flatbuffers/metric_batch_reader.h"
+#include "flatbuffers/metric_batch_verifier.h"
+#include "noit_fb.h"
 #include "noit_message_decoder.h"
 
 #undef ns
@@ -340,17 +342,36 @@ noit_check_log_b12_to_sm(const char *line, int len, char ***out, int noit_ip, no
   return cnt + has_status;
 }
 
-static int 
+static char *
+noit_check_log_bf_metric_line(const char *ts, const char *uuid_str, metric_t *m)
+{
+  char scratch[64], *out;
+  const char *value_str = "[[null]]";
+  int size;
+
+  if(m->metric_value.vp) {
+    if(m->metric_type == METRIC_STRING) value_str = m->metric_value.s;
+    else if(noit_stats_snprint_metric_value(scratch, sizeof(scratch), m) < 0) return NULL;
+    else value_str = scratch;
+  }
+  size = 2 /* M\t */ + strlen(ts) + 1 /* \t */ + strlen(uuid_str) +
+         1 /* \t */ + strlen(m->metric_name) + 3 /* \t<type>\t */ +
+         strlen(value_str) + 1 /* \0 */;
+  out = malloc(size);
+  snprintf(out, size, "M\t%s\t%s\t%s\t%c\t%s",
+           ts, uuid_str, m->metric_name, m->metric_type, value_str);
+  return out;
+}
+
+static int
 noit_check_log_bf_to_sm(const char *line, int len, char ***out, int noit_ip)
 {
   unsigned int ulen;
-  int i, size, cnt = 0, has_status = 0;
+  int rv, cnt = 0;
   const char *cp1, *cp2, *rest, *error_str = NULL;
-  char *uuid_str, *target, *module, *name, *ulen_str, *nipstr = NULL;
+  char *ulen_str, *nipstr = NULL, *uuid_str;
   unsigned char *raw_data = NULL;
-  const char *value_str;
-  size_t value_size;
-  char scratch[64];
+  char ts[32];
 
   *out = NULL;
   if(len < 3) return 0;
@@ -358,19 +379,17 @@ noit_check_log_bf_to_sm(const char *line, int len, char ***out, int noit_ip)
 
   line += 3; len -= 3;
   cp1 = line;
-#define SET_FIELD_FROM_BUNDLE(tgt) do { \
-  if(*cp1 == '\0') { error_str = "short line @ " #tgt; goto bad_line; } \
-  cp2 = strnstrn("\t", 1, cp1, len - (cp1 - line)); \
-  if(cp2 == NULL) { error_str = "no tab after " #tgt; goto bad_line; } \
-  tgt = (char *)alloca(cp2 - cp1 + 1); \
-  if(!tgt) { error_str = "alloca failed for " #tgt; goto bad_line; } \
-  memcpy(tgt, cp1, cp2 - cp1); \
-  tgt[cp2 - cp1] = '\0'; \
-  cp1 = cp2 + 1; \
-} while(0)
+
+  if(noit_ip == -1) {
+    /* auto-detect: a leading noit field means a second tab */
+    cp2 = memchr(line, '\t', len);
+    noit_ip = (cp2 && memchr(cp2 + 1, '\t', len - (cp2 + 1 - line))) ? 1 : 0;
+  }
+
+  if(noit_ip > 0) SET_FIELD_FROM_BUNDLE(nipstr);
   SET_FIELD_FROM_BUNDLE(ulen_str);
   rest = cp1;
-  
+
   ulen = strtoul(ulen_str, NULL, 10);
   raw_data = malloc(ulen);
   if(!raw_data) {
@@ -385,98 +404,118 @@ noit_check_log_bf_to_sm(const char *line, int len, char ***out, int noit_ip)
     goto bad_line;
   }
 
-  /* flatbuffers reader */
-  ns(MetricBatch_table_t) message = ns(MetricBatch_as_root(raw_data));
-
-  mtevAssert(message != NULL);
+#define SET_BF_CHECK(whence_ms, check_name, check_uuid) do { \
+  size_t uuid_len = strlen(check_name) + strlen(check_uuid) + 1; \
+  uuid_str = alloca(uuid_len); \
+  snprintf(uuid_str, uuid_len, "%s%s", check_name, check_uuid); \
+  snprintf(ts, sizeof(ts), "%llu.%03llu", \
+           (unsigned long long)((whence_ms) / 1000), \
+           (unsigned long long)((whence_ms) % 1000)); \
+} while(0)
 
-  uint64_t timestamp = ns(MetricBatch_timestamp(message));
-  flatbuffers_string_t check_name = ns(MetricBatch_check_name(message));
-  flatbuffers_string_t check_uuid = ns(MetricBatch_check_uuid(message));
-  int account_id = ns(MetricBatch_account_id(message));
-  ns(MetricValue_vec_t) metrics = ns(MetricBatch_metrics(message));
-  size_t metrics_len = ns(MetricValue_vec_len(metrics));
-  
-  *out = calloc(sizeof(**out), metrics_len);
-  if(!*out) { error_str = "memory exhaustion"; goto bad_line; }
-  
-  for (int i = 0; i < metrics_len; i++) {
-    ns(MetricValue_table_t) m = ns(MetricValue_vec_at(metrics, i));
-    flatbuffers_string_t metric_name = ns(MetricValue_name(m));
-    char ts[15];
-    size_t uuid_len = flatbuffers_string_len(check_name) + flatbuffers_string_len(check_uuid) + 2;
-    char *uuid_str = alloca(uuid_len);
-    snprintf(uuid_str, uuid_len, "%s`%s", check_name, check_uuid);
-    sprintf(ts, "%.03f", (double) timestamp / 1000.0);
-    char type = 'x';
+  if(noit_fb_is_metriccolumns(raw_data, ulen)) {
+    noit_fb_metriccolumns_iter_t iter;
+    metric_t m;
 
-    value_str = scratch;
-    switch(type) {
-    case ns(MetricValueUnion_IntValue):
-      {
-        type = 'i';
-        ns(IntValue_table_t) v = ns(MetricValue_value(m));
-        snprintf(scratch, sizeof(scratch), "%d", ns(IntValue_value(v)));
-        break;
-      }
-    case ns(MetricValueUnion_UintValue):
-      {
-        type = 'I';
-        ns(UintValue_table_t) v = ns(MetricValue_value(m));
-        snprintf(scratch, sizeof(scratch), "%u", ns(UintValue_value(v)));
-        break;
-      }
-    case ns(MetricValueUnion_LongValue):
-      {
-        type = 'l';
-        ns(LongValue_table_t) v = ns(MetricValue_value(m));
-        snprintf(scratch, sizeof(scratch), "%lld", (long long)ns(LongValue_value(v)));
-        break;
-      }
-    case ns(MetricValueUnion_UlongValue):
-      {
-        type = 'L';
-        ns(UlongValue_table_t) v = ns(MetricValue_value(m));
-        snprintf(scratch, sizeof(scratch), "%llu", (unsigned long long)ns(UlongValue_value(v)));
-        break;
-      }
-    case ns(MetricValueUnion_DoubleValue):
-      {
-        type = 'n';
-        ns(DoubleValue_table_t) v = ns(MetricValue_value(m));
-        snprintf(scratch, sizeof(scratch), "%0.6f", ns(DoubleValue_value(v)));
+    if(noit_fb_metriccolumns_iter_init(&iter, raw_data, ulen)) {
+      error_str = "invalid MetricColumns";
+      goto bad_line;
+    }
+    SET_BF_CHECK(iter.whence_ms, iter.check_name, iter.check_uuid);
+    *out = calloc(sizeof(**out), MAX(iter.count, 1));
+    if(!*out) { error_str = "memory exhaustion"; goto bad_line; }
+    while((rv = noit_fb_metriccolumns_next(&iter, &m, NULL)) == 1) {
+      (*out)[cnt] = noit_check_log_bf_metric_line(ts, uuid_str, &m);
+      if((*out)[cnt]) cnt++;
+    }
+    if(rv < 0) { error_str = "inconsistent MetricColumns"; goto bad_line; }
+  }
+  else {
+    ns(MetricBatch_table_t) message;
+    ns(MetricValue_vec_t) metrics;
+    const char *check_name, *check_uuid;
+    size_t i, metrics_len;
+
+    if(ns(MetricBatch_verify_as_root(raw_data, ulen)) != 0 ||
+       (message = ns(MetricBatch_as_root(raw_data))) == NULL) {
+      error_str = "invalid MetricBatch";
+      goto bad_line;
+    }
+    check_name = ns(MetricBatch_check_name(message));
+    check_uuid = ns(MetricBatch_check_uuid(message));
+    SET_BF_CHECK(ns(MetricBatch_timestamp(message)),
+                 check_name ? check_name : "", check_uuid ? check_uuid : "");
+    metrics = ns(MetricBatch_metrics(message));
+    metrics_len = ns(MetricValue_vec_len(metrics));
+
+    *out = calloc(sizeof(**out), MAX(metrics_len, 1));
+    if(!*out) { error_str = "memory exhaustion"; goto bad_line; }
+
+    for(i = 0; i < metrics_len; i++) {
+      ns(MetricValue_table_t) mv = ns(MetricValue_vec_at(metrics, i));
+      union {
+        int32_t i;
+        uint32_t I;
+        int64_t l;
+        uint64_t L;
+        double n;
+      } v;
+      metric_t m;
+
+      memset(&m, 0, sizeof(m));
+      m.metric_name = (char *)ns(MetricValue_name(mv));
+      if(!m.metric_name) continue;
+      switch(ns(MetricValue_value_type(mv))) {
+#define BF_VALUE(FBTYPE, MTYPE, FIELD) \
+      case ns(MetricValueUnion_##FBTYPE): \
+        { \
+          ns(FBTYPE##_table_t) fv = ns(MetricValue_value(mv)); \
+          v.FIELD = ns(FBTYPE##_value(fv)); \
+          m.metric_type = MTYPE; \
+          m.metric_value.FIELD = &v.FIELD; \
+          break; \
+        }
+      BF_VALUE(IntValue, METRIC_INT32, i)
+      BF_VALUE(UintValue, METRIC_UINT32, I)
+      BF_VALUE(LongValue, METRIC_INT64, l)
+      BF_VALUE(UlongValue, METRIC_UINT64, L)
+      BF_VALUE(DoubleValue, METRIC_DOUBLE, n)
+#undef BF_VALUE
+      case ns(MetricValueUnion_StringValue):
+        {
+          ns(StringValue_table_t) fv = ns(MetricValue_value(mv));
+          m.metric_type = METRIC_STRING;
+          m.metric_value.s = (char *)ns(StringValue_value(fv));
+          break;
+        }
+      case ns(MetricValueUnion_AbsentNumericValue):
+        /* the numeric type of an absent value is not preserved */
+        m.metric_type = METRIC_DOUBLE;
         break;
-      }
-    case ns(MetricValueUnion_StringValue):
-      {
-        type = 's';
-        ns(StringValue_table_t) v = ns(MetricValue_value(m));
-        value_str = ns(StringValue_value(v));
+      case ns(MetricValueUnion_AbsentStringValue):
+        m.metric_type = METRIC_STRING;
         break;
+      default:
+        /* histograms have no M line */
+        continue;
       }
-    };
-
-    value_size = strlen(value_str);
-
-    size = 2 /* M\t */ + strlen(ts) + 1 /* \t */ +
-      flatbuffers_string_len(check_uuid) + 1 /* \t */ + flatbuffers_string_len(metric_name) +
-           3 /* \t<type>\t */ + value_size + 1 /* \0 */;
-    (*out)[i+has_status] = malloc(size);
-    snprintf((*out)[i], size, "M\t%s\t%s\t%s\t%c\t%s",
-             ts, uuid_str, metric_name, type, value_str);
+      (*out)[cnt] = noit_check_log_bf_metric_line(ts, uuid_str, &m);
+      if((*out)[cnt]) cnt++;
+    }
   }
+  free(raw_data);
+  return cnt;
 
  bad_line:
   if(*out) {
     int i;
-    for(i=0; i<cnt + has_status; i++) if((*out)[i]) free((*out)[i]);
+    for(i=0; i<cnt; i++) if((*out)[i]) free((*out)[i]);
     free(*out);
     *out = NULL;
   }
+  if(raw_data) free(raw_data);
   if(error_str) mtevL(noit_error, "bundle: bad line due to %s\n", error_str);
-
-  return cnt + has_status;
- 
+  return 0;
 }
 
 int
@@ -44,6 +44,7 @@
 #include <mtev_conf.h>
 #include <mtev_conf_private.h>
 #include <mtev_json.h>
+#include <mtev_memory.h>
 
 #include "noit_mtev_bridge.h"
 #include "noit_filters.h"
@@ -70,21 +71,17 @@ rest_show_config(mtev_http_rest_closure_t *, int, char **);
 static void
 add_metrics_to_node(stats_t *c, xmlNodePtr metrics, const char *type,
                     int include_time, mtev_hash_table *supp) {
-  mtev_hash_table *mets;
-  mtev_hash_iter iter = MTEV_HASH_ITER_ZERO;
-  const char *k;
-  int klen;
-  void *data;
+  uint32_t iter = 0;
+  metric_t *m;
   xmlNodePtr tmp;
 
-  mets = noit_check_stats_metrics(c);
-  while(mtev_hash_next(mets, &iter, &k, &klen, &data)) {
+  while(noit_check_stats_metric_next(c, &iter, &m)) {
     char buff[256];
-    metric_t *m = (metric_t *)data;
     if(supp) {
       void *unused;
-      if(mtev_hash_retrieve(supp, k, klen, &unused)) continue;
-      mtev_hash_store(supp, k, klen, NULL);
+      int klen = strlen(m->metric_name);
+      if(mtev_hash_retrieve(supp, m->metric_name, klen, &unused)) continue;
+      mtev_hash_store(supp, m->metric_name, klen, NULL);
     }
     xmlAddChild(metrics, (tmp = xmlNewNode(NULL, (xmlChar *)"metric")));
     xmlSetProp(tmp, (xmlChar *)"name", (xmlChar *)m->metric_name);
@@ -112,8 +109,11 @@ xmlNodePtr
 noit_check_state_as_xml(noit_check_t *check, int full) {
   xmlNodePtr state, tmp, metrics;
   struct timeval now, *whence;
-  stats_t *c = noit_check_get_stats_current(check);
+  stats_t *c;
 
+  /* stats generations and their metrics are retired through safe memory */
+  mtev_memory_begin();
+  c = noit_check_get_stats_current(check);
   mtev_gettimeofday(&now, NULL);
   state = xmlNewNode(NULL, (xmlChar *)"state");
   NODE_CONTENT(state, "running", NOIT_CHECK_RUNNING(check)?"true":"false");
@@ -169,6 +169,7 @@ noit_check_state_as_xml(noit_check_t *check, int full) {
     }
     if(supp) mtev_hash_destroy(supp, NULL, NULL);
   }
+  mtev_memory_end();
   return state;
 }
 
@@ -176,20 +177,16 @@ static struct json_object *
 stats_to_json(stats_t *c, mtev_hash_table *supp) {
   struct json_object *doc;
   doc = json_object_new_object();
-  mtev_hash_table *metrics;
-  mtev_hash_iter iter = MTEV_HASH_ITER_ZERO;
-  const char *k;
-  int klen;
-  void *data;
+  uint32_t iter = 0;
+  metric_t *m;
 
-  metrics = noit_check_stats_metrics(c);
-  while(mtev_hash_next(metrics, &iter, &k, &klen, &data)) {
+  while(noit_check_stats_metric_next(c, &iter, &m)) {
     char buff[256];
-    metric_t *m = (metric_t *)data;
     if(supp) {
       void *unused;
-      if(mtev_hash_retrieve(supp, k, klen, &unused)) continue;
-      mtev_hash_store(supp, k, klen, NULL);
+      int klen = strlen(m->metric_name);
+      if(mtev_hash_retrieve(supp, m->metric_name, klen, &unused)) continue;
+      mtev_hash_store(supp, m->metric_name, klen, NULL);
     }
     struct json_object *metric = json_object_new_object();
     buff[0] = m->metric_type; buff[1] = '\0';
@@ -229,6 +226,8 @@ noit_check_state_as_json(noit_check_t *check, int full) {
   json_object_object_add(doc, "timeout", json_object_new_int(check->timeout));
   json_object_object_add(doc, "flags", json_object_new_int(check->flags));
 
+  /* stats generations and their metrics are retired through safe memory */
+  mtev_memory_begin();
   c = noit_check_get_stats_current(check);
   t = noit_check_stats_whence(c, NULL);
   j_last_run = json_object_new_int(ms);
@@ -323,33 +322,129 @@ noit_check_state_as_json(noit_check_t *check, int full) {
     json_object_object_add(doc, "metrics", metrics);
     if(supp) mtev_hash_destroy(supp, NULL, NULL);
   }
+  mtev_memory_end();
   return doc;
 }
 
+/* /checks/show.json is assembled from each check's pre-serialized state
+ * (noit_check_state_fragment) and streamed out in chunks rather than
+ * built as one json-c document.  The ETag is the state generation: an
+ * If-None-Match naming the current one gets a 304, and ?since=<generation>
+ * lists only checks changed after it, with deleted checks as null.  When
+ * deletions that old are no longer known the full listing is sent;
+ * X-Noit-Check-Delta tells the client which it got.
+ */
+#define CHECKS_JSON_FLUSH_BYTES (64 * 1024)
+
+typedef struct {
+  mtev_http_session_ctx *ctx;
+  uint64_t since;
+  int count;
+  size_t pending;
+} checks_json_stream_t;
+
+static void
+checks_json_append(checks_json_stream_t *js, const char *buff, size_t len) {
+  mtev_http_response_append(js->ctx, buff, len);
+  js->pending += len;
+  if(js->pending >= CHECKS_JSON_FLUSH_BYTES) {
+    mtev_http_response_flush(js->ctx, mtev_false);
+    js->pending = 0;
+  }
+}
 static int
-json_check_accum(noit_check_t *check, void *closure) {
-  struct json_object *cobj, *doc = closure;
-  char id_str[UUID_STR_LEN+1];
+json_check_stream(noit_check_t *check, void *closure) {
+  checks_json_stream_t *js = closure;
+  char id_str[UUID_STR_LEN+1], buff[128];
+  const char *frag;
+  size_t len;
+  uint64_t gen, ms;
+  int blen;
+
+  frag = noit_check_state_fragment(check, &len, &gen);
+  if(!frag || gen <= js->since) return 0;
   uuid_unparse_lower(check->checkid, id_str);
-  cobj = noit_check_state_as_json(check, 0);
-  json_object_object_del(cobj, "id");
-  json_object_object_add(doc, id_str, cobj);
+  blen = snprintf(buff, sizeof(buff), "%s\"%s\":{",
+                  js->count++ ? "," : "", id_str);
+  checks_json_append(js, buff, blen);
+  checks_json_append(js, frag, len);
+  if(check->fire_event) {
+    struct timeval *t = &check->fire_event->whence;
+    ms = (uint64_t)t->tv_sec * 1000ULL + t->tv_usec / 1000;
+    blen = snprintf(buff, sizeof(buff), ",\"flags\":%d,\"next_run\":%llu}",
+                    (int)check->flags, (unsigned long long)ms);
+  }
+  else
+    blen = snprintf(buff, sizeof(buff), ",\"flags\":%d}", (int)check->flags);
+  checks_json_append(js, buff, blen);
   return 1;
 }
+static void
+json_check_deleted(uuid_t checkid, uint64_t gen, void *closure) {
+  checks_json_stream_t *js = closure;
+  char id_str[UUID_STR_LEN+1], buff[128];
+  int blen;
+
+  uuid_unparse_lower(checkid, id_str);
+  blen = snprintf(buff, sizeof(buff), "%s\"%s\":null",
+                  js->count++ ? "," : "", id_str);
+  checks_json_append(js, buff, blen);
+}
 static int
 rest_show_checks_json(mtev_http_rest_closure_t *restc,
                       int npats, char **pats) {
-  const char *jsonstr;
-  struct json_object *doc;
-  doc = json_object_new_object();
-  noit_poller_do(json_check_accum, doc);
+  mtev_http_session_ctx *ctx = restc->http_ctx;
+  mtev_http_request *req = mtev_http_session_request(ctx);
+  mtev_hash_table *hdrs;
+  checks_json_stream_t js;
+  const char *since_str, *etag_in;
+  char etag[64];
+  uint64_t generation;
+  mtev_boolean delta = mtev_false;
+
+  memset(&js, 0, sizeof(js));
+  js.ctx = ctx;
+
+  /* Read the generation first: anything changing while we stream will
+   * be in the next delta, whether or not it made it into this one. */
+  generation = noit_check_state_generation();
+  snprintf(etag, sizeof(etag), "\"%llu\"", (unsigned long long)generation);
+
+  hdrs = mtev_http_request_headers_table(req);
+  if(mtev_hash_retr_str(hdrs, "if-none-match", strlen("if-none-match"), &etag_in) &&
+     !strcmp(etag_in, etag)) {
+    mtev_http_response_standard(ctx, 304, "NOT MODIFIED", "application/json");
+    mtev_http_response_header_set(ctx, "ETag", etag);
+    mtev_http_response_end(ctx);
+    return 0;
+  }
 
-  mtev_http_response_ok(restc->http_ctx, "application/json");
-  jsonstr = json_object_to_json_string(doc);
-  mtev_http_response_append(restc->http_ctx, jsonstr, strlen(jsonstr));
-  mtev_http_response_append(restc->http_ctx, "\n", 1);
-  json_object_put(doc);
-  mtev_http_response_end(restc->http_ctx);
+  since_str = mtev_http_request_querystring(req, "since");
+  if(since_str) {
+    js.since = strtoull(since_str, NULL, 10);
+    if(js.since > 0 && js.since <= generation) delta = mtev_true;
+    else js.since = 0;
+  }
+
+  mtev_http_response_status_set(ctx, 200, "OK");
+  mtev_http_response_option_set(ctx, MTEV_HTTP_CHUNKED);
+  mtev_http_response_header_set(ctx, "Content-Type", "application/json");
+  mtev_http_response_header_set(ctx, "ETag", etag);
+
+  if(delta && noit_check_state_deleted_since(js.since, NULL, NULL) < 0) {
+    js.since = 0;
+    delta = mtev_false;
+  }
+  mtev_http_response_header_set(ctx, "X-Noit-Check-Delta", delta ? "true" : "false");
+
+  /* the state fragments are only good within an epoch */
+  mtev_memory_begin();
+  mtev_http_response_append(ctx, "{", 1);
+  if(delta) noit_check_state_deleted_since(js.since, json_check_deleted, &js);
+  noit_poller_do(json_check_stream, &js);
+  mtev_http_response_append(ctx, "}\n", 2);
+  mtev_memory_end();
+  mtev_http_response_end(ctx);
   return 0;
 }
 static int
@@ -32,6 +32,8 @@
  */
 
 #include <mtev_defines.h>
+
+#include <pthread.h>
 #include <mtev_str.h>
 #include <mtev_json.h>
 #include <eventer/eventer.h>
@@ -40,6 +42,7 @@
 #include "noit_dtrace_probes.h"
 #include "noit_check_tools.h"
 #include "noit_check_tools_shared.h"
+#include "noit_check_wheel.h"
 
 MTEV_HOOK_IMPL(check_preflight,
   (noit_module_t *self, noit_check_t *check, noit_check_t *cause),
@@ -53,12 +56,26 @@ MTEV_HOOK_IMPL(check_postflight,
   (closure,self,check,cause))
 
 typedef struct {
+  noit_check_wheel_entry_t wheel_entry;
   noit_module_t *self;
   noit_check_t *check;
   noit_check_t *cause;
   dispatch_func_t dispatch;
+  int64_t prev_lateness_us;   /* -1 if this is the first fire */
+  mtev_boolean cancelled;     /* set under the fire lock, see below */
 } recur_closure_t;
 
+/* A check's fire event is cancelled from whatever thread reconfigures
+ * or deletes the check, while it fires on the check's eventer thread.
+ * The handler and noit_check_fire_event_cancel serialize on a lock
+ * striped by check; if cancel finds the event already in flight it
+ * marks the closure cancelled and the handler frees it instead.
+ * Lock order: fire lock, then wheel lock. */
+#define FIRE_LOCK_STRIPES 64
+static pthread_mutex_t fire_locks[FIRE_LOCK_STRIPES];
+#define FIRE_LOCK(check) \
+  (&fire_locks[((uintptr_t)(check) / sizeof(noit_check_t)) % FIRE_LOCK_STRIPES])
+
 static void
 noit_check_recur_name_details(char *buf, int buflen,
                               eventer_t e, void *closure) {
@@ -76,15 +93,42 @@ static int
 noit_check_recur_handler(eventer_t e, int mask, void *closure,
                               struct timeval *now) {
   recur_closure_t *rcl = closure;
+  pthread_mutex_t *fire_lock = FIRE_LOCK(rcl->check);
+  struct timeval diff;
+  int64_t lateness_us = 0, jitter_us = -1;
   int ms;
 
-  if(e != rcl->check->fire_event) return 0;
+  pthread_mutex_lock(fire_lock);
+  /* The check may already be gone if we were cancelled */
+  if(rcl->cancelled) {
+    pthread_mutex_unlock(fire_lock);
+    free(rcl);
+    return 0;
+  }
+  if(e != rcl->check->fire_event) {
+    pthread_mutex_unlock(fire_lock);
+    return 0;
+  }
+
+  /* lateness is how far past the intended time we fired, jitter is
+   * how much that changed since the previous fire of this check */
+  if(compare_timeval(*now, e->whence) >= 0) {
+    sub_timeval(*now, e->whence, &diff);
+    lateness_us = (int64_t)diff.tv_sec * 1000000 + diff.tv_usec;
+  }
+  if(rcl->prev_lateness_us >= 0)
+    jitter_us = llabs(lateness_us - rcl->prev_lateness_us);
+  noit_check_wheel_record_timing(rcl->check->period, lateness_us, jitter_us);
 
   noit_check_resolve(rcl->check);
   ms = noit_check_schedule_next(rcl->self, NULL, rcl->check, now,
                                 rcl->dispatch, NULL);
   if(ms == 0)
     rcl->check->fire_event = NULL; /* This is us, we get free post-return */
+  else
+    ((recur_closure_t *)rcl->check->fire_event->closure)->prev_lateness_us =
+      lateness_us;
+  pthread_mutex_unlock(fire_lock);
   if(NOIT_CHECK_RESOLVED(rcl->check)) {
     if(MTEV_HOOK_CONTINUE ==
        check_preflight_hook_invoke(rcl->self, rcl->check, rcl->cause)) {
@@ -187,6 +231,7 @@ noit_check_schedule_next(noit_module_t *self,
   rcl->check = check;
   rcl->cause = cause;
   rcl->dispatch = dispatch;
+  rcl->prev_lateness_us = -1;
   newe->closure = rcl;
 
   /* knuth's golden ratio approach */
@@ -194,10 +239,45 @@ noit_check_schedule_next(noit_module_t *self,
     eventer_set_owner(newe, CHOOSE_EVENTER_THREAD_FOR_CHECK(check));
   }
   check->fire_event = newe;
-  eventer_add(newe);
+  if(!noit_check_wheel_add(&rcl->wheel_entry, newe,
+                           noit_check_is_priority_scheduled(check)))
+    eventer_add(newe);
   return diffms;
 }
 
+void
+noit_check_fire_event_cancel(noit_check_t *check) {
+  pthread_mutex_t *fire_lock = FIRE_LOCK(check);
+  eventer_t e;
+  recur_closure_t *rcl;
+  mtev_boolean removed = mtev_false;
+
+  pthread_mutex_lock(fire_lock);
+  e = check->fire_event;
+  if(!e) {
+    pthread_mutex_unlock(fire_lock);
+    return;
+  }
+  rcl = e->closure;
+  check->fire_event = NULL;
+  switch(noit_check_wheel_remove(&rcl->wheel_entry)) {
+    case NOIT_CHECK_WHEEL_REMOVED: removed = mtev_true; break;
+    case NOIT_CHECK_WHEEL_FIRING: break;
+    case NOIT_CHECK_WHEEL_NOT_SCHEDULED:
+      removed = (eventer_remove(e) != NULL);
+      break;
+  }
+  if(removed) {
+    free(rcl);
+    eventer_free(e);
+  }
+  else {
+    /* In flight; the handler is waiting on our lock and will free */
+    rcl->cancelled = mtev_true;
+  }
+  pthread_mutex_unlock(fire_lock);
+}
+
 void
 noit_check_run_full_asynch_opts(noit_check_t *check, eventer_func_t callback,
                                 int mask) {
@@ -223,6 +303,10 @@ noit_check_run_full_asynch(noit_check_t *check, eventer_func_t callback) {
 
 void
 noit_check_tools_init() {
+  int i;
+  for(i=0; i<FIRE_LOCK_STRIPES; i++)
+    pthread_mutex_init(&fire_locks[i], NULL);
+  noit_check_wheel_init();
   eventer_name_callback_ext("noit_check_recur_handler",
                             noit_check_recur_handler,
                             noit_check_recur_name_details, NULL);
@@ -54,6 +54,10 @@ API_EXPORT(int)
                            struct timeval *now, dispatch_func_t recur,
                            noit_check_t *cause);
 
+/* Unschedule (and free) the pending fire of a check */
+API_EXPORT(void)
+  noit_check_fire_event_cancel(noit_check_t *check);
+
 API_EXPORT(void)
   noit_check_run_full_asynch_opts(noit_check_t *check, eventer_func_t callback,
                                   int mask);
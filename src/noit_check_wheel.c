@@ -0,0 +1,461 @@
+/*
+ * Copyright (c) 2017, Circonus, Inc. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above
+ *       copyright notice, this list of conditions and the following
+ *       disclaimer in the documentation and/or other materials provided
+ *       with the distribution.
+ *     * Neither the name Circonus, Inc. nor the names
+ *       of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written
+ *       permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <mtev_defines.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <circllhist.h>
+
+#include <eventer/eventer.h>
+#include <mtev_log.h>
+#include <mtev_hash.h>
+#include <mtev_conf.h>
+#include <mtev_console.h>
+
+#include "noit_mtev_bridge.h"
+#include "noit_check_wheel.h"
+
+/* This matches the 20ms scheduling slots in noit_check.c */
+#define WHEEL_TICK_MS 20
+#define WHEEL_BITS 8
+#define WHEEL_SLOTS (1 << WHEEL_BITS)
+#define WHEEL_MASK (WHEEL_SLOTS - 1)
+#define WHEEL_LEVELS 3
+/* Level 0 covers ~5s, level 1 ~22m and level 2 ~93h; anything further
+ * out sits on the overflow list until it is close enough to place.
+ * This is what lets checks with periods well beyond the 60 second
+ * slot model be scheduled without a dedicated eventer timer. */
+#define WHEEL_LEVEL_SPAN(l) ((uint64_t)1 << (WHEEL_BITS * ((l)+1)))
+#define WHEEL_LEVEL_IDX(l,t) (((t) >> (WHEEL_BITS * (l))) & WHEEL_MASK)
+
+typedef struct noit_check_wheel {
+  pthread_mutex_t lock;
+  pthread_t owner;
+  int id;
+  uint64_t current_tick;
+  noit_check_wheel_entry_t *firing;
+  noit_check_wheel_entry_t *slots[WHEEL_LEVELS][WHEEL_SLOTS];
+  noit_check_wheel_entry_t *overflow;
+  uint64_t scheduled;
+  uint64_t fired;
+  uint64_t cascaded;
+  uint64_t ticks_behind;
+} noit_check_wheel_t;
+
+struct period_timing {
+  uint32_t period_ms;
+  uint64_t fires;
+  histogram_t *lateness;
+  histogram_t *jitter;
+};
+
+/* per-thread timing stats; only the owning thread inserts, the lock
+ * protects against console readers. */
+struct thread_timing {
+  pthread_mutex_t lock;
+  pthread_t thread;
+  mtev_hash_table periods;
+  struct thread_timing *next;
+};
+
+static mtev_boolean use_wheel = mtev_true;
+static int nwheels = 0;
+static noit_check_wheel_t *wheels = NULL;
+static pthread_mutex_t timing_list_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct thread_timing *timing_list = NULL;
+static __thread struct thread_timing *my_timing = NULL;
+
+static inline uint64_t
+tv_to_tick(const struct timeval *tv) {
+  uint64_t ms = (uint64_t)tv->tv_sec * 1000 + tv->tv_usec / 1000;
+  /* round up, we must never fire early */
+  return (ms + WHEEL_TICK_MS - 1) / WHEEL_TICK_MS;
+}
+
+static inline void
+wheel_list_insert(noit_check_wheel_entry_t **head,
+                  noit_check_wheel_entry_t *ent) {
+  ent->next = *head;
+  if(ent->next) ent->next->pprev = &ent->next;
+  ent->pprev = head;
+  *head = ent;
+}
+
+static inline void
+wheel_list_unlink(noit_check_wheel_entry_t *ent) {
+  if(ent->next) ent->next->pprev = ent->pprev;
+  *ent->pprev = ent->next;
+  ent->next = NULL;
+  ent->pprev = NULL;
+}
+
+/* must be called with the wheel locked */
+static void
+wheel_place(noit_check_wheel_t *w, noit_check_wheel_entry_t *ent) {
+  uint64_t delta;
+  int level;
+  if(ent->tick < w->current_tick) ent->tick = w->current_tick;
+  delta = ent->tick - w->current_tick;
+  for(level=0; level<WHEEL_LEVELS; level++) {
+    if(delta < WHEEL_LEVEL_SPAN(level)) {
+      wheel_list_insert(&w->slots[level][WHEEL_LEVEL_IDX(level, ent->tick)], ent);
+      return;
+    }
+  }
+  wheel_list_insert(&w->overflow, ent);
+}
+
+static void
+wheel_cascade(noit_check_wheel_t *w, noit_check_wheel_entry_t **head) {
+  noit_check_wheel_entry_t *ent;
+  while(NULL != (ent = *head)) {
+    wheel_list_unlink(ent);
+    wheel_place(w, ent);
+    w->cascaded++;
+  }
+}
+
+static noit_check_wheel_t *
+wheel_for_owner(pthread_t owner) {
+  int i;
+  for(i=0; i<nwheels; i++)
+    if(pthread_equal(wheels[i].owner, owner)) return &wheels[i];
+  return NULL;
+}
+
+static void
+wheel_fire(noit_check_wheel_entry_t *ent, struct timeval *now) {
+  eventer_t e = ent->e;
+  /* The callback owns (and usually frees) the closure holding ent */
+  if(e->callback(e, EVENTER_TIMER, e->closure, now) == 0)
+    eventer_free(e);
+}
+
+static void
+wheel_fire_list(noit_check_wheel_t *w, noit_check_wheel_entry_t **head,
+                struct timeval *now) {
+  noit_check_wheel_entry_t *ent;
+  /* Always pop the head; while we are unlocked another thread may
+   * remove other entries from this list, which is safe as they are
+   * unlinked in place under the lock.  The popped entry keeps its
+   * wheel and is marked firing so that a remover can tell it is no
+   * longer scheduled but its callback has not yet completed. */
+  while(NULL != (ent = *head)) {
+    wheel_list_unlink(ent);
+    w->scheduled--;
+    w->fired++;
+    w->firing = ent;
+    pthread_mutex_unlock(&w->lock);
+    /* ent may be freed by the callback, don't touch it after this */
+    wheel_fire(ent, now);
+    pthread_mutex_lock(&w->lock);
+    w->firing = NULL;
+  }
+}
+
+static void
+wheel_process_tick(noit_check_wheel_t *w, uint64_t tick, struct timeval *now) {
+  noit_check_wheel_entry_t *due = NULL, *prio = NULL, *ent, *next;
+
+  /* pull everything that lands in this tick down from the upper levels */
+  if(WHEEL_LEVEL_IDX(0, tick) == 0) {
+    if(WHEEL_LEVEL_IDX(1, tick) == 0) {
+      /* overflow is rare (periods beyond ~93h), re-place it often
+       * enough that nothing can skip past its level 2 slot */
+      wheel_cascade(w, &w->overflow);
+      wheel_cascade(w, &w->slots[2][WHEEL_LEVEL_IDX(2, tick)]);
+    }
+    wheel_cascade(w, &w->slots[1][WHEEL_LEVEL_IDX(1, tick)]);
+  }
+
+  /* detach the slot; callbacks rescheduling from here will land
+   * no earlier than the next tick */
+  due = w->slots[0][WHEEL_LEVEL_IDX(0, tick)];
+  w->slots[0][WHEEL_LEVEL_IDX(0, tick)] = NULL;
+  if(due) due->pprev = &due;
+  w->current_tick = tick + 1;
+
+  /* priority scheduled checks go first */
+  for(ent = due; ent; ent = next) {
+    next = ent->next;
+    if(ent->priority) {
+      wheel_list_unlink(ent);
+      wheel_list_insert(&prio, ent);
+    }
+  }
+  wheel_fire_list(w, &prio, now);
+  wheel_fire_list(w, &due, now);
+}
+
+static int
+noit_check_wheel_tick(eventer_t e, int mask, void *closure,
+                      struct timeval *now) {
+  noit_check_wheel_t *w = closure;
+  uint64_t now_ms, now_tick;
+
+  now_ms = (uint64_t)now->tv_sec * 1000 + now->tv_usec / 1000;
+  now_tick = now_ms / WHEEL_TICK_MS;
+
+  /* The lock is dropped around each callback (see wheel_fire_list);
+   * a concurrent remove of an entry in flight reports it as firing
+   * and leaves freeing it to the callback. */
+  pthread_mutex_lock(&w->lock);
+  if(now_tick > w->current_tick + 1) w->ticks_behind += now_tick - w->current_tick - 1;
+  while(w->current_tick <= now_tick)
+    wheel_process_tick(w, w->current_tick, now);
+  pthread_mutex_unlock(&w->lock);
+
+  now_ms = (now_tick + 1) * WHEEL_TICK_MS;
+  e->whence.tv_sec = now_ms / 1000;
+  e->whence.tv_usec = (now_ms % 1000) * 1000;
+  return EVENTER_TIMER;
+}
+
+mtev_boolean
+noit_check_wheel_enabled() {
+  return use_wheel && nwheels > 0;
+}
+
+mtev_boolean
+noit_check_wheel_add(noit_check_wheel_entry_t *ent, eventer_t e,
+                     mtev_boolean priority) {
+  noit_check_wheel_t *w;
+  if(!noit_check_wheel_enabled()) return mtev_false;
+  w = wheel_for_owner(eventer_get_owner(e));
+  if(!w) return mtev_false;
+  ent->e = e;
+  ent->priority = priority;
+  ent->tick = tv_to_tick(&e->whence);
+  pthread_mutex_lock(&w->lock);
+  ent->wheel = w;
+  wheel_place(w, ent);
+  w->scheduled++;
+  pthread_mutex_unlock(&w->lock);
+  return mtev_true;
+}
+
+noit_check_wheel_remove_t
+noit_check_wheel_remove(noit_check_wheel_entry_t *ent) {
+  noit_check_wheel_remove_t rv = NOIT_CHECK_WHEEL_NOT_SCHEDULED;
+  noit_check_wheel_t *w = ent->wheel;
+  if(!w) return rv;
+  pthread_mutex_lock(&w->lock);
+  if(ent->wheel == w) {
+    if(ent->pprev != NULL) {
+      wheel_list_unlink(ent);
+      ent->wheel = NULL;
+      w->scheduled--;
+      rv = NOIT_CHECK_WHEEL_REMOVED;
+    }
+    else if(w->firing == ent) rv = NOIT_CHECK_WHEEL_FIRING;
+  }
+  pthread_mutex_unlock(&w->lock);
+  return rv;
+}
+
+static struct thread_timing *
+get_my_timing() {
+  if(my_timing == NULL) {
+    struct thread_timing *t = calloc(1, sizeof(*t));
+    pthread_mutex_init(&t->lock, NULL);
+    t->thread = pthread_self();
+    mtev_hash_init(&t->periods);
+    pthread_mutex_lock(&timing_list_lock);
+    t->next = timing_list;
+    timing_list = t;
+    pthread_mutex_unlock(&timing_list_lock);
+    my_timing = t;
+  }
+  return my_timing;
+}
+
+void
+noit_check_wheel_record_timing(uint32_t period_ms,
+                               int64_t lateness_us, int64_t jitter_us) {
+  void *vpt;
+  struct period_timing *pt;
+  struct thread_timing *t = get_my_timing();
+
+  pthread_mutex_lock(&t->lock);
+  if(!mtev_hash_retrieve(&t->periods, (const char *)&period_ms,
+                         sizeof(period_ms), &vpt)) {
+    pt = calloc(1, sizeof(*pt));
+    pt->period_ms = period_ms;
+    pt->lateness = hist_alloc();
+    pt->jitter = hist_alloc();
+    mtev_hash_store(&t->periods, (const char *)&pt->period_ms,
+                    sizeof(pt->period_ms), pt);
+    vpt = pt;
+  }
+  pt = vpt;
+  pt->fires++;
+  if(lateness_us < 0) lateness_us = 0;
+  hist_insert(pt->lateness, (double)lateness_us / 1000.0, 1);
+  if(jitter_us >= 0) hist_insert(pt->jitter, (double)jitter_us / 1000.0, 1);
+  pthread_mutex_unlock(&t->lock);
+}
+
+static int
+noit_console_show_timing_wheel(mtev_console_closure_t ncct,
+                               int argc, char **argv,
+                               mtev_console_state_t *dstate,
+                               void *closure) {
+  int i;
+  double q_in[3] = { 0.5, 0.99, 1.0 }, lq[3], jq[3];
+  mtev_hash_table merged;
+  mtev_hash_iter iter = MTEV_HASH_ITER_ZERO;
+  const char *k;
+  int klen;
+  void *data;
+  struct thread_timing *t;
+
+  nc_printf(ncct, "timing wheel: %s (%d wheels, %dms ticks)\n",
+            noit_check_wheel_enabled() ? "enabled" : "disabled",
+            nwheels, WHEEL_TICK_MS);
+  for(i=0; i<nwheels; i++) {
+    noit_check_wheel_t *w = &wheels[i];
+    pthread_mutex_lock(&w->lock);
+    nc_printf(ncct, "[%d] scheduled: %llu, fired: %llu, cascaded: %llu, ticks behind: %llu\n",
+              w->id, (unsigned long long)w->scheduled,
+              (unsigned long long)w->fired, (unsigned long long)w->cascaded,
+              (unsigned long long)w->ticks_behind);
+    pthread_mutex_unlock(&w->lock);
+  }
+
+  /* merge all per-thread timing into one view per period */
+  mtev_hash_init(&merged);
+  pthread_mutex_lock(&timing_list_lock);
+  for(t = timing_list; t; t = t->next) {
+    pthread_mutex_lock(&t->lock);
+    memset(&iter, 0, sizeof(iter));
+    while(mtev_hash_next(&t->periods, &iter, &k, &klen, &data)) {
+      struct period_timing *src = data, *tgt;
+      void *vtgt;
+      if(!mtev_hash_retrieve(&merged, k, klen, &vtgt)) {
+        tgt = calloc(1, sizeof(*tgt));
+        tgt->period_ms = src->period_ms;
+        tgt->lateness = hist_alloc();
+        tgt->jitter = hist_alloc();
+        mtev_hash_store(&merged, (const char *)&tgt->period_ms,
+                        sizeof(tgt->period_ms), tgt);
+        vtgt = tgt;
+      }
+      tgt = vtgt;
+      tgt->fires += src->fires;
+      hist_accumulate(tgt->lateness, (const histogram_t * const *)&src->lateness, 1);
+      hist_accumulate(tgt->jitter, (const histogram_t * const *)&src->jitter, 1);
+    }
+    pthread_mutex_unlock(&t->lock);
+  }
+  pthread_mutex_unlock(&timing_list_lock);
+
+  memset(&iter, 0, sizeof(iter));
+  while(mtev_hash_next(&merged, &iter, &k, &klen, &data)) {
+    struct period_timing *pt = data;
+    memset(lq, 0, sizeof(lq));
+    memset(jq, 0, sizeof(jq));
+    hist_approx_quantile(pt->lateness, q_in, 3, lq);
+    hist_approx_quantile(pt->jitter, q_in, 3, jq);
+    nc_printf(ncct, "period %ums: %llu fires\n"
+              "\tlateness(ms) p50: %0.3f, p99: %0.3f, max: %0.3f\n"
+              "\tjitter(ms)   p50: %0.3f, p99: %0.3f, max: %0.3f\n",
+              pt->period_ms, (unsigned long long)pt->fires,
+              lq[0], lq[1], lq[2], jq[0], jq[1], jq[2]);
+  }
+  memset(&iter, 0, sizeof(iter));
+  while(mtev_hash_next(&merged, &iter, &k, &klen, &data)) {
+    struct period_timing *pt = data;
+    hist_free(pt->lateness);
+    hist_free(pt->jitter);
+  }
+  mtev_hash_destroy(&merged, NULL, free);
+  return 0;
+}
+
+static void
+register_console_wheel_commands() {
+  mtev_console_state_t *tl;
+  cmd_info_t *showcmd;
+
+  tl = mtev_console_state_initial();
+  showcmd = mtev_console_state_get_cmd(tl, "show");
+  mtevAssert(showcmd && showcmd->dstate);
+
+  mtev_console_state_add_cmd(showcmd->dstate,
+    NCSCMD("timing_wheel", noit_console_show_timing_wheel, NULL, NULL, NULL));
+}
+
+void
+noit_check_wheel_init() {
+  int i;
+  struct timeval now;
+  uint64_t now_ms;
+  pthread_mutexattr_t attr;
+
+  register_console_wheel_commands();
+  eventer_name_callback("noit_check_wheel_tick", noit_check_wheel_tick);
+
+  mtev_conf_get_boolean(NULL, "//checks/@timing_wheel", &use_wheel);
+  if(!use_wheel) {
+    mtevL(noit_debug, "check timing wheel disabled, using eventer timers\n");
+    return;
+  }
+
+  nwheels = eventer_loop_concurrency();
+  mtevAssert(nwheels > 0);
+  wheels = calloc(nwheels, sizeof(*wheels));
+
+  pthread_mutexattr_init(&attr);
+  pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+
+  mtev_gettimeofday(&now, NULL);
+  now_ms = (uint64_t)now.tv_sec * 1000 + now.tv_usec / 1000;
+  for(i=0; i<nwheels; i++) {
+    eventer_t e;
+    noit_check_wheel_t *w = &wheels[i];
+    pthread_mutex_init(&w->lock, &attr);
+    w->id = i;
+    w->owner = eventer_choose_owner(i);
+    w->current_tick = now_ms / WHEEL_TICK_MS;
+
+    e = eventer_alloc();
+    e->mask = EVENTER_TIMER;
+    e->callback = noit_check_wheel_tick;
+    e->closure = w;
+    e->whence.tv_sec = ((w->current_tick + 1) * WHEEL_TICK_MS) / 1000;
+    e->whence.tv_usec = (((w->current_tick + 1) * WHEEL_TICK_MS) % 1000) * 1000;
+    eventer_set_owner(e, w->owner);
+    eventer_add(e);
+  }
+  pthread_mutexattr_destroy(&attr);
+}
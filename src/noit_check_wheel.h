@@ -0,0 +1,90 @@
+/*
+ * Copyright (c) 2017, Circonus, Inc. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above
+ *       copyright notice, this list of conditions and the following
+ *       disclaimer in the documentation and/or other materials provided
+ *       with the distribution.
+ *     * Neither the name Circonus, Inc. nor the names
+ *       of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written
+ *       permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _NOIT_CHECK_WHEEL_H
+#define _NOIT_CHECK_WHEEL_H
+
+#include <mtev_defines.h>
+#include <eventer/eventer.h>
+
+/* The check timing wheel replaces one eventer timer per check fire with
+ * a hierarchical wheel per eventer thread.  Each wheel is driven by a
+ * single recurrent tick (SCHEDULE_GRANULARITY ms) on its owning thread.
+ *
+ * A scheduled event is described by a normal (but never eventer_add'd)
+ * timer eventer_t; the whence, owner, callback and closure are honored
+ * as they would be by the eventer.  The linkage is supplied by the
+ * caller so that scheduling never allocates.
+ */
+
+typedef struct noit_check_wheel_entry {
+  struct noit_check_wheel_entry *next;
+  struct noit_check_wheel_entry **pprev;
+  struct noit_check_wheel *wheel; /* set while scheduled or firing */
+  eventer_t e;
+  uint64_t tick;
+  mtev_boolean priority;  /* fired ahead of others in the same tick */
+} noit_check_wheel_entry_t;
+
+API_EXPORT(void)
+  noit_check_wheel_init();
+
+API_EXPORT(mtev_boolean)
+  noit_check_wheel_enabled();
+
+/* Schedule ent->e on the wheel owned by the eventer's owner thread.
+ * Returns mtev_false if no wheel could take it (the caller should
+ * fall back to eventer_add).
+ */
+API_EXPORT(mtev_boolean)
+  noit_check_wheel_add(noit_check_wheel_entry_t *ent, eventer_t e,
+                       mtev_boolean priority);
+
+typedef enum {
+  NOIT_CHECK_WHEEL_NOT_SCHEDULED = 0,
+  NOIT_CHECK_WHEEL_REMOVED,
+  /* The entry has been taken off the wheel and its callback is running
+   * (or about to run) on the wheel's thread; the callback owns the
+   * event and its closure, so the caller must not free them. */
+  NOIT_CHECK_WHEEL_FIRING
+} noit_check_wheel_remove_t;
+
+API_EXPORT(noit_check_wheel_remove_t)
+  noit_check_wheel_remove(noit_check_wheel_entry_t *ent);
+
+/* Record how late (and how irregularly) a check of the given period
+ * fired.  Both values are in microseconds.
+ */
+API_EXPORT(void)
+  noit_check_wheel_record_timing(uint32_t period_ms,
+                                 int64_t lateness_us, int64_t jitter_us);
+
+#endif
@@ -47,6 +47,7 @@
 #include <mtev_console.h>
 #include <mtev_hash.h>
 #include <mtev_log.h>
+#include <mtev_memory.h>
 #include <mtev_uuid.h>
 
 #include "noit_filters.h"
@@ -407,51 +408,39 @@ noit_console_watch_check(mtev_console_closure_t ncct,
   return 0;
 }
 static int
-_qsort_string_compare(const void *i1, const void *i2) {
-        const char *s1 = ((const char **)i1)[0];
-        const char *s2 = ((const char **)i2)[0];
-        return strcasecmp(s1, s2);
+_qsort_metric_compare(const void *i1, const void *i2) {
+        const metric_t *m1 = ((const metric_t **)i1)[0];
+        const metric_t *m2 = ((const metric_t **)i2)[0];
+        return strcasecmp(m1->metric_name, m2->metric_name);
 }
 static void
 nc_print_stat_metrics(mtev_console_closure_t ncct,
                       noit_check_t *check, stats_t *c) {
   int mcount=0, cnt=0;
-  const char **sorted_keys;
+  metric_t **sorted, *m;
   char buff[256];
   mtev_boolean filtered;
-  mtev_hash_table *metrics;
-  mtev_hash_iter iter = MTEV_HASH_ITER_ZERO;
-  const char *k;
-  int klen;
-  void *data;
+  uint32_t iter = 0;
 
-  metrics = noit_check_stats_metrics(c);
-  memset(&iter, 0, sizeof(iter));
-  while(mtev_hash_next(metrics, &iter, &k, &klen, &data)) cnt++;
-  sorted_keys = malloc(cnt * sizeof(*sorted_keys));
-  memset(&iter, 0, sizeof(iter));
-  while(mtev_hash_next(metrics, &iter, &k, &klen, &data)) {
-    if(sorted_keys && mcount < cnt) sorted_keys[mcount++] = k;
+  cnt = noit_check_stats_metric_count(c);
+  sorted = malloc(cnt * sizeof(*sorted));
+  while(noit_check_stats_metric_next(c, &iter, &m)) {
+    if(sorted && mcount < cnt) sorted[mcount++] = m;
     else {
-      noit_stats_snprint_metric(buff, sizeof(buff), (metric_t *)data);
-      filtered = !noit_apply_filterset(check->filterset, check, (metric_t *)data);
+      noit_stats_snprint_metric(buff, sizeof(buff), m);
+      filtered = !noit_apply_filterset(check->filterset, check, m);
       nc_printf(ncct, "  %c%s\n", filtered ? '*' : ' ', buff);
     }
   }
-  if(sorted_keys) {
+  if(sorted) {
     int j;
-    qsort(sorted_keys, mcount, sizeof(*sorted_keys),
-          _qsort_string_compare);
+    qsort(sorted, mcount, sizeof(*sorted), _qsort_metric_compare);
     for(j=0;j<mcount;j++) {
-      if(mtev_hash_retrieve(metrics,
-                            sorted_keys[j], strlen(sorted_keys[j]),
-                            &data)) {
-        noit_stats_snprint_metric(buff, sizeof(buff), (metric_t *)data);
-        filtered = !noit_apply_filterset(check->filterset, check, (metric_t *)data);
-        nc_printf(ncct, "  %c%s\n", filtered ? '*' : ' ', buff);
-      }
+      noit_stats_snprint_metric(buff, sizeof(buff), sorted[j]);
+      filtered = !noit_apply_filterset(check->filterset, check, sorted[j]);
+      nc_printf(ncct, "  %c%s\n", filtered ? '*' : ' ', buff);
     }
-    free(sorted_keys);
+    free(sorted);
   }
 }
 static int
@@ -555,7 +544,6 @@ noit_console_show_check(mtev_console_closure_t ncct,
       int idx = 0;
       stats_t *c;
       struct timeval *whence;
-      mtev_hash_table *metrics;
       nc_printf(ncct, " target_ip: %s\n", check->target_ip);
       nc_printf(ncct, " currently: %08x ", check->flags);
       if(NOIT_CHECK_RUNNING(check)) { nc_printf(ncct, "running"); idx++; }
@@ -575,6 +563,8 @@ noit_console_show_check(mtev_console_closure_t ncct,
         nc_printf(ncct, " next run: unscheduled\n");
       }
 
+      /* stats generations and their metrics are retired through safe memory */
+      mtev_memory_begin();
       c = noit_check_get_stats_current(check);
       whence = noit_check_stats_whence(c, NULL);
       if(whence->tv_sec == 0) {
@@ -597,23 +587,21 @@ noit_console_show_check(mtev_console_closure_t ncct,
       }
 
       c = noit_check_get_stats_inprogress(check);
-      metrics = noit_check_stats_metrics(c);
-      if(mtev_hash_size(metrics) > 0) {
+      if(noit_check_stats_metric_count(c) > 0) {
         nc_printf(ncct, " metrics (inprogress):\n");
         nc_print_stat_metrics(ncct, check, c);
       }
       c = noit_check_get_stats_current(check);
-      metrics = noit_check_stats_metrics(c);
-      if(mtev_hash_size(metrics)) {
+      if(noit_check_stats_metric_count(c) > 0) {
         nc_printf(ncct, " metrics (current):\n");
         nc_print_stat_metrics(ncct, check, c);
       }
       c = noit_check_get_stats_previous(check);
-      metrics = noit_check_stats_metrics(c);
-      if(mtev_hash_size(metrics) > 0) {
+      if(noit_check_stats_metric_count(c) > 0) {
         nc_printf(ncct, " metrics (previous):\n");
         nc_print_stat_metrics(ncct, check, c);
       }
+      mtev_memory_end();
     }
   }
  out:
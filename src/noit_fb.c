@@ -32,7 +32,11 @@
  * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 
+#include <mtev_hash.h>
+
 #include "noit_fb.h"
+#include "flatbuffers/metric_columns_reader.h"
+#include "flatbuffers/metric_columns_verifier.h"
 
 static void
 flatbuffer_encode_metric(flatcc_builder_t *B, metric_t *m)
@@ -297,3 +301,344 @@ noit_fb_serialize_metricbatch(uint64_t whence_ms, const char *check_uuid,
   return buffer;
 }
 
+
+/* A MetricColumns is built by accumulating each column here and writing
+ * the vectors out in finalize; flatcc can only have one vector open at a
+ * time.  Names and string values are pooled so a repeated string is
+ * stored once.
+ */
+struct metriccolumns_builder {
+  flatcc_builder_t B;
+  mtev_hash_table name_pool, string_pool;
+  nsc(string_ref_t) *names, *strings;
+  uint32_t *name_idx, *string_idx;
+  ns(MetricColumnType_enum_t) *types;
+  int64_t *longs;
+  uint64_t *ulongs;
+  double *doubles;
+  ns(Histogram_ref_t) *histograms;
+  size_t n_names, n_strings, n_string_idx, n, n_longs, n_ulongs, n_doubles, n_histograms;
+  size_t names_allocd, strings_allocd, string_idx_allocd, allocd, longs_allocd,
+         ulongs_allocd, doubles_allocd, histograms_allocd;
+};
+
+#define COLUMN_PUSH(cb, col, v) do { \
+  if((cb)->n_##col == (cb)->col##_allocd) { \
+    (cb)->col##_allocd = (cb)->col##_allocd ? (cb)->col##_allocd * 2 : 64; \
+    (cb)->col = realloc((cb)->col, (cb)->col##_allocd * sizeof(*(cb)->col)); \
+  } \
+  (cb)->col[(cb)->n_##col++] = (v); \
+} while(0)
+
+static uint32_t
+metriccolumns_pool(struct metriccolumns_builder *cb, mtev_hash_table *pool,
+                   nsc(string_ref_t) **refs, size_t *n, size_t *allocd,
+                   const char *str)
+{
+  void *vidx;
+  int len = strlen(str);
+  if(mtev_hash_retrieve(pool, str, len, &vidx)) return (uint32_t)(uintptr_t)vidx;
+  if(*n == *allocd) {
+    *allocd = *allocd ? *allocd * 2 : 64;
+    *refs = realloc(*refs, *allocd * sizeof(**refs));
+  }
+  (*refs)[*n] = nsc(string_create(&cb->B, str, len));
+  mtev_hash_store(pool, strdup(str), len, (void *)(uintptr_t)*n);
+  return (uint32_t)(*n)++;
+}
+
+static void
+metriccolumns_add_entry(struct metriccolumns_builder *cb, const char *name,
+                        ns(MetricColumnType_enum_t) type)
+{
+  uint32_t idx = metriccolumns_pool(cb, &cb->name_pool, &cb->names,
+                                    &cb->n_names, &cb->names_allocd, name);
+  if(cb->n == cb->allocd) {
+    cb->allocd = cb->allocd ? cb->allocd * 2 : 64;
+    cb->name_idx = realloc(cb->name_idx, cb->allocd * sizeof(*cb->name_idx));
+    cb->types = realloc(cb->types, cb->allocd * sizeof(*cb->types));
+  }
+  cb->name_idx[cb->n] = idx;
+  cb->types[cb->n] = type;
+  cb->n++;
+}
+
+void *
+noit_fb_start_metriccolumns(uint64_t whence_ms, const char *check_uuid,
+                            const char *check_name, int account_id)
+{
+  struct metriccolumns_builder *cb = calloc(1, sizeof(*cb));
+  flatcc_builder_t *B = &cb->B;
+  flatcc_builder_init(B);
+  mtev_hash_init(&cb->name_pool);
+  mtev_hash_init(&cb->string_pool);
+
+  ns(MetricColumns_start_as_root(B));
+  ns(MetricColumns_timestamp_add(B, whence_ms));
+  ns(MetricColumns_check_name_create_str(B, check_name));
+  ns(MetricColumns_check_uuid_create_str(B, check_uuid));
+  ns(MetricColumns_account_id_add(B, account_id));
+  return cb;
+}
+
+void
+noit_fb_add_metric_to_metriccolumns(void *builder, metric_t *m)
+{
+  struct metriccolumns_builder *cb = builder;
+
+#define ADD_COLUMN(FBTYPE, MFIELD, COL) do { \
+  if(m->metric_value.MFIELD != NULL) { \
+    metriccolumns_add_entry(cb, m->metric_name, ns(MetricColumnType_##FBTYPE)); \
+    COLUMN_PUSH(cb, COL, *m->metric_value.MFIELD); \
+  } \
+  else metriccolumns_add_entry(cb, m->metric_name, ns(MetricColumnType_Absent##FBTYPE)); \
+} while(0)
+
+  switch(m->metric_type) {
+  case METRIC_INT32:
+    ADD_COLUMN(Int, i, longs);
+    break;
+  case METRIC_UINT32:
+    ADD_COLUMN(Uint, I, longs);
+    break;
+  case METRIC_INT64:
+    ADD_COLUMN(Long, l, longs);
+    break;
+  case METRIC_UINT64:
+    ADD_COLUMN(Ulong, L, ulongs);
+    break;
+  case METRIC_DOUBLE:
+    ADD_COLUMN(Double, n, doubles);
+    break;
+  case METRIC_STRING:
+    if(m->metric_value.s != NULL) {
+      uint32_t idx;
+      metriccolumns_add_entry(cb, m->metric_name, ns(MetricColumnType_String));
+      idx = metriccolumns_pool(cb, &cb->string_pool, &cb->strings,
+                               &cb->n_strings, &cb->strings_allocd,
+                               m->metric_value.s);
+      COLUMN_PUSH(cb, string_idx, idx);
+    }
+    else metriccolumns_add_entry(cb, m->metric_name, ns(MetricColumnType_AbsentString));
+    break;
+  case METRIC_ABSENT:
+  case METRIC_GUESS:
+    break;
+  };
+
+#undef ADD_COLUMN
+}
+
+void
+noit_fb_add_histogram_to_metriccolumns(void *builder, const char *name, histogram_t *h)
+{
+  struct metriccolumns_builder *cb = builder;
+  flatcc_builder_t *B = &cb->B;
+
+  if(h == NULL) {
+    metriccolumns_add_entry(cb, name, ns(MetricColumnType_AbsentHistogram));
+    return;
+  }
+  metriccolumns_add_entry(cb, name, ns(MetricColumnType_Histogram));
+  ns(Histogram_start(B));
+  ns(Histogram_buckets_start(B));
+  for (int i = 0; i < hist_bucket_count(h); i++) {
+    hist_bucket_t bucket;
+    uint64_t count;
+    hist_bucket_idx_bucket(h, i, &bucket, &count);
+    ns(Histogram_buckets_push_start(B));
+    ns(HistogramBucket_val_add(B, bucket.val));
+    ns(HistogramBucket_exp_add(B, bucket.exp));
+    ns(HistogramBucket_count_add(B, count));
+    ns(Histogram_buckets_push_end(B));
+  }
+  ns(Histogram_buckets_end(B));
+  COLUMN_PUSH(cb, histograms, ns(Histogram_end(B)));
+}
+
+void *
+noit_fb_finalize_metriccolumns(void *builder, size_t *out_size)
+{
+  struct metriccolumns_builder *cb = builder;
+  flatcc_builder_t *B = &cb->B;
+
+  nsc(string_vec_ref_t) names = nsc(string_vec_create(B, cb->names, cb->n_names));
+  ns(MetricColumns_names_add(B, names));
+  ns(MetricColumns_name_idx_create(B, cb->name_idx, cb->n));
+  ns(MetricColumns_types_create(B, cb->types, cb->n));
+  if(cb->n_longs) ns(MetricColumns_longs_create(B, cb->longs, cb->n_longs));
+  if(cb->n_ulongs) ns(MetricColumns_ulongs_create(B, cb->ulongs, cb->n_ulongs));
+  if(cb->n_doubles) ns(MetricColumns_doubles_create(B, cb->doubles, cb->n_doubles));
+  if(cb->n_string_idx) {
+    nsc(string_vec_ref_t) strings = nsc(string_vec_create(B, cb->strings, cb->n_strings));
+    ns(MetricColumns_strings_add(B, strings));
+    ns(MetricColumns_string_idx_create(B, cb->string_idx, cb->n_string_idx));
+  }
+  if(cb->n_histograms) {
+    ns(Histogram_vec_ref_t) histograms =
+      ns(Histogram_vec_create(B, cb->histograms, cb->n_histograms));
+    ns(MetricColumns_histograms_add(B, histograms));
+  }
+  ns(MetricColumns_end_as_root(B));
+
+  void *buffer = flatcc_builder_finalize_buffer(B, out_size);
+  flatcc_builder_clear(B);
+  mtev_hash_destroy(&cb->name_pool, free, NULL);
+  mtev_hash_destroy(&cb->string_pool, free, NULL);
+  free(cb->names);
+  free(cb->strings);
+  free(cb->name_idx);
+  free(cb->string_idx);
+  free(cb->types);
+  free(cb->longs);
+  free(cb->ulongs);
+  free(cb->doubles);
+  free(cb->histograms);
+  free(cb);
+  return buffer;
+}
+
+mtev_boolean
+noit_fb_is_metriccolumns(const void *buffer, size_t len)
+{
+  if(len < 8) return mtev_false;
+  return nsc(has_identifier(buffer, "CIMC")) ? mtev_true : mtev_false;
+}
+
+int
+noit_fb_metriccolumns_iter_init(noit_fb_metriccolumns_iter_t *iter,
+                                const void *buffer, size_t len)
+{
+  ns(MetricColumns_table_t) t;
+  ns(MetricColumnType_vec_t) types;
+
+  memset(iter, 0, sizeof(*iter));
+  if(ns(MetricColumns_verify_as_root(buffer, len)) != 0) return -1;
+  t = ns(MetricColumns_as_root(buffer));
+  if(t == NULL) return -1;
+  types = ns(MetricColumns_types(t));
+  if(ns(MetricColumnType_vec_len(types)) !=
+     flatbuffers_uint32_vec_len(ns(MetricColumns_name_idx(t)))) return -1;
+
+  iter->table = t;
+  iter->whence_ms = ns(MetricColumns_timestamp(t));
+  iter->check_name = ns(MetricColumns_check_name(t));
+  iter->check_uuid = ns(MetricColumns_check_uuid(t));
+  iter->account_id = ns(MetricColumns_account_id(t));
+  iter->count = ns(MetricColumnType_vec_len(types));
+  if(!iter->check_name) iter->check_name = "";
+  if(!iter->check_uuid) iter->check_uuid = "";
+  return 0;
+}
+
+int
+noit_fb_metriccolumns_next(noit_fb_metriccolumns_iter_t *iter, metric_t *m,
+                           histogram_t **h)
+{
+  ns(MetricColumns_table_t) t = iter->table;
+
+  while(iter->idx < iter->count) {
+    int i = iter->idx++;
+    uint32_t name_idx = flatbuffers_uint32_vec_at(ns(MetricColumns_name_idx(t)), i);
+    ns(MetricColumnType_vec_t) types = ns(MetricColumns_types(t));
+    ns(MetricColumnType_enum_t) type = ns(MetricColumnType_vec_at(types, i));
+    flatbuffers_string_vec_t names = ns(MetricColumns_names(t));
+
+    if(name_idx >= flatbuffers_string_vec_len(names)) return -1;
+    memset(m, 0, sizeof(*m));
+    m->metric_name = (char *)flatbuffers_string_vec_at(names, name_idx);
+
+#define NEXT_VALUE(COL, CURSOR, VEC, FIELD, MTYPE) do { \
+  flatbuffers_##VEC##_vec_t v = ns(MetricColumns_##COL(t)); \
+  if(iter->CURSOR >= flatbuffers_##VEC##_vec_len(v)) return -1; \
+  iter->value.FIELD = flatbuffers_##VEC##_vec_at(v, iter->CURSOR++); \
+  m->metric_type = MTYPE; \
+  m->metric_value.FIELD = &iter->value.FIELD; \
+} while(0)
+
+    switch(type) {
+    case ns(MetricColumnType_Int):
+      NEXT_VALUE(longs, c_long, int64, l, METRIC_INT64);
+      iter->value.i = (int32_t)iter->value.l;
+      m->metric_type = METRIC_INT32;
+      m->metric_value.i = &iter->value.i;
+      return 1;
+    case ns(MetricColumnType_Uint):
+      NEXT_VALUE(longs, c_long, int64, l, METRIC_INT64);
+      iter->value.I = (uint32_t)iter->value.l;
+      m->metric_type = METRIC_UINT32;
+      m->metric_value.I = &iter->value.I;
+      return 1;
+    case ns(MetricColumnType_Long):
+      NEXT_VALUE(longs, c_long, int64, l, METRIC_INT64);
+      return 1;
+    case ns(MetricColumnType_Ulong):
+      NEXT_VALUE(ulongs, c_ulong, uint64, L, METRIC_UINT64);
+      return 1;
+    case ns(MetricColumnType_Double):
+      NEXT_VALUE(doubles, c_double, double, n, METRIC_DOUBLE);
+      return 1;
+    case ns(MetricColumnType_String):
+      {
+        flatbuffers_uint32_vec_t sidx = ns(MetricColumns_string_idx(t));
+        flatbuffers_string_vec_t strings = ns(MetricColumns_strings(t));
+        uint32_t k;
+        if(iter->c_string >= flatbuffers_uint32_vec_len(sidx)) return -1;
+        k = flatbuffers_uint32_vec_at(sidx, iter->c_string++);
+        if(k >= flatbuffers_string_vec_len(strings)) return -1;
+        m->metric_type = METRIC_STRING;
+        m->metric_value.s = (char *)flatbuffers_string_vec_at(strings, k);
+        return 1;
+      }
+    case ns(MetricColumnType_AbsentInt):
+      m->metric_type = METRIC_INT32;
+      return 1;
+    case ns(MetricColumnType_AbsentUint):
+      m->metric_type = METRIC_UINT32;
+      return 1;
+    case ns(MetricColumnType_AbsentLong):
+      m->metric_type = METRIC_INT64;
+      return 1;
+    case ns(MetricColumnType_AbsentUlong):
+      m->metric_type = METRIC_UINT64;
+      return 1;
+    case ns(MetricColumnType_AbsentDouble):
+      m->metric_type = METRIC_DOUBLE;
+      return 1;
+    case ns(MetricColumnType_AbsentString):
+      m->metric_type = METRIC_STRING;
+      return 1;
+    case ns(MetricColumnType_Histogram):
+      {
+        ns(Histogram_vec_t) hv = ns(MetricColumns_histograms(t));
+        ns(Histogram_table_t) ht;
+        ns(HistogramBucket_vec_t) buckets;
+        size_t nb;
+        if(iter->c_histogram >= ns(Histogram_vec_len(hv))) return -1;
+        ht = ns(Histogram_vec_at(hv, iter->c_histogram++));
+        if(!h) continue;
+        buckets = ns(Histogram_buckets(ht));
+        nb = ns(HistogramBucket_vec_len(buckets));
+        *h = hist_alloc_nbins(nb);
+        for(size_t j = 0; j < nb; j++) {
+          ns(HistogramBucket_table_t) b = ns(HistogramBucket_vec_at(buckets, j));
+          hist_bucket_t bucket;
+          bucket.val = ns(HistogramBucket_val(b));
+          bucket.exp = ns(HistogramBucket_exp(b));
+          hist_insert_raw(*h, bucket, ns(HistogramBucket_count(b)));
+        }
+        m->metric_type = METRIC_ABSENT;
+        return 1;
+      }
+    case ns(MetricColumnType_AbsentHistogram):
+      if(!h) continue;
+      *h = NULL;
+      m->metric_type = METRIC_ABSENT;
+      return 1;
+    default:
+      return -1;
+    }
+#undef NEXT_VALUE
+  }
+  return 0;
+}
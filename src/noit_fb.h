@@ -37,6 +37,7 @@
 
 #include "noit_metric.h"
 #include "flatbuffers/metric_batch_builder.h"
+#include "flatbuffers/metric_columns_builder.h"
 #include "flatbuffers/metric_common_builder.h"
 #include "flatbuffers/metric_list_builder.h"
 
@@ -140,6 +141,98 @@ noit_fb_add_metric_to_metricbatch(void *builder, metric_t *m);
 API_EXPORT(void)
 noit_fb_add_histogram_to_metricbatch(void *builder, const char *name, histogram_t *h);
 
+/*!
+  \fn noit_fb_start_metriccolumns(uint64_t whence_ms, const char *check_uuid, const char *check_name, int account_id)
+  \brief Create a MetricColumns flatbuffer builder which we can append metrics to
+  \return The flatbuffer builder handle
+
+  MetricColumns carries the same content as a MetricBatch, but stores the
+  metrics as columns (names, types and one packed array per value type)
+  rather than as a table per metric.
+*/
+API_EXPORT(void *)
+noit_fb_start_metriccolumns(uint64_t whence_ms, const char *check_uuid,
+                            const char *check_name, int account_id);
+
+/*!
+  \fn noit_fb_add_metric_to_metriccolumns(void *builder, metric_t *m)
+  \brief Add a record to the MetricColumns flatbuffer
+*/
+API_EXPORT(void)
+noit_fb_add_metric_to_metriccolumns(void *builder, metric_t *m);
+
+/*!
+  \fn noit_fb_add_histogram_to_metriccolumns(void *builder, const char *name, histogram_t *h)
+  \brief Add a record to the MetricColumns flatbuffer
+*/
+API_EXPORT(void)
+noit_fb_add_histogram_to_metriccolumns(void *builder, const char *name, histogram_t *h);
+
+/*!
+  \fn noit_fb_finalize_metriccolumns(void *builder, size_t *out_size)
+  \brief Serialize and output the bytes for this MetricColumns flatbuffer based on what has been added so far
+  \return The flatbuffer bytes, size is returned in 'out_size'
+
+  The builder will be destroyed after this call.
+*/
+API_EXPORT(void *)
+noit_fb_finalize_metriccolumns(void *builder, size_t *out_size);
+
+/*!
+  \fn noit_fb_is_metriccolumns(const void *buffer, size_t len)
+  \brief Determine if a flatbuffer is a MetricColumns (as opposed to a MetricBatch)
+  \return mtev_true if the buffer carries the MetricColumns identifier
+*/
+API_EXPORT(mtev_boolean)
+noit_fb_is_metriccolumns(const void *buffer, size_t len);
+
+typedef struct {
+  uint64_t whence_ms;
+  const char *check_name;
+  const char *check_uuid;
+  int account_id;
+  int count;
+  /* private */
+  const void *table;
+  int idx;
+  size_t c_long, c_ulong, c_double, c_string, c_histogram;
+  union {
+    int32_t i;
+    uint32_t I;
+    int64_t l;
+    uint64_t L;
+    double n;
+  } value;
+} noit_fb_metriccolumns_iter_t;
+
+/*!
+  \fn noit_fb_metriccolumns_iter_init(noit_fb_metriccolumns_iter_t *iter, const void *buffer, size_t len)
+  \brief Verify a MetricColumns flatbuffer and prepare to walk its metrics
+  \return 0 on success, -1 if the buffer is not a valid MetricColumns
+
+  On success the check fields and the metric count are available in iter.
+  The buffer must outlive the iterator.
+*/
+API_EXPORT(int)
+noit_fb_metriccolumns_iter_init(noit_fb_metriccolumns_iter_t *iter,
+                                const void *buffer, size_t len);
+
+/*!
+  \fn noit_fb_metriccolumns_next(noit_fb_metriccolumns_iter_t *iter, metric_t *m, histogram_t **h)
+  \brief Decode the next metric from a MetricColumns flatbuffer
+  \return 1 if a metric was decoded, 0 at the end and -1 if the columns are inconsistent
+
+  Numeric and string metrics are returned in 'm' whose name and value
+  point into the buffer (or the iterator) and are valid until the next call.
+  Absent values have a NULL value pointer.  Histograms are skipped unless
+  'h' is given, in which case a histogram is allocated and returned in '*h'
+  (NULL if absent) for the caller to free, with m->metric_type set to
+  METRIC_ABSENT.
+*/
+API_EXPORT(int)
+noit_fb_metriccolumns_next(noit_fb_metriccolumns_iter_t *iter, metric_t *m,
+                           histogram_t **h);
+
 /* convenience macros */
 #undef ns
 #define ns(x) FLATBUFFERS_WRAP_NAMESPACE(circonus, x)
@@ -68,6 +68,36 @@ int noit_is_timestamp(const char *line, int len) {
   }
   return is_ts;
 }
+/* The common case for M records is a well-formed number whose declared
+ * type matches what it looks like; classify it in place rather than
+ * copying it out for strto*().  Returns 0 whenever the result might
+ * differ from the strto*() path, which then handles it.
+ */
+static int
+noit_message_decoder_fast_value(char type, const char *str, int len,
+                                noit_metric_value_t *metric) {
+  noit_metric_value_t v;
+  metric_type_t guess = noit_metric_guess_value(str, len, &v);
+  switch(type) {
+    case METRIC_INT64:
+      if(guess == METRIC_INT64) metric->value.v_int64 = v.value.v_int64;
+      else if(guess == METRIC_UINT64 && v.value.v_uint64 <= INT64_MAX)
+        metric->value.v_int64 = (int64_t)v.value.v_uint64;
+      else return 0;
+      return 1;
+    case METRIC_UINT64:
+      if(guess != METRIC_UINT64) return 0;
+      metric->value.v_uint64 = v.value.v_uint64;
+      return 1;
+    case METRIC_DOUBLE:
+      if(guess != METRIC_DOUBLE) return 0;
+      metric->value.v_double = v.value.v_double;
+      return 1;
+    default:
+      break;
+  }
+  return 0;
+}
 int noit_message_decoder_parse_line(const char *payload, int payload_len,
     uuid_t *id, const char **metric_name, int *metric_name_len,
     const char **noit_name, int *noit_name_len,
@@ -141,6 +171,10 @@ int noit_message_decoder_parse_line(const char *payload, int payload_len,
     if((vlen == 8 && !memcmp(value_str, "[[null]]", 8)) ||
        (vlen == 9 && !memcmp(value_str, "[[null]]\n", 9))) {
       metric->is_null = mtev_true;
+    } else if(vlen < 512 &&
+              noit_message_decoder_fast_value(*metric_type_str, value_str,
+                                              vlen, metric)) {
+      /* parsed in place, no copy needed */
     } else {
       char osnum[512]; /* that's a big number! */
       int nlen = (vlen >= sizeof(osnum)) ? (sizeof(osnum)-1) : vlen;
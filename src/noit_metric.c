@@ -38,6 +38,8 @@
 #include <circllhist.h>
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 
 mtev_boolean
 noit_metric_as_double(metric_t *metric, double *out) {
@@ -58,6 +60,140 @@ noit_metric_as_double(metric_t *metric, double *out) {
   return true;
 }
 
+#define GUESS_ISSPACE(c) ((c) == ' ' || ((c) >= '\t' && (c) <= '\r'))
+#define GUESS_ISDIGIT(c) ((unsigned char)((c) - '0') < 10)
+
+/* Powers of ten that are exact doubles; with a mantissa below 2^53 a
+ * single multiply or divide by one of these is correctly rounded. */
+static const double guess_pow10[] = {
+  1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+  1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
+static double
+noit_metric_guess_strtod(const char *start, const char *end) {
+  char buf[512], *copy = buf;
+  size_t len = end - start;
+  double d;
+  if(len >= sizeof(buf)) copy = malloc(len + 1);
+  memcpy(copy, start, len);
+  copy[len] = '\0';
+  d = strtod(copy, NULL);
+  if(copy != buf) free(copy);
+  return d;
+}
+
+metric_type_t
+noit_metric_guess_value(const char *s, size_t len, noit_metric_value_t *v) {
+  const char *end, *tok, *tokend, *cp;
+  const char *int_start, *frac_start, *frac_end;
+  mtev_boolean negative = mtev_false;
+  uint64_t mantissa = 0;
+  int mantissa_digits = 0;
+  int64_t exp10 = 0;
+
+  if(!s) return METRIC_GUESS;
+  end = memchr(s, '\0', len);
+  if(!end) end = s + len;
+
+  /* token is the first run of non-space; anything after it is trailer */
+  for(tok = s; tok < end && GUESS_ISSPACE(*tok); tok++);
+  for(tokend = tok; tokend < end && !GUESS_ISSPACE(*tokend); tokend++);
+  for(cp = tokend; cp < end; cp++)
+    if(GUESS_ISDIGIT(*cp)) return METRIC_STRING;
+  if(tokend - tok > 1 && tokend[-1] == '%') tokend--;
+
+  cp = tok;
+  if(cp < tokend && (*cp == '-' || *cp == '+')) {
+    negative = (*cp == '-');
+    cp++;
+  }
+  int_start = cp;
+  if(cp >= tokend) return METRIC_STRING;
+  if(*cp == '0') {
+    cp++;
+    if(cp < tokend && *cp != '.') return METRIC_STRING;
+  }
+  else if(*cp >= '1' && *cp <= '9') {
+    while(cp < tokend && GUESS_ISDIGIT(*cp)) cp++;
+    if(cp < tokend && *cp != '.') return METRIC_STRING;
+  }
+  else if(*cp != '.') return METRIC_STRING;
+
+  if(cp == tokend) {
+    /* an integer: [1-9][0-9]* or 0 */
+    uint64_t limit = negative ? (uint64_t)INT64_MAX + 1 : UINT64_MAX;
+    mtev_boolean overflow = mtev_false;
+    for(cp = int_start; cp < tokend; cp++) {
+      uint64_t digit = *cp - '0';
+      if(mantissa > (limit - digit) / 10) {
+        overflow = mtev_true;
+        break;
+      }
+      mantissa = mantissa * 10 + digit;
+    }
+    if(overflow) mantissa = limit;
+    if(negative) {
+      v->type = METRIC_INT64;
+      v->value.v_int64 = (mantissa == (uint64_t)INT64_MAX + 1) ?
+                           INT64_MIN : -(int64_t)mantissa;
+    }
+    else {
+      v->type = METRIC_UINT64;
+      v->value.v_uint64 = mantissa;
+    }
+    return v->type;
+  }
+
+  /* a decimal: .[0-9]+ with an optional e[+-][0-9]+ */
+  cp++; /* the '.' */
+  frac_start = cp;
+  while(cp < tokend && GUESS_ISDIGIT(*cp)) cp++;
+  frac_end = cp;
+  if(frac_end == frac_start) return METRIC_STRING;
+  if(cp < tokend) {
+    mtev_boolean eneg;
+    if(*cp != 'e' && *cp != 'E') return METRIC_STRING;
+    cp++;
+    if(cp >= tokend || (*cp != '-' && *cp != '+')) return METRIC_STRING;
+    eneg = (*cp == '-');
+    cp++;
+    if(cp >= tokend) return METRIC_STRING;
+    for(; cp < tokend; cp++) {
+      if(!GUESS_ISDIGIT(*cp)) return METRIC_STRING;
+      if(exp10 < 100000) exp10 = exp10 * 10 + (*cp - '0');
+    }
+    if(eneg) exp10 = -exp10;
+  }
+
+  /* Fast path: few enough significant digits for an exact mantissa */
+  v->type = METRIC_DOUBLE;
+  for(cp = int_start; cp < frac_end; cp++) {
+    if(*cp == '.') continue;
+    if(mantissa == 0 && *cp == '0') continue;
+    if(mantissa_digits >= 19) {
+      v->value.v_double = noit_metric_guess_strtod(tok, tokend);
+      return METRIC_DOUBLE;
+    }
+    mantissa = mantissa * 10 + (*cp - '0');
+    mantissa_digits++;
+  }
+  exp10 -= (frac_end - frac_start);
+  if(mantissa == 0) {
+    v->value.v_double = negative ? -0.0 : 0.0;
+    return METRIC_DOUBLE;
+  }
+  if(mantissa < ((uint64_t)1 << 53) && exp10 >= -22 && exp10 <= 22) {
+    double d = (double)mantissa;
+    if(exp10 < 0) d /= guess_pow10[-exp10];
+    else d *= guess_pow10[exp10];
+    v->value.v_double = negative ? -d : d;
+    return METRIC_DOUBLE;
+  }
+  v->value.v_double = noit_metric_guess_strtod(tok, tokend);
+  return METRIC_DOUBLE;
+}
+
 void
 noit_metric_to_json(noit_metric_message_t *metric, char **json, size_t *len, mtev_boolean include_original)
 {
@@ -118,4 +118,20 @@ void noit_metric_to_json(noit_metric_message_t *metric, char **json, size_t *len
 /* If possible coerce the metric to a double, return success */
 API_EXPORT(mtev_boolean) noit_metric_as_double(metric_t *m, double *);
 
+/* Infer the type of a METRIC_GUESS value without allocating.  At most len
+ * bytes of s are examined (stopping early at a NUL).  Returns
+ * METRIC_INT64, METRIC_UINT64 or METRIC_DOUBLE and sets v->type and
+ * v->value accordingly, or METRIC_STRING (leaving v untouched) if s is
+ * not a number; METRIC_GUESS is returned if s is NULL.
+ *
+ * A number is optional whitespace, an optional sign, then 0, [1-9][0-9]*
+ * or either followed by .[0-9]+ (the integer part may be omitted) and an
+ * optional e[+-][0-9]+ exponent on decimals.  A single trailing '%' is
+ * ignored, as is any trailer after whitespace as long as it contains no
+ * digits ("12 apples").  Signed integers are INT64, unsigned UINT64, and
+ * out-of-range integers saturate as strtoll/strtoull would.
+ */
+API_EXPORT(metric_type_t)
+  noit_metric_guess_value(const char *s, size_t len, noit_metric_value_t *v);
+
 #endif
@@ -73,6 +73,7 @@ struct hash_and_time {
 static __thread struct {
   int id;
   ck_fifo_spsc_t *fifo;
+  dmflush_t *pending_flush; /* seen mid-batch, observed on the next pull */
 } my_lane;
 
 static mtev_atomic64_t number_of_messages_received = 0;
@@ -388,6 +389,10 @@ noit_metric_message_t *noit_metric_director_lane_next() {
   noit_metric_message_t *msg = NULL;
   if(my_lane.fifo == NULL)
     return NULL;
+  if(my_lane.pending_flush) {
+    dmflush_observe(my_lane.pending_flush);
+    my_lane.pending_flush = NULL;
+  }
  again:
   ck_fifo_spsc_dequeue_lock(my_lane.fifo);
   if(ck_fifo_spsc_dequeue(my_lane.fifo, &msg) == false) {
@@ -400,6 +405,32 @@ noit_metric_message_t *noit_metric_director_lane_next() {
   }
   return msg;
 }
+int noit_metric_director_lane_next_batch(noit_metric_message_t **msgs, int max) {
+  noit_metric_message_t *msg;
+  int n = 0;
+  if(my_lane.fifo == NULL)
+    return 0;
+  /* A flush completes once the messages queued ahead of it have been
+   * consumed, so one found behind part of a batch waits for the next call */
+  if(my_lane.pending_flush) {
+    dmflush_observe(my_lane.pending_flush);
+    my_lane.pending_flush = NULL;
+  }
+  ck_fifo_spsc_dequeue_lock(my_lane.fifo);
+  while(n < max && ck_fifo_spsc_dequeue(my_lane.fifo, &msg)) {
+    if((uintptr_t)msg & FLUSHFLAG) {
+      if(n == 0) {
+        dmflush_observe(DMFLUSH_UNFLAG((dmflush_t *)msg));
+        continue;
+      }
+      my_lane.pending_flush = DMFLUSH_UNFLAG((dmflush_t *)msg);
+      break;
+    }
+    msgs[n++] = msg;
+  }
+  ck_fifo_spsc_dequeue_unlock(my_lane.fifo);
+  return n;
+}
 static noit_noit_t *
 get_noit(const char *payload, int payload_len, noit_noit_t *data) {
   const char *cp = payload, *end = payload + payload_len;
@@ -68,6 +68,9 @@ void noit_adjust_checks_interest(short cnt);
 /* This gets the next line you've subscribed to, if avaialable. */
 noit_metric_message_t *noit_metric_director_lane_next();
 
+/* As above, but takes up to max messages at once; returns how many. */
+int noit_metric_director_lane_next_batch(noit_metric_message_t **msgs, int max);
+
 void noit_metric_director_message_ref(void *message);
 void noit_metric_director_message_deref(void *message);
 void noit_metric_director_init_globals(void);
@@ -0,0 +1,144 @@
+/*
+ * Copyright (c) 2017, Circonus, Inc. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above
+ *       copyright notice, this list of conditions and the following
+ *       disclaimer in the documentation and/or other materials provided
+ *       with the distribution.
+ *     * Neither the name Circonus, Inc. nor the names
+ *       of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written
+ *       permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* The METRIC_GUESS guesser noit_metric_guess_value() replaced, kept as
+ * the reference it must match exactly: noit_test_guess checks the two
+ * agree and noit_bench times them against each other.  Not linked into
+ * the daemons.
+ */
+
+#include "noit_config.h"
+#include <mtev_defines.h>
+
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+#include "noit_metric_guess_legacy.h"
+
+metric_type_t
+noit_metric_guess_type_legacy(const char *s, void **replacement) {
+  char *copy, *cp, *trailer, *rpl;
+  int negative = 0;
+  metric_type_t type = METRIC_STRING;
+
+  if(!s) return METRIC_GUESS;
+  copy = cp = strdup(s);
+
+  /* TRIM the string */
+  while(*cp && isspace(*cp)) cp++; /* ltrim */
+  s = cp; /* found a good starting point */
+  while(*cp) cp++; /* advance to \0 */
+  cp--; /* back up one */
+  while(cp > s && isspace(*cp)) *cp-- = '\0'; /* rtrim */
+
+  /* Find the first space */
+  cp = (char *)s;
+  while(*cp && !isspace(*cp)) cp++;
+  trailer = cp;
+  cp--; /* backup one */
+  if(cp > s && *cp == '%') *cp-- = '\0'; /* chop a last % is there is one */
+
+  while(*trailer && isspace(*trailer)) *trailer++ = '\0'; /* rtrim */
+
+  /* So, the trailer must not contain numbers */
+  while(*trailer) { if(isdigit(*trailer)) goto notanumber; trailer++; }
+
+  rpl = (char *)s;
+  if(s[0] == '-' || s[0] == '+') {
+    if(s[0] == '-') negative = 1;
+    s++;
+  }
+
+  if(s[0] == '.') goto decimal;
+  if(s[0] == '0') {
+    s++;
+    if(!s[0]) goto scanint;
+    if(s[0] == '.') goto decimal;
+    goto notanumber;
+  }
+  if(s[0] >= '1' && s[0] <= '9') {
+    s++;
+    while(isdigit(s[0])) s++;
+    if(!s[0]) goto scanint;
+    if(s[0] == '.') goto decimal;
+    goto notanumber;
+  }
+  goto notanumber;
+
+ decimal:
+  s++;
+  if(!isdigit(s[0])) goto notanumber;
+  s++;
+  while(isdigit(s[0])) s++;
+  if(!s[0]) goto scandouble;
+  if(s[0] == 'e' || s[0] == 'E') goto exponent;
+  goto notanumber;
+
+ exponent:
+  s++;
+  if(s[0] != '-' && s[0] != '+') goto notanumber;
+  s++;
+  if(!isdigit(s[0])) goto notanumber;
+  s++;
+  while(isdigit(s[0])) s++;
+  if(!s[0]) goto scandouble;
+  goto notanumber;
+
+ scanint:
+  if(negative) {
+    int64_t *v = malloc(sizeof(*v));
+    *v = strtoll(rpl, NULL, 10);
+    *replacement = v;
+    type = METRIC_INT64;
+    goto alldone;
+  }
+  else {
+    uint64_t *v = malloc(sizeof(*v));
+    *v = strtoull(rpl, NULL, 10);
+    *replacement = v;
+    type = METRIC_UINT64;
+    goto alldone;
+  }
+ scandouble:
+  {
+    double *v = malloc(sizeof(*v));
+    *v = strtod(rpl, NULL);
+    *replacement = v;
+    type = METRIC_DOUBLE;
+    goto alldone;
+  }
+
+ alldone:
+ notanumber:
+  free(copy);
+  return type;
+}
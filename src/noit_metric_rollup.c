@@ -35,6 +35,7 @@
 #define isnanf(a) __inline_isnanf((float)(a))
 #endif
 #include <math.h>
+#include <limits.h>
 
 static double
 metric_value_double(noit_metric_value_t *v) {
@@ -163,6 +164,35 @@ calculate_change(noit_metric_value_t *v1, noit_metric_value_t *v2,
   return;
 }
 
+static double
+nnt_multitype_double(const nnt_multitype *a) {
+  switch(a->type) {
+    case METRIC_INT32: return a->value.v_int32;
+    case METRIC_UINT32: return a->value.v_uint32;
+    case METRIC_INT64: return a->value.v_int64;
+    case METRIC_UINT64: return a->value.v_uint64;
+    case METRIC_DOUBLE: return a->value.v_double;
+    default: ;
+  }
+  return 0.0;
+}
+
+static void
+nnt_multitype_set_value(nnt_multitype *a, double avg) {
+  if(avg == (double)((uint64_t)avg)) {
+    a->type = METRIC_UINT64;
+    a->value.v_uint64 = avg;
+  }
+  else if(avg == (double)((int64_t)avg)) {
+    a->type = METRIC_INT64;
+    a->value.v_int64 = avg;
+  }
+  else {
+    a->type = METRIC_DOUBLE;
+    a->value.v_double = avg;
+  }
+}
+
 static int nnt_multitype_accum_counts(nnt_multitype *a, int a_count,
                                int a_drun, int a_crun,
                                const nnt_multitype *v, int v_count,
@@ -175,22 +205,8 @@ static int nnt_multitype_accum_counts(nnt_multitype *a, int a_count,
   count = a_count + v_count;
 
   /* extract double form of accumulator and new value */
-  switch(a->type) {
-    case METRIC_INT32: avg_l = a->value.v_int32; break;
-    case METRIC_UINT32: avg_l = a->value.v_uint32; break;
-    case METRIC_INT64: avg_l = a->value.v_int64; break;
-    case METRIC_UINT64: avg_l = a->value.v_uint64; break;
-    case METRIC_DOUBLE: avg_l = a->value.v_double; break;
-    default: avg_l = 0.0;
-  }
-  switch(v->type) {
-    case METRIC_INT32: avg_r = v->value.v_int32; break;
-    case METRIC_UINT32: avg_r = v->value.v_uint32; break;
-    case METRIC_INT64: avg_r = v->value.v_int64; break;
-    case METRIC_UINT64: avg_r = v->value.v_uint64; break;
-    case METRIC_DOUBLE: avg_r = v->value.v_double; break;
-    default: avg_r = 0.0;
-  }
+  avg_l = nnt_multitype_double(a);
+  avg_r = nnt_multitype_double(v);
 
   /* calculate new average */
   if(count) {
@@ -200,18 +216,7 @@ static int nnt_multitype_accum_counts(nnt_multitype *a, int a_count,
 
   if(count) {
     /* Set the value */
-    if(avg == (double)((uint64_t)avg)) {
-      a->type = METRIC_UINT64;
-      a->value.v_uint64 = avg;
-    }
-    else if(avg == (double)((int64_t)avg)) {
-      a->type = METRIC_INT64;
-      a->value.v_int64 = avg;
-    }
-    else {
-      a->type = METRIC_DOUBLE;
-      a->value.v_double = avg;
-    }
+    nnt_multitype_set_value(a, avg);
 
     /* calc the stddev */
     if(a->stddev_present || v->stddev_present) {
@@ -228,7 +233,8 @@ static int nnt_multitype_accum_counts(nnt_multitype *a, int a_count,
                + ((double)v_count) * ((v->stddev*v->stddev) + (avg_r*avg_r));
         stddev /= (double)count;
         stddev -= (avg*avg);
-        a->stddev = sqrt(stddev);
+        /* rounding can leave a zero variance slightly negative */
+        a->stddev = (stddev > 0) ? sqrt(stddev) : 0;
       }
     }
   }
@@ -250,12 +256,12 @@ static int nnt_multitype_accum_counts(nnt_multitype *a, int a_count,
     if(isnanf(a->derivative_stddev) || a_drun == 0) {
       a->derivative_stddev = v->derivative_stddev;
     }
-    else if(!isnanf(v->derivative_stddev)) {
+    else if(!isnanf(v->derivative) && !isnanf(v->derivative_stddev)) {
       stddev = ((double)a_drun * ((a->derivative_stddev * a->derivative_stddev) + avg_l*avg_l))
              + ((double)v_drun * ((v->derivative_stddev * v->derivative_stddev) + avg_r*avg_r));
       stddev /= (double)(a_drun + v_drun);
       stddev -= (a->derivative * a->derivative);
-      a->derivative_stddev = sqrt(stddev);
+      a->derivative_stddev = (stddev > 0) ? sqrt(stddev) : 0;
     }
   }
 
@@ -276,12 +282,12 @@ static int nnt_multitype_accum_counts(nnt_multitype *a, int a_count,
     if(isnanf(a->counter_stddev) || a_crun == 0) {
       a->counter_stddev = v->counter_stddev;
     }
-    else if(!isnanf(v->counter_stddev)) {
+    else if(!isnanf(v->counter) && !isnanf(v->counter_stddev)) {
       stddev = ((double)a_crun * ((a->counter_stddev * a->counter_stddev) + avg_l*avg_l))
              + ((double)v_crun * ((v->counter_stddev * v->counter_stddev) + avg_r*avg_r));
       stddev /= (double)(a_crun + v_crun);
       stddev -= (a->counter * a->counter);
-      a->counter_stddev = sqrt(stddev);
+      a->counter_stddev = (stddev > 0) ? sqrt(stddev) : 0;
     }
   }
 
@@ -317,6 +323,8 @@ noit_metric_rollup_accumulate_numeric(noit_numeric_rollup_accu* accu, noit_metri
       calculate_change(&last_value, value, &dy, &drun);
       if (drun > 0) {
         derivative = (1000.0 * dy) / (double) drun;
+        /* a change to or from a non-finite value has no rate */
+        if (!isfinite(derivative)) derivative = NAN;
       }
 
       /* setup a faux nnt_multitype so we can accum */
@@ -356,3 +364,285 @@ noit_metric_rollup_accumulate_numeric(noit_numeric_rollup_accu* accu, noit_metri
       }
     }
 }
+
+/* Columnar accumulation.
+ *
+ * Runs of well-behaved samples (increasing timestamps after the first
+ * value, finite doubles) are reduced a block at a time: the values,
+ * derivatives and counters of a block are turned into flat double columns
+ * with a single type switch, summed about a shift over fixed-width lanes
+ * (which the compiler vectorizes) and folded into the accumulator with the
+ * pairwise mean/variance update.  Everything else -- the first sample of a
+ * batch, stale or out-of-order samples, non-finite doubles and the point
+ * where the 16 bit count wraps -- is handed to
+ * noit_metric_rollup_accumulate_numeric, which remains the reference.
+ */
+#define ROLLUP_LANES 8
+#define ROLLUP_BLOCK 512
+
+typedef struct {
+  double w;  /* total weight */
+  double s;  /* weighted sum of (v - shift) */
+  double ss; /* weighted sum of (v - shift)^2 */
+} rollup_moments_t;
+
+static void
+rollup_moments_add(rollup_moments_t *m, const double *w, const double *v,
+                   double shift, int n) {
+  double aw[ROLLUP_LANES] = { 0 }, as[ROLLUP_LANES] = { 0 },
+         ass[ROLLUP_LANES] = { 0 };
+  int i = 0, l;
+
+  if(w == NULL) {
+    for(; i + ROLLUP_LANES <= n; i += ROLLUP_LANES) {
+      for(l = 0; l < ROLLUP_LANES; l++) {
+        double dv = v[i+l] - shift;
+        as[l] += dv;
+        ass[l] += dv * dv;
+      }
+    }
+    for(; i < n; i++) {
+      double dv = v[i] - shift;
+      as[0] += dv;
+      ass[0] += dv * dv;
+    }
+    m->w += n;
+  }
+  else {
+    for(; i + ROLLUP_LANES <= n; i += ROLLUP_LANES) {
+      for(l = 0; l < ROLLUP_LANES; l++) {
+        double wdv = w[i+l] * (v[i+l] - shift);
+        aw[l] += w[i+l];
+        as[l] += wdv;
+        ass[l] += wdv * (v[i+l] - shift);
+      }
+    }
+    for(; i < n; i++) {
+      double wdv = w[i] * (v[i] - shift);
+      aw[0] += w[i];
+      as[0] += wdv;
+      ass[0] += wdv * (v[i] - shift);
+    }
+    for(l = 0; l < ROLLUP_LANES; l++) m->w += aw[l];
+  }
+  for(l = 0; l < ROLLUP_LANES; l++) {
+    m->s += as[l];
+    m->ss += ass[l];
+  }
+}
+
+/* Fold moments (about shift) into a running weighted mean and stddev held
+ * with weight *aw.  Returns the combined mean, the stddev is put in *sd. */
+static double
+rollup_moments_merge(const rollup_moments_t *m, double shift,
+                     double aw, double amean, double asd, double *sd) {
+  double w = aw + m->w, mean_b, m2_b, delta, m2;
+
+  mean_b = shift + m->s / m->w;
+  m2_b = m->ss - (m->s * m->s) / m->w;
+  if(m2_b < 0) m2_b = 0;
+  if(aw == 0) {
+    *sd = sqrt(m2_b / m->w);
+    return mean_b;
+  }
+  delta = mean_b - amean;
+  m2 = aw * asd * asd + m2_b + delta * delta * aw * m->w / w;
+  m2 /= w;
+  *sd = (m2 > 0) ? sqrt(m2) : 0;
+  return amean + delta * m->w / w;
+}
+
+/* The same change calculate_change() arrives at for two samples of one
+ * 64 bit integer type. */
+static inline double
+rollup_change_int64(int64_t v1, int64_t v2) {
+  int64_t diff = (int64_t)((uint64_t)v2 - (uint64_t)v1);
+  if((v1 > v2 && diff > 0) || (v2 > v1 && diff < 0))
+    return (double)v2 - (double)v1;
+  return (double)diff;
+}
+static inline double
+rollup_change_uint64(uint64_t v1, uint64_t v2) {
+  int64_t diffi;
+  if(v2 >= v1) return (double)(v2 - v1);
+  diffi = -(v1 - v2);
+  if(diffi > 0) return (double)v2 - (double)v1;
+  return (double)diffi;
+}
+
+static void
+rollup_column_value(noit_metric_value_t *v, metric_type_t type,
+                    const uint64_t *whence_ms, const void *values, size_t i) {
+  memset(v, 0, sizeof(*v));
+  v->whence_ms = whence_ms[i];
+  v->type = type;
+  switch(type) {
+    case METRIC_INT32: v->value.v_int32 = ((const int32_t *)values)[i]; break;
+    case METRIC_UINT32: v->value.v_uint32 = ((const uint32_t *)values)[i]; break;
+    case METRIC_INT64: v->value.v_int64 = ((const int64_t *)values)[i]; break;
+    case METRIC_UINT64: v->value.v_uint64 = ((const uint64_t *)values)[i]; break;
+    case METRIC_DOUBLE: v->value.v_double = ((const double *)values)[i]; break;
+    default: break;
+  }
+}
+
+/* How many samples from i on the block path can take as-is; the sample
+ * before i is the accumulator's last value when i is 0. */
+static size_t
+rollup_fast_run(const noit_numeric_rollup_accu *accu, metric_type_t type,
+                const uint64_t *whence_ms, const void *values,
+                size_t i, size_t nvalues) {
+  size_t k, limit = UINT16_MAX - accu->accumulated.count;
+  const double *dv = (type == METRIC_DOUBLE) ? values : NULL;
+  uint64_t prev_ms;
+
+  if(limit > nvalues - i) limit = nvalues - i;
+  /* Out-of-order samples leave negative runs behind; the scalar path
+   * restarts the average when a run passes through zero, so let it walk
+   * back up to positive. */
+  if(accu->drun < 0 || accu->crun < 0) return 0;
+  if(i == 0) {
+    if(accu->last_value.type != type || accu->last_value.is_null) return 0;
+    if(dv && !isfinite(accu->last_value.value.v_double)) return 0;
+    prev_ms = accu->last_value.whence_ms;
+  }
+  else {
+    if(dv && !isfinite(dv[i-1])) return 0;
+    prev_ms = whence_ms[i-1];
+  }
+  for(k = i; k < i + limit; k++) {
+    if(whence_ms[k] <= prev_ms || whence_ms[k] - prev_ms > INT_MAX ||
+       whence_ms[k] <= accu->first_value_time_ms) break;
+    if(dv && !isfinite(dv[k])) break;
+    prev_ms = whence_ms[k];
+  }
+  return k - i;
+}
+
+static void
+rollup_accumulate_run(noit_numeric_rollup_accu *accu, metric_type_t type,
+                      const uint64_t *whence_ms, const void *values,
+                      size_t i, size_t n) {
+  double x[ROLLUP_BLOCK], d[ROLLUP_BLOCK], dt[ROLLUP_BLOCK], cw[ROLLUP_BLOCK];
+  rollup_moments_t mv = { 0 }, md = { 0 }, mc = { 0 };
+  double xshift = 0, dshift = 0, mean, sd;
+  int64_t drun = 0, crun = 0;
+  nnt_multitype *a = &accu->accumulated;
+  size_t off;
+  int k, bn;
+
+  for(off = 0; off < n; off += bn) {
+    size_t b = i + off;
+    bn = (n - off > ROLLUP_BLOCK) ? ROLLUP_BLOCK : (int)(n - off);
+
+    /* one switch per block: values and raw changes as doubles.  The
+     * sample before the run is the accumulator's last value. */
+    switch(type) {
+#define ROLLUP_FILL(T, field, CHANGE) do { \
+      const T *v = values; \
+      T p = (b == 0) ? accu->last_value.value.field : v[b-1]; \
+      x[0] = (double)v[b]; \
+      d[0] = CHANGE(p, v[b]); \
+      for(k = 1; k < bn; k++) { \
+        x[k] = (double)v[b+k]; \
+        d[k] = CHANGE(v[b+k-1], v[b+k]); \
+      } \
+    } while(0)
+#define ROLLUP_CHANGE_INT(a, b) (double)((int64_t)(b) - (int64_t)(a))
+#define ROLLUP_CHANGE_DOUBLE(a, b) ((b) - (a))
+      case METRIC_INT32:
+        ROLLUP_FILL(int32_t, v_int32, ROLLUP_CHANGE_INT); break;
+      case METRIC_UINT32:
+        ROLLUP_FILL(uint32_t, v_uint32, ROLLUP_CHANGE_INT); break;
+      case METRIC_INT64:
+        ROLLUP_FILL(int64_t, v_int64, rollup_change_int64); break;
+      case METRIC_UINT64:
+        ROLLUP_FILL(uint64_t, v_uint64, rollup_change_uint64); break;
+      case METRIC_DOUBLE:
+        ROLLUP_FILL(double, v_double, ROLLUP_CHANGE_DOUBLE); break;
+#undef ROLLUP_CHANGE_DOUBLE
+#undef ROLLUP_CHANGE_INT
+#undef ROLLUP_FILL
+      default: break;
+    }
+    dt[0] = (double)(int)(whence_ms[b] -
+                          ((b == 0) ? accu->last_value.whence_ms : whence_ms[b-1]));
+    for(k = 1; k < bn; k++)
+      dt[k] = (double)(int)(whence_ms[b+k] - whence_ms[b+k-1]);
+    /* derivatives are stored (and so combined) at float precision; only
+     * non-negative ones count towards the counter */
+    for(k = 0; k < bn; k++) {
+      double dd;
+      dd = (1000.0 * d[k]) / dt[k];
+      cw[k] = (dd >= 0) ? dt[k] : 0;
+      d[k] = (float)dd;
+      drun += (int64_t)dt[k];
+      crun += (int64_t)cw[k];
+    }
+    if(off == 0) {
+      xshift = x[0];
+      dshift = d[0];
+    }
+    rollup_moments_add(&mv, NULL, x, xshift, bn);
+    rollup_moments_add(&md, dt, d, dshift, bn);
+    rollup_moments_add(&mc, cw, d, dshift, bn);
+  }
+
+  /* values */
+  mean = rollup_moments_merge(&mv, xshift, (double)a->count,
+                              nnt_multitype_double(a),
+                              a->stddev_present ? a->stddev : 0, &sd);
+  nnt_multitype_set_value(a, mean);
+  a->stddev_present = 1;
+  a->stddev = sd;
+  a->count += n;
+
+  /* derivative, weighted by the time between samples */
+  if(accu->drun + drun != 0) {
+    double aw = (accu->drun == 0 || isnanf(a->derivative)) ? 0 : accu->drun;
+    mean = rollup_moments_merge(&md, dshift, aw, a->derivative,
+                                isnanf(a->derivative_stddev) ? 0 : a->derivative_stddev,
+                                &sd);
+    a->derivative = mean;
+    a->derivative_stddev = sd;
+  }
+  accu->drun += drun;
+
+  /* counter, only over the non-negative derivatives */
+  if(crun > 0 && accu->crun + crun != 0) {
+    double aw = (accu->crun == 0 || isnanf(a->counter)) ? 0 : accu->crun;
+    mean = rollup_moments_merge(&mc, dshift, aw, a->counter,
+                                isnanf(a->counter_stddev) ? 0 : a->counter_stddev,
+                                &sd);
+    a->counter = mean;
+    a->counter_stddev = sd;
+  }
+  accu->crun += crun;
+
+  rollup_column_value(&accu->last_value, type, whence_ms, values, i + n - 1);
+}
+
+void
+noit_metric_rollup_accumulate_numeric_batch(noit_numeric_rollup_accu *accu,
+                                            metric_type_t type,
+                                            const uint64_t *whence_ms,
+                                            const void *values,
+                                            size_t nvalues) {
+  size_t i = 0, run;
+
+  if(!IS_METRIC_TYPE_NUMERIC(type))
+    mtevFatal(mtev_error, "non-numeric type %x in numeric batch path\n", type);
+
+  while(i < nvalues) {
+    run = rollup_fast_run(accu, type, whence_ms, values, i, nvalues);
+    if(run == 0) {
+      noit_metric_value_t v;
+      rollup_column_value(&v, type, whence_ms, values, i);
+      noit_metric_rollup_accumulate_numeric(accu, &v);
+      i++;
+      continue;
+    }
+    rollup_accumulate_run(accu, type, whence_ms, values, i, run);
+    i += run;
+  }
+}
@@ -66,4 +66,15 @@ typedef struct {
 API_EXPORT(void)
 noit_metric_rollup_accumulate_numeric(noit_numeric_rollup_accu* accumulator, noit_metric_value_t* value);
 
+/* Accumulate nvalues samples of one stream in a single call.  values is an
+ * array of the C type for the numeric metric type (int32_t, uint32_t,
+ * int64_t, uint64_t or double) and whence_ms holds their timestamps.  The
+ * result matches feeding each sample to
+ * noit_metric_rollup_accumulate_numeric in order, up to rounding. */
+API_EXPORT(void)
+noit_metric_rollup_accumulate_numeric_batch(noit_numeric_rollup_accu* accumulator,
+                                            metric_type_t type,
+                                            const uint64_t *whence_ms,
+                                            const void *values, size_t nvalues);
+
 #endif
@@ -0,0 +1,450 @@
+/*
+ * Copyright (c) 2017, Circonus, Inc. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above
+ *       copyright notice, this list of conditions and the following
+ *       disclaimer in the documentation and/or other materials provided
+ *       with the distribution.
+ *     * Neither the name Circonus, Inc. nor the names
+ *       of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written
+ *       permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* Round trips through the MetricColumns codec (noit_fb.c): every metric
+ * type at the edges of its range, absent values of each type, pooled
+ * names and strings, histograms and a large generated batch, read back
+ * with noit_fb_metriccolumns_next and decoded as a BF line by
+ * noit_check_log_b_to_sm.  Prints TAP and exits non-zero on any
+ * mismatch.
+ */
+
+#include "noit_config.h"
+#include <mtev_defines.h>
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+
+#include "noit_metric.h"
+#include "noit_fb.h"
+#include "noit_check_log_helpers.h"
+#include "flatbuffers/metric_columns_reader.h"
+
+#define WHENCE_MS 1700000000123ULL
+#define CHECK_NAME "127.0.0.1`test`columns`"
+#define CHECK_UUID "5e8c6d2a-7f1b-4c3e-9a0d-2b4f6e8a1c3d"
+#define ACCOUNT_ID 42
+
+#define GEN_COUNT 5000
+#define GEN_NAMES 300
+#define GEN_STRINGS 20
+
+typedef struct {
+  const char *name;
+  metric_type_t type;   /* unused for histograms */
+  int absent;
+  int histogram;
+  union {
+    int32_t i;
+    uint32_t I;
+    int64_t l;
+    uint64_t L;
+    double n;
+  } v;
+  const char *s;
+  histogram_t *h;
+} expect_t;
+
+static expect_t fixed[] = {
+  { "i.neg", METRIC_INT32, 0, 0, { .i = -5 } },
+  { "i.min", METRIC_INT32, 0, 0, { .i = INT32_MIN } },
+  { "i.max", METRIC_INT32, 0, 0, { .i = INT32_MAX } },
+  { "I.zero", METRIC_UINT32, 0, 0, { .I = 0 } },
+  { "I.max", METRIC_UINT32, 0, 0, { .I = UINT32_MAX } },
+  { "l.min", METRIC_INT64, 0, 0, { .l = INT64_MIN } },
+  { "l.max", METRIC_INT64, 0, 0, { .l = INT64_MAX } },
+  { "L.top", METRIC_UINT64, 0, 0, { .L = 1ULL << 63 } },
+  { "L.max", METRIC_UINT64, 0, 0, { .L = UINT64_MAX } },
+  { "n.frac", METRIC_DOUBLE, 0, 0, { .n = 3.25 } },
+  { "n.negzero", METRIC_DOUBLE, 0, 0, { .n = -0.0 } },
+  { "n.denormal", METRIC_DOUBLE, 0, 0, { .n = 5e-324 } },
+  { "n.huge", METRIC_DOUBLE, 0, 0, { .n = -1.7976931348623157e308 } },
+  { "n.inf", METRIC_DOUBLE, 0, 0, { .n = INFINITY } },
+  { "s.up", METRIC_STRING, 0, 0, { 0 }, "up" },
+  { "s.empty", METRIC_STRING, 0, 0, { 0 }, "" },
+  { "s.down", METRIC_STRING, 0, 0, { 0 }, "down" },
+  { "s.up.again", METRIC_STRING, 0, 0, { 0 }, "up" },
+  { "i.absent", METRIC_INT32, 1 },
+  { "I.absent", METRIC_UINT32, 1 },
+  { "l.absent", METRIC_INT64, 1 },
+  { "L.absent", METRIC_UINT64, 1 },
+  { "n.absent", METRIC_DOUBLE, 1 },
+  { "s.absent", METRIC_STRING, 1 },
+  { "h", 0, 0, 1 },
+  { "h.absent", 0, 1, 1 },
+  { "s.empty.again", METRIC_STRING, 0, 0, { 0 }, "" },
+  /* a name seen before, with another type; a name equal to a value */
+  { "i.neg", METRIC_INT64, 0, 0, { .l = -5 } },
+  { "up", METRIC_STRING, 0, 0, { 0 }, "up" },
+  { "h", 0, 0, 1 },
+  { "i.tail", METRIC_INT32, 0, 0, { .i = 7 } },
+};
+
+static const double hist_samples[] = { 0, 0.5, 1, 1, 42, 42.1, 1e6, -3 };
+
+static int ntests = 0, nfailed = 0;
+
+static void
+ok(int pass, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+static void
+ok(int pass, const char *fmt, ...) {
+  va_list ap;
+  ntests++;
+  if(!pass) nfailed++;
+  printf("%sok %d - ", pass ? "" : "not ", ntests);
+  va_start(ap, fmt);
+  vprintf(fmt, ap);
+  va_end(ap);
+  printf("\n");
+}
+
+static uint64_t lcg_state = 0x9e3779b97f4a7c15ULL;
+static uint64_t
+lcg(void) {
+  lcg_state = lcg_state * 6364136223846793005ULL + 1442695040888963407ULL;
+  return lcg_state >> 17;
+}
+
+static void
+expect_metric(const expect_t *e, metric_t *m) {
+  memset(m, 0, sizeof(*m));
+  m->metric_name = (char *)e->name;
+  m->metric_type = e->type;
+  if(e->absent) return;
+  if(e->type == METRIC_STRING) m->metric_value.s = (char *)e->s;
+  else m->metric_value.vp = (void *)&e->v;
+}
+
+static void *
+encode(const expect_t *e, int n, size_t *size) {
+  void *B = noit_fb_start_metriccolumns(WHENCE_MS, CHECK_UUID, CHECK_NAME, ACCOUNT_ID);
+  int i;
+  for(i=0; i<n; i++) {
+    metric_t m;
+    if(e[i].histogram) {
+      noit_fb_add_histogram_to_metriccolumns(B, e[i].name, e[i].h);
+      continue;
+    }
+    expect_metric(&e[i], &m);
+    noit_fb_add_metric_to_metriccolumns(B, &m);
+  }
+  return noit_fb_finalize_metriccolumns(B, size);
+}
+
+static int
+same_histogram(const histogram_t *a, const histogram_t *b) {
+  int i;
+  if(hist_bucket_count(a) != hist_bucket_count(b)) return 0;
+  for(i=0; i<hist_bucket_count(a); i++) {
+    hist_bucket_t ba, bb;
+    uint64_t ca, cb;
+    hist_bucket_idx_bucket(a, i, &ba, &ca);
+    hist_bucket_idx_bucket(b, i, &bb, &cb);
+    if(ba.val != bb.val || ba.exp != bb.exp || ca != cb) return 0;
+  }
+  return 1;
+}
+
+static int
+same_value(const expect_t *e, const metric_t *m) {
+  if(m->metric_type != e->type) return 0;
+  if(e->absent) return m->metric_value.vp == NULL;
+  if(m->metric_value.vp == NULL) return 0;
+  switch(e->type) {
+  case METRIC_INT32: return *m->metric_value.i == e->v.i;
+  case METRIC_UINT32: return *m->metric_value.I == e->v.I;
+  case METRIC_INT64: return *m->metric_value.l == e->v.l;
+  case METRIC_UINT64: return *m->metric_value.L == e->v.L;
+  /* bit for bit: -0.0 and denormals included */
+  case METRIC_DOUBLE: return !memcmp(m->metric_value.n, &e->v.n, sizeof(double));
+  case METRIC_STRING: return !strcmp(m->metric_value.s, e->s);
+  default: return 0;
+  }
+}
+
+/* Walk the buffer and compare it against e[0..n); histograms are
+ * decoded if with_hist, skipped otherwise.  Returns the number of
+ * mismatches, describing the first.
+ */
+static int
+walk(const void *buf, size_t size, const expect_t *e, int n, int with_hist) {
+  noit_fb_metriccolumns_iter_t iter;
+  int i, rv, bad = 0;
+
+  if(noit_fb_metriccolumns_iter_init(&iter, buf, size)) {
+    printf("# iter_init refused the buffer\n");
+    return 1;
+  }
+  if(iter.whence_ms != WHENCE_MS || strcmp(iter.check_name, CHECK_NAME) ||
+     strcmp(iter.check_uuid, CHECK_UUID) || iter.account_id != ACCOUNT_ID ||
+     iter.count != n) {
+    printf("# header: %llu %s %s %d count %d\n",
+           (unsigned long long)iter.whence_ms, iter.check_name,
+           iter.check_uuid, iter.account_id, iter.count);
+    bad++;
+  }
+  for(i=0; i<n; i++) {
+    metric_t m;
+    histogram_t *h = NULL;
+    const expect_t *x = &e[i];
+
+    if(x->histogram && !with_hist) continue;
+    rv = noit_fb_metriccolumns_next(&iter, &m, with_hist ? &h : NULL);
+    if(rv != 1) {
+      printf("# next returned %d at %d (%s)\n", rv, i, x->name);
+      return bad + 1;
+    }
+    if(strcmp(m.metric_name, x->name)) {
+      if(!bad++) printf("# %d: name %s, expected %s\n", i, m.metric_name, x->name);
+    }
+    else if(x->histogram) {
+      if(m.metric_type != METRIC_ABSENT || (h == NULL) != x->absent ||
+         (h && !same_histogram(h, x->h))) {
+        if(!bad++) printf("# %d: histogram %s differs\n", i, x->name);
+      }
+    }
+    else if(!same_value(x, &m)) {
+      if(!bad++) printf("# %d: %s differs (type %c)\n", i, x->name, m.metric_type);
+    }
+    if(h) hist_free(h);
+  }
+  if((rv = noit_fb_metriccolumns_next(&iter, &(metric_t){0}, NULL)) != 0) {
+    printf("# next returned %d past the end\n", rv);
+    bad++;
+  }
+  return bad;
+}
+
+static int
+distinct(const expect_t *e, int n, int strings) {
+  int i, j, cnt = 0;
+  for(i=0; i<n; i++) {
+    const char *a = strings ? e[i].s : e[i].name;
+    if(strings && (e[i].histogram || e[i].absent || e[i].type != METRIC_STRING))
+      continue;
+    for(j=0; j<i; j++) {
+      const char *b = strings ? e[j].s : e[j].name;
+      if(strings && (e[j].histogram || e[j].absent || e[j].type != METRIC_STRING))
+        continue;
+      if(!strcmp(a, b)) break;
+    }
+    if(j == i) cnt++;
+  }
+  return cnt;
+}
+
+/* Both pools must hold each distinct string once */
+static int
+pooled(const void *buf, const expect_t *e, int n) {
+  ns(MetricColumns_table_t) t = ns(MetricColumns_as_root(buf));
+  size_t names = flatbuffers_string_vec_len(ns(MetricColumns_names(t)));
+  size_t strings = flatbuffers_string_vec_len(ns(MetricColumns_strings(t)));
+  if(names != (size_t)distinct(e, n, 0) || strings != (size_t)distinct(e, n, 1)) {
+    printf("# %zu names (%d distinct), %zu strings (%d distinct)\n",
+           names, distinct(e, n, 0), strings, distinct(e, n, 1));
+    return 0;
+  }
+  return 1;
+}
+
+/* The M lines noit_check_log_b_to_sm must produce for e */
+static char **
+expected_lines(const expect_t *e, int n, int *cnt) {
+  char **lines = calloc(n, sizeof(*lines));
+  int i;
+  *cnt = 0;
+  for(i=0; i<n; i++) {
+    char value[64];
+    const char *text = value;
+    if(e[i].histogram) continue;
+    if(e[i].absent) text = "[[null]]";
+    else switch(e[i].type) {
+    case METRIC_INT32: snprintf(value, sizeof(value), "%d", e[i].v.i); break;
+    case METRIC_UINT32: snprintf(value, sizeof(value), "%u", e[i].v.I); break;
+    case METRIC_INT64: snprintf(value, sizeof(value), "%lld", (long long)e[i].v.l); break;
+    case METRIC_UINT64:
+      snprintf(value, sizeof(value), "%llu", (unsigned long long)e[i].v.L); break;
+    case METRIC_DOUBLE: snprintf(value, sizeof(value), "%.12e", e[i].v.n); break;
+    default: text = e[i].s; break;
+    }
+    if(asprintf(&lines[*cnt], "M\t%llu.%03llu\t%s%s\t%s\t%c\t%s",
+                WHENCE_MS / 1000, WHENCE_MS % 1000, CHECK_NAME, CHECK_UUID,
+                e[i].name, e[i].type, text) < 0) abort();
+    (*cnt)++;
+  }
+  return lines;
+}
+
+static int
+b_to_sm(const void *buf, size_t size, const expect_t *e, int n,
+        const char *noit, int noit_ip) {
+  char *b64, *line, **out = NULL, **want;
+  unsigned int b64len;
+  int i, cnt, nwant, bad = 0;
+
+  if(noit_check_log_bundle_compress_b64(NOIT_COMPRESS_LZ4, buf, size,
+                                        &b64, &b64len)) {
+    printf("# cannot compress\n");
+    return 0;
+  }
+  if(asprintf(&line, "BF\t%s%s%d\t%.*s", noit ? noit : "", noit ? "\t" : "",
+              (int)size, (int)b64len, b64) < 0) abort();
+  free(b64);
+
+  want = expected_lines(e, n, &nwant);
+  cnt = noit_check_log_b_to_sm(line, strlen(line), &out, noit_ip);
+  if(cnt != nwant) {
+    printf("# %d lines, expected %d\n", cnt, nwant);
+    bad++;
+  }
+  for(i=0; i<cnt && i<nwant; i++) {
+    if(strcmp(out[i], want[i]) && !bad++)
+      printf("# line %d: %s\n#  expected %s\n", i, out[i], want[i]);
+  }
+  for(i=0; i<cnt; i++) free(out[i]);
+  free(out);
+  for(i=0; i<nwant; i++) free(want[i]);
+  free(want);
+  free(line);
+  return bad == 0;
+}
+
+/* A large batch past every column's initial allocation */
+static expect_t *
+generate(int n, char ***names, char ***strings) {
+  static const metric_type_t types[] = {
+    METRIC_INT32, METRIC_UINT32, METRIC_INT64, METRIC_UINT64,
+    METRIC_DOUBLE, METRIC_STRING
+  };
+  expect_t *e = calloc(n, sizeof(*e));
+  int i;
+
+  *names = calloc(GEN_NAMES, sizeof(**names));
+  *strings = calloc(GEN_STRINGS, sizeof(**strings));
+  for(i=0; i<GEN_NAMES; i++)
+    if(asprintf(&(*names)[i], "gen.metric`%d", i) < 0) abort();
+  for(i=0; i<GEN_STRINGS; i++)
+    if(asprintf(&(*strings)[i], "state %d", i) < 0) abort();
+
+  for(i=0; i<n; i++) {
+    uint64_t r = lcg();
+    e[i].name = (*names)[r % GEN_NAMES];
+    if(lcg() % 50 == 0) {
+      e[i].histogram = 1;
+      e[i].absent = lcg() % 4 == 0;
+      continue;
+    }
+    e[i].type = types[lcg() % 6];
+    e[i].absent = lcg() % 8 == 0;
+    r = lcg() << 20 ^ lcg();
+    switch(e[i].type) {
+    case METRIC_INT32: e[i].v.i = (int32_t)r; break;
+    case METRIC_UINT32: e[i].v.I = (uint32_t)r; break;
+    case METRIC_INT64: e[i].v.l = (int64_t)r; break;
+    case METRIC_UINT64: e[i].v.L = r; break;
+    case METRIC_DOUBLE: e[i].v.n = (double)(int64_t)r / 1e6; break;
+    default: e[i].s = (*strings)[r % GEN_STRINGS]; break;
+    }
+  }
+  return e;
+}
+
+int
+main(int argc, char **argv) {
+  int nfixed = sizeof(fixed) / sizeof(*fixed), i, j;
+  histogram_t *h = hist_alloc();
+  expect_t *gen;
+  char **names, **strings;
+  void *buf;
+  size_t size;
+
+  for(i=0; i<(int)(sizeof(hist_samples) / sizeof(*hist_samples)); i++)
+    hist_insert(h, hist_samples[i], i + 1);
+  for(i=0; i<nfixed; i++) if(fixed[i].histogram && !fixed[i].absent) fixed[i].h = h;
+
+  buf = encode(fixed, nfixed, &size);
+  ok(noit_fb_is_metriccolumns(buf, size), "identified as MetricColumns");
+  ok(walk(buf, size, fixed, nfixed, 1) == 0, "every type, absent and histogram round trip");
+  ok(walk(buf, size, fixed, nfixed, 0) == 0, "histograms skipped without h");
+  ok(pooled(buf, fixed, nfixed), "names and strings pooled");
+  ok(b_to_sm(buf, size, fixed, nfixed, NULL, 0), "b_to_sm decodes BF MetricColumns");
+  ok(b_to_sm(buf, size, fixed, nfixed, NULL, -1), "b_to_sm detects no noit field");
+  ok(b_to_sm(buf, size, fixed, nfixed, "127.0.0.2", -1), "b_to_sm detects a noit field");
+  ok(noit_fb_metriccolumns_iter_init(&(noit_fb_metriccolumns_iter_t){0}, buf, size / 2) == -1,
+     "truncated buffer refused");
+  free(buf);
+
+  /* each prefix: a column may be empty or hold a single entry */
+  for(i=0, j=0; i<=nfixed; i++) {
+    buf = encode(fixed, i, &size);
+    if(walk(buf, size, fixed, i, 1) != 0 || walk(buf, size, fixed, i, 0) != 0) {
+      printf("# first %d fixed metrics\n", i);
+      j++;
+    }
+    free(buf);
+  }
+  ok(j == 0, "every prefix of the fixed metrics round trips");
+
+  buf = noit_fb_start_metricbatch(WHENCE_MS, CHECK_UUID, CHECK_NAME, ACCOUNT_ID);
+  {
+    metric_t m;
+    expect_metric(&fixed[0], &m);
+    noit_fb_add_metric_to_metricbatch(buf, &m);
+  }
+  buf = noit_fb_finalize_metricbatch(buf, &size);
+  ok(!noit_fb_is_metriccolumns(buf, size) &&
+     noit_fb_metriccolumns_iter_init(&(noit_fb_metriccolumns_iter_t){0}, buf, size) == -1,
+     "MetricBatch is not MetricColumns");
+  free(buf);
+
+  gen = generate(GEN_COUNT, &names, &strings);
+  for(i=0; i<GEN_COUNT; i++) if(gen[i].histogram && !gen[i].absent) gen[i].h = h;
+  buf = encode(gen, GEN_COUNT, &size);
+  ok(walk(buf, size, gen, GEN_COUNT, 1) == 0, "%d generated metrics round trip", GEN_COUNT);
+  ok(pooled(buf, gen, GEN_COUNT), "generated names and strings pooled");
+  ok(b_to_sm(buf, size, gen, GEN_COUNT, NULL, 0), "b_to_sm decodes generated metrics");
+  free(buf);
+  for(i=0; i<GEN_NAMES; i++) free(names[i]);
+  for(i=0; i<GEN_STRINGS; i++) free(strings[i]);
+  free(names);
+  free(strings);
+  free(gen);
+  hist_free(h);
+
+  printf("1..%d\n", ntests);
+  if(nfailed) fprintf(stderr, "%d of %d MetricColumns tests failed\n",
+                      nfailed, ntests);
+  return nfailed ? 1 : 0;
+}
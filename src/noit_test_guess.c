@@ -0,0 +1,281 @@
+/*
+ * Copyright (c) 2017, Circonus, Inc. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above
+ *       copyright notice, this list of conditions and the following
+ *       disclaimer in the documentation and/or other materials provided
+ *       with the distribution.
+ *     * Neither the name Circonus, Inc. nor the names
+ *       of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written
+ *       permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* Conformance of noit_metric_guess_value against the guesser it
+ * replaced (noit_metric_guess_legacy.c): the same type for every input
+ * and the same value, bit for bit for doubles.  Inputs are the edges of
+ * the grammar, a few hundred thousand generated number-like strings and
+ * those strings again with len cutting them short or running past an
+ * embedded NUL.  Prints TAP and exits non-zero on any mismatch.
+ */
+
+#include "noit_config.h"
+#include <mtev_defines.h>
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "noit_metric.h"
+#include "noit_metric_guess_legacy.h"
+
+#define FUZZ_COUNT 300000
+#define FUZZ_MAXLEN 48
+
+static int ntests = 0, nfailed = 0;
+
+static void
+ok(int pass, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+static void
+ok(int pass, const char *fmt, ...) {
+  va_list ap;
+  ntests++;
+  if(!pass) nfailed++;
+  printf("%sok %d - ", pass ? "" : "not ", ntests);
+  va_start(ap, fmt);
+  vprintf(fmt, ap);
+  va_end(ap);
+  printf("\n");
+}
+
+/* s for a TAP line: control characters escaped (static buffer) */
+static const char *
+esc(const char *s) {
+  static char out[4 * FUZZ_MAXLEN + 64];
+  size_t o = 0;
+  for(; *s && o < sizeof(out) - 5; s++) {
+    if(*s == '\t') o += sprintf(out + o, "\\t");
+    else if(*s == '\n') o += sprintf(out + o, "\\n");
+    else if((unsigned char)*s < ' ') o += sprintf(out + o, "\\x%02x", (unsigned char)*s);
+    else out[o++] = *s;
+  }
+  out[o] = '\0';
+  return out;
+}
+
+/* Guess the first len bytes of s both ways; the legacy guesser sees them
+ * as a C string.  On a mismatch a diagnostic is printed and 0 returned. */
+static int
+agree(const char *s, size_t len) {
+  char *copy;
+  void *replacement = NULL;
+  noit_metric_value_t v;
+  metric_type_t lt, nt;
+  int same;
+
+  copy = malloc(len + 1);
+  memcpy(copy, s, len);
+  copy[len] = '\0';
+  lt = noit_metric_guess_type_legacy(copy, &replacement);
+  memset(&v, 0, sizeof(v));
+  nt = noit_metric_guess_value(s, len, &v);
+  same = (lt == nt);
+  if(same) {
+    switch(lt) {
+      case METRIC_INT64:
+        same = (v.value.v_int64 == *(int64_t *)replacement); break;
+      case METRIC_UINT64:
+        same = (v.value.v_uint64 == *(uint64_t *)replacement); break;
+      case METRIC_DOUBLE:
+        same = !memcmp(&v.value.v_double, replacement, sizeof(double)); break;
+      default: break;
+    }
+  }
+  if(!same)
+    printf("# \"%s\": %c vs legacy %c\n", esc(copy), nt ? nt : '-', lt ? lt : '-');
+  free(replacement);
+  free(copy);
+  return same;
+}
+
+static int
+agree_str(const char *s) {
+  return agree(s, strlen(s));
+}
+
+static const char *edges[] = {
+  /* integers */
+  "0", "-0", "+0", "00", "01", "-01", "7", "-7", "+7", "10", "1000000",
+  "9223372036854775807", "9223372036854775808", "-9223372036854775807",
+  "-9223372036854775808", "-9223372036854775809", "-99999999999999999999",
+  "18446744073709551615", "18446744073709551616", "99999999999999999999",
+  "4294967295", "4294967296", "-2147483648",
+  /* decimals */
+  "0.", ".5", "-.5", "+.5", "0.0", "-0.0", "0.000", "1.0", "-1.0", "0.1",
+  "0.30000000000000004", "3.14159", "2.718281828459045235360287",
+  "123456789012345678901234567890.5", "9007199254740993.0",
+  "9007199254740992.5", "1234567890123456789.5", "12345678901234567890.5",
+  "0.0000000000000000000000001", "100000000000000000000000.0",
+  "1.7976931348623157", "4.9406564584124654",
+  /* exponents */
+  "1e10", "1.0e10", "1.5e+10", "1.5E-10", "1.5e10", "1.0e+22", "1.0e+23",
+  "1.0e-22", "1.0e-23", "-1.5e-308", "4.9e-324", "2.4e-324",
+  "1.7976931348623157e+308", "1.7976931348623159e+308", "1.0e+400",
+  "1.0e-400", "1.0e+99999999999", "1.0e-99999999999", "1.0e+", "1.0e-",
+  "1.0e+1.5", "1.0ee+5", "1.0e+5e",
+  /* whitespace, percentages and trailers */
+  "  42  ", "\t42\n", "42%", "42%%", "%42", " 87.5% used ", "12 apples",
+  "12 apples 3", "1 2", "1\t2", "1 %", "5 kB", "-5 \t", "3.5 ms",
+  /* not numbers */
+  "%", "-", "+", ".", "-.", "+-1", "--1", "e5", "1.e5", "1..2", ".e5",
+  "0x10", "0b1", "inf", "-inf", "nan", "NaN", "infinity", "", "   ",
+  "1,000", "1_000", "12a", "a12",
+  NULL
+};
+
+static uint64_t lcg_state = 0x6e6f6974ULL;
+static uint32_t
+lcg(void) {
+  lcg_state = lcg_state * 6364136223846793005ULL + 1442695040888963407ULL;
+  return (uint32_t)(lcg_state >> 33);
+}
+
+static void
+append(char *buf, size_t *len, const char *s) {
+  while(*s && *len < FUZZ_MAXLEN) buf[(*len)++] = *s++;
+}
+static void
+digits(char *buf, size_t *len, int max) {
+  int i, n = lcg() % (max + 1);
+  for(i=0; i<n && *len < FUZZ_MAXLEN; i++) buf[(*len)++] = '0' + lcg() % 10;
+}
+
+/* A string that is usually a number or nearly one: each part of the
+ * grammar is present, absent or perturbed at random. */
+static size_t
+fuzz_number(char *buf) {
+  static const char *space[] = { "", "", "", " ", "  ", "\t" };
+  static const char *sign[] = { "", "", "", "-", "+", "--" };
+  static const char *trail[] = { "", "", "", "", "%", " ", " ms", " 5", "x", "%%" };
+  size_t len = 0;
+  append(buf, &len, space[lcg() % 6]);
+  append(buf, &len, sign[lcg() % 6]);
+  if(lcg() % 8 == 0) append(buf, &len, "0");
+  digits(buf, &len, (lcg() % 4 == 0) ? 25 : 6);
+  if(lcg() % 2) {
+    append(buf, &len, ".");
+    digits(buf, &len, (lcg() % 4 == 0) ? 25 : 6);
+  }
+  if(lcg() % 4 == 0) {
+    append(buf, &len, (lcg() % 2) ? "e" : "E");
+    append(buf, &len, sign[lcg() % 6]);
+    digits(buf, &len, (lcg() % 8 == 0) ? 6 : 3);
+  }
+  append(buf, &len, trail[lcg() % 10]);
+  append(buf, &len, space[lcg() % 6]);
+  buf[len] = '\0';
+  return len;
+}
+
+/* Any string over the characters the grammar cares about. */
+static size_t
+fuzz_noise(char *buf) {
+  static const char alphabet[] = "0123456789000111.....--++eEE%%  \tx";
+  size_t i, len = lcg() % 16;
+  for(i=0; i<len; i++) buf[i] = alphabet[lcg() % (sizeof(alphabet) - 1)];
+  buf[len] = '\0';
+  return len;
+}
+
+int
+main(int argc, char **argv) {
+  char buf[FUZZ_MAXLEN + 1], *big;
+  int i, fails;
+  noit_metric_value_t v;
+  void *replacement = NULL;
+
+  ok(noit_metric_guess_value(NULL, 0, &v) == METRIC_GUESS &&
+     noit_metric_guess_type_legacy(NULL, &replacement) == METRIC_GUESS,
+     "NULL is METRIC_GUESS");
+
+  for(i=0; edges[i]; i++)
+    ok(agree_str(edges[i]), "edge \"%s\"", esc(edges[i]));
+
+  /* past the fast path's 512 byte copy buffer */
+  big = malloc(2048);
+  memset(big, '1', 700);
+  strcpy(big + 700, ".25");
+  ok(agree_str(big), "700 digit decimal");
+  strcpy(big + 700, ".25e-300");
+  ok(agree_str(big), "700 digit decimal with exponent");
+  memset(big, '0', 1500);
+  big[1] = '.';
+  big[1500] = '\0';
+  ok(agree_str(big), "1500 character zero");
+  free(big);
+
+  for(fails = 0, i = 0; i < FUZZ_COUNT; i++) {
+    fuzz_number(buf);
+    if(!agree_str(buf) && ++fails >= 10) break;
+  }
+  ok(fails == 0, "%d generated numbers", i);
+
+  for(fails = 0, i = 0; i < FUZZ_COUNT; i++) {
+    fuzz_noise(buf);
+    if(!agree_str(buf) && ++fails >= 10) break;
+  }
+  ok(fails == 0, "%d generated strings", i);
+
+  /* len shorter than the string: the guess must stop at len */
+  for(fails = 0, i = 0; i < FUZZ_COUNT / 4; i++) {
+    size_t len = fuzz_number(buf);
+    if(len && !agree(buf, lcg() % len) && ++fails >= 10) break;
+  }
+  ok(fails == 0, "%d generated numbers cut short by len", i);
+
+  /* len past an embedded NUL: the guess must stop at the NUL */
+  for(fails = 0, i = 0; i < FUZZ_COUNT / 4; i++) {
+    size_t len = fuzz_number(buf), slen;
+    char padded[FUZZ_MAXLEN + 8];
+    noit_metric_value_t a, b;
+    metric_type_t ta, tb;
+
+    memcpy(padded, buf, len);
+    memcpy(padded + len, "\0" "123 x", 6);
+    slen = len + 6;
+    memset(&a, 0, sizeof(a));
+    memset(&b, 0, sizeof(b));
+    ta = noit_metric_guess_value(padded, slen, &a);
+    tb = noit_metric_guess_value(buf, len, &b);
+    if(ta != tb || memcmp(&a.value, &b.value, sizeof(a.value))) {
+      printf("# \"%s\" followed by NUL: %c vs %c\n", esc(buf), ta, tb);
+      if(++fails >= 10) break;
+    }
+  }
+  ok(fails == 0, "%d generated numbers followed by NUL and more", i);
+
+  printf("1..%d\n", ntests);
+  if(nfailed) fprintf(stderr, "%d of %d guess conformance tests failed\n",
+                      nfailed, ntests);
+  return nfailed ? 1 : 0;
+}
@@ -0,0 +1,351 @@
+/*
+ * Copyright (c) 2017, Circonus, Inc. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above
+ *       copyright notice, this list of conditions and the following
+ *       disclaimer in the documentation and/or other materials provided
+ *       with the distribution.
+ *     * Neither the name Circonus, Inc. nor the names
+ *       of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written
+ *       permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* Conformance of noit_metric_rollup_accumulate_numeric_batch against
+ * noit_metric_rollup_accumulate_numeric, the scalar reference, for every
+ * numeric type: well-behaved series whose lengths straddle the lane and
+ * block boundaries of the columnar path, series fed in uneven pieces,
+ * out-of-order and duplicate timestamps, NaN and infinite doubles,
+ * counters wrapping at the top of their type and the 16 bit sample count
+ * wrapping.  Prints TAP and exits non-zero on any mismatch.
+ */
+
+#include "noit_config.h"
+#include <mtev_defines.h>
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <limits.h>
+#include <math.h>
+
+#include "noit_metric.h"
+#include "noit_metric_rollup.h"
+
+/* the columnar path's geometry (noit_metric_rollup.c) */
+#define LANES 8
+#define BLOCK 512
+
+typedef enum {
+  SERIES_SMOOTH,
+  SERIES_OUT_OF_ORDER,
+  SERIES_NONFINITE,
+  SERIES_WRAP
+} series_kind_t;
+
+static const char *kind_names[] = { "smooth", "out-of-order", "nan", "wrap" };
+
+typedef struct {
+  metric_type_t type;
+  size_t n;
+  uint64_t *whence_ms;
+  void *values;
+  double vscale; /* largest |value| */
+  double dscale; /* largest |derivative| */
+} series_t;
+
+static int ntests = 0, nfailed = 0;
+
+static uint64_t lcg_state;
+static uint32_t
+lcg(void) {
+  lcg_state = lcg_state * 6364136223846793005ULL + 1442695040888963407ULL;
+  return (uint32_t)(lcg_state >> 33);
+}
+
+static double
+series_double(const series_t *s, size_t i) {
+  switch(s->type) {
+    case METRIC_INT32: return ((int32_t *)s->values)[i];
+    case METRIC_UINT32: return ((uint32_t *)s->values)[i];
+    case METRIC_INT64: return ((int64_t *)s->values)[i];
+    case METRIC_UINT64: return ((uint64_t *)s->values)[i];
+    case METRIC_DOUBLE: return ((double *)s->values)[i];
+    default: return 0;
+  }
+}
+
+/* Store step i of a series in the column; x is the smooth value and
+ * wrap, when set, the value of a counter wrapping at the top of the
+ * type. */
+static void
+series_set(series_t *s, size_t i, double x, uint64_t wrap) {
+  switch(s->type) {
+    case METRIC_INT32:
+      ((int32_t *)s->values)[i] = wrap ? (int32_t)(uint32_t)wrap : (int32_t)x;
+      break;
+    case METRIC_UINT32:
+      ((uint32_t *)s->values)[i] = wrap ? (uint32_t)wrap : (uint32_t)fabs(x);
+      break;
+    case METRIC_INT64:
+      ((int64_t *)s->values)[i] = wrap ? (int64_t)wrap : (int64_t)x;
+      break;
+    case METRIC_UINT64:
+      ((uint64_t *)s->values)[i] = wrap ? wrap : (uint64_t)fabs(x);
+      break;
+    case METRIC_DOUBLE:
+      ((double *)s->values)[i] = wrap ? (double)(wrap % 1000003) : x;
+      break;
+    default: break;
+  }
+}
+
+static void
+series_make(series_t *s, metric_type_t type, series_kind_t kind, size_t n,
+            uint64_t seed) {
+  size_t i, width;
+  uint64_t ms = 1500000000000ULL, counter, step;
+
+  lcg_state = seed;
+  width = (type == METRIC_INT32 || type == METRIC_UINT32) ? 4 : 8;
+  memset(s, 0, sizeof(*s));
+  s->type = type;
+  s->n = n;
+  s->whence_ms = calloc(n ? n : 1, sizeof(*s->whence_ms));
+  s->values = calloc(n ? n : 1, width);
+  /* start the counter a few steps short of the top of the type */
+  step = 1000 + lcg() % 5000;
+  switch(type) {
+    case METRIC_INT32: case METRIC_UINT32: counter = UINT32_MAX - 7 * step; break;
+    case METRIC_INT64: counter = (uint64_t)INT64_MAX - 7 * step; break;
+    default: counter = UINT64_MAX - 7 * step; break;
+  }
+
+  for(i=0; i<n; i++) {
+    double x = 1000.0 + (double)i * 2.5 + (double)(lcg() % 1000) / 10.0;
+    if(type == METRIC_INT32 || type == METRIC_INT64) x -= 2000.0;
+    if(type == METRIC_DOUBLE) x += (double)(lcg() % 1000) / 997.0;
+
+    ms += 1000 + lcg() % 50;
+    s->whence_ms[i] = ms;
+    if(kind == SERIES_OUT_OF_ORDER) {
+      if(i % 37 == 36) s->whence_ms[i] = ms - 2500;     /* late */
+      else if(i % 41 == 40) s->whence_ms[i] = s->whence_ms[i-1]; /* duplicate */
+    }
+    if(kind == SERIES_WRAP) {
+      counter += step;
+      /* keep 0 meaning "not wrapping" */
+      series_set(s, i, x, counter ? counter : 1);
+    }
+    else series_set(s, i, x, 0);
+    if(kind == SERIES_NONFINITE && type == METRIC_DOUBLE) {
+      if(i % 53 == 17) ((double *)s->values)[i] = NAN;
+      else if(i % 97 == 60) ((double *)s->values)[i] = INFINITY;
+      else if(i % 101 == 70) ((double *)s->values)[i] = -INFINITY;
+    }
+  }
+
+  for(i=0; i<n; i++) {
+    double v = series_double(s, i);
+    if(isfinite(v) && fabs(v) > s->vscale) s->vscale = fabs(v);
+    if(i > 0 && s->whence_ms[i] > s->whence_ms[i-1]) {
+      double d = 1000.0 * (v - series_double(s, i-1)) /
+                 (double)(s->whence_ms[i] - s->whence_ms[i-1]);
+      if(isfinite(d) && fabs(d) > s->dscale) s->dscale = fabs(d);
+    }
+  }
+}
+
+static void
+series_free(series_t *s) {
+  free(s->whence_ms);
+  free(s->values);
+}
+
+static void
+series_value(const series_t *s, size_t i, noit_metric_value_t *v) {
+  memset(v, 0, sizeof(*v));
+  v->whence_ms = s->whence_ms[i];
+  v->type = s->type;
+  switch(s->type) {
+    case METRIC_INT32: v->value.v_int32 = ((int32_t *)s->values)[i]; break;
+    case METRIC_UINT32: v->value.v_uint32 = ((uint32_t *)s->values)[i]; break;
+    case METRIC_INT64: v->value.v_int64 = ((int64_t *)s->values)[i]; break;
+    case METRIC_UINT64: v->value.v_uint64 = ((uint64_t *)s->values)[i]; break;
+    case METRIC_DOUBLE: v->value.v_double = ((double *)s->values)[i]; break;
+    default: break;
+  }
+}
+
+static double
+accu_value(const nnt_multitype *a) {
+  switch(a->type) {
+    case METRIC_INT32: return a->value.v_int32;
+    case METRIC_UINT32: return a->value.v_uint32;
+    case METRIC_INT64: return a->value.v_int64;
+    case METRIC_UINT64: return a->value.v_uint64;
+    case METRIC_DOUBLE: return a->value.v_double;
+    default: return 0;
+  }
+}
+
+/* Equal up to rounding relative to scale; NaN only matches NaN. */
+static int
+close_to(double a, double b, double rel, double scale) {
+  if(isnan(a) || isnan(b)) return isnan(a) && isnan(b);
+  if(isinf(a) || isinf(b)) return a == b;
+  return fabs(a - b) <= rel * (scale + fabs(a) + 1.0);
+}
+
+/* Standard deviations are compared as variances: the scalar path
+ * recovers the variance as E[x^2] - mean^2 each sample from a running
+ * mean and stddev held in floats, so its error grows with the square of
+ * the magnitude, not with the spread. */
+static int
+close_sd(double a, double b, double rel, double scale) {
+  if(isnan(a) || isnan(b)) return isnan(a) && isnan(b);
+  return fabs(a * a - b * b) <= rel * (scale * scale + 1.0);
+}
+
+static void
+ok(int pass, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+static void
+ok(int pass, const char *fmt, ...) {
+  va_list ap;
+  ntests++;
+  if(!pass) nfailed++;
+  printf("%sok %d - ", pass ? "" : "not ", ntests);
+  va_start(ap, fmt);
+  vprintf(fmt, ap);
+  va_end(ap);
+  printf("\n");
+}
+
+/* Compare the two accumulators; on a mismatch name the first field that
+ * differs in why. */
+static int
+accu_match(const noit_numeric_rollup_accu *ref, const noit_numeric_rollup_accu *got,
+           const series_t *s, const char **why) {
+  const nnt_multitype *r = &ref->accumulated, *g = &got->accumulated;
+  double vs = s->vscale, ds = s->dscale;
+
+  *why = NULL;
+  if(r->count != g->count) *why = "count";
+  else if(ref->drun != got->drun) *why = "drun";
+  else if(ref->crun != got->crun) *why = "crun";
+  else if(ref->first_value_time_ms != got->first_value_time_ms) *why = "first_value_time_ms";
+  else if(ref->last_value.whence_ms != got->last_value.whence_ms ||
+          ref->last_value.type != got->last_value.type ||
+          memcmp(&ref->last_value.value, &got->last_value.value,
+                 sizeof(ref->last_value.value)))
+    *why = "last_value";
+  else if(r->stddev_present != g->stddev_present) *why = "stddev_present";
+  else if(!close_to(accu_value(r), accu_value(g), 1e-9, vs)) *why = "value";
+  else if(r->stddev_present && !close_sd(r->stddev, g->stddev, 1e-5, vs)) *why = "stddev";
+  else if(!close_to(r->derivative, g->derivative, 1e-4, ds)) *why = "derivative";
+  else if(!close_sd(r->derivative_stddev, g->derivative_stddev, 1e-5, ds))
+    *why = "derivative_stddev";
+  else if(!close_to(r->counter, g->counter, 1e-4, ds)) *why = "counter";
+  else if(!close_sd(r->counter_stddev, g->counter_stddev, 1e-5, ds))
+    *why = "counter_stddev";
+  return *why == NULL;
+}
+
+/* Feed s to a scalar and a batch accumulator, the batch in pieces of
+ * the given sizes (cycled; 0 means all at once), and compare. */
+static void
+conform(const series_t *s, const char *what, const size_t *pieces, int npieces) {
+  noit_numeric_rollup_accu ref, got;
+  noit_metric_value_t v;
+  const char *why;
+  size_t i, p = 0;
+  int k = 0;
+
+  memset(&ref, 0, sizeof(ref));
+  memset(&got, 0, sizeof(got));
+  for(i=0; i<s->n; i++) {
+    series_value(s, i, &v);
+    noit_metric_rollup_accumulate_numeric(&ref, &v);
+  }
+  while(p < s->n) {
+    size_t len = npieces ? pieces[k++ % npieces] : s->n;
+    const char *vals = s->values;
+    size_t width = (s->type == METRIC_INT32 || s->type == METRIC_UINT32) ? 4 : 8;
+    if(len == 0 || len > s->n - p) len = s->n - p;
+    noit_metric_rollup_accumulate_numeric_batch(&got, s->type, &s->whence_ms[p],
+                                                vals + p * width, len);
+    p += len;
+  }
+  if(accu_match(&ref, &got, s, &why)) ok(1, "%s", what);
+  else ok(0, "%s: %s differs", what, why);
+}
+
+static const metric_type_t types[] = {
+  METRIC_INT32, METRIC_UINT32, METRIC_INT64, METRIC_UINT64, METRIC_DOUBLE
+};
+#define NTYPES (sizeof(types)/sizeof(*types))
+
+int
+main(int argc, char **argv) {
+  /* lengths on either side of the lane width and the block size */
+  static const size_t lengths[] = {
+    1, 2, LANES - 1, LANES, LANES + 1, 2 * LANES + 1,
+    BLOCK - 1, BLOCK, BLOCK + 1, 2 * BLOCK + LANES + 3, 5000
+  };
+  /* uneven pieces, so runs start mid-lane and mid-block and the first
+   * sample of a call comes from the accumulator's last value */
+  static const size_t pieces[] = { 1, LANES - 1, 3, BLOCK + 1, LANES, 2 };
+  char what[128];
+  size_t t, l;
+  int kind;
+
+  for(t=0; t<NTYPES; t++) {
+    char tc = (char)types[t];
+    for(kind=SERIES_SMOOTH; kind<=SERIES_WRAP; kind++) {
+      if(kind == SERIES_NONFINITE && types[t] != METRIC_DOUBLE) continue;
+      for(l=0; l<sizeof(lengths)/sizeof(*lengths); l++) {
+        series_t s;
+        series_make(&s, types[t], kind, lengths[l], 0x5eed + t * 131 + kind * 17 + l);
+        snprintf(what, sizeof(what), "%c %s n=%zu whole", tc, kind_names[kind], lengths[l]);
+        conform(&s, what, NULL, 0);
+        snprintf(what, sizeof(what), "%c %s n=%zu pieces", tc, kind_names[kind], lengths[l]);
+        conform(&s, what, pieces, sizeof(pieces)/sizeof(*pieces));
+        series_free(&s);
+      }
+    }
+    /* past the 16 bit sample count, where the columnar path must hand
+     * the wrapping sample to the scalar one */
+    {
+      series_t s;
+      series_make(&s, types[t], SERIES_SMOOTH, UINT16_MAX + 2 * BLOCK, 0xc0ffee + t);
+      snprintf(what, sizeof(what), "%c count wrap n=%zu", tc, s.n);
+      conform(&s, what, NULL, 0);
+      series_free(&s);
+    }
+  }
+
+  printf("1..%d\n", ntests);
+  if(nfailed) fprintf(stderr, "%d of %d rollup conformance tests failed\n",
+                      nfailed, ntests);
+  return nfailed ? 1 : 0;
+}
@@ -0,0 +1,398 @@
+/*
+ * Copyright (c) 2017, Circonus, Inc. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above
+ *       copyright notice, this list of conditions and the following
+ *       disclaimer in the documentation and/or other materials provided
+ *       with the distribution.
+ *     * Neither the name Circonus, Inc. nor the names
+ *       of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written
+ *       permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#define _GNU_SOURCE
+#include <sys/socket.h>
+#undef _GNU_SOURCE
+
+#include <mtev_defines.h>
+#include "noit_config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/uio.h>
+
+#include <eventer/eventer.h>
+#include <mtev_log.h>
+#include <mtev_hash.h>
+#include <mtev_console.h>
+
+#include "noit_mtev_bridge.h"
+#include "noit_check.h"
+#include "noit_udp.h"
+
+#define DEFAULT_BATCH 32
+#define MAX_BATCH 1024
+/* direct mapped; a collision just costs a re-lookup */
+#define SOURCE_CACHE_SIZE 1024
+
+#if defined(SO_RXQ_OVFL)
+#define RXQ_CMSG_SPACE CMSG_SPACE(sizeof(uint32_t))
+#else
+#define RXQ_CMSG_SPACE 0
+#endif
+
+typedef struct {
+  int family;             /* 0 if unused */
+  uint32_t generation;
+  uint8_t addr[16];
+  char ip[INET6_ADDRSTRLEN];
+  int nchecks;
+  mtev_boolean checks_truncated;
+  noit_check_t *checks[NOIT_UDP_MAX_CHECKS];
+} udp_source_t;
+
+struct noit_udp_receiver {
+  char *name;
+  char *module;
+  void *closure;
+  int batch;
+  int payload_len;
+  char *buffers;
+  noit_udp_packet_t *packets;
+  struct iovec *iovs;
+#ifdef HAVE_RECVMMSG
+  struct mmsghdr *msgs;
+#else
+  struct msghdr *msgs;
+#endif
+  char *cmsgs;
+  udp_source_t *sources;
+
+  /* only written by the owning eventer thread */
+  uint64_t calls;
+  uint64_t packets_in;
+  uint64_t bytes_in;
+  uint64_t truncated;
+  uint64_t cache_hits;
+  uint64_t cache_misses;
+  uint32_t kernel_drops;  /* as last reported by SO_RXQ_OVFL */
+
+  struct noit_udp_receiver *next;
+};
+
+static pthread_mutex_t receivers_lock = PTHREAD_MUTEX_INITIALIZER;
+static noit_udp_receiver_t *receivers = NULL;
+static mtev_boolean console_registered = mtev_false;
+
+static void register_console_udp_commands();
+
+noit_udp_receiver_t *
+noit_udp_receiver_alloc(const char *name, const char *module,
+                        int batch, int payload_len, void *closure) {
+  int i;
+  noit_udp_receiver_t *rx;
+
+  if(batch <= 0) batch = DEFAULT_BATCH;
+  if(batch > MAX_BATCH) batch = MAX_BATCH;
+  if(payload_len <= 0 || payload_len > 65536) payload_len = 65536;
+
+  rx = calloc(1, sizeof(*rx));
+  rx->name = strdup(name ? name : "udp");
+  rx->module = module ? strdup(module) : NULL;
+  rx->closure = closure;
+  rx->batch = batch;
+  rx->payload_len = payload_len;
+  /* one extra byte per buffer so payloads can always be terminated */
+  rx->buffers = malloc((size_t)batch * (payload_len + 1));
+  rx->packets = calloc(batch, sizeof(*rx->packets));
+  rx->iovs = calloc(batch, sizeof(*rx->iovs));
+  rx->msgs = calloc(batch, sizeof(*rx->msgs));
+  if(RXQ_CMSG_SPACE) rx->cmsgs = calloc(batch, RXQ_CMSG_SPACE);
+  if(rx->module) rx->sources = calloc(SOURCE_CACHE_SIZE, sizeof(*rx->sources));
+  for(i=0; i<batch; i++) {
+    rx->packets[i].payload = rx->buffers + (size_t)i * (payload_len + 1);
+    rx->iovs[i].iov_base = rx->packets[i].payload;
+    rx->iovs[i].iov_len = payload_len;
+  }
+
+  pthread_mutex_lock(&receivers_lock);
+  if(!console_registered) {
+    register_console_udp_commands();
+    console_registered = mtev_true;
+  }
+  rx->next = receivers;
+  receivers = rx;
+  pthread_mutex_unlock(&receivers_lock);
+  return rx;
+}
+
+void *
+noit_udp_receiver_closure(noit_udp_receiver_t *rx) {
+  return rx->closure;
+}
+
+static void
+udp_resolve_source(noit_udp_receiver_t *rx, noit_udp_packet_t *p) {
+  const void *addr;
+  size_t addrlen;
+  uint32_t bucket, generation;
+  udp_source_t *s;
+
+  p->ip[0] = '\0';
+  p->nchecks = 0;
+  p->checks_truncated = mtev_false;
+  if(!rx->sources) return;
+
+  switch(p->addr.sa.sa_family) {
+    case AF_INET:
+      addr = &p->addr.in.sin_addr;
+      addrlen = sizeof(p->addr.in.sin_addr);
+      break;
+    case AF_INET6:
+      addr = &p->addr.in6.sin6_addr;
+      addrlen = sizeof(p->addr.in6.sin6_addr);
+      break;
+    default:
+      return;
+  }
+
+  /* read the generation before looking up, so a concurrent change to
+   * the index leaves this entry stale rather than wrong forever */
+  generation = noit_poller_target_ip_generation();
+  bucket = mtev_hash__hash((const char *)addr, addrlen, 0) & (SOURCE_CACHE_SIZE - 1);
+  s = &rx->sources[bucket];
+  if(s->family == p->addr.sa.sa_family &&
+     !memcmp(s->addr, addr, addrlen)) {
+    if(s->generation == generation) {
+      rx->cache_hits++;
+      goto done;
+    }
+  }
+  else {
+    s->family = p->addr.sa.sa_family;
+    memcpy(s->addr, addr, addrlen);
+    if(inet_ntop(s->family, addr, s->ip, sizeof(s->ip)) == NULL) {
+      s->family = 0;
+      return;
+    }
+  }
+  rx->cache_misses++;
+  s->generation = generation;
+  s->nchecks = noit_poller_lookup_by_ip_module(s->ip, rx->module,
+                                               s->checks, NOIT_UDP_MAX_CHECKS);
+  s->checks_truncated = (s->nchecks == NOIT_UDP_MAX_CHECKS);
+
+ done:
+  /* copy out; a later packet in this batch may reuse the bucket */
+  strlcpy(p->ip, s->ip, sizeof(p->ip));
+  memcpy(p->checks, s->checks, s->nchecks * sizeof(*p->checks));
+  p->nchecks = s->nchecks;
+  p->checks_truncated = s->checks_truncated;
+}
+
+static void
+udp_prepare_msg(noit_udp_receiver_t *rx, struct msghdr *hdr, int i) {
+  memset(hdr, 0, sizeof(*hdr));
+  hdr->msg_iov = &rx->iovs[i];
+  hdr->msg_iovlen = 1;
+  if(rx->module) {
+    hdr->msg_name = &rx->packets[i].addr;
+    hdr->msg_namelen = sizeof(rx->packets[i].addr);
+  }
+  if(rx->cmsgs) {
+    hdr->msg_control = rx->cmsgs + (size_t)i * RXQ_CMSG_SPACE;
+    hdr->msg_controllen = RXQ_CMSG_SPACE;
+  }
+}
+
+static void
+udp_finish_msg(noit_udp_receiver_t *rx, struct msghdr *hdr, int i, int len) {
+  noit_udp_packet_t *p = &rx->packets[i];
+#if defined(SO_RXQ_OVFL)
+  struct cmsghdr *cmsg;
+  for(cmsg = CMSG_FIRSTHDR(hdr); cmsg; cmsg = CMSG_NXTHDR(hdr, cmsg)) {
+    if(cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SO_RXQ_OVFL)
+      memcpy(&rx->kernel_drops, CMSG_DATA(cmsg), sizeof(uint32_t));
+  }
+#endif
+  p->len = len;
+  p->payload[len] = '\0';
+  p->truncated = (hdr->msg_flags & MSG_TRUNC) ? mtev_true : mtev_false;
+  if(p->truncated) rx->truncated++;
+  p->addrlen = hdr->msg_namelen;
+  if(!rx->module) p->addr.sa.sa_family = AF_UNSPEC;
+  udp_resolve_source(rx, p);
+  rx->bytes_in += len;
+}
+
+int
+noit_udp_receiver_recv(noit_udp_receiver_t *rx, int fd,
+                       noit_udp_packet_t **packets) {
+  int cnt;
+
+  *packets = rx->packets;
+  rx->calls++;
+#ifdef HAVE_RECVMMSG
+  int i;
+  for(i=0; i<rx->batch; i++) {
+    udp_prepare_msg(rx, &rx->msgs[i].msg_hdr, i);
+    rx->msgs[i].msg_len = 0;
+  }
+  cnt = recvmmsg(fd, rx->msgs, rx->batch, MSG_DONTWAIT, NULL);
+  if(cnt < 0) {
+    if(errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+    return -1;
+  }
+  for(i=0; i<cnt; i++)
+    udp_finish_msg(rx, &rx->msgs[i].msg_hdr, i, rx->msgs[i].msg_len);
+#else
+  for(cnt=0; cnt<rx->batch; cnt++) {
+    ssize_t len;
+    udp_prepare_msg(rx, &rx->msgs[cnt], cnt);
+    len = recvmsg(fd, &rx->msgs[cnt], MSG_DONTWAIT);
+    if(len < 0) {
+      if(errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) break;
+      if(cnt == 0) return -1;
+      break;
+    }
+    udp_finish_msg(rx, &rx->msgs[cnt], cnt, len);
+  }
+#endif
+  rx->packets_in += cnt;
+  return cnt;
+}
+
+int
+noit_udp_bind(const struct sockaddr *addr, socklen_t addrlen,
+              mtev_boolean reuseport) {
+  int fd, on = 1, save_errno;
+
+  fd = socket(addr->sa_family, NE_SOCK_CLOEXEC|SOCK_DGRAM, IPPROTO_UDP);
+  if(fd < 0) return -1;
+  if(eventer_set_fd_nonblocking(fd)) goto bail;
+  if(reuseport) {
+#if defined(SO_REUSEPORT)
+    if(setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) < 0)
+      goto bail;
+#else
+    errno = ENOTSUP;
+    goto bail;
+#endif
+  }
+#if defined(IPV6_V6ONLY)
+  /* IPv4 is bound separately; don't let the IPv6 socket claim it */
+  if(addr->sa_family == AF_INET6 &&
+     setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &on, sizeof(on)) < 0)
+    goto bail;
+#endif
+#if defined(SO_RXQ_OVFL)
+  if(setsockopt(fd, SOL_SOCKET, SO_RXQ_OVFL, &on, sizeof(on)) < 0)
+    mtevL(noit_debug, "udp: SO_RXQ_OVFL unavailable: %s\n", strerror(errno));
+#endif
+  if(bind(fd, addr, addrlen) < 0) goto bail;
+  return fd;
+
+ bail:
+  save_errno = errno;
+  close(fd);
+  errno = save_errno;
+  return -1;
+}
+
+int
+noit_udp_listen(const char *name, const char *module,
+                const struct sockaddr *addr, socklen_t addrlen,
+                int listeners, int batch, int payload_len,
+                eventer_func_t callback, void *closure) {
+  int i, started = 0;
+  char rxname[128];
+
+  if(listeners < 1) listeners = 1;
+#if !defined(SO_REUSEPORT)
+  if(listeners > 1) {
+    mtevL(noit_error, "%s: SO_REUSEPORT unsupported, using one listener\n",
+          name);
+    listeners = 1;
+  }
+#endif
+  for(i=0; i<listeners; i++) {
+    int fd;
+    eventer_t newe;
+    noit_udp_receiver_t *rx;
+
+    fd = noit_udp_bind(addr, addrlen, listeners > 1);
+    if(fd < 0) {
+      mtevL(noit_error, "%s: bind failed: %s\n", name, strerror(errno));
+      break;
+    }
+    snprintf(rxname, sizeof(rxname), "%s#%d", name, i);
+    rx = noit_udp_receiver_alloc(rxname, module, batch, payload_len, closure);
+    newe = eventer_alloc_fd(callback, rx, fd,
+                            EVENTER_READ | EVENTER_EXCEPTION);
+    if(listeners > 1) eventer_set_owner(newe, eventer_choose_owner(i));
+    eventer_add(newe);
+    started++;
+  }
+  return started;
+}
+
+static int
+noit_console_show_udp(mtev_console_closure_t ncct,
+                      int argc, char **argv,
+                      mtev_console_state_t *dstate,
+                      void *closure) {
+  noit_udp_receiver_t *rx;
+  pthread_mutex_lock(&receivers_lock);
+  for(rx = receivers; rx; rx = rx->next) {
+    nc_printf(ncct, "== %s ==\n", rx->name);
+    nc_printf(ncct, "  batch size: %d, recv calls: %llu, packets: %llu "
+              "(%.1f/call), bytes: %llu\n",
+              rx->batch, (unsigned long long)rx->calls,
+              (unsigned long long)rx->packets_in,
+              rx->calls ? (double)rx->packets_in / (double)rx->calls : 0.0,
+              (unsigned long long)rx->bytes_in);
+    nc_printf(ncct, "  truncated: %llu, kernel drops: %u\n",
+              (unsigned long long)rx->truncated, rx->kernel_drops);
+    if(rx->sources)
+      nc_printf(ncct, "  source cache hits: %llu, misses: %llu\n",
+                (unsigned long long)rx->cache_hits,
+                (unsigned long long)rx->cache_misses);
+  }
+  pthread_mutex_unlock(&receivers_lock);
+  return 0;
+}
+
+static void
+register_console_udp_commands() {
+  mtev_console_state_t *tl;
+  cmd_info_t *showcmd;
+
+  tl = mtev_console_state_initial();
+  showcmd = mtev_console_state_get_cmd(tl, "show");
+  mtevAssert(showcmd && showcmd->dstate);
+
+  mtev_console_state_add_cmd(showcmd->dstate,
+    NCSCMD("udp", noit_console_show_udp, NULL, NULL, NULL));
+}
@@ -0,0 +1,114 @@
+/*
+ * Copyright (c) 2017, Circonus, Inc. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above
+ *       copyright notice, this list of conditions and the following
+ *       disclaimer in the documentation and/or other materials provided
+ *       with the distribution.
+ *     * Neither the name Circonus, Inc. nor the names
+ *       of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written
+ *       permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _NOIT_UDP_H
+#define _NOIT_UDP_H
+
+#include <mtev_defines.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <eventer/eventer.h>
+#include "noit_check.h"
+
+/* A batched UDP receive layer for the passive modules (statsd, collectd,
+ * ganglia).  A receiver owns a set of datagram buffers and pulls up to
+ * `batch` datagrams from a socket per call (recvmmsg(2) where available).
+ * Each receiver is driven by a single eventer thread, so none of its
+ * state is locked.
+ *
+ * If the receiver was created with a module name, every packet carries
+ * the formatted source address and the checks for (source, module), both
+ * served from a small per-receiver cache keyed by source address that is
+ * invalidated by noit_poller_target_ip_generation().  They are copied
+ * into the packet, as a later packet in the same batch may evict the
+ * cache entry they came from.
+ */
+
+#define NOIT_UDP_MAX_CHECKS 8
+
+typedef struct {
+  char *payload;          /* NUL terminated */
+  int len;
+  mtev_boolean truncated;
+  union {
+    struct sockaddr sa;
+    struct sockaddr_in in;
+    struct sockaddr_in6 in6;
+  } addr;
+  socklen_t addrlen;
+  char ip[INET6_ADDRSTRLEN]; /* "" if unknown or not requested */
+  noit_check_t *checks[NOIT_UDP_MAX_CHECKS];
+  int nchecks;
+  /* more checks exist for this source than NOIT_UDP_MAX_CHECKS */
+  mtev_boolean checks_truncated;
+} noit_udp_packet_t;
+
+typedef struct noit_udp_receiver noit_udp_receiver_t;
+
+/* name is used in "show udp"; module may be NULL to skip source address
+ * formatting and check lookup (e.g. ganglia which routes on payload). */
+API_EXPORT(noit_udp_receiver_t *)
+  noit_udp_receiver_alloc(const char *name, const char *module,
+                          int batch, int payload_len, void *closure);
+
+API_EXPORT(void *)
+  noit_udp_receiver_closure(noit_udp_receiver_t *rx);
+
+/* Read up to the receiver's batch size of datagrams from fd.  Returns the
+ * number of packets (valid until the next call), 0 if nothing was
+ * pending, or -1 on error (errno set).
+ */
+API_EXPORT(int)
+  noit_udp_receiver_recv(noit_udp_receiver_t *rx, int fd,
+                         noit_udp_packet_t **packets);
+
+/* Create a non-blocking UDP socket bound to addr.  With reuseport the
+ * socket is marked SO_REUSEPORT so that several may share the port.
+ * Kernel drop accounting (SO_RXQ_OVFL) is enabled where supported.
+ * Returns the fd or -1 (errno set).
+ */
+API_EXPORT(int)
+  noit_udp_bind(const struct sockaddr *addr, socklen_t addrlen,
+                mtev_boolean reuseport);
+
+/* Bind `listeners` sockets to addr (SO_REUSEPORT when more than one),
+ * each with its own receiver and an eventer read event owned by a
+ * distinct eventer thread.  Returns the number of listeners started.
+ */
+API_EXPORT(int)
+  noit_udp_listen(const char *name, const char *module,
+                  const struct sockaddr *addr, socklen_t addrlen,
+                  int listeners, int batch, int payload_len,
+                  eventer_func_t callback, void *closure);
+
+#endif
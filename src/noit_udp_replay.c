@@ -0,0 +1,379 @@
+/*
+ * Copyright (c) 2017, Circonus, Inc. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above
+ *       copyright notice, this list of conditions and the following
+ *       disclaimer in the documentation and/or other materials provided
+ *       with the distribution.
+ *     * Neither the name Circonus, Inc. nor the names
+ *       of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written
+ *       permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* noit_udp_replay: replay datagrams captured in a pcap file (or one per
+ * line of a text file) at a UDP listener, for load testing the statsd,
+ * collectd and ganglia receivers.
+ */
+
+#define _GNU_SOURCE
+#include <sys/socket.h>
+#undef _GNU_SOURCE
+
+#include "noit_config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <netdb.h>
+#include <time.h>
+#include <sys/time.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#define MAX_BATCH 1024
+
+typedef struct {
+  char *data;
+  size_t len;
+} datagram_t;
+
+static datagram_t *datagrams = NULL;
+static size_t ndatagrams = 0, datagrams_allocd = 0;
+
+static struct sockaddr_storage target;
+static socklen_t target_len;
+static double rate = 0;        /* packets per second across all threads */
+static int duration = 10;
+static long loops = 0;
+static int nthreads = 1;
+static int batch = 32;
+
+struct replay_thread {
+  pthread_t tid;
+  int id;
+  uint64_t packets;
+  uint64_t bytes;
+  uint64_t errors;
+};
+
+static void usage(const char *prog) {
+  fprintf(stderr, "%s [-l] -f <file> [-h host] -p <port> [-P <pcap dst port>]\n"
+                  "\t[-r <pps>] [-d <seconds> | -n <loops>] [-t <threads>] [-b <batch>]\n", prog);
+  fprintf(stderr, "\t-f file   pcap capture of UDP traffic (or text with -l)\n");
+  fprintf(stderr, "\t-l        treat each line of the file as a datagram\n");
+  fprintf(stderr, "\t-P port   only replay captured datagrams sent to this port\n");
+  fprintf(stderr, "\t-r pps    aggregate send rate (default: unlimited)\n");
+  fprintf(stderr, "\t-d secs   run time (default: 10)\n");
+  fprintf(stderr, "\t-n loops  replay the capture this many times instead\n");
+  fprintf(stderr, "\t-t count  sending threads (default: 1)\n");
+  fprintf(stderr, "\t-b count  datagrams per send call (default: 32)\n");
+}
+
+static void add_datagram(const void *data, size_t len) {
+  if(ndatagrams == datagrams_allocd) {
+    datagrams_allocd = datagrams_allocd ? datagrams_allocd * 2 : 1024;
+    datagrams = realloc(datagrams, datagrams_allocd * sizeof(*datagrams));
+  }
+  datagrams[ndatagrams].data = malloc(len ? len : 1);
+  memcpy(datagrams[ndatagrams].data, data, len);
+  datagrams[ndatagrams].len = len;
+  ndatagrams++;
+}
+
+static int load_lines(FILE *fp) {
+  char line[65536];
+  while(fgets(line, sizeof(line), fp)) {
+    size_t len = strlen(line);
+    while(len > 0 && (line[len-1] == '\n' || line[len-1] == '\r')) len--;
+    if(len) add_datagram(line, len);
+  }
+  return 0;
+}
+
+static uint32_t rd32(const uint8_t *p, int swap) {
+  uint32_t v;
+  memcpy(&v, p, 4);
+  return swap ? __builtin_bswap32(v) : v;
+}
+
+/* Strip the link, network and transport headers off a captured frame
+ * and keep the UDP payload.  Only what the receivers see matters here,
+ * so IP fragments and anything that isn't UDP are skipped. */
+static void pcap_frame(const uint8_t *f, size_t caplen, uint32_t linktype,
+                       int dport) {
+  const uint8_t *ip = f;
+  size_t iplen = caplen, hl;
+  int version, proto;
+  const uint8_t *udp;
+  size_t udplen, ulen;
+
+  switch(linktype) {
+    case 1: /* ethernet */
+      {
+        size_t off = 12;
+        uint16_t et;
+        if(caplen < 14) return;
+        et = (f[off] << 8) | f[off+1];
+        while((et == 0x8100 || et == 0x88a8) && caplen >= off + 6) {
+          off += 4;
+          et = (f[off] << 8) | f[off+1];
+        }
+        ip = f + off + 2;
+        iplen = caplen - (off + 2);
+      }
+      break;
+    case 113: /* linux cooked */
+      if(caplen < 16) return;
+      ip = f + 16; iplen = caplen - 16;
+      break;
+    case 0: /* BSD loopback */
+      if(caplen < 4) return;
+      ip = f + 4; iplen = caplen - 4;
+      break;
+    case 12: case 14: case 101: /* raw IP */
+      break;
+    default:
+      return;
+  }
+  if(iplen < 1) return;
+  version = ip[0] >> 4;
+  if(version == 4) {
+    if(iplen < 20) return;
+    hl = (ip[0] & 0x0f) * 4;
+    proto = ip[9];
+    if(((ip[6] & 0x1f) << 8 | ip[7]) != 0 || (ip[6] & 0x20)) return;
+  }
+  else if(version == 6) {
+    if(iplen < 40) return;
+    hl = 40;
+    proto = ip[6];
+  }
+  else return;
+  if(proto != IPPROTO_UDP || iplen < hl + 8) return;
+  udp = ip + hl;
+  udplen = iplen - hl;
+  if(dport > 0 && ((udp[2] << 8) | udp[3]) != dport) return;
+  ulen = (udp[4] << 8) | udp[5];
+  if(ulen < 8) return;
+  ulen -= 8;
+  if(ulen > udplen - 8) ulen = udplen - 8; /* truncated capture */
+  add_datagram(udp + 8, ulen);
+}
+
+static int load_pcap(FILE *fp, int dport) {
+  uint8_t hdr[24], rec[16];
+  uint8_t *frame = NULL;
+  size_t frame_allocd = 0;
+  uint32_t magic, linktype;
+  int swap;
+
+  if(fread(hdr, sizeof(hdr), 1, fp) != 1) return -1;
+  memcpy(&magic, hdr, 4);
+  if(magic == 0xa1b2c3d4 || magic == 0xa1b23c4d) swap = 0;
+  else if(magic == 0xd4c3b2a1 || magic == 0x4d3cb2a1) swap = 1;
+  else {
+    fprintf(stderr, "not a pcap file (pcapng is not supported)\n");
+    return -1;
+  }
+  linktype = rd32(hdr + 20, swap);
+  while(fread(rec, sizeof(rec), 1, fp) == 1) {
+    uint32_t caplen = rd32(rec + 8, swap);
+    if(caplen > 262144) return -1;
+    if(caplen > frame_allocd) {
+      frame_allocd = caplen;
+      frame = realloc(frame, frame_allocd);
+    }
+    if(caplen && fread(frame, caplen, 1, fp) != 1) break;
+    pcap_frame(frame, caplen, linktype, dport);
+  }
+  free(frame);
+  return 0;
+}
+
+static double now_sec() {
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+static void *replay(void *vt) {
+  struct replay_thread *t = vt;
+  double start = now_sec(), my_rate = rate / nthreads;
+  size_t idx = (ndatagrams / nthreads) * t->id;
+  uint64_t quota = 0, sent_here = 0;
+  int fd;
+#ifdef HAVE_SENDMMSG
+  struct mmsghdr msgs[MAX_BATCH];
+#endif
+  struct iovec iovs[MAX_BATCH];
+
+  /* with -n, the capture is replayed that many times across all threads */
+  if(loops > 0) {
+    quota = (uint64_t)loops * ndatagrams / nthreads;
+    if(t->id == 0) quota += (uint64_t)loops * ndatagrams % nthreads;
+  }
+  fd = socket(target.ss_family, SOCK_DGRAM, IPPROTO_UDP);
+  if(fd < 0) {
+    perror("socket");
+    return NULL;
+  }
+  while(1) {
+    int i, n = batch, sent;
+    double elapsed = now_sec() - start;
+
+    if(loops > 0) {
+      if(sent_here >= quota) break;
+      if(n > quota - sent_here) n = quota - sent_here;
+    }
+    else if(elapsed >= duration) break;
+
+    if(my_rate > 0) {
+      double due = sent_here / my_rate;
+      if(due > elapsed) {
+        double wait = due - elapsed;
+        if(wait > 0.1) wait = 0.1;
+        usleep((useconds_t)(wait * 1000000));
+        continue;
+      }
+      if(n > (my_rate * (elapsed + 0.001)) - sent_here)
+        n = (int)((my_rate * (elapsed + 0.001)) - sent_here);
+      if(n < 1) n = 1;
+    }
+
+    for(i=0; i<n; i++) {
+      datagram_t *d = &datagrams[(idx + i) % ndatagrams];
+      iovs[i].iov_base = d->data;
+      iovs[i].iov_len = d->len;
+#ifdef HAVE_SENDMMSG
+      memset(&msgs[i], 0, sizeof(msgs[i]));
+      msgs[i].msg_hdr.msg_name = &target;
+      msgs[i].msg_hdr.msg_namelen = target_len;
+      msgs[i].msg_hdr.msg_iov = &iovs[i];
+      msgs[i].msg_hdr.msg_iovlen = 1;
+#endif
+    }
+#ifdef HAVE_SENDMMSG
+    sent = sendmmsg(fd, msgs, n, 0);
+    if(sent < 0) {
+      t->errors++;
+      sent = 1; /* skip the offender */
+    }
+    else {
+      for(i=0; i<sent; i++) t->bytes += iovs[i].iov_len;
+    }
+#else
+    for(sent=0; sent<n; sent++) {
+      if(sendto(fd, iovs[sent].iov_base, iovs[sent].iov_len, 0,
+                (struct sockaddr *)&target, target_len) < 0)
+        t->errors++;
+      else
+        t->bytes += iovs[sent].iov_len;
+    }
+#endif
+    t->packets += sent;
+    sent_here += sent;
+    idx = (idx + sent) % ndatagrams;
+  }
+  close(fd);
+  return NULL;
+}
+
+int main(int argc, char **argv) {
+  const char *file = NULL, *host = "127.0.0.1", *port = NULL;
+  int ch, lines = 0, dport = -1, i, rv;
+  struct addrinfo hints, *res;
+  struct replay_thread *threads;
+  uint64_t packets = 0, bytes = 0, errors = 0;
+  double start, elapsed;
+  FILE *fp;
+
+  while((ch = getopt(argc, argv, "lf:h:p:P:r:d:n:t:b:")) != -1) {
+    switch(ch) {
+      case 'l': lines = 1; break;
+      case 'f': file = optarg; break;
+      case 'h': host = optarg; break;
+      case 'p': port = optarg; break;
+      case 'P': dport = atoi(optarg); break;
+      case 'r': rate = atof(optarg); break;
+      case 'd': duration = atoi(optarg); break;
+      case 'n': loops = atol(optarg); break;
+      case 't': nthreads = atoi(optarg); break;
+      case 'b': batch = atoi(optarg); break;
+      default: usage(argv[0]); return 2;
+    }
+  }
+  if(!file || !port || nthreads < 1) {
+    usage(argv[0]);
+    return 2;
+  }
+  if(batch < 1) batch = 1;
+  if(batch > MAX_BATCH) batch = MAX_BATCH;
+
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_socktype = SOCK_DGRAM;
+  if((rv = getaddrinfo(host, port, &hints, &res)) != 0) {
+    fprintf(stderr, "%s:%s: %s\n", host, port, gai_strerror(rv));
+    return 1;
+  }
+  memcpy(&target, res->ai_addr, res->ai_addrlen);
+  target_len = res->ai_addrlen;
+  freeaddrinfo(res);
+
+  if((fp = fopen(file, "rb")) == NULL) {
+    perror(file);
+    return 1;
+  }
+  rv = lines ? load_lines(fp) : load_pcap(fp, dport);
+  fclose(fp);
+  if(rv < 0 || ndatagrams == 0) {
+    fprintf(stderr, "%s: no datagrams to replay\n", file);
+    return 1;
+  }
+  fprintf(stderr, "replaying %zu datagrams to %s:%s with %d thread(s)\n",
+          ndatagrams, host, port, nthreads);
+
+  threads = calloc(nthreads, sizeof(*threads));
+  start = now_sec();
+  for(i=0; i<nthreads; i++) {
+    threads[i].id = i;
+    pthread_create(&threads[i].tid, NULL, replay, &threads[i]);
+  }
+  for(i=0; i<nthreads; i++) {
+    pthread_join(threads[i].tid, NULL);
+    packets += threads[i].packets;
+    bytes += threads[i].bytes;
+    errors += threads[i].errors;
+  }
+  elapsed = now_sec() - start;
+  printf("sent %llu datagrams (%llu bytes, %llu errors) in %.3fs: "
+         "%.0f pps, %.2f Mbit/s\n",
+         (unsigned long long)packets, (unsigned long long)bytes,
+         (unsigned long long)errors, elapsed,
+         elapsed > 0 ? packets / elapsed : 0,
+         elapsed > 0 ? (bytes * 8.0) / elapsed / 1000000.0 : 0);
+  return errors ? 1 : 0;
+}
@@ -55,6 +55,7 @@
 #include <mtev_b64.h>
 #include <mtev_conf.h>
 #include <mtev_rest.h>
+#include <mtev_console.h>
 
 #include "noit_mtev_bridge.h"
 #include "noit_jlog_listener.h"
@@ -88,13 +89,50 @@ static int rest_set_filters(mtev_http_rest_closure_t *restc,
                             int npats, char **pats);
 
 
-struct iep_job_closure {
-  char *line;       /* This is a copy and gets trashed during processing */
-  char *remote;
-  char *doc_str;
-  struct timeval start;
+/* Lines bound for the MQ drivers are rewritten (remote injected) on the
+ * thread that receives them and collected into a per-thread batch.  A batch
+ * is handed to the submitter job queue as a single job when it fills or
+ * when the periodic flusher finds it non-empty.
+ */
+#define IEP_BATCH_SIZE_DEFAULT 256
+#define IEP_BATCH_FLUSH_MS_DEFAULT 100
+#define IEP_BATCH_BUF_INITIAL 16384
+
+struct iep_batch {
+  int count;
+  int allocd;
+  size_t *offsets;
+  size_t *lens;
+  const char **payloads;
+  char *buf;
+  size_t buflen;
+  size_t bufallocd;
+  struct timeval start; /* when the oldest line was queued */
+};
+
+struct iep_thread_batch {
+  pthread_mutex_t lock;
+  struct iep_batch *batch;
+  struct iep_thread_batch *next;
 };
 
+static __thread struct iep_thread_batch *my_batch = NULL;
+static struct iep_thread_batch *thread_batches = NULL;
+static pthread_mutex_t thread_batches_lock = PTHREAD_MUTEX_INITIALIZER;
+static int iep_batch_size = IEP_BATCH_SIZE_DEFAULT;
+static int iep_batch_flush_ms = IEP_BATCH_FLUSH_MS_DEFAULT;
+
+static struct {
+  mtev_atomic64_t lines_queued;
+  mtev_atomic64_t lines_submitted;
+  mtev_atomic64_t lines_dropped_age;
+  mtev_atomic64_t lines_dropped_wait;
+  mtev_atomic64_t batches_submitted;
+  mtev_atomic64_t batches_full;
+  mtev_atomic64_t batches_pending;
+  mtev_atomic64_t submit_failures;
+} iep_stats;
+
 static void
 start_iep_daemon();
 
@@ -400,66 +438,173 @@ setup_iep_connection_later(int seconds) {
   eventer_add(newe);
 }
 
+static struct iep_batch *
+iep_batch_alloc(const struct timeval *start) {
+  struct iep_batch *b = calloc(1, sizeof(*b));
+  b->allocd = iep_batch_size;
+  b->offsets = calloc(b->allocd, sizeof(*b->offsets));
+  b->lens = calloc(b->allocd, sizeof(*b->lens));
+  b->bufallocd = IEP_BATCH_BUF_INITIAL;
+  b->buf = malloc(b->bufallocd);
+  memcpy(&b->start, start, sizeof(b->start));
+  return b;
+}
+
+static void
+iep_batch_free(struct iep_batch *b) {
+  if(!b) return;
+  free(b->offsets);
+  free(b->lens);
+  free(b->payloads);
+  free(b->buf);
+  free(b);
+}
+
+/* Append line to the batch as "<token>\t<remote>\t<rest of line>". */
+static void
+iep_batch_append(struct iep_batch *b, const char *line, const char *remote) {
+  size_t line_len = strlen(line);
+  size_t remote_len = strlen(remote);
+  size_t need = line_len + remote_len + 1;
+  const char *toff = strchr(line, '\t');
+  size_t token_off = 2;
+  char *cp;
+
+  if(toff) token_off = toff - line + 1;
+  if(token_off > line_len) token_off = line_len;
+  if(b->count >= b->allocd) {
+    b->allocd *= 2;
+    b->offsets = realloc(b->offsets, b->allocd * sizeof(*b->offsets));
+    b->lens = realloc(b->lens, b->allocd * sizeof(*b->lens));
+  }
+  while(b->buflen + need + 1 > b->bufallocd) {
+    b->bufallocd *= 2;
+    b->buf = realloc(b->buf, b->bufallocd);
+  }
+  cp = b->buf + b->buflen;
+  memcpy(cp, line, token_off);
+  cp += token_off;
+  memcpy(cp, remote, remote_len);
+  cp += remote_len;
+  *cp++ = '\t';
+  memcpy(cp, line + token_off, line_len - token_off);
+  cp += line_len - token_off;
+  *cp = '\0';
+  b->offsets[b->count] = b->buflen;
+  b->lens[b->count] = need;
+  b->count++;
+  b->buflen += need + 1;
+}
+
 static int
 stratcon_iep_submitter(eventer_t e, int mask, void *closure,
                        struct timeval *now) {
-  double age;
-  struct iep_job_closure *job = closure;
-  char *line;
+  struct iep_batch *batch = closure;
   struct timeval diff;
+  int i;
   /* We only play when it is an asynch event */
   if(!(mask & EVENTER_ASYNCH_WORK)) return 0;
 
   if(mask & EVENTER_ASYNCH_CLEANUP) {
     /* free all the memory associated with the batch */
-    if(job) {
-      if(job->line) free(job->line);
-      if(job->remote) free(job->remote);
-      if(job->doc_str) free(job->doc_str);
-      free(job);
-    }
+    iep_batch_free(batch);
+    mtev_atomic_dec64(&iep_stats.batches_pending);
     return 0;
   }
 
+  if(!batch || batch->count == 0) return 0;
+
   /* If we're greater than 30 seconds old,
      just quit. */
-  sub_timeval(*now, job->start, &diff);
+  sub_timeval(*now, batch->start, &diff);
   if (diff.tv_sec >= 30) {
-    mtevL(noit_debug, "Skipping event from %s - waiting in eventer for more than 30 seconds\n",
-                        job->remote ? job->remote : "(null)");
+    mtevL(noit_debug, "Skipping %d events - waiting in eventer for more than 30 seconds\n",
+          batch->count);
+    mtev_atomic_add64(&iep_stats.lines_dropped_wait, batch->count);
     return 0;
   }
 
-  if(!job->line || job->line[0] == '\0') return 0;
-
-  if((age = stratcon_iep_age_from_line(job->line, *now)) > 60) {
-    mtevL(noit_debug, "Skipping old event from %s, %f seconds old.\n",
-          job->remote ? job->remote : "(null)", age);
-    return 0;
-  }
-  /* Submit */
-  int line_len = strlen(job->line);
-  int remote_len = strlen(job->remote);
-  const char *toff = strchr(job->line, '\t');
-  int token_off = 2;
-  if(toff) token_off = toff - job->line + 1;
-
-  line = (char*)calloc(line_len + 1 /* \t */ + remote_len + 2, 1);
-  strncpy(line, job->line, token_off);
-  strncat(line, job->remote, remote_len);
-  strncat(line, "\t", 1);
-  strncat(line, job->line + token_off, line_len - token_off);
-  job->doc_str = line;
+  /* The buffer is final now, so the payload pointers are stable. */
+  batch->payloads = malloc(batch->count * sizeof(*batch->payloads));
+  for(i=0; i<batch->count; i++)
+    batch->payloads[i] = batch->buf + batch->offsets[i];
 
   for(struct driver_list *d = drivers; d; d = d->next) {
     struct driver_thread_data *tls = connect_iep_driver(d);
-    if(tls && tls->driver_data) {
-      if(tls->mq_driver->submit(tls->driver_data, job->doc_str,
-                                line_len + remote_len + 1) != 0) {
-        mtevL(noit_debug, "failed to MQ submit.\n");
+    int failed = 0;
+    /* lines the driver never saw are failures too */
+    if(!tls || !tls->driver_data) {
+      mtev_atomic_add64(&iep_stats.submit_failures, batch->count);
+      continue;
+    }
+    if(tls->mq_driver->submit_batch) {
+      int sent = tls->mq_driver->submit_batch(tls->driver_data, batch->payloads,
+                                              batch->lens, batch->count);
+      failed = batch->count - (sent < 0 ? 0 : sent);
+    }
+    else {
+      for(i=0; i<batch->count; i++) {
+        if(tls->mq_driver->submit(tls->driver_data, batch->payloads[i],
+                                  batch->lens[i]) != 0) failed++;
       }
     }
+    if(failed) {
+      mtevL(noit_debug, "failed to MQ submit %d of %d.\n", failed, batch->count);
+      mtev_atomic_add64(&iep_stats.submit_failures, failed);
+    }
+    /* counted per driver, only for lines the driver accepted */
+    mtev_atomic_add64(&iep_stats.lines_submitted, batch->count - failed);
+  }
+  mtev_atomic_inc64(&iep_stats.batches_submitted);
+  return 0;
+}
+
+static void
+iep_batch_dispatch(struct iep_batch *batch) {
+  eventer_t newe;
+  newe = eventer_alloc();
+  newe->thr_owner = eventer_choose_owner(0);
+  newe->mask = EVENTER_ASYNCH;
+  newe->callback = stratcon_iep_submitter;
+  newe->closure = batch;
+  mtev_atomic_inc64(&iep_stats.batches_pending);
+  eventer_add_asynch(iep_jobq, newe);
+}
+
+static struct iep_thread_batch *
+iep_thread_batch_get() {
+  if(!my_batch) {
+    my_batch = calloc(1, sizeof(*my_batch));
+    pthread_mutex_init(&my_batch->lock, NULL);
+    pthread_mutex_lock(&thread_batches_lock);
+    my_batch->next = thread_batches;
+    thread_batches = my_batch;
+    pthread_mutex_unlock(&thread_batches_lock);
   }
+  return my_batch;
+}
+
+static void
+iep_thread_batch_flush(struct iep_thread_batch *tb) {
+  struct iep_batch *b;
+  pthread_mutex_lock(&tb->lock);
+  b = tb->batch;
+  tb->batch = NULL;
+  pthread_mutex_unlock(&tb->lock);
+  if(b) iep_batch_dispatch(b);
+}
+
+static int
+stratcon_iep_batch_flusher(eventer_t e, int mask, void *closure,
+                           struct timeval *now) {
+  struct iep_thread_batch *tb;
+  pthread_mutex_lock(&thread_batches_lock);
+  for(tb = thread_batches; tb; tb = tb->next)
+    iep_thread_batch_flush(tb);
+  pthread_mutex_unlock(&thread_batches_lock);
+  eventer_add_in_s_us(stratcon_iep_batch_flusher, NULL,
+                      iep_batch_flush_ms / 1000,
+                      (iep_batch_flush_ms % 1000) * 1000);
   return 0;
 }
 
@@ -468,9 +613,12 @@ stratcon_iep_line_processor(stratcon_datastore_op_t op,
                             struct sockaddr *remote, const char *remote_cn,
                             void *operand, eventer_t completion) {
   int len;
+  double age;
   char remote_str[256];
-  struct iep_job_closure *jc;
-  eventer_t newe;
+  char *line = operand;
+  struct timeval now;
+  struct iep_thread_batch *tb;
+  struct iep_batch *full = NULL;
   /* We only care about inserts */
 
   if(op == DS_OP_CHKPT) {
@@ -479,6 +627,22 @@ stratcon_iep_line_processor(stratcon_datastore_op_t op,
   }
   if(op != DS_OP_INSERT) return;
 
+  tb = iep_thread_batch_get();
+  if(!line || line[0] == '\0') {
+    /* Nothing to send; push out whatever this thread has pending. */
+    if(line) free(line);
+    iep_thread_batch_flush(tb);
+    return;
+  }
+
+  mtev_gettimeofday(&now, NULL);
+  if((age = stratcon_iep_age_from_line(line, now)) > 60) {
+    mtevL(noit_debug, "Skipping old event, %f seconds old.\n", age);
+    mtev_atomic_inc64(&iep_stats.lines_dropped_age);
+    free(line);
+    return;
+  }
+
   if(inject_remote_cn) {
     if(remote_cn == NULL) remote_cn = "default";
     strlcpy(remote_str, remote_cn, sizeof(remote_str));
@@ -504,18 +668,53 @@ stratcon_iep_line_processor(stratcon_datastore_op_t op,
     }
   }
 
-  /* process operand and push onto queue */
-  newe = eventer_alloc();
-  newe->thr_owner = eventer_choose_owner(0);
-  newe->mask = EVENTER_ASYNCH;
-  newe->callback = stratcon_iep_submitter;
-  jc = calloc(1, sizeof(*jc));
-  jc->line = operand;
-  jc->remote = strdup(remote_str);
-  mtev_gettimeofday(&jc->start, NULL);
-  newe->closure = jc;
+  /* rewrite into this thread's batch; hand it off if it is full */
+  pthread_mutex_lock(&tb->lock);
+  if(!tb->batch) tb->batch = iep_batch_alloc(&now);
+  iep_batch_append(tb->batch, line, remote_str);
+  if(tb->batch->count >= iep_batch_size) {
+    full = tb->batch;
+    tb->batch = NULL;
+  }
+  pthread_mutex_unlock(&tb->lock);
+  mtev_atomic_inc64(&iep_stats.lines_queued);
+  free(line);
 
-  eventer_add_asynch(iep_jobq, newe);
+  if(full) {
+    mtev_atomic_inc64(&iep_stats.batches_full);
+    iep_batch_dispatch(full);
+  }
+}
+
+static int
+stratcon_console_show_iep(mtev_console_closure_t ncct,
+                          int argc, char **argv,
+                          mtev_console_state_t *dstate,
+                          void *closure) {
+  nc_printf(ncct, " == IEP ==\n");
+  nc_printf(ncct, " batch_size:            %d\n", iep_batch_size);
+  nc_printf(ncct, " batch_flush_ms:        %d\n", iep_batch_flush_ms);
+  nc_printf(ncct, " lines_queued:          %llu\n", (unsigned long long)iep_stats.lines_queued);
+  nc_printf(ncct, " lines_submitted:       %llu\n", (unsigned long long)iep_stats.lines_submitted);
+  nc_printf(ncct, " lines_dropped_age:     %llu\n", (unsigned long long)iep_stats.lines_dropped_age);
+  nc_printf(ncct, " lines_dropped_wait:    %llu\n", (unsigned long long)iep_stats.lines_dropped_wait);
+  nc_printf(ncct, " batches_submitted:     %llu\n", (unsigned long long)iep_stats.batches_submitted);
+  nc_printf(ncct, " batches_full:          %llu\n", (unsigned long long)iep_stats.batches_full);
+  nc_printf(ncct, " batches_pending:       %llu\n", (unsigned long long)iep_stats.batches_pending);
+  nc_printf(ncct, " submit_failures:       %llu\n", (unsigned long long)iep_stats.submit_failures);
+  return 0;
+}
+
+static void
+register_console_iep_commands() {
+  mtev_console_state_t *tl;
+  cmd_info_t *showcmd;
+
+  tl = mtev_console_state_initial();
+  showcmd = mtev_console_state_get_cmd(tl, "show");
+  mtevAssert(showcmd && showcmd->dstate);
+  mtev_console_state_add_cmd(showcmd->dstate,
+    NCSCMD("iep", stratcon_console_show_iep, NULL, NULL, NULL));
 }
 
 static void connection_destroy(void *vd) {
@@ -822,6 +1021,11 @@ stratcon_iep_init() {
   if(!strcmp(remote, "ip")) inject_remote_cn = mtev_false;
   else if(!strcmp(remote, "cn")) inject_remote_cn = mtev_true;
 
+  (void)mtev_conf_get_int(NULL, "/stratcon/iep/@batch_size", &iep_batch_size);
+  if(iep_batch_size < 1) iep_batch_size = 1;
+  (void)mtev_conf_get_int(NULL, "/stratcon/iep/@batch_flush_ms", &iep_batch_flush_ms);
+  if(iep_batch_flush_ms < 1) iep_batch_flush_ms = IEP_BATCH_FLUSH_MS_DEFAULT;
+
   if(mtev_conf_get_boolean(NULL, "/stratcon/iep/@disabled", &disabled) &&
      disabled == mtev_true) {
     mtevL(noit_iep, "IEP system is disabled!\n");
@@ -854,6 +1058,7 @@ stratcon_iep_init() {
   eventer_name_callback("stratcon_iep_submitter", stratcon_iep_submitter);
   eventer_name_callback("stratcon_iep_err_handler", stratcon_iep_err_handler);
   eventer_name_callback("setup_iep_connection_callback", setup_iep_connection_callback);
+  eventer_name_callback("stratcon_iep_batch_flusher", stratcon_iep_batch_flusher);
 
   /* start up a thread pool of one */
   
@@ -861,6 +1066,11 @@ stratcon_iep_init() {
   eventer_jobq_set_concurrency(iep_jobq, 1);
   eventer_jobq_set_min_max(iep_jobq, 1, 1);
 
+  register_console_iep_commands();
+  eventer_add_in_s_us(stratcon_iep_batch_flusher, NULL,
+                      iep_batch_flush_ms / 1000,
+                      (iep_batch_flush_ms % 1000) * 1000);
+
   mtevAssert(mtev_http_rest_register_auth(
     "PUT", "/", "^mq_filters$",
     rest_set_filters, mtev_http_rest_client_cert_auth
@@ -92,6 +92,11 @@ typedef struct mq_driver {
 
   void (*deallocate)(iep_thread_driver_t *driver);
   void (*set_filters) (mq_command_t *command, int count);
+
+  int (*submit_batch)(iep_thread_driver_t *driver, const char **payloads,
+                      size_t *payloadlens, int count);
+  /* submit_batch is optional (may be NULL, in which case submit is called
+     per message) and returns the number of messages submitted or -1 */
 } mq_driver_t;
 
 API_EXPORT(void)
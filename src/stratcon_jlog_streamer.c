@@ -204,14 +204,19 @@ nc_print_noit_conn_brief(mtev_console_closure_t ncct,
                       "\tNext checkpoint: [%08x:%08x]\n"
                       "\tLast event: %lld.%06us ago\n"
                       "\tEvents this session: %llu (%0.2f/s)\n"
-                      "\tOctets this session: %llu (%0.2f/s)\n",
+                      "\tOctets this session: %llu (%0.2f/s)\n"
+                      "\tDelivery lag: %llums (avg %0.1fms, max %llums)\n",
                 state,
                 jctx->header.chkpt.log, jctx->header.chkpt.marker,
                 (long long)diff.tv_sec, (unsigned int)diff.tv_usec,
                 jctx->total_events,
                 (double)jctx->total_events/session_duration_seconds,
                 jctx->total_bytes_read,
-                (double)jctx->total_bytes_read/session_duration_seconds);
+                (double)jctx->total_bytes_read/session_duration_seconds,
+                (long long unsigned)jctx->lag_last_ms,
+                jctx->total_events ?
+                  (double)jctx->lag_total_ms/jctx->total_events : 0.0,
+                (long long unsigned)jctx->lag_max_ms);
     }
     else {
       nc_printf(ncct, "\tUnknown type.\n");
@@ -227,6 +232,21 @@ stratcon_jlog_streamer_datastore_ctx_alloc(void) {
   ctx->push = stratcon_datastore_push;
   return ctx;
 }
+static void
+jlog_streamer_note_lag(jlog_streamer_ctx_t *ctx, struct timeval *now) {
+  struct timeval written, lag;
+  uint64_t ms = 0;
+
+  written.tv_sec = ctx->header.tv_sec;
+  written.tv_usec = ctx->header.tv_usec;
+  if(compare_timeval(*now, written) > 0) {
+    sub_timeval(*now, written, &lag);
+    ms = lag.tv_sec * 1000 + lag.tv_usec / 1000;
+  }
+  ctx->lag_last_ms = ms;
+  if(ms > ctx->lag_max_ms) ctx->lag_max_ms = ms;
+  ctx->lag_total_ms += ms;
+}
 jlog_streamer_ctx_t *
 stratcon_jlog_streamer_ctx_alloc(void) {
   jlog_streamer_ctx_t *ctx;
@@ -415,6 +435,7 @@ stratcon_jlog_recv_handler(eventer_t e, int mask, void *closure,
         ctx->buffer = NULL;
         ctx->count--;
         ctx->total_events++;
+        jlog_streamer_note_lag(ctx, now);
         if(ctx->count == 0 && ctx->needs_chkpt) {
           eventer_t completion_e;
           eventer_remove_fd(e->fd);
@@ -673,6 +694,9 @@ emit_noit_info_metrics(struct timeval *now, const char *uuid_str,
                                                   "connecting"));
   push_noit_m_u64("last_event_age_ms", last_event_ms);
   push_noit_m_u64("session_length_ms", session_duration_ms);
+  push_noit_m_u64("events", jctx->total_events);
+  push_noit_m_u64("delivery_lag_ms", jctx->lag_last_ms);
+  push_noit_m_u64("delivery_lag_max_ms", jctx->lag_max_ms);
 }
 static int
 periodic_noit_metrics(eventer_t e, int mask, void *closure,
@@ -895,6 +919,12 @@ rest_show_noits_json(mtev_http_rest_closure_t *restc,
       snprintf(buff, sizeof(buff), "%llu",
                (unsigned long long)jctx->total_bytes_read);
       json_object_object_add(node, "session_bytes", json_object_new_string(buff));
+      snprintf(buff, sizeof(buff), "%llu",
+               (unsigned long long)jctx->lag_last_ms);
+      json_object_object_add(node, "delivery_lag_ms", json_object_new_string(buff));
+      snprintf(buff, sizeof(buff), "%llu",
+               (unsigned long long)jctx->lag_max_ms);
+      json_object_object_add(node, "delivery_lag_max_ms", json_object_new_string(buff));
   
       sub_timeval(now, ctx->last_connect, &diff);
       snprintf(buff, sizeof(buff), "%lld.%06d",
@@ -1121,6 +1151,12 @@ rest_show_noits(mtev_http_rest_closure_t *restc,
       snprintf(buff, sizeof(buff), "%llu",
                (unsigned long long)jctx->total_bytes_read);
       xmlSetProp(node, (xmlChar *)"session_bytes", (xmlChar *)buff);
+      snprintf(buff, sizeof(buff), "%llu",
+               (unsigned long long)jctx->lag_last_ms);
+      xmlSetProp(node, (xmlChar *)"delivery_lag_ms", (xmlChar *)buff);
+      snprintf(buff, sizeof(buff), "%llu",
+               (unsigned long long)jctx->lag_max_ms);
+      xmlSetProp(node, (xmlChar *)"delivery_lag_max_ms", (xmlChar *)buff);
   
       sub_timeval(now, ctx->last_connect, &diff);
       snprintf(buff, sizeof(buff), "%lld.%06d",
@@ -72,6 +72,12 @@ typedef struct jlog_streamer_ctx_t {
   uint64_t total_events;
   uint64_t total_bytes_read;
 
+  /* Delivery lag: how long after the noit wrote each record (the jlog
+   * header time) we read it.  Clock skew between the two clamps to 0. */
+  uint64_t lag_last_ms;
+  uint64_t lag_max_ms;
+  uint64_t lag_total_ms;
+
   void (*push)(stratcon_datastore_op_t, struct sockaddr *, const char *, void *, eventer_t);
 } jlog_streamer_ctx_t;
 
@@ -0,0 +1,653 @@
+/*
+ * Copyright (c) 2017, Circonus, Inc. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above
+ *       copyright notice, this list of conditions and the following
+ *       disclaimer in the documentation and/or other materials provided
+ *       with the distribution.
+ *     * Neither the name Circonus, Inc. nor the names
+ *       of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written
+ *       permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <mtev_defines.h>
+
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+
+#include <mtev_hash.h>
+#include <mtev_log.h>
+
+#include "noit_mtev_bridge.h"
+#include "noit_metric_rollup.h"
+#include "stratcon_rollup.h"
+
+/* Mirrors noit.metric_numeric_rollup_config.  The 5m rollup is built from
+ * samples in (rollup_time - 5m, rollup_time]; every other rollup is the
+ * count weighted combination of the rows of the rollup it depends on with
+ * a rollup_time in [rollup_time, rollup_time + seconds).
+ */
+typedef struct {
+  const char *name;
+  int seconds;
+  int dependent_on;
+} rollup_level_t;
+
+static const rollup_level_t levels[] = {
+  { "5m", 300, -1 },
+  { "20m", 1200, 0 },
+  { "30m", 1800, 0 },
+  { "1hour", 3600, 2 },
+  { "4hour", 14400, 3 },
+  { "1day", 86400, 4 },
+};
+#define NLEVELS (int)(sizeof(levels)/sizeof(*levels))
+/* The database only pairs a sample with one from the previous 10 minutes
+ * when computing counter_dev. */
+#define SEED_HORIZON_MS (600 * 1000)
+
+#define CHECKPOINT_MAGIC 0x31555253 /* SRU1 */
+
+typedef struct rollup_link {
+  struct rollup_link *prev, *next;
+} rollup_link_t;
+
+typedef struct {
+  uint64_t start;   /* bucket start, seconds; 0 when nothing is open */
+  int64_t count;
+  double sum_avg;
+  double sum_counter;
+  mtev_boolean has_counter;
+} rollup_agg_t;
+
+typedef struct {
+  int32_t sid;
+  int storagenode_id;
+  char *name;
+  uint64_t end_ms;  /* end of the open 5m window; 0 when none is open */
+  noit_numeric_rollup_accu accu;
+  mtev_boolean has_last;
+  noit_metric_value_t last;
+  rollup_agg_t agg[NLEVELS];
+  rollup_link_t link[NLEVELS];
+} rollup_stream_t;
+
+/* Streams with an open window or bucket are listed under the time it
+ * closes; the windows are aligned so there are only a few of these. */
+typedef struct {
+  struct {
+    int32_t level;
+    uint32_t pad;
+    uint64_t key;
+  } id;
+  rollup_link_t head;
+} rollup_due_t;
+
+struct stratcon_rollup {
+  pthread_mutex_t lock;
+  char *checkpoint_path;
+  int grace;
+  mtev_hash_table streams;
+  mtev_hash_table dues;
+  stratcon_rollup_row_t *rows;
+  int nrows, rows_allocd;
+  uint64_t samples, late, rows_emitted;
+};
+
+static mtev_log_stream_t rollup_err = NULL;
+static mtev_log_stream_t rollup_deb = NULL;
+
+static rollup_stream_t *
+link_stream(rollup_link_t *l, int level) {
+  return (rollup_stream_t *)((char *)(l - level) -
+                             offsetof(rollup_stream_t, link));
+}
+
+static void
+rollup_unlink(rollup_link_t *l) {
+  if(!l->next) return;
+  l->prev->next = l->next;
+  l->next->prev = l->prev;
+  l->prev = l->next = NULL;
+}
+
+static void
+rollup_due(stratcon_rollup_t *r, rollup_stream_t *s, int level,
+           uint64_t key) {
+  rollup_due_t probe, *due;
+  void *vd;
+
+  memset(&probe.id, 0, sizeof(probe.id));
+  probe.id.level = level;
+  probe.id.key = key;
+  if(mtev_hash_retrieve(&r->dues, (const char *)&probe.id, sizeof(probe.id),
+                        &vd)) {
+    due = vd;
+  }
+  else {
+    due = calloc(1, sizeof(*due));
+    due->id = probe.id;
+    due->head.prev = due->head.next = &due->head;
+    mtev_hash_store(&r->dues, (const char *)&due->id, sizeof(due->id), due);
+  }
+  rollup_unlink(&s->link[level]);
+  s->link[level].next = &due->head;
+  s->link[level].prev = due->head.prev;
+  due->head.prev->next = &s->link[level];
+  due->head.prev = &s->link[level];
+}
+
+static void
+rollup_emit(stratcon_rollup_t *r, rollup_stream_t *s, int level,
+            uint64_t rollup_time, int32_t count, double avg,
+            mtev_boolean has_counter, double counter) {
+  stratcon_rollup_row_t *row;
+  if(r->nrows == r->rows_allocd) {
+    r->rows_allocd = r->rows_allocd ? r->rows_allocd * 2 : 1024;
+    r->rows = realloc(r->rows, r->rows_allocd * sizeof(*r->rows));
+  }
+  row = &r->rows[r->nrows++];
+  row->storagenode_id = s->storagenode_id;
+  row->sid = s->sid;
+  row->name = strdup(s->name);
+  row->rollup = levels[level].name;
+  row->rollup_time = rollup_time;
+  row->count_rows = count;
+  row->avg_value = avg;
+  row->has_counter_dev = has_counter;
+  row->counter_dev = has_counter ? counter : 0;
+  r->rows_emitted++;
+}
+
+static void rollup_feed(stratcon_rollup_t *r, rollup_stream_t *s, int parent,
+                        uint64_t rollup_time, int32_t count, double avg,
+                        mtev_boolean has_counter, double counter);
+
+static void
+rollup_close_agg(stratcon_rollup_t *r, rollup_stream_t *s, int level) {
+  rollup_agg_t *a = &s->agg[level];
+  uint64_t start = a->start;
+  int32_t count = a->count;
+  double avg, counter;
+  mtev_boolean has_counter = a->has_counter;
+
+  rollup_unlink(&s->link[level]);
+  if(!start) return;
+  avg = count ? a->sum_avg / count : 0;
+  counter = count ? a->sum_counter / count : 0;
+  memset(a, 0, sizeof(*a));
+  if(count == 0) return;
+  rollup_emit(r, s, level, start, count, avg, has_counter, counter);
+  rollup_feed(r, s, level, start, count, avg, has_counter, counter);
+}
+
+/* Hand a finished row of one rollup to the rollups built from it. */
+static void
+rollup_feed(stratcon_rollup_t *r, rollup_stream_t *s, int parent,
+            uint64_t rollup_time, int32_t count, double avg,
+            mtev_boolean has_counter, double counter) {
+  int level;
+  for(level = parent + 1; level < NLEVELS; level++) {
+    rollup_agg_t *a = &s->agg[level];
+    uint64_t start;
+    if(levels[level].dependent_on != parent) continue;
+    start = rollup_time - (rollup_time % levels[level].seconds);
+    if(a->start && start < a->start) {
+      r->late++;
+      continue;
+    }
+    if(a->start && start > a->start) rollup_close_agg(r, s, level);
+    if(!a->start) {
+      a->start = start;
+      rollup_due(r, s, level, start + levels[level].seconds);
+    }
+    a->count += count;
+    a->sum_avg += avg * count;
+    if(has_counter) {
+      a->sum_counter += counter * count;
+      a->has_counter = mtev_true;
+    }
+  }
+}
+
+static double
+accu_value(const nnt_multitype *m) {
+  switch(m->type) {
+    case METRIC_INT32: return m->value.v_int32;
+    case METRIC_UINT32: return m->value.v_uint32;
+    case METRIC_INT64: return m->value.v_int64;
+    case METRIC_UINT64: return m->value.v_uint64;
+    case METRIC_DOUBLE: return m->value.v_double;
+    default: ;
+  }
+  return 0;
+}
+
+static void
+rollup_close_window(stratcon_rollup_t *r, rollup_stream_t *s) {
+  uint64_t end_s = s->end_ms / 1000;
+  nnt_multitype *m = &s->accu.accumulated;
+  int32_t count = m->count;
+  mtev_boolean has_counter = (s->accu.crun > 0);
+
+  rollup_unlink(&s->link[0]);
+  if(!s->end_ms) return;
+  s->end_ms = 0;
+  if(count == 0) return;
+  rollup_emit(r, s, 0, end_s, count, accu_value(m),
+              has_counter, m->counter);
+  rollup_feed(r, s, 0, end_s, count, accu_value(m),
+              has_counter, m->counter);
+}
+
+static rollup_stream_t *
+rollup_stream(stratcon_rollup_t *r, int32_t sid, const char *name,
+              mtev_boolean create) {
+  char keybuf[256], *key = keybuf;
+  size_t nlen = strlen(name), klen = sizeof(sid) + nlen;
+  rollup_stream_t *s = NULL;
+  void *vs;
+
+  if(klen > sizeof(keybuf)) key = malloc(klen);
+  memcpy(key, &sid, sizeof(sid));
+  memcpy(key + sizeof(sid), name, nlen);
+  if(mtev_hash_retrieve(&r->streams, key, klen, &vs)) s = vs;
+  else if(create) {
+    char *skey = malloc(klen);
+    memcpy(skey, key, klen);
+    s = calloc(1, sizeof(*s));
+    s->sid = sid;
+    s->name = strdup(name);
+    mtev_hash_store(&r->streams, skey, klen, s);
+  }
+  if(key != keybuf) free(key);
+  return s;
+}
+
+static void
+rollup_add(stratcon_rollup_t *r, rollup_stream_t *s,
+           const noit_metric_value_t *v) {
+  uint64_t end_ms;
+
+  /* samples at exactly a boundary belong to the window ending there */
+  end_ms = v->whence_ms + 299999;
+  end_ms -= end_ms % 300000;
+  if(s->end_ms && end_ms < s->end_ms) {
+    r->late++;
+    return;
+  }
+  if(s->end_ms && end_ms > s->end_ms) rollup_close_window(r, s);
+  if(!s->end_ms) {
+    s->end_ms = end_ms;
+    memset(&s->accu, 0, sizeof(s->accu));
+    /* seed with the previous sample so the first one in the window forms
+     * a counter pair with it, as the database does */
+    if(s->has_last && s->last.whence_ms + SEED_HORIZON_MS > end_ms)
+      s->accu.last_value = s->last;
+    rollup_due(r, s, 0, end_ms / 1000);
+  }
+  noit_metric_rollup_accumulate_numeric(&s->accu, (noit_metric_value_t *)v);
+  s->last = *v;
+  s->has_last = mtev_true;
+  r->samples++;
+}
+
+void
+stratcon_rollup_add(stratcon_rollup_t *r, int storagenode_id, int32_t sid,
+                    const char *name, const noit_metric_value_t *v) {
+  rollup_stream_t *s;
+  if(v->is_null || !IS_METRIC_TYPE_NUMERIC(v->type)) return;
+  pthread_mutex_lock(&r->lock);
+  s = rollup_stream(r, sid, name, mtev_true);
+  s->storagenode_id = storagenode_id;
+  rollup_add(r, s, v);
+  pthread_mutex_unlock(&r->lock);
+}
+
+static mtev_boolean
+rollup_stream_idle(const rollup_stream_t *s) {
+  int level;
+  if(s->end_ms) return mtev_false;
+  for(level = 1; level < NLEVELS; level++)
+    if(s->agg[level].start) return mtev_false;
+  return mtev_true;
+}
+
+static void
+rollup_stream_free(void *vs) {
+  rollup_stream_t *s = vs;
+  free(s->name);
+  free(s);
+}
+
+void
+stratcon_rollup_advance(stratcon_rollup_t *r, uint64_t now_ms) {
+  const char *k;
+  int klen, i, level, ndue, nidle = 0;
+  void *vd;
+  rollup_due_t **due = NULL;
+  rollup_stream_t **idle = NULL;
+  uint64_t now_s = now_ms / 1000;
+
+  pthread_mutex_lock(&r->lock);
+  /* Close in level order: closing a window or bucket feeds the rollups
+   * above it, which may make new (already due) buckets there. */
+  for(level = 0; level < NLEVELS; level++) {
+    mtev_hash_iter iter = MTEV_HASH_ITER_ZERO;
+    ndue = 0;
+    due = realloc(due, (mtev_hash_size(&r->dues) + 1) * sizeof(*due));
+    while(mtev_hash_next(&r->dues, &iter, &k, &klen, &vd)) {
+      rollup_due_t *d = vd;
+      if(d->id.level == level && d->id.key + r->grace <= now_s)
+        due[ndue++] = d;
+    }
+    for(i = 0; i < ndue; i++) {
+      rollup_due_t *d = due[i];
+      while(d->head.next != &d->head) {
+        rollup_stream_t *s = link_stream(d->head.next, level);
+        if(level == 0) rollup_close_window(r, s);
+        else rollup_close_agg(r, s, level);
+        if(rollup_stream_idle(s)) {
+          idle = realloc(idle, (nidle + 1) * sizeof(*idle));
+          idle[nidle++] = s;
+        }
+      }
+      mtev_hash_delete(&r->dues, (const char *)&d->id, sizeof(d->id),
+                       NULL, free);
+    }
+  }
+  free(due);
+
+  /* Streams that have gone quiet leave no state behind. */
+  for(i = 0; i < nidle; i++) {
+    rollup_stream_t *s = idle[i];
+    char keybuf[256], *key = keybuf;
+    size_t nlen = strlen(s->name), klen = sizeof(s->sid) + nlen;
+    if(!rollup_stream_idle(s)) continue;
+    if(klen > sizeof(keybuf)) key = malloc(klen);
+    memcpy(key, &s->sid, sizeof(s->sid));
+    memcpy(key + sizeof(s->sid), s->name, nlen);
+    mtev_hash_delete(&r->streams, key, klen, free, rollup_stream_free);
+    if(key != keybuf) free(key);
+  }
+  free(idle);
+  pthread_mutex_unlock(&r->lock);
+}
+
+int
+stratcon_rollup_take(stratcon_rollup_t *r, int storagenode_id,
+                     stratcon_rollup_row_t **rows) {
+  int i, n = 0, kept = 0;
+  stratcon_rollup_row_t *out = NULL;
+
+  *rows = NULL;
+  pthread_mutex_lock(&r->lock);
+  for(i = 0; i < r->nrows; i++)
+    if(r->rows[i].storagenode_id == storagenode_id) n++;
+  if(n) {
+    out = malloc(n * sizeof(*out));
+    n = 0;
+    for(i = 0; i < r->nrows; i++) {
+      if(r->rows[i].storagenode_id == storagenode_id) out[n++] = r->rows[i];
+      else r->rows[kept++] = r->rows[i];
+    }
+    r->nrows = kept;
+  }
+  pthread_mutex_unlock(&r->lock);
+  *rows = out;
+  return n;
+}
+
+void
+stratcon_rollup_rows_free(stratcon_rollup_row_t *rows, int nrows) {
+  int i;
+  for(i = 0; i < nrows; i++) free(rows[i].name);
+  free(rows);
+}
+
+void
+stratcon_rollup_stats(stratcon_rollup_t *r, uint32_t *streams,
+                      uint64_t *samples, uint64_t *late, uint64_t *rows) {
+  pthread_mutex_lock(&r->lock);
+  if(streams) *streams = mtev_hash_size(&r->streams);
+  if(samples) *samples = r->samples;
+  if(late) *late = r->late;
+  if(rows) *rows = r->rows_emitted;
+  pthread_mutex_unlock(&r->lock);
+}
+
+/* Checkpoint file: a header followed by every stream with open state and
+ * every row not yet taken, in host byte order.  The accumulator is written
+ * as is, so the header records its size and a layout change invalidates
+ * older checkpoints. */
+typedef struct {
+  uint32_t magic;
+  uint32_t accu_size;
+  uint32_t nstreams;
+  uint32_t nrows;
+} checkpoint_hdr_t;
+
+static int
+write_str(FILE *fp, const char *str) {
+  uint32_t len = strlen(str);
+  if(fwrite(&len, sizeof(len), 1, fp) != 1) return -1;
+  if(len && fwrite(str, len, 1, fp) != 1) return -1;
+  return 0;
+}
+
+static char *
+read_str(FILE *fp) {
+  uint32_t len;
+  char *str;
+  if(fread(&len, sizeof(len), 1, fp) != 1 || len > 65536) return NULL;
+  str = malloc(len + 1);
+  if(len && fread(str, len, 1, fp) != 1) {
+    free(str);
+    return NULL;
+  }
+  str[len] = '\0';
+  return str;
+}
+
+int
+stratcon_rollup_checkpoint(stratcon_rollup_t *r) {
+  char tmp[PATH_MAX];
+  FILE *fp;
+  checkpoint_hdr_t hdr;
+  mtev_hash_iter iter = MTEV_HASH_ITER_ZERO;
+  const char *k;
+  int klen, i, level;
+  void *vs;
+
+  if(!r->checkpoint_path) return 0;
+  snprintf(tmp, sizeof(tmp), "%s.tmp", r->checkpoint_path);
+  fp = fopen(tmp, "w");
+  if(!fp) {
+    mtevL(rollup_err, "rollup checkpoint: cannot open %s: %s\n",
+          tmp, strerror(errno));
+    return -1;
+  }
+  pthread_mutex_lock(&r->lock);
+  hdr.magic = CHECKPOINT_MAGIC;
+  hdr.accu_size = sizeof(noit_numeric_rollup_accu);
+  hdr.nstreams = mtev_hash_size(&r->streams);
+  hdr.nrows = r->nrows;
+  if(fwrite(&hdr, sizeof(hdr), 1, fp) != 1) goto bail;
+  while(mtev_hash_next(&r->streams, &iter, &k, &klen, &vs)) {
+    rollup_stream_t *s = vs;
+    if(fwrite(&s->sid, sizeof(s->sid), 1, fp) != 1 ||
+       fwrite(&s->storagenode_id, sizeof(s->storagenode_id), 1, fp) != 1 ||
+       write_str(fp, s->name) ||
+       fwrite(&s->end_ms, sizeof(s->end_ms), 1, fp) != 1 ||
+       fwrite(&s->accu, sizeof(s->accu), 1, fp) != 1 ||
+       fwrite(&s->has_last, sizeof(s->has_last), 1, fp) != 1 ||
+       fwrite(&s->last, sizeof(s->last), 1, fp) != 1)
+      goto bail;
+    for(level = 1; level < NLEVELS; level++)
+      if(fwrite(&s->agg[level], sizeof(s->agg[level]), 1, fp) != 1)
+        goto bail;
+  }
+  for(i = 0; i < r->nrows; i++) {
+    stratcon_rollup_row_t *row = &r->rows[i];
+    for(level = 0; level < NLEVELS; level++)
+      if(row->rollup == levels[level].name) break;
+    if(fwrite(&level, sizeof(level), 1, fp) != 1 ||
+       fwrite(&row->storagenode_id, sizeof(row->storagenode_id), 1, fp) != 1 ||
+       fwrite(&row->sid, sizeof(row->sid), 1, fp) != 1 ||
+       write_str(fp, row->name) ||
+       fwrite(&row->rollup_time, sizeof(row->rollup_time), 1, fp) != 1 ||
+       fwrite(&row->count_rows, sizeof(row->count_rows), 1, fp) != 1 ||
+       fwrite(&row->avg_value, sizeof(row->avg_value), 1, fp) != 1 ||
+       fwrite(&row->has_counter_dev, sizeof(row->has_counter_dev), 1, fp) != 1 ||
+       fwrite(&row->counter_dev, sizeof(row->counter_dev), 1, fp) != 1)
+      goto bail;
+  }
+  pthread_mutex_unlock(&r->lock);
+  if(fflush(fp) || fsync(fileno(fp)) || fclose(fp)) {
+    fp = NULL;
+    goto bail_unlocked;
+  }
+  if(rename(tmp, r->checkpoint_path)) {
+    mtevL(rollup_err, "rollup checkpoint: rename to %s: %s\n",
+          r->checkpoint_path, strerror(errno));
+    unlink(tmp);
+    return -1;
+  }
+  mtevL(rollup_deb, "rollup checkpoint: %u streams, %u rows\n",
+        hdr.nstreams, hdr.nrows);
+  return 0;
+
+ bail:
+  pthread_mutex_unlock(&r->lock);
+ bail_unlocked:
+  mtevL(rollup_err, "rollup checkpoint: write to %s failed: %s\n",
+        tmp, strerror(errno));
+  if(fp) fclose(fp);
+  unlink(tmp);
+  return -1;
+}
+
+static void
+rollup_restore(stratcon_rollup_t *r) {
+  FILE *fp;
+  checkpoint_hdr_t hdr;
+  uint32_t i;
+  int level;
+
+  fp = fopen(r->checkpoint_path, "r");
+  if(!fp) {
+    if(errno != ENOENT)
+      mtevL(rollup_err, "rollup checkpoint: cannot open %s: %s\n",
+            r->checkpoint_path, strerror(errno));
+    return;
+  }
+  if(fread(&hdr, sizeof(hdr), 1, fp) != 1 ||
+     hdr.magic != CHECKPOINT_MAGIC ||
+     hdr.accu_size != sizeof(noit_numeric_rollup_accu)) {
+    mtevL(rollup_err, "rollup checkpoint: %s is not usable, starting empty\n",
+          r->checkpoint_path);
+    fclose(fp);
+    return;
+  }
+  for(i = 0; i < hdr.nstreams; i++) {
+    rollup_stream_t *s;
+    int32_t sid;
+    int storagenode_id;
+    char *name;
+    if(fread(&sid, sizeof(sid), 1, fp) != 1 ||
+       fread(&storagenode_id, sizeof(storagenode_id), 1, fp) != 1 ||
+       (name = read_str(fp)) == NULL) goto truncated;
+    s = rollup_stream(r, sid, name, mtev_true);
+    free(name);
+    s->storagenode_id = storagenode_id;
+    if(fread(&s->end_ms, sizeof(s->end_ms), 1, fp) != 1 ||
+       fread(&s->accu, sizeof(s->accu), 1, fp) != 1 ||
+       fread(&s->has_last, sizeof(s->has_last), 1, fp) != 1 ||
+       fread(&s->last, sizeof(s->last), 1, fp) != 1) goto truncated;
+    if(s->end_ms) rollup_due(r, s, 0, s->end_ms / 1000);
+    for(level = 1; level < NLEVELS; level++) {
+      if(fread(&s->agg[level], sizeof(s->agg[level]), 1, fp) != 1)
+        goto truncated;
+      if(s->agg[level].start)
+        rollup_due(r, s, level, s->agg[level].start + levels[level].seconds);
+    }
+  }
+  for(i = 0; i < hdr.nrows; i++) {
+    stratcon_rollup_row_t row;
+    memset(&row, 0, sizeof(row));
+    if(fread(&level, sizeof(level), 1, fp) != 1 ||
+       level < 0 || level >= NLEVELS ||
+       fread(&row.storagenode_id, sizeof(row.storagenode_id), 1, fp) != 1 ||
+       fread(&row.sid, sizeof(row.sid), 1, fp) != 1 ||
+       (row.name = read_str(fp)) == NULL) goto truncated;
+    row.rollup = levels[level].name;
+    if(fread(&row.rollup_time, sizeof(row.rollup_time), 1, fp) != 1 ||
+       fread(&row.count_rows, sizeof(row.count_rows), 1, fp) != 1 ||
+       fread(&row.avg_value, sizeof(row.avg_value), 1, fp) != 1 ||
+       fread(&row.has_counter_dev, sizeof(row.has_counter_dev), 1, fp) != 1 ||
+       fread(&row.counter_dev, sizeof(row.counter_dev), 1, fp) != 1) {
+      free(row.name);
+      goto truncated;
+    }
+    if(r->nrows == r->rows_allocd) {
+      r->rows_allocd = r->rows_allocd ? r->rows_allocd * 2 : 1024;
+      r->rows = realloc(r->rows, r->rows_allocd * sizeof(*r->rows));
+    }
+    r->rows[r->nrows++] = row;
+  }
+  fclose(fp);
+  mtevL(rollup_deb, "rollup checkpoint: restored %u streams, %u rows\n",
+        hdr.nstreams, hdr.nrows);
+  return;
+
+ truncated:
+  mtevL(rollup_err, "rollup checkpoint: %s is truncated, kept %d streams\n",
+        r->checkpoint_path, mtev_hash_size(&r->streams));
+  fclose(fp);
+}
+
+stratcon_rollup_t *
+stratcon_rollup_alloc(const char *checkpoint_path, int grace_seconds) {
+  stratcon_rollup_t *r;
+
+  if(!rollup_err) rollup_err = mtev_log_stream_find("error/rollup");
+  if(!rollup_deb) rollup_deb = mtev_log_stream_find("debug/rollup");
+  if(!rollup_err) rollup_err = noit_error;
+  if(!rollup_deb) rollup_deb = noit_debug;
+
+  r = calloc(1, sizeof(*r));
+  pthread_mutex_init(&r->lock, NULL);
+  mtev_hash_init(&r->streams);
+  mtev_hash_init(&r->dues);
+  r->grace = grace_seconds;
+  if(checkpoint_path) {
+    r->checkpoint_path = strdup(checkpoint_path);
+    rollup_restore(r);
+  }
+  return r;
+}
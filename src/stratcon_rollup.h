@@ -0,0 +1,92 @@
+/*
+ * Copyright (c) 2017, Circonus, Inc. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above
+ *       copyright notice, this list of conditions and the following
+ *       disclaimer in the documentation and/or other materials provided
+ *       with the distribution.
+ *     * Neither the name Circonus, Inc. nor the names
+ *       of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written
+ *       permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _STRATCON_ROLLUP_H
+#define _STRATCON_ROLLUP_H
+
+#include <mtev_defines.h>
+#include <stdint.h>
+
+#include "noit_metric.h"
+
+/* In-process numeric rollups.
+ *
+ * Numeric samples are folded into per-(sid, metric) windows as they are
+ * ingested and finalized rows for the rollups of
+ * noit.metric_numeric_rollup_config (5m, 20m, 30m, 1hour, 4hour, 1day) are
+ * handed back in bulk for the storage node the stream belongs to.  The
+ * rows carry the same count_rows/avg_value/counter_dev the database
+ * rollup job would compute.  State (open windows and rows not yet taken)
+ * is checkpointed to a file and reloaded on start.
+ */
+
+typedef struct stratcon_rollup stratcon_rollup_t;
+
+typedef struct {
+  int storagenode_id;
+  int32_t sid;
+  char *name;
+  const char *rollup;      /* the rollup name: "5m", "20m", ... */
+  uint64_t rollup_time;    /* seconds since epoch */
+  int32_t count_rows;
+  double avg_value;
+  mtev_boolean has_counter_dev;
+  double counter_dev;
+} stratcon_rollup_row_t;
+
+API_EXPORT(stratcon_rollup_t *)
+  stratcon_rollup_alloc(const char *checkpoint_path, int grace_seconds);
+
+API_EXPORT(void)
+  stratcon_rollup_add(stratcon_rollup_t *r, int storagenode_id, int32_t sid,
+                      const char *name, const noit_metric_value_t *value);
+
+/* Finalize every window that closed more than grace seconds before now. */
+API_EXPORT(void)
+  stratcon_rollup_advance(stratcon_rollup_t *r, uint64_t now_ms);
+
+/* Take the finalized rows for a storage node, the caller frees them with
+ * stratcon_rollup_rows_free.  Returns the number of rows. */
+API_EXPORT(int)
+  stratcon_rollup_take(stratcon_rollup_t *r, int storagenode_id,
+                       stratcon_rollup_row_t **rows);
+
+API_EXPORT(void)
+  stratcon_rollup_rows_free(stratcon_rollup_row_t *rows, int nrows);
+
+API_EXPORT(int)
+  stratcon_rollup_checkpoint(stratcon_rollup_t *r);
+
+API_EXPORT(void)
+  stratcon_rollup_stats(stratcon_rollup_t *r, uint32_t *streams,
+                        uint64_t *samples, uint64_t *late, uint64_t *rows);
+
+#endif
@@ -0,0 +1,127 @@
+-- Copyright (c) 2017, Circonus, Inc.
+-- All rights reserved.
+--
+-- Redistribution and use in source and binary forms, with or without
+-- modification, are permitted provided that the following conditions are
+-- met:
+--
+--     * Redistributions of source code must retain the above copyright
+--       notice, this list of conditions and the following disclaimer.
+--     * Redistributions in binary form must reproduce the above
+--       copyright notice, this list of conditions and the following
+--       disclaimer in the documentation and/or other materials provided
+--       with the distribution.
+--     * Neither the name Circonus, Inc. nor the names of its contributors
+--       may be used to endorse or promote products derived from this
+--       software without specific prior written permission.
+--
+-- THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+-- "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+-- LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+-- A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+-- OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+-- SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+-- LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+-- DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+-- THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+-- (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+-- OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+-- The Lua side of noit_bench -M's lua.* cases.  Each run of a check
+-- performs config.iterations ops of config.case against canned input,
+-- going through the same functions http.lua and resmon.lua use on a
+-- response body, then sets "bench_ops" for noit_bench to count.
+
+module(..., package.seeall)
+
+local http = require 'noit.module.http'
+local resmon = require 'noit.module.resmon'
+
+local METRICS = 50
+local extract_re = '(\\w+)=(\\d+(?:\\.\\d+)?)'
+local extract_body, resmon_json, resmon_xml
+
+local function build_inputs()
+  local lines, services, xml = {}, {}, {}
+  for i = 1, METRICS do
+    lines[#lines + 1] = string.format("metric%02d=%d.%d", i, i * 7, i % 10)
+  end
+  extract_body = table.concat(lines, "\n")
+
+  table.insert(xml, '<ResmonResults>')
+  for s = 1, 5 do
+    local metrics = {}
+    table.insert(xml, string.format(
+      '<ResmonResult module="bench" service="svc%d">' ..
+      '<last_runtime_seconds>0.0%d</last_runtime_seconds><state>OK</state>', s, s))
+    for i = 1, METRICS / 5 do
+      table.insert(xml, string.format(
+        '<metric name="metric%02d" type="L">%d</metric>', i, i * s))
+      table.insert(metrics, string.format(
+        '"metric%02d":{"_type":"L","_value":"%d"}', i, i * s))
+    end
+    table.insert(xml, '</ResmonResult>')
+    table.insert(services, string.format('"svc%d":{%s}', s, table.concat(metrics, ",")))
+  end
+  table.insert(xml, '</ResmonResults>')
+  resmon_xml = table.concat(xml)
+  resmon_json = '{"bench":{' .. table.concat(services, ",") .. '}}'
+end
+
+local cases = {
+  -- http.lua's extract: every match set in one metrics_bulk call
+  ["http.extract"] = function(check)
+    http.extract_metrics(check, extract_re, extract_body, 10000)
+  end,
+  -- the same matches set one check.metric call at a time
+  ["http.extract.single"] = function(check)
+    local exre = mtev.pcre(extract_re)
+    local rv, m, key, value = true, nil, nil, nil
+    while rv and m ~= '' do
+      rv, m, key, value = exre(extract_body, { limit = 10000 })
+      if rv and key ~= nil then check.metric(key, value) end
+    end
+  end,
+  ["resmon.json"] = function(check)
+    resmon.json_to_metrics(check, mtev.parsejson(resmon_json))
+  end,
+  ["resmon.xml"] = function(check)
+    resmon.xml_to_metrics(check, mtev.parsexml(resmon_xml))
+  end,
+  -- what every module does first: read its config
+  ["check.config"] = function(check)
+    local config = check.config
+    return config.case
+  end,
+}
+
+function onload(image)
+  return 0
+end
+
+function init(module)
+  return 0
+end
+
+function config(module, options)
+  return 0
+end
+
+function initiate(module, check)
+  local name = check.config.case
+  local op = cases[name]
+  local iterations = tonumber(check.config.iterations) or 100
+
+  check.bad()
+  check.unavailable()
+  if op == nil then
+    check.status("unknown case " .. tostring(name))
+    return
+  end
+  if extract_body == nil then build_inputs() end
+  for i = 1, iterations do op(check) end
+  check.available()
+  check.good()
+  check.status(name .. "=" .. iterations)
+  check.metric_uint32("bench_ops", iterations)
+end
@@ -3,10 +3,50 @@
 RV=0
 
 run() {
-	$*
-	if [[ $? -ne 0 ]]; then
-		RV=$?
+	"$@"
+	rc=$?
+	if [[ $rc -ne 0 ]]; then
+		echo "FAILED ($rc): $*"
+		RV=$rc
 	fi
 }
 
+# Everything here is built by "make" (src's tests target); a missing
+# binary is a failure, not a skip.
+need() {
+	if [[ ! -x $1 ]]; then
+		echo "FAILED: $1 is not built"
+		RV=1
+		return 1
+	fi
+}
+
+# Conformance tests, TAP on stdout, non-zero exit on any failure
+for t in noit_test_rollup noit_test_guess noit_test_columns; do
+	need ../../src/$t && run ../../src/$t
+done
+
+# noit_bench: cases whose setup checks correctness (METRIC_GUESS against
+# the legacy guesser, batch against scalar rollups, bundle encode/decode)
+# fail outright.  Timings only gate when NOIT_BENCH_BASELINE names a
+# baseline written on this machine ("make bench BENCH_ARGS='-w file'");
+# otherwise a short pass just exercises every case.
+BENCH=../../src/noit_bench
+if need $BENCH; then
+	if [[ -n "$NOIT_BENCH_BASELINE" && -f "$NOIT_BENCH_BASELINE" ]]; then
+		run $BENCH -F ../bench -b "$NOIT_BENCH_BASELINE"
+	else
+		run $BENCH -F ../bench -t 0.01 -r 1
+	fi
+	# module cases, once "make bench" has generated their config
+	MODCONF=../../src/noit_bench_modules.conf
+	if [[ -f $MODCONF ]]; then
+		if [[ -n "$NOIT_BENCH_MODULES_BASELINE" && -f "$NOIT_BENCH_MODULES_BASELINE" ]]; then
+			run $BENCH -F ../bench -M -c $MODCONF -b "$NOIT_BENCH_MODULES_BASELINE"
+		else
+			run $BENCH -F ../bench -M -c $MODCONF -t 0.01 -r 1
+		fi
+	fi
+fi
+
 exit $RV
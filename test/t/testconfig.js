@@ -221,7 +221,18 @@ testconfig.prototype.make_modules_config = function(fd,opts) {
       fs.writeSync(fd, " loader=\"" + opts['modules'][k]['loader'] + "\"");
     if(opts['modules'][k].hasOwnProperty('object'))
       fs.writeSync(fd, " object=\"" + opts['modules'][k]['object'] + "\"");
-    fs.writeSync(fd, " name=\"" + k + "\"/>\n");
+    if(opts['modules'][k].hasOwnProperty('config')) {
+      fs.writeSync(fd, " name=\"" + k + "\">\n");
+      fs.writeSync(fd, "      <config>\n");
+      for (var name in opts['modules'][k]['config']) {
+        fs.writeSync(fd, "        <" + name + ">" + opts['modules'][k]['config'][name] +
+                         "</" + name + ">\n");
+      }
+      fs.writeSync(fd, "      </config>\n");
+      fs.writeSync(fd, "    </module>\n");
+    }
+    else
+      fs.writeSync(fd, " name=\"" + k + "\"/>\n");
   }
   fs.writeSync(fd, "</modules>\n");
 }